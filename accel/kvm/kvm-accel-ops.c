@@ -21,9 +21,83 @@
 #include "sysemu/cpus.h"
 #include "qemu/guest-random.h"
 #include "qapi/error.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 #include "kvm-cpus.h"
 
+/* Window of the halt polling when it grows from zero */
+#define KVM_HALT_POLL_START_NS 10000
+
+/*
+ * Spin for up to cpu->kvm_halt_poll_ns, until the vCPU has something to
+ * do.  The BQL is released meanwhile, so that the thread that wakes us
+ * up can take it; qemu_wait_io_event() then looks at the vCPU again.
+ */
+static void kvm_halt_poll(CPUState *cpu)
+{
+    int64_t start = get_clock();
+
+    qemu_mutex_unlock_iothread();
+    do {
+        if (qatomic_read(&cpu->interrupt_request) ||
+            qatomic_read(&QSIMPLEQ_FIRST(&cpu->work_list)) ||
+            qatomic_read(&cpu->stop) || qatomic_read(&cpu->exit_request)) {
+            break;
+        }
+        cpu_relax();
+    } while (get_clock() - start < cpu->kvm_halt_poll_ns);
+    qemu_mutex_lock_iothread();
+}
+
+/*
+ * Adapt the window like the kernel does: grow it when the vCPU was woken
+ * up soon after the window ended, shrink it when its sleep exceeded the
+ * limit, so that polling is not wasted on long halts.
+ */
+static void kvm_halt_poll_update(CPUState *cpu, int64_t block_ns)
+{
+    int64_t max = kvm_halt_poll_ns();
+
+    if (block_ns <= cpu->kvm_halt_poll_ns) {
+        cpu->kvm_halt_poll_success++;
+    } else {
+        if (cpu->kvm_halt_poll_ns) {
+            cpu->kvm_halt_poll_fail++;
+        }
+        if (block_ns > max) {
+            cpu->kvm_halt_poll_ns /= 2;
+            if (cpu->kvm_halt_poll_ns < KVM_HALT_POLL_START_NS) {
+                cpu->kvm_halt_poll_ns = 0;
+            }
+        } else if (cpu->kvm_halt_poll_ns) {
+            cpu->kvm_halt_poll_ns = MIN(cpu->kvm_halt_poll_ns * 2, max);
+        } else {
+            cpu->kvm_halt_poll_ns = MIN(KVM_HALT_POLL_START_NS, max);
+        }
+    }
+    trace_kvm_halt_poll(cpu->cpu_index, block_ns, cpu->kvm_halt_poll_ns);
+}
+
+static void kvm_wait_io_event(CPUState *cpu)
+{
+    int64_t start;
+
+    /* Only halts in userspace, i.e. without in-kernel irqchip, get here */
+    if (!kvm_halt_poll_ns() || !cpu->halted || !runstate_is_running() ||
+        !cpu_thread_is_idle(cpu)) {
+        qemu_wait_io_event(cpu);
+        return;
+    }
+
+    start = get_clock();
+    if (cpu->kvm_halt_poll_ns) {
+        kvm_halt_poll(cpu);
+    }
+    qemu_wait_io_event(cpu);
+    kvm_halt_poll_update(cpu, get_clock() - start);
+}
+
 static void *kvm_vcpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
@@ -51,7 +125,7 @@ static void *kvm_vcpu_thread_fn(void *arg)
                 cpu_handle_guest_debug(cpu);
             }
         }
-        qemu_wait_io_event(cpu);
+        kvm_wait_io_event(cpu);
     } while (!cpu->unplug || cpu_can_run(cpu));
 
     kvm_destroy_vcpu(cpu);
@@ -36,6 +36,7 @@
 #include "exec/ram_addr.h"
 #include "qemu/event_notifier.h"
 #include "qemu/main-loop.h"
+#include "qemu/thread-context.h"
 #include "trace.h"
 #include "hw/irq.h"
 #include "qapi/visitor.h"
@@ -44,6 +45,7 @@
 #include "sysemu/reset.h"
 #include "qemu/guest-random.h"
 #include "sysemu/hw_accel.h"
+#include "sysemu/dirtylimit.h"
 #include "kvm-cpus.h"
 
 #include "hw/boards.h"
@@ -149,6 +151,7 @@ struct KVMState
     uint64_t kvm_dirty_ring_bytes;  /* Size of the per-vcpu dirty ring */
     uint32_t kvm_dirty_ring_size;   /* Number of dirty GFNs per ring */
     struct KVMDirtyRingReaper reaper;
+    uint32_t halt_poll_ns;          /* Limit of the halt polling windows */
 };
 
 KVMState *kvm_state;
@@ -245,6 +248,21 @@ int kvm_get_max_memslots(void)
     return s->nr_slots;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->kvm_dirty_ring_size;
+}
+
+uint32_t kvm_dirty_ring_size(void)
+{
+    return kvm_state ? kvm_state->kvm_dirty_ring_size : 0;
+}
+
+uint32_t kvm_halt_poll_ns(void)
+{
+    return kvm_state->halt_poll_ns;
+}
+
 /* Called with KVMMemoryListener.slots_lock held */
 static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
 {
@@ -286,19 +304,59 @@ static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
     abort();
 }
 
+/*
+ * Index in kml->sorted_slots of the first slot that starts at or after
+ * @start_addr.  Called with KVMMemoryListener.slots_lock held.
+ */
+static int kvm_slot_index_find(KVMMemoryListener *kml, hwaddr start_addr)
+{
+    int lo = 0, hi = kml->nr_used_slots;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (kml->sorted_slots[mid]->start_addr < start_addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void kvm_slot_index_insert(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    int i = kvm_slot_index_find(kml, mem->start_addr);
+
+    memmove(&kml->sorted_slots[i + 1], &kml->sorted_slots[i],
+            (kml->nr_used_slots - i) * sizeof(kml->sorted_slots[0]));
+    kml->sorted_slots[i] = mem;
+    kml->nr_used_slots++;
+}
+
+static void kvm_slot_index_remove(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    int i = kvm_slot_index_find(kml, mem->start_addr);
+
+    assert(i < kml->nr_used_slots && kml->sorted_slots[i] == mem);
+    kml->nr_used_slots--;
+    memmove(&kml->sorted_slots[i], &kml->sorted_slots[i + 1],
+            (kml->nr_used_slots - i) * sizeof(kml->sorted_slots[0]));
+}
+
 static KVMSlot *kvm_lookup_matching_slot(KVMMemoryListener *kml,
                                          hwaddr start_addr,
                                          hwaddr size)
 {
-    KVMState *s = kvm_state;
-    int i;
-
-    for (i = 0; i < s->nr_slots; i++) {
-        KVMSlot *mem = &kml->slots[i];
+    int i = kvm_slot_index_find(kml, start_addr);
+    KVMSlot *mem;
 
-        if (start_addr == mem->start_addr && size == mem->memory_size) {
-            return mem;
-        }
+    if (i == kml->nr_used_slots) {
+        return NULL;
+    }
+    mem = kml->sorted_slots[i];
+    if (start_addr == mem->start_addr && size == mem->memory_size) {
+        return mem;
     }
 
     return NULL;
@@ -743,22 +801,67 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
         count++;
     }
     cpu->kvm_fetch_index = fetch;
+    cpu->dirty_pages += count;
 
     return count;
 }
 
-/* Must be with slots_lock held */
-static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+/*
+ * The reaper reaps the ring of a vCPU when it should be half full, from
+ * the rate at which the vCPU filled it since the last reap, but at most
+ * once per KVM_DIRTY_RING_REAP_MIN_MS and at least once per
+ * KVM_DIRTY_RING_REAP_MAX_MS.
+ */
+#define KVM_DIRTY_RING_REAP_MIN_MS 10
+#define KVM_DIRTY_RING_REAP_MAX_MS 1000
+
+static uint32_t kvm_dirty_ring_reap_cpu(KVMState *s, CPUState *cpu,
+                                        int64_t now)
+{
+    uint32_t count = kvm_dirty_ring_reap_one(s, cpu);
+    int64_t elapsed = now - cpu->kvm_reap_time;
+    int64_t delay = KVM_DIRTY_RING_REAP_MAX_MS * SCALE_MS;
+    uint64_t rate;
+
+    if (cpu->kvm_reap_time && elapsed > 0) {
+        rate = muldiv64(count, NANOSECONDS_PER_SECOND, elapsed);
+        cpu->kvm_dirty_rate = (cpu->kvm_dirty_rate + rate) / 2;
+    }
+    if (cpu->kvm_dirty_rate) {
+        delay = MIN(delay, muldiv64(s->kvm_dirty_ring_size / 2,
+                                    NANOSECONDS_PER_SECOND,
+                                    cpu->kvm_dirty_rate));
+    }
+    delay = MAX(delay, KVM_DIRTY_RING_REAP_MIN_MS * SCALE_MS);
+
+    cpu->kvm_reap_time = now;
+    cpu->kvm_reap_deadline = now + delay;
+
+    return count;
+}
+
+/*
+ * Must be with slots_lock held.  Reaps the ring of @cpu, or of all vCPUs
+ * if @cpu is NULL.  When @due is set, only reaps the rings of the vCPUs
+ * whose deadline passed.
+ */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState *cpu,
+                                           bool due)
 {
     int ret;
-    CPUState *cpu;
     uint64_t total = 0;
     int64_t stamp;
 
     stamp = get_clock();
 
-    CPU_FOREACH(cpu) {
-        total += kvm_dirty_ring_reap_one(s, cpu);
+    if (cpu) {
+        total = kvm_dirty_ring_reap_cpu(s, cpu, stamp);
+    } else {
+        CPU_FOREACH(cpu) {
+            if (!due || stamp >= cpu->kvm_reap_deadline) {
+                total += kvm_dirty_ring_reap_cpu(s, cpu, stamp);
+            }
+        }
     }
 
     if (total) {
@@ -779,7 +882,7 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
  * Currently for simplicity, we must hold BQL before calling this.  We can
  * consider to drop the BQL if we're clear with all the race conditions.
  */
-static uint64_t kvm_dirty_ring_reap(KVMState *s)
+static uint64_t kvm_dirty_ring_reap(KVMState *s, CPUState *cpu, bool due)
 {
     uint64_t total;
 
@@ -799,7 +902,7 @@ static uint64_t kvm_dirty_ring_reap(KVMState *s)
      *     reset below.
      */
     kvm_slots_lock();
-    total = kvm_dirty_ring_reap_locked(s);
+    total = kvm_dirty_ring_reap_locked(s, cpu, due);
     kvm_slots_unlock();
 
     return total;
@@ -846,7 +949,7 @@ static void kvm_dirty_ring_flush(void)
      * vcpus out in a synchronous way.
      */
     kvm_cpu_synchronize_kick_all();
-    kvm_dirty_ring_reap(kvm_state);
+    kvm_dirty_ring_reap(kvm_state, NULL, false);
     trace_kvm_dirty_ring_flush(1);
 }
 
@@ -1331,6 +1434,80 @@ void kvm_set_max_memslot_size(hwaddr max_slot_size)
     kvm_max_slot_size = max_slot_size;
 }
 
+/* Called with KVMMemoryListener.slots_lock held */
+static void kvm_slot_unregister(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    int err;
+
+    if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
+        /*
+         * NOTE: We should be aware of the fact that here we're only
+         * doing a best effort to sync dirty bits.  No matter whether
+         * we're using dirty log or dirty ring, we ignored two facts:
+         *
+         * (1) dirty bits can reside in hardware buffers (PML)
+         *
+         * (2) after we collected dirty bits here, pages can be dirtied
+         * again before we do the final KVM_SET_USER_MEMORY_REGION to
+         * remove the slot.
+         *
+         * Not easy.  Let's cross the fingers until it's fixed.
+         */
+        if (kvm_state->kvm_dirty_ring_size) {
+            kvm_dirty_ring_reap_locked(kvm_state, NULL, false);
+        } else {
+            kvm_slot_get_dirty_log(kvm_state, mem);
+        }
+        kvm_slot_sync_dirty_pages(mem);
+    }
+
+    /* unregister the slot */
+    kvm_slot_index_remove(kml, mem);
+    g_free(mem->dirty_bmap);
+    mem->dirty_bmap = NULL;
+    mem->memory_size = 0;
+    mem->flags = 0;
+    err = kvm_set_user_memory_region(kml, mem, false);
+    if (err) {
+        fprintf(stderr, "%s: error unregistering slot: %s\n",
+                __func__, strerror(-err));
+        abort();
+    }
+}
+
+/* Remove the slots whose removal was deferred */
+static void kvm_slots_flush_deferred_del(KVMMemoryListener *kml)
+{
+    int i;
+
+    for (i = 0; i < kml->nr_deferred_del; i++) {
+        kvm_slot_unregister(kml, kml->deferred_del[i]);
+    }
+    kml->nr_deferred_del = 0;
+}
+
+/*
+ * Take back a slot whose removal was deferred, if it maps the same
+ * memory in the same way, so that KVM can keep it.
+ */
+static KVMSlot *kvm_slot_revive(KVMMemoryListener *kml, hwaddr start_addr,
+                                hwaddr size, void *ram, int flags)
+{
+    int i;
+
+    for (i = 0; i < kml->nr_deferred_del; i++) {
+        KVMSlot *mem = kml->deferred_del[i];
+
+        if (mem->start_addr == start_addr && mem->memory_size == size &&
+            mem->ram == ram && mem->flags == flags) {
+            kml->deferred_del[i] = kml->deferred_del[--kml->nr_deferred_del];
+            trace_kvm_slot_revive(mem->slot, start_addr, size);
+            return mem;
+        }
+    }
+    return NULL;
+}
+
 static void kvm_set_phys_mem(KVMMemoryListener *kml,
                              MemoryRegionSection *section, bool add)
 {
@@ -1374,39 +1551,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             if (!mem) {
                 goto out;
             }
-            if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-                /*
-                 * NOTE: We should be aware of the fact that here we're only
-                 * doing a best effort to sync dirty bits.  No matter whether
-                 * we're using dirty log or dirty ring, we ignored two facts:
-                 *
-                 * (1) dirty bits can reside in hardware buffers (PML)
-                 *
-                 * (2) after we collected dirty bits here, pages can be dirtied
-                 * again before we do the final KVM_SET_USER_MEMORY_REGION to
-                 * remove the slot.
-                 *
-                 * Not easy.  Let's cross the fingers until it's fixed.
-                 */
-                if (kvm_state->kvm_dirty_ring_size) {
-                    kvm_dirty_ring_reap_locked(kvm_state);
-                } else {
-                    kvm_slot_get_dirty_log(kvm_state, mem);
-                }
-                kvm_slot_sync_dirty_pages(mem);
-            }
-
-            /* unregister the slot */
-            g_free(mem->dirty_bmap);
-            mem->dirty_bmap = NULL;
-            mem->memory_size = 0;
-            mem->flags = 0;
-            err = kvm_set_user_memory_region(kml, mem, false);
-            if (err) {
-                fprintf(stderr, "%s: error unregistering slot: %s\n",
-                        __func__, strerror(-err));
-                abort();
-            }
+            /* kvm_region_commit() or the next kvm_alloc_slot() removes it */
+            kml->deferred_del[kml->nr_deferred_del++] = mem;
             start_addr += slot_size;
             size -= slot_size;
         } while (size);
@@ -1416,6 +1562,13 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     /* register the new slot */
     do {
         slot_size = MIN(kvm_max_slot_size, size);
+        mem = kvm_slot_revive(kml, start_addr, slot_size, ram,
+                              kvm_mem_flags(mr));
+        if (mem) {
+            goto next;
+        }
+        /* The new slot may overlap the ones that are going away */
+        kvm_slots_flush_deferred_del(kml);
         mem = kvm_alloc_slot(kml);
         mem->as_id = kml->as_id;
         mem->memory_size = slot_size;
@@ -1430,6 +1583,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                     strerror(-err));
             abort();
         }
+        kvm_slot_index_insert(kml, mem);
+next:
         start_addr += slot_size;
         ram_start_offset += slot_size;
         ram += slot_size;
@@ -1440,10 +1595,25 @@ out:
     kvm_slots_unlock();
 }
 
+/* Time in nanoseconds until the ring of a vCPU must be reaped */
+static int64_t kvm_dirty_ring_reaper_delay(void)
+{
+    int64_t now = get_clock();
+    int64_t deadline = now + KVM_DIRTY_RING_REAP_MAX_MS * SCALE_MS;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        deadline = MIN(deadline, cpu->kvm_reap_deadline);
+    }
+
+    return MAX(deadline - now, KVM_DIRTY_RING_REAP_MIN_MS * SCALE_MS);
+}
+
 static void *kvm_dirty_ring_reaper_thread(void *data)
 {
     KVMState *s = data;
     struct KVMDirtyRingReaper *r = &s->reaper;
+    int64_t delay = KVM_DIRTY_RING_REAP_MAX_MS * SCALE_MS;
 
     rcu_register_thread();
 
@@ -1451,17 +1621,15 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
 
     while (true) {
         r->reaper_state = KVM_DIRTY_RING_REAPER_WAIT;
-        trace_kvm_dirty_ring_reaper("wait");
-        /*
-         * TODO: provide a smarter timeout rather than a constant?
-         */
-        sleep(1);
+        trace_kvm_dirty_ring_reaper_wait(delay / SCALE_MS);
+        g_usleep(delay / SCALE_US);
 
         trace_kvm_dirty_ring_reaper("wakeup");
         r->reaper_state = KVM_DIRTY_RING_REAPER_REAPING;
 
         qemu_mutex_lock_iothread();
-        kvm_dirty_ring_reap(s);
+        kvm_dirty_ring_reap(s, NULL, true);
+        delay = kvm_dirty_ring_reaper_delay();
         qemu_mutex_unlock_iothread();
 
         r->reaper_iteration++;
@@ -1478,9 +1646,9 @@ static int kvm_dirty_ring_reaper_init(KVMState *s)
 {
     struct KVMDirtyRingReaper *r = &s->reaper;
 
-    qemu_thread_create(&r->reaper_thr, "kvm-reaper",
-                       kvm_dirty_ring_reaper_thread,
-                       s, QEMU_THREAD_JOINABLE);
+    thread_context_create_thread(THREAD_GROUP_DIRTY_RING_REAPER,
+                                 &r->reaper_thr, "kvm-reaper",
+                                 kvm_dirty_ring_reaper_thread, s);
 
     return 0;
 }
@@ -1503,6 +1671,16 @@ static void kvm_region_del(MemoryListener *listener,
     memory_region_unref(section->mr);
 }
 
+static void kvm_region_commit(MemoryListener *listener)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener,
+                                          listener);
+
+    kvm_slots_lock();
+    kvm_slots_flush_deferred_del(kml);
+    kvm_slots_unlock();
+}
+
 static void kvm_log_sync(MemoryListener *listener,
                          MemoryRegionSection *section)
 {
@@ -1638,6 +1816,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     int i;
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
+    kml->sorted_slots = g_new(KVMSlot *, s->nr_slots);
+    kml->deferred_del = g_new(KVMSlot *, s->nr_slots);
     kml->as_id = as_id;
 
     for (i = 0; i < s->nr_slots; i++) {
@@ -1646,6 +1826,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->listener.region_add = kvm_region_add;
     kml->listener.region_del = kvm_region_del;
+    kml->listener.commit = kvm_region_commit;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.priority = 10;
@@ -2474,6 +2655,23 @@ static int kvm_init(MachineState *ms)
         }
     }
 
+    /*
+     * halt-poll-ns applies to the vCPUs that halt in the kernel, and to
+     * the ones that halt in userspace without an in-kernel irqchip.
+     */
+    if (s->halt_poll_ns) {
+        if (kvm_vm_check_extension(s, KVM_CAP_HALT_POLL)) {
+            ret = kvm_vm_enable_cap(s, KVM_CAP_HALT_POLL, 0, s->halt_poll_ns);
+            if (ret) {
+                warn_report("Setting the KVM halt polling time failed: %s",
+                            strerror(-ret));
+            }
+        } else if (s->kernel_irqchip_allowed) {
+            warn_report("KVM does not support setting the halt polling time, "
+                        "halt-poll-ns only applies to userspace halts");
+        }
+    }
+
     /*
      * KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 is not needed when dirty ring is
      * enabled.  More importantly, KVM_DIRTY_LOG_INITIALLY_SET will assume no
@@ -2915,8 +3113,9 @@ int kvm_cpu_exec(CPUState *cpu)
              */
             trace_kvm_dirty_ring_full(cpu->cpu_index);
             qemu_mutex_lock_iothread();
-            kvm_dirty_ring_reap(kvm_state);
+            kvm_dirty_ring_reap(kvm_state, cpu, false);
             qemu_mutex_unlock_iothread();
+            dirtylimit_vcpu_execute(cpu);
             ret = 0;
             break;
         case KVM_EXIT_SYSTEM_EVENT:
@@ -3597,6 +3796,34 @@ static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
     s->kvm_dirty_ring_size = value;
 }
 
+static void kvm_get_halt_poll_ns(Object *obj, Visitor *v,
+                                 const char *name, void *opaque,
+                                 Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->halt_poll_ns;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_halt_poll_ns(Object *obj, Visitor *v,
+                                 const char *name, void *opaque,
+                                 Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (s->fd != -1) {
+        error_setg(errp, "Cannot set properties after the accelerator has been initialized");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    s->halt_poll_ns = value;
+}
+
 static void kvm_accel_instance_init(Object *obj)
 {
     KVMState *s = KVM_STATE(obj);
@@ -3635,6 +3862,13 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
         NULL, NULL);
     object_class_property_set_description(oc, "dirty-ring-size",
         "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
+
+    object_class_property_add(oc, "halt-poll-ns", "uint32",
+        kvm_get_halt_poll_ns, kvm_set_halt_poll_ns,
+        NULL, NULL);
+    object_class_property_set_description(oc, "halt-poll-ns",
+        "Maximum time a halted vCPU polls for wakeups before sleeping "
+        "(default: 0, i.e. use the kernel setting)");
 }
 
 static const TypeInfo kvm_accel_type = {
@@ -242,6 +242,21 @@ static void cpu_exec_exit(CPUState *cpu)
     }
 }
 
+/*
+ * tb_flush() does not clear the jump caches of the vCPUs: each vCPU
+ * clears its own before looking up a TB, so that they do it in parallel
+ * rather than one after the other while the flush stops them all.
+ */
+static inline void cpu_tb_jmp_cache_flush_check(CPUState *cpu)
+{
+    unsigned tb_flush_count = qatomic_read(&tb_ctx.tb_flush_count);
+
+    if (unlikely(cpu->tb_jmp_cache_flush_count != tb_flush_count)) {
+        cpu_tb_jmp_cache_clear(cpu);
+        cpu->tb_jmp_cache_flush_count = tb_flush_count;
+    }
+}
+
 void cpu_exec_step_atomic(CPUState *cpu)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
@@ -257,6 +272,7 @@ void cpu_exec_step_atomic(CPUState *cpu)
         g_assert(!cpu->running);
         cpu->running = true;
 
+        cpu_tb_jmp_cache_flush_check(cpu);
         cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
         tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
 
@@ -727,6 +743,7 @@ int cpu_exec(CPUState *cpu)
 
     rcu_read_lock();
 
+    cpu_tb_jmp_cache_flush_check(cpu);
     cpu_exec_enter(cpu);
 
     /* Calculate difference between guest clock and host clock.
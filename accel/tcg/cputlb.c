@@ -237,7 +237,7 @@ static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
     desc->large_page_mask = -1;
     desc->vindex = 0;
     memset(fast->table, -1, sizeof_tlb(fast));
-    memset(desc->vtable, -1, sizeof(desc->vtable));
+    memset(desc->vtable, -1, tcg_victim_tlb_size * sizeof(CPUTLBEntry));
 }
 
 static void tlb_flush_one_mmuidx_locked(CPUArchState *env, int mmu_idx,
@@ -259,6 +259,8 @@ static void tlb_mmu_init(CPUTLBDesc *desc, CPUTLBDescFast *fast, int64_t now)
     fast->mask = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
     fast->table = g_new(CPUTLBEntry, n_entries);
     desc->iotlb = g_new(CPUIOTLBEntry, n_entries);
+    desc->vtable = g_new(CPUTLBEntry, tcg_victim_tlb_size);
+    desc->viotlb = g_new(CPUIOTLBEntry, tcg_victim_tlb_size);
     tlb_mmu_flush_locked(desc, fast);
 }
 
@@ -283,6 +285,10 @@ void tlb_init(CPUState *cpu)
     /* All tlbs are initialized flushed. */
     env_tlb(env)->c.dirty = 0;
 
+    if (tcg_dirty_ring_size) {
+        env_tlb(env)->c.dirty_ring = g_new(ram_addr_t, tcg_dirty_ring_size);
+    }
+
     for (i = 0; i < NB_MMU_MODES; i++) {
         tlb_mmu_init(&env_tlb(env)->d[i], &env_tlb(env)->f[i], now);
     }
@@ -294,12 +300,15 @@ void tlb_destroy(CPUState *cpu)
     int i;
 
     qemu_spin_destroy(&env_tlb(env)->c.lock);
+    g_free(env_tlb(env)->c.dirty_ring);
     for (i = 0; i < NB_MMU_MODES; i++) {
         CPUTLBDesc *desc = &env_tlb(env)->d[i];
         CPUTLBDescFast *fast = &env_tlb(env)->f[i];
 
         g_free(fast->table);
         g_free(desc->iotlb);
+        g_free(desc->vtable);
+        g_free(desc->viotlb);
     }
 }
 
@@ -339,6 +348,21 @@ void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
     *pelide = elide;
 }
 
+void tlb_victim_counts(size_t *phit, size_t *pmiss)
+{
+    CPUState *cpu;
+    size_t hit = 0, miss = 0;
+
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        hit += qatomic_read(&env_tlb(env)->c.victim_hit_count);
+        miss += qatomic_read(&env_tlb(env)->c.victim_miss_count);
+    }
+    *phit = hit;
+    *pmiss = miss;
+}
+
 static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
@@ -480,7 +504,7 @@ static void tlb_flush_vtlb_page_mask_locked(CPUArchState *env, int mmu_idx,
     int k;
 
     assert_cpu_is_self(env_cpu(env));
-    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+    for (k = 0; k < tcg_victim_tlb_size; k++) {
         if (tlb_flush_entry_mask_locked(&d->vtable[k], page, mask)) {
             tlb_n_used_entries_dec(env, mmu_idx);
         }
@@ -1021,7 +1045,7 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                          start1, length);
         }
 
-        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        for (i = 0; i < tcg_victim_tlb_size; i++) {
             tlb_reset_dirty_range_locked(&env_tlb(env)->d[mmu_idx].vtable[i],
                                          start1, length);
         }
@@ -1055,7 +1079,7 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        for (k = 0; k < tcg_victim_tlb_size; k++) {
             tlb_set_dirty1_locked(&env_tlb(env)->d[mmu_idx].vtable[k], vaddr);
         }
     }
@@ -1205,7 +1229,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
      * different page; otherwise just overwrite the stale data.
      */
     if (!tlb_hit_page_anyprot(te, vaddr_page) && !tlb_entry_is_empty(te)) {
-        unsigned vidx = desc->vindex++ % CPU_VTLB_SIZE;
+        unsigned vidx = desc->vindex++ % tcg_victim_tlb_size;
         CPUTLBEntry *tv = &desc->vtable[vidx];
 
         /* Evict the old entry into the victim tlb.  */
@@ -1352,7 +1376,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         cpu_io_recompile(cpu, retaddr);
     }
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
@@ -1413,7 +1437,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
      */
     save_iotlb_data(cpu, iotlbentry->addr, section, mr_offset);
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
@@ -1450,7 +1474,7 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
     size_t vidx;
 
     assert_cpu_is_self(env_cpu(env));
-    for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
+    for (vidx = 0; vidx < tcg_victim_tlb_size; ++vidx) {
         CPUTLBEntry *vtlb = &env_tlb(env)->d[mmu_idx].vtable[vidx];
         target_ulong cmp;
 
@@ -1474,9 +1498,13 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
             CPUIOTLBEntry tmpio, *io = &env_tlb(env)->d[mmu_idx].iotlb[index];
             CPUIOTLBEntry *vio = &env_tlb(env)->d[mmu_idx].viotlb[vidx];
             tmpio = *io; *io = *vio; *vio = tmpio;
+            qatomic_set(&env_tlb(env)->c.victim_hit_count,
+                        env_tlb(env)->c.victim_hit_count + 1);
             return true;
         }
     }
+    qatomic_set(&env_tlb(env)->c.victim_miss_count,
+                env_tlb(env)->c.victim_miss_count + 1);
     return false;
 }
 
@@ -1540,10 +1568,76 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
     return get_page_addr_code_hostp(env, addr, NULL);
 }
 
+/*
+ * With dirty-ring-size, log the page at @ram_addr for the migration
+ * client in the ring of @cpu, rather than setting its bit in the shared
+ * bitmap with an atomic operation on each first write.
+ *
+ * Returns false when the page must go to the bitmap: the migration
+ * isn't tracking dirty pages, or the ring is full.
+ */
+static bool tlb_dirty_ring_push(CPUState *cpu, ram_addr_t ram_addr)
+{
+    CPUTLBCommon *c = &env_tlb(cpu->env_ptr)->c;
+    uint32_t head = c->dirty_ring_head;
+
+    if (!c->dirty_ring || !global_dirty_tracking ||
+        head - qatomic_load_acquire(&c->dirty_ring_tail) ==
+        tcg_dirty_ring_size) {
+        return false;
+    }
+
+    c->dirty_ring[head & (tcg_dirty_ring_size - 1)] =
+        ram_addr & TARGET_PAGE_MASK;
+    /* Pairs with the load_acquire in tlb_dirty_ring_reap */
+    qatomic_store_release(&c->dirty_ring_head, head + 1);
+    return true;
+}
+
+/*
+ * Set the bits of the pages in the dirty rings in the bitmap of the
+ * migration client, as memory_global_dirty_log_sync() does for KVM's,
+ * then arm TLB_NOTDIRTY again on all the RAM entries of each vCPU, in
+ * one pass, so that the next writes are logged.  The vCPUs keep
+ * running: the pages they log meanwhile are set by the next reap.
+ *
+ * Called with the iothread lock, so there's a single reaper.
+ */
+void tlb_dirty_ring_reap(void)
+{
+    CPUState *cpu;
+
+    if (!tcg_dirty_ring_size) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        CPUTLBCommon *c = &env_tlb(cpu->env_ptr)->c;
+        uint32_t head, tail;
+
+        if (!c->dirty_ring) {
+            continue;
+        }
+        head = qatomic_load_acquire(&c->dirty_ring_head);
+        for (tail = c->dirty_ring_tail; tail != head; tail++) {
+            cpu_physical_memory_set_dirty_range(
+                c->dirty_ring[tail & (tcg_dirty_ring_size - 1)],
+                TARGET_PAGE_SIZE, 1 << DIRTY_MEMORY_MIGRATION);
+        }
+        trace_tlb_dirty_ring_reap(cpu->cpu_index, head - c->dirty_ring_tail);
+        /* The vCPU can reuse the entries now */
+        qatomic_store_release(&c->dirty_ring_tail, head);
+        if (global_dirty_tracking) {
+            tlb_reset_dirty(cpu, 0, (ram_addr_t)-1);
+        }
+    }
+}
+
 static void notdirty_write(CPUState *cpu, vaddr mem_vaddr, unsigned size,
                            CPUIOTLBEntry *iotlbentry, uintptr_t retaddr)
 {
     ram_addr_t ram_addr = mem_vaddr + iotlbentry->addr;
+    bool in_ring;
 
     trace_memory_notdirty_write_access(mem_vaddr, ram_addr, size);
 
@@ -1556,12 +1650,19 @@ static void notdirty_write(CPUState *cpu, vaddr mem_vaddr, unsigned size,
 
     /*
      * Set both VGA and migration bits for simplicity and to remove
-     * the notdirty callback faster.
+     * the notdirty callback faster.  A page in the dirty ring counts
+     * as dirty for migration already.
      */
-    cpu_physical_memory_set_dirty_range(ram_addr, size, DIRTY_CLIENTS_NOCODE);
+    in_ring = tlb_dirty_ring_push(cpu, ram_addr);
+    cpu_physical_memory_set_dirty_range(ram_addr, size,
+        in_ring ? DIRTY_CLIENTS_NOCODE & ~(1 << DIRTY_MEMORY_MIGRATION)
+                : DIRTY_CLIENTS_NOCODE);
 
     /* We remove the notdirty callback only if the code has been flushed. */
-    if (!cpu_physical_memory_is_clean(ram_addr)) {
+    if (in_ring ?
+        cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_VGA) &&
+        cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE) :
+        !cpu_physical_memory_is_clean(ram_addr)) {
         trace_memory_notdirty_set_dirty(mem_vaddr);
         tlb_set_dirty(cpu, mem_vaddr);
     }
@@ -19,4 +19,10 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 void page_init(void);
 void tb_htable_init(void);
 
+/* Entries of the per-vCPU dirty rings, 0 when they are not used */
+extern uint32_t tcg_dirty_ring_size;
+
+/* Entries of the fully associative victim tlb of each MMU mode */
+extern uint32_t tcg_victim_tlb_size;
+
 #endif /* ACCEL_TCG_INTERNAL_H */
@@ -92,7 +92,8 @@
 /* Access to the various translations structures need to be serialised via locks
  * for consistency.
  * In user-mode emulation access to the memory related structures are protected
- * with mmap_lock.
+ * with mmap_lock.  linux-user only takes it briefly when changing the guest
+ * address space, see linux-user/mmap.c.
  * In !user-mode we use per-page locks.
  */
 #ifdef CONFIG_SOFTMMU
@@ -906,7 +907,7 @@ static bool tb_cmp(const void *ap, const void *bp)
 
 void tb_htable_init(void)
 {
-    unsigned int mode = QHT_MODE_AUTO_RESIZE;
+    unsigned int mode = QHT_MODE_AUTO_RESIZE | QHT_MODE_NUMA_INTERLEAVE;
 
     qht_init(&tb_ctx.htable, tb_cmp, CODE_GEN_HTABLE_SIZE, mode);
 }
@@ -989,10 +990,10 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
                tcg_code_size(), nb_tbs, nb_tbs > 0 ? host_size / nb_tbs : 0);
     }
 
-    CPU_FOREACH(cpu) {
-        cpu_tb_jmp_cache_clear(cpu);
-    }
-
+    /*
+     * The vCPUs clear their jump cache when they see the new
+     * tb_flush_count, see cpu_tb_jmp_cache_flush_check().
+     */
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
@@ -2093,6 +2094,7 @@ void dump_exec_info(void)
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
+    size_t victim_hit, victim_miss;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
     nb_tbs = tst.nb_tbs;
@@ -2134,6 +2136,9 @@ void dump_exec_info(void)
     qemu_printf("TLB full flushes    %zu\n", flush_full);
     qemu_printf("TLB partial flushes %zu\n", flush_part);
     qemu_printf("TLB elided flushes  %zu\n", flush_elide);
+    tlb_victim_counts(&victim_hit, &victim_miss);
+    qemu_printf("victim TLB hits     %zu\n", victim_hit);
+    qemu_printf("victim TLB misses   %zu\n", victim_miss);
     tcg_dump_info();
 }
 
@@ -2263,6 +2268,10 @@ void page_dump(FILE *f)
     walk_memory_regions(f, dump_region);
 }
 
+/*
+ * This does not need mmap_lock: the levels of l1_map are read with
+ * qatomic_rcu_read() and never freed, and the flags are a single word.
+ */
 int page_get_flags(target_ulong address)
 {
     PageDesc *p;
@@ -2271,7 +2280,7 @@ int page_get_flags(target_ulong address)
     if (!p) {
         return 0;
     }
-    return p->flags;
+    return qatomic_read(&p->flags);
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -21,6 +21,7 @@
 #include "qemu/mmap-alloc.h"
 
 #ifdef CONFIG_NUMA
+#include <numa.h>
 #include <numaif.h>
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_DEFAULT != MPOL_DEFAULT);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_PREFERRED != MPOL_PREFERRED);
@@ -203,6 +204,54 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+/*
+ * The host CPUs of the nodes that the memory of @backend is bound to, or
+ * NULL if it is not bound.
+ */
+static unsigned long *host_memory_backend_host_cpus(HostMemoryBackend *backend,
+                                                    unsigned long *nbits)
+{
+#ifdef CONFIG_NUMA
+    unsigned long *host_cpus;
+    struct bitmask *node_cpus;
+    long node, cpu;
+
+    *nbits = 0;
+    if (backend->policy == MPOL_DEFAULT ||
+        bitmap_empty(backend->host_nodes, MAX_NODES) ||
+        numa_available() < 0) {
+        return NULL;
+    }
+
+    *nbits = numa_num_possible_cpus();
+    host_cpus = bitmap_new(*nbits);
+    node_cpus = numa_allocate_cpumask();
+    for (node = find_first_bit(backend->host_nodes, MAX_NODES);
+         node < MAX_NODES;
+         node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1)) {
+        if (numa_node_to_cpus(node, node_cpus)) {
+            continue;
+        }
+        for (cpu = 0; cpu < *nbits; cpu++) {
+            if (numa_bitmask_isbitset(node_cpus, cpu)) {
+                set_bit(cpu, host_cpus);
+            }
+        }
+    }
+    numa_free_cpumask(node_cpus);
+
+    /* Memory-only nodes */
+    if (bitmap_empty(host_cpus, *nbits)) {
+        g_free(host_cpus);
+        return NULL;
+    }
+    return host_cpus;
+#else
+    *nbits = 0;
+    return NULL;
+#endif
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -231,7 +280,12 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads, &local_err);
+        unsigned long nbits;
+        g_autofree unsigned long *host_cpus =
+            host_memory_backend_host_cpus(backend, &nbits);
+
+        os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads,
+                        host_cpus, nbits, false, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -392,8 +446,18 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
+            unsigned long nbits;
+            g_autofree unsigned long *host_cpus =
+                host_memory_backend_host_cpus(backend, &nbits);
+
+            /*
+             * Backends created on the command line preallocate at the
+             * same time, qemu_create_late_backends() waits for them.
+             */
             os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            backend->prealloc_threads, &local_err);
+                            backend->prealloc_threads, host_cpus, nbits,
+                            !phase_check(PHASE_LATE_BACKENDS_CREATED),
+                            &local_err);
             if (local_err) {
                 goto out;
             }
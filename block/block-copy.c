@@ -82,6 +82,7 @@ typedef struct BlockCopyTask {
     BlockCopyState *s;
     BlockCopyCallState *call_state;
     int64_t offset;
+    int64_t bytes;
     /*
      * @method can also be set again in the while loop of
      * block_copy_dirty_clusters(), but it is never accessed concurrently
@@ -96,11 +97,6 @@ typedef struct BlockCopyTask {
      * Protected by lock in BlockCopyState.
      */
     CoQueue wait_queue; /* coroutines blocked on this task */
-    /*
-     * Only protect the case of parallel read while updating @bytes
-     * value in block_copy_task_shrink().
-     */
-    int64_t bytes;
     QLIST_ENTRY(BlockCopyTask) list;
 } BlockCopyTask;
 
@@ -215,17 +211,20 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
 
 /*
  * Search for the first dirty area in offset/bytes range and create task at
- * the beginning of it.
+ * the beginning of it.  Tasks that write zeroes need no buffer, and are
+ * only limited by what a single request can do.
  */
 static coroutine_fn BlockCopyTask *
 block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
-                       int64_t offset, int64_t bytes)
+                       int64_t offset, int64_t bytes, bool zeroes)
 {
     BlockCopyTask *task;
     int64_t max_chunk;
 
     QEMU_LOCK_GUARD(&s->lock);
-    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    max_chunk = zeroes ? QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size) :
+                         block_copy_chunk_size(s);
+    max_chunk = MIN_NON_ZERO(max_chunk, call_state->max_chunk);
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
                                            max_chunk, &offset, &bytes))
@@ -249,7 +248,7 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
         .call_state = call_state,
         .offset = offset,
         .bytes = bytes,
-        .method = s->method,
+        .method = zeroes ? COPY_WRITE_ZEROES : s->method,
     };
     qemu_co_queue_init(&task->wait_queue);
     QLIST_INSERT_HEAD(&s->tasks, task, list);
@@ -257,29 +256,10 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
     return task;
 }
 
-/*
- * block_copy_task_shrink
- *
- * Drop the tail of the task to be handled later. Set dirty bits back and
- * wake up all tasks waiting for us (may be some of them are not intersecting
- * with shrunk task)
- */
-static void coroutine_fn block_copy_task_shrink(BlockCopyTask *task,
-                                                int64_t new_bytes)
+/* Zeroes are written without a bounce buffer */
+static int64_t task_mem(BlockCopyTask *task)
 {
-    QEMU_LOCK_GUARD(&task->s->lock);
-    if (new_bytes == task->bytes) {
-        return;
-    }
-
-    assert(new_bytes > 0 && new_bytes < task->bytes);
-
-    task->s->in_flight_bytes -= task->bytes - new_bytes;
-    bdrv_set_dirty_bitmap(task->s->copy_bitmap,
-                          task->offset + new_bytes, task->bytes - new_bytes);
-
-    task->bytes = new_bytes;
-    qemu_co_queue_restart_all(&task->wait_queue);
+    return task->method == COPY_WRITE_ZEROES ? 0 : task->bytes;
 }
 
 static void coroutine_fn block_copy_task_end(BlockCopyTask *task, int ret)
@@ -397,7 +377,7 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
 
     aio_task_pool_wait_slot(pool);
     if (aio_task_pool_status(pool) < 0) {
-        co_put_to_shres(task->s->mem, task->bytes);
+        co_put_to_shres(task->s->mem, task_mem(task));
         block_copy_task_end(task, -ECANCELED);
         g_free(task);
         return -ECANCELED;
@@ -526,7 +506,7 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
             progress_work_done(s->progress, t->bytes);
         }
     }
-    co_put_to_shres(s->mem, t->bytes);
+    co_put_to_shres(s->mem, task_mem(t));
     block_copy_task_end(t, ret);
 
     return ret;
@@ -656,6 +636,8 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     bool found_dirty = false;
     int64_t end = offset + bytes;
     AioTaskPool *aio = NULL;
+    int64_t status_end = offset;
+    int status = 0;
 
     /*
      * block_copy() user is responsible for keeping source and target in same
@@ -667,42 +649,66 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
     assert(QEMU_IS_ALIGNED(bytes, s->cluster_size));
 
+    /*
+     * The block status is queried for the whole rest of the range at the
+     * first dirty cluster, and the extent it returns is then cut into
+     * tasks: unallocated extents are dropped from the bitmap at once when
+     * skipping them, zeroed ones become as few write zeroes as possible,
+     * and the data ones are copied in chunks without asking again.
+     */
     while (bytes && aio_task_pool_status(aio) == 0 &&
            !qatomic_read(&call_state->cancelled)) {
         BlockCopyTask *task;
-        int64_t status_bytes;
+        int64_t dirty, status_bytes;
 
-        task = block_copy_task_create(s, call_state, offset, bytes);
-        if (!task) {
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            dirty = bdrv_dirty_bitmap_next_dirty(s->copy_bitmap, offset,
+                                                 bytes);
+        }
+        if (dirty < 0) {
             /* No more dirty bits in the bitmap */
             trace_block_copy_skip_range(s, offset, bytes);
             break;
         }
-        if (task->offset > offset) {
-            trace_block_copy_skip_range(s, offset, task->offset - offset);
+        if (dirty > offset) {
+            trace_block_copy_skip_range(s, offset, dirty - offset);
+            offset = dirty;
+            bytes = end - offset;
         }
 
-        found_dirty = true;
-
-        ret = block_copy_block_status(s, task->offset, task->bytes,
-                                      &status_bytes);
-        assert(ret >= 0); /* never fail */
-        if (status_bytes < task->bytes) {
-            block_copy_task_shrink(task, status_bytes);
+        if (offset >= status_end) {
+            status = block_copy_block_status(s, offset, bytes, &status_bytes);
+            assert(status >= 0); /* never fail */
+            status_end = offset + MIN(status_bytes, bytes);
         }
+        status_bytes = status_end - offset;
+
         if (qatomic_read(&s->skip_unallocated) &&
-            !(ret & BDRV_BLOCK_ALLOCATED)) {
-            block_copy_task_end(task, 0);
-            trace_block_copy_skip_range(s, task->offset, task->bytes);
-            offset = task_end(task);
+            !(status & BDRV_BLOCK_ALLOCATED)) {
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                bdrv_reset_dirty_bitmap(s->copy_bitmap, offset, status_bytes);
+                progress_set_remaining(s->progress,
+                                       bdrv_get_dirty_count(s->copy_bitmap) +
+                                       s->in_flight_bytes);
+            }
+            trace_block_copy_skip_range(s, offset, status_bytes);
+            found_dirty = true;
+            offset += status_bytes;
             bytes = end - offset;
-            g_free(task);
             continue;
         }
-        if (ret & BDRV_BLOCK_ZERO) {
-            task->method = COPY_WRITE_ZEROES;
+
+        task = block_copy_task_create(s, call_state, offset, status_bytes,
+                                      status & BDRV_BLOCK_ZERO);
+        if (!task) {
+            /* Copied by someone else since we looked */
+            offset += status_bytes;
+            bytes = end - offset;
+            continue;
         }
 
+        found_dirty = true;
+
         if (!call_state->ignore_ratelimit) {
             uint64_t ns = ratelimit_calculate_delay(&s->rate_limit, 0);
             if (ns > 0) {
@@ -718,7 +724,7 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         trace_block_copy_process(s, task->offset);
 
-        co_get_from_shres(s->mem, task->bytes);
+        co_get_from_shres(s->mem, task_mem(task));
 
         offset = task_end(task);
         bytes = end - offset;
@@ -20,8 +20,10 @@
 
 #include "qemu/osdep.h"
 
+#include "block/aio_task.h"
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -31,13 +33,22 @@
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "crypto.h"
 
 typedef struct BlockCrypto BlockCrypto;
 
+/* Ciphers, and so threads, that can encrypt or decrypt at the same time */
+#define BLOCK_CRYPTO_MAX_THREADS 4
+
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
+
+    /* Protects nb_threads */
+    CoMutex lock;
+    CoQueue thread_task_queue;
+    int nb_threads;
 };
 
 
@@ -294,7 +305,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
-                                       1,
+                                       BLOCK_CRYPTO_MAX_THREADS,
                                        errp);
 
     if (!crypto->block) {
@@ -303,6 +314,8 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     }
 
     bs->encrypted = true;
+    qemu_co_mutex_init(&crypto->lock);
+    qemu_co_queue_init(&crypto->thread_task_queue);
 
     ret = 0;
  cleanup:
@@ -396,6 +409,95 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+/*
+ * Each chunk is encrypted or decrypted in slices of this size, which
+ * are processed in parallel by the thread pool.
+ */
+#define BLOCK_CRYPTO_SLICE_SIZE (64 * KiB)
+
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoEncDecTask {
+    AioTask task;
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+    BlockCryptoEncDecFunc func;
+} BlockCryptoEncDecTask;
+
+static int block_crypto_encdec_pool_func(void *opaque)
+{
+    BlockCryptoEncDecTask *t = opaque;
+    BlockCrypto *crypto = t->bs->opaque;
+
+    if (t->func(crypto->block, t->offset, t->buf, t->len, NULL) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static coroutine_fn int block_crypto_encdec_task_entry(AioTask *task)
+{
+    BlockCryptoEncDecTask *t = container_of(task, BlockCryptoEncDecTask, task);
+    BlockCrypto *crypto = t->bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(t->bs));
+    int ret;
+
+    /* There is one cipher per thread */
+    qemu_co_mutex_lock(&crypto->lock);
+    while (crypto->nb_threads >= BLOCK_CRYPTO_MAX_THREADS) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, &crypto->lock);
+    }
+    crypto->nb_threads++;
+    qemu_co_mutex_unlock(&crypto->lock);
+
+    ret = thread_pool_submit_co(pool, block_crypto_encdec_pool_func, t);
+
+    qemu_co_mutex_lock(&crypto->lock);
+    crypto->nb_threads--;
+    qemu_co_queue_next(&crypto->thread_task_queue);
+    qemu_co_mutex_unlock(&crypto->lock);
+
+    return ret;
+}
+
+/*
+ * Encrypt or decrypt @len bytes of @buf in place, outside of the
+ * AioContext so that it can do other I/O meanwhile.
+ */
+static coroutine_fn int
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset, uint8_t *buf,
+                       uint64_t len, BlockCryptoEncDecFunc func)
+{
+    AioTaskPool *aio = aio_task_pool_new(BLOCK_CRYPTO_MAX_THREADS);
+    int ret;
+
+    while (len && aio_task_pool_status(aio) == 0) {
+        BlockCryptoEncDecTask *t = g_new(BlockCryptoEncDecTask, 1);
+
+        *t = (BlockCryptoEncDecTask) {
+            .task.func = block_crypto_encdec_task_entry,
+            .bs = bs,
+            .offset = offset,
+            .buf = buf,
+            .len = MIN(len, BLOCK_CRYPTO_SLICE_SIZE),
+            .func = func,
+        };
+        offset += t->len;
+        buf += t->len;
+        len -= t->len;
+        aio_task_pool_start_task(aio, &t->task);
+    }
+
+    aio_task_pool_wait_all(aio);
+    ret = aio_task_pool_status(aio);
+    aio_task_pool_free(aio);
+
+    return ret;
+}
+
 static coroutine_fn int
 block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                        QEMUIOVector *qiov, int flags)
@@ -439,9 +541,9 @@ block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                     cur_bytes, qcrypto_block_decrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -495,9 +597,9 @@ block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                     cur_bytes, qcrypto_block_encrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -51,6 +51,9 @@ struct BdrvDirtyBitmap {
     bool skip_store;            /* We are either migrating or deleting this
                                  * bitmap; it should not be stored on the next
                                  * inactivation. */
+    HBitmap *changes;           /* Meta bitmap of the chunks that changed since
+                                   bdrv_dirty_bitmap_track_changes(), if any */
+    int changes_chunk;          /* Bits of @bitmap per bit of @changes */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -251,6 +254,75 @@ void bdrv_dirty_bitmap_enable_successor(BdrvDirtyBitmap *bitmap)
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
 }
 
+/*
+ * Mark the chunks where @hb has bits set as changed, before @hb is merged
+ * into the bitmap.
+ */
+static void bdrv_dirty_bitmap_mark_changed(BdrvDirtyBitmap *bitmap,
+                                           const HBitmap *hb)
+{
+    if (bitmap->changes) {
+        hbitmap_merge(bitmap->changes, hb, bitmap->changes);
+    }
+}
+
+/*
+ * Make @hb the bitmap's implementation.  The change tracking moves to
+ * @hb, and the bits that may differ between the two are marked changed.
+ */
+static void bdrv_dirty_bitmap_replace(BdrvDirtyBitmap *bitmap, HBitmap *hb)
+{
+    HBitmap *old = bitmap->bitmap;
+
+    if (bitmap->changes) {
+        HBitmap *changes = hbitmap_create_meta(hb, bitmap->changes_chunk);
+
+        hbitmap_merge(bitmap->changes, old, changes);
+        hbitmap_merge(changes, hb, changes);
+        hbitmap_free_meta(old);
+        bitmap->changes = changes;
+    }
+    bitmap->bitmap = hb;
+}
+
+/*
+ * Start recording which chunks of @chunk_bytes of the bitmap's range see
+ * their bits change, or forget the changes recorded so far.  This lets
+ * the owner of a persistent bitmap only store what is different from the
+ * copy in the image.
+ */
+void bdrv_dirty_bitmap_track_changes(BdrvDirtyBitmap *bitmap,
+                                     uint64_t chunk_bytes)
+{
+    int chunk = chunk_bytes / bdrv_dirty_bitmap_granularity(bitmap);
+
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    if (bitmap->changes && bitmap->changes_chunk == chunk) {
+        hbitmap_reset_all(bitmap->changes);
+    } else {
+        if (bitmap->changes) {
+            hbitmap_free_meta(bitmap->bitmap);
+        }
+        bitmap->changes = hbitmap_create_meta(bitmap->bitmap, chunk);
+        bitmap->changes_chunk = chunk;
+    }
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
+/*
+ * Return whether the bits for @offset..@offset+@bytes may have changed
+ * since the last bdrv_dirty_bitmap_track_changes().  Always true if the
+ * changes are not tracked.
+ */
+bool bdrv_dirty_bitmap_changed(BdrvDirtyBitmap *bitmap,
+                               int64_t offset, int64_t bytes)
+{
+    if (!bitmap->changes) {
+        return true;
+    }
+    return hbitmap_next_dirty(bitmap->changes, offset, bytes) >= 0;
+}
+
 /* Called within bdrv_dirty_bitmap_lock..unlock and with BQL taken.  */
 static void bdrv_release_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap)
 {
@@ -258,6 +330,9 @@ static void bdrv_release_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap)
     assert(!bdrv_dirty_bitmap_busy(bitmap));
     assert(!bdrv_dirty_bitmap_has_successor(bitmap));
     QLIST_REMOVE(bitmap, list);
+    if (bitmap->changes) {
+        hbitmap_free_meta(bitmap->bitmap);
+    }
     hbitmap_free(bitmap->bitmap);
     g_free(bitmap->name);
     g_free(bitmap);
@@ -287,6 +362,15 @@ BdrvDirtyBitmap *bdrv_dirty_bitmap_abdicate(BdrvDirtyBitmap *bitmap,
     successor->persistent = bitmap->persistent;
     bitmap->persistent = false;
     bitmap->busy = false;
+    if (bitmap->changes) {
+        /* The successor differs from the parent where either has bits */
+        assert(!successor->changes);
+        successor->changes_chunk = bitmap->changes_chunk;
+        successor->changes = hbitmap_create_meta(successor->bitmap,
+                                                 successor->changes_chunk);
+        hbitmap_merge(bitmap->changes, bitmap->bitmap, successor->changes);
+        bdrv_dirty_bitmap_mark_changed(successor, successor->bitmap);
+    }
     bdrv_release_dirty_bitmap(bitmap);
 
     return successor;
@@ -309,6 +393,7 @@ BdrvDirtyBitmap *bdrv_reclaim_dirty_bitmap_locked(BdrvDirtyBitmap *parent,
         return NULL;
     }
 
+    bdrv_dirty_bitmap_mark_changed(parent, successor->bitmap);
     if (!hbitmap_merge(parent->bitmap, successor->bitmap, parent->bitmap)) {
         error_setg(errp, "Merging of parent and successor bitmap failed");
         return NULL;
@@ -659,11 +744,13 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
     bdrv_dirty_bitmaps_lock(bitmap->bs);
     if (!out) {
+        bdrv_dirty_bitmap_mark_changed(bitmap, bitmap->bitmap);
         hbitmap_reset_all(bitmap->bitmap);
     } else {
         HBitmap *backup = bitmap->bitmap;
-        bitmap->bitmap = hbitmap_alloc(bitmap->size,
-                                       hbitmap_granularity(backup));
+        bdrv_dirty_bitmap_replace(bitmap,
+                                  hbitmap_alloc(bitmap->size,
+                                                hbitmap_granularity(backup)));
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
@@ -673,7 +760,7 @@ void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup)
 {
     HBitmap *tmp = bitmap->bitmap;
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
-    bitmap->bitmap = backup;
+    bdrv_dirty_bitmap_replace(bitmap, backup);
     hbitmap_free(tmp);
 }
 
@@ -712,6 +799,9 @@ void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap,
                                         uint8_t *buf, uint64_t offset,
                                         uint64_t bytes, bool finish)
 {
+    if (bitmap->changes) {
+        hbitmap_set(bitmap->changes, offset, bytes);
+    }
     hbitmap_deserialize_part(bitmap->bitmap, buf, offset, bytes, finish);
 }
 
@@ -719,6 +809,9 @@ void bdrv_dirty_bitmap_deserialize_zeroes(BdrvDirtyBitmap *bitmap,
                                           uint64_t offset, uint64_t bytes,
                                           bool finish)
 {
+    if (bitmap->changes) {
+        hbitmap_set(bitmap->changes, offset, bytes);
+    }
     hbitmap_deserialize_zeroes(bitmap->bitmap, offset, bytes, finish);
 }
 
@@ -726,6 +819,9 @@ void bdrv_dirty_bitmap_deserialize_ones(BdrvDirtyBitmap *bitmap,
                                         uint64_t offset, uint64_t bytes,
                                         bool finish)
 {
+    if (bitmap->changes) {
+        hbitmap_set(bitmap->changes, offset, bytes);
+    }
     hbitmap_deserialize_ones(bitmap->bitmap, offset, bytes, finish);
 }
 
@@ -942,9 +1038,13 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 
     if (backup) {
         *backup = dest->bitmap;
-        dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        bdrv_dirty_bitmap_replace(dest,
+                                  hbitmap_alloc(dest->size,
+                                                hbitmap_granularity(*backup)));
+        bdrv_dirty_bitmap_mark_changed(dest, src->bitmap);
         ret = hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
+        bdrv_dirty_bitmap_mark_changed(dest, src->bitmap);
         ret = hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
     }
 
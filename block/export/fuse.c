@@ -26,6 +26,8 @@
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
+#include "qemu/queue.h"
 #include "sysemu/block-backend.h"
 
 #include <fuse.h>
@@ -36,13 +38,30 @@
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
 
+/* Requests kept around for reuse, their buffers are over 1 MB each */
+#define FUSE_MAX_FREE_REQUESTS 16
+
+/*
+ * A request read from /dev/fuse.  It is processed in its own coroutine, so
+ * that the next request can be read while it waits for the block layer.
+ */
+typedef struct FuseRequest {
+    struct FuseExport *exp;
+    struct fuse_buf fuse_buf;
+    QSLIST_ENTRY(FuseRequest) next;
+} FuseRequest;
+
 typedef struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
+    QSLIST_HEAD(, FuseRequest) free_requests;
+    int nr_free_requests;
     bool mounted, fd_handler_set_up;
 
+    /* Serializes writes that grow the image */
+    CoMutex grow_lock;
+
     char *mountpoint;
     bool writable;
     bool growable;
@@ -122,6 +141,8 @@ static int fuse_export_create(BlockExport *blk_exp,
 
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
+    QSLIST_INIT(&exp->free_requests);
+    qemu_co_mutex_init(&exp->grow_lock);
     exp->growable = args->growable;
 
     /* set default */
@@ -226,6 +247,48 @@ fail:
     return ret;
 }
 
+static FuseRequest *fuse_request_get(FuseExport *exp)
+{
+    FuseRequest *fuse_req = QSLIST_FIRST(&exp->free_requests);
+
+    if (fuse_req) {
+        QSLIST_REMOVE_HEAD(&exp->free_requests, next);
+        exp->nr_free_requests--;
+    } else {
+        fuse_req = g_new0(FuseRequest, 1);
+        fuse_req->exp = exp;
+    }
+    return fuse_req;
+}
+
+static void fuse_request_put(FuseRequest *fuse_req)
+{
+    FuseExport *exp = fuse_req->exp;
+
+    if (exp->nr_free_requests == FUSE_MAX_FREE_REQUESTS) {
+        free(fuse_req->fuse_buf.mem);
+        g_free(fuse_req);
+        return;
+    }
+    QSLIST_INSERT_HEAD(&exp->free_requests, fuse_req, next);
+    exp->nr_free_requests++;
+}
+
+static void coroutine_fn co_process_fuse_request(void *opaque)
+{
+    FuseRequest *fuse_req = opaque;
+    FuseExport *exp = fuse_req->exp;
+
+    /*
+     * The handlers in fuse_ops issue their I/O from this coroutine, so
+     * they yield to the event loop until it completes.
+     */
+    fuse_session_process_buf(exp->fuse_session, &fuse_req->fuse_buf);
+
+    fuse_request_put(fuse_req);
+    blk_exp_unref(&exp->common);
+}
+
 /**
  * Callback to be invoked when the FUSE session FD can be read from.
  * (This is basically the FUSE event loop.)
@@ -233,21 +296,25 @@ fail:
 static void read_from_fuse_export(void *opaque)
 {
     FuseExport *exp = opaque;
+    FuseRequest *fuse_req;
+    Coroutine *co;
     int ret;
 
     blk_exp_ref(&exp->common);
 
+    fuse_req = fuse_request_get(exp);
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &fuse_req->fuse_buf);
     } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
+    if (ret <= 0) {
+        fuse_request_put(fuse_req);
+        blk_exp_unref(&exp->common);
+        return;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
-    blk_exp_unref(&exp->common);
+    /* The coroutine drops the reference */
+    co = qemu_coroutine_create(co_process_fuse_request, fuse_req);
+    qemu_coroutine_enter(co);
 }
 
 static void fuse_export_shutdown(BlockExport *blk_exp)
@@ -286,7 +353,13 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    while (!QSLIST_EMPTY(&exp->free_requests)) {
+        FuseRequest *fuse_req = QSLIST_FIRST(&exp->free_requests);
+
+        QSLIST_REMOVE_HEAD(&exp->free_requests, next);
+        free(fuse_req->fuse_buf.mem);
+        g_free(fuse_req);
+    }
     g_free(exp->mountpoint);
 }
 
@@ -578,7 +651,21 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            /*
+             * Other writes past the EOF may be in flight: check the length
+             * again under the lock, so that the image never shrinks back.
+             */
+            qemu_co_mutex_lock(&exp->grow_lock);
+            length = blk_getlength(exp->common.blk);
+            if (length < 0) {
+                ret = length;
+            } else if (offset + size > length) {
+                ret = fuse_do_truncate(exp, offset + size, true,
+                                       PREALLOC_MODE_OFF);
+            } else {
+                ret = 0;
+            }
+            qemu_co_mutex_unlock(&exp->grow_lock);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
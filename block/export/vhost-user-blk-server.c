@@ -44,8 +44,18 @@ typedef struct VuBlkReq {
     struct virtio_blk_outhdr out;
     VuServer *server;
     struct VuVirtq *vq;
+    int vq_idx;
 } VuBlkReq;
 
+/*
+ * Requests that complete while a kick is processed only mark the virtqueue,
+ * which is then notified once at the end of vu_blk_process_vq().
+ */
+typedef struct {
+    bool batching;
+    bool notify;
+} VuBlkVirtq;
+
 /* vhost user block device */
 typedef struct {
     BlockExport export;
@@ -54,15 +64,22 @@ typedef struct {
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
     bool writable;
+    VuBlkVirtq *vqs;
 } VuBlkExport;
 
 static void vu_blk_req_complete(VuBlkReq *req)
 {
     VuDev *vu_dev = &req->server->vu_dev;
+    VuBlkExport *vexp = container_of(req->server, VuBlkExport, vu_server);
+    VuBlkVirtq *bvq = &vexp->vqs[req->vq_idx];
 
     /* IO size with 1 extra status byte */
     vu_queue_push(vu_dev, req->vq, &req->elem, req->size + 1);
-    vu_queue_notify(vu_dev, req->vq);
+    if (bvq->batching) {
+        bvq->notify = true;
+    } else {
+        vu_queue_notify(vu_dev, req->vq);
+    }
 
     free(req);
 }
@@ -295,8 +312,14 @@ err:
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 {
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
+    VuBlkVirtq *bvq = &vexp->vqs[idx];
     VuVirtq *vq = vu_get_queue(vu_dev, idx);
 
+    /* Submit all the requests of this kick to the block layer at once */
+    blk_io_plug(vexp->export.blk);
+    bvq->batching = true;
+
     while (1) {
         VuBlkReq *req;
 
@@ -307,11 +330,20 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 
         req->server = server;
         req->vq = vq;
+        req->vq_idx = idx;
 
         Coroutine *co =
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
         qemu_coroutine_enter(co);
     }
+
+    blk_io_unplug(vexp->export.blk);
+    bvq->batching = false;
+
+    if (bvq->notify) {
+        bvq->notify = false;
+        vu_queue_notify(vu_dev, vq);
+    }
 }
 
 static void vu_blk_queue_set_started(VuDev *vu_dev, int idx, bool started)
@@ -502,6 +534,7 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
 
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
+    vexp->vqs = g_new0(VuBlkVirtq, num_queues);
 
     blk_add_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                  vexp);
@@ -510,6 +543,7 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  num_queues, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        g_free(vexp->vqs);
         return -EADDRNOTAVAIL;
     }
 
@@ -522,6 +556,7 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    g_free(vexp->vqs);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
@@ -167,6 +167,7 @@ typedef struct BDRVRawState {
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
+    bool nowait_read;
     struct {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
@@ -552,12 +553,42 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "check that page cache was dropped on live migration (default: off)"
         },
+#ifdef CONFIG_PREADV2_NOWAIT
+        {
+            .name = "x-nowait-read",
+            .type = QEMU_OPT_BOOL,
+            .help = "try cached reads without blocking before submitting "
+                    "them (default: off)",
+        },
+#endif
         { /* end of list */ }
     },
 };
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Register the image file with the io_uring of the AioContext of @bs, or
+ * unregister it before it is closed or @bs moves to another AioContext.
+ */
+static void raw_luring_register_fd(BlockDriverState *bs, bool on)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    if (!s->use_linux_io_uring || s->fd < 0) {
+        return;
+    }
+    aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    if (on) {
+        luring_register_file(aio, s->fd);
+    } else {
+        luring_unregister_file(aio, s->fd);
+    }
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -650,6 +681,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->drop_cache = qemu_opt_get_bool(opts, "drop-cache", true);
     s->check_cache_dropped = qemu_opt_get_bool(opts, "x-check-cache-dropped",
                                                false);
+    s->nowait_read = qemu_opt_get_bool(opts, "x-nowait-read", false);
 
     s->open_flags = open_flags;
     raw_parse_flags(bdrv_flags, &s->open_flags, false);
@@ -790,6 +822,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_register_fd(bs, true);
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2030,6 +2065,48 @@ static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
     return thread_pool_submit_co(pool, func, arg);
 }
 
+#ifdef CONFIG_PREADV2_NOWAIT
+/*
+ * Try to serve a read from the page cache without blocking, right in the
+ * coroutine.  Returns true if the whole request was read, false if it has
+ * to be submitted as usual.
+ */
+static bool raw_try_nowait_read(BlockDriverState *bs, uint64_t offset,
+                                uint64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVRawState *s = bs->opaque;
+    ssize_t ret;
+
+    if (qiov->niov > IOV_MAX) {
+        return false;
+    }
+
+    do {
+        ret = preadv2(s->fd, qiov->iov, qiov->niov, offset, RWF_NOWAIT);
+    } while (ret == -1 && errno == EINTR);
+    trace_file_nowait_read(bs, offset, bytes, ret < 0 ? -errno : ret);
+
+    if (ret == -1 && (errno == EOPNOTSUPP || errno == EINVAL ||
+                      errno == ENOSYS)) {
+        /* Not supported by the kernel or the file system, stop trying */
+        s->nowait_read = false;
+    }
+
+    /*
+     * EAGAIN means a cache miss.  Partially cached requests and short reads
+     * at the EOF are left to the asynchronous path too, which knows how to
+     * handle them.
+     */
+    return ret == bytes;
+}
+#else
+static bool raw_try_nowait_read(BlockDriverState *bs, uint64_t offset,
+                                uint64_t bytes, QEMUIOVector *qiov)
+{
+    return false;
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -2039,6 +2116,12 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     if (fd_open(bs) < 0)
         return -EIO;
 
+    if (s->nowait_read && type == QEMU_AIO_READ &&
+        !(s->open_flags & O_DIRECT) &&
+        raw_try_nowait_read(bs, offset, bytes, qiov)) {
+        return 0;
+    }
+
     /*
      * When using O_DIRECT, the request must be aligned to be able to use
      * either libaio or io_uring interface. If not fail back to regular thread
@@ -2152,6 +2235,13 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_register_fd(bs, false);
+#endif
+}
+
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
@@ -2174,6 +2264,7 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
         }
+        raw_luring_register_fd(bs, true);
     }
 #endif
 }
@@ -2182,6 +2273,9 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_register_fd(bs, false);
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3176,9 +3270,15 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        raw_luring_register_fd(bs, false);
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+#ifdef CONFIG_LINUX_IO_URING
+        raw_luring_register_fd(bs, true);
+#endif
     }
     s->perm_change_fd = 0;
 
@@ -3277,6 +3377,7 @@ BlockDriver bdrv_file = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
@@ -3643,6 +3744,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
@@ -3767,6 +3869,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -3897,6 +4000,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -2023,6 +2023,32 @@ bdrv_co_write_req_prepare(BdrvChild *child, int64_t offset, int64_t bytes,
     }
 }
 
+static bool bdrv_bsc_is_data(BlockDriverState *bs, int64_t offset,
+                             int64_t *pnum)
+{
+    if (offset < bs->bsc_data_start || offset >= bs->bsc_data_end) {
+        return false;
+    }
+    *pnum = bs->bsc_data_end - offset;
+    return true;
+}
+
+static void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    bs->bsc_data_start = offset;
+    bs->bsc_data_end = offset + bytes;
+}
+
+static void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                                      int64_t offset, int64_t bytes)
+{
+    if (offset < bs->bsc_data_end &&
+        bytes > bs->bsc_data_start - offset) {
+        bs->bsc_data_start = 0;
+        bs->bsc_data_end = 0;
+    }
+}
+
 static inline void coroutine_fn
 bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
                          BdrvTrackedRequest *req, int ret)
@@ -2034,6 +2060,16 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
 
     qatomic_inc(&bs->write_gen);
 
+    /*
+     * Zero writes and discards may punch holes, and a truncated node may
+     * have new holes past its old end
+     */
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+    } else {
+        bdrv_bsc_invalidate_range(bs, offset, bytes);
+    }
+
     /*
      * Discard cannot extend the image, but in error handling cases, such as
      * when reverting a qcow2 cluster allocation, the discarded range can pass
@@ -2446,9 +2482,36 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     aligned_bytes = ROUND_UP(offset + bytes, align) - aligned_offset;
 
     if (bs->drv->bdrv_co_block_status) {
-        ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
-                                            aligned_bytes, pnum, &local_map,
-                                            &local_file);
+        /*
+         * Protocol drivers may need slow queries outside of QEMU to find
+         * out about holes, like lseek(SEEK_DATA/SEEK_HOLE) on fragmented
+         * files, so remember the last data region they reported.  Only
+         * data is cached: if another process punches a hole in it, the
+         * cache reports zeroes as data, which is harmless.  Reporting
+         * data as a hole would not be.
+         *
+         * A protocol node that reports DATA | OFFSET_VALID always maps
+         * an offset to itself in its own file, so that is what the
+         * cache returns.
+         */
+        if (want_zero && QLIST_EMPTY(&bs->children) &&
+            bdrv_bsc_is_data(bs, aligned_offset, pnum))
+        {
+            ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
+            local_file = bs;
+            local_map = aligned_offset;
+        } else {
+            ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
+                                                aligned_bytes, pnum,
+                                                &local_map, &local_file);
+            if (want_zero && QLIST_EMPTY(&bs->children) &&
+                ret == (BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID))
+            {
+                assert(local_file == bs);
+                assert(local_map == aligned_offset);
+                bdrv_bsc_fill(bs, aligned_offset, *pnum);
+            }
+        }
     } else {
         /* Default code for filters */
 
@@ -22,9 +22,18 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Number of image files that can be registered with a ring */
+#define MAX_FIXED_FILES 64
+
+/* Time the SQ thread polls before going to sleep, in milliseconds */
+#define SQ_THREAD_IDLE 1000
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
+    /* Set when the request goes through the io_uring of the AioContext */
+    CqeHandler cqe_handler;
+    LuringState *s;
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
@@ -56,8 +65,20 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* Registered files, -1 for the free slots */
+    int fixed_files[MAX_FIXED_FILES];
+    bool has_fixed_files;
+
+    bool sqpoll;
 } LuringState;
 
+/*
+ * Ring whose SQ thread is shared by the other rings that poll their
+ * submission queue.  Only changed with the BQL held.
+ */
+static int luring_sq_thread_fd = -1;
+
 /**
  * luring_resubmit:
  *
@@ -66,6 +87,10 @@ typedef struct LuringState {
  */
 static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
 {
+    if (luringcb->cqe_handler.cb) {
+        aio_add_sqe(s->aio_context, &luringcb->sqeq, &luringcb->cqe_handler);
+        return;
+    }
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
 }
@@ -123,10 +148,79 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
  * canceled.
  *
  */
+/**
+ * luring_complete:
+ * @s: AIO state
+ * @luringcb: AIO control block
+ * @ret: result of the cqe
+ *
+ * Finish a request, or resubmit it if it was interrupted or short.
+ */
+static void luring_complete(LuringState *s, LuringAIOCB *luringcb, int ret)
+{
+    int total_bytes;
+
+    trace_luring_process_completion(s, luringcb, ret);
+
+    /* total_read is non-zero only for resubmitted read requests */
+    total_bytes = ret + luringcb->total_read;
+
+    if (ret < 0) {
+        if (ret == -EINTR) {
+            luring_resubmit(s, luringcb);
+            return;
+        }
+    } else if (!luringcb->qiov) {
+        goto end;
+    } else if (total_bytes == luringcb->qiov->size) {
+        ret = 0;
+    /* Only read/write */
+    } else {
+        /* Short Read/Write */
+        if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                return;
+            } else {
+                /* Pad with zeroes */
+                qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                  luringcb->qiov->size - total_bytes);
+                ret = 0;
+            }
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+end:
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    /*
+     * If the coroutine is already entered it must be in ioq_submit()
+     * and will notice luringcb->ret has been filled in when it
+     * eventually runs later. Coroutines cannot be entered recursively
+     * so avoid doing that!
+     */
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+}
+
+/* Completion of a request that went through the AioContext's io_uring */
+static void luring_cqe_handler(CqeHandler *cqe_handler)
+{
+    LuringAIOCB *luringcb = container_of(cqe_handler, LuringAIOCB,
+                                         cqe_handler);
+    LuringState *s = luringcb->s;
+
+    aio_context_acquire(s->aio_context);
+    luring_complete(s, luringcb, cqe_handler->cqe.res);
+    aio_context_release(s->aio_context);
+}
+
 static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
-    int total_bytes;
     /*
      * Request completion callbacks can run the nested event loop.
      * Schedule ourselves so the nested event loop will "see" remaining
@@ -159,50 +253,7 @@ static void luring_process_completions(LuringState *s)
 
         /* Change counters one-by-one because we can be nested. */
         s->io_q.in_flight--;
-        trace_luring_process_completion(s, luringcb, ret);
-
-        /* total_read is non-zero only for resubmitted read requests */
-        total_bytes = ret + luringcb->total_read;
-
-        if (ret < 0) {
-            if (ret == -EINTR) {
-                luring_resubmit(s, luringcb);
-                continue;
-            }
-        } else if (!luringcb->qiov) {
-            goto end;
-        } else if (total_bytes == luringcb->qiov->size) {
-            ret = 0;
-        /* Only read/write */
-        } else {
-            /* Short Read/Write */
-            if (luringcb->is_read) {
-                if (ret > 0) {
-                    luring_resubmit_short_read(s, luringcb, ret);
-                    continue;
-                } else {
-                    /* Pad with zeroes */
-                    qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
-                                      luringcb->qiov->size - total_bytes);
-                    ret = 0;
-                }
-            } else {
-                ret = -ENOSPC;
-            }
-        }
-end:
-        luringcb->ret = ret;
-        qemu_iovec_destroy(&luringcb->resubmit_qiov);
-
-        /*
-         * If the coroutine is already entered it must be in ioq_submit()
-         * and will notice luringcb->ret has been filled in when it
-         * eventually runs later. Coroutines cannot be entered recursively
-         * so avoid doing that!
-         */
-        if (!qemu_coroutine_entered(luringcb->co)) {
-            aio_co_wake(luringcb->co);
-        }
+        luring_complete(s, luringcb, ret);
     }
     qemu_bh_cancel(s->completion_bh);
 }
@@ -312,6 +363,51 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/* Returns the index of @fd in the registered files, or -1 */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (s->has_fixed_files) {
+        for (i = 0; i < MAX_FIXED_FILES; i++) {
+            if (s->fixed_files[i] == fd) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+void luring_register_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->has_fixed_files || luring_fixed_file(s, fd) >= 0) {
+        return;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == -1) {
+            if (io_uring_register_files_update(&s->ring, i, &fd, 1) == 1) {
+                s->fixed_files[i] = fd;
+                trace_luring_register_file(s, fd, i);
+            }
+            return;
+        }
+    }
+}
+
+void luring_unregister_file(LuringState *s, int fd)
+{
+    int i = luring_fixed_file(s, fd);
+    int unused = -1;
+
+    if (i >= 0) {
+        io_uring_register_files_update(&s->ring, i, &unused, 1);
+        s->fixed_files[i] = -1;
+        trace_luring_unregister_file(s, fd, i);
+    }
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -328,6 +424,17 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    /*
+     * In an IOThread, the request goes to the io_uring that monitors the
+     * file descriptors: it is submitted and reaped by the same system call
+     * as the fd events.  SQPOLL rings keep their own kernel thread.
+     */
+    bool add_sqe = !s->sqpoll && aio_can_add_sqe(s->aio_context);
+    int fixed = add_sqe ? -1 : luring_fixed_file(s, fd);
+
+    if (fixed >= 0) {
+        fd = fixed;
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
@@ -346,8 +453,18 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (fixed >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
+    if (add_sqe) {
+        luringcb->cqe_handler.cb = luring_cqe_handler;
+        aio_add_sqe(s->aio_context, sqes, &luringcb->cqe_handler);
+        trace_luring_add_sqe(s, luringcb);
+        return 0;
+    }
+
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
     trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
@@ -368,6 +485,7 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     int ret;
     LuringAIOCB luringcb = {
         .co         = qemu_coroutine_self(),
+        .s          = s,
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
@@ -402,20 +520,50 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(bool sqpoll, Error **errp)
 {
-    int rc;
+    int rc, i;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    /*
+     * With SQPOLL, a kernel thread submits the requests as they are
+     * queued, and io_uring_submit() only makes a system call when the
+     * thread went to sleep.  All the rings share one such thread.
+     */
+    if (sqpoll) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQ_THREAD_IDLE;
+        if (luring_sq_thread_fd >= 0) {
+            params.flags |= IORING_SETUP_ATTACH_WQ;
+            params.wq_fd = luring_sq_thread_fd;
+        }
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
+    if (sqpoll && luring_sq_thread_fd < 0) {
+        luring_sq_thread_fd = ring->ring_fd;
+    }
+    s->sqpoll = sqpoll;
+
+    /*
+     * Registered files save the kernel the lookup and the reference
+     * counting of the file on every request.  Start with an empty table,
+     * older kernels that don't have sparse tables just don't use them.
+     */
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_files[i] = -1;
+    }
+    s->has_fixed_files = io_uring_register_files(ring, s->fixed_files,
+                                                 MAX_FIXED_FILES) == 0;
 
     ioq_init(&s->io_q);
     return s;
@@ -424,6 +572,9 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->ring.ring_fd == luring_sq_thread_fd) {
+        luring_sq_thread_fd = -1;
+    }
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
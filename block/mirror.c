@@ -28,6 +28,15 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/*
+ * The limit of operations in flight starts at MAX_IN_FLIGHT and moves
+ * between these bounds, following the throughput measured over each
+ * interval in which the limit was reached.
+ */
+#define MIN_IN_FLIGHT_LIMIT 4
+#define MAX_IN_FLIGHT_LIMIT 64
+#define MIRROR_ADAPT_INTERVAL_NS (100 * SCALE_MS)
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -76,6 +85,12 @@ typedef struct MirrorBlockJob {
     int in_flight;
     int64_t bytes_in_flight;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+    int max_in_flight;
+    int in_flight_step;
+    int64_t adapt_start_ns;
+    uint64_t adapt_bytes;
+    bool adapt_saturated;
+    uint64_t last_throughput;
     int ret;
     bool unmap;
     int target_cluster_size;
@@ -166,6 +181,41 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/*
+ * Grow or shrink the limit of operations in flight while that increases
+ * the throughput, and go the other way when it drops: past some depth,
+ * the target only gets slower to answer.
+ */
+static void mirror_adapt_in_flight(MirrorBlockJob *s, uint64_t bytes)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t throughput;
+    int step;
+
+    s->adapt_bytes += bytes;
+    if (now - s->adapt_start_ns < MIRROR_ADAPT_INTERVAL_NS) {
+        return;
+    }
+
+    if (s->adapt_saturated) {
+        throughput = s->adapt_bytes * NANOSECONDS_PER_SECOND /
+                     (now - s->adapt_start_ns);
+        if (throughput < s->last_throughput) {
+            s->in_flight_step = -s->in_flight_step;
+        }
+        step = MAX(s->max_in_flight / 4, 1) * s->in_flight_step;
+        s->max_in_flight = MIN(MAX(s->max_in_flight + step,
+                                   MIN_IN_FLIGHT_LIMIT),
+                               MAX_IN_FLIGHT_LIMIT);
+        s->last_throughput = throughput;
+        trace_mirror_adapt_in_flight(s, throughput, s->max_in_flight);
+    }
+
+    s->adapt_start_ns = now;
+    s->adapt_bytes = 0;
+    s->adapt_saturated = false;
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -196,6 +246,7 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
+        mirror_adapt_in_flight(s, op->bytes);
     }
     qemu_iovec_destroy(&op->qiov);
 
@@ -313,6 +364,16 @@ mirror_wait_for_free_in_flight_slot(MirrorBlockJob *s)
     mirror_wait_for_any_operation(s, false);
 }
 
+static void coroutine_fn mirror_wait_for_in_flight_limit(MirrorBlockJob *s,
+                                                         int64_t offset)
+{
+    while (s->in_flight >= s->max_in_flight) {
+        s->adapt_saturated = true;
+        trace_mirror_yield_in_flight(s, offset, s->in_flight);
+        mirror_wait_for_free_in_flight_slot(s);
+    }
+}
+
 /* Perform a mirror copy operation.
  *
  * *op->bytes_handled is set to the number of bytes copied after and
@@ -465,6 +526,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
     int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_bytes = s->buf_size;
+    int64_t dirty_start, dirty_bytes, status_bytes;
+    int64_t chunk, next_in_flight;
+    int status;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -480,29 +545,37 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     job_pause_point(&s->common.job);
 
-    /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
-    bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    while (nb_chunks * s->granularity < s->buf_size) {
-        int64_t next_dirty;
-        int64_t next_offset = offset + nb_chunks * s->granularity;
-        int64_t next_chunk = next_offset / s->granularity;
-        if (next_offset >= s->bdev_length ||
-            !bdrv_dirty_bitmap_get_locked(s->dirty_bitmap, next_offset)) {
-            break;
-        }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
-            break;
-        }
+    /*
+     * Zeroed and unallocated areas don't take any buffer, so they can go
+     * past buf_size and become a single write zeroes or discard.  This is
+     * only a hint: the block status is queried again below, once the
+     * dirty bits are cleared.
+     */
+    status = bdrv_block_status_above(source, NULL, offset,
+                                     QEMU_ALIGN_DOWN(INT_MAX, s->granularity),
+                                     &status_bytes, NULL, NULL);
+    if (status >= 0 && !(status & BDRV_BLOCK_DATA)) {
+        max_bytes = MAX(max_bytes,
+                        QEMU_ALIGN_DOWN(status_bytes, s->granularity));
+    }
 
-        next_dirty = bdrv_dirty_iter_next(s->dbi);
-        if (next_dirty > next_offset || next_dirty < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
-            bdrv_set_dirty_iter(s->dbi, next_offset);
-            next_dirty = bdrv_dirty_iter_next(s->dbi);
-        }
-        assert(next_dirty == next_offset);
-        nb_chunks++;
+    /* Find the dirty area that starts with the first dirty chunk, up to the
+     * first chunk that is already in flight. */
+    bdrv_dirty_bitmap_lock(s->dirty_bitmap);
+    if (bdrv_dirty_bitmap_next_dirty_area(s->dirty_bitmap, offset,
+                                          s->bdev_length, max_bytes,
+                                          &dirty_start, &dirty_bytes) &&
+        dirty_start == offset) {
+        nb_chunks = DIV_ROUND_UP(dirty_bytes, s->granularity);
+    }
+    chunk = offset / s->granularity;
+    next_in_flight = find_next_bit(s->in_flight_bitmap, chunk + nb_chunks,
+                                   chunk + 1);
+    nb_chunks = next_in_flight - chunk;
+    if (offset + nb_chunks * s->granularity < s->bdev_length) {
+        bdrv_set_dirty_iter(s->dbi, offset + nb_chunks * s->granularity);
+    } else {
+        bdrv_set_dirty_iter(s->dbi, 0);
     }
 
     /* Clear dirty bits before querying the block status, because
@@ -561,10 +634,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
-            trace_mirror_yield_in_flight(s, offset, s->in_flight);
-            mirror_wait_for_free_in_flight_slot(s);
-        }
+        mirror_wait_for_in_flight_limit(s, offset);
 
         if (s->ret < 0) {
             ret = 0;
@@ -821,7 +891,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -964,6 +1034,9 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     mirror_free_init(s);
 
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->in_flight_step = 1;
+    s->adapt_start_ns = s->last_pause_ns;
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
         if (ret < 0 || job_is_cancelled(&s->common.job)) {
@@ -1004,8 +1077,11 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
+                if (s->in_flight >= s->max_in_flight) {
+                    s->adapt_saturated = true;
+                }
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
                 continue;
@@ -508,7 +508,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
 
     qmp_block_stream(true, device, device, base != NULL, base, false, NULL,
                      false, NULL, false, NULL,
-                     qdict_haskey(qdict, "speed"), speed, true,
+                     qdict_haskey(qdict, "speed"), speed, false, 0, true,
                      BLOCKDEV_ON_ERROR_REPORT, false, NULL, false, false, false,
                      false, &error);
 
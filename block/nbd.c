@@ -50,6 +50,7 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -96,8 +97,16 @@ typedef struct BDRVNBDState {
     const char *hostname;
     char *x_dirty_bitmap;
     bool alloc_depth;
+    uint32_t multi_conn;
 
     NBDClientConnection *conn;
+
+    /*
+     * The other connections of multi-conn.  Each one is an nbd node of
+     * its own, that reconnects on its own.
+     */
+    BdrvChild *conns[MAX_NBD_CONNECTIONS - 1];
+    int nr_conns;
 } BDRVNBDState;
 
 static void nbd_yank(void *opaque);
@@ -1320,18 +1329,48 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     return ret ? ret : request_ret;
 }
 
+/*
+ * With multi-conn, return the connected child with the fewest requests
+ * in flight, or NULL if that is this node's own connection.  Flushes
+ * always go to this node: the server only has to make the writes that
+ * completed on any connection persistent on a flush, and block status
+ * isn't worth spreading.
+ */
+static BdrvChild *nbd_pick_connection(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *best = NULL;
+    int in_flight = s->in_flight;
+    int i;
+
+    for (i = 0; i < s->nr_conns && in_flight; i++) {
+        BDRVNBDState *cs = s->conns[i]->bs->opaque;
+
+        if (cs->in_flight < in_flight && nbd_client_connected(cs)) {
+            best = s->conns[i];
+            in_flight = cs->in_flight;
+        }
+    }
+    return best;
+}
+
 static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                                 uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn = nbd_pick_connection(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
         .len = bytes,
     };
 
+    if (conn) {
+        return bdrv_co_preadv(conn, offset, bytes, qiov, flags);
+    }
+
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
     assert(!flags);
 
@@ -1382,12 +1421,17 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                  uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn = nbd_pick_connection(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
         .len = bytes,
     };
 
+    if (conn) {
+        return bdrv_co_pwritev(conn, offset, bytes, qiov, flags);
+    }
+
     assert(!(s->info.flags & NBD_FLAG_READ_ONLY));
     if (flags & BDRV_REQ_FUA) {
         assert(s->info.flags & NBD_FLAG_SEND_FUA);
@@ -1406,6 +1450,7 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                        int bytes, BdrvRequestFlags flags)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -1417,6 +1462,11 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
         return -ENOTSUP;
     }
 
+    conn = nbd_pick_connection(bs);
+    if (conn) {
+        return bdrv_co_pwrite_zeroes(conn, offset, bytes, flags);
+    }
+
     if (flags & BDRV_REQ_FUA) {
         assert(s->info.flags & NBD_FLAG_SEND_FUA);
         request.flags |= NBD_CMD_FLAG_FUA;
@@ -1454,6 +1504,7 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
                                   int bytes)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -1465,6 +1516,11 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         return 0;
     }
 
+    conn = nbd_pick_connection(bs);
+    if (conn) {
+        return bdrv_co_pdiscard(conn, offset, bytes);
+    }
+
     return nbd_co_request(bs, &request, NULL);
 }
 
@@ -1895,6 +1951,12 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server, if it supports "
+                    "more than one. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -1951,6 +2013,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (!s->multi_conn || s->multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1958,11 +2027,51 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+/*
+ * Open the other connections of multi-conn as nbd nodes with the same
+ * options, and make them children of @bs.
+ */
+static int nbd_open_connections(BlockDriverState *bs, QDict *options,
+                                int flags, Error **errp)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
+
+    if (!(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        trace_nbd_multi_conn_unsupported(s->export);
+        return 0;
+    }
+
+    for (i = 1; i < s->multi_conn; i++) {
+        QDict *conn_opts = qdict_clone_shallow(options);
+        BlockDriverState *conn_bs;
+        char name[16];
+
+        qdict_put_str(conn_opts, "driver", "nbd");
+        qdict_put_int(conn_opts, "multi-conn", 1);
+        conn_bs = bdrv_open(NULL, NULL, conn_opts, flags, errp);
+        if (!conn_bs) {
+            return -EINVAL;
+        }
+
+        snprintf(name, sizeof(name), "conn%d", i);
+        s->conns[s->nr_conns] = bdrv_attach_child(bs, conn_bs, name,
+                                                  &child_of_bds,
+                                                  BDRV_CHILD_DATA, errp);
+        if (!s->conns[s->nr_conns]) {
+            return -EINVAL;
+        }
+        s->nr_conns++;
+    }
+    return 0;
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
     int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    QDict *conn_opts = qdict_clone_shallow(options);
 
     s->bs = bs;
     qemu_co_mutex_init(&s->send_mutex);
@@ -1990,9 +2099,19 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     bdrv_inc_in_flight(bs);
     aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
 
+    if (s->multi_conn > 1) {
+        ret = nbd_open_connections(bs, conn_opts, flags, errp);
+        if (ret < 0) {
+            nbd_client_close(bs);
+            goto fail;
+        }
+    }
+
+    qobject_unref(conn_opts);
     return 0;
 
 fail:
+    qobject_unref(conn_opts);
     nbd_clear_bdrvstate(bs);
     return ret;
 }
@@ -2036,6 +2155,12 @@ static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
     }
 }
 
+static void nbd_gather_child_options(BlockDriverState *bs, QDict *target,
+                                     bool backing_overridden)
+{
+    /* The other connections are opened from the options of this node */
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     nbd_client_close(bs);
@@ -2171,6 +2296,8 @@ static BlockDriver bdrv_nbd = {
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
 };
 
 static BlockDriver bdrv_nbd_tcp = {
@@ -2200,6 +2327,8 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
 };
 
 static BlockDriver bdrv_nbd_unix = {
@@ -2229,6 +2358,8 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
 };
 
 static void bdrv_nbd_init(void)
@@ -106,6 +106,11 @@ struct BDRVNVMeState {
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    /* Number of I/O queue pairs requested by the user */
+    unsigned io_queues;
+    /* Interrupt coalescing, in 100 microsecond units and 0's based entries */
+    uint8_t irq_coalescing_time;
+    uint8_t irq_coalescing_threshold;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -140,6 +145,9 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_QUEUES "queues"
+#define NVME_BLOCK_OPT_IRQ_COALESCING_TIME "irq-coalescing-time"
+#define NVME_BLOCK_OPT_IRQ_COALESCING_THRESHOLD "irq-coalescing-threshold"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -157,6 +165,21 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs",
+        },
+        {
+            .name = NVME_BLOCK_OPT_IRQ_COALESCING_TIME,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum interrupt delay, in microseconds",
+        },
+        {
+            .name = NVME_BLOCK_OPT_IRQ_COALESCING_THRESHOLD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Completions that trigger an interrupt before the delay",
+        },
         { /* end of list */ }
     },
 };
@@ -691,6 +714,76 @@ out_error:
     return false;
 }
 
+/*
+ * Ask for @s->io_queues I/O queue pairs and create as many of them as the
+ * controller lets us.  Only failing to create the first one is an error.
+ */
+static bool nvme_add_io_queues(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    unsigned max = NVME_DOORBELL_SIZE / sizeof(*s->doorbells) /
+                   s->doorbell_scale - 1;
+    unsigned n = MIN(s->io_queues, max);
+    Error *local_err = NULL;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((n - 1) << 16) | (n - 1)),
+    };
+
+    /* Controllers that do not implement it give us what they have */
+    nvme_admin_cmd_sync(bs, &cmd);
+
+    if (!nvme_add_io_queue(bs, errp)) {
+        return false;
+    }
+    while (s->queue_count < INDEX_IO(n)) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            warn_reportf_err(local_err, "Using %u of %u NVMe queue pairs: ",
+                             s->queue_count - 1, n);
+            break;
+        }
+    }
+
+    if (s->irq_coalescing_time) {
+        cmd = (NvmeCmd) {
+            .opcode = NVME_ADM_CMD_SET_FEATURES,
+            .cdw10 = cpu_to_le32(NVME_INTERRUPT_COALESCING),
+            .cdw11 = cpu_to_le32(s->irq_coalescing_time << 8 |
+                                 s->irq_coalescing_threshold),
+        };
+        if (nvme_admin_cmd_sync(bs, &cmd)) {
+            error_setg(errp, "Failed to configure NVMe interrupt coalescing");
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Pick the I/O queue pair with the fewest requests in flight, so that the
+ * submissions of one AioContext are spread over all the queue pairs of the
+ * device.  The counts are only a hint and are read without q->lock.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    NVMeQueuePair *best = s->queues[INDEX_IO(0)];
+    int best_load = INT_MAX;
+    unsigned i;
+
+    assert(s->queue_count > 1);
+    for (i = INDEX_IO(0); i < s->queue_count; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        int load = qatomic_read(&q->inflight) + qatomic_read(&q->need_kick);
+
+        if (load < best_load) {
+            best = q;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -701,7 +794,7 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
@@ -717,6 +810,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     qemu_co_queue_init(&s->dma_flush_queue);
     s->device = g_strdup(device);
     s->nsid = namespace;
+    s->io_queues = io_queues;
     s->aio_context = bdrv_get_aio_context(bs);
     ret = event_notifier_init(&s->irq_notifier[MSIX_SHARED_IRQ_IDX], 0);
     if (ret) {
@@ -840,7 +934,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_add_io_queues(bs, errp)) {
         ret = -EIO;
     }
 out:
@@ -932,6 +1026,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t io_queues, irq_time, irq_threshold;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -947,7 +1042,33 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_QUEUES, 1);
+    irq_time = qemu_opt_get_number(opts, NVME_BLOCK_OPT_IRQ_COALESCING_TIME, 0);
+    irq_threshold = qemu_opt_get_number(opts,
+                                        NVME_BLOCK_OPT_IRQ_COALESCING_THRESHOLD,
+                                        1);
+    if (io_queues < 1 || io_queues > UINT16_MAX) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_QUEUES "' must be between 1 and %d",
+                   UINT16_MAX);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    if (irq_time > 25500) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IRQ_COALESCING_TIME
+                   "' must be at most 25500");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    if (irq_threshold < 1 || irq_threshold > 256) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IRQ_COALESCING_THRESHOLD
+                   "' must be between 1 and 256");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->irq_coalescing_time = DIV_ROUND_UP(irq_time, 100);
+    s->irq_coalescing_threshold = irq_threshold - 1;
+
+    ret = nvme_init(bs, device, namespace, io_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1119,7 +1240,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1137,7 +1258,6 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->queue_count > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1237,7 +1357,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1248,7 +1368,6 @@ static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
         .ret = -EINPROGRESS,
     };
 
-    assert(s->queue_count > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
@@ -1268,7 +1387,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1300,7 +1419,6 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     cmd.cdw12 = cpu_to_le32(cdw12);
 
     trace_nvme_write_zeroes(s, offset, bytes, flags);
-    assert(s->queue_count > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1321,7 +1439,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
@@ -89,6 +89,7 @@ typedef struct Qcow2Bitmap {
     char *name;
 
     BdrvDirtyBitmap *dirty_bitmap;
+    bool store_in_place;    /* update the data that table points to */
 
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
@@ -219,6 +220,25 @@ static void clear_bitmap_table(BlockDriverState *bs, uint64_t *bitmap_table,
     }
 }
 
+/* Free the clusters that @bitmap_table references and @other_table does not */
+static void clear_bitmap_table_diff(BlockDriverState *bs,
+                                    const uint64_t *bitmap_table,
+                                    const uint64_t *other_table,
+                                    uint32_t bitmap_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < bitmap_table_size; ++i) {
+        uint64_t addr = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        if (!addr || addr == (other_table[i] & BME_TABLE_ENTRY_OFFSET_MASK)) {
+            continue;
+        }
+
+        qcow2_free_clusters(bs, addr, s->cluster_size, QCOW2_DISCARD_ALWAYS);
+    }
+}
+
 static int bitmap_table_load(BlockDriverState *bs, Qcow2BitmapTable *tb,
                              uint64_t **bitmap_table)
 {
@@ -339,6 +359,7 @@ static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
                                     Qcow2Bitmap *bm, Error **errp)
 {
     int ret;
+    BDRVQcow2State *s = bs->opaque;
     uint64_t *bitmap_table = NULL;
     uint32_t granularity;
     BdrvDirtyBitmap *bitmap = NULL;
@@ -369,6 +390,10 @@ static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Only the clusters that change will have to be written back */
+    bdrv_dirty_bitmap_track_changes(bitmap,
+        bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap));
+
     g_free(bitmap_table);
     return bitmap;
 
@@ -1264,6 +1289,43 @@ out:
     return ret;
 }
 
+/* store_bitmap_cluster()
+ * Write the part of @bitmap from @offset to @end to the cluster at @off,
+ * using @buf as a cluster-sized buffer.
+ */
+static int store_bitmap_cluster(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                                uint8_t *buf, int64_t off,
+                                uint64_t offset, uint64_t end, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t write_size;
+    int ret;
+
+    write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
+                                                      end - offset);
+    assert(write_size <= s->cluster_size);
+
+    bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
+    if (write_size < s->cluster_size) {
+        memset(buf + write_size, 0, s->cluster_size - write_size);
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        return ret;
+    }
+
+    ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                         bdrv_dirty_bitmap_name(bitmap));
+        return ret;
+    }
+
+    return 0;
+}
+
 /* store_bitmap_data()
  * Store bitmap to image, filling bitmap table accordingly.
  */
@@ -1305,7 +1367,7 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
            >= 0)
     {
         uint64_t cluster = offset / limit;
-        uint64_t end, write_size;
+        uint64_t end;
         int64_t off;
 
         /*
@@ -1315,9 +1377,6 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
          */
         offset = QEMU_ALIGN_DOWN(offset, limit);
         end = MIN(bm_size, offset + limit);
-        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
-                                                          end - offset);
-        assert(write_size <= s->cluster_size);
 
         off = qcow2_alloc_clusters(bs, s->cluster_size);
         if (off < 0) {
@@ -1328,21 +1387,8 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
         }
         tb[cluster] = off;
 
-        bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
-        if (write_size < s->cluster_size) {
-            memset(buf + write_size, 0, s->cluster_size - write_size);
-        }
-
-        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
+        ret = store_bitmap_cluster(bs, bitmap, buf, off, offset, end, errp);
         if (ret < 0) {
-            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
-            goto fail;
-        }
-
-        ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
-        if (ret < 0) {
-            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
-                             bm_name);
             goto fail;
         }
 
@@ -1362,6 +1408,141 @@ fail:
     return NULL;
 }
 
+/* store_bitmap_data_in_place()
+ * Update the bitmap data that @old_tb points to, writing only the clusters
+ * whose part of the bitmap changed since it was loaded or last stored.
+ * Clusters are allocated for the parts that were empty and are not any more.
+ * Returns the new bitmap table; the clusters of @old_tb that it does not
+ * reference any more are still allocated.
+ */
+static uint64_t *store_bitmap_data_in_place(BlockDriverState *bs,
+                                            BdrvDirtyBitmap *bitmap,
+                                            const uint64_t *old_tb,
+                                            uint32_t tb_size, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset, limit;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint8_t *buf = NULL;
+    uint64_t *tb;
+    uint32_t i;
+
+    tb = g_memdup(old_tb, tb_size * sizeof(tb[0]));
+    limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
+    assert(DIV_ROUND_UP(bm_size, limit) == tb_size);
+
+    for (i = 0, offset = 0; i < tb_size; ++i, offset += limit) {
+        uint64_t end = MIN(bm_size, offset + limit);
+        int64_t off = old_tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (!bdrv_dirty_bitmap_changed(bitmap, offset, end - offset)) {
+            continue;
+        }
+
+        if (bdrv_dirty_bitmap_next_dirty(bitmap, offset, end - offset) < 0) {
+            tb[i] = 0;
+            continue;
+        }
+
+        if (!off) {
+            off = qcow2_alloc_clusters(bs, s->cluster_size);
+            if (off < 0) {
+                error_setg_errno(errp, -off,
+                                 "Failed to allocate clusters for bitmap '%s'",
+                                 bdrv_dirty_bitmap_name(bitmap));
+                goto fail;
+            }
+        }
+        tb[i] = off;
+
+        if (!buf) {
+            buf = g_malloc(s->cluster_size);
+        }
+        ret = store_bitmap_cluster(bs, bitmap, buf, off, offset, end, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    g_free(buf);
+
+    return tb;
+
+fail:
+    clear_bitmap_table_diff(bs, tb, old_tb, tb_size);
+    g_free(buf);
+    g_free(tb);
+
+    return NULL;
+}
+
+/* store_bitmap_in_place()
+ * Store bm->dirty_bitmap to the bitmap table and data that bm->table points
+ * to.  This is only safe while the bitmap is marked in use in the image, as
+ * the data is inconsistent until all the clusters are written.
+ */
+static int store_bitmap_in_place(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                 Error **errp)
+{
+    int ret;
+    uint64_t *old_tb, *tb, *be_tb;
+    uint32_t tb_size = bm->table.size;
+    BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+
+    ret = bitmap_table_load(bs, &bm->table, &old_tb);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Could not read bitmap_table table from image for "
+                         "bitmap '%s'", bm_name);
+        return ret;
+    }
+
+    tb = store_bitmap_data_in_place(bs, bitmap, old_tb, tb_size, errp);
+    if (tb == NULL) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!memcmp(tb, old_tb, tb_size * sizeof(tb[0]))) {
+        goto out;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, bm->table.offset,
+                                        tb_size * sizeof(tb[0]), false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        clear_bitmap_table_diff(bs, tb, old_tb, tb_size);
+        goto out;
+    }
+
+    be_tb = g_memdup(tb, tb_size * sizeof(tb[0]));
+    bitmap_table_to_be(be_tb, tb_size);
+    ret = bdrv_pwrite(bs->file, bm->table.offset, be_tb,
+                      tb_size * sizeof(tb[0]));
+    g_free(be_tb);
+    if (ret < 0) {
+        /*
+         * Part of the table may have been written: leak the new clusters
+         * rather than leave entries that point to free ones.
+         */
+        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                         bm_name);
+        goto out;
+    }
+
+    /* The table does not reference them any more */
+    clear_bitmap_table_diff(bs, old_tb, tb, tb_size);
+    ret = 0;
+
+out:
+    g_free(old_tb);
+    g_free(tb);
+
+    return ret;
+}
+
 /* store_bitmap()
  * Store bm->dirty_bitmap to qcow2.
  * Set bm->table_offset and bm->table_size accordingly.
@@ -1377,6 +1558,10 @@ static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
 
     assert(bitmap != NULL);
 
+    if (bm->store_in_place) {
+        return store_bitmap_in_place(bs, bm, errp);
+    }
+
     bm_name = bdrv_dirty_bitmap_name(bitmap);
 
     tb = store_bitmap_data(bs, bitmap, &tb_size, errp);
@@ -1594,15 +1779,29 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             bm->name = g_strdup(name);
             QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
         } else {
+            uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+
             if (!(bm->flags & BME_FLAG_IN_USE)) {
                 error_setg(errp, "Bitmap '%s' already exists in the image",
                            name);
                 goto fail;
             }
-            tb = g_memdup(&bm->table, sizeof(bm->table));
-            bm->table.offset = 0;
-            bm->table.size = 0;
-            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            if (bm->table.offset &&
+                bm->granularity_bits == ctz32(granularity) &&
+                bm->table.size == size_to_clusters(s,
+                    bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size)))
+            {
+                /*
+                 * The image has the bitmap marked in use, so its clusters
+                 * can be rewritten where they are.
+                 */
+                bm->store_in_place = true;
+            } else {
+                tb = g_memdup(&bm->table, sizeof(bm->table));
+                bm->table.offset = 0;
+                bm->table.size = 0;
+                QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            }
         }
         bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
@@ -1645,6 +1844,21 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
         g_free(tb);
     }
 
+    /* The image is up to date, the next store only writes what changes */
+    if (!release_stored) {
+        QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+            BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+
+            if (bitmap == NULL || bdrv_dirty_bitmap_readonly(bitmap)) {
+                continue;
+            }
+
+            bdrv_dirty_bitmap_track_changes(bitmap,
+                bdrv_dirty_bitmap_serialization_coverage(s->cluster_size,
+                                                         bitmap));
+        }
+    }
+
 success:
     if (release_stored) {
         QSIMPLEQ_FOREACH(bm, bm_list, entry) {
@@ -1662,6 +1876,7 @@ success:
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
+            bm->store_in_place ||
             bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
         {
             continue;
@@ -759,6 +759,17 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     }
 
     assert(l1_index < s->l1_size);
+
+    /* The last snapshot must own its clusters before they can change */
+    if (s->snapshot_refcount_pending &&
+        l1_index < s->snapshot_refcount_pending_size &&
+        test_bit(l1_index, s->snapshot_refcount_pending)) {
+        ret = qcow2_snapshot_refcount_pending_entry(bs, l1_index);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
     if (offset_into_cluster(s, l2_offset)) {
         qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#" PRIx64
@@ -1583,14 +1594,25 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+            qcow2_alloc_reserved_clusters(bs, INV_OFFSET, nb_clusters);
         if (cluster_offset < 0) {
             return cluster_offset;
         }
         *host_offset = cluster_offset;
         return 0;
     } else {
-        int64_t ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
+        uint64_t nb_reserved = *nb_clusters;
+        int64_t ret = qcow2_alloc_reserved_clusters(bs, *host_offset,
+                                                    &nb_reserved);
+        if (ret < 0) {
+            return ret;
+        }
+        if (nb_reserved) {
+            *nb_clusters = nb_reserved;
+            return 0;
+        }
+
+        ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
         if (ret < 0) {
             return ret;
         }
@@ -2389,6 +2411,11 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
     int ret;
     int i, j;
 
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (status_cb) {
         l1_entries = s->l1_size;
         for (i = 0; i < s->nb_snapshots; i++) {
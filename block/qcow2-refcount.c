@@ -1063,6 +1063,69 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocating writes reserve this much at once, so that most of them don't
+ * need to update (and maybe load) a refcount block while holding s->lock.
+ * Clusters that are still reserved when QEMU is killed are leaked, like
+ * the ones of a write that was cut short.
+ */
+#define QCOW2_RESERVE_SIZE (4 * MiB)
+
+/*
+ * Allocate up to *nb_clusters data clusters from the reserved ones, taking
+ * a new reservation if needed.  If @offset is not INV_OFFSET, they must
+ * start there, and *nb_clusters is set to 0 if they can't.
+ *
+ * Returns the offset of the first cluster, with *nb_clusters updated to the
+ * number of clusters allocated, or -errno.
+ */
+int64_t qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t offset,
+                                      uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t reserved;
+    uint64_t n;
+
+    if (offset != INV_OFFSET && (!s->nb_reserved_clusters ||
+                                 offset != s->reserved_cluster_offset)) {
+        *nb_clusters = 0;
+        return offset;
+    }
+
+    if (!s->nb_reserved_clusters) {
+        n = MAX(*nb_clusters, QCOW2_RESERVE_SIZE >> s->cluster_bits);
+        reserved = qcow2_alloc_clusters(bs, n << s->cluster_bits);
+        if (reserved < 0) {
+            return reserved;
+        }
+        s->reserved_cluster_offset = reserved;
+        s->nb_reserved_clusters = n;
+    }
+
+    n = MIN(*nb_clusters, s->nb_reserved_clusters);
+    offset = s->reserved_cluster_offset;
+    s->reserved_cluster_offset += n << s->cluster_bits;
+    s->nb_reserved_clusters -= n;
+    *nb_clusters = n;
+    return offset;
+}
+
+/*
+ * Drop the reserved clusters, before anything that walks the refcounts or
+ * needs the end of the image to be free.
+ */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->nb_reserved_clusters) {
+        qcow2_free_clusters(bs, s->reserved_cluster_offset,
+                            s->nb_reserved_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->nb_reserved_clusters = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1238,25 +1301,168 @@ int coroutine_fn qcow2_flush_caches(BlockDriverState *bs)
 
 
 
+/*
+ * Update the refcounts of the L2 table that @l1_entry points to and of
+ * its clusters, and the copied flags of its entries.  @l1_entry gets
+ * the copied flag of the L2 table.  @l1_index is only used in error
+ * messages.
+ */
+static int update_l2_snapshot_refcount(BlockDriverState *bs,
+                                       uint64_t *l1_entry, int l1_index,
+                                       int addend)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice = NULL, l2_offset, entry, refcount;
+    int64_t old_entry;
+    unsigned slice, slice_size2, n_slices;
+    int j, nb_csectors;
+    int ret;
+
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
+    l2_offset = *l1_entry & L1E_OFFSET_MASK;
+
+    if (offset_into_cluster(s, l2_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
+                                PRIx64 " unaligned (L1 index: %#x)",
+                                l2_offset, l1_index);
+        return -EIO;
+    }
+
+    for (slice = 0; slice < n_slices; slice++) {
+        ret = qcow2_cache_get(bs, s->l2_table_cache,
+                              l2_offset + slice * slice_size2,
+                              (void **) &l2_slice);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (j = 0; j < s->l2_slice_size; j++) {
+            uint64_t cluster_index;
+            uint64_t offset;
+
+            entry = get_l2_entry(s, l2_slice, j);
+            old_entry = entry;
+            entry &= ~QCOW_OFLAG_COPIED;
+            offset = entry & L2E_OFFSET_MASK;
+
+            switch (qcow2_get_cluster_type(bs, entry)) {
+            case QCOW2_CLUSTER_COMPRESSED:
+                nb_csectors = ((entry >> s->csize_shift) &
+                               s->csize_mask) + 1;
+                if (addend != 0) {
+                    uint64_t coffset = (entry & s->cluster_offset_mask)
+                        & QCOW2_COMPRESSED_SECTOR_MASK;
+                    ret = update_refcount(
+                        bs, coffset,
+                        nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE,
+                        abs(addend), addend < 0,
+                        QCOW2_DISCARD_SNAPSHOT);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+                /* compressed clusters are never modified */
+                refcount = 2;
+                break;
+
+            case QCOW2_CLUSTER_NORMAL:
+            case QCOW2_CLUSTER_ZERO_ALLOC:
+                if (offset_into_cluster(s, offset)) {
+                    /* Here l2_index means table (not slice) index */
+                    int l2_index = slice * s->l2_slice_size + j;
+                    qcow2_signal_corruption(
+                        bs, true, -1, -1, "Cluster "
+                        "allocation offset %#" PRIx64
+                        " unaligned (L2 offset: %#"
+                        PRIx64 ", L2 index: %#x)",
+                        offset, l2_offset, l2_index);
+                    ret = -EIO;
+                    goto fail;
+                }
+
+                cluster_index = offset >> s->cluster_bits;
+                assert(cluster_index);
+                if (addend != 0) {
+                    ret = qcow2_update_cluster_refcount(
+                        bs, cluster_index, abs(addend), addend < 0,
+                        QCOW2_DISCARD_SNAPSHOT);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+
+                ret = qcow2_get_refcount(bs, cluster_index, &refcount);
+                if (ret < 0) {
+                    goto fail;
+                }
+                break;
+
+            case QCOW2_CLUSTER_ZERO_PLAIN:
+            case QCOW2_CLUSTER_UNALLOCATED:
+                refcount = 0;
+                break;
+
+            default:
+                abort();
+            }
+
+            if (refcount == 1) {
+                entry |= QCOW_OFLAG_COPIED;
+            }
+            if (entry != old_entry) {
+                if (addend > 0) {
+                    qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                               s->refcount_block_cache);
+                }
+                set_l2_entry(s, l2_slice, j, entry);
+                qcow2_cache_entry_mark_dirty(s->l2_table_cache,
+                                             l2_slice);
+            }
+        }
+
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+
+    if (addend != 0) {
+        ret = qcow2_update_cluster_refcount(bs, l2_offset >>
+                                                s->cluster_bits,
+                                            abs(addend), addend < 0,
+                                            QCOW2_DISCARD_SNAPSHOT);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
+                             &refcount);
+    if (ret < 0) {
+        return ret;
+    } else if (refcount == 1) {
+        l2_offset |= QCOW_OFLAG_COPIED;
+    }
+    *l1_entry = l2_offset;
+    return 0;
+
+fail:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
 /* update the refcounts of snapshots and the copied flag */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_slice, l2_offset, entry, l1_size2, refcount;
+    uint64_t *l1_table, l1_size2;
     bool l1_allocated = false;
-    int64_t old_entry, old_l2_offset;
-    unsigned slice, slice_size2, n_slices;
-    int i, j, l1_modified = 0, nb_csectors;
+    int i, l1_modified = 0;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
-    l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * L1E_SIZE;
-    slice_size2 = s->l2_slice_size * l2_entry_size(s);
-    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -1286,132 +1492,15 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     }
 
     for (i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            old_l2_offset = l2_offset;
-            l2_offset &= L1E_OFFSET_MASK;
-
-            if (offset_into_cluster(s, l2_offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
-                                        PRIx64 " unaligned (L1 index: %#x)",
-                                        l2_offset, i);
-                ret = -EIO;
-                goto fail;
-            }
-
-            for (slice = 0; slice < n_slices; slice++) {
-                ret = qcow2_cache_get(bs, s->l2_table_cache,
-                                      l2_offset + slice * slice_size2,
-                                      (void **) &l2_slice);
-                if (ret < 0) {
-                    goto fail;
-                }
-
-                for (j = 0; j < s->l2_slice_size; j++) {
-                    uint64_t cluster_index;
-                    uint64_t offset;
-
-                    entry = get_l2_entry(s, l2_slice, j);
-                    old_entry = entry;
-                    entry &= ~QCOW_OFLAG_COPIED;
-                    offset = entry & L2E_OFFSET_MASK;
-
-                    switch (qcow2_get_cluster_type(bs, entry)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((entry >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            uint64_t coffset = (entry & s->cluster_offset_mask)
-                                & QCOW2_COMPRESSED_SECTOR_MASK;
-                            ret = update_refcount(
-                                bs, coffset,
-                                nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE,
-                                abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO_ALLOC:
-                        if (offset_into_cluster(s, offset)) {
-                            /* Here l2_index means table (not slice) index */
-                            int l2_index = slice * s->l2_slice_size + j;
-                            qcow2_signal_corruption(
-                                bs, true, -1, -1, "Cluster "
-                                "allocation offset %#" PRIx64
-                                " unaligned (L2 offset: %#"
-                                PRIx64 ", L2 index: %#x)",
-                                offset, l2_offset, l2_index);
-                            ret = -EIO;
-                            goto fail;
-                        }
-
-                        cluster_index = offset >> s->cluster_bits;
-                        assert(cluster_index);
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(
-                                bs, cluster_index, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
+        uint64_t l1_entry = l1_table[i];
 
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
-
-                    case QCOW2_CLUSTER_ZERO_PLAIN:
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
-
-                    default:
-                        abort();
-                    }
-
-                    if (refcount == 1) {
-                        entry |= QCOW_OFLAG_COPIED;
-                    }
-                    if (entry != old_entry) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                                       s->refcount_block_cache);
-                        }
-                        set_l2_entry(s, l2_slice, j, entry);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache,
-                                                     l2_slice);
-                    }
-                }
-
-                qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-            }
-
-            if (addend != 0) {
-                ret = qcow2_update_cluster_refcount(bs, l2_offset >>
-                                                        s->cluster_bits,
-                                                    abs(addend), addend < 0,
-                                                    QCOW2_DISCARD_SNAPSHOT);
-                if (ret < 0) {
-                    goto fail;
-                }
-            }
-            ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
-                                     &refcount);
+        if (l1_entry) {
+            ret = update_l2_snapshot_refcount(bs, &l1_entry, i, addend);
             if (ret < 0) {
                 goto fail;
-            } else if (refcount == 1) {
-                l2_offset |= QCOW_OFLAG_COPIED;
             }
-            if (l2_offset != old_l2_offset) {
-                l1_table[i] = l2_offset;
+            if (l1_entry != l1_table[i]) {
+                l1_table[i] = l1_entry;
                 l1_modified = 1;
             }
         }
@@ -1419,10 +1508,6 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_slice) {
-        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-    }
-
     s->cache_discards = false;
     qcow2_process_discards(bs, ret);
 
@@ -1444,6 +1529,32 @@ fail:
     return ret;
 }
 
+/*
+ * Add a reference to the L2 table of entry @l1_index of the active L1
+ * table and to its clusters, like qcow2_update_snapshot_refcount() does
+ * for the whole table, and write the L1 entry if its copied flag
+ * changed.  Unlike qcow2_update_snapshot_refcount(), this does not
+ * flush: it is only used while the image is marked dirty.
+ */
+int qcow2_update_snapshot_refcount_entry(BlockDriverState *bs, int l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_entry = s->l1_table[l1_index];
+    int ret;
+
+    if (!l1_entry) {
+        return 0;
+    }
+
+    ret = update_l2_snapshot_refcount(bs, &l1_entry, l1_index, 1);
+    if (ret < 0 || l1_entry == s->l1_table[l1_index]) {
+        return ret;
+    }
+
+    s->l1_table[l1_index] = l1_entry;
+    return qcow2_write_l1_entry(bs, l1_index);
+}
+
 
 
 
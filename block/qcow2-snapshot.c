@@ -29,6 +29,8 @@
 #include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
+#include "trace.h"
 
 static void qcow2_free_single_snapshot(BlockDriverState *bs, int i)
 {
@@ -630,6 +632,98 @@ static int find_snapshot_by_id_or_name(BlockDriverState *bs,
     return find_snapshot_by_id_and_name(bs, NULL, id_or_name);
 }
 
+/*
+ * With lazy refcounts, qcow2_snapshot_create() does not add the
+ * reference of the new snapshot to the clusters of the active L1 table
+ * right away.  Instead, the L1 entries are marked as pending, and a
+ * coroutine updates their refcounts a few at a time.  As long as an
+ * entry is pending, its L2 table and clusters have the copied flag of
+ * the active image only, so any change to it goes through
+ * get_cluster_table(), which first runs the update for that entry.
+ * The image is marked dirty beforehand, so that the refcounts are
+ * repaired if QEMU stops before the updates are done.
+ */
+
+/* Number of L1 entries that the coroutine updates before yielding */
+#define QCOW2_SNAPSHOT_REFCOUNT_BATCH 16
+
+int qcow2_snapshot_refcount_pending_entry(BlockDriverState *bs, int l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_update_snapshot_refcount_entry(bs, l1_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    clear_bit(l1_index, s->snapshot_refcount_pending);
+    if (find_first_bit(s->snapshot_refcount_pending,
+                       s->snapshot_refcount_pending_size) ==
+        s->snapshot_refcount_pending_size) {
+        g_free(s->snapshot_refcount_pending);
+        s->snapshot_refcount_pending = NULL;
+        s->snapshot_refcount_pending_size = 0;
+    }
+    return 0;
+}
+
+/* Update the refcounts of all the pending L1 entries */
+int qcow2_snapshot_refcount_finish(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->snapshot_refcount_pending) {
+        return 0;
+    }
+
+    while (s->snapshot_refcount_pending) {
+        ret = qcow2_snapshot_refcount_pending_entry(bs,
+                  find_first_bit(s->snapshot_refcount_pending,
+                                 s->snapshot_refcount_pending_size));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return bdrv_flush(bs);
+}
+
+static void coroutine_fn qcow2_snapshot_refcount_co(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    int i, ret = 0;
+
+    while (s->snapshot_refcount_pending && ret == 0) {
+        qemu_co_mutex_lock(&s->lock);
+        for (i = 0; i < QCOW2_SNAPSHOT_REFCOUNT_BATCH &&
+                    s->snapshot_refcount_pending; i++) {
+            ret = qcow2_snapshot_refcount_pending_entry(bs,
+                      find_first_bit(s->snapshot_refcount_pending,
+                                     s->snapshot_refcount_pending_size));
+            if (ret < 0) {
+                break;
+            }
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
+        /* Let the guest requests run */
+        aio_co_schedule(bdrv_get_aio_context(bs), qemu_coroutine_self());
+        qemu_coroutine_yield();
+    }
+
+    if (ret < 0) {
+        /* The next snapshot operation, or the next open, will retry */
+        error_report("qcow2: updating the refcounts of a snapshot "
+                     "failed: %s", strerror(-ret));
+    } else {
+        bdrv_co_flush(bs);
+    }
+    trace_qcow2_snapshot_refcount_done(bs, ret);
+    bdrv_dec_in_flight(bs);
+}
+
 /* if no id is provided, a new one is constructed */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 {
@@ -637,6 +731,7 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     QCowSnapshot *new_snapshot_list = NULL;
     QCowSnapshot *old_snapshot_list = NULL;
     QCowSnapshot sn1, *sn = &sn1;
+    bool lazy;
     int i, ret;
     uint64_t *l1_table = NULL;
     int64_t l1_table_offset;
@@ -649,6 +744,12 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         return -ENOTSUP;
     }
 
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    lazy = s->use_lazy_refcounts;
+
     memset(sn, 0, sizeof(*sn));
 
     /* Generate an ID */
@@ -701,12 +802,18 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     g_free(l1_table);
     l1_table = NULL;
 
-    /*
-     * Increase the refcounts of all clusters and make sure everything is
-     * stable on disk before updating the snapshot table to contain a pointer
-     * to the new L1 table.
-     */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1);
+    if (lazy) {
+        /* The refcounts are repaired on open until the updates are done */
+        ret = qcow2_mark_dirty(bs);
+    } else {
+        /*
+         * Increase the refcounts of all clusters and make sure everything
+         * is stable on disk before updating the snapshot table to contain
+         * a pointer to the new L1 table.
+         */
+        ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset,
+                                             s->l1_size, 1);
+    }
     if (ret < 0) {
         goto fail;
     }
@@ -731,6 +838,22 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 
     g_free(old_snapshot_list);
 
+    if (lazy && s->l1_size) {
+        Coroutine *co;
+
+        s->snapshot_refcount_pending = bitmap_new(s->l1_size);
+        s->snapshot_refcount_pending_size = s->l1_size;
+        for (i = 0; i < s->l1_size; i++) {
+            if (s->l1_table[i]) {
+                set_bit(i, s->snapshot_refcount_pending);
+            }
+        }
+        trace_qcow2_snapshot_refcount_start(bs, s->l1_size);
+        bdrv_inc_in_flight(bs);
+        co = qemu_coroutine_create(qcow2_snapshot_refcount_co, bs);
+        aio_co_schedule(bdrv_get_aio_context(bs), co);
+    }
+
     /* The VM state isn't needed any more in the active L1 table; in fact, it
      * hurts by causing expensive COW for the next snapshot. */
     qcow2_cluster_discard(bs, qcow2_vm_state_offset(s),
@@ -768,6 +891,11 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         return -ENOTSUP;
     }
 
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -916,6 +1044,13 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
         return -ENOTSUP;
     }
 
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update the refcounts of "
+                         "the last snapshot");
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_and_name(bs, snapshot_id, name);
     if (snapshot_index < 0) {
@@ -79,6 +79,8 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t bytes,
                            QEMUIOVector *qiov,
                            size_t qiov_offset);
+static void qcow2_decompressed_cache_clear(BlockDriverState *bs,
+                                           bool free_buffers);
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -610,6 +612,7 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
     int ret;
 
     memset(result, 0, sizeof(*result));
+    qcow2_release_reserved_clusters(bs);
 
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
@@ -2683,6 +2686,16 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_release_reserved_clusters(bs);
+
+    /* The image must stay dirty if the snapshot refcounts are not right */
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        result = ret;
+        error_report("Failed to update the snapshot refcounts: %s",
+                     strerror(-ret));
+    }
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2726,11 +2739,13 @@ static void qcow2_close(BlockDriverState *bs)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_decompressed_cache_clear(bs, true);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
 
+    g_free(s->snapshot_refcount_pending);
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
@@ -4200,6 +4215,8 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
 
     qemu_co_mutex_lock(&s->lock);
 
+    qcow2_release_reserved_clusters(bs);
+
     /*
      * Even though we store snapshot size for all images, it was not
      * required until v3, so it is not safe to proceed for v2.
@@ -4594,6 +4611,7 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
         qemu_co_mutex_unlock(&s->lock);
         goto fail;
     }
+    qcow2_decompressed_cache_clear(bs, false);
 
     ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
     qemu_co_mutex_unlock(&s->lock);
@@ -4691,6 +4709,82 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Drop the decompressed clusters, and if @free_buffers is true their
+ * buffers too.  Reads that are decompressing a cluster at the same time
+ * will not add it.
+ */
+static void qcow2_decompressed_cache_clear(BlockDriverState *bs,
+                                           bool free_buffers)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESSED_CACHE_SIZE; i++) {
+        s->decompressed_cache[i].cluster_descriptor = 0;
+        s->decompressed_cache[i].lru_counter = 0;
+        if (free_buffers) {
+            qemu_vfree(s->decompressed_cache[i].data);
+            s->decompressed_cache[i].data = NULL;
+        }
+    }
+    s->decompressed_cache_gen++;
+}
+
+/* Copy @bytes of the decompressed cluster to @qiov, if it is cached */
+static bool qcow2_decompressed_cache_read(BlockDriverState *bs,
+                                          uint64_t cluster_descriptor,
+                                          int offset_in_cluster,
+                                          uint64_t bytes, QEMUIOVector *qiov,
+                                          size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESSED_CACHE_SIZE; i++) {
+        if (s->decompressed_cache[i].cluster_descriptor == cluster_descriptor) {
+            s->decompressed_cache[i].lru_counter =
+                ++s->decompressed_lru_counter;
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                s->decompressed_cache[i].data +
+                                offset_in_cluster, bytes);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Add a decompressed cluster in place of the least recently used one.
+ * *@data becomes the buffer of the entry, and the caller gets its old
+ * buffer (or NULL) to free.
+ */
+static void qcow2_decompressed_cache_insert(BlockDriverState *bs,
+                                            uint64_t cluster_descriptor,
+                                            uint8_t **data)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i, lru = 0;
+    uint8_t *old;
+
+    for (i = 0; i < QCOW2_DECOMPRESSED_CACHE_SIZE; i++) {
+        if (s->decompressed_cache[i].cluster_descriptor == cluster_descriptor) {
+            /* Another read of the same cluster got there first */
+            return;
+        }
+        if (s->decompressed_cache[i].lru_counter <
+            s->decompressed_cache[lru].lru_counter) {
+            lru = i;
+        }
+    }
+
+    old = s->decompressed_cache[lru].data;
+    s->decompressed_cache[lru].cluster_descriptor = cluster_descriptor;
+    s->decompressed_cache[lru].data = *data;
+    s->decompressed_cache[lru].lru_counter = ++s->decompressed_lru_counter;
+    *data = old;
+}
+
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t cluster_descriptor,
@@ -4701,10 +4795,17 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     int ret = 0, csize, nb_csectors;
-    uint64_t coffset;
+    uint64_t coffset, gen;
     uint8_t *buf, *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
 
+    if (qcow2_decompressed_cache_read(bs, cluster_descriptor,
+                                      offset_in_cluster, bytes,
+                                      qiov, qiov_offset)) {
+        return 0;
+    }
+    gen = s->decompressed_cache_gen;
+
     coffset = cluster_descriptor & s->cluster_offset_mask;
     nb_csectors = ((cluster_descriptor >> s->csize_shift) & s->csize_mask) + 1;
     csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
@@ -4730,6 +4831,11 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
 
     qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
 
+    /* Unless a compressed cluster was written in the meantime */
+    if (gen == s->decompressed_cache_gen) {
+        qcow2_decompressed_cache_insert(bs, cluster_descriptor, &out_buf);
+    }
+
 fail:
     qemu_vfree(out_buf);
     g_free(buf);
@@ -4895,6 +5001,7 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int step = QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size);
     int l1_clusters, ret = 0;
 
+    qcow2_release_reserved_clusters(bs);
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
@@ -5489,6 +5596,8 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     Qcow2AmendHelperCBInfo helper_cb_info;
     bool encryption_update = false;
 
+    qcow2_release_reserved_clusters(bs);
+
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
             /* only change explicitly defined options */
@@ -71,6 +71,9 @@
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
+/* Number of decompressed clusters that are kept for the next reads */
+#define QCOW2_DECOMPRESSED_CACHE_SIZE 8
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -357,6 +360,13 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Data clusters whose refcount was already increased, for the next
+     * allocating writes to use without touching the refcount blocks.
+     */
+    uint64_t reserved_cluster_offset;
+    uint64_t nb_reserved_clusters;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -369,6 +379,13 @@ typedef struct BDRVQcow2State {
     int snapshots_size;
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
+    /*
+     * With lazy refcounts, the entries of the active L1 table whose
+     * clusters still miss the reference of the last snapshot.  NULL
+     * when there are none.
+     */
+    unsigned long *snapshot_refcount_pending;
+    int snapshot_refcount_pending_size;
 
     uint32_t nb_bitmaps;
     uint64_t bitmap_directory_size;
@@ -420,6 +437,20 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /*
+     * Compressed clusters that were recently read, for reads that hit the
+     * same cluster again not to decompress it once more.  Entries are
+     * keyed by the cluster descriptor; they all go away when a compressed
+     * cluster is written, since its host offset may have been reused.
+     */
+    struct {
+        uint64_t cluster_descriptor; /* 0 if the entry is unused */
+        uint8_t *data;
+        uint64_t lru_counter;
+    } decompressed_cache[QCOW2_DECOMPRESSED_CACHE_SIZE];
+    uint64_t decompressed_lru_counter;
+    uint64_t decompressed_cache_gen;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -863,6 +894,9 @@ int64_t qcow2_refcount_area(BlockDriverState *bs, uint64_t offset,
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
+int64_t qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t offset,
+                                      uint64_t *nb_clusters);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
@@ -872,6 +906,7 @@ void qcow2_free_any_cluster(BlockDriverState *bs, uint64_t l2_entry,
 
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
+int qcow2_update_snapshot_refcount_entry(BlockDriverState *bs, int l1_index);
 
 int coroutine_fn qcow2_flush_caches(BlockDriverState *bs);
 int coroutine_fn qcow2_write_caches(BlockDriverState *bs);
@@ -935,6 +970,8 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
                           const char *name,
                           Error **errp);
 int qcow2_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab);
+int qcow2_snapshot_refcount_pending_entry(BlockDriverState *bs, int l1_index);
+int qcow2_snapshot_refcount_finish(BlockDriverState *bs);
 int qcow2_snapshot_load_tmp(BlockDriverState *bs,
                             const char *snapshot_id,
                             const char *name,
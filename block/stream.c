@@ -21,6 +21,7 @@
 #include "qemu/ratelimit.h"
 #include "sysemu/block-backend.h"
 #include "block/copy-on-read.h"
+#include "block/aio_task.h"
 
 enum {
     /*
@@ -29,8 +30,19 @@ enum {
      * that populating contiguous regions of the image is efficient.
      */
     STREAM_CHUNK = 512 * 1024, /* in bytes */
+
+    /* Default number of chunks that are copied in parallel */
+    STREAM_DEFAULT_MAX_WORKERS = 8,
 };
 
+typedef struct StreamTask {
+    AioTask task;
+    struct StreamBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+    QSIMPLEQ_ENTRY(StreamTask) next;
+} StreamTask;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     BlockDriverState *base_overlay; /* COW overlay (stream from this) */
@@ -40,6 +52,12 @@ typedef struct StreamBlockJob {
     BlockdevOnError on_error;
     char *backing_file_str;
     bool bs_read_only;
+    int max_workers;
+
+    /* First error that was ignored by the copy tasks */
+    int error;
+    /* Chunks whose copy failed with BLOCK_ERROR_ACTION_STOP */
+    QSIMPLEQ_HEAD(, StreamTask) retry_tasks;
 } StreamBlockJob;
 
 static int coroutine_fn stream_populate(BlockBackend *blk,
@@ -50,6 +68,46 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
     return blk_co_preadv(blk, offset, bytes, NULL, BDRV_REQ_PREFETCH);
 }
 
+static int coroutine_fn stream_task_entry(AioTask *task)
+{
+    StreamTask *t = container_of(task, StreamTask, task);
+    StreamBlockJob *s = t->s;
+    BlockErrorAction action;
+    int ret;
+
+    ret = stream_populate(s->common.blk, t->offset, t->bytes);
+    trace_stream_task_done(s, t->offset, t->bytes, ret);
+    if (ret < 0) {
+        action = block_job_error_action(&s->common, s->on_error, true, -ret);
+        if (action == BLOCK_ERROR_ACTION_STOP) {
+            /* The pool frees @t, so queue a copy for when the job resumes */
+            StreamTask *retry = g_memdup(t, sizeof(*t));
+
+            QSIMPLEQ_INSERT_TAIL(&s->retry_tasks, retry, next);
+            return 0;
+        }
+        if (action == BLOCK_ERROR_ACTION_REPORT) {
+            return ret;
+        }
+        if (s->error == 0) {
+            s->error = ret;
+        }
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+static void coroutine_fn stream_task_start(StreamBlockJob *s,
+                                           AioTaskPool *pool,
+                                           StreamTask *t)
+{
+    t->task.func = stream_task_entry;
+    t->s = s;
+    aio_task_pool_start_task(pool, &t->task);
+}
+
 static int stream_prepare(Job *job)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
@@ -105,8 +163,9 @@ static void stream_clean(Job *job)
 static int coroutine_fn stream_run(Job *job, Error **errp)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
-    BlockBackend *blk = s->common.blk;
     BlockDriverState *unfiltered_bs = bdrv_skip_filters(s->target_bs);
+    AioTaskPool *pool;
+    StreamTask *t;
     int64_t len;
     int64_t offset = 0;
     uint64_t delay_ns = 0;
@@ -124,21 +183,47 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     }
     job_progress_set_remaining(&s->common.job, len);
 
-    for ( ; offset < len; offset += n) {
+    pool = aio_task_pool_new(s->max_workers);
+
+    for (;;) {
         bool copy;
         int ret;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  The chunks that are
+         * being copied are waited for by the drain itself.
          */
         job_sleep_ns(&s->common.job, delay_ns);
-        if (job_is_cancelled(&s->common.job)) {
+        if (job_is_cancelled(&s->common.job) ||
+            aio_task_pool_status(pool) < 0) {
             break;
         }
+        delay_ns = 0;
+
+        /* Copy again the chunks that failed before the job was stopped */
+        t = QSIMPLEQ_FIRST(&s->retry_tasks);
+        if (t) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry_tasks, next);
+            stream_task_start(s, pool, t);
+            continue;
+        }
+
+        if (offset == len) {
+            if (aio_task_pool_empty(pool)) {
+                break;
+            }
+            aio_task_pool_wait_one(pool);
+            continue;
+        }
 
         copy = false;
 
-        ret = bdrv_is_allocated(unfiltered_bs, offset, STREAM_CHUNK, &n);
+        /*
+         * Ask about everything up to the end of the image, so that large
+         * extents that are allocated in the top image, or nowhere in the
+         * chain, are skipped at once.
+         */
+        ret = bdrv_is_allocated(unfiltered_bs, offset, len - offset, &n);
         if (ret == 1) {
             /* Allocated in the top, no need to copy.  */
         } else if (ret >= 0) {
@@ -155,14 +240,10 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
             copy = (ret > 0);
         }
         trace_stream_one_iteration(s, offset, n, ret);
-        if (copy) {
-            ret = stream_populate(blk, offset, n);
-        }
         if (ret < 0) {
             BlockErrorAction action =
                 block_job_error_action(&s->common, s->on_error, true, -ret);
             if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
                 continue;
             }
             if (error == 0) {
@@ -171,15 +252,33 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
             if (action == BLOCK_ERROR_ACTION_REPORT) {
                 break;
             }
+            /* Skip the chunk that could not be queried */
+            n = MIN(len - offset, STREAM_CHUNK);
         }
 
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
         if (copy) {
+            n = MIN(n, STREAM_CHUNK);
+            t = g_new0(StreamTask, 1);
+            t->offset = offset;
+            t->bytes = n;
+            stream_task_start(s, pool, t);
             delay_ns = block_job_ratelimit_get_delay(&s->common, n);
         } else {
-            delay_ns = 0;
+            /* Publish progress */
+            job_progress_update(&s->common.job, n);
         }
+        offset += n;
+    }
+
+    aio_task_pool_wait_all(pool);
+    if (error == 0) {
+        error = aio_task_pool_status(pool) ?: s->error;
+    }
+    aio_task_pool_free(pool);
+
+    while ((t = QSIMPLEQ_FIRST(&s->retry_tasks))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry_tasks, next);
+        g_free(t);
     }
 
     /* Do not remove the backing file if an error was there but ignored. */
@@ -201,7 +300,7 @@ static const BlockJobDriver stream_job_driver = {
 void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
                   BlockDriverState *bottom,
-                  int creation_flags, int64_t speed,
+                  int creation_flags, int64_t speed, int max_workers,
                   BlockdevOnError on_error,
                   const char *filter_node_name,
                   Error **errp)
@@ -334,6 +433,8 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     s->cor_filter_bs = cor_filter_bs;
     s->target_bs = bs;
     s->bs_read_only = bs_read_only;
+    s->max_workers = max_workers ?: STREAM_DEFAULT_MAX_WORKERS;
+    QSIMPLEQ_INIT(&s->retry_tasks);
 
     s->on_error = on_error;
     trace_stream_start(bs, base, s);
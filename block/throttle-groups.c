@@ -39,6 +39,12 @@ static void throttle_group_obj_init(Object *obj);
 static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
 static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
 
+/* Requests that a member can account in advance, and how long it can
+ * keep them before they are lost.
+ */
+#define THROTTLE_GROUP_CREDIT_REQS 8
+#define THROTTLE_GROUP_CREDIT_NS   SCALE_MS
+
 /* The ThrottleGroup structure (with its ThrottleState) is shared
  * among different ThrottleGroupMembers and it's independent from
  * AioContext, so in order to use it from different threads it needs
@@ -62,6 +68,13 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * When a request goes through without waiting, the member also accounts a
+ * few requests of the same size in advance, as long as they would not have
+ * to wait either.  Requests that find such credit in their member skip the
+ * lock altogether; this is only done while no timer of the group is armed
+ * for that type of request, i.e. while no member is being throttled, so
+ * that the round-robin order is kept whenever it matters.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -277,7 +290,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     }
 
     /* Check if any of the timers in this group is already armed */
-    if (tg->any_timer_armed[is_write]) {
+    if (qatomic_read(&tg->any_timer_armed[is_write])) {
         return true;
     }
 
@@ -286,7 +299,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
         tg->tokens[is_write] = tgm;
-        tg->any_timer_armed[is_write] = true;
+        qatomic_set(&tg->any_timer_armed[is_write], true);
     }
 
     return must_wait;
@@ -343,7 +356,7 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
             ThrottleTimers *tt = &token->throttle_timers;
             int64_t now = qemu_clock_get_ns(tg->clock_type);
             timer_mod(tt->timers[is_write], now);
-            tg->any_timer_armed[is_write] = true;
+            qatomic_set(&tg->any_timer_armed[is_write], true);
         }
         tg->tokens[is_write] = token;
     }
@@ -364,9 +377,20 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     bool must_wait;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    int64_t now = qemu_clock_get_ns(tg->clock_type);
 
     assert(bytes >= 0);
 
+    /* Use the requests that were accounted in advance, if any */
+    if (tgm->credit_reqs[is_write] && bytes <= tgm->credit_bytes[is_write] &&
+        now < tgm->credit_expire_ns[is_write] &&
+        !qatomic_read(&tgm->pending_reqs[is_write]) &&
+        !qatomic_read(&tg->any_timer_armed[is_write])) {
+        tgm->credit_reqs[is_write]--;
+        return;
+    }
+    tgm->credit_reqs[is_write] = 0;
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -375,19 +399,29 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
-        tgm->pending_reqs[is_write]++;
+        qatomic_inc(&tgm->pending_reqs[is_write]);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[is_write],
                            &tgm->throttled_reqs_lock);
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
-        tgm->pending_reqs[is_write]--;
+        qatomic_dec(&tgm->pending_reqs[is_write]);
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, is_write, bytes);
 
+    /* If nobody is being throttled, account the next few requests too */
+    if (!must_wait && !tg->any_timer_armed[is_write] &&
+        !qatomic_read(&tgm->io_limits_disabled)) {
+        tgm->credit_reqs[is_write] =
+            throttle_account_ahead(tgm->throttle_state, is_write, bytes,
+                                   THROTTLE_GROUP_CREDIT_REQS);
+        tgm->credit_bytes[is_write] = bytes;
+        tgm->credit_expire_ns[is_write] = now + THROTTLE_GROUP_CREDIT_NS;
+    }
+
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
@@ -477,6 +511,9 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     throttle_config(ts, tg->clock_type, cfg);
     qemu_mutex_unlock(&tg->lock);
 
+    /* The credit of the other members expires on its own */
+    tgm->credit_reqs[0] = tgm->credit_reqs[1] = 0;
+
     throttle_group_restart_tgm(tgm);
 }
 
@@ -509,7 +546,7 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write)
 
     /* The timer has just been fired, so we can update the flag */
     qemu_mutex_lock(&tg->lock);
-    tg->any_timer_armed[is_write] = false;
+    qatomic_set(&tg->any_timer_armed[is_write], false);
     qemu_mutex_unlock(&tg->lock);
 
     /* Run the request that was waiting for this timer */
@@ -548,6 +585,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
     qatomic_set(&tgm->restart_pending, 0);
+    memset(tgm->credit_reqs, 0, sizeof(tgm->credit_reqs));
 
     QEMU_LOCK_GUARD(&tg->lock);
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
@@ -642,9 +680,10 @@ void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
     WITH_QEMU_LOCK_GUARD(&tg->lock) {
         for (i = 0; i < 2; i++) {
             if (timer_pending(tt->timers[i])) {
-                tg->any_timer_armed[i] = false;
+                qatomic_set(&tg->any_timer_armed[i], false);
                 schedule_next_request(tgm, i);
             }
+            tgm->credit_reqs[i] = 0;
         }
     }
 
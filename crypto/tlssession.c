@@ -240,12 +240,6 @@ qcrypto_tls_session_new(QCryptoTLSCreds *creds,
         goto error;
     }
 
-    gnutls_transport_set_ptr(session->handle, session);
-    gnutls_transport_set_push_function(session->handle,
-                                       qcrypto_tls_session_push);
-    gnutls_transport_set_pull_function(session->handle,
-                                       qcrypto_tls_session_pull);
-
     return session;
 
  error:
@@ -429,6 +423,24 @@ qcrypto_tls_session_set_callbacks(QCryptoTLSSession *session,
     session->writeFunc = writeFunc;
     session->readFunc = readFunc;
     session->opaque = opaque;
+
+    gnutls_transport_set_ptr(session->handle, session);
+    gnutls_transport_set_push_function(session->handle,
+                                       qcrypto_tls_session_push);
+    gnutls_transport_set_pull_function(session->handle,
+                                       qcrypto_tls_session_pull);
+}
+
+
+void
+qcrypto_tls_session_set_socket(QCryptoTLSSession *session,
+                               int fd)
+{
+    /*
+     * GnuTLS only moves the session to the kernel when it does the
+     * I/O on the socket itself, with its default push/pull functions
+     */
+    gnutls_transport_set_int(session->handle, fd);
 }
 
 
@@ -549,6 +561,24 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 }
 
 
+bool
+qcrypto_tls_session_has_ktls(QCryptoTLSSession *session,
+                             bool send)
+{
+#ifdef CONFIG_GNUTLS_KTLS
+    gnutls_transport_ktls_enable_flags_t flags;
+
+    if (!session->handshakeComplete) {
+        return false;
+    }
+    flags = gnutls_transport_is_ktls_enabled(session->handle);
+    return flags & (send ? GNUTLS_KTLS_SEND : GNUTLS_KTLS_RECV);
+#else
+    return false;
+#endif
+}
+
+
 #else /* ! CONFIG_GNUTLS */
 
 
@@ -589,6 +619,13 @@ qcrypto_tls_session_set_callbacks(
 }
 
 
+void
+qcrypto_tls_session_set_socket(QCryptoTLSSession *sess G_GNUC_UNUSED,
+                               int fd G_GNUC_UNUSED)
+{
+}
+
+
 ssize_t
 qcrypto_tls_session_write(QCryptoTLSSession *sess,
                           const char *buf,
@@ -640,4 +677,12 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
     return NULL;
 }
 
+
+bool
+qcrypto_tls_session_has_ktls(QCryptoTLSSession *sess G_GNUC_UNUSED,
+                             bool send G_GNUC_UNUSED)
+{
+    return false;
+}
+
 #endif
@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "elf.h"
 #include "exec/hwaddr.h"
 #include "monitor/monitor.h"
@@ -41,6 +42,9 @@
 #ifdef CONFIG_SNAPPY
 #include <snappy-c.h>
 #endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #ifndef ELF_MACHINE_UNAME
 #define ELF_MACHINE_UNAME "Unknown"
 #endif
@@ -382,25 +386,23 @@ static void write_data(DumpState *s, void *buf, int length, Error **errp)
     }
 }
 
-/* write the memory to vmcore. 1 page per I/O. */
+/*
+ * Largest I/O when writing guest memory.  The data is written straight
+ * from the guest RAM mapping, so large writes only save system calls;
+ * the limit keeps written_size moving for query-dump.
+ */
+#define DUMP_WRITE_CHUNK (64 * MiB)
+
+/* write the memory to vmcore, up to DUMP_WRITE_CHUNK bytes per I/O. */
 static void write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
                          int64_t size, Error **errp)
 {
-    int64_t i;
+    int64_t done, len;
     Error *local_err = NULL;
 
-    for (i = 0; i < size / s->dump_info.page_size; i++) {
-        write_data(s, block->host_addr + start + i * s->dump_info.page_size,
-                   s->dump_info.page_size, &local_err);
-        if (local_err) {
-            error_propagate(errp, local_err);
-            return;
-        }
-    }
-
-    if ((size % s->dump_info.page_size) != 0) {
-        write_data(s, block->host_addr + start + i * s->dump_info.page_size,
-                   size % s->dump_info.page_size, &local_err);
+    for (done = 0; done < size; done += len) {
+        len = MIN(size - done, DUMP_WRITE_CHUNK);
+        write_data(s, block->host_addr + start + done, len, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -846,6 +848,11 @@ static void create_header32(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -958,6 +965,11 @@ static void create_header64(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -1285,6 +1297,11 @@ static size_t get_len_buf_out(size_t page_size, uint32_t flag_compress)
     case DUMP_DH_COMPRESSED_SNAPPY:
         return snappy_max_compressed_length(page_size);
 #endif
+
+#ifdef CONFIG_ZSTD
+    case DUMP_DH_COMPRESSED_ZSTD:
+        return ZSTD_compressBound(page_size);
+#endif
     }
     return 0;
 }
@@ -1297,20 +1314,228 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/* Pages that a compression thread gets at a time */
+#define DUMP_BATCH_PAGES 256
+#define DUMP_MAX_THREADS 16
+
+typedef struct DumpPage {
+    uint8_t *buf;               /* the guest page */
+    uint8_t *data;              /* what is written, NULL for a zero page */
+    uint32_t flags;             /* DUMP_DH_COMPRESSED_*, 0 for plaintext */
+    size_t size;
+} DumpPage;
+
+typedef struct DumpCompressor {
+    /* room for the compressed data of DUMP_BATCH_PAGES pages */
+    uint8_t *buf_out;
+    size_t len_buf_out;
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} DumpCompressor;
+
+typedef struct DumpWorker {
+    QemuThread thread;
+    QemuSemaphore sem_start;
+    QemuSemaphore sem_done;
+    DumpState *s;
+    DumpCompressor comp;
+    DumpPage *pages;
+    size_t nr_pages;
+    bool quit;
+} DumpWorker;
+
+static void dump_compressor_init(DumpCompressor *c, DumpState *s)
+{
+    c->len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
+    assert(c->len_buf_out != 0);
+    c->buf_out = g_malloc(c->len_buf_out * DUMP_BATCH_PAGES);
+#ifdef CONFIG_LZO
+    c->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress == DUMP_DH_COMPRESSED_ZSTD) {
+        c->zstd = ZSTD_createCCtx();
+    }
+#endif
+}
+
+static void dump_compressor_cleanup(DumpCompressor *c)
+{
+    g_free(c->buf_out);
+#ifdef CONFIG_LZO
+    g_free(c->wrkmem);
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(c->zstd);
+#endif
+}
+
+/*
+ * Compress up to DUMP_BATCH_PAGES pages into the buffer of @c.
+ *
+ * only one compression format will be used here, for s->flag_compress
+ * is set. But when compression fails to work, we fall back to save in
+ * plaintext.
+ */
+static void dump_compress_pages(DumpState *s, DumpCompressor *c,
+                                DumpPage *pages, size_t nr_pages)
+{
+    size_t page_size = s->dump_info.page_size;
+    size_t i;
+
+    assert(nr_pages <= DUMP_BATCH_PAGES);
+    for (i = 0; i < nr_pages; i++) {
+        DumpPage *page = &pages[i];
+        uint8_t *buf_out = c->buf_out + i * c->len_buf_out;
+        size_t size_out = c->len_buf_out;
+        bool ok = false;
+
+        if (is_zero_page(page->buf, page_size)) {
+            page->data = NULL;
+            continue;
+        }
+
+        switch (s->flag_compress) {
+        case DUMP_DH_COMPRESSED_ZLIB:
+            ok = compress2(buf_out, (uLongf *)&size_out, page->buf,
+                           page_size, Z_BEST_SPEED) == Z_OK;
+            break;
+#ifdef CONFIG_LZO
+        case DUMP_DH_COMPRESSED_LZO:
+            ok = lzo1x_1_compress(page->buf, page_size, buf_out,
+                                  (lzo_uint *)&size_out,
+                                  c->wrkmem) == LZO_E_OK;
+            break;
+#endif
+#ifdef CONFIG_SNAPPY
+        case DUMP_DH_COMPRESSED_SNAPPY:
+            ok = snappy_compress((char *)page->buf, page_size,
+                                 (char *)buf_out, &size_out) == SNAPPY_OK;
+            break;
+#endif
+#ifdef CONFIG_ZSTD
+        case DUMP_DH_COMPRESSED_ZSTD:
+            if (c->zstd) {
+                size_out = ZSTD_compressCCtx(c->zstd, buf_out, c->len_buf_out,
+                                             page->buf, page_size, 1);
+                ok = !ZSTD_isError(size_out);
+            }
+            break;
+#endif
+        }
+
+        if (ok && size_out < page_size) {
+            page->flags = s->flag_compress;
+            page->size = size_out;
+            page->data = buf_out;
+        } else {
+            /*
+             * fall back to save in plaintext, size_out should be
+             * assigned the target's page size
+             */
+            page->flags = 0;
+            page->size = page_size;
+            page->data = page->buf;
+        }
+    }
+}
+
+static void *dump_worker_thread(void *opaque)
+{
+    DumpWorker *w = opaque;
+
+    for (;;) {
+        qemu_sem_wait(&w->sem_start);
+        if (w->quit) {
+            break;
+        }
+        dump_compress_pages(w->s, &w->comp, w->pages, w->nr_pages);
+        qemu_sem_post(&w->sem_done);
+    }
+    return NULL;
+}
+
+/*
+ * Compress the pages of a batch, split among the worker threads if
+ * there are some.
+ */
+static void dump_compress_batch(DumpState *s, DumpCompressor *comp,
+                                DumpWorker *workers, int nr_workers,
+                                DumpPage *pages, size_t nr_pages)
+{
+    int i, started = 0;
+
+    if (!nr_workers) {
+        dump_compress_pages(s, comp, pages, nr_pages);
+        return;
+    }
+
+    for (i = 0; i < nr_workers && i * DUMP_BATCH_PAGES < nr_pages; i++) {
+        workers[i].pages = pages + i * DUMP_BATCH_PAGES;
+        workers[i].nr_pages = MIN(nr_pages - i * DUMP_BATCH_PAGES,
+                                  DUMP_BATCH_PAGES);
+        qemu_sem_post(&workers[i].sem_start);
+        started++;
+    }
+    for (i = 0; i < started; i++) {
+        qemu_sem_wait(&workers[i].sem_done);
+    }
+}
+
+static DumpWorker *dump_start_workers(DumpState *s, int nr_workers)
+{
+    DumpWorker *workers = g_new0(DumpWorker, nr_workers);
+    int i;
+
+    for (i = 0; i < nr_workers; i++) {
+        DumpWorker *w = &workers[i];
+
+        w->s = s;
+        dump_compressor_init(&w->comp, s);
+        qemu_sem_init(&w->sem_start, 0);
+        qemu_sem_init(&w->sem_done, 0);
+        qemu_thread_create(&w->thread, "dump_compress", dump_worker_thread,
+                           w, QEMU_THREAD_JOINABLE);
+    }
+    return workers;
+}
+
+static void dump_stop_workers(DumpWorker *workers, int nr_workers)
+{
+    int i;
+
+    for (i = 0; i < nr_workers; i++) {
+        DumpWorker *w = &workers[i];
+
+        w->quit = true;
+        qemu_sem_post(&w->sem_start);
+        qemu_thread_join(&w->thread);
+        qemu_sem_destroy(&w->sem_start);
+        qemu_sem_destroy(&w->sem_done);
+        dump_compressor_cleanup(&w->comp);
+    }
+    g_free(workers);
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpCompressor comp = {};
+    DumpWorker *workers = NULL;
+    DumpPage *pages;
+    int nr_workers;
+    size_t nr_pages, max_pages, i;
     off_t offset_desc, offset_data;
     PageDescriptor pd, pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    bool more = true;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1319,15 +1544,20 @@ static void write_dump_pages(DumpState *s, Error **errp)
     prepare_data_cache(&page_desc, s, offset_desc);
     prepare_data_cache(&page_data, s, offset_data);
 
-    /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
-    assert(len_buf_out != 0);
-
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    /*
+     * Compression is what takes time, so it runs in a thread per host
+     * CPU.  Each one compresses DUMP_BATCH_PAGES pages of a batch, and
+     * the pages of the batch are then written in order.
+     */
+    nr_workers = MIN(g_get_num_processors(), DUMP_MAX_THREADS);
+    if (nr_workers > 1) {
+        workers = dump_start_workers(s, nr_workers);
+    } else {
+        nr_workers = 0;
+        dump_compressor_init(&comp, s);
+    }
+    max_pages = MAX(nr_workers, 1) * DUMP_BATCH_PAGES;
+    pages = g_new(DumpPage, max_pages);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1351,97 +1581,57 @@ static void write_dump_pages(DumpState *s, Error **errp)
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+    while (more) {
+        for (nr_pages = 0; nr_pages < max_pages; nr_pages++) {
+            more = get_next_page(&block_iter, &pfn_iter, &buf, s);
+            if (!more) {
+                break;
             }
-        } else {
+            pages[nr_pages].buf = buf;
+        }
+
+        dump_compress_batch(s, &comp, workers, nr_workers, pages, nr_pages);
+
+        for (i = 0; i < nr_pages; i++) {
+            DumpPage *page = &pages[i];
+
+            if (!page->data) {
+                ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
+                                  false);
+                if (ret < 0) {
+                    error_setg(errp, "dump: failed to write page desc");
+                    goto out;
+                }
+                s->written_size += s->dump_info.page_size;
+                continue;
+            }
+
             /*
              * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
+             * 1. write the compressed page into the cache of page_data
+             * 2. get page desc of the compressed page and write it into the
              *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
              */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
+            ret = write_cache(&page_data, page->data, page->size, false);
+            if (ret < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                goto out;
             }
 
             /* get and write page desc here */
+            pd.flags = cpu_to_dump32(s, page->flags);
+            pd.size = cpu_to_dump32(s, page->size);
             pd.page_flags = cpu_to_dump64(s, 0);
             pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            offset_data += page->size;
 
             ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
             if (ret < 0) {
                 error_setg(errp, "dump: failed to write page desc");
                 goto out;
             }
+            s->written_size += s->dump_info.page_size;
         }
-        s->written_size += s->dump_info.page_size;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1459,11 +1649,12 @@ out:
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
 
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
+    if (workers) {
+        dump_stop_workers(workers, nr_workers);
+    } else {
+        dump_compressor_cleanup(&comp);
+    }
+    g_free(pages);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1804,6 +1995,10 @@ static void dump_init(DumpState *s, int fd, bool has_format,
             s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
             break;
 
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD:
+            s->flag_compress = DUMP_DH_COMPRESSED_ZSTD;
+            break;
+
         default:
             s->flag_compress = 0;
         }
@@ -1961,7 +2156,7 @@ void qmp_dump_guest_memory(bool paging, const char *file,
         detach_p = detach;
     }
 
-    /* check whether lzo/snappy is supported */
+    /* check whether lzo/snappy/zstd is supported */
 #ifndef CONFIG_LZO
     if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO) {
         error_setg(errp, "kdump-lzo is not available now");
@@ -1976,6 +2171,13 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     }
 #endif
 
+#ifndef CONFIG_ZSTD
+    if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD) {
+        error_setg(errp, "kdump-zstd is not available now");
+        return;
+    }
+#endif
+
 #ifndef TARGET_X86_64
     if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_WIN_DMP) {
         error_setg(errp, "Windows dump is only available for x86-64");
@@ -2049,6 +2251,11 @@ DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
     QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY);
 #endif
 
+    /* add new item if kdump-zstd is available */
+#ifdef CONFIG_ZSTD
+    QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD);
+#endif
+
     /* Windows dump is available only if target is x86_64 */
 #ifdef TARGET_X86_64
     QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_WIN_DMP);
@@ -807,7 +807,8 @@ static void do_cpu_reset(void *opaque)
  * @size_key:       The firmware config key to store the size of the loaded
  *                  data under, with fw_cfg_add_i32().
  * @data_key:       The firmware config key to store the loaded data under,
- *                  with fw_cfg_add_bytes().
+ *                  with fw_cfg_add_bytes(), or with fw_cfg_add_mapped_bytes()
+ *                  if it is not decompressed.
  * @image_name:     The name of the image file to load. If it is NULL, the
  *                  function returns without doing anything.
  * @try_decompress: Whether the image should be decompressed (gunzipped) before
@@ -834,15 +835,19 @@ static void load_image_to_fw_cfg(FWCfgState *fw_cfg, uint16_t size_key,
     }
 
     if (size == (size_t)-1) {
-        gchar *contents;
-        gsize length;
+        GMappedFile *mapped_file;
 
-        if (!g_file_get_contents(image_name, &contents, &length, NULL)) {
+        /* Map the image rather than read it, it can be a large initrd */
+        mapped_file = g_mapped_file_new(image_name, false, NULL);
+        if (!mapped_file ||
+            g_mapped_file_get_length(mapped_file) >= UINT32_MAX) {
             error_report("failed to load \"%s\"", image_name);
             exit(1);
         }
-        size = length;
-        data = (uint8_t *)contents;
+        fw_cfg_add_i32(fw_cfg, size_key, g_mapped_file_get_length(mapped_file));
+        fw_cfg_add_mapped_bytes(fw_cfg, data_key, mapped_file);
+        g_mapped_file_unref(mapped_file);
+        return;
     }
 
     fw_cfg_add_i32(fw_cfg, size_key, size);
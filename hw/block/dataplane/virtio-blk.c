@@ -43,13 +43,25 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * With iothread-vq-mapping, the virtqueues are processed by several
+     * IOThreads.  The BlockBackend stays in the context of the first one,
+     * @ctx, where the requests are submitted and completed; the AioContext
+     * lock of @ctx, taken by virtio_blk_handle_vq() and by the completion
+     * callbacks, serializes the accesses to the vrings.
+     */
+    IOThread **iothreads;
+    unsigned nr_iothreads;
+    AioContext **vq_ctx;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
     if (s->batch_notifications) {
-        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
+        /* Requests that fail early complete in the IOThread of their vq */
+        set_bit_atomic(virtio_get_queue_index(vq), s->batch_notify_vqs);
         qemu_bh_schedule(s->bh);
     } else {
         virtio_notify_irqfd(s->vdev, vq);
@@ -60,14 +72,11 @@ static void notify_guest_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
     unsigned nvqs = s->conf->num_queues;
-    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
-
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j / BITS_PER_LONG];
+        unsigned long *word = &s->batch_notify_vqs[j / BITS_PER_LONG];
+        unsigned long bits = qatomic_xchg(word, 0);
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -80,6 +89,57 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/* Resolve the IOThreads of the iothread-vq-mapping property */
+static bool virtio_blk_data_plane_map_vqs(VirtIOBlockDataPlane *s,
+                                          Error **errp)
+{
+    g_auto(GStrv) ids = g_strsplit(s->conf->iothread_vq_mapping, ":", -1);
+    unsigned nr = g_strv_length(ids);
+    unsigned i;
+
+    if (!nr) {
+        error_setg(errp, "iothread-vq-mapping must list at least one "
+                   "IOThread");
+        return false;
+    }
+
+    s->iothreads = g_new0(IOThread *, nr);
+    for (i = 0; i < nr; i++) {
+        IOThread *iothread = iothread_by_id(ids[i]);
+
+        if (!iothread) {
+            error_setg(errp, "IOThread '%s' not found", ids[i]);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        s->iothreads[s->nr_iothreads++] = iothread;
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        s->vq_ctx[i] = iothread_get_aio_context(s->iothreads[i % nr]);
+    }
+    return true;
+}
+
+static void virtio_blk_data_plane_free(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    for (i = 0; i < s->nr_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s->vq_ctx);
+    g_free(s->batch_notify_vqs);
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+    }
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+    }
+    g_free(s);
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -88,10 +148,17 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping are mutually "
+                   "exclusive");
+        return false;
+    }
+
+    if (conf->iothread || conf->iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -119,13 +186,25 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
+    if (conf->iothread_vq_mapping) {
+        if (!virtio_blk_data_plane_map_vqs(s, errp)) {
+            virtio_blk_data_plane_free(s);
+            return false;
+        }
+        s->ctx = s->vq_ctx[0];
     } else {
-        s->ctx = qemu_get_aio_context();
+        if (conf->iothread) {
+            s->iothread = conf->iothread;
+            object_ref(OBJECT(s->iothread));
+            s->ctx = iothread_get_aio_context(s->iothread);
+        } else {
+            s->ctx = qemu_get_aio_context();
+        }
+        for (i = 0; i < conf->num_queues; i++) {
+            s->vq_ctx[i] = s->ctx;
+        }
     }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
@@ -146,12 +225,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
-    }
-    g_free(s);
+    virtio_blk_data_plane_free(s);
 }
 
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
@@ -254,14 +328,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(s->vq_ctx[i]);
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i],
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(s->vq_ctx[i]);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_aio_context:
@@ -297,12 +371,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_ctx[i] == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -329,6 +406,16 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 0; i < s->nr_iothreads; i++) {
+        AioContext *ctx = iothread_get_aio_context(s->iothreads[i]);
+
+        if (ctx != s->ctx) {
+            aio_context_acquire(ctx);
+            aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+            aio_context_release(ctx);
+        }
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
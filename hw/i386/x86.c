@@ -836,7 +836,6 @@ void x86_load_linux(X86MachineState *x86ms,
             if (initrd_filename) {
                 GMappedFile *mapped_file;
                 gsize initrd_size;
-                gchar *initrd_data;
                 GError *gerr = NULL;
 
                 mapped_file = g_mapped_file_new(initrd_filename, false, &gerr);
@@ -845,9 +844,6 @@ void x86_load_linux(X86MachineState *x86ms,
                             initrd_filename, gerr->message);
                     exit(1);
                 }
-                x86ms->initrd_mapped_file = mapped_file;
-
-                initrd_data = g_mapped_file_get_contents(mapped_file);
                 initrd_size = g_mapped_file_get_length(mapped_file);
                 initrd_max = x86ms->below_4g_mem_size - acpi_data_size - 1;
                 if (initrd_size >= initrd_max) {
@@ -861,8 +857,9 @@ void x86_load_linux(X86MachineState *x86ms,
 
                 fw_cfg_add_i32(fw_cfg, FW_CFG_INITRD_ADDR, initrd_addr);
                 fw_cfg_add_i32(fw_cfg, FW_CFG_INITRD_SIZE, initrd_size);
-                fw_cfg_add_bytes(fw_cfg, FW_CFG_INITRD_DATA, initrd_data,
-                                 initrd_size);
+                fw_cfg_add_mapped_bytes(fw_cfg, FW_CFG_INITRD_DATA,
+                                        mapped_file);
+                g_mapped_file_unref(mapped_file);
             }
 
             option_rom[nb_option_roms].bootindex = 0;
@@ -975,7 +972,6 @@ void x86_load_linux(X86MachineState *x86ms,
     if (initrd_filename) {
         GMappedFile *mapped_file;
         gsize initrd_size;
-        gchar *initrd_data;
         GError *gerr = NULL;
 
         if (protocol < 0x200) {
@@ -989,9 +985,6 @@ void x86_load_linux(X86MachineState *x86ms,
                     initrd_filename, gerr->message);
             exit(1);
         }
-        x86ms->initrd_mapped_file = mapped_file;
-
-        initrd_data = g_mapped_file_get_contents(mapped_file);
         initrd_size = g_mapped_file_get_length(mapped_file);
         if (initrd_size >= initrd_max) {
             fprintf(stderr, "qemu: initrd is too large, cannot support."
@@ -1004,7 +997,8 @@ void x86_load_linux(X86MachineState *x86ms,
 
         fw_cfg_add_i32(fw_cfg, FW_CFG_INITRD_ADDR, initrd_addr);
         fw_cfg_add_i32(fw_cfg, FW_CFG_INITRD_SIZE, initrd_size);
-        fw_cfg_add_bytes(fw_cfg, FW_CFG_INITRD_DATA, initrd_data, initrd_size);
+        fw_cfg_add_mapped_bytes(fw_cfg, FW_CFG_INITRD_DATA, mapped_file);
+        g_mapped_file_unref(mapped_file);
 
         stl_p(header + 0x218, initrd_addr);
         stl_p(header + 0x21c, initrd_size);
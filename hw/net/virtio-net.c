@@ -15,6 +15,7 @@
 #include "qemu/atomic.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "qemu/xxhash.h"
 #include "qemu/module.h"
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
@@ -554,11 +555,15 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+    if (n->flows) {
+        memset(n->flows, 0, VIRTIO_NET_FLOW_TABLE_SIZE * sizeof(*n->flows));
+    }
 
     /* Flush any async TX */
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
+        n->vqs[i].rx_batched = 0;
         if (nc->peer) {
             qemu_flush_or_purge_queued_packets(nc->peer, true);
             assert(!virtio_net_get_subqueue(nc)->async_tx.elem);
@@ -1239,6 +1244,16 @@ static void virtio_net_unload_ebpf(VirtIONet *n)
     ebpf_rss_unload(&n->ebpf_rss);
 }
 
+/*
+ * The guest sends the packets of a flow from the queue of the vCPU that
+ * handles it, so the received packets of the flow go to that queue too.
+ * The tx path is only seen without vhost.
+ */
+static bool virtio_net_use_flows(VirtIONet *n)
+{
+    return n->flows && !get_vhost_net(qemu_get_queue(n->nic)->peer);
+}
+
 static uint16_t virtio_net_handle_rss(VirtIONet *n,
                                       struct iovec *iov,
                                       unsigned int iov_cnt,
@@ -1352,7 +1367,7 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
     }
     n->rss_data.enabled = true;
 
-    if (!n->rss_data.populate_hash) {
+    if (!n->rss_data.populate_hash && !virtio_net_use_flows(n)) {
         if (!virtio_net_attach_epbf_rss(n)) {
             /* EBPF must be loaded for vhost */
             if (get_vhost_net(qemu_get_queue(n->nic)->peer)) {
@@ -1364,7 +1379,7 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
             n->rss_data.enabled_software_rss = true;
         }
     } else {
-        /* use software RSS for hash populating */
+        /* use software RSS for hash populating or flow affinity */
         /* and detach eBPF if was loaded before */
         virtio_net_detach_epbf_rss(n);
         n->rss_data.enabled_software_rss = true;
@@ -1687,6 +1702,99 @@ static void virtio_set_packet_hash(const uint8_t *buf, uint8_t report,
     hdr->hash_report = report;
 }
 
+static uint32_t virtio_net_fold_in6(const struct in6_address *addr)
+{
+    uint32_t w[4];
+
+    memcpy(w, addr, sizeof(w));
+    return w[0] ^ w[1] ^ w[2] ^ w[3];
+}
+
+/*
+ * Hash the TCP or UDP flow of the packet in @iov, which starts with the
+ * ethernet header.  Both directions of a flow have the same hash.
+ */
+static bool virtio_net_flow_hash(const struct iovec *iov, int iovcnt,
+                                 uint32_t *hash)
+{
+    bool isip4, isip6, isudp, istcp;
+    size_t l3hdr_off, l4hdr_off, l5hdr_off;
+    eth_ip6_hdr_info ip6hdr_info;
+    eth_ip4_hdr_info ip4hdr_info;
+    eth_l4_hdr_info l4hdr_info;
+    uint32_t saddr, daddr;
+    uint16_t sport, dport;
+    uint64_t a, b;
+
+    eth_get_protocols(iov, iovcnt, &isip4, &isip6, &isudp, &istcp,
+                      &l3hdr_off, &l4hdr_off, &l5hdr_off,
+                      &ip6hdr_info, &ip4hdr_info, &l4hdr_info);
+    if (!isudp && !istcp) {
+        return false;
+    }
+    if (isip4 && !ip4hdr_info.fragment) {
+        saddr = ip4hdr_info.ip4_hdr.ip_src;
+        daddr = ip4hdr_info.ip4_hdr.ip_dst;
+    } else if (isip6 && !ip6hdr_info.fragment) {
+        saddr = virtio_net_fold_in6(&ip6hdr_info.ip6_hdr.ip6_src);
+        daddr = virtio_net_fold_in6(&ip6hdr_info.ip6_hdr.ip6_dst);
+    } else {
+        return false;
+    }
+    if (istcp) {
+        sport = l4hdr_info.hdr.tcp.th_sport;
+        dport = l4hdr_info.hdr.tcp.th_dport;
+    } else {
+        sport = l4hdr_info.hdr.udp.uh_sport;
+        dport = l4hdr_info.hdr.udp.uh_dport;
+    }
+
+    a = (uint64_t)saddr << 16 | sport;
+    b = (uint64_t)daddr << 16 | dport;
+    *hash = qemu_xxhash5(MIN(a, b), MAX(a, b), istcp);
+    return true;
+}
+
+static void virtio_net_flow_learn(VirtIONet *n, VirtQueueElement *elem,
+                                  int queue_index)
+{
+    uint8_t hdrs[128];
+    struct iovec iov = { .iov_base = hdrs };
+    VirtioNetFlow *flow;
+    uint32_t hash;
+
+    iov.iov_len = iov_to_buf(elem->out_sg, elem->out_num, n->guest_hdr_len,
+                             hdrs, sizeof(hdrs));
+    if (!virtio_net_flow_hash(&iov, 1, &hash)) {
+        return;
+    }
+
+    flow = &n->flows[hash & (VIRTIO_NET_FLOW_TABLE_SIZE - 1)];
+    flow->hash = hash;
+    flow->queue = queue_index + 1;
+}
+
+static int virtio_net_flow_lookup(VirtIONet *n, const uint8_t *buf,
+                                  size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)(buf + n->host_hdr_len),
+        .iov_len = size - n->host_hdr_len,
+    };
+    VirtioNetFlow *flow;
+    uint32_t hash;
+
+    if (!virtio_net_flow_hash(&iov, 1, &hash)) {
+        return -1;
+    }
+
+    flow = &n->flows[hash & (VIRTIO_NET_FLOW_TABLE_SIZE - 1)];
+    if (flow->hash != hash || !flow->queue || flow->queue > n->curr_queues) {
+        return -1;
+    }
+    return flow->queue - 1;
+}
+
 static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
@@ -1733,8 +1841,14 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
     }
 
     if (n->rss_data.redirect) {
-        new_index = hash & (n->rss_data.indirections_len - 1);
-        new_index = n->rss_data.indirections_table[new_index];
+        int flow_index = n->flows ? virtio_net_flow_lookup(n, buf, size) : -1;
+
+        if (flow_index >= 0) {
+            new_index = flow_index;
+        } else {
+            new_index = hash & (n->rss_data.indirections_len - 1);
+            new_index = n->rss_data.indirections_table[new_index];
+        }
     }
 
     return (index == new_index) ? -1 : new_index;
@@ -1840,7 +1954,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_batched + i++);
         g_free(elem);
     }
 
@@ -1851,8 +1965,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    /* In a batch, the guest sees all the packets when it ends */
+    q->rx_batched += i;
+    if (!nc->receive_batch) {
+        virtqueue_flush(q->rx_vq, q->rx_batched);
+        q->rx_batched = 0;
+        virtio_notify(vdev, q->rx_vq);
+    }
 
     return size;
 }
@@ -1865,6 +1984,21 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
     return virtio_net_receive_rcu(nc, buf, size, false);
 }
 
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (!q->rx_batched) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    virtqueue_flush(q->rx_vq, q->rx_batched);
+    q->rx_batched = 0;
+    virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+}
+
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
                                          const uint8_t *buf,
                                          VirtioNetRscUnit *unit)
@@ -2563,6 +2697,10 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
+        if (n->flows) {
+            virtio_net_flow_learn(n, elem, queue_index);
+        }
+
         ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
@@ -2859,8 +2997,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     }
 
     if (n->rss_data.enabled) {
-        n->rss_data.enabled_software_rss = n->rss_data.populate_hash;
-        if (!n->rss_data.populate_hash) {
+        n->rss_data.enabled_software_rss = n->rss_data.populate_hash ||
+                                           virtio_net_use_flows(n);
+        if (!n->rss_data.enabled_software_rss) {
             if (!virtio_net_attach_epbf_rss(n)) {
                 if (get_vhost_net(qemu_get_queue(n->nic)->peer)) {
                     warn_report("Can't post-load eBPF RSS for vhost");
@@ -3142,6 +3281,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch_end = virtio_net_receive_batch_end,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3378,6 +3518,15 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     }
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
+
+    if (n->rss_flow_affinity) {
+        if (!virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
+            error_setg(errp, "rss-flow-affinity requires rss=on");
+            virtio_cleanup(vdev);
+            return;
+        }
+        n->flows = g_new0(VirtioNetFlow, VIRTIO_NET_FLOW_TABLE_SIZE);
+    }
     n->tx_timeout = n->net_conf.txtimer;
 
     if (n->net_conf.tx && strcmp(n->net_conf.tx, "timer")
@@ -3496,6 +3645,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
+    g_free(n->flows);
     net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
@@ -3606,6 +3756,8 @@ static Property virtio_net_properties[] = {
                     VIRTIO_NET_F_RSS, false),
     DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
                     VIRTIO_NET_F_HASH_REPORT, false),
+    DEFINE_PROP_BOOL("rss-flow-affinity", VirtIONet, rss_flow_affinity,
+                     false),
     DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
@@ -62,6 +62,8 @@ struct FWCfgEntry {
     uint32_t len;
     bool allow_write;
     uint8_t *data;
+    /* Set if data is a host file mapped by fw_cfg_add_mapped_bytes() */
+    GMappedFile *mapped_file;
     void *callback_opaque;
     FWCfgCallback select_cb;
     FWCfgWriteCallback write_cb;
@@ -736,6 +738,12 @@ static void *fw_cfg_modify_bytes_read(FWCfgState *s, uint16_t key,
 
     /* return the old data to the function caller, avoid memory leak */
     ptr = s->entries[arch][key].data;
+    if (s->entries[arch][key].mapped_file) {
+        /* nothing for the caller to free */
+        g_mapped_file_unref(s->entries[arch][key].mapped_file);
+        s->entries[arch][key].mapped_file = NULL;
+        ptr = NULL;
+    }
     s->entries[arch][key].data = data;
     s->entries[arch][key].len = len;
     s->entries[arch][key].callback_opaque = NULL;
@@ -750,6 +758,17 @@ void fw_cfg_add_bytes(FWCfgState *s, uint16_t key, void *data, size_t len)
     fw_cfg_add_bytes_callback(s, key, NULL, NULL, NULL, data, len, true);
 }
 
+void fw_cfg_add_mapped_bytes(FWCfgState *s, uint16_t key,
+                             GMappedFile *mapped_file)
+{
+    int arch = !!(key & FW_CFG_ARCH_LOCAL);
+
+    fw_cfg_add_bytes(s, key, g_mapped_file_get_contents(mapped_file),
+                     g_mapped_file_get_length(mapped_file));
+    s->entries[arch][key & FW_CFG_ENTRY_MASK].mapped_file =
+        g_mapped_file_ref(mapped_file);
+}
+
 void fw_cfg_add_string(FWCfgState *s, uint16_t key, const char *value)
 {
     size_t sz = strlen(value) + 1;
@@ -1034,6 +1053,38 @@ void *fw_cfg_modify_file(FWCfgState *s, const char *filename,
     return NULL;
 }
 
+bool fw_cfg_add_file_from_host(FWCfgState *s, const char *filename,
+                               const char *host_path, Error **errp)
+{
+    GMappedFile *mapped_file;
+    GError *gerr = NULL;
+    size_t len;
+    int i;
+
+    mapped_file = g_mapped_file_new(host_path, false, &gerr);
+    if (!mapped_file) {
+        error_setg(errp, "can't load %s: %s", host_path, gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+    len = g_mapped_file_get_length(mapped_file);
+    if (len >= UINT32_MAX) {
+        error_setg(errp, "%s is too large for fw_cfg", host_path);
+        g_mapped_file_unref(mapped_file);
+        return false;
+    }
+
+    fw_cfg_add_file(s, filename, g_mapped_file_get_contents(mapped_file), len);
+    for (i = 0; i < be32_to_cpu(s->files->count); i++) {
+        if (strcmp(filename, s->files->f[i].name) == 0) {
+            /* the entry keeps the only reference */
+            s->entries[0][FW_CFG_FILE_FIRST + i].mapped_file = mapped_file;
+            break;
+        }
+    }
+    return true;
+}
+
 bool fw_cfg_add_from_generator(FWCfgState *s, const char *filename,
                                const char *gen_id, Error **errp)
 {
@@ -34,6 +34,8 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/range.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
 #include "sysemu/kvm.h"
 #include "sysemu/reset.h"
 #include "sysemu/runstate.h"
@@ -520,6 +522,80 @@ static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
     return -errno;
 }
 
+/*
+ * VFIO_IOMMU_MAP_DMA faults in and pins the pages of the whole mapping
+ * with the container lock held.  Faulting them in first from several
+ * threads leaves only the pinning to the ioctl, which is much faster
+ * for large guests.
+ */
+#define VFIO_PREFAULT_MIN_SIZE      (1 * GiB)
+#define VFIO_PREFAULT_CHUNK_SIZE    (256 * MiB)
+#define VFIO_PREFAULT_MAX_THREADS   16
+
+typedef struct VFIOPrefaultChunk {
+    QemuThread thread;
+    void *addr;
+    size_t size;
+} VFIOPrefaultChunk;
+
+static bool vfio_prefault_unsupported;
+
+static void *vfio_prefault_thread(void *opaque)
+{
+    VFIOPrefaultChunk *chunk = opaque;
+
+    /* Errors are left for VFIO_IOMMU_MAP_DMA to report */
+    qemu_madvise(chunk->addr, chunk->size, QEMU_MADV_POPULATE_WRITE);
+    return NULL;
+}
+
+/*
+ * Fault in @size bytes at @vaddr, split at multiples of @pagesize so that
+ * no huge page is shared by two threads.
+ */
+static void vfio_prefault(void *vaddr, size_t size, size_t pagesize)
+{
+    VFIOPrefaultChunk *chunks;
+    size_t chunk_size, offset;
+    int i, nr_threads;
+
+    if (QEMU_MADV_POPULATE_WRITE == QEMU_MADV_INVALID ||
+        vfio_prefault_unsupported) {
+        return;
+    }
+
+    nr_threads = MIN(size / VFIO_PREFAULT_CHUNK_SIZE,
+                     VFIO_PREFAULT_MAX_THREADS);
+    nr_threads = MIN(nr_threads, sysconf(_SC_NPROCESSORS_ONLN));
+    if (nr_threads < 2) {
+        return;
+    }
+
+    /* Check that the kernel knows MADV_POPULATE_WRITE on the first page */
+    if (qemu_madvise(vaddr, pagesize, QEMU_MADV_POPULATE_WRITE)) {
+        if (errno == EINVAL) {
+            vfio_prefault_unsupported = true;
+        }
+        return;
+    }
+
+    chunk_size = ROUND_UP(DIV_ROUND_UP(size, nr_threads), pagesize);
+    chunks = g_new0(VFIOPrefaultChunk, nr_threads);
+    trace_vfio_prefault(vaddr, size, nr_threads);
+    for (i = 0, offset = 0; i < nr_threads && offset < size; i++) {
+        chunks[i].addr = (uint8_t *)vaddr + offset;
+        chunks[i].size = MIN(chunk_size, size - offset);
+        offset += chunks[i].size;
+        qemu_thread_create(&chunks[i].thread, "vfio-prefault",
+                           vfio_prefault_thread, &chunks[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    while (i--) {
+        qemu_thread_join(&chunks[i].thread);
+    }
+    g_free(chunks);
+}
+
 static void vfio_host_win_add(VFIOContainer *container,
                               hwaddr min_iova, hwaddr max_iova,
                               uint64_t iova_pgsizes)
@@ -1050,6 +1126,12 @@ static void vfio_listener_region_add(MemoryListener *listener,
         }
     }
 
+    if (!memory_region_is_ram_device(section->mr) && !section->readonly &&
+        int128_get64(llsize) >= VFIO_PREFAULT_MIN_SIZE) {
+        vfio_prefault(vaddr, int128_get64(llsize),
+                      qemu_ram_pagesize(section->mr->ram_block));
+    }
+
     ret = vfio_dma_map(container, iova, int128_get64(llsize),
                        vaddr, section->readonly);
     if (ret) {
@@ -1225,6 +1307,12 @@ static void vfio_set_dirty_page_tracking(VFIOContainer *container, bool start)
         error_report("Failed to set dirty tracking flag 0x%x errno: %d",
                      dirty.flags, errno);
     }
+
+    if (!start) {
+        g_free(container->dirty_bitmap_buf);
+        container->dirty_bitmap_buf = NULL;
+        container->dirty_bitmap_buf_size = 0;
+    }
 }
 
 static void vfio_listener_log_global_start(MemoryListener *listener)
@@ -1267,11 +1355,25 @@ static int vfio_get_dirty_bitmap(VFIOContainer *container, uint64_t iova,
     pages = REAL_HOST_PAGE_ALIGN(range->size) / qemu_real_host_page_size;
     range->bitmap.size = ROUND_UP(pages, sizeof(__u64) * BITS_PER_BYTE) /
                                          BITS_PER_BYTE;
-    range->bitmap.data = g_try_malloc0(range->bitmap.size);
-    if (!range->bitmap.data) {
-        ret = -ENOMEM;
-        goto err_out;
+
+    /*
+     * The buffer is reused by every section and every sync, which saves
+     * the mmap(), munmap() and page faults of a large allocation.  The
+     * kernel only fills the bits of the ranges that are mapped.
+     */
+    if (range->bitmap.size > container->dirty_bitmap_buf_size) {
+        void *buf = g_try_malloc(range->bitmap.size);
+
+        if (!buf) {
+            ret = -ENOMEM;
+            goto err_out;
+        }
+        g_free(container->dirty_bitmap_buf);
+        container->dirty_bitmap_buf = buf;
+        container->dirty_bitmap_buf_size = range->bitmap.size;
     }
+    range->bitmap.data = container->dirty_bitmap_buf;
+    memset(range->bitmap.data, 0, range->bitmap.size);
 
     ret = ioctl(container->fd, VFIO_IOMMU_DIRTY_PAGES, dbitmap);
     if (ret) {
@@ -1287,7 +1389,6 @@ static int vfio_get_dirty_bitmap(VFIOContainer *container, uint64_t iova,
     trace_vfio_get_dirty_bitmap(container->fd, range->iova, range->size,
                                 range->bitmap.size, ram_addr);
 err_out:
-    g_free(range->bitmap.data);
     g_free(dbitmap);
 
     return ret;
@@ -2241,6 +2342,7 @@ static void vfio_disconnect_container(VFIOGroup *group)
 
         trace_vfio_disconnect_container(container->fd);
         close(container->fd);
+        g_free(container->dirty_bitmap_buf);
         g_free(container);
 
         vfio_put_address_space(space);
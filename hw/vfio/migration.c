@@ -10,6 +10,8 @@
 #include "qemu/osdep.h"
 #include "qemu/main-loop.h"
 #include "qemu/cutils.h"
+#include "qemu/lockable.h"
+#include "qemu/units.h"
 #include <linux/vfio.h>
 #include <sys/ioctl.h>
 
@@ -38,11 +40,28 @@
  * The beginning of state information is marked by _DEV_CONFIG_STATE,
  * _DEV_SETUP_STATE, or _DEV_DATA_STATE, respectively. The end of a
  * certain state information is marked by _END_OF_STATE.
+ *
+ * When the data sections go over the multifd channels, _DEV_DATA_STATE
+ * is followed by an empty section, and the last one by _DEV_DATA_MULTIFD
+ * with the number of buffers sent over the channels.
  */
 #define VFIO_MIG_FLAG_END_OF_STATE      (0xffffffffef100001ULL)
 #define VFIO_MIG_FLAG_DEV_CONFIG_STATE  (0xffffffffef100002ULL)
 #define VFIO_MIG_FLAG_DEV_SETUP_STATE   (0xffffffffef100003ULL)
 #define VFIO_MIG_FLAG_DEV_DATA_STATE    (0xffffffffef100004ULL)
+#define VFIO_MIG_FLAG_DEV_DATA_MULTIFD  (0xffffffffef100005ULL)
+
+/*
+ * Chunks of a data section that is not mmap'd are written to the device
+ * straight from the QEMUFile buffer, so they have to fit in there.
+ */
+#define VFIO_MIG_LOAD_CHUNK_SIZE        (16 * KiB)
+
+/* A data section received over multifd */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} VFIOStateBuffer;
 
 static int64_t bytes_transferred;
 
@@ -193,6 +212,54 @@ static void *get_data_section_size(VFIORegion *region, uint64_t data_offset,
     return ptr;
 }
 
+/*
+ * Copy a data section out of the migration region, and queue it on the
+ * multifd channels.  The destination loads it as it arrives, in
+ * vfio_load_state_buffer().
+ */
+static int vfio_save_buffer_multifd(QEMUFile *f, VFIODevice *vbasedev,
+                                    uint64_t data_offset, uint64_t data_size)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    VFIORegion *region = &migration->region;
+    uint64_t done = 0;
+    uint8_t *data;
+    int ret;
+
+    data = g_try_malloc(data_size);
+    if (!data) {
+        error_report("%s: Error allocating buffer ", __func__);
+        return -ENOMEM;
+    }
+
+    while (done < data_size) {
+        uint64_t sec_size;
+        void *buf;
+
+        buf = get_data_section_size(region, data_offset + done,
+                                    data_size - done, &sec_size);
+        if (buf) {
+            memcpy(data + done, buf, sec_size);
+        } else {
+            ret = vfio_mig_read(vbasedev, data + done, sec_size,
+                                region->fd_offset + data_offset + done);
+            if (ret < 0) {
+                g_free(data);
+                return ret;
+            }
+        }
+        done += sec_size;
+    }
+
+    trace_vfio_save_buffer_multifd(vbasedev->name, migration->save_buf_idx,
+                                   data_size);
+    if (multifd_queue_device_state(f, vbasedev, migration->save_buf_idx++,
+                                   data, data_size) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
 static int vfio_save_buffer(QEMUFile *f, VFIODevice *vbasedev, uint64_t *size)
 {
     VFIOMigration *migration = vbasedev->migration;
@@ -215,23 +282,41 @@ static int vfio_save_buffer(QEMUFile *f, VFIODevice *vbasedev, uint64_t *size)
     trace_vfio_save_buffer(vbasedev->name, data_offset, data_size,
                            migration->pending_bytes);
 
-    qemu_put_be64(f, data_size);
-    sz = data_size;
+    if (migration->multifd_transfer) {
+        /* An empty section in the main stream */
+        qemu_put_be64(f, 0);
+        if (data_size) {
+            ret = vfio_save_buffer_multifd(f, vbasedev, data_offset,
+                                           data_size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        sz = 0;
+    } else {
+        qemu_put_be64(f, data_size);
+        sz = data_size;
+    }
 
+    /*
+     * The sections are not copied to the QEMUFile buffer: the mmap'd ones
+     * are sent from the migration region, so they must be written out
+     * before the device is asked for more data.
+     */
     while (sz) {
         void *buf;
         uint64_t sec_size;
-        bool buf_allocated = false;
 
         buf = get_data_section_size(region, data_offset, sz, &sec_size);
 
-        if (!buf) {
+        if (buf) {
+            qemu_put_buffer_async(f, buf, sec_size, false);
+        } else {
             buf = g_try_malloc(sec_size);
             if (!buf) {
                 error_report("%s: Error allocating buffer ", __func__);
                 return -ENOMEM;
             }
-            buf_allocated = true;
 
             ret = vfio_mig_read(vbasedev, buf, sec_size,
                                 region->fd_offset + data_offset);
@@ -239,16 +324,17 @@ static int vfio_save_buffer(QEMUFile *f, VFIODevice *vbasedev, uint64_t *size)
                 g_free(buf);
                 return ret;
             }
-        }
 
-        qemu_put_buffer(f, buf, sec_size);
-
-        if (buf_allocated) {
+            qemu_put_buffer_async(f, buf, sec_size, false);
+            qemu_fflush(f);
             g_free(buf);
         }
         sz -= sec_size;
         data_offset += sec_size;
     }
+    if (data_size && !migration->multifd_transfer) {
+        qemu_fflush(f);
+    }
 
     ret = qemu_file_get_error(f);
 
@@ -260,8 +346,51 @@ static int vfio_save_buffer(QEMUFile *f, VFIODevice *vbasedev, uint64_t *size)
     return ret;
 }
 
+/*
+ * Write a section that is not mmap'd to the device, from the QEMUFile
+ * buffer when the data is already there.
+ */
+static int vfio_load_section_in_place(QEMUFile *f, VFIODevice *vbasedev,
+                                      uint64_t sec_size, uint64_t data_offset)
+{
+    VFIORegion *region = &vbasedev->migration->region;
+    uint8_t *bounce, *buf;
+    int ret = 0;
+
+    bounce = g_try_malloc(MIN(sec_size, VFIO_MIG_LOAD_CHUNK_SIZE));
+    if (!bounce) {
+        error_report("%s: Error allocating buffer ", __func__);
+        return -ENOMEM;
+    }
+
+    while (sec_size) {
+        size_t len = MIN(sec_size, VFIO_MIG_LOAD_CHUNK_SIZE);
+
+        buf = bounce;
+        if (qemu_get_buffer_in_place(f, &buf, len) != len) {
+            ret = qemu_file_get_error(f) ?: -EIO;
+            break;
+        }
+        ret = vfio_mig_write(vbasedev, buf, len,
+                             region->fd_offset + data_offset);
+        if (ret < 0) {
+            break;
+        }
+        ret = 0;
+        sec_size -= len;
+        data_offset += len;
+    }
+
+    g_free(bounce);
+    return ret;
+}
+
+/*
+ * Load @data_size bytes of a data section from @f, or from @src if it is
+ * not NULL.
+ */
 static int vfio_load_buffer(QEMUFile *f, VFIODevice *vbasedev,
-                            uint64_t data_size)
+                            const uint8_t *src, uint64_t data_size)
 {
     VFIORegion *region = &vbasedev->migration->region;
     uint64_t data_offset = 0, size, report_size;
@@ -293,26 +422,30 @@ static int vfio_load_buffer(QEMUFile *f, VFIODevice *vbasedev,
         while (size) {
             void *buf;
             uint64_t sec_size;
-            bool buf_alloc = false;
 
             buf = get_data_section_size(region, data_offset, size, &sec_size);
 
-            if (!buf) {
-                buf = g_try_malloc(sec_size);
-                if (!buf) {
-                    error_report("%s: Error allocating buffer ", __func__);
-                    return -ENOMEM;
+            if (src) {
+                if (buf) {
+                    memcpy(buf, src, sec_size);
+                } else {
+                    ret = vfio_mig_write(vbasedev, src, sec_size,
+                                         region->fd_offset + data_offset);
+                    if (ret < 0) {
+                        return ret;
+                    }
                 }
-                buf_alloc = true;
+                src += sec_size;
+                size -= sec_size;
+                data_offset += sec_size;
+                continue;
             }
 
-            qemu_get_buffer(f, buf, sec_size);
-
-            if (buf_alloc) {
-                ret = vfio_mig_write(vbasedev, buf, sec_size,
-                        region->fd_offset + data_offset);
-                g_free(buf);
-
+            if (buf) {
+                qemu_get_buffer(f, buf, sec_size);
+            } else {
+                ret = vfio_load_section_in_place(f, vbasedev, sec_size,
+                                                 data_offset);
                 if (ret < 0) {
                     return ret;
                 }
@@ -413,6 +546,9 @@ static int vfio_save_setup(QEMUFile *f, void *opaque)
 
     trace_vfio_save_setup(vbasedev->name);
 
+    migration->multifd_transfer = multifd_device_state_supported();
+    migration->save_buf_idx = 0;
+
     qemu_put_be64(f, VFIO_MIG_FLAG_DEV_SETUP_STATE);
 
     if (migration->region.mmaps) {
@@ -562,6 +698,13 @@ static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
         }
     }
 
+    if (migration->multifd_transfer) {
+        /* The device state is complete once the buffers are */
+        multifd_device_state_save_sync(f);
+        qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_MULTIFD);
+        qemu_put_be64(f, migration->save_buf_idx);
+    }
+
     qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
 
     ret = qemu_file_get_error(f);
@@ -615,6 +758,15 @@ static int vfio_load_setup(QEMUFile *f, void *opaque)
         if (migration->region.mmaps) {
             vfio_region_unmap(&migration->region);
         }
+        return ret;
+    }
+
+    if (migrate_multifd_device_state()) {
+        qemu_mutex_init(&migration->load_bufs_mutex);
+        migration->load_bufs = g_array_new(FALSE, TRUE,
+                                           sizeof(VFIOStateBuffer));
+        migration->load_buf_idx = 0;
+        migration->load_bufs_ret = 0;
     }
     return ret;
 }
@@ -622,12 +774,112 @@ static int vfio_load_setup(QEMUFile *f, void *opaque)
 static int vfio_load_cleanup(void *opaque)
 {
     VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+
+    if (migration->load_bufs) {
+        guint i;
 
+        for (i = 0; i < migration->load_bufs->len; i++) {
+            g_free(g_array_index(migration->load_bufs, VFIOStateBuffer,
+                                 i).data);
+        }
+        g_array_free(migration->load_bufs, TRUE);
+        migration->load_bufs = NULL;
+        qemu_mutex_destroy(&migration->load_bufs_mutex);
+    }
     vfio_migration_cleanup(vbasedev);
     trace_vfio_load_cleanup(vbasedev->name);
     return 0;
 }
 
+/*
+ * Called by the multifd receive threads.  The buffers can arrive in any
+ * order; whichever thread gets the next one loads it, and the ones after
+ * it that are already there.
+ */
+static int vfio_load_state_buffer(void *opaque, uint32_t idx, uint8_t *data,
+                                  size_t len, Error **errp)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    VFIOStateBuffer *lb;
+
+    if (!migration->load_bufs) {
+        g_free(data);
+        error_setg(errp, "%s: unexpected device state buffer, is the "
+                   "multifd-device-state capability set?", vbasedev->name);
+        return -EINVAL;
+    }
+
+    QEMU_LOCK_GUARD(&migration->load_bufs_mutex);
+
+    if (idx >= migration->load_bufs->len) {
+        g_array_set_size(migration->load_bufs, idx + 1);
+    }
+    lb = &g_array_index(migration->load_bufs, VFIOStateBuffer, idx);
+    if (idx < migration->load_buf_idx || lb->data) {
+        g_free(data);
+        error_setg(errp, "%s: device state buffer %u received twice",
+                   vbasedev->name, idx);
+        return -EINVAL;
+    }
+    lb->data = data;
+    lb->len = len;
+    trace_vfio_load_state_buffer(vbasedev->name, idx, len);
+
+    while (migration->load_buf_idx < migration->load_bufs->len) {
+        lb = &g_array_index(migration->load_bufs, VFIOStateBuffer,
+                            migration->load_buf_idx);
+        if (!lb->data) {
+            break;
+        }
+        if (!migration->load_bufs_ret) {
+            migration->load_bufs_ret = vfio_load_buffer(NULL, vbasedev,
+                                                        lb->data, lb->len);
+        }
+        g_free(lb->data);
+        lb->data = NULL;
+        migration->load_buf_idx++;
+    }
+
+    if (migration->load_bufs_ret) {
+        error_setg_errno(errp, -migration->load_bufs_ret,
+                         "%s: failed to load device state buffer",
+                         vbasedev->name);
+        return migration->load_bufs_ret;
+    }
+    return 0;
+}
+
+/* Wait until the device took the @count buffers sent over multifd */
+static int vfio_load_bufs_complete(VFIODevice *vbasedev, uint64_t count)
+{
+    VFIOMigration *migration = vbasedev->migration;
+
+    if (!migration->load_bufs) {
+        error_report("%s: device state sent over multifd, but the "
+                     "multifd-device-state capability is not set",
+                     vbasedev->name);
+        return -EINVAL;
+    }
+
+    multifd_device_state_load_sync();
+
+    QEMU_LOCK_GUARD(&migration->load_bufs_mutex);
+    trace_vfio_load_bufs_complete(vbasedev->name, count,
+                                  migration->load_buf_idx);
+    if (migration->load_bufs_ret) {
+        return migration->load_bufs_ret;
+    }
+    if (migration->load_buf_idx != count) {
+        error_report("%s: %"PRIu32" device state buffers received over "
+                     "multifd out of %"PRIu64, vbasedev->name,
+                     migration->load_buf_idx, count);
+        return -EINVAL;
+    }
+    return 0;
+}
+
 static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
 {
     VFIODevice *vbasedev = opaque;
@@ -661,13 +913,23 @@ static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
             uint64_t data_size = qemu_get_be64(f);
 
             if (data_size) {
-                ret = vfio_load_buffer(f, vbasedev, data_size);
+                ret = vfio_load_buffer(f, vbasedev, NULL, data_size);
                 if (ret < 0) {
                     return ret;
                 }
             }
             break;
         }
+        case VFIO_MIG_FLAG_DEV_DATA_MULTIFD:
+        {
+            uint64_t count = qemu_get_be64(f);
+
+            ret = vfio_load_bufs_complete(vbasedev, count);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
         default:
             error_report("%s: Unknown tag 0x%"PRIx64, vbasedev->name, data);
             return -EINVAL;
@@ -692,6 +954,7 @@ static SaveVMHandlers savevm_vfio_handlers = {
     .load_setup = vfio_load_setup,
     .load_cleanup = vfio_load_cleanup,
     .load_state = vfio_load_state,
+    .load_state_buffer = vfio_load_state_buffer,
 };
 
 /* ---------------------------------------------------------------------- */
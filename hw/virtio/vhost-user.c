@@ -80,10 +80,13 @@ enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_RESET_DEVICE = 13,
     /* Feature 14 reserved for VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS. */
     VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS = 15,
+    /* Feature 16 reserved for VHOST_USER_PROTOCOL_F_STATUS. */
+    VHOST_USER_PROTOCOL_F_LOG_RING = 17,
     VHOST_USER_PROTOCOL_F_MAX
 };
 
-#define VHOST_USER_PROTOCOL_FEATURE_MASK ((1 << VHOST_USER_PROTOCOL_F_MAX) - 1)
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    (((1 << VHOST_USER_PROTOCOL_F_MAX) - 1) & ~(1 << 16))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -125,6 +128,8 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_MAX_MEM_SLOTS = 36,
     VHOST_USER_ADD_MEM_REG = 37,
     VHOST_USER_REM_MEM_REG = 38,
+    /* Message numbers 39 and 40 reserved for VHOST_USER_SET/GET_STATUS. */
+    VHOST_USER_SET_LOG_RING = 41,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -2029,6 +2034,29 @@ static bool vhost_user_requires_shm_log(struct vhost_dev *dev)
                               VHOST_USER_PROTOCOL_F_LOG_SHMFD);
 }
 
+static int vhost_user_set_log_ring(struct vhost_dev *dev,
+                                   struct vhost_log_ring *ring)
+{
+    VhostUserMsg msg = {
+        .hdr.request = VHOST_USER_SET_LOG_RING,
+        .hdr.flags = VHOST_USER_VERSION | VHOST_USER_NEED_REPLY_MASK,
+        .payload.log.mmap_size = ring->mmap_size,
+        .payload.log.mmap_offset = 0,
+        .hdr.size = sizeof(msg.payload.log),
+    };
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_LOG_RING)) {
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, &ring->fd, 1) < 0) {
+        return -1;
+    }
+
+    return process_message_reply(dev, &msg);
+}
+
 static int vhost_user_migration_done(struct vhost_dev *dev, char* mac_addr)
 {
     VhostUserMsg msg = { };
@@ -2446,6 +2474,7 @@ const VhostOps user_ops = {
         .vhost_get_vq_index = vhost_user_get_vq_index,
         .vhost_set_vring_enable = vhost_user_set_vring_enable,
         .vhost_requires_shm_log = vhost_user_requires_shm_log,
+        .vhost_set_log_ring = vhost_user_set_log_ring,
         .vhost_migration_done = vhost_user_migration_done,
         .vhost_backend_can_merge = vhost_user_can_merge,
         .vhost_net_set_mtu = vhost_user_net_set_mtu,
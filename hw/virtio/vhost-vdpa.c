@@ -89,6 +89,104 @@ static int vhost_vdpa_dma_unmap(struct vhost_vdpa *v, hwaddr iova,
     return ret;
 }
 
+static void vhost_vdpa_insert_map(struct vhost_vdpa *v, VhostVDPAMap *map)
+{
+    guint i;
+
+    if (vhost_vdpa_dma_map(v, map->iova, map->size, map->vaddr,
+                           map->readonly)) {
+        error_report("vhost-vdpa: DMA mapping failed, unable to continue");
+        return;
+    }
+
+    for (i = 0; i < v->maps->len; i++) {
+        if (g_array_index(v->maps, VhostVDPAMap, i).iova > map->iova) {
+            break;
+        }
+    }
+    g_array_insert_val(v->maps, i, *map);
+}
+
+static void vhost_vdpa_flush_pending_map(struct vhost_vdpa *v)
+{
+    if (v->pending_map.size) {
+        vhost_vdpa_insert_map(v, &v->pending_map);
+        v->pending_map.size = 0;
+    }
+}
+
+/*
+ * Queue a mapping, merged with the previous one when it follows it both
+ * in iova and in host memory, so that contiguous RAM takes one entry.
+ */
+static void vhost_vdpa_add_map(struct vhost_vdpa *v, hwaddr iova,
+                               hwaddr size, void *vaddr, bool readonly)
+{
+    VhostVDPAMap *pending = &v->pending_map;
+
+    if (pending->size && pending->readonly == readonly &&
+        pending->iova + pending->size == iova &&
+        (uint8_t *)pending->vaddr + pending->size == vaddr) {
+        pending->size += size;
+        return;
+    }
+
+    vhost_vdpa_flush_pending_map(v);
+    *pending = (VhostVDPAMap) {
+        .iova = iova,
+        .size = size,
+        .vaddr = vaddr,
+        .readonly = readonly,
+    };
+}
+
+/*
+ * The device drops every entry that a range overlaps, so the parts of a
+ * merged entry outside [@iova, @iova + @size) are mapped again.
+ */
+static void vhost_vdpa_del_map(struct vhost_vdpa *v, hwaddr iova,
+                               hwaddr size)
+{
+    hwaddr end = iova + size;
+    guint i = 0;
+
+    vhost_vdpa_flush_pending_map(v);
+
+    while (i < v->maps->len) {
+        VhostVDPAMap map = g_array_index(v->maps, VhostVDPAMap, i);
+        hwaddr map_end = map.iova + map.size;
+
+        if (map_end <= iova) {
+            i++;
+            continue;
+        }
+        if (map.iova >= end) {
+            break;
+        }
+
+        g_array_remove_index(v->maps, i);
+        if (vhost_vdpa_dma_unmap(v, map.iova, map.size)) {
+            error_report("vhost_vdpa dma unmap error!");
+        }
+        if (map.iova < iova) {
+            VhostVDPAMap head = map;
+
+            head.size = iova - map.iova;
+            vhost_vdpa_insert_map(v, &head);
+            i++;
+        }
+        if (map_end > end) {
+            VhostVDPAMap tail = map;
+
+            tail.iova = end;
+            tail.size = map_end - end;
+            tail.vaddr = (uint8_t *)map.vaddr + (end - map.iova);
+            vhost_vdpa_insert_map(v, &tail);
+            break;
+        }
+    }
+}
+
 static void vhost_vdpa_listener_begin(MemoryListener *listener)
 {
     struct vhost_vdpa *v = container_of(listener, struct vhost_vdpa, listener);
@@ -116,6 +214,8 @@ static void vhost_vdpa_listener_commit(MemoryListener *listener)
     struct vhost_msg_v2 msg = {};
     int fd = v->device_fd;
 
+    vhost_vdpa_flush_pending_map(v);
+
     if (!(dev->backend_cap & (0x1ULL << VHOST_BACKEND_F_IOTLB_BATCH))) {
         return;
     }
@@ -136,7 +236,6 @@ static void vhost_vdpa_listener_region_add(MemoryListener *listener,
     hwaddr iova;
     Int128 llend, llsize;
     void *vaddr;
-    int ret;
 
     if (vhost_vdpa_listener_skipped_section(section)) {
         return;
@@ -170,24 +269,8 @@ static void vhost_vdpa_listener_region_add(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
-    ret = vhost_vdpa_dma_map(v, iova, int128_get64(llsize),
-                             vaddr, section->readonly);
-    if (ret) {
-        error_report("vhost vdpa map fail!");
-        goto fail;
-    }
-
-    return;
-
-fail:
-    /*
-     * On the initfn path, store the first error in the container so we
-     * can gracefully fail.  Runtime, there's not much we can do other
-     * than throw a hardware error.
-     */
-    error_report("vhost-vdpa: DMA mapping failed, unable to continue");
-    return;
-
+    vhost_vdpa_add_map(v, iova, int128_get64(llsize), vaddr,
+                       section->readonly);
 }
 
 static void vhost_vdpa_listener_region_del(MemoryListener *listener,
@@ -196,7 +279,6 @@ static void vhost_vdpa_listener_region_del(MemoryListener *listener,
     struct vhost_vdpa *v = container_of(listener, struct vhost_vdpa, listener);
     hwaddr iova;
     Int128 llend, llsize;
-    int ret;
 
     if (vhost_vdpa_listener_skipped_section(section)) {
         return;
@@ -221,10 +303,7 @@ static void vhost_vdpa_listener_region_del(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
-    ret = vhost_vdpa_dma_unmap(v, iova, int128_get64(llsize));
-    if (ret) {
-        error_report("vhost_vdpa dma unmap error!");
-    }
+    vhost_vdpa_del_map(v, iova, int128_get64(llsize));
 
     memory_region_unref(section->mr);
 }
@@ -278,6 +357,7 @@ static int vhost_vdpa_init(struct vhost_dev *dev, void *opaque, Error **errp)
     dev->opaque =  opaque ;
     v->listener = vhost_vdpa_memory_listener;
     v->msg_type = VHOST_IOTLB_MSG_V2;
+    v->maps = g_array_new(false, false, sizeof(VhostVDPAMap));
 
     vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
                                VIRTIO_CONFIG_S_DRIVER);
@@ -375,6 +455,8 @@ static int vhost_vdpa_cleanup(struct vhost_dev *dev)
     trace_vhost_vdpa_cleanup(dev, v);
     vhost_vdpa_host_notifiers_uninit(dev, dev->nvqs);
     memory_listener_unregister(&v->listener);
+    g_array_free(v->maps, true);
+    v->maps = NULL;
 
     dev->opaque = NULL;
     return 0;
@@ -20,9 +20,11 @@
 #include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
+#include "qemu/cutils.h"
 #include "standard-headers/linux/vhost_types.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
+#include "exec/ram_addr.h"
 #include "migration/blocker.h"
 #include "migration/qemu-file-types.h"
 #include "sysemu/dma.h"
@@ -60,6 +62,64 @@ bool vhost_has_free_slot(void)
     return slots_limit > used_memslots;
 }
 
+/* Words of the log that are checked for zeroes at once */
+#define VHOST_LOG_SCAN_WORDS 64
+
+static void vhost_dev_set_dirty_run(MemoryRegionSection *section,
+                                    hwaddr page_addr, uint64_t pages)
+{
+    hwaddr section_offset = page_addr - section->offset_within_address_space;
+    hwaddr mr_offset = section_offset + section->offset_within_region;
+
+    memory_region_set_dirty(section->mr, mr_offset, pages * VHOST_LOG_PAGE);
+}
+
+/* Mark the pages of @n words of the log, starting at @addr, as dirty */
+static void vhost_dev_set_dirty_words(MemoryRegionSection *section,
+                                      hwaddr addr, vhost_log_chunk_t *words,
+                                      size_t n)
+{
+    hwaddr start = section->offset_within_address_space;
+    uint64_t first = 0, count = 0, page;
+    size_t i;
+
+    /* The log is a little-endian bitmap, like the KVM dirty log */
+    if (addr >= start &&
+        addr + n * VHOST_LOG_CHUNK <= start + int128_get64(section->size) &&
+        memory_region_is_ram(section->mr) &&
+        TARGET_PAGE_SIZE == VHOST_LOG_PAGE) {
+        cpu_physical_memory_set_dirty_lebitmap(words,
+            memory_region_get_ram_addr(section->mr) +
+            section->offset_within_region + (addr - start),
+            n * VHOST_LOG_BITS);
+        return;
+    }
+
+    /* Pages at the edges of the section: set runs of them at once */
+    for (i = 0; i < n; i++) {
+        vhost_log_chunk_t log = words[i];
+
+        while (log) {
+            page = i * VHOST_LOG_BITS + ctzl(log);
+            if (count && page == first + count) {
+                count++;
+            } else {
+                if (count) {
+                    vhost_dev_set_dirty_run(section,
+                                            addr + first * VHOST_LOG_PAGE,
+                                            count);
+                }
+                first = page;
+                count = 1;
+            }
+            log &= log - 1;
+        }
+    }
+    if (count) {
+        vhost_dev_set_dirty_run(section, addr + first * VHOST_LOG_PAGE, count);
+    }
+}
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
                                   uint64_t mfirst, uint64_t mlast,
@@ -72,6 +132,8 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     vhost_log_chunk_t *from = log + start / VHOST_LOG_CHUNK;
     vhost_log_chunk_t *to = log + end / VHOST_LOG_CHUNK + 1;
     uint64_t addr = QEMU_ALIGN_DOWN(start, VHOST_LOG_CHUNK);
+    vhost_log_chunk_t words[VHOST_LOG_SCAN_WORDS];
+    size_t i, n;
 
     if (end < start) {
         return;
@@ -79,29 +141,19 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(end / VHOST_LOG_CHUNK < dev->log_size);
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
-    for (;from < to; ++from) {
-        vhost_log_chunk_t log;
+    for (; from < to; from += n, addr += n * VHOST_LOG_CHUNK) {
+        n = MIN(to - from, VHOST_LOG_SCAN_WORDS);
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
-        if (!*from) {
-            addr += VHOST_LOG_CHUNK;
+        if (buffer_is_zero(from, n * sizeof(*from))) {
             continue;
         }
-        /* Data must be read atomically. We don't really need barrier semantics
-         * but it's easier to use atomic_* than roll our own. */
-        log = qatomic_xchg(from, 0);
-        while (log) {
-            int bit = ctzl(log);
-            hwaddr page_addr;
-            hwaddr section_offset;
-            hwaddr mr_offset;
-            page_addr = addr + bit * VHOST_LOG_PAGE;
-            section_offset = page_addr - section->offset_within_address_space;
-            mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+        for (i = 0; i < n; i++) {
+            /* Data must be read atomically. We don't really need barrier
+             * semantics but it's easier to use atomic_* than roll our own. */
+            words[i] = from[i] ? qatomic_xchg(&from[i], 0) : 0;
         }
-        addr += VHOST_LOG_CHUNK;
+        vhost_dev_set_dirty_words(section, addr, words, n);
     }
 }
 
@@ -142,14 +194,6 @@ static int vhost_sync_dirty_bitmap(struct vhost_dev *dev,
     return 0;
 }
 
-static void vhost_log_sync(MemoryListener *listener,
-                          MemoryRegionSection *section)
-{
-    struct vhost_dev *dev = container_of(listener, struct vhost_dev,
-                                         memory_listener);
-    vhost_sync_dirty_bitmap(dev, section, 0x0, ~0x0ULL);
-}
-
 static void vhost_log_sync_range(struct vhost_dev *dev,
                                  hwaddr first, hwaddr last)
 {
@@ -161,6 +205,147 @@ static void vhost_log_sync_range(struct vhost_dev *dev,
     }
 }
 
+/*
+ * With a log ring, the backend pushes the pages it dirties to the ring
+ * instead of only setting their bit in the log, so syncing doesn't scan
+ * the whole log.  The bit of a page stays set while it is in the ring,
+ * and is cleared when it is reaped, so that a page that is dirtied
+ * again before it is reaped doesn't take another entry.  When the ring
+ * is full, the backend only sets the bit and VHOST_LOG_RING_F_OVERFLOW,
+ * and the next sync scans the log.
+ */
+static void vhost_log_ring_set_dirty(struct vhost_dev *dev, uint64_t gpa)
+{
+    struct vhost_log_ring *ring = dev->log_ring;
+    uint64_t page = gpa / VHOST_LOG_PAGE;
+    int i, n;
+
+    if (page < dev->log_size * VHOST_LOG_BITS) {
+        qatomic_and(&((uint8_t *)dev->log->log)[page / 8],
+                    ~(1 << (page % 8)));
+    }
+
+    /* Pages usually come in runs from the same section */
+    i = ring->last_section < dev->n_mem_sections ? ring->last_section : 0;
+    for (n = 0; n < dev->n_mem_sections; n++) {
+        MemoryRegionSection *section = &dev->mem_sections[i];
+        hwaddr start = section->offset_within_address_space;
+
+        if (gpa >= start && gpa - start < int128_get64(section->size)) {
+            memory_region_set_dirty(section->mr,
+                                    gpa - start +
+                                    section->offset_within_region,
+                                    VHOST_LOG_PAGE);
+            ring->last_section = i;
+            return;
+        }
+        i = (i + 1) % dev->n_mem_sections;
+    }
+}
+
+static void vhost_log_ring_reap(struct vhost_dev *dev)
+{
+    struct vhost_log_ring *ring = dev->log_ring;
+    uint32_t mask = ring->hdr->size - 1;
+    uint64_t tail = ring->hdr->tail;
+    uint64_t *entry, gpa;
+    uint64_t reaped = 0;
+
+    while (true) {
+        entry = &ring->entries[tail & mask];
+        gpa = qatomic_read__nocheck(entry);
+        if (!gpa) {
+            break;
+        }
+        qatomic_set__nocheck(entry, 0);
+        vhost_log_ring_set_dirty(dev, gpa & ~VHOST_LOG_RING_VALID);
+        tail++;
+        reaped++;
+    }
+    /* The backend may only reuse the entries once they are free */
+    smp_mb();
+    qatomic_set__nocheck(&ring->hdr->tail, tail);
+
+    if (qatomic_read(&ring->hdr->flags) & VHOST_LOG_RING_F_OVERFLOW) {
+        /* Clear it first, pages logged during the scan set it again */
+        qatomic_and(&ring->hdr->flags, ~VHOST_LOG_RING_F_OVERFLOW);
+        smp_mb();
+        vhost_log_sync_range(dev, 0, ~0x0ULL);
+        trace_vhost_log_ring_overflow(dev);
+    }
+    trace_vhost_log_ring_reap(dev, reaped);
+}
+
+static void vhost_log_ring_free(struct vhost_log_ring *ring)
+{
+    qemu_memfd_free(ring->hdr, ring->mmap_size, ring->fd);
+    g_free(ring);
+}
+
+/* Give the backend a ring, if it supports one, once the log is set up */
+static void vhost_log_ring_start(struct vhost_dev *dev)
+{
+    struct vhost_log_ring *ring;
+    Error *err = NULL;
+
+    if (dev->log_ring || !dev->vhost_ops->vhost_set_log_ring ||
+        !dev->log || dev->log->fd < 0) {
+        return;
+    }
+
+    ring = g_new0(struct vhost_log_ring, 1);
+    ring->mmap_size = sizeof(*ring->hdr) +
+                      VHOST_LOG_RING_ENTRIES * sizeof(*ring->entries);
+    ring->hdr = qemu_memfd_alloc("vhost-log-ring", ring->mmap_size,
+                                 F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+                                 &ring->fd, &err);
+    if (err) {
+        error_report_err(err);
+        g_free(ring);
+        return;
+    }
+    memset(ring->hdr, 0, ring->mmap_size);
+    ring->hdr->size = VHOST_LOG_RING_ENTRIES;
+    /* The backend logged to the log alone until now */
+    ring->hdr->flags = VHOST_LOG_RING_F_OVERFLOW;
+    ring->entries = (uint64_t *)(ring->hdr + 1);
+
+    if (dev->vhost_ops->vhost_set_log_ring(dev, ring) < 0) {
+        vhost_log_ring_free(ring);
+        return;
+    }
+    dev->log_ring = ring;
+    trace_vhost_log_ring_start(dev, VHOST_LOG_RING_ENTRIES);
+}
+
+static void vhost_log_ring_stop(struct vhost_dev *dev, bool sync)
+{
+    if (!dev->log_ring) {
+        return;
+    }
+    if (sync) {
+        vhost_log_ring_reap(dev);
+    }
+    vhost_log_ring_free(dev->log_ring);
+    dev->log_ring = NULL;
+}
+
+static void vhost_log_sync(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    struct vhost_dev *dev = container_of(listener, struct vhost_dev,
+                                         memory_listener);
+
+    if (dev->log_ring) {
+        /* Everything is reaped at once, the other sections find it empty */
+        if (dev->log_enabled && dev->started) {
+            vhost_log_ring_reap(dev);
+        }
+        return;
+    }
+    vhost_sync_dirty_bitmap(dev, section, 0x0, ~0x0ULL);
+}
+
 static uint64_t vhost_get_log_size(struct vhost_dev *dev)
 {
     uint64_t log_size = 0;
@@ -884,9 +1069,11 @@ static int vhost_migration_log(MemoryListener *listener, bool enable)
         if (r < 0) {
             goto check_dev_state;
         }
+        vhost_log_ring_stop(dev, false);
         vhost_log_put(dev, false);
     } else {
         vhost_dev_log_resize(dev, vhost_get_log_size(dev));
+        vhost_log_ring_start(dev);
         r = vhost_dev_set_log(dev, true);
         if (r < 0) {
             goto check_dev_state;
@@ -1431,6 +1618,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
         hdev->vhost_ops->vhost_backend_cleanup(hdev);
     }
     assert(!hdev->log);
+    assert(!hdev->log_ring);
 
     memset(hdev, 0, sizeof(struct vhost_dev));
 }
@@ -1438,10 +1626,44 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
 /* Stop processing guest IO notifications in qemu.
  * Start processing them in vhost in kernel.
  */
+static void vhost_dev_disable_notifiers_nvqs(struct vhost_dev *hdev,
+                                             VirtIODevice *vdev,
+                                             unsigned int nvqs)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    int i, r;
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+
+    for (i = 0; i < nvqs; ++i) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), hdev->vq_index + i,
+                                         false);
+        if (r < 0) {
+            error_report("vhost VQ %d notifier cleanup failed: %d", i, -r);
+        }
+        assert (r >= 0);
+    }
+
+    /*
+     * The transaction expects the ioeventfds to be open when it
+     * commits. Do it now, before the cleanup loop.
+     */
+    memory_region_transaction_commit();
+
+    for (i = 0; i < nvqs; ++i) {
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), hdev->vq_index + i);
+    }
+    virtio_device_release_ioeventfd(vdev);
+}
+
 int vhost_dev_enable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
-    int i, r, e;
+    int i, r;
 
     /* We will pass the notifiers to the kernel, make sure that QEMU
      * doesn't interfere.
@@ -1449,32 +1671,30 @@ int vhost_dev_enable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     r = virtio_device_grab_ioeventfd(vdev);
     if (r < 0) {
         error_report("binding does not support host notifiers");
-        goto fail;
+        return r;
     }
 
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds(),
+     * and to only update the KVM ioeventfds once.
+     */
+    memory_region_transaction_begin();
+
     for (i = 0; i < hdev->nvqs; ++i) {
         r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), hdev->vq_index + i,
                                          true);
         if (r < 0) {
             error_report("vhost VQ %d notifier binding failed: %d", i, -r);
-            goto fail_vq;
+            memory_region_transaction_commit();
+            vhost_dev_disable_notifiers_nvqs(hdev, vdev, i);
+            return r;
         }
     }
 
+    memory_region_transaction_commit();
+
     return 0;
-fail_vq:
-    while (--i >= 0) {
-        e = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), hdev->vq_index + i,
-                                         false);
-        if (e < 0) {
-            error_report("vhost VQ %d notifier cleanup error: %d", i, -r);
-        }
-        assert (e >= 0);
-        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), hdev->vq_index + i);
-    }
-    virtio_device_release_ioeventfd(vdev);
-fail:
-    return r;
 }
 
 /* Stop processing guest IO notifications in vhost.
@@ -1484,19 +1704,7 @@ fail:
  */
 void vhost_dev_disable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
-    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
-    int i, r;
-
-    for (i = 0; i < hdev->nvqs; ++i) {
-        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), hdev->vq_index + i,
-                                         false);
-        if (r < 0) {
-            error_report("vhost VQ %d notifier cleanup failed: %d", i, -r);
-        }
-        assert (r >= 0);
-        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), hdev->vq_index + i);
-    }
-    virtio_device_release_ioeventfd(vdev);
+    vhost_dev_disable_notifiers_nvqs(hdev, vdev, hdev->nvqs);
 }
 
 /* Test and clear event pending status.
@@ -1767,6 +1975,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
             r = -errno;
             goto fail_log;
         }
+        vhost_log_ring_start(hdev);
     }
     if (hdev->vhost_ops->vhost_dev_start) {
         r = hdev->vhost_ops->vhost_dev_start(hdev, true);
@@ -1787,6 +1996,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
     return 0;
 fail_log:
+    vhost_log_ring_stop(hdev, false);
     vhost_log_put(hdev, false);
 fail_vq:
     while (--i >= 0) {
@@ -1827,6 +2037,7 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
         }
         memory_listener_unregister(&hdev->iommu_listener);
     }
+    vhost_log_ring_stop(hdev, true);
     vhost_log_put(hdev, true);
     hdev->started = false;
     hdev->vdev = NULL;
@@ -17,6 +17,7 @@
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "hw/virtio/virtio.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/qdev-properties.h"
@@ -24,6 +25,8 @@
 #include "sysemu/balloon.h"
 #include "hw/virtio/virtio-balloon.h"
 #include "exec/address-spaces.h"
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
 #include "qapi/error.h"
 #include "qapi/qapi-events-machine.h"
 #include "qapi/visitor.h"
@@ -324,14 +327,182 @@ static void balloon_stats_set_poll_interval(Object *obj, Visitor *v,
     balloon_stats_change_timer(s, 0);
 }
 
+/* A range of guest memory that the guest reported as free */
+typedef struct VirtIOBalloonReportRange {
+    RAMBlock *rb;
+    MemoryRegion *mr;
+    ram_addr_t offset;
+    void *host;
+    size_t size;
+} VirtIOBalloonReportRange;
+
+/*
+ * The elements that the guest queued on the reporting queue.  Their ranges
+ * are sorted and merged, then discarded by the thread pool.
+ */
+typedef struct VirtIOBalloonReport {
+    VirtIOBalloon *dev;
+    GPtrArray *elems;
+    GArray *ranges;
+    uint64_t bytes;
+    int64_t start_ns;
+} VirtIOBalloonReport;
+
+static gint virtio_balloon_report_range_cmp(gconstpointer a, gconstpointer b)
+{
+    const VirtIOBalloonReportRange *ra = a, *rb = b;
+
+    if (ra->rb != rb->rb) {
+        return (uintptr_t)ra->rb < (uintptr_t)rb->rb ? -1 : 1;
+    }
+    return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+/* Sort the ranges of @report and merge the contiguous ones */
+static void virtio_balloon_report_merge(VirtIOBalloonReport *report)
+{
+    GArray *ranges = report->ranges;
+    VirtIOBalloonReportRange *last = NULL;
+    guint i, n = 0;
+
+    g_array_sort(ranges, virtio_balloon_report_range_cmp);
+    for (i = 0; i < ranges->len; i++) {
+        VirtIOBalloonReportRange *r =
+            &g_array_index(ranges, VirtIOBalloonReportRange, i);
+
+        if (last && last->rb == r->rb &&
+            last->offset + last->size >= r->offset) {
+            /* The guest should not report a page twice, but be safe. */
+            last->size = MAX(last->size, r->offset + r->size - last->offset);
+            continue;
+        }
+        last = &g_array_index(ranges, VirtIOBalloonReportRange, n++);
+        *last = *r;
+    }
+    g_array_set_size(ranges, n);
+
+    /* Keep the memory around while the thread pool discards it. */
+    for (i = 0; i < n; i++) {
+        VirtIOBalloonReportRange *r =
+            &g_array_index(ranges, VirtIOBalloonReportRange, i);
+        ram_addr_t offset;
+
+        r->mr = memory_region_from_host(r->host, &offset);
+        memory_region_ref(r->mr);
+        report->bytes += r->size;
+    }
+}
+
+static int virtio_balloon_report_worker(void *opaque)
+{
+    VirtIOBalloonReport *report = opaque;
+    guint i;
+
+    for (i = 0; i < report->ranges->len; i++) {
+        VirtIOBalloonReportRange *r =
+            &g_array_index(report->ranges, VirtIOBalloonReportRange, i);
+
+        /* We ignore errors, the pages simply stay populated. */
+        ram_block_discard_range(r->rb, r->offset, r->size);
+    }
+    return 0;
+}
+
+/* Answer the elements of @report and free it */
+static void virtio_balloon_report_finish(VirtIOBalloonReport *report)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(report->dev);
+    VirtQueue *vq = report->dev->reporting_vq;
+    GArray *ranges = report->ranges;
+    guint i;
+
+    /*
+     * The pages are free in the guest, don't send them if RAM is being
+     * migrated.  The dirty log is cleared first, so that the guest can use
+     * them again as soon as it gets the elements back.
+     */
+    if (ranges->len) {
+        g_autofree struct iovec *iov = g_new(struct iovec, ranges->len);
+
+        for (i = 0; i < ranges->len; i++) {
+            VirtIOBalloonReportRange *r =
+                &g_array_index(ranges, VirtIOBalloonReportRange, i);
+
+            iov[i].iov_base = r->host;
+            iov[i].iov_len = r->size;
+        }
+        qemu_guest_free_page_hints(iov, ranges->len);
+    }
+
+    for (i = 0; i < report->elems->len; i++) {
+        VirtQueueElement *elem = g_ptr_array_index(report->elems, i);
+
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+    }
+    virtio_notify(vdev, vq);
+
+    trace_virtio_balloon_report_done(report->elems->len, ranges->len,
+                                     report->bytes,
+                                     (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                      report->start_ns) / SCALE_US);
+    for (i = 0; i < ranges->len; i++) {
+        memory_region_unref(g_array_index(ranges, VirtIOBalloonReportRange,
+                                          i).mr);
+    }
+    g_array_free(ranges, true);
+    g_ptr_array_free(report->elems, true);
+    g_free(report);
+}
+
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq);
+
+static void virtio_balloon_report_done(void *opaque, int ret)
+{
+    VirtIOBalloonReport *report = opaque;
+    VirtIOBalloon *dev = report->dev;
+
+    dev->report = NULL;
+    virtio_balloon_report_finish(report);
+
+    /* Process the elements that the guest queued in the meantime. */
+    virtio_balloon_handle_report(VIRTIO_DEVICE(dev), dev->reporting_vq);
+}
+
+/* Wait for the report that the thread pool discards, if any */
+static void virtio_balloon_report_drain(VirtIOBalloon *dev)
+{
+    AIO_WAIT_WHILE(NULL, dev->report);
+}
+
+/*
+ * Guests report gigabytes at once: instead of discarding each range in the
+ * main loop, all the elements in the queue are collected, and their ranges
+ * discarded by the thread pool.  The queue is not processed again until
+ * that is done.
+ */
 static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
+    VirtIOBalloonReport *report;
     VirtQueueElement *elem;
 
+    if (dev->report) {
+        return;
+    }
+
+    report = g_new0(VirtIOBalloonReport, 1);
+    report->dev = dev;
+    report->elems = g_ptr_array_new();
+    report->ranges = g_array_new(false, false,
+                                 sizeof(VirtIOBalloonReportRange));
+    report->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         unsigned int i;
 
+        g_ptr_array_add(report->elems, elem);
+
         /*
          * When we discard the page it has the effect of removing the page
          * from the hypervisor itself and causing it to be zeroed when it
@@ -340,14 +511,14 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
          * expecting it to retain a non-zero value.
          */
         if (virtio_balloon_inhibited() || dev->poison_val) {
-            goto skip_element;
+            continue;
         }
 
         for (i = 0; i < elem->in_num; i++) {
-            void *addr = elem->in_sg[i].iov_base;
-            size_t size = elem->in_sg[i].iov_len;
-            ram_addr_t ram_offset;
-            RAMBlock *rb;
+            VirtIOBalloonReportRange range = {
+                .host = elem->in_sg[i].iov_base,
+                .size = elem->in_sg[i].iov_len,
+            };
 
             /*
              * There is no need to check the memory section to see if
@@ -360,8 +531,9 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
              * will return NULL after the first bounce buffer and fail
              * to map any resources.
              */
-            rb = qemu_ram_block_from_host(addr, false, &ram_offset);
-            if (!rb) {
+            range.rb = qemu_ram_block_from_host(range.host, false,
+                                                &range.offset);
+            if (!range.rb) {
                 trace_virtio_balloon_bad_addr(elem->in_addr[i]);
                 continue;
             }
@@ -370,19 +542,34 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
              * For now we will simply ignore unaligned memory regions, or
              * regions that overrun the end of the RAMBlock.
              */
-            if (!QEMU_IS_ALIGNED(ram_offset | size, qemu_ram_pagesize(rb)) ||
-                (ram_offset + size) > qemu_ram_get_used_length(rb)) {
+            if (!QEMU_IS_ALIGNED(range.offset | range.size,
+                                 qemu_ram_pagesize(range.rb)) ||
+                (range.offset + range.size) >
+                qemu_ram_get_used_length(range.rb)) {
                 continue;
             }
 
-            ram_block_discard_range(rb, ram_offset, size);
+            g_array_append_val(report->ranges, range);
         }
+    }
 
-skip_element:
-        virtqueue_push(vq, elem, 0);
-        virtio_notify(vdev, vq);
-        g_free(elem);
+    if (!report->elems->len) {
+        g_array_free(report->ranges, true);
+        g_ptr_array_free(report->elems, true);
+        g_free(report);
+        return;
     }
+
+    if (!report->ranges->len) {
+        virtio_balloon_report_finish(report);
+        return;
+    }
+
+    virtio_balloon_report_merge(report);
+    dev->report = report;
+    thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
+                           virtio_balloon_report_worker, report,
+                           virtio_balloon_report_done, report);
 }
 
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
@@ -503,17 +690,42 @@ static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
     qemu_bh_schedule(s->free_page_bh);
 }
 
-static bool get_free_page_hints(VirtIOBalloon *dev)
+/*
+ * The hints of up to FREE_PAGE_HINT_BATCH elements are applied to the
+ * migration bitmap at once.  The elements are only given back to the
+ * guest after that, since it may reuse the pages as soon as they are.
+ */
+#define FREE_PAGE_HINT_BATCH 64
+
+typedef struct {
+    VirtQueueElement *elems[FREE_PAGE_HINT_BATCH];
+    struct iovec hints[FREE_PAGE_HINT_BATCH];
+    int nelems;
+    int nhints;
+} FreePageHintBatch;
+
+static void free_page_hints_flush(VirtIOBalloon *dev, FreePageHintBatch *batch)
+{
+    int i;
+
+    if (batch->nhints) {
+        qemu_guest_free_page_hints(batch->hints, batch->nhints);
+    }
+    for (i = 0; i < batch->nelems; i++) {
+        virtqueue_push(dev->free_page_vq, batch->elems[i], 1);
+        g_free(batch->elems[i]);
+    }
+    batch->nelems = 0;
+    batch->nhints = 0;
+}
+
+static bool get_free_page_hints(VirtIOBalloon *dev, FreePageHintBatch *batch)
 {
     VirtQueueElement *elem;
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtQueue *vq = dev->free_page_vq;
     bool ret = true;
 
-    while (dev->block_iothread) {
-        qemu_cond_wait(&dev->free_page_cond, &dev->free_page_lock);
-    }
-
     elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
     if (!elem) {
         return false;
@@ -546,14 +758,12 @@ static bool get_free_page_hints(VirtIOBalloon *dev)
 
     if (elem->in_num) {
         if (dev->free_page_hint_status == FREE_PAGE_HINT_S_START) {
-            qemu_guest_free_page_hint(elem->in_sg[0].iov_base,
-                                      elem->in_sg[0].iov_len);
+            batch->hints[batch->nhints++] = elem->in_sg[0];
         }
     }
 
 out:
-    virtqueue_push(vq, elem, 1);
-    g_free(elem);
+    batch->elems[batch->nelems++] = elem;
     return ret;
 }
 
@@ -562,12 +772,21 @@ static void virtio_ballloon_get_free_page_hints(void *opaque)
     VirtIOBalloon *dev = opaque;
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtQueue *vq = dev->free_page_vq;
+    FreePageHintBatch batch = { .nelems = 0 };
     bool continue_to_get_hints;
 
     do {
         qemu_mutex_lock(&dev->free_page_lock);
+        /* Don't keep elements while the VM is stopped and migrated */
+        while (dev->block_iothread) {
+            qemu_cond_wait(&dev->free_page_cond, &dev->free_page_lock);
+        }
         virtio_queue_set_notification(vq, 0);
-        continue_to_get_hints = get_free_page_hints(dev);
+        do {
+            continue_to_get_hints = get_free_page_hints(dev, &batch);
+        } while (continue_to_get_hints &&
+                 batch.nelems < FREE_PAGE_HINT_BATCH);
+        free_page_hints_flush(dev, &batch);
         qemu_mutex_unlock(&dev->free_page_lock);
         virtio_notify(vdev, vq);
       /*
@@ -827,6 +1046,13 @@ static void virtio_balloon_to_target(void *opaque, ram_addr_t target)
     trace_virtio_balloon_to_target(target, dev->num_pages);
 }
 
+static int virtio_balloon_pre_save_device(void *opaque)
+{
+    /* The elements of a report in progress must be answered here. */
+    virtio_balloon_report_drain(VIRTIO_BALLOON(opaque));
+    return 0;
+}
+
 static int virtio_balloon_post_load_device(void *opaque, int version_id)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(opaque);
@@ -864,6 +1090,7 @@ static const VMStateDescription vmstate_virtio_balloon_device = {
     .name = "virtio-balloon-device",
     .version_id = 1,
     .minimum_version_id = 1,
+    .pre_save = virtio_balloon_pre_save_device,
     .post_load = virtio_balloon_post_load_device,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(num_pages, VirtIOBalloon),
@@ -930,6 +1157,7 @@ static void virtio_balloon_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    virtio_balloon_report_drain(s);
     if (s->free_page_bh) {
         qemu_bh_delete(s->free_page_bh);
         object_unref(OBJECT(s->iothread));
@@ -955,6 +1183,8 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
 
+    /* Don't answer elements on the queues after they are reset. */
+    virtio_balloon_report_drain(s);
     if (virtio_balloon_free_page_support(s)) {
         virtio_balloon_free_page_stop(s);
     }
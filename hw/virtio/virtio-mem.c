@@ -16,9 +16,12 @@
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/units.h"
+#include "qemu/main-loop.h"
 #include "sysemu/numa.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/reset.h"
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
@@ -130,6 +133,33 @@ static uint64_t virtio_mem_default_block_size(RAMBlock *rb)
 #error VIRTIO_MEM_USABLE_EXTENT not defined
 #endif
 
+/*
+ * Discarding hundreds of GiB can take seconds.  Bigger unplug batches are
+ * discarded in the thread pool, and the queue is not processed until they
+ * are done.
+ */
+#define VIRTIO_MEM_ASYNC_DISCARD_SIZE (256 * MiB)
+
+typedef struct VirtIOMEMRequest {
+    VirtQueueElement elem;
+    struct virtio_mem_req req;
+    QSIMPLEQ_ENTRY(VirtIOMEMRequest) next;
+} VirtIOMEMRequest;
+
+/*
+ * Requests of the same type for contiguous ranges, that the guest queued
+ * one after the other.  Their memory is plugged or unplugged at once.
+ */
+typedef struct VirtIOMEMBatch {
+    VirtIOMEM *vmem;
+    uint16_t type;
+    uint64_t gpa;
+    uint64_t size;
+    unsigned int nb_reqs;
+    int64_t start_ns;
+    QSIMPLEQ_HEAD(, VirtIOMEMRequest) reqs;
+} VirtIOMEMBatch;
+
 static bool virtio_mem_is_busy(void)
 {
     /*
@@ -205,7 +235,7 @@ static int virtio_mem_for_each_plugged_section(const VirtIOMEM *vmem,
     uint64_t offset, size;
     int ret = 0;
 
-    first_bit = s->offset_within_region / vmem->bitmap_size;
+    first_bit = s->offset_within_region / vmem->block_size;
     first_bit = find_next_bit(vmem->bitmap, vmem->bitmap_size, first_bit);
     while (first_bit < vmem->bitmap_size) {
         MemoryRegionSection tmp = *s;
@@ -228,6 +258,38 @@ static int virtio_mem_for_each_plugged_section(const VirtIOMEM *vmem,
     return ret;
 }
 
+static int virtio_mem_for_each_unplugged_section(const VirtIOMEM *vmem,
+                                                 MemoryRegionSection *s,
+                                                 void *arg,
+                                                 virtio_mem_section_cb cb)
+{
+    unsigned long first_bit, last_bit;
+    uint64_t offset, size;
+    int ret = 0;
+
+    first_bit = s->offset_within_region / vmem->block_size;
+    first_bit = find_next_zero_bit(vmem->bitmap, vmem->bitmap_size, first_bit);
+    while (first_bit < vmem->bitmap_size) {
+        MemoryRegionSection tmp = *s;
+
+        offset = first_bit * vmem->block_size;
+        last_bit = find_next_bit(vmem->bitmap, vmem->bitmap_size,
+                                 first_bit + 1) - 1;
+        size = (last_bit - first_bit + 1) * vmem->block_size;
+
+        if (!virito_mem_intersect_memory_section(&tmp, offset, size)) {
+            break;
+        }
+        ret = cb(&tmp, arg);
+        if (ret) {
+            break;
+        }
+        first_bit = find_next_zero_bit(vmem->bitmap, vmem->bitmap_size,
+                                       last_bit + 2);
+    }
+    return ret;
+}
+
 static int virtio_mem_notify_populate_cb(MemoryRegionSection *s, void *arg)
 {
     RamDiscardListener *rdl = arg;
@@ -382,6 +444,33 @@ static bool virtio_mem_valid_range(const VirtIOMEM *vmem, uint64_t gpa,
     return true;
 }
 
+/*
+ * With "prealloc", populate the blocks with the threads of the memory backend
+ * before the guest gets them, instead of having the guest fault them in.  If
+ * the host is short of memory, the guest is told to retry.
+ */
+static int virtio_mem_prealloc_range(VirtIOMEM *vmem, uint64_t offset,
+                                     uint64_t size)
+{
+    HostMemoryBackend *backend = vmem->memdev;
+    Error *local_err = NULL;
+    char *area;
+
+    if (!vmem->prealloc) {
+        return 0;
+    }
+
+    area = (char *)memory_region_get_ram_ptr(&backend->mr) + offset;
+    os_mem_prealloc(memory_region_get_fd(&backend->mr), area, size,
+                    backend->prealloc_threads, NULL, 0, false, &local_err);
+    if (local_err) {
+        warn_report_once("virtio-mem: %s", error_get_pretty(local_err));
+        error_free(local_err);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
 static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
                                       uint64_t size, bool plug)
 {
@@ -397,8 +486,12 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
             return -EBUSY;
         }
         virtio_mem_notify_unplug(vmem, offset, size);
-    } else if (virtio_mem_notify_plug(vmem, offset, size)) {
-        /* Could be a mapping attempt resulted in memory getting populated. */
+    } else if (virtio_mem_prealloc_range(vmem, offset, size) ||
+               virtio_mem_notify_plug(vmem, offset, size)) {
+        /*
+         * Could be the preallocation or a mapping attempt resulted in memory
+         * getting populated.
+         */
         ram_block_discard_range(vmem->memdev->mr.ram_block, offset, size);
         return -EBUSY;
     }
@@ -406,62 +499,6 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
     return 0;
 }
 
-static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
-                                           uint16_t nb_blocks, bool plug)
-{
-    const uint64_t size = nb_blocks * vmem->block_size;
-    int ret;
-
-    if (!virtio_mem_valid_range(vmem, gpa, size)) {
-        return VIRTIO_MEM_RESP_ERROR;
-    }
-
-    if (plug && (vmem->size + size > vmem->requested_size)) {
-        return VIRTIO_MEM_RESP_NACK;
-    }
-
-    /* test if really all blocks are in the opposite state */
-    if (!virtio_mem_test_bitmap(vmem, gpa, size, !plug)) {
-        return VIRTIO_MEM_RESP_ERROR;
-    }
-
-    ret = virtio_mem_set_block_state(vmem, gpa, size, plug);
-    if (ret) {
-        return VIRTIO_MEM_RESP_BUSY;
-    }
-    if (plug) {
-        vmem->size += size;
-    } else {
-        vmem->size -= size;
-    }
-    notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
-    return VIRTIO_MEM_RESP_ACK;
-}
-
-static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
-                                    struct virtio_mem_req *req)
-{
-    const uint64_t gpa = le64_to_cpu(req->u.plug.addr);
-    const uint16_t nb_blocks = le16_to_cpu(req->u.plug.nb_blocks);
-    uint16_t type;
-
-    trace_virtio_mem_plug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, true);
-    virtio_mem_send_response_simple(vmem, elem, type);
-}
-
-static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
-                                      struct virtio_mem_req *req)
-{
-    const uint64_t gpa = le64_to_cpu(req->u.unplug.addr);
-    const uint16_t nb_blocks = le16_to_cpu(req->u.unplug.nb_blocks);
-    uint16_t type;
-
-    trace_virtio_mem_unplug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, false);
-    virtio_mem_send_response_simple(vmem, elem, type);
-}
-
 static void virtio_mem_resize_usable_region(VirtIOMEM *vmem,
                                             uint64_t requested_size,
                                             bool can_shrink)
@@ -484,17 +521,8 @@ static void virtio_mem_resize_usable_region(VirtIOMEM *vmem,
     vmem->usable_region_size = newsize;
 }
 
-static int virtio_mem_unplug_all(VirtIOMEM *vmem)
+static void virtio_mem_unplugged_all(VirtIOMEM *vmem)
 {
-    RAMBlock *rb = vmem->memdev->mr.ram_block;
-
-    if (virtio_mem_is_busy()) {
-        return -EBUSY;
-    }
-
-    if (ram_block_discard_range(rb, 0, qemu_ram_get_used_length(rb))) {
-        return -EBUSY;
-    }
     virtio_mem_notify_unplug_all(vmem);
 
     bitmap_clear(vmem->bitmap, 0, vmem->bitmap_size);
@@ -504,18 +532,21 @@ static int virtio_mem_unplug_all(VirtIOMEM *vmem)
     }
     trace_virtio_mem_unplugged_all();
     virtio_mem_resize_usable_region(vmem, vmem->requested_size, true);
-    return 0;
 }
 
-static void virtio_mem_unplug_all_request(VirtIOMEM *vmem,
-                                          VirtQueueElement *elem)
+static int virtio_mem_unplug_all(VirtIOMEM *vmem)
 {
-    trace_virtio_mem_unplug_all_request();
-    if (virtio_mem_unplug_all(vmem)) {
-        virtio_mem_send_response_simple(vmem, elem, VIRTIO_MEM_RESP_BUSY);
-    } else {
-        virtio_mem_send_response_simple(vmem, elem, VIRTIO_MEM_RESP_ACK);
+    RAMBlock *rb = vmem->memdev->mr.ram_block;
+
+    if (virtio_mem_is_busy()) {
+        return -EBUSY;
+    }
+
+    if (ram_block_discard_range(rb, 0, qemu_ram_get_used_length(rb))) {
+        return -EBUSY;
     }
+    virtio_mem_unplugged_all(vmem);
+    return 0;
 }
 
 static void virtio_mem_state_request(VirtIOMEM *vmem, VirtQueueElement *elem,
@@ -545,61 +576,295 @@ static void virtio_mem_state_request(VirtIOMEM *vmem, VirtQueueElement *elem,
     virtio_mem_send_response(vmem, elem, &resp);
 }
 
-static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq);
+
+static VirtIOMEMBatch *virtio_mem_batch_new(VirtIOMEM *vmem, uint16_t type,
+                                            uint64_t gpa, uint64_t size)
 {
-    const int len = sizeof(struct virtio_mem_req);
-    VirtIOMEM *vmem = VIRTIO_MEM(vdev);
-    VirtQueueElement *elem;
-    struct virtio_mem_req req;
-    uint16_t type;
+    VirtIOMEMBatch *batch = g_new0(VirtIOMEMBatch, 1);
+
+    batch->vmem = vmem;
+    batch->type = type;
+    batch->gpa = gpa;
+    batch->size = size;
+    batch->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    QSIMPLEQ_INIT(&batch->reqs);
+    return batch;
+}
 
-    while (true) {
-        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            return;
+static void virtio_mem_batch_add(VirtIOMEMBatch *batch, VirtIOMEMRequest *r)
+{
+    QSIMPLEQ_INSERT_TAIL(&batch->reqs, r, next);
+    batch->nb_reqs++;
+}
+
+/* Account for the memory of @batch, answer and free its requests */
+static void virtio_mem_batch_finish(VirtIOMEMBatch *batch, int ret)
+{
+    VirtIOMEM *vmem = batch->vmem;
+    VirtIOMEMRequest *r, *next;
+
+    if (!ret && batch->type != VIRTIO_MEM_REQ_UNPLUG_ALL) {
+        if (batch->type == VIRTIO_MEM_REQ_PLUG) {
+            vmem->size += batch->size;
+        } else {
+            vmem->size -= batch->size;
         }
+        notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
+    }
 
-        if (iov_to_buf(elem->out_sg, elem->out_num, 0, &req, len) < len) {
-            virtio_error(vdev, "virtio-mem protocol violation: invalid request"
-                         " size: %d", len);
-            virtqueue_detach_element(vq, elem, 0);
-            g_free(elem);
-            return;
+    QSIMPLEQ_FOREACH_SAFE(r, &batch->reqs, next, next) {
+        virtio_mem_send_response_simple(vmem, &r->elem, ret ?
+                                        VIRTIO_MEM_RESP_BUSY :
+                                        VIRTIO_MEM_RESP_ACK);
+        g_free(r);
+    }
+    trace_virtio_mem_batch_done(batch->type, batch->gpa, batch->size, ret,
+                                (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                 batch->start_ns) / SCALE_US);
+    g_free(batch);
+}
+
+static int virtio_mem_discard_worker(void *opaque)
+{
+    VirtIOMEMBatch *batch = opaque;
+    VirtIOMEM *vmem = batch->vmem;
+
+    return ram_block_discard_range(vmem->memdev->mr.ram_block,
+                                   batch->gpa - vmem->addr, batch->size);
+}
+
+static void virtio_mem_discard_done(void *opaque, int ret)
+{
+    VirtIOMEMBatch *batch = opaque;
+    VirtIOMEM *vmem = batch->vmem;
+
+    /*
+     * If a migration started in the meantime, the blocks stay plugged and
+     * the guest has to retry.  They were discarded already, but the guest
+     * does not rely on the content of memory that it asked to unplug.
+     */
+    if (!ret && virtio_mem_is_busy()) {
+        ret = -EBUSY;
+    }
+    if (ret) {
+        ret = -EBUSY;
+    } else if (batch->type == VIRTIO_MEM_REQ_UNPLUG_ALL) {
+        virtio_mem_unplugged_all(vmem);
+    } else {
+        virtio_mem_notify_unplug(vmem, batch->gpa - vmem->addr, batch->size);
+        virtio_mem_set_bitmap(vmem, batch->gpa, batch->size, false);
+    }
+
+    vmem->discard_batch = NULL;
+    virtio_mem_batch_finish(batch, ret);
+
+    /* Process the requests that the guest queued in the meantime. */
+    virtio_mem_handle_request(VIRTIO_DEVICE(vmem), vmem->vq);
+}
+
+static void virtio_mem_batch_run(VirtIOMEMBatch *batch)
+{
+    VirtIOMEM *vmem = batch->vmem;
+    int ret;
+
+    trace_virtio_mem_batch_start(batch->type, batch->gpa, batch->size,
+                                 batch->nb_reqs);
+    if (virtio_mem_is_busy()) {
+        virtio_mem_batch_finish(batch, -EBUSY);
+        return;
+    }
+
+    if (batch->type != VIRTIO_MEM_REQ_PLUG &&
+        batch->size >= VIRTIO_MEM_ASYNC_DISCARD_SIZE) {
+        ThreadPool *pool = aio_get_thread_pool(qemu_get_aio_context());
+
+        vmem->discard_batch = batch;
+        thread_pool_submit_aio(pool, virtio_mem_discard_worker, batch,
+                               virtio_mem_discard_done, batch);
+        return;
+    }
+
+    if (batch->type == VIRTIO_MEM_REQ_UNPLUG_ALL) {
+        ret = virtio_mem_unplug_all(vmem);
+    } else {
+        ret = virtio_mem_set_block_state(vmem, batch->gpa, batch->size,
+                                         batch->type == VIRTIO_MEM_REQ_PLUG);
+    }
+    virtio_mem_batch_finish(batch, ret);
+}
+
+/* Wait for the discard that runs in the thread pool, if any */
+static void virtio_mem_drain(VirtIOMEM *vmem)
+{
+    AIO_WAIT_WHILE(NULL, vmem->discard_batch);
+}
+
+static uint16_t virtio_mem_check_state_change(VirtIOMEM *vmem, uint64_t gpa,
+                                              uint64_t size, bool plug,
+                                              uint64_t pending)
+{
+    if (!virtio_mem_valid_range(vmem, gpa, size)) {
+        return VIRTIO_MEM_RESP_ERROR;
+    }
+
+    if (plug && (vmem->size + pending + size > vmem->requested_size)) {
+        return VIRTIO_MEM_RESP_NACK;
+    }
+
+    /* test if really all blocks are in the opposite state */
+    if (!virtio_mem_test_bitmap(vmem, gpa, size, !plug)) {
+        return VIRTIO_MEM_RESP_ERROR;
+    }
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static void virtio_mem_request_range(VirtIOMEM *vmem, VirtIOMEMRequest *r,
+                                     uint64_t *gpa, uint64_t *size)
+{
+    if (le16_to_cpu(r->req.type) == VIRTIO_MEM_REQ_PLUG) {
+        *gpa = le64_to_cpu(r->req.u.plug.addr);
+        *size = le16_to_cpu(r->req.u.plug.nb_blocks) * vmem->block_size;
+    } else {
+        *gpa = le64_to_cpu(r->req.u.unplug.addr);
+        *size = le16_to_cpu(r->req.u.unplug.nb_blocks) * vmem->block_size;
+    }
+}
+
+static VirtIOMEMRequest *virtio_mem_pop_request(VirtIOMEM *vmem)
+{
+    const int len = sizeof(struct virtio_mem_req);
+    VirtIODevice *vdev = VIRTIO_DEVICE(vmem);
+    VirtIOMEMRequest *r;
+
+    r = vmem->next_req;
+    if (r) {
+        vmem->next_req = NULL;
+        return r;
+    }
+
+    r = virtqueue_pop(vmem->vq, sizeof(VirtIOMEMRequest));
+    if (!r) {
+        return NULL;
+    }
+
+    if (iov_to_buf(r->elem.out_sg, r->elem.out_num, 0, &r->req, len) < len) {
+        virtio_error(vdev, "virtio-mem protocol violation: invalid request"
+                     " size: %d", len);
+        virtqueue_detach_element(vmem->vq, &r->elem, 0);
+        g_free(r);
+        return NULL;
+    }
+
+    if (iov_size(r->elem.in_sg, r->elem.in_num) <
+        sizeof(struct virtio_mem_resp)) {
+        virtio_error(vdev, "virtio-mem protocol violation: not enough space"
+                     " for response: %zu",
+                     iov_size(r->elem.in_sg, r->elem.in_num));
+        virtqueue_detach_element(vmem->vq, &r->elem, 0);
+        g_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/*
+ * Plug or unplug the blocks of @r, together with the ones of the following
+ * requests in the queue, as long as they are of the same type and their
+ * ranges are contiguous.  A guest that queues many small requests then
+ * costs one discard and one round of notifications.
+ */
+static void virtio_mem_state_change_request(VirtIOMEM *vmem,
+                                            VirtIOMEMRequest *r)
+{
+    const uint16_t type = le16_to_cpu(r->req.type);
+    const bool plug = type == VIRTIO_MEM_REQ_PLUG;
+    VirtIOMEMBatch *batch;
+    uint64_t gpa, size;
+    uint16_t resp;
+
+    virtio_mem_request_range(vmem, r, &gpa, &size);
+    if (plug) {
+        trace_virtio_mem_plug_request(gpa, size / vmem->block_size);
+    } else {
+        trace_virtio_mem_unplug_request(gpa, size / vmem->block_size);
+    }
+    resp = virtio_mem_check_state_change(vmem, gpa, size, plug, 0);
+    if (resp != VIRTIO_MEM_RESP_ACK) {
+        virtio_mem_send_response_simple(vmem, &r->elem, resp);
+        g_free(r);
+        return;
+    }
+
+    batch = virtio_mem_batch_new(vmem, type, gpa, size);
+    virtio_mem_batch_add(batch, r);
+
+    while ((r = virtio_mem_pop_request(vmem))) {
+        if (le16_to_cpu(r->req.type) != type) {
+            break;
+        }
+        virtio_mem_request_range(vmem, r, &gpa, &size);
+        if (gpa != batch->gpa + batch->size ||
+            virtio_mem_check_state_change(vmem, gpa, size, plug,
+                                          batch->size) !=
+            VIRTIO_MEM_RESP_ACK) {
+            /* It gets its own answer once the batch is done. */
+            break;
         }
+        virtio_mem_batch_add(batch, r);
+        batch->size += size;
+    }
+    vmem->next_req = r;
+
+    virtio_mem_batch_run(batch);
+}
+
+static void virtio_mem_unplug_all_request(VirtIOMEM *vmem,
+                                          VirtIOMEMRequest *r)
+{
+    RAMBlock *rb = vmem->memdev->mr.ram_block;
+    VirtIOMEMBatch *batch;
+
+    trace_virtio_mem_unplug_all_request();
+    batch = virtio_mem_batch_new(vmem, VIRTIO_MEM_REQ_UNPLUG_ALL, vmem->addr,
+                                 qemu_ram_get_used_length(rb));
+    virtio_mem_batch_add(batch, r);
+    virtio_mem_batch_run(batch);
+}
+
+static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(vdev);
+    VirtIOMEMRequest *r;
+    uint16_t type;
 
-        if (iov_size(elem->in_sg, elem->in_num) <
-            sizeof(struct virtio_mem_resp)) {
-            virtio_error(vdev, "virtio-mem protocol violation: not enough space"
-                         " for response: %zu",
-                         iov_size(elem->in_sg, elem->in_num));
-            virtqueue_detach_element(vq, elem, 0);
-            g_free(elem);
+    /* The requests queued during a discard wait for its completion. */
+    while (!vmem->discard_batch) {
+        r = virtio_mem_pop_request(vmem);
+        if (!r) {
             return;
         }
 
-        type = le16_to_cpu(req.type);
+        type = le16_to_cpu(r->req.type);
         switch (type) {
         case VIRTIO_MEM_REQ_PLUG:
-            virtio_mem_plug_request(vmem, elem, &req);
-            break;
         case VIRTIO_MEM_REQ_UNPLUG:
-            virtio_mem_unplug_request(vmem, elem, &req);
+            virtio_mem_state_change_request(vmem, r);
             break;
         case VIRTIO_MEM_REQ_UNPLUG_ALL:
-            virtio_mem_unplug_all_request(vmem, elem);
+            virtio_mem_unplug_all_request(vmem, r);
             break;
         case VIRTIO_MEM_REQ_STATE:
-            virtio_mem_state_request(vmem, elem, &req);
+            virtio_mem_state_request(vmem, &r->elem, &r->req);
+            g_free(r);
             break;
         default:
             virtio_error(vdev, "virtio-mem protocol violation: unknown request"
                          " type: %d", type);
-            virtqueue_detach_element(vq, elem, 0);
-            g_free(elem);
+            virtqueue_detach_element(vq, &r->elem, 0);
+            g_free(r);
             return;
         }
-
-        g_free(elem);
     }
 }
 
@@ -634,6 +899,8 @@ static void virtio_mem_system_reset(void *opaque)
 {
     VirtIOMEM *vmem = VIRTIO_MEM(opaque);
 
+    virtio_mem_drain(vmem);
+
     /*
      * During usual resets, we will unplug all memory and shrink the usable
      * region size. This is, however, not possible in all scenarios. Then,
@@ -642,6 +909,12 @@ static void virtio_mem_system_reset(void *opaque)
     virtio_mem_unplug_all(vmem);
 }
 
+static void virtio_mem_device_reset(VirtIODevice *vdev)
+{
+    /* Don't answer requests on the queues after they are reset. */
+    virtio_mem_drain(VIRTIO_MEM(vdev));
+}
+
 static void virtio_mem_device_realize(DeviceState *dev, Error **errp)
 {
     MachineState *ms = MACHINE(qdev_get_machine());
@@ -681,6 +954,15 @@ static void virtio_mem_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (vmem->memdev->prealloc) {
+        error_setg(errp, "'%s' property specifies a memdev with preallocation"
+                   " enabled: %s. Instead, specify '%s=on' for the device",
+                   VIRTIO_MEM_MEMDEV_PROP,
+                   object_get_canonical_path_component(OBJECT(vmem->memdev)),
+                   VIRTIO_MEM_PREALLOC_PROP);
+        return;
+    }
+
     rb = vmem->memdev->mr.ram_block;
     page_size = qemu_ram_pagesize(rb);
 
@@ -759,6 +1041,8 @@ static void virtio_mem_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOMEM *vmem = VIRTIO_MEM(dev);
 
+    virtio_mem_drain(vmem);
+
     /*
      * The unplug handler unmapped the memory region, it cannot be
      * found via an address space anymore. Unset ourselves.
@@ -789,6 +1073,13 @@ static int virtio_mem_restore_unplugged(VirtIOMEM *vmem)
                                                virtio_mem_discard_range_cb);
 }
 
+static int virtio_mem_pre_save(void *opaque)
+{
+    /* The requests of a discard in progress must be answered here. */
+    virtio_mem_drain(VIRTIO_MEM(opaque));
+    return 0;
+}
+
 static int virtio_mem_post_load(void *opaque, int version_id)
 {
     VirtIOMEM *vmem = VIRTIO_MEM(opaque);
@@ -887,6 +1178,7 @@ static const VMStateDescription vmstate_virtio_mem_device = {
     .minimum_version_id = 1,
     .version_id = 1,
     .priority = MIG_PRI_VIRTIO_MEM,
+    .pre_save = virtio_mem_pre_save,
     .post_load = virtio_mem_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_WITH_TMP(VirtIOMEM, VirtIOMEMMigSanityChecks,
@@ -1111,6 +1403,7 @@ static Property virtio_mem_properties[] = {
     DEFINE_PROP_UINT32(VIRTIO_MEM_NODE_PROP, VirtIOMEM, node, 0),
     DEFINE_PROP_LINK(VIRTIO_MEM_MEMDEV_PROP, VirtIOMEM, memdev,
                      TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_BOOL(VIRTIO_MEM_PREALLOC_PROP, VirtIOMEM, prealloc, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1170,6 +1463,31 @@ static int virtio_mem_rdm_replay_populated(const RamDiscardManager *rdm,
                                             virtio_mem_rdm_replay_populated_cb);
 }
 
+static int virtio_mem_rdm_replay_discarded_cb(MemoryRegionSection *s,
+                                              void *arg)
+{
+    struct VirtIOMEMReplayData *data = arg;
+
+    ((ReplayRamDiscard)data->fn)(s, data->opaque);
+    return 0;
+}
+
+static void virtio_mem_rdm_replay_discarded(const RamDiscardManager *rdm,
+                                            MemoryRegionSection *s,
+                                            ReplayRamDiscard replay_fn,
+                                            void *opaque)
+{
+    const VirtIOMEM *vmem = VIRTIO_MEM(rdm);
+    struct VirtIOMEMReplayData data = {
+        .fn = replay_fn,
+        .opaque = opaque,
+    };
+
+    g_assert(s->mr == &vmem->memdev->mr);
+    virtio_mem_for_each_unplugged_section(vmem, s, &data,
+                                          virtio_mem_rdm_replay_discarded_cb);
+}
+
 static void virtio_mem_rdm_register_listener(RamDiscardManager *rdm,
                                              RamDiscardListener *rdl,
                                              MemoryRegionSection *s)
@@ -1222,6 +1540,7 @@ static void virtio_mem_class_init(ObjectClass *klass, void *data)
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
     vdc->realize = virtio_mem_device_realize;
     vdc->unrealize = virtio_mem_device_unrealize;
+    vdc->reset = virtio_mem_device_reset;
     vdc->get_config = virtio_mem_get_config;
     vdc->get_features = virtio_mem_get_features;
     vdc->vmsd = &vmstate_virtio_mem_device;
@@ -1234,6 +1553,7 @@ static void virtio_mem_class_init(ObjectClass *klass, void *data)
     rdmc->get_min_granularity = virtio_mem_rdm_get_min_granularity;
     rdmc->is_populated = virtio_mem_rdm_is_populated;
     rdmc->replay_populated = virtio_mem_rdm_replay_populated;
+    rdmc->replay_discarded = virtio_mem_rdm_replay_discarded;
     rdmc->register_listener = virtio_mem_rdm_register_listener;
     rdmc->unregister_listener = virtio_mem_rdm_unregister_listener;
 }
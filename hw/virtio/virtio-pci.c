@@ -27,7 +27,9 @@
 #include "hw/qdev-properties.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
@@ -1149,14 +1151,17 @@ static int virtio_pci_add_mem_cap(VirtIOPCIProxy *proxy,
     return offset;
 }
 
+/* Called without the BQL, see memory_region_clear_global_locking() */
 static uint64_t virtio_pci_common_read(void *opaque, hwaddr addr,
                                        unsigned size)
 {
     VirtIOPCIProxy *proxy = opaque;
-    VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
+    VirtIODevice *vdev;
     uint32_t val = 0;
     int i;
 
+    QEMU_LOCK_GUARD(&proxy->lock);
+    vdev = proxy->lockless_vdev;
     if (vdev == NULL) {
         return UINT64_MAX;
     }
@@ -1238,8 +1243,8 @@ static uint64_t virtio_pci_common_read(void *opaque, hwaddr addr,
     return val;
 }
 
-static void virtio_pci_common_write(void *opaque, hwaddr addr,
-                                    uint64_t val, unsigned size)
+static void virtio_pci_common_write_locked(void *opaque, hwaddr addr,
+                                           uint64_t val, unsigned size)
 {
     VirtIOPCIProxy *proxy = opaque;
     VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
@@ -1357,6 +1362,21 @@ static uint64_t virtio_pci_notify_read(void *opaque, hwaddr addr,
     return 0;
 }
 
+/* Writes change the device state, which needs the BQL */
+static void virtio_pci_common_write(void *opaque, hwaddr addr,
+                                    uint64_t val, unsigned size)
+{
+    bool locked = qemu_mutex_iothread_locked();
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    virtio_pci_common_write_locked(opaque, addr, val, size);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static void virtio_pci_notify_write(void *opaque, hwaddr addr,
                                     uint64_t val, unsigned size)
 {
@@ -1383,19 +1403,40 @@ static void virtio_pci_notify_write_pio(void *opaque, hwaddr addr,
     }
 }
 
+/* Called without the BQL, see memory_region_clear_global_locking() */
 static uint64_t virtio_pci_isr_read(void *opaque, hwaddr addr,
                                     unsigned size)
 {
     VirtIOPCIProxy *proxy = opaque;
-    VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
+    VirtIODevice *vdev;
     uint64_t val;
+    bool locked;
 
-    if (vdev == NULL) {
-        return UINT64_MAX;
+    WITH_QEMU_LOCK_GUARD(&proxy->lock) {
+        vdev = proxy->lockless_vdev;
+        if (vdev == NULL) {
+            return UINT64_MAX;
+        }
+        val = qatomic_xchg(&vdev->isr, 0);
     }
 
-    val = qatomic_xchg(&vdev->isr, 0);
+    /*
+     * virtio_pci_notify() sets the interrupt line from the ISR, so the
+     * line is already low if nothing was pending.  Reads that find it
+     * empty, like those of other devices sharing the line, are common.
+     */
+    if (!val) {
+        return 0;
+    }
+
+    locked = qemu_mutex_iothread_locked();
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
     pci_irq_deassert(&proxy->pci_dev);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 
@@ -1519,6 +1560,13 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy,
                           name->str,
                           proxy->isr.size);
 
+    /*
+     * Reads of the common configuration and of the ISR are handled
+     * outside the BQL, writes to the common configuration take it.
+     */
+    memory_region_clear_global_locking(&proxy->common.mr);
+    memory_region_clear_global_locking(&proxy->isr.mr);
+
     g_string_printf(name, "virtio-pci-device-%s", vdev_name);
     memory_region_init_io(&proxy->device.mr, OBJECT(proxy),
                           &device_ops,
@@ -1752,6 +1800,10 @@ static void virtio_pci_device_plugged(DeviceState *d, Error **errp)
         pci_register_bar(&proxy->pci_dev, proxy->legacy_io_bar_idx,
                          PCI_BASE_ADDRESS_SPACE_IO, &proxy->bar);
     }
+
+    WITH_QEMU_LOCK_GUARD(&proxy->lock) {
+        proxy->lockless_vdev = vdev;
+    }
 }
 
 static void virtio_pci_device_unplugged(DeviceState *d)
@@ -1760,6 +1812,11 @@ static void virtio_pci_device_unplugged(DeviceState *d)
     bool modern = virtio_pci_modern(proxy);
     bool modern_pio = proxy->flags & VIRTIO_PCI_FLAG_MODERN_PIO_NOTIFY;
 
+    /* The virtqueues are freed when the device is unrealized */
+    WITH_QEMU_LOCK_GUARD(&proxy->lock) {
+        proxy->lockless_vdev = NULL;
+    }
+
     virtio_pci_stop_ioeventfd(proxy);
 
     if (modern) {
@@ -1780,6 +1837,8 @@ static void virtio_pci_realize(PCIDevice *pci_dev, Error **errp)
     bool pcie_port = pci_bus_is_express(pci_get_bus(pci_dev)) &&
                      !pci_bus_is_root(pci_get_bus(pci_dev));
 
+    qemu_mutex_init(&proxy->lock);
+
     if (kvm_enabled() && !kvm_has_many_ioeventfds()) {
         proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IOEVENTFD;
     }
@@ -1919,6 +1978,7 @@ static void virtio_pci_exit(PCIDevice *pci_dev)
         pci_is_express(pci_dev)) {
         pcie_aer_exit(pci_dev);
     }
+    qemu_mutex_destroy(&proxy->lock);
 }
 
 static void virtio_pci_reset(DeviceState *qdev)
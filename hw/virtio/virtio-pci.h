@@ -156,6 +156,14 @@ struct VirtIOPCIProxy {
     VirtIOIRQFD *vector_irqfd;
     int nvqs_with_notifiers;
     VirtioBusState bus;
+
+    /*
+     * The common configuration and ISR regions are accessed without the
+     * BQL.  They find the device through lockless_vdev, which is only set
+     * while it is plugged, and hold @lock while they use it.
+     */
+    QemuMutex lock;
+    VirtIODevice *lockless_vdev;
 };
 
 static inline bool virtio_pci_modern(VirtIOPCIProxy *proxy)
@@ -27,6 +27,7 @@
 #include "hw/virtio/virtio-access.h"
 #include "sysemu/dma.h"
 #include "sysemu/runstate.h"
+#include "sysemu/xen.h"
 #include "standard-headers/linux/virtio_ids.h"
 
 /*
@@ -76,6 +77,15 @@ typedef struct VRingMemoryRegionCaches {
     MemoryRegionCache desc;
     MemoryRegionCache avail;
     MemoryRegionCache used;
+    /*
+     * The range of guest RAM that the last buffer was in, mapped without
+     * going through the address space when there is no IOMMU.  It is
+     * only used by the thread that pops the elements.
+     */
+    MemoryRegion *ram_mr;
+    hwaddr ram_start;
+    hwaddr ram_size;
+    uint8_t *ram_host;
 } VRingMemoryRegionCaches;
 
 typedef struct VRing
@@ -142,6 +152,9 @@ static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
     address_space_cache_destroy(&caches->desc);
     address_space_cache_destroy(&caches->avail);
     address_space_cache_destroy(&caches->used);
+    if (caches->ram_mr) {
+        memory_region_unref(caches->ram_mr);
+    }
     g_free(caches);
 }
 
@@ -530,12 +543,9 @@ static void vring_packed_desc_read(VirtIODevice *vdev,
         smp_rmb();
     }
 
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
-                              &desc->addr, sizeof(desc->addr));
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
-                              &desc->id, sizeof(desc->id));
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
-                              &desc->len, sizeof(desc->len));
+    /* addr, len and id at once */
+    address_space_read_cached(cache, off, desc,
+                              offsetof(VRingPackedDesc, flags));
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap16s(vdev, &desc->id);
     virtio_tswap32s(vdev, &desc->len);
@@ -546,17 +556,16 @@ static void vring_packed_desc_write_data(VirtIODevice *vdev,
                                          MemoryRegionCache *cache,
                                          int i)
 {
-    hwaddr off_id = i * sizeof(VRingPackedDesc) +
-                    offsetof(VRingPackedDesc, id);
     hwaddr off_len = i * sizeof(VRingPackedDesc) +
                     offsetof(VRingPackedDesc, len);
+    /* len and id at once */
+    hwaddr size = offsetof(VRingPackedDesc, flags) -
+                  offsetof(VRingPackedDesc, len);
 
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->id);
-    address_space_write_cached(cache, off_id, &desc->id, sizeof(desc->id));
-    address_space_cache_invalidate(cache, off_id, sizeof(desc->id));
-    address_space_write_cached(cache, off_len, &desc->len, sizeof(desc->len));
-    address_space_cache_invalidate(cache, off_len, sizeof(desc->len));
+    address_space_write_cached(cache, off_len, &desc->len, size);
+    address_space_cache_invalidate(cache, off_len, size);
 }
 
 static void vring_packed_desc_write_flags(VirtIODevice *vdev,
@@ -1294,7 +1303,72 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
+typedef struct VirtQueueRAMLookup {
+    hwaddr pa;
+    VRingMemoryRegionCaches *caches;
+} VirtQueueRAMLookup;
+
+static bool virtqueue_find_ram(Int128 start, Int128 len,
+                               const MemoryRegion *mr,
+                               hwaddr offset_in_region, void *opaque)
+{
+    VirtQueueRAMLookup *lookup = opaque;
+    VRingMemoryRegionCaches *caches = lookup->caches;
+    MemoryRegion *ram_mr = (MemoryRegion *)mr;
+
+    if (int128_lt(int128_make64(lookup->pa), start) ||
+        int128_ge(int128_make64(lookup->pa), int128_add(start, len))) {
+        return false;
+    }
+
+    if (mr->ram_block && memory_access_is_direct(ram_mr, true)) {
+        memory_region_ref(ram_mr);
+        if (caches->ram_mr) {
+            memory_region_unref(caches->ram_mr);
+        }
+        caches->ram_mr = ram_mr;
+        caches->ram_start = int128_get64(start);
+        caches->ram_size = int128_get64(len);
+        caches->ram_host = (uint8_t *)memory_region_get_ram_ptr(ram_mr) +
+                           offset_in_region;
+    }
+    return true;
+}
+
+/*
+ * Map up to *@plen bytes at @pa if they are in guest RAM, like
+ * dma_memory_map() would but without translating the address each time.
+ * Called within rcu_read_lock().
+ */
+static void *virtqueue_map_ram(VirtIODevice *vdev,
+                               VRingMemoryRegionCaches *caches,
+                               hwaddr pa, hwaddr *plen)
+{
+    hwaddr offset = pa - caches->ram_start;
+
+    if (!caches->ram_mr || offset >= caches->ram_size) {
+        VirtQueueRAMLookup lookup = { .pa = pa, .caches = caches };
+
+        if (vdev->dma_as != &address_space_memory || xen_enabled()) {
+            return NULL;
+        }
+        flatview_for_each_range(address_space_to_flatview(vdev->dma_as),
+                                virtqueue_find_ram, &lookup);
+        offset = pa - caches->ram_start;
+        if (!caches->ram_mr || offset >= caches->ram_size) {
+            return NULL;
+        }
+    }
+
+    *plen = MIN(*plen, caches->ram_size - offset);
+    /* Dropped by address_space_unmap(), as for address_space_map() */
+    memory_region_ref(caches->ram_mr);
+    return caches->ram_host + offset;
+}
+
+static bool virtqueue_map_desc(VirtIODevice *vdev,
+                               VRingMemoryRegionCaches *caches,
+                               unsigned int *p_num_sg,
                                hwaddr *addr, struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
                                hwaddr pa, size_t sz)
@@ -1317,10 +1391,14 @@ static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
             goto out;
         }
 
-        iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
-                                              is_write ?
-                                              DMA_DIRECTION_FROM_DEVICE :
-                                              DMA_DIRECTION_TO_DEVICE);
+        iov[num_sg].iov_base = virtqueue_map_ram(vdev, caches, pa, &len);
+        if (!iov[num_sg].iov_base) {
+            len = sz;
+            iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
+                                                  is_write ?
+                                                  DMA_DIRECTION_FROM_DEVICE :
+                                                  DMA_DIRECTION_TO_DEVICE);
+        }
         if (!iov[num_sg].iov_base) {
             virtio_error(vdev, "virtio: bogus descriptor or out of resources");
             goto out;
@@ -1491,8 +1569,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
-                                        iov + out_num,
+            map_ok = virtqueue_map_desc(vdev, caches, &in_num,
+                                        addr + out_num, iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
         } else {
@@ -1500,8 +1578,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
-                                        VIRTQUEUE_MAX_SIZE, false,
+            map_ok = virtqueue_map_desc(vdev, caches, &out_num, addr,
+                                        iov, VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
         if (!map_ok) {
@@ -1547,7 +1625,13 @@ err_undo_map:
     goto done;
 }
 
-static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+/*
+ * Called within rcu_read_lock().  @strict_order is false when the head
+ * descriptor is known to be available and its flags were read before a
+ * read barrier.
+ */
+static void *virtqueue_packed_pop_rcu(VirtQueue *vq, size_t sz,
+                                      bool strict_order)
 {
     unsigned int i, max;
     VRingMemoryRegionCaches *caches;
@@ -1563,11 +1647,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     uint16_t id;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_packed_empty_rcu(vq)) {
-        goto done;
-    }
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1592,7 +1671,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     }
 
     desc_cache = &caches->desc;
-    vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    vring_packed_desc_read(vdev, &desc, desc_cache, i, strict_order);
     id = desc.id;
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingPackedDesc)) {
@@ -1619,8 +1698,8 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
-                                        iov + out_num,
+            map_ok = virtqueue_map_desc(vdev, caches, &in_num,
+                                        addr + out_num, iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
         } else {
@@ -1628,8 +1707,8 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
-                                        VIRTQUEUE_MAX_SIZE, false,
+            map_ok = virtqueue_map_desc(vdev, caches, &out_num, addr,
+                                        iov, VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
         if (!map_ok) {
@@ -1682,6 +1761,104 @@ err_undo_map:
     goto done;
 }
 
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return NULL;
+    }
+    return virtqueue_packed_pop_rcu(vq, sz, true);
+}
+
+/* Descriptors whose flags virtqueue_packed_avail_descs() reads at once */
+#define VIRTQUEUE_PACKED_SCAN 32
+
+/*
+ * Count the available descriptors from last_avail_idx, up to @max and
+ * up to the end of the ring, with a single read of the ring and a single
+ * read barrier.  Called within rcu_read_lock().
+ */
+static unsigned int virtqueue_packed_avail_descs(VirtQueue *vq,
+                                                 unsigned int max)
+{
+    VRingPackedDesc descs[VIRTQUEUE_PACKED_SCAN];
+    VRingMemoryRegionCaches *caches;
+    unsigned int i, n;
+
+    if (unlikely(!vq->vring.desc)) {
+        return 0;
+    }
+
+    caches = vring_get_region_caches(vq);
+    if (!caches || caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        return 0;
+    }
+
+    n = MIN(MIN(max, VIRTQUEUE_PACKED_SCAN),
+            vq->vring.num - vq->last_avail_idx);
+    address_space_read_cached(&caches->desc,
+                              vq->last_avail_idx * sizeof(VRingPackedDesc),
+                              descs, n * sizeof(VRingPackedDesc));
+    for (i = 0; i < n; i++) {
+        uint16_t flags = descs[i].flags;
+
+        virtio_tswap16s(vq->vdev, &flags);
+        if (!is_desc_avail(flags, vq->last_avail_wrap_counter)) {
+            break;
+        }
+    }
+
+    /* Make sure flags are read before the rest fields. */
+    smp_rmb();
+    return i;
+}
+
+static unsigned int virtqueue_packed_pop_batch(VirtQueue *vq, size_t sz,
+                                               void **elems, unsigned int max)
+{
+    VirtQueueElement *elem;
+    unsigned int n = 0, avail = 0;
+
+    RCU_READ_LOCK_GUARD();
+    while (n < max) {
+        if (!avail) {
+            avail = virtqueue_packed_avail_descs(vq, VIRTQUEUE_PACKED_SCAN);
+            if (!avail) {
+                break;
+            }
+        }
+
+        elem = virtqueue_packed_pop_rcu(vq, sz, false);
+        if (!elem) {
+            break;
+        }
+        elems[n++] = elem;
+        /* The rest of a chain was written before its head */
+        avail -= MIN(avail, elem->ndescs);
+    }
+    return n;
+}
+
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n = 0;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop_batch(vq, sz, elems, max);
+    }
+
+    /* The avail index is only read again once the known heads are used */
+    while (n < max && (elems[n] = virtqueue_split_pop(vq, sz))) {
+        n++;
+    }
+    return n;
+}
+
 void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     if (virtio_device_disabled(vq->vdev)) {
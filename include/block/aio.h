@@ -22,6 +22,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#include "qemu/stats64.h"
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -121,6 +122,19 @@ struct BHListSlice {
 
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Completion of a request submitted with aio_add_sqe().  @cb is called by
+ * aio_poll() with @cqe filled in.
+ */
+typedef struct CqeHandler CqeHandler;
+struct CqeHandler {
+    void (*cb)(CqeHandler *cqe_handler);
+    struct io_uring_cqe cqe;
+    QSIMPLEQ_ENTRY(CqeHandler) next;
+};
+#endif
+
 struct AioContext {
     GSource source;
 
@@ -211,9 +225,16 @@ struct AioContext {
      */
     struct LuringState *linux_io_uring;
 
+    /* Whether linux_io_uring polls its submission queue in the kernel */
+    bool io_uring_sqpoll;
+
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+
+    /* Requests of aio_add_sqe() that have not completed yet */
+    unsigned fdmon_io_uring_in_flight;
+    QSIMPLEQ_HEAD(, CqeHandler) cqe_handler_ready_list;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -232,6 +253,14 @@ struct AioContext {
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
 
+    /* Polling that found an event in time, or went on to wait */
+    Stat64 poll_hits;
+    Stat64 poll_misses;
+
+    /* Coroutines created in this thread from the pool, or with a new stack */
+    Stat64 coroutine_pool_hits;
+    Stat64 coroutine_pool_misses;
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -517,6 +546,33 @@ struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_can_add_sqe:
+ * @ctx: the aio context
+ *
+ * Returns whether the caller may submit requests to the io_uring that
+ * monitors the file descriptors of @ctx.  That is only the case in the
+ * thread of an IOThread whose file descriptors are monitored by io_uring.
+ */
+bool aio_can_add_sqe(AioContext *ctx);
+
+/**
+ * aio_add_sqe:
+ * @ctx: the aio context
+ * @sqe: the request, its user_data is overwritten
+ * @cqe_handler: called by aio_poll() when the request completes
+ *
+ * Queue @sqe on the io_uring that monitors the file descriptors of @ctx.
+ * It is submitted by the next aio_poll(), together with the changes to
+ * the monitored file descriptors, and its completion is reaped by the
+ * same system call as the file descriptor events.  Only call it when
+ * aio_can_add_sqe() returned true.
+ */
+void aio_add_sqe(AioContext *ctx, const struct io_uring_sqe *sqe,
+                 CqeHandler *cqe_handler);
+#endif
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -755,4 +811,15 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_io_uring_sqpoll:
+ * @ctx: the aio context
+ * @sqpoll: whether a kernel thread polls the submission queue
+ *
+ * Only takes effect for the io_uring that is set up after it, and can't
+ * be changed once the io_uring of @ctx is in use.
+ */
+void aio_context_set_io_uring_sqpoll(AioContext *ctx, bool sqpoll,
+                                     Error **errp);
+
 #endif
@@ -1008,6 +1008,16 @@ struct BlockDriverState {
     /* Only read/written by whoever has set active_flush_req to true.  */
     unsigned int flushed_gen;             /* Flushed write generation */
 
+    /*
+     * Block-status cache: the last data region that the driver of this
+     * protocol node reported, from bsc_data_start to bsc_data_end, so
+     * that scans over large images do not query the driver again for
+     * each request.  Empty if bsc_data_end is 0.  Requests that modify
+     * the node invalidate it.
+     */
+    int64_t bsc_data_start;
+    int64_t bsc_data_end;
+
     /* BdrvChild links to this node may never be frozen */
     bool never_freeze;
 };
@@ -1144,6 +1154,8 @@ int is_windows_drive(const char *filename);
  * @creation_flags: Flags that control the behavior of the Job lifetime.
  *                  See @BlockJobCreateFlags
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_workers: The maximum number of chunks that are copied in parallel,
+ *               or 0 for the default.
  * @on_error: The action to take upon error.
  * @filter_node_name: The node name that should be assigned to the filter
  *                    driver that the stream job inserts into the graph above
@@ -1160,7 +1172,7 @@ int is_windows_drive(const char *filename);
 void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
                   BlockDriverState *bottom,
-                  int creation_flags, int64_t speed,
+                  int creation_flags, int64_t speed, int max_workers,
                   BlockdevOnError on_error,
                   const char *filter_node_name,
                   Error **errp);
@@ -80,6 +80,10 @@ void bdrv_dirty_bitmap_set_busy(BdrvDirtyBitmap *bitmap, bool busy);
 void bdrv_merge_dirty_bitmap(BdrvDirtyBitmap *dest, const BdrvDirtyBitmap *src,
                              HBitmap **backup, Error **errp);
 void bdrv_dirty_bitmap_skip_store(BdrvDirtyBitmap *bitmap, bool skip);
+void bdrv_dirty_bitmap_track_changes(BdrvDirtyBitmap *bitmap,
+                                     uint64_t chunk_bytes);
+bool bdrv_dirty_bitmap_changed(BdrvDirtyBitmap *bitmap,
+                               int64_t offset, int64_t bytes);
 bool bdrv_dirty_bitmap_get(BdrvDirtyBitmap *bitmap, int64_t offset);
 
 /* Functions that require manual locking.  */
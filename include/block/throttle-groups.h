@@ -49,6 +49,15 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* Requests of at most credit_bytes bytes that have already been
+     * accounted in the group and that can be issued until
+     * credit_expire_ns without taking the ThrottleGroup lock.  Only
+     * accessed from aio_context.
+     */
+    unsigned       credit_reqs[2];
+    uint64_t       credit_bytes[2];
+    int64_t        credit_expire_ns[2];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -207,6 +207,24 @@ void qcrypto_tls_session_set_callbacks(QCryptoTLSSession *sess,
                                        QCryptoTLSSessionReadFunc readFunc,
                                        void *opaque);
 
+/**
+ * qcrypto_tls_session_set_socket:
+ * @sess: the TLS session object
+ * @fd: the connected socket to use
+ *
+ * Use the socket @fd directly for sending and receiving data,
+ * instead of the callbacks of qcrypto_tls_session_set_callbacks().
+ * This lets the TLS library move the encryption of the session
+ * to the kernel once the handshake is complete, if both the
+ * kernel and the library (GnuTLS 3.7.3 or later, with "ktls"
+ * enabled in its system configuration) support it.
+ *
+ * The socket can be non-blocking, the session then fails with
+ * EAGAIN like the callbacks do.
+ */
+void qcrypto_tls_session_set_socket(QCryptoTLSSession *sess,
+                                    int fd);
+
 /**
  * qcrypto_tls_session_write:
  * @sess: the TLS session object
@@ -321,4 +339,19 @@ int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
  */
 char *qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess);
 
+/**
+ * qcrypto_tls_session_has_ktls:
+ * @sess: the TLS session object
+ * @send: whether to check the sending or the receiving side
+ *
+ * Check whether the kernel encrypts the data sent on the socket
+ * of qcrypto_tls_session_set_socket(), or decrypts the data
+ * received on it.  When it does for sending, plain data can be
+ * written to the socket without going through the session.
+ *
+ * Returns: true if that side of the session is done by the kernel
+ */
+bool qcrypto_tls_session_has_ktls(QCryptoTLSSession *sess,
+                                  bool send);
+
 #endif /* QCRYPTO_TLSSESSION_H */
@@ -27,6 +27,7 @@
 #include "qemu/thread.h"
 #ifndef CONFIG_USER_ONLY
 #include "exec/hwaddr.h"
+#include "exec/cpu-common.h"
 #endif
 #include "exec/memattrs.h"
 #include "hw/core/cpu.h"
@@ -76,9 +77,6 @@ typedef uint64_t target_ulong;
 
 #if !defined(CONFIG_USER_ONLY) && defined(CONFIG_TCG)
 
-/* use a fully associative victim tlb of 8 entries */
-#define CPU_VTLB_SIZE 8
-
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
 #else
@@ -170,9 +168,9 @@ typedef struct CPUTLBDesc {
     size_t n_used_entries;
     /* The next index to use in the tlb victim table.  */
     size_t vindex;
-    /* The tlb victim table, in two parts.  */
-    CPUTLBEntry vtable[CPU_VTLB_SIZE];
-    CPUIOTLBEntry viotlb[CPU_VTLB_SIZE];
+    /* The tlb victim table, in two parts, of tcg_victim_tlb_size entries */
+    CPUTLBEntry *vtable;
+    CPUIOTLBEntry *viotlb;
     /* The iotlb.  */
     CPUIOTLBEntry *iotlb;
 } CPUTLBDesc;
@@ -208,6 +206,17 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    size_t victim_hit_count;
+    size_t victim_miss_count;
+    /*
+     * With dirty-ring-size, the pages dirtied for the migration client
+     * since tlb_dirty_ring_reap() last set them in its bitmap.  Only
+     * the vCPU moves dirty_ring_head, only the reaper moves
+     * dirty_ring_tail.
+     */
+    ram_addr_t *dirty_ring;
+    uint32_t dirty_ring_head;
+    uint32_t dirty_ring_tail;
 } CPUTLBCommon;
 
 /*
@@ -38,9 +38,21 @@ struct RAMBlock {
     QLIST_ENTRY(RAMBlock) next;
     QLIST_HEAD(, RAMBlockNotifier) ramblock_notifiers;
     int fd;
+    /* offset of the memory in the file behind fd */
+    off_t fd_offset;
     size_t page_size;
     /* dirty bitmap used during migration */
     unsigned long *bmap;
+    /*
+     * Summary of bmap while saving: a clear bit means that the word of
+     * the same index in bmap is zero, a set bit that it may not be.
+     * Lets the migration thread skip the clean parts of bmap 64 times
+     * faster.  Bits are set along with bmap, and cleared lazily by
+     * the migration thread when it finds the word zero.
+     */
+    unsigned long *bmap_summary;
+    /* With page-dedup, pages that were sent by hash once while saving */
+    unsigned long *dedup_bmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
 
@@ -69,6 +81,36 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * Second mapping of the file of a shared hugetlbfs RAMBlock, that is
+     * not registered with userfaultfd.  During postcopy, the incoming
+     * pages are written there and then mapped into the guest with
+     * UFFDIO_CONTINUE.  NULL when the pages are placed with UFFDIO_COPY.
+     */
+    uint8_t *postcopy_alias;
+
+    /*
+     * With fixed-ram, the pages of the block are stored at
+     * pages_offset of the migration file, and the bitmap of the pages
+     * that are there (the zero ones are not) at bitmap_offset.
+     * file_bmap is that bitmap while saving.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
+
+    /*
+     * With ram-cold-first, one byte per chunk of pages that records
+     * whether the chunk was dirty after each of the last bitmap syncs.
+     */
+    uint8_t *dirty_heat;
+    /*
+     * With dirty-heatmap-granularity, the dirty pages found by the
+     * bitmap syncs in each bucket, and the syncs that found any
+     */
+    uint64_t *heatmap_pages;
+    uint64_t *heatmap_syncs;
 };
 #endif
 #endif
@@ -44,11 +44,19 @@ typedef struct {
     unsigned long *blocks[];
 } DirtyMemoryBlocks;
 
+typedef struct RAMBlockIndex RAMBlockIndex;
+
 typedef struct RAMList {
     QemuMutex mutex;
     RAMBlock *mru_block;
     /* RCU-enabled, writes protected by the ramlist lock. */
     QLIST_HEAD(, RAMBlock) blocks;
+    /*
+     * Lookup tables by name and by ram_addr_t, rebuilt whenever @blocks
+     * or the name of a block changes.  RCU-enabled, writes protected by
+     * the ramlist lock.
+     */
+    RAMBlockIndex *index;
     DirtyMemoryBlocks *dirty_memory[DIRTY_MEMORY_NUM];
     uint32_t version;
     QLIST_HEAD(, RAMBlockNotifier) ramblock_notifiers;
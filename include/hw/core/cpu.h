@@ -221,6 +221,20 @@ struct hvf_vcpu_state;
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/*
+ * Set-associative cache of the sections that address_space_lookup_region()
+ * found for this vCPU.  Entries belong to the AddressSpaceDispatch with
+ * the same generation, so a new FlatView invalidates them.
+ */
+#define CPU_DISPATCH_CACHE_SETS 32
+#define CPU_DISPATCH_CACHE_WAYS 4
+
+typedef struct CPUDispatchCacheEntry {
+    uint64_t generation;
+    hwaddr page;
+    MemoryRegionSection *section;
+} CPUDispatchCacheEntry;
+
 /* work queue */
 
 /* The union type allows passing of 64 bit target pointers on 32 bit
@@ -299,6 +313,20 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @kvm_halt_poll_ns: Time in nanoseconds the vCPU thread spins before
+ *    sleeping when the CPU halts in userspace, adapted to the wakeups.
+ * @kvm_halt_poll_success: Number of halts that ended while spinning.
+ * @kvm_halt_poll_fail: Number of halts that ended after sleeping.
+ * @dirty_pages: Number of pages collected from the KVM dirty ring of this
+ *    CPU since it was created.
+ * @throttle_us_per_full: Time in microseconds the CPU sleeps every time its
+ *    KVM dirty ring is full, to keep it below its dirty page rate limit.
+ * @kvm_reap_time: Time in nanoseconds the KVM dirty ring of this CPU was
+ *    last reaped.
+ * @kvm_reap_deadline: Time in nanoseconds the KVM dirty ring reaper must
+ *    reap the ring of this CPU again, before the CPU fills it.
+ * @kvm_dirty_rate: Rate in pages per second at which this CPU fills its
+ *    KVM dirty ring, smoothed over the last reaps.
  *
  * State of one CPU core or thread.
  */
@@ -351,6 +379,14 @@ struct CPUState {
 
     /* Accessed in parallel; all accesses must be atomic */
     TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    /* tb_ctx.tb_flush_count when tb_jmp_cache was last cleared */
+    unsigned tb_jmp_cache_flush_count;
+
+    /* Only accessed by the vCPU thread, except for the statistics */
+    CPUDispatchCacheEntry
+        dispatch_cache[CPU_DISPATCH_CACHE_SETS][CPU_DISPATCH_CACHE_WAYS];
+    uint64_t dispatch_cache_hits;
+    uint64_t dispatch_cache_misses;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -376,6 +412,14 @@ struct CPUState {
     struct kvm_run *kvm_run;
     struct kvm_dirty_gfn *kvm_dirty_gfns;
     uint32_t kvm_fetch_index;
+    int64_t kvm_halt_poll_ns;
+    uint64_t kvm_halt_poll_success;
+    uint64_t kvm_halt_poll_fail;
+    uint64_t dirty_pages;
+    int64_t throttle_us_per_full;
+    int64_t kvm_reap_time;
+    int64_t kvm_reap_deadline;
+    uint64_t kvm_dirty_rate;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -117,6 +117,23 @@ struct FWCfgMemState {
  */
 void fw_cfg_add_bytes(FWCfgState *s, uint16_t key, void *data, size_t len);
 
+/**
+ * fw_cfg_add_mapped_bytes:
+ * @s: fw_cfg device being modified
+ * @key: selector key value for new fw_cfg item
+ * @mapped_file: host file mapped with g_mapped_file_new()
+ *
+ * Add a new fw_cfg item, available by selecting the given key, with the
+ * contents of a mapped host file, which must be smaller than 4 GiB.  The
+ * item takes a reference to @mapped_file.  Nothing is read until the
+ * guest reads the item, and DMA transfers copy it straight from the
+ * page cache, so large kernels and initrds neither take a copy in QEMU
+ * memory nor delay startup.  The file should not change while the guest
+ * may still read it.
+ */
+void fw_cfg_add_mapped_bytes(FWCfgState *s, uint16_t key,
+                             GMappedFile *mapped_file);
+
 /**
  * fw_cfg_add_string:
  * @s: fw_cfg device being modified
@@ -288,6 +305,22 @@ void fw_cfg_add_file_callback(FWCfgState *s, const char *filename,
 void *fw_cfg_modify_file(FWCfgState *s, const char *filename, void *data,
                          size_t len);
 
+/**
+ * fw_cfg_add_file_from_host:
+ * @s: fw_cfg device being modified
+ * @filename: name of new fw_cfg file item
+ * @host_path: host file with the contents of the item
+ * @errp: pointer to a NULL initialized error object
+ *
+ * Add a new NAMED fw_cfg item like fw_cfg_add_file(), with the contents
+ * of the host file @host_path.  The file is mapped like with
+ * fw_cfg_add_mapped_bytes(), not read.
+ *
+ * Returns: %true on success, %false on error.
+ */
+bool fw_cfg_add_file_from_host(FWCfgState *s, const char *filename,
+                               const char *host_path, Error **errp);
+
 /**
  * fw_cfg_add_from_generator:
  * @s: fw_cfg device being modified
@@ -66,6 +66,17 @@ typedef struct VFIOMigration {
     int vm_running;
     Notifier migration_state;
     uint64_t pending_bytes;
+    /* The data sections go over the multifd channels */
+    bool multifd_transfer;
+    uint32_t save_buf_idx;
+    /*
+     * The buffers that the multifd channels received, by index, until the
+     * device takes them: the device loads them in order.
+     */
+    QemuMutex load_bufs_mutex;
+    GArray *load_bufs;
+    uint32_t load_buf_idx;
+    int load_bufs_ret;
 } VFIOMigration;
 
 typedef struct VFIOAddressSpace {
@@ -87,6 +98,9 @@ typedef struct VFIOContainer {
     bool dirty_pages_supported;
     uint64_t dirty_pgsizes;
     uint64_t max_dirty_bitmap_size;
+    /* Buffer for VFIO_IOMMU_DIRTY_PAGES, kept while dirty tracking is on */
+    void *dirty_bitmap_buf;
+    uint64_t dirty_bitmap_buf_size;
     unsigned long pgsizes;
     unsigned int dma_max_mappings;
     QLIST_HEAD(, VFIOGuestIOMMU) giommu_list;
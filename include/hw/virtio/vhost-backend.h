@@ -29,6 +29,7 @@ typedef enum VhostSetConfigType {
 struct vhost_inflight;
 struct vhost_dev;
 struct vhost_log;
+struct vhost_log_ring;
 struct vhost_memory;
 struct vhost_vring_file;
 struct vhost_vring_state;
@@ -82,6 +83,8 @@ typedef int (*vhost_get_vq_index_op)(struct vhost_dev *dev, int idx);
 typedef int (*vhost_set_vring_enable_op)(struct vhost_dev *dev,
                                          int enable);
 typedef bool (*vhost_requires_shm_log_op)(struct vhost_dev *dev);
+typedef int (*vhost_set_log_ring_op)(struct vhost_dev *dev,
+                                     struct vhost_log_ring *ring);
 typedef int (*vhost_migration_done_op)(struct vhost_dev *dev,
                                        char *mac_addr);
 typedef bool (*vhost_backend_can_merge_op)(struct vhost_dev *dev,
@@ -154,6 +157,7 @@ typedef struct VhostOps {
     vhost_get_vq_index_op vhost_get_vq_index;
     vhost_set_vring_enable_op vhost_set_vring_enable;
     vhost_requires_shm_log_op vhost_requires_shm_log;
+    vhost_set_log_ring_op vhost_set_log_ring;
     vhost_migration_done_op vhost_migration_done;
     vhost_backend_can_merge_op vhost_backend_can_merge;
     vhost_vsock_set_guest_cid_op vhost_vsock_set_guest_cid;
@@ -19,10 +19,22 @@ typedef struct VhostVDPAHostNotifier {
     void *addr;
 } VhostVDPAHostNotifier;
 
+/* An IOTLB entry, which can cover several adjacent sections */
+typedef struct VhostVDPAMap {
+    hwaddr iova;
+    hwaddr size;
+    void *vaddr;
+    bool readonly;
+} VhostVDPAMap;
+
 typedef struct vhost_vdpa {
     int device_fd;
     uint32_t msg_type;
     MemoryListener listener;
+    /* IOTLB entries written to the device, sorted by iova */
+    GArray *maps;
+    /* Entry still being extended by the sections that follow it */
+    VhostVDPAMap pending_map;
     struct vhost_dev *dev;
     VhostVDPAHostNotifier notifier[VIRTIO_QUEUE_MAX];
 } VhostVDPA;
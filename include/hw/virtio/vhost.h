@@ -45,6 +45,33 @@ struct vhost_log {
     vhost_log_chunk_t *log;
 };
 
+/*
+ * Ring of the pages that the backend dirtied, shared with it as
+ * described in docs/interop/vhost-user.rst.  An entry is the guest
+ * physical address of a page with VHOST_LOG_RING_VALID set, and 0 when
+ * it is free.
+ */
+struct vhost_log_ring_hdr {
+    uint64_t head;
+    uint64_t tail;
+    uint32_t size;
+    uint32_t flags;
+    uint64_t padding[5];
+};
+
+#define VHOST_LOG_RING_F_OVERFLOW   (1 << 0)
+#define VHOST_LOG_RING_VALID        1ULL
+#define VHOST_LOG_RING_ENTRIES      (64 * 1024)
+
+struct vhost_log_ring {
+    struct vhost_log_ring_hdr *hdr;
+    uint64_t *entries;
+    size_t mmap_size;
+    int fd;
+    /* The memory section of the last page reaped */
+    int last_section;
+};
+
 struct vhost_dev;
 struct vhost_iommu {
     struct vhost_dev *hdev;
@@ -89,6 +116,7 @@ struct vhost_dev {
     const VhostOps *vhost_ops;
     void *opaque;
     struct vhost_log *log;
+    struct vhost_log_ring *log_ring;
     QLIST_ENTRY(vhost_dev) entry;
     QLIST_HEAD(, vhost_iommu) iommu_list;
     IOMMUNotifier n;
@@ -71,6 +71,8 @@ struct VirtIOBalloon {
 
     bool qemu_4_0_config_size;
     uint32_t poison_val;
+    /* the free page report that is being discarded by the thread pool */
+    struct VirtIOBalloonReport *report;
 };
 
 #endif
@@ -30,6 +30,7 @@ OBJECT_DECLARE_TYPE(VirtIOMEM, VirtIOMEMClass,
 #define VIRTIO_MEM_REQUESTED_SIZE_PROP "requested-size"
 #define VIRTIO_MEM_BLOCK_SIZE_PROP "block-size"
 #define VIRTIO_MEM_ADDR_PROP "memaddr"
+#define VIRTIO_MEM_PREALLOC_PROP "prealloc"
 
 struct VirtIOMEM {
     VirtIODevice parent_obj;
@@ -62,6 +63,15 @@ struct VirtIOMEM {
     /* block size and alignment */
     uint64_t block_size;
 
+    /* preallocate the memory that the guest plugs */
+    bool prealloc;
+
+    /* the batch of requests whose memory is being discarded in a thread */
+    struct VirtIOMEMBatch *discard_batch;
+
+    /* request popped while building a batch, that did not fit in it */
+    struct VirtIOMEMRequest *next_req;
+
     /* notifiers to notify when "size" changes */
     NotifierList size_change_notifiers;
 
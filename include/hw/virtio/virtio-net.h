@@ -142,12 +142,23 @@ typedef struct VirtioNetRssData {
     uint16_t default_queue;
 } VirtioNetRssData;
 
+/* Flows whose queue is learned from the packets that the guest sends */
+#define VIRTIO_NET_FLOW_TABLE_SIZE      4096
+
+typedef struct VirtioNetFlow {
+    uint32_t hash;
+    /* tx queue of the last packet of the flow, plus one; 0 if unused */
+    uint16_t queue;
+} VirtioNetFlow;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     uint32_t tx_waiting;
+    /* Filled rx elements waiting for the batch to end to be flushed */
+    unsigned rx_batched;
     struct {
         VirtQueueElement *elem;
     } async_tx;
@@ -211,6 +222,8 @@ struct VirtIONet {
     DeviceListener primary_listener;
     Notifier migration_state;
     VirtioNetRssData rss_data;
+    bool rss_flow_affinity;
+    VirtioNetFlow *flows;
     struct NetRxPkt *rx_pkt;
     struct EBPFRSSContext ebpf_rss;
 };
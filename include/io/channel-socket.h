@@ -38,6 +38,12 @@ OBJECT_DECLARE_SIMPLE_TYPE(QIOChannelSocket, QIO_CHANNEL_SOCKET)
  * Beyond the core channel API, it also provides functionality
  * for accepting client connections, tuning some socket
  * parameters and getting socket address strings.
+ *
+ * On Linux hosts with SO_ZEROCOPY support, connected sockets
+ * advertise QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY.  The
+ * zero_copy_queued and zero_copy_sent counters track the
+ * sendmsg() calls done with MSG_ZEROCOPY and the ones whose
+ * completion was already read from the socket error queue.
  */
 
 struct QIOChannelSocket {
@@ -47,6 +53,8 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    ssize_t zero_copy_queued;
+    ssize_t zero_copy_sent;
 };
 
 
@@ -117,6 +125,46 @@ void qio_channel_socket_connect_async(QIOChannelSocket *ioc,
                                       GDestroyNotify destroy,
                                       GMainContext *context);
 
+/**
+ * qio_channel_socket_connect_from_sync:
+ * @ioc: the socket channel object
+ * @addr: the address to connect to
+ * @source: the local host address to bind to, or %NULL
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Like qio_channel_socket_connect_sync(), but bind the
+ * socket to the local address @source before connecting,
+ * which selects the network interface the connection goes
+ * through. This is only possible for inet sockets.
+ */
+int qio_channel_socket_connect_from_sync(QIOChannelSocket *ioc,
+                                         SocketAddress *addr,
+                                         const char *source,
+                                         Error **errp);
+
+/**
+ * qio_channel_socket_connect_from_async:
+ * @ioc: the socket channel object
+ * @addr: the address to connect to
+ * @source: the local host address to bind to, or %NULL
+ * @callback: the function to invoke on completion
+ * @opaque: user data to pass to @callback
+ * @destroy: the function to free @opaque
+ * @context: the context to run the async task. If %NULL, the default
+ *           context will be used.
+ *
+ * Like qio_channel_socket_connect_async(), binding the
+ * socket to @source like qio_channel_socket_connect_from_sync().
+ * Both @addr and @source are copied.
+ */
+void qio_channel_socket_connect_from_async(QIOChannelSocket *ioc,
+                                           SocketAddress *addr,
+                                           const char *source,
+                                           QIOTaskFunc callback,
+                                           gpointer opaque,
+                                           GDestroyNotify destroy,
+                                           GMainContext *context);
+
 
 /**
  * qio_channel_socket_listen_sync:
@@ -131,6 +131,21 @@ void qio_channel_tls_handshake(QIOChannelTLS *ioc,
                                GDestroyNotify destroy,
                                GMainContext *context);
 
+/**
+ * qio_channel_tls_enable_ktls:
+ * @ioc: the TLS channel object
+ *
+ * Let the kernel encrypt and decrypt the data of the channel
+ * after the handshake, if it and the TLS library can.  The
+ * session then does its I/O directly on the socket of the
+ * master channel, and data written to the channel goes to the
+ * socket as it is, in one call.
+ *
+ * This must be called before qio_channel_tls_handshake(), and
+ * does nothing unless the master channel is a socket.
+ */
+void qio_channel_tls_enable_ktls(QIOChannelTLS *ioc);
+
 /**
  * qio_channel_tls_get_session:
  * @ioc: the TLS channel object
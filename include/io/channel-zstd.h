@@ -0,0 +1,99 @@
+/*
+ * QEMU I/O channels zstd driver
+ *
+ * Copyright (c) 2021 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef QIO_CHANNEL_ZSTD_H
+#define QIO_CHANNEL_ZSTD_H
+
+#include "io/channel.h"
+#include "qom/object.h"
+
+#define TYPE_QIO_CHANNEL_ZSTD "qio-channel-zstd"
+OBJECT_DECLARE_SIMPLE_TYPE(QIOChannelZstd, QIO_CHANNEL_ZSTD)
+
+typedef enum {
+    QIO_CHANNEL_ZSTD_COMPRESS,
+    QIO_CHANNEL_ZSTD_DETECT,
+    QIO_CHANNEL_ZSTD_DECOMPRESS,
+    QIO_CHANNEL_ZSTD_PASSTHROUGH,
+} QIOChannelZstdMode;
+
+/**
+ * QIOChannelZstd
+ *
+ * The QIOChannelZstd class provides a channel wrapper which
+ * compresses the data written to it as one zstd stream, or
+ * decompresses the data read from it.  It only touches one
+ * direction: data going the other way goes to or from the
+ * master channel untouched.
+ *
+ * Every write is flushed to the master channel, so that the
+ * peer can act on it without waiting for more data.
+ */
+
+struct QIOChannelZstd {
+    QIOChannel parent;
+    QIOChannel *master;
+    QIOChannelZstdMode mode;
+    struct ZSTD_CCtx_s *cctx;
+    struct ZSTD_DCtx_s *dctx;
+    /* Compressed data, waiting to be written or decompressed */
+    uint8_t *buf;
+    size_t buf_size;
+    size_t buf_pos;
+    size_t buf_len;
+    bool ended;
+};
+
+/**
+ * qio_channel_zstd_new_client:
+ * @master: the underlying channel object
+ * @level: the zstd compression level
+ * @workers: the number of zstd worker threads, 0 to compress
+ *           in the thread that writes
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Create a new channel that compresses the data written to
+ * it before writing it to @master.  The zstd frame is ended
+ * when the channel is closed.
+ *
+ * Returns: the new zstd channel object, or NULL
+ */
+QIOChannelZstd *
+qio_channel_zstd_new_client(QIOChannel *master,
+                            int level,
+                            int workers,
+                            Error **errp);
+
+/**
+ * qio_channel_zstd_new_server:
+ * @master: the underlying channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Create a new channel that reads from @master.  If the data
+ * starts with the magic number of a zstd frame, it is
+ * decompressed, otherwise it is passed through as is.
+ *
+ * Returns: the new zstd channel object, or NULL
+ */
+QIOChannelZstd *
+qio_channel_zstd_new_server(QIOChannel *master,
+                            Error **errp);
+
+#endif /* QIO_CHANNEL_ZSTD_H */
@@ -40,6 +40,7 @@ int precopy_notify(PrecopyNotifyReason reason, Error **errp);
 
 void ram_mig_init(void);
 void qemu_guest_free_page_hint(void *addr, size_t len);
+void qemu_guest_free_page_hints(const struct iovec *iov, int iovcnt);
 
 /* migration/block.c */
 
@@ -72,6 +73,14 @@ bool migration_in_incoming_postcopy(void);
 /* True if background snapshot is active */
 bool migration_in_bg_snapshot(void);
 
+/* migration/multifd.c */
+int multifd_queue_device_state(QEMUFile *f, void *opaque, uint32_t idx,
+                               uint8_t *data, size_t len);
+/* True if devices can send their state with multifd_queue_device_state() */
+bool multifd_device_state_supported(void);
+void multifd_device_state_save_sync(QEMUFile *f);
+void multifd_device_state_load_sync(void);
+
 /* migration/block-dirty-bitmap.c */
 void dirty_bitmap_mig_init(void);
 
@@ -68,6 +68,13 @@ typedef struct SaveVMHandlers {
     int (*load_cleanup)(void *opaque);
     /* Called when postcopy migration wants to resume from failure */
     int (*resume_prepare)(MigrationState *s, void *opaque);
+    /*
+     * Load a buffer of device state that the source sent with
+     * multifd_queue_device_state().  This runs in a multifd receive
+     * thread, outside the iothread lock, and takes ownership of @data.
+     */
+    int (*load_state_buffer)(void *opaque, uint32_t idx, uint8_t *data,
+                             size_t len, Error **errp);
 } SaveVMHandlers;
 
 int register_savevm_live(const char *idstr,
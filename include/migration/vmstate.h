@@ -183,6 +183,20 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /*
+     * The state can be saved and loaded by the device-state-threads,
+     * outside the iothread lock and at the same time as the other
+     * parallel devices.  The hooks and fields must only touch the
+     * device itself.
+     */
+    bool parallel;
+    /*
+     * With early-device-state, the state is sent while the guest is still
+     * running, and only sent again at the end if it changed.  post_load
+     * must not depend on guest RAM or on other devices, and the state must
+     * be saved with the iothread lock alone.
+     */
+    bool early;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
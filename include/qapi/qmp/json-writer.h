@@ -14,7 +14,18 @@
 #ifndef JSON_WRITER_H
 #define JSON_WRITER_H
 
+typedef void JSONWriterFlushFunc(void *opaque, const char *buf, size_t len);
+
 JSONWriter *json_writer_new(bool pretty);
+
+/*
+ * Create a writer that passes its output to @flush whenever at least
+ * @chunk_size bytes are pending, instead of accumulating all of it.  @buf
+ * is NUL-terminated.  Call json_writer_flush() for the rest once done.
+ */
+JSONWriter *json_writer_new_stream(bool pretty, size_t chunk_size,
+                                   JSONWriterFlushFunc *flush, void *opaque);
+void json_writer_flush(JSONWriter *);
 const char *json_writer_get(JSONWriter *);
 GString *json_writer_get_and_free(JSONWriter *);
 void json_writer_free(JSONWriter *);
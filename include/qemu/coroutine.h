@@ -65,6 +65,20 @@ typedef void coroutine_fn CoroutineEntry(void *opaque);
  */
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque);
 
+/**
+ * Increase the size of the coroutine pool by @additional_pool_size
+ *
+ * Devices call this with the number of requests they can have in flight,
+ * so that the coroutines of a deep queue come from the pool instead of
+ * allocating and freeing a stack each.
+ */
+void qemu_coroutine_inc_pool_size(unsigned int additional_pool_size);
+
+/**
+ * Decrease the size of the coroutine pool by @removing_pool_size
+ */
+void qemu_coroutine_dec_pool_size(unsigned int removing_pool_size);
+
 /**
  * Transfer control to a coroutine
  */
@@ -0,0 +1,54 @@
+/*
+ * Offload of memory operations to Intel DSA
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_DSA_H
+#define QEMU_DSA_H
+
+#include "qapi/qapi-builtin-types.h"
+
+/*
+ * The Data Streaming Accelerator of Intel Xeon processors compares and
+ * fills memory without using the CPUs.  A batch goes to the device
+ * as a few descriptors, and the thread that submitted it polls for
+ * their completion.  Buffers that the device could not process, for
+ * example because they were not mapped, are then processed by the
+ * CPU, as are all of them when no device is open.
+ */
+
+typedef struct QemuDsaBatchTask QemuDsaBatchTask;
+
+/*
+ * Open the shared DSA work queues of @paths, like /dev/dsa/wq0.0, and
+ * submit the batches to them in turn.  With an empty list, close the
+ * ones that are open.  Returns 0 or -1.
+ */
+int qemu_dsa_init(const strList *paths, Error **errp);
+void qemu_dsa_cleanup(void);
+bool qemu_dsa_is_running(void);
+
+/*
+ * A task has the descriptors of one batch at a time.  Each thread
+ * needs its own.
+ */
+QemuDsaBatchTask *qemu_dsa_batch_task_new(void);
+void qemu_dsa_batch_task_free(QemuDsaBatchTask *task);
+
+/*
+ * Check which of the @count buffers of @iov only contain zeroes.
+ * Returns an array of @count results that belongs to @task, valid
+ * until the next batch.
+ */
+bool *qemu_dsa_buffer_is_zero_batch(QemuDsaBatchTask *task,
+                                    const struct iovec *iov, size_t count);
+
+/* Fill the @count buffers of @iov with zeroes */
+void qemu_dsa_fill_zero_batch(QemuDsaBatchTask *task,
+                              const struct iovec *iov, size_t count);
+
+#endif
@@ -280,6 +280,31 @@ char *hbitmap_sha256(const HBitmap *bitmap, Error **errp);
  */
 void hbitmap_free(HBitmap *hb);
 
+/**
+ * hbitmap_create_meta:
+ * @hb: The HBitmap to operate on.
+ * @chunk_size: How many bits in @hb does one bit in the meta track.
+ *
+ * Create a "meta" hbitmap to track which groups of @chunk_size bits
+ * of @hb were changed by hbitmap_set() and hbitmap_reset().  Other
+ * functions that modify @hb, like hbitmap_reset_all(), hbitmap_merge()
+ * or the deserialization functions, do not update it.  The meta bitmap
+ * covers the same items as @hb, so it can be merged with it to mark the
+ * chunks where @hb has bits set.
+ *
+ * The meta bitmap belongs to @hb and must be freed with hbitmap_free_meta()
+ * before @hb is freed.
+ *
+ * Returns the meta bitmap.
+ */
+HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_size);
+
+/**
+ * hbitmap_free_meta:
+ * @hb: The HBitmap whose meta bitmap should be released.
+ */
+void hbitmap_free_meta(HBitmap *hb);
+
 /**
  * hbitmap_iter_init:
  * @hbi: HBitmapIter to initialize.
@@ -340,6 +365,25 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, int64_t start, int64_t end,
                              int64_t max_dirty_count,
                              int64_t *dirty_start, int64_t *dirty_count);
 
+/* hbitmap_next_dirty_areas:
+ * @hb: The HBitmap to operate on
+ * @start: the offset to start from
+ * @end: end of requested area
+ * @max_dirty_count: limit for the length of each area
+ * @max_areas: number of elements of @dirty_starts and @dirty_counts
+ * @dirty_starts: filled with the start of each area found
+ * @dirty_counts: filled with the length of each area found
+ *
+ * Find up to @max_areas dirty areas within [@start, @end) in one call,
+ * the same as successive calls to hbitmap_next_dirty_area() would, each
+ * starting at the end of the previous area.
+ *
+ * Returns the number of areas found.
+ */
+int hbitmap_next_dirty_areas(const HBitmap *hb, int64_t start, int64_t end,
+                             int64_t max_dirty_count, int max_areas,
+                             int64_t *dirty_starts, int64_t *dirty_counts);
+
 /**
  * hbitmap_iter_next:
  * @hbi: HBitmapIter to operate on.
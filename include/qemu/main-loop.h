@@ -290,6 +290,19 @@ void qemu_cond_wait_iothread(QemuCond *cond);
  */
 void qemu_cond_timedwait_iothread(QemuCond *cond, int ms);
 
+/**
+ * qemu_mutex_iothread_get_stats: Return how long the main loop mutex was held
+ *
+ * Must be called with the main loop mutex held.  The hold times
+ * leave out the time spent waiting on condition variables.
+ *
+ * @acquisitions: the number of times the mutex was taken and released
+ * @hold_ns: the total time the mutex was held, in nanoseconds
+ * @max_hold_ns: the longest time it was held at once, in nanoseconds
+ */
+void qemu_mutex_iothread_get_stats(uint64_t *acquisitions, uint64_t *hold_ns,
+                                   uint64_t *max_hold_ns);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
@@ -87,10 +87,18 @@ struct qemu_plugin_dyn_cb {
         struct {
             enum qemu_plugin_op op;
             uint64_t imm;
+            /* if @entry.score is set, the op ignores @userp */
+            qemu_plugin_u64 entry;
         } inline_insn;
     };
 };
 
+struct qemu_plugin_scoreboard {
+    /* one element per vCPU, see plugin.scoreboard_alloc_size */
+    GArray *data;
+    QLIST_ENTRY(qemu_plugin_scoreboard) entry;
+};
+
 /* Internal context for instrumenting an instruction */
 struct qemu_plugin_insn {
     GByteArray *data;
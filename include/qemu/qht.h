@@ -16,7 +16,7 @@ typedef bool (*qht_cmp_func_t)(const void *a, const void *b);
 struct qht {
     struct qht_map *map;
     qht_cmp_func_t cmp;
-    QemuMutex lock; /* serializes setters of ht->map */
+    QemuMutex lock; /* serializes resizes, resets and iterations */
     unsigned int mode;
 };
 
@@ -48,6 +48,7 @@ typedef bool (*qht_iter_bool_func_t)(void *p, uint32_t h, void *up);
 
 #define QHT_MODE_AUTO_RESIZE 0x1 /* auto-resize when heavily loaded */
 #define QHT_MODE_RAW_MUTEXES 0x2 /* bypass the profiler (QSP) */
+#define QHT_MODE_NUMA_INTERLEAVE 0x4 /* interleave large maps across nodes */
 
 /**
  * qht_init - Initialize a QHT
@@ -0,0 +1,35 @@
+/*
+ * Placement of QEMU's own threads on host CPUs
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_THREAD_CONTEXT_H
+#define QEMU_THREAD_CONTEXT_H
+
+#include "qapi/qapi-types-qom.h"
+#include "qemu/thread.h"
+
+/*
+ * A thread-context object gives the host CPUs that a few groups of
+ * threads run on, so that for example the migration threads stay away
+ * from the CPUs that are reserved for the vCPUs.
+ */
+
+#define TYPE_THREAD_CONTEXT "thread-context"
+
+/*
+ * Like qemu_thread_create() with QEMU_THREAD_JOINABLE, and restrict the
+ * new thread to the host CPUs of the thread-context that places @group,
+ * if there is one.  A thread keeps its CPUs when the thread-context goes
+ * away.
+ */
+void thread_context_create_thread(ThreadGroup group, QemuThread *thread,
+                                  const char *name,
+                                  void *(*start_routine)(void *),
+                                  void *arg);
+
+#endif
@@ -188,6 +188,13 @@ void qemu_thread_create(QemuThread *thread, const char *name,
 void *qemu_thread_join(QemuThread *thread);
 void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
+/*
+ * Restrict @thread to the host CPUs set in the @nbits bits of
+ * @host_cpus.  Returns 0, or a negative errno value: -ENOSYS if the
+ * host can't do it.
+ */
+int qemu_thread_set_affinity(QemuThread *thread, unsigned long *host_cpus,
+                             unsigned long nbits);
 void qemu_thread_exit(void *retval) QEMU_NORETURN;
 void qemu_thread_naming(bool enable);
 
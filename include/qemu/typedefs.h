@@ -93,6 +93,7 @@ typedef struct PCIExpressHost PCIExpressHost;
 typedef struct PCIHostDeviceAddress PCIHostDeviceAddress;
 typedef struct PCIHostState PCIHostState;
 typedef struct PostcopyDiscardState PostcopyDiscardState;
+typedef struct PostcopyPlaceBatch PostcopyPlaceBatch;
 typedef struct Property Property;
 typedef struct PropertyInfo PropertyInfo;
 typedef struct QBool QBool;
@@ -0,0 +1,60 @@
+/*
+ * dirty limit helper functions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_DIRTYLIMIT_H
+#define QEMU_DIRTYLIMIT_H
+
+/**
+ * dirtylimit_in_service:
+ *
+ * Returns: %true if the dirty page rate of any vCPU is being limited.
+ */
+bool dirtylimit_in_service(void);
+
+/**
+ * dirtylimit_vcpu_index_valid:
+ * @cpu_index: index of the vCPU
+ *
+ * Returns: %true if @cpu_index is the index of an existing vCPU.
+ */
+bool dirtylimit_vcpu_index_valid(int cpu_index);
+
+/**
+ * dirtylimit_set_vcpu:
+ * @cpu_index: index of the vCPU
+ * @quota: dirty page rate limit in MB/s
+ * @enable: whether to limit the vCPU or to stop limiting it
+ *
+ * Limit the rate at which a vCPU dirties memory by making it sleep
+ * every time its KVM dirty ring is full.  The sleep time is adjusted
+ * periodically from the dirty page rate measured in the ring, so
+ * vCPUs that dirty memory slower than @quota are left alone.
+ *
+ * When the last limit goes away, this waits for the thread that
+ * measures the dirty page rates, dropping the BQL if it is held.
+ */
+void dirtylimit_set_vcpu(int cpu_index, uint64_t quota, bool enable);
+
+/**
+ * dirtylimit_set_all:
+ * @quota: dirty page rate limit in MB/s
+ * @enable: whether to limit the vCPUs or to stop limiting them
+ *
+ * Same as dirtylimit_set_vcpu(), for all the vCPUs.
+ */
+void dirtylimit_set_all(uint64_t quota, bool enable);
+
+/**
+ * dirtylimit_vcpu_execute:
+ * @cpu: the vCPU whose dirty ring is full
+ *
+ * Called by the vCPU thread when its dirty ring is full, without the
+ * BQL, to sleep as long as its dirty page rate limit requires.
+ */
+void dirtylimit_vcpu_execute(CPUState *cpu);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * dirty page rate helper functions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_DIRTYRATE_H
+#define QEMU_DIRTYRATE_H
+
+#include "qapi/qapi-types-migration.h"
+
+typedef struct VcpuStat {
+    int nvcpu; /* number of vcpu */
+    DirtyRateVcpu *rates; /* array of dirty rate for each vcpu */
+} VcpuStat;
+
+/**
+ * vcpu_calculate_dirtyrate: measure the dirty rate of each vcpu
+ *
+ * Count the pages that each vcpu logs in its KVM dirty ring over
+ * @calc_time_ms.  A new array of rates is allocated in @stat, which
+ * the caller frees.  Takes the BQL.
+ *
+ * Returns the actual duration of the measure, in milliseconds
+ *
+ * @calc_time_ms: duration of the measure, in milliseconds
+ * @stat: where to store the dirty rates
+ * @flag: GLOBAL_DIRTY_* user of the dirty log
+ * @one_shot: start and stop the dirty log around the measure for @flag;
+ *            otherwise the caller keeps it running
+ */
+int64_t vcpu_calculate_dirtyrate(int64_t calc_time_ms, VcpuStat *stat,
+                                 unsigned int flag, bool one_shot);
+
+#endif
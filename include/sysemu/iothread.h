@@ -26,6 +26,7 @@ struct IOThread {
     QemuThread thread;
     AioContext *ctx;
     bool run_gcontext;          /* whether we should run gcontext */
+    bool aio_source_attached;   /* is ctx a source of worker_context? */
     GMainContext *worker_context;
     GMainLoop *main_loop;
     QemuSemaphore init_done_sem; /* is thread init done? */
@@ -37,6 +38,9 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* Whether the io_uring of the AioContext uses an SQ thread */
+    bool io_uring_sqpoll;
 };
 typedef struct IOThread IOThread;
 
@@ -547,4 +547,17 @@ bool kvm_cpu_check_are_resettable(void);
 
 bool kvm_arch_cpu_check_are_resettable(void);
 
+/**
+ * kvm_dirty_ring_enabled - return whether the KVM dirty ring is in use
+ *
+ * When it is, the pages dirtied by each vCPU are accounted in
+ * CPUState::dirty_pages.
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_size - return the number of entries of each vCPU dirty ring
+ */
+uint32_t kvm_dirty_ring_size(void);
+
 #endif
@@ -33,6 +33,16 @@ typedef struct KVMSlot
 typedef struct KVMMemoryListener {
     MemoryListener listener;
     KVMSlot *slots;
+    /* The slots in use, sorted by start_addr */
+    KVMSlot **sorted_slots;
+    int nr_used_slots;
+    /*
+     * Slots removed by the current memory transaction.  They stay in
+     * KVM until the transaction commits or a new slot needs their
+     * room, in case the same memory is added back at the same address.
+     */
+    KVMSlot **deferred_del;
+    int nr_deferred_del;
     int as_id;
 } KVMMemoryListener;
 
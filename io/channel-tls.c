@@ -22,6 +22,7 @@
 #include "qapi/error.h"
 #include "qemu/module.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
 #include "trace.h"
 #include "qemu/atomic.h"
 
@@ -169,6 +170,9 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
     status = qcrypto_tls_session_get_handshake_status(ioc->session);
     if (status == QCRYPTO_TLS_HANDSHAKE_COMPLETE) {
         trace_qio_channel_tls_handshake_complete(ioc);
+        trace_qio_channel_tls_ktls(
+            ioc, qcrypto_tls_session_has_ktls(ioc->session, true),
+            qcrypto_tls_session_has_ktls(ioc->session, false));
         if (qcrypto_tls_session_check_credentials(ioc->session,
                                                   &err) < 0) {
             trace_qio_channel_tls_credentials_deny(ioc);
@@ -241,6 +245,19 @@ void qio_channel_tls_handshake(QIOChannelTLS *ioc,
 }
 
 
+void qio_channel_tls_enable_ktls(QIOChannelTLS *ioc)
+{
+#ifdef CONFIG_GNUTLS_KTLS
+    QIOChannelSocket *sioc = (QIOChannelSocket *)
+        object_dynamic_cast(OBJECT(ioc->master), TYPE_QIO_CHANNEL_SOCKET);
+
+    if (sioc) {
+        qcrypto_tls_session_set_socket(ioc->session, sioc->fd);
+    }
+#endif
+}
+
+
 static void qio_channel_tls_init(Object *obj G_GNUC_UNUSED)
 {
 }
@@ -301,12 +318,19 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
                                       size_t niov,
                                       int *fds,
                                       size_t nfds,
+                                      int flags,
                                       Error **errp)
 {
     QIOChannelTLS *tioc = QIO_CHANNEL_TLS(ioc);
     size_t i;
     ssize_t done = 0;
 
+    if (qcrypto_tls_session_has_ktls(tioc->session, true)) {
+        /* The kernel makes the records: skip the copy and write at once */
+        return qio_channel_writev_full(tioc->master, iov, niov,
+                                       NULL, 0, 0, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_write(tioc->session,
                                                 iov[i].iov_base,
@@ -27,6 +27,10 @@
 #include "qemu/iov.h"
 #include "qemu/module.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* Max amount to allow in rawinput/encoutput buffers */
 #define QIO_CHANNEL_WEBSOCK_MAX_BUFFER 8192
 
@@ -613,38 +617,54 @@ static gboolean qio_channel_websock_handshake_io(QIOChannel *ioc,
 }
 
 
-static void qio_channel_websock_encode(QIOChannelWebsock *ioc,
-                                       uint8_t opcode,
-                                       const struct iovec *iov,
-                                       size_t niov,
-                                       size_t size)
+typedef union {
+    char buf[QIO_CHANNEL_WEBSOCK_HEADER_LEN_64_BIT];
+    QIOChannelWebsockHeader ws;
+} QIOChannelWebsockHeaderBuf;
+
+/* Fill @header for a frame of @size bytes and return its length */
+static size_t qio_channel_websock_encode_header(QIOChannelWebsock *ioc,
+                                                uint8_t opcode,
+                                                size_t size,
+                                                QIOChannelWebsockHeaderBuf
+                                                *header)
 {
     size_t header_size;
-    size_t i;
-    union {
-        char buf[QIO_CHANNEL_WEBSOCK_HEADER_LEN_64_BIT];
-        QIOChannelWebsockHeader ws;
-    } header;
-
-    assert(size <= iov_size(iov, niov));
 
-    header.ws.b0 = QIO_CHANNEL_WEBSOCK_HEADER_FIELD_FIN |
+    header->ws.b0 = QIO_CHANNEL_WEBSOCK_HEADER_FIELD_FIN |
         (opcode & QIO_CHANNEL_WEBSOCK_HEADER_FIELD_OPCODE);
     if (size < QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_THRESHOLD_7_BIT) {
-        header.ws.b1 = (uint8_t)size;
+        header->ws.b1 = (uint8_t)size;
         header_size = QIO_CHANNEL_WEBSOCK_HEADER_LEN_7_BIT;
     } else if (size < QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_THRESHOLD_16_BIT) {
-        header.ws.b1 = QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_MAGIC_16_BIT;
-        header.ws.u.s16.l16 = cpu_to_be16((uint16_t)size);
+        header->ws.b1 = QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_MAGIC_16_BIT;
+        header->ws.u.s16.l16 = cpu_to_be16((uint16_t)size);
         header_size = QIO_CHANNEL_WEBSOCK_HEADER_LEN_16_BIT;
     } else {
-        header.ws.b1 = QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_MAGIC_64_BIT;
-        header.ws.u.s64.l64 = cpu_to_be64(size);
+        header->ws.b1 = QIO_CHANNEL_WEBSOCK_PAYLOAD_LEN_MAGIC_64_BIT;
+        header->ws.u.s64.l64 = cpu_to_be64(size);
         header_size = QIO_CHANNEL_WEBSOCK_HEADER_LEN_64_BIT;
     }
     header_size -= QIO_CHANNEL_WEBSOCK_HEADER_LEN_MASK;
 
     trace_qio_channel_websock_encode(ioc, opcode, header_size, size);
+    return header_size;
+}
+
+static void qio_channel_websock_encode(QIOChannelWebsock *ioc,
+                                       uint8_t opcode,
+                                       const struct iovec *iov,
+                                       size_t niov,
+                                       size_t size)
+{
+    QIOChannelWebsockHeaderBuf header;
+    size_t header_size;
+    size_t i;
+
+    assert(size <= iov_size(iov, niov));
+
+    header_size = qio_channel_websock_encode_header(ioc, opcode, size,
+                                                    &header);
     buffer_reserve(&ioc->encoutput, header_size + size);
     buffer_append(&ioc->encoutput, header.buf, header_size);
     for (i = 0; i < niov && size != 0; i++) {
@@ -794,12 +814,37 @@ static int qio_channel_websock_decode_header(QIOChannelWebsock *ioc,
 }
 
 
+/*
+ * XOR the @len bytes of @buf with @mask, starting at its first byte:
+ * 16 bytes at a time with SSE2, else 8, and the tail byte by byte.
+ */
+static void qio_channel_websock_unmask(uint8_t *buf, size_t len,
+                                       QIOChannelWebsockMask mask)
+{
+    uint64_t mask64 = ((uint64_t)mask.u << 32) | mask.u;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i mask128 = _mm_set1_epi64x(mask64);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i *p = (__m128i *)(buf + i);
+
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask128));
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        stq_he_p(buf + i, ldq_he_p(buf + i) ^ mask64);
+    }
+    for (; i < len; i++) {
+        buf[i] ^= mask.c[i % 4];
+    }
+}
+
 static int qio_channel_websock_decode_payload(QIOChannelWebsock *ioc,
                                               Error **errp)
 {
-    size_t i;
     size_t payload_len = 0;
-    uint32_t *payload32;
 
     if (ioc->payload_remain) {
         /* If we aren't at the end of the payload, then drop
@@ -823,15 +868,8 @@ static int qio_channel_websock_decode_payload(QIOChannelWebsock *ioc,
         ioc->payload_remain -= payload_len;
 
         /* unmask frame */
-        /* process 1 frame (32 bit op) */
-        payload32 = (uint32_t *)ioc->encinput.buffer;
-        for (i = 0; i < payload_len / 4; i++) {
-            payload32[i] ^= ioc->mask.u;
-        }
-        /* process the remaining bytes (if any) */
-        for (i *= 4; i < payload_len; i++) {
-            ioc->encinput.buffer[i] ^= ioc->mask.c[i % 4];
-        }
+        qio_channel_websock_unmask(ioc->encinput.buffer, payload_len,
+                                   ioc->mask);
     }
 
     trace_qio_channel_websock_payload_decode(
@@ -978,6 +1016,51 @@ static ssize_t qio_channel_websock_read_wire(QIOChannelWebsock *ioc,
 }
 
 
+/*
+ * Send a binary frame of @size bytes from @iov with a single writev()
+ * of the header and of the payload, without copying them into
+ * encoutput.  Whatever the master channel does not take is left in
+ * encoutput for qio_channel_websock_write_wire().  Only valid while
+ * encoutput is empty, so that the frames stay in order.
+ */
+static int qio_channel_websock_write_direct(QIOChannelWebsock *ioc,
+                                            const struct iovec *iov,
+                                            size_t niov,
+                                            size_t size,
+                                            Error **errp)
+{
+    QIOChannelWebsockHeaderBuf header;
+    g_autofree struct iovec *wire = g_new(struct iovec, niov + 1);
+    size_t header_size, total;
+    unsigned int nwire;
+    ssize_t ret;
+
+    assert(ioc->encoutput.offset == 0);
+
+    header_size = qio_channel_websock_encode_header(
+        ioc, QIO_CHANNEL_WEBSOCK_OPCODE_BINARY_FRAME, size, &header);
+    wire[0].iov_base = header.buf;
+    wire[0].iov_len = header_size;
+    nwire = 1 + iov_copy(wire + 1, niov, iov, niov, 0, size);
+    total = header_size + size;
+
+    ret = qio_channel_writev(ioc->master, wire, nwire, errp);
+    if (ret == QIO_CHANNEL_ERR_BLOCK) {
+        ret = 0;
+    } else if (ret < 0) {
+        return -1;
+    }
+
+    if (ret < total) {
+        buffer_reserve(&ioc->encoutput, total - ret);
+        iov_to_buf(wire, nwire, ret, buffer_end(&ioc->encoutput),
+                   total - ret);
+        ioc->encoutput.offset += total - ret;
+    }
+    return 0;
+}
+
+
 static ssize_t qio_channel_websock_write_wire(QIOChannelWebsock *ioc,
                                               Error **errp)
 {
@@ -1133,6 +1216,7 @@ static ssize_t qio_channel_websock_writev(QIOChannel *ioc,
                                           size_t niov,
                                           int *fds,
                                           size_t nfds,
+                                          int flags,
                                           Error **errp)
 {
     QIOChannelWebsock *wioc = QIO_CHANNEL_WEBSOCK(ioc);
@@ -1156,6 +1240,16 @@ static ssize_t qio_channel_websock_writev(QIOChannel *ioc,
         want = avail;
     }
 
+    if (want && wioc->encoutput.offset == 0) {
+        if (qio_channel_websock_write_direct(wioc, iov, niov, want,
+                                             errp) < 0) {
+            qio_channel_websock_unset_watch(wioc);
+            return -1;
+        }
+        qio_channel_websock_set_watch(wioc);
+        return want;
+    }
+
     if (want) {
         qio_channel_websock_encode(wioc,
                                    QIO_CHANNEL_WEBSOCK_OPCODE_BINARY_FRAME,
@@ -0,0 +1,427 @@
+/*
+ * QEMU I/O channels zstd driver
+ *
+ * Copyright (c) 2021 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <zstd.h>
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/module.h"
+#include "io/channel-zstd.h"
+#include "trace.h"
+
+
+static QIOChannelZstd *qio_channel_zstd_new(QIOChannel *master,
+                                            QIOChannelZstdMode mode)
+{
+    QIOChannelZstd *zioc;
+
+    zioc = QIO_CHANNEL_ZSTD(object_new(TYPE_QIO_CHANNEL_ZSTD));
+
+    zioc->master = master;
+    zioc->mode = mode;
+    if (qio_channel_has_feature(master, QIO_CHANNEL_FEATURE_SHUTDOWN)) {
+        qio_channel_set_feature(QIO_CHANNEL(zioc),
+                                QIO_CHANNEL_FEATURE_SHUTDOWN);
+    }
+    object_ref(OBJECT(master));
+
+    return zioc;
+}
+
+
+QIOChannelZstd *
+qio_channel_zstd_new_client(QIOChannel *master,
+                            int level,
+                            int workers,
+                            Error **errp)
+{
+    QIOChannelZstd *zioc;
+    size_t ret;
+
+    zioc = qio_channel_zstd_new(master, QIO_CHANNEL_ZSTD_COMPRESS);
+
+    zioc->cctx = ZSTD_createCCtx();
+    if (!zioc->cctx) {
+        error_setg(errp, "Cannot create zstd compression context");
+        goto error;
+    }
+
+    ret = ZSTD_CCtx_setParameter(zioc->cctx, ZSTD_c_compressionLevel, level);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "Cannot set zstd compression level %d: %s",
+                   level, ZSTD_getErrorName(ret));
+        goto error;
+    }
+
+    /*
+     * libzstd may be built without its worker threads, then it just
+     * compresses in the thread that writes.
+     */
+    if (workers) {
+        ZSTD_CCtx_setParameter(zioc->cctx, ZSTD_c_nbWorkers, workers);
+    }
+
+    zioc->buf_size = ZSTD_CStreamOutSize();
+    zioc->buf = g_malloc(zioc->buf_size);
+
+    trace_qio_channel_zstd_new_client(zioc, master, level, workers);
+    return zioc;
+
+ error:
+    object_unref(OBJECT(zioc));
+    return NULL;
+}
+
+
+QIOChannelZstd *
+qio_channel_zstd_new_server(QIOChannel *master,
+                            Error **errp)
+{
+    QIOChannelZstd *zioc;
+
+    zioc = qio_channel_zstd_new(master, QIO_CHANNEL_ZSTD_DETECT);
+
+    zioc->buf_size = ZSTD_DStreamInSize();
+    zioc->buf = g_malloc(zioc->buf_size);
+
+    trace_qio_channel_zstd_new_server(zioc, master);
+    return zioc;
+}
+
+
+static void qio_channel_zstd_init(Object *obj G_GNUC_UNUSED)
+{
+}
+
+
+static void qio_channel_zstd_finalize(Object *obj)
+{
+    QIOChannelZstd *ioc = QIO_CHANNEL_ZSTD(obj);
+
+    object_unref(OBJECT(ioc->master));
+    ZSTD_freeCCtx(ioc->cctx);
+    ZSTD_freeDCtx(ioc->dctx);
+    g_free(ioc->buf);
+}
+
+
+/*
+ * Read the first bytes from the master channel and look for the
+ * magic number that starts a zstd frame.
+ */
+static int qio_channel_zstd_detect(QIOChannelZstd *zioc,
+                                   Error **errp)
+{
+    while (zioc->buf_len < 4) {
+        ssize_t ret = qio_channel_read(zioc->master,
+                                       (char *)zioc->buf + zioc->buf_len,
+                                       4 - zioc->buf_len, errp);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == 0) {
+            break;
+        }
+        zioc->buf_len += ret;
+    }
+
+    if (zioc->buf_len < 4 || ldl_le_p(zioc->buf) != ZSTD_MAGICNUMBER) {
+        zioc->mode = QIO_CHANNEL_ZSTD_PASSTHROUGH;
+        trace_qio_channel_zstd_detect(zioc, false);
+        return 0;
+    }
+
+    zioc->dctx = ZSTD_createDCtx();
+    if (!zioc->dctx) {
+        error_setg(errp, "Cannot create zstd decompression context");
+        return -1;
+    }
+    zioc->mode = QIO_CHANNEL_ZSTD_DECOMPRESS;
+    trace_qio_channel_zstd_detect(zioc, true);
+    return 0;
+}
+
+
+static ssize_t qio_channel_zstd_decompress(QIOChannelZstd *zioc,
+                                           const struct iovec *iov,
+                                           size_t niov,
+                                           Error **errp)
+{
+    for (;;) {
+        ssize_t got = 0;
+        ssize_t ret;
+        size_t i;
+
+        for (i = 0; i < niov; i++) {
+            ZSTD_outBuffer out = { iov[i].iov_base, iov[i].iov_len, 0 };
+            ZSTD_inBuffer in = { zioc->buf, zioc->buf_len, zioc->buf_pos };
+            size_t zret;
+
+            zret = ZSTD_decompressStream(zioc->dctx, &out, &in);
+            zioc->buf_pos = in.pos;
+            if (ZSTD_isError(zret)) {
+                error_setg(errp, "Cannot decompress zstd stream: %s",
+                           ZSTD_getErrorName(zret));
+                return -1;
+            }
+            got += out.pos;
+            /* Either the input ran out, or zstd has to read more */
+            if (out.pos < out.size) {
+                break;
+            }
+        }
+        if (got) {
+            return got;
+        }
+
+        /* All of the input went in without producing anything */
+        ret = qio_channel_read(zioc->master, (char *)zioc->buf,
+                               zioc->buf_size, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+        zioc->buf_pos = 0;
+        zioc->buf_len = ret;
+    }
+}
+
+
+static ssize_t qio_channel_zstd_readv(QIOChannel *ioc,
+                                      const struct iovec *iov,
+                                      size_t niov,
+                                      int **fds,
+                                      size_t *nfds,
+                                      Error **errp)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+
+    if (zioc->mode == QIO_CHANNEL_ZSTD_DETECT) {
+        int ret = qio_channel_zstd_detect(zioc, errp);
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    switch (zioc->mode) {
+    case QIO_CHANNEL_ZSTD_DECOMPRESS:
+        return qio_channel_zstd_decompress(zioc, iov, niov, errp);
+
+    case QIO_CHANNEL_ZSTD_PASSTHROUGH:
+        /* What was read to look for the magic number comes first */
+        if (zioc->buf_pos < zioc->buf_len) {
+            size_t done = iov_from_buf(iov, niov, 0,
+                                       zioc->buf + zioc->buf_pos,
+                                       zioc->buf_len - zioc->buf_pos);
+
+            zioc->buf_pos += done;
+            return done;
+        }
+        /* fall through */
+    default:
+        return qio_channel_readv_full(zioc->master, iov, niov, fds, nfds,
+                                      errp);
+    }
+}
+
+
+/* Write out the compressed data waiting in the buffer */
+static int qio_channel_zstd_write_buf(QIOChannelZstd *zioc,
+                                      Error **errp)
+{
+    if (zioc->buf_len &&
+        qio_channel_write_all(zioc->master, (char *)zioc->buf,
+                              zioc->buf_len, errp) < 0) {
+        return -1;
+    }
+    zioc->buf_len = 0;
+    return 0;
+}
+
+
+static int qio_channel_zstd_compress(QIOChannelZstd *zioc,
+                                     const void *data,
+                                     size_t len,
+                                     ZSTD_EndDirective mode,
+                                     Error **errp)
+{
+    ZSTD_inBuffer in = { data, len, 0 };
+
+    for (;;) {
+        ZSTD_outBuffer out = { zioc->buf, zioc->buf_size, zioc->buf_len };
+        size_t ret;
+
+        ret = ZSTD_compressStream2(zioc->cctx, &out, &in, mode);
+        zioc->buf_len = out.pos;
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "Cannot compress zstd stream: %s",
+                       ZSTD_getErrorName(ret));
+            return -1;
+        }
+        /* With a flush or an end, 0 means that zstd is done */
+        if (mode == ZSTD_e_continue ? in.pos == in.size : ret == 0) {
+            return 0;
+        }
+        if (qio_channel_zstd_write_buf(zioc, errp) < 0) {
+            return -1;
+        }
+    }
+}
+
+
+static ssize_t qio_channel_zstd_writev(QIOChannel *ioc,
+                                       const struct iovec *iov,
+                                       size_t niov,
+                                       int *fds,
+                                       size_t nfds,
+                                       int flags,
+                                       Error **errp)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+    ssize_t done = 0;
+    size_t i;
+
+    if (zioc->mode != QIO_CHANNEL_ZSTD_COMPRESS) {
+        return qio_channel_writev_full(zioc->master, iov, niov,
+                                       fds, nfds, flags, errp);
+    }
+
+    for (i = 0; i < niov; i++) {
+        if (qio_channel_zstd_compress(zioc, iov[i].iov_base, iov[i].iov_len,
+                                      ZSTD_e_continue, errp) < 0) {
+            return -1;
+        }
+        done += iov[i].iov_len;
+    }
+
+    if (qio_channel_zstd_compress(zioc, NULL, 0, ZSTD_e_flush, errp) < 0 ||
+        qio_channel_zstd_write_buf(zioc, errp) < 0) {
+        return -1;
+    }
+    return done;
+}
+
+static int qio_channel_zstd_set_blocking(QIOChannel *ioc,
+                                         bool enabled,
+                                         Error **errp)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+
+    return qio_channel_set_blocking(zioc->master, enabled, errp);
+}
+
+static void qio_channel_zstd_set_delay(QIOChannel *ioc,
+                                       bool enabled)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+
+    qio_channel_set_delay(zioc->master, enabled);
+}
+
+static void qio_channel_zstd_set_cork(QIOChannel *ioc,
+                                      bool enabled)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+
+    qio_channel_set_cork(zioc->master, enabled);
+}
+
+static int qio_channel_zstd_shutdown(QIOChannel *ioc,
+                                     QIOChannelShutdown how,
+                                     Error **errp)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+
+    return qio_channel_shutdown(zioc->master, how, errp);
+}
+
+static int qio_channel_zstd_close(QIOChannel *ioc,
+                                  Error **errp)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+    Error *local_err = NULL;
+
+    /* The return path closes the channel too, end the frame once */
+    if (zioc->mode == QIO_CHANNEL_ZSTD_COMPRESS && !zioc->ended) {
+        zioc->ended = true;
+        if (qio_channel_zstd_compress(zioc, NULL, 0, ZSTD_e_end,
+                                      &local_err) < 0 ||
+            qio_channel_zstd_write_buf(zioc, &local_err) < 0) {
+            qio_channel_close(zioc->master, NULL);
+            error_propagate(errp, local_err);
+            return -1;
+        }
+    }
+
+    return qio_channel_close(zioc->master, errp);
+}
+
+static void qio_channel_zstd_set_aio_fd_handler(QIOChannel *ioc,
+                                                AioContext *ctx,
+                                                IOHandler *io_read,
+                                                IOHandler *io_write,
+                                                void *opaque)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+
+    qio_channel_set_aio_fd_handler(zioc->master, ctx, io_read, io_write,
+                                   opaque);
+}
+
+static GSource *qio_channel_zstd_create_watch(QIOChannel *ioc,
+                                              GIOCondition condition)
+{
+    QIOChannelZstd *zioc = QIO_CHANNEL_ZSTD(ioc);
+
+    return qio_channel_create_watch(zioc->master, condition);
+}
+
+static void qio_channel_zstd_class_init(ObjectClass *klass,
+                                        void *class_data G_GNUC_UNUSED)
+{
+    QIOChannelClass *ioc_klass = QIO_CHANNEL_CLASS(klass);
+
+    ioc_klass->io_writev = qio_channel_zstd_writev;
+    ioc_klass->io_readv = qio_channel_zstd_readv;
+    ioc_klass->io_set_blocking = qio_channel_zstd_set_blocking;
+    ioc_klass->io_set_delay = qio_channel_zstd_set_delay;
+    ioc_klass->io_set_cork = qio_channel_zstd_set_cork;
+    ioc_klass->io_close = qio_channel_zstd_close;
+    ioc_klass->io_shutdown = qio_channel_zstd_shutdown;
+    ioc_klass->io_create_watch = qio_channel_zstd_create_watch;
+    ioc_klass->io_set_aio_fd_handler = qio_channel_zstd_set_aio_fd_handler;
+}
+
+static const TypeInfo qio_channel_zstd_info = {
+    .parent = TYPE_QIO_CHANNEL,
+    .name = TYPE_QIO_CHANNEL_ZSTD,
+    .instance_size = sizeof(QIOChannelZstd),
+    .instance_init = qio_channel_zstd_init,
+    .instance_finalize = qio_channel_zstd_finalize,
+    .class_init = qio_channel_zstd_class_init,
+};
+
+static void qio_channel_zstd_register_types(void)
+{
+    type_register_static(&qio_channel_zstd_info);
+}
+
+type_init(qio_channel_zstd_register_types);
@@ -22,6 +22,7 @@
 #include "qapi/qapi-commands-misc.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "qemu/thread-context.h"
 #include "qemu/main-loop.h"
 
 typedef ObjectClass IOThreadClass;
@@ -39,6 +40,25 @@ DECLARE_CLASS_CHECKERS(IOThreadClass, IOTHREAD,
 #define IOTHREAD_POLL_MAX_NS_DEFAULT 0ULL
 #endif
 
+/*
+ * The AioContext only goes to the GMainContext once something needs the
+ * gcontext, because the glib loop turns off the io_uring fd monitoring of
+ * the AioContext.  This runs in the iothread so that the io_uring is not
+ * torn down under aio_poll().
+ */
+static void iothread_attach_aio_source(IOThread *iothread)
+{
+    GSource *source;
+
+    if (iothread->aio_source_attached) {
+        return;
+    }
+    source = aio_get_g_source(iothread->ctx);
+    g_source_attach(source, iothread->worker_context);
+    g_source_unref(source);
+    iothread->aio_source_attached = true;
+}
+
 static void *iothread_run(void *opaque)
 {
     IOThread *iothread = opaque;
@@ -70,6 +90,7 @@ static void *iothread_run(void *opaque)
          * changed in previous aio_poll()
          */
         if (iothread->running && qatomic_read(&iothread->run_gcontext)) {
+            iothread_attach_aio_source(iothread);
             g_main_loop_run(iothread->main_loop);
         }
     }
@@ -143,12 +164,7 @@ static void iothread_instance_finalize(Object *obj)
 
 static void iothread_init_gcontext(IOThread *iothread)
 {
-    GSource *source;
-
     iothread->worker_context = g_main_context_new();
-    source = aio_get_g_source(iothread_get_aio_context(iothread));
-    g_source_attach(source, iothread->worker_context);
-    g_source_unref(source);
     iothread->main_loop = g_main_loop_new(iothread->worker_context, TRUE);
 }
 
@@ -183,13 +199,22 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
-    /* This assumes we are called from a thread with useful CPU affinity for us
-     * to inherit.
+    aio_context_set_io_uring_sqpoll(iothread->ctx, iothread->io_uring_sqpoll,
+                                    &local_error);
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
+    /* Unless a thread-context places the iothreads, this assumes we are
+     * called from a thread with useful CPU affinity for us to inherit.
      */
     thread_name = g_strdup_printf("IO %s",
                         object_get_canonical_path_component(OBJECT(obj)));
-    qemu_thread_create(&iothread->thread, thread_name, iothread_run,
-                       iothread, QEMU_THREAD_JOINABLE);
+    thread_context_create_thread(THREAD_GROUP_IOTHREAD, &iothread->thread,
+                                 thread_name, iothread_run, iothread);
     g_free(thread_name);
 
     /* Wait for initialization to complete */
@@ -252,6 +277,28 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static bool iothread_get_io_uring_sqpoll(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->io_uring_sqpoll;
+}
+
+static void iothread_set_io_uring_sqpoll(Object *obj, bool value,
+                                         Error **errp)
+{
+    ERRP_GUARD();
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        aio_context_set_io_uring_sqpoll(iothread->ctx, value, errp);
+        if (*errp) {
+            return;
+        }
+    }
+    iothread->io_uring_sqpoll = value;
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -269,6 +316,9 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add_bool(klass, "io-uring-sqpoll",
+                                   iothread_get_io_uring_sqpoll,
+                                   iothread_set_io_uring_sqpoll);
 }
 
 static const TypeInfo iothread_info = {
@@ -318,6 +368,12 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->poll_hits = stat64_get(&iothread->ctx->poll_hits);
+    info->poll_misses = stat64_get(&iothread->ctx->poll_misses);
+    info->coroutine_pool_hits =
+        stat64_get(&iothread->ctx->coroutine_pool_hits);
+    info->coroutine_pool_misses =
+        stat64_get(&iothread->ctx->coroutine_pool_misses);
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
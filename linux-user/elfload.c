@@ -1929,7 +1929,9 @@ static void zero_bss(abi_ulong elf_bss, abi_ulong last_bss, int prot)
 
     /* Ensure that the bss page(s) are valid */
     if ((page_get_flags(last_bss-1) & prot) != prot) {
+        mmap_lock();
         page_set_flags(elf_bss & TARGET_PAGE_MASK, last_bss, prot | PAGE_VALID);
+        mmap_unlock();
     }
 
     if (host_start < host_map_start) {
@@ -2670,7 +2672,7 @@ static void load_elf_image(const char *image_name, int image_fd,
     info->nsegs = 0;
     info->pt_dynamic_addr = 0;
 
-    mmap_lock();
+    mmap_vma_lock();
 
     /*
      * Find the maximum size of the image and allocate an appropriate
@@ -2934,7 +2936,7 @@ static void load_elf_image(const char *image_name, int image_fd,
         load_symbols(ehdr, image_fd, load_bias);
     }
 
-    mmap_unlock();
+    mmap_vma_unlock();
 
     close(image_fd);
     return;
@@ -21,9 +21,45 @@
 #include "exec/log.h"
 #include "qemu.h"
 
+/*
+ * mmap_vma_lock serializes the changes to the guest address space: the
+ * choice of the addresses, the host mappings and the page flags.  Inside
+ * it, mmap_lock is only taken around the updates of the page flags and of
+ * the host protection that depends on them.  Translating code and the
+ * faults on pages that contain code thus only wait for these updates, not
+ * for looking up a free range, for reading a file or for the host
+ * mmap() and munmap() calls that don't touch translated code.
+ *
+ * Both locks are recursive and mmap_vma_lock must be taken first.  The
+ * page flags may be read with either of them held: with mmap_vma_lock
+ * alone, PAGE_WRITE may still get cleared or set back on pages that
+ * contain code, but the other flags are stable.
+ */
+static pthread_mutex_t mmap_vma_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int mmap_vma_lock_count;
 static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
 static __thread int mmap_lock_count;
 
+void mmap_vma_lock(void)
+{
+    assert(mmap_vma_lock_count || !mmap_lock_count);
+    if (mmap_vma_lock_count++ == 0) {
+        pthread_mutex_lock(&mmap_vma_mutex);
+    }
+}
+
+void mmap_vma_unlock(void)
+{
+    if (--mmap_vma_lock_count == 0) {
+        pthread_mutex_unlock(&mmap_vma_mutex);
+    }
+}
+
+bool have_mmap_vma_lock(void)
+{
+    return mmap_vma_lock_count > 0;
+}
+
 void mmap_lock(void)
 {
     if (mmap_lock_count++ == 0) {
@@ -46,17 +82,21 @@ bool have_mmap_lock(void)
 /* Grab lock to make sure things are in a consistent state after fork().  */
 void mmap_fork_start(void)
 {
-    if (mmap_lock_count)
+    if (mmap_lock_count || mmap_vma_lock_count)
         abort();
+    pthread_mutex_lock(&mmap_vma_mutex);
     pthread_mutex_lock(&mmap_mutex);
 }
 
 void mmap_fork_end(int child)
 {
-    if (child)
+    if (child) {
         pthread_mutex_init(&mmap_mutex, NULL);
-    else
+        pthread_mutex_init(&mmap_vma_mutex, NULL);
+    } else {
         pthread_mutex_unlock(&mmap_mutex);
+        pthread_mutex_unlock(&mmap_vma_mutex);
+    }
 }
 
 /*
@@ -132,6 +172,8 @@ int target_mprotect(abi_ulong start, abi_ulong len, int target_prot)
         return 0;
     }
 
+    /* The host protection is computed from the flags of the other pages */
+    mmap_vma_lock();
     mmap_lock();
     host_start = start & qemu_host_page_mask;
     host_end = HOST_PAGE_ALIGN(end);
@@ -177,9 +219,11 @@ int target_mprotect(abi_ulong start, abi_ulong len, int target_prot)
     }
     page_set_flags(start, start + len, page_flags);
     mmap_unlock();
+    mmap_vma_unlock();
     return 0;
 error:
     mmap_unlock();
+    mmap_vma_unlock();
     return ret;
 }
 
@@ -308,7 +352,7 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size,
 /*
  * Find and reserve a free memory area of size 'size'. The search
  * starts at 'start'.
- * It must be called with mmap_lock() held.
+ * It must be called with mmap_vma_lock() held.
  * Return -1 if error.
  */
 abi_ulong mmap_find_vma(abi_ulong start, abi_ulong size, abi_ulong align)
@@ -424,8 +468,9 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int target_prot,
 {
     abi_ulong ret, end, real_start, real_end, retaddr, host_offset, host_len;
     int page_flags, host_prot;
+    bool locked = false;
 
-    mmap_lock();
+    mmap_vma_lock();
     trace_target_mmap(start, len, target_prot, flags, fd, offset);
 
     if (!len) {
@@ -535,7 +580,21 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int target_prot,
             host_start += offset - host_offset;
         }
         start = h2g(host_start);
+
+        /*
+         * The range was free, there is no code to invalidate: only take
+         * mmap_lock now to set its flags.
+         */
+        mmap_lock();
+        locked = true;
     } else {
+        /*
+         * This may replace pages that contain code, or that share a host
+         * page with some.
+         */
+        mmap_lock();
+        locked = true;
+
         if (start & ~TARGET_PAGE_MASK) {
             errno = EINVAL;
             goto fail;
@@ -632,9 +691,13 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int target_prot,
     }
     tb_invalidate_phys_range(start, start + len);
     mmap_unlock();
+    mmap_vma_unlock();
     return start;
 fail:
-    mmap_unlock();
+    if (locked) {
+        mmap_unlock();
+    }
+    mmap_vma_unlock();
     return -1;
 }
 
@@ -693,7 +756,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
         return -TARGET_EINVAL;
     }
 
-    mmap_lock();
+    mmap_vma_lock();
     end = start + len;
     real_start = start & qemu_host_page_mask;
     real_end = HOST_PAGE_ALIGN(end);
@@ -732,11 +795,17 @@ int target_munmap(abi_ulong start, abi_ulong len)
         }
     }
 
+    /*
+     * Until the flags are cleared, translating code from the range faults
+     * like the guest would.
+     */
     if (ret == 0) {
+        mmap_lock();
         page_set_flags(start, start + len, 0);
         tb_invalidate_phys_range(start, start + len);
+        mmap_unlock();
     }
-    mmap_unlock();
+    mmap_vma_unlock();
     return ret;
 }
 
@@ -756,7 +825,7 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         return -1;
     }
 
-    mmap_lock();
+    mmap_vma_lock();
 
     if (flags & MREMAP_FIXED) {
         host_addr = mremap(g2h_untagged(old_addr), old_size, new_size,
@@ -815,6 +884,7 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         }
     }
 
+    mmap_lock();
     if (host_addr == MAP_FAILED) {
         new_addr = -1;
     } else {
@@ -826,5 +896,6 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size);
     mmap_unlock();
+    mmap_vma_unlock();
     return new_addr;
 }
@@ -479,6 +479,9 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
 extern unsigned long last_brk;
 extern abi_ulong mmap_next_start;
 abi_ulong mmap_find_vma(abi_ulong, abi_ulong, abi_ulong);
+void mmap_vma_lock(void);
+void mmap_vma_unlock(void);
+bool have_mmap_vma_lock(void);
 void mmap_fork_start(void);
 void mmap_fork_end(int child);
 
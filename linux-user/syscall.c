@@ -4632,7 +4632,7 @@ static inline abi_ulong do_shmat(CPUArchState *cpu_env,
         return -TARGET_EINVAL;
     }
 
-    mmap_lock();
+    mmap_vma_lock();
 
     /*
      * We're mapping shared memory, so ensure we generate code for parallel
@@ -4662,14 +4662,16 @@ static inline abi_ulong do_shmat(CPUArchState *cpu_env,
     }
 
     if (host_raddr == (void *)-1) {
-        mmap_unlock();
+        mmap_vma_unlock();
         return get_errno((long)host_raddr);
     }
     raddr=h2g((unsigned long)host_raddr);
 
+    mmap_lock();
     page_set_flags(raddr, raddr + shm_info.shm_segsz,
                    PAGE_VALID | PAGE_RESET | PAGE_READ |
                    (shmflg & SHM_RDONLY ? 0 : PAGE_WRITE));
+    mmap_unlock();
 
     for (i = 0; i < N_SHM_REGIONS; i++) {
         if (!shm_regions[i].in_use) {
@@ -4680,7 +4682,7 @@ static inline abi_ulong do_shmat(CPUArchState *cpu_env,
         }
     }
 
-    mmap_unlock();
+    mmap_vma_unlock();
     return raddr;
 
 }
@@ -4692,18 +4694,20 @@ static inline abi_long do_shmdt(abi_ulong shmaddr)
 
     /* shmdt pointers are always untagged */
 
-    mmap_lock();
+    mmap_vma_lock();
 
     for (i = 0; i < N_SHM_REGIONS; ++i) {
         if (shm_regions[i].in_use && shm_regions[i].start == shmaddr) {
             shm_regions[i].in_use = false;
+            mmap_lock();
             page_set_flags(shmaddr, shmaddr + shm_regions[i].size, 0);
+            mmap_unlock();
             break;
         }
     }
     rv = get_errno(shmdt(g2h_untagged(shmaddr)));
 
-    mmap_unlock();
+    mmap_vma_unlock();
 
     return rv;
 }
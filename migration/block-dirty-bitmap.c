@@ -53,6 +53,17 @@
  * [ be64: buffer size  ] \ ! (flags & ZEROES)
  * [ n bytes: buffer    ] /
  *
+ * With the dirty-bitmaps-compress capability, the buffer is replaced by:
+ *
+ * [ 1 byte: encoding   ] \
+ * [ be64: buffer size  ]  | ! (flags & ZEROES)
+ * [ be64: encoded size ]  |
+ * [ n bytes: encoded   ] /
+ *
+ * Encoding 0 is the buffer itself, 1 the runs of its clear then set bits,
+ * alternately, each as a LEB128 number, and 2 these runs compressed with
+ * the compress-method.
+ *
  * The last chunk in stream should contain flags & EOS. The chunk may skip
  * device and/or bitmap names, assuming them to be the same with the previous
  * chunk.
@@ -73,13 +84,21 @@
 #include "qemu/hbitmap.h"
 #include "qemu/cutils.h"
 #include "qemu/id.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/thread-context.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
 #include "qapi/qapi-visit-migration.h"
 #include "qapi/clone-visitor.h"
+#include "ram-compress.h"
 #include "trace.h"
 
 #define CHUNK_SIZE     (1 << 10)
+/* With dirty-bitmaps-compress, the chunks are larger but rarely sent whole */
+#define ENCODED_CHUNK_SIZE (64 << 10)
+/* Chunks prepared by the threads at once */
+#define ENCODED_BATCH_CHUNKS 64
 
 /* Flags occupy one, two or four bytes (Big Endian). The size is determined as
  * follows:
@@ -104,6 +123,10 @@
 /* 0x04 was "AUTOLOAD" flags on older versions, now it is ignored */
 #define DIRTY_BITMAP_MIG_START_FLAG_RESERVED_MASK    0xf8
 
+#define DIRTY_BITMAP_MIG_ENCODING_RAW           0
+#define DIRTY_BITMAP_MIG_ENCODING_RLE           1
+#define DIRTY_BITMAP_MIG_ENCODING_COMPRESSED    2
+
 /* State of one bitmap during save process */
 typedef struct SaveBitmapState {
     /* Written during setup phase. */
@@ -121,6 +144,27 @@ typedef struct SaveBitmapState {
     uint64_t cur_sector;
 } SaveBitmapState;
 
+/* A chunk of the bulk phase, prepared by an encode thread */
+typedef struct DBMChunk {
+    SaveBitmapState *dbms;
+    uint64_t start_sector;
+    uint32_t nr_sectors;
+    bool zeroes;
+    uint8_t encoding;
+    uint64_t buf_size;
+    /* The serialized bits, or what they are encoded to */
+    uint8_t *data;
+    uint64_t data_size;
+} DBMChunk;
+
+typedef struct DBMEncodeThread {
+    QemuThread thread;
+    QemuSemaphore sem;
+    QemuSemaphore done_sem;
+    void *comp_state;
+    bool quit;
+} DBMEncodeThread;
+
 /* State of the dirty bitmap migration (DBM) during save process */
 typedef struct DBMSaveState {
     QSIMPLEQ_HEAD(, SaveBitmapState) dbms_list;
@@ -131,6 +175,14 @@ typedef struct DBMSaveState {
     /* for send_bitmap_bits() */
     BlockDriverState *prev_bs;
     BdrvDirtyBitmap *prev_bitmap;
+
+    /* for dirty-bitmaps-compress */
+    const RAMCompressMethods *comp_ops;
+    DBMEncodeThread *threads;
+    int nr_threads;
+    DBMChunk batch[ENCODED_BATCH_CHUNKS];
+    unsigned int batch_len;
+    unsigned int next_chunk;
 } DBMSaveState;
 
 typedef struct LoadBitmapState {
@@ -163,6 +215,10 @@ typedef struct DBMLoadState {
 
     GSList *bitmaps;
     QemuMutex lock; /* protect bitmaps */
+
+    /* for dirty-bitmaps-compress */
+    const RAMCompressMethods *decomp_ops;
+    void *decomp_state;
 } DBMLoadState;
 
 typedef struct DBMState {
@@ -462,11 +518,243 @@ static void send_bitmap_bits(QEMUFile *f, DBMSaveState *s,
     g_free(buf);
 }
 
+static bool dbm_test_bit(const uint8_t *buf, uint64_t nr)
+{
+    return buf[nr >> 3] & (1 << (nr & 7));
+}
+
+/*
+ * Encode the @nbits bits at @buf as alternate runs of clear and set bits,
+ * starting with a clear one.  Returns the size of the runs, or 0 if they
+ * don't fit in the @out_len bytes at @out.
+ */
+static size_t dbm_rle_encode(const uint8_t *buf, uint64_t nbits,
+                             uint8_t *out, size_t out_len)
+{
+    size_t len = 0;
+    uint64_t nr = 0;
+    bool set = false;
+
+    while (nr < nbits) {
+        uint8_t same = set ? 0xff : 0;
+        uint64_t run = nr;
+
+        while (nr < nbits) {
+            if (!(nr & 7) && nbits - nr >= 8 && buf[nr >> 3] == same) {
+                nr += 8;
+            } else if (dbm_test_bit(buf, nr) == set) {
+                nr++;
+            } else {
+                break;
+            }
+        }
+
+        run = nr - run;
+        do {
+            if (len == out_len) {
+                return 0;
+            }
+            out[len++] = (run & 0x7f) | (run > 0x7f ? 0x80 : 0);
+            run >>= 7;
+        } while (run);
+        set = !set;
+    }
+    return len;
+}
+
+/* Set the bits of the runs at @in in the @nbits clear bits at @buf */
+static int dbm_rle_decode(const uint8_t *in, size_t in_len,
+                          uint8_t *buf, uint64_t nbits)
+{
+    size_t pos = 0;
+    uint64_t nr = 0;
+    bool set = false;
+
+    while (pos < in_len) {
+        uint64_t run = 0, end;
+        int shift = 0;
+        uint8_t byte;
+
+        do {
+            if (pos == in_len || shift > 63) {
+                return -1;
+            }
+            byte = in[pos++];
+            run |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+
+        if (run > nbits - nr) {
+            return -1;
+        }
+        end = nr + run;
+        if (set) {
+            for (; nr < end && (nr & 7); nr++) {
+                buf[nr >> 3] |= 1 << (nr & 7);
+            }
+            for (; end - nr >= 8; nr += 8) {
+                buf[nr >> 3] = 0xff;
+            }
+            for (; nr < end; nr++) {
+                buf[nr >> 3] |= 1 << (nr & 7);
+            }
+        }
+        nr = end;
+        set = !set;
+    }
+    return nr == nbits ? 0 : -1;
+}
+
+/* Called from the encode threads, while the bitmaps don't change */
+static void dbm_encode_chunk(DBMSaveState *s, DBMEncodeThread *t,
+                             DBMChunk *c)
+{
+    /* align for buffer_is_zero(), as send_bitmap_bits() */
+    uint64_t unaligned_size =
+        bdrv_dirty_bitmap_serialization_size(
+            c->dbms->bitmap, c->start_sector << BDRV_SECTOR_BITS,
+            (uint64_t)c->nr_sectors << BDRV_SECTOR_BITS);
+    uint8_t *buf, *rle, *comp;
+    size_t rle_size, bound;
+    int comp_size;
+
+    c->buf_size = QEMU_ALIGN_UP(unaligned_size, 4 * sizeof(long));
+    buf = g_malloc0(c->buf_size);
+    bdrv_dirty_bitmap_serialize_part(
+        c->dbms->bitmap, buf, c->start_sector << BDRV_SECTOR_BITS,
+        (uint64_t)c->nr_sectors << BDRV_SECTOR_BITS);
+
+    if (buffer_is_zero(buf, c->buf_size)) {
+        g_free(buf);
+        c->zeroes = true;
+        return;
+    }
+
+    c->encoding = DIRTY_BITMAP_MIG_ENCODING_RAW;
+    c->data = buf;
+    c->data_size = c->buf_size;
+
+    rle = g_malloc(c->buf_size);
+    rle_size = dbm_rle_encode(buf, c->buf_size * 8, rle, c->buf_size - 1);
+    if (!rle_size) {
+        g_free(rle);
+        return;
+    }
+    g_free(buf);
+    c->encoding = DIRTY_BITMAP_MIG_ENCODING_RLE;
+    c->data = rle;
+    c->data_size = rle_size;
+
+    bound = s->comp_ops->bound(rle_size);
+    comp = g_malloc(bound);
+    comp_size = s->comp_ops->compress(t->comp_state, comp, bound,
+                                      rle, rle_size);
+    if (comp_size <= 0 || comp_size >= rle_size) {
+        g_free(comp);
+        return;
+    }
+    g_free(rle);
+    c->encoding = DIRTY_BITMAP_MIG_ENCODING_COMPRESSED;
+    c->data = comp;
+    c->data_size = comp_size;
+}
+
+static void *dbm_encode_thread(void *opaque)
+{
+    DBMEncodeThread *t = opaque;
+    DBMSaveState *s = &dbm_state.save;
+    unsigned int i;
+
+    while (true) {
+        qemu_sem_wait(&t->sem);
+        if (qatomic_read(&t->quit)) {
+            break;
+        }
+        while ((i = qatomic_fetch_inc(&s->next_chunk)) < s->batch_len) {
+            dbm_encode_chunk(s, t, &s->batch[i]);
+        }
+        qemu_sem_post(&t->done_sem);
+    }
+    return NULL;
+}
+
+static void dbm_encode_threads_cleanup(DBMSaveState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_threads; i++) {
+        DBMEncodeThread *t = &s->threads[i];
+
+        qatomic_set(&t->quit, true);
+        qemu_sem_post(&t->sem);
+        qemu_thread_join(&t->thread);
+        qemu_sem_destroy(&t->sem);
+        qemu_sem_destroy(&t->done_sem);
+        s->comp_ops->compress_cleanup(t->comp_state);
+    }
+    g_free(s->threads);
+    s->threads = NULL;
+    s->nr_threads = 0;
+}
+
+static int dbm_encode_threads_setup(DBMSaveState *s, Error **errp)
+{
+    int i, nr_threads = MAX(migrate_compress_threads(), 1);
+
+    s->comp_ops = ram_compress_get_ops(migrate_compress_method());
+    s->threads = g_new0(DBMEncodeThread, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        DBMEncodeThread *t = &s->threads[i];
+
+        if (s->comp_ops->compress_setup(&t->comp_state,
+                                        migrate_compress_level(), errp)) {
+            dbm_encode_threads_cleanup(s);
+            return -1;
+        }
+        qemu_sem_init(&t->sem, 0);
+        qemu_sem_init(&t->done_sem, 0);
+        thread_context_create_thread(THREAD_GROUP_MIGRATION, &t->thread,
+                                     "dbm/encode", dbm_encode_thread, t);
+        s->nr_threads++;
+    }
+    return 0;
+}
+
+/* Called with no lock taken.  */
+static void send_bitmap_chunk(QEMUFile *f, DBMSaveState *s, DBMChunk *c)
+{
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS;
+
+    if (c->zeroes) {
+        flags |= DIRTY_BITMAP_MIG_FLAG_ZEROES;
+    }
+
+    trace_send_bitmap_chunk(flags, c->start_sector, c->nr_sectors,
+                            c->encoding, c->buf_size, c->data_size);
+
+    send_bitmap_header(f, s, c->dbms, flags);
+
+    qemu_put_be64(f, c->start_sector);
+    qemu_put_be32(f, c->nr_sectors);
+
+    /* flush zero chunks here, as send_bitmap_bits() */
+    if (flags & DIRTY_BITMAP_MIG_FLAG_ZEROES) {
+        qemu_fflush(f);
+    } else {
+        qemu_put_byte(f, c->encoding);
+        qemu_put_be64(f, c->buf_size);
+        qemu_put_be64(f, c->data_size);
+        qemu_put_buffer(f, c->data, c->data_size);
+    }
+}
+
 /* Called with iothread lock taken.  */
 static void dirty_bitmap_do_save_cleanup(DBMSaveState *s)
 {
     SaveBitmapState *dbms;
 
+    dbm_encode_threads_cleanup(s);
+
     while ((dbms = QSIMPLEQ_FIRST(&s->dbms_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&s->dbms_list, entry);
         bdrv_dirty_bitmap_set_busy(dbms->bitmap, false);
@@ -573,7 +861,9 @@ static int add_bitmaps_to_list(DBMSaveState *s, BlockDriverState *bs,
         dbms->bitmap_alias = g_strdup(bitmap_alias);
         dbms->bitmap = bitmap;
         dbms->total_sectors = bdrv_nb_sectors(bs);
-        dbms->sectors_per_chunk = CHUNK_SIZE * 8LLU *
+        dbms->sectors_per_chunk =
+            (migrate_dirty_bitmaps_compress() ? ENCODED_CHUNK_SIZE :
+             CHUNK_SIZE) * 8LLU *
             (bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS);
         assert(dbms->sectors_per_chunk != 0);
         if (bdrv_dirty_bitmap_enabled(bitmap)) {
@@ -697,11 +987,94 @@ static void bulk_phase_send_chunk(QEMUFile *f, DBMSaveState *s,
     }
 }
 
+/*
+ * Called with no lock taken.  The threads prepare the next chunks of the
+ * bitmaps while the previous ones are sent.
+ */
+static void bulk_phase_encoded(QEMUFile *f, DBMSaveState *s, bool limit)
+{
+    SaveBitmapState *dbms = QSIMPLEQ_FIRST(&s->dbms_list);
+    unsigned int i, k;
+    int j;
+
+    while (true) {
+        SaveBitmapState *b;
+        uint64_t cur_sector;
+
+        while (dbms && dbms->bulk_completed) {
+            dbms = QSIMPLEQ_NEXT(dbms, entry);
+        }
+        if (!dbms) {
+            break;
+        }
+
+        /* The next chunks, from the bitmap that is being sent on */
+        s->batch_len = 0;
+        cur_sector = dbms->cur_sector;
+        for (b = dbms; b && s->batch_len < ENCODED_BATCH_CHUNKS;) {
+            DBMChunk *c;
+
+            if (b->bulk_completed) {
+                b = QSIMPLEQ_NEXT(b, entry);
+                cur_sector = b ? b->cur_sector : 0;
+                continue;
+            }
+            c = &s->batch[s->batch_len++];
+
+            memset(c, 0, sizeof(*c));
+            c->dbms = b;
+            c->start_sector = cur_sector;
+            c->nr_sectors = MIN(b->total_sectors - cur_sector,
+                                b->sectors_per_chunk);
+            cur_sector += c->nr_sectors;
+            if (cur_sector >= b->total_sectors) {
+                b = QSIMPLEQ_NEXT(b, entry);
+                cur_sector = b ? b->cur_sector : 0;
+            }
+        }
+
+        s->next_chunk = 0;
+        for (j = 0; j < s->nr_threads; j++) {
+            qemu_sem_post(&s->threads[j].sem);
+        }
+        for (j = 0; j < s->nr_threads; j++) {
+            qemu_sem_wait(&s->threads[j].done_sem);
+        }
+
+        for (i = 0; i < s->batch_len; i++) {
+            DBMChunk *c = &s->batch[i];
+
+            if (limit && qemu_file_rate_limit(f)) {
+                break;
+            }
+            send_bitmap_chunk(f, s, c);
+            c->dbms->cur_sector = c->start_sector + c->nr_sectors;
+            if (c->dbms->cur_sector >= c->dbms->total_sectors) {
+                c->dbms->bulk_completed = true;
+            }
+        }
+        for (k = 0; k < s->batch_len; k++) {
+            g_free(s->batch[k].data);
+        }
+        if (i < s->batch_len) {
+            /* The rest is prepared again next time */
+            return;
+        }
+    }
+
+    s->bulk_completed = true;
+}
+
 /* Called with no lock taken.  */
 static void bulk_phase(QEMUFile *f, DBMSaveState *s, bool limit)
 {
     SaveBitmapState *dbms;
 
+    if (s->nr_threads) {
+        bulk_phase_encoded(f, s, limit);
+        return;
+    }
+
     QSIMPLEQ_FOREACH(dbms, &s->dbms_list, entry) {
         while (!dbms->bulk_completed) {
             bulk_phase_send_chunk(f, s, dbms);
@@ -973,6 +1346,44 @@ static void dirty_bitmap_load_complete(QEMUFile *f, DBMLoadState *s)
     }
 }
 
+/* Decode the @data_size bytes at @data to the @buf_size clear bytes at @buf */
+static int dirty_bitmap_load_decode(DBMLoadState *s, uint8_t encoding,
+                                    uint8_t *data, uint64_t data_size,
+                                    uint8_t *buf, uint64_t buf_size)
+{
+    g_autofree uint8_t *rle = NULL;
+    int rle_size;
+
+    trace_dirty_bitmap_load_decode(encoding, buf_size, data_size);
+
+    switch (encoding) {
+    case DIRTY_BITMAP_MIG_ENCODING_RLE:
+        return dbm_rle_decode(data, data_size, buf, buf_size * 8);
+    case DIRTY_BITMAP_MIG_ENCODING_COMPRESSED:
+        if (!s->decomp_ops) {
+            Error *local_err = NULL;
+
+            s->decomp_ops = ram_compress_get_ops(migrate_compress_method());
+            if (s->decomp_ops->decompress_setup(&s->decomp_state,
+                                                &local_err)) {
+                error_report_err(local_err);
+                s->decomp_ops = NULL;
+                return -1;
+            }
+        }
+        /* The runs are smaller than the bits, or they would not be sent */
+        rle = g_malloc(buf_size);
+        rle_size = s->decomp_ops->decompress(s->decomp_state, rle, buf_size,
+                                             data, data_size);
+        if (rle_size <= 0) {
+            return -1;
+        }
+        return dbm_rle_decode(rle, rle_size, buf, buf_size * 8);
+    default:
+        return -1;
+    }
+}
+
 static int dirty_bitmap_load_bits(QEMUFile *f, DBMLoadState *s)
 {
     uint64_t first_byte = qemu_get_be64(f) << BDRV_SECTOR_BITS;
@@ -989,9 +1400,21 @@ static int dirty_bitmap_load_bits(QEMUFile *f, DBMLoadState *s)
     } else {
         size_t ret;
         g_autofree uint8_t *buf = NULL;
-        uint64_t buf_size = qemu_get_be64(f);
+        uint8_t encoding = DIRTY_BITMAP_MIG_ENCODING_RAW;
+        uint64_t chunk_size = CHUNK_SIZE;
+        uint64_t buf_size, data_size;
         uint64_t needed_size;
 
+        if (migrate_dirty_bitmaps_compress()) {
+            encoding = qemu_get_byte(f);
+            chunk_size = ENCODED_CHUNK_SIZE;
+        }
+        buf_size = qemu_get_be64(f);
+        data_size = buf_size;
+        if (migrate_dirty_bitmaps_compress()) {
+            data_size = qemu_get_be64(f);
+        }
+
         /*
          * The actual check for buf_size is done a bit later. We can't do it in
          * cancelled mode as we don't have the bitmap to check the constraints
@@ -1002,15 +1425,15 @@ static int dirty_bitmap_load_bits(QEMUFile *f, DBMLoadState *s)
          * the whole migration will most probably fail soon due to broken
          * stream).
          */
-        if (buf_size > 10 * CHUNK_SIZE) {
+        if (buf_size > 10 * chunk_size || data_size > buf_size) {
             error_report("Bitmap migration stream buffer allocation request "
                          "is too large");
             return -EIO;
         }
 
         buf = g_malloc(buf_size);
-        ret = qemu_get_buffer(f, buf, buf_size);
-        if (ret != buf_size) {
+        ret = qemu_get_buffer(f, buf, data_size);
+        if (ret != data_size) {
             error_report("Failed to read bitmap bits");
             return -EIO;
         }
@@ -1019,6 +1442,18 @@ static int dirty_bitmap_load_bits(QEMUFile *f, DBMLoadState *s)
             return 0;
         }
 
+        if (encoding != DIRTY_BITMAP_MIG_ENCODING_RAW) {
+            g_autofree uint8_t *data = g_steal_pointer(&buf);
+
+            buf = g_malloc0(buf_size);
+            if (dirty_bitmap_load_decode(s, encoding, data, data_size,
+                                         buf, buf_size) < 0) {
+                error_report("Failed to decode bitmap bits of '%s'",
+                             bdrv_dirty_bitmap_name(s->bitmap));
+                return -EIO;
+            }
+        }
+
         needed_size = bdrv_dirty_bitmap_serialization_size(s->bitmap,
                                                            first_byte,
                                                            nr_bytes);
@@ -1211,14 +1646,35 @@ fail:
     return ret;
 }
 
+static int dirty_bitmap_load_cleanup(void *opaque)
+{
+    DBMLoadState *s = &((DBMState *)opaque)->load;
+
+    if (s->decomp_ops) {
+        s->decomp_ops->decompress_cleanup(s->decomp_state);
+        s->decomp_ops = NULL;
+        s->decomp_state = NULL;
+    }
+    return 0;
+}
+
 static int dirty_bitmap_save_setup(QEMUFile *f, void *opaque)
 {
     DBMSaveState *s = &((DBMState *)opaque)->save;
     SaveBitmapState *dbms = NULL;
+    Error *local_err = NULL;
+
     if (init_dirty_bitmap_migration(s) < 0) {
         return -1;
     }
 
+    if (migrate_dirty_bitmaps_compress() && !s->no_bitmaps &&
+        dbm_encode_threads_setup(s, &local_err) < 0) {
+        error_report_err(local_err);
+        dirty_bitmap_do_save_cleanup(s);
+        return -1;
+    }
+
     QSIMPLEQ_FOREACH(dbms, &s->dbms_list, entry) {
         send_bitmap_start(f, s, dbms);
     }
@@ -1253,6 +1709,7 @@ static SaveVMHandlers savevm_dirty_bitmap_handlers = {
     .save_live_iterate = dirty_bitmap_save_iterate,
     .is_active_iterate = dirty_bitmap_is_active_iterate,
     .load_state = dirty_bitmap_load,
+    .load_cleanup = dirty_bitmap_load_cleanup,
     .save_cleanup = dirty_bitmap_save_cleanup,
     .is_active = dirty_bitmap_is_active,
 };
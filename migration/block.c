@@ -28,7 +28,6 @@
 #include "sysemu/block-backend.h"
 #include "trace.h"
 
-#define BLK_MIG_BLOCK_SIZE           (1 << 20)
 #define BDRV_SECTORS_PER_DIRTY_CHUNK (BLK_MIG_BLOCK_SIZE >> BDRV_SECTOR_BITS)
 
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
@@ -38,6 +37,7 @@
 
 #define MAX_IS_ALLOCATED_SEARCH (65536 * BDRV_SECTOR_SIZE)
 
+/* In blocks of BLK_MIG_BLOCK_SIZE, and in chunks for the reads in flight */
 #define MAX_IO_BUFFERS 512
 #define MAX_PARALLEL_IO 16
 
@@ -81,7 +81,7 @@ typedef struct BlkMigDevState {
 
 typedef struct BlkMigBlock {
     /* Only used by migration thread.  */
-    uint8_t *buf;
+    uint8_t *buf; /* NULL if the blocks read as zeroes */
     BlkMigDevState *bmds;
     int64_t sector;
     int nr_sectors;
@@ -98,12 +98,13 @@ typedef struct BlkMigState {
     int64_t total_sector_sum;
     bool zero_blocks;
 
-    /* Protected by lock.  */
+    /* Protected by lock.  In blocks of BLK_MIG_BLOCK_SIZE.  */
     QSIMPLEQ_HEAD(, BlkMigBlock) blk_list;
     int submitted;
     int read_done;
 
     /* Only used by migration thread.  Does not need a lock.  */
+    int chunk_blocks;
     int transferred;
     int prev_progress;
     int bulk_completed;
@@ -128,18 +129,24 @@ static void blk_mig_unlock(void)
  * or the VM will stall.
  */
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static int blk_mig_nr_blocks(BlkMigBlock *blk)
+{
+    return DIV_ROUND_UP(blk->nr_sectors, BDRV_SECTORS_PER_DIRTY_CHUNK);
+}
+
+static void blk_send_block(QEMUFile *f, BlkMigBlock *blk, int64_t sector,
+                           uint8_t *buf)
 {
     int len;
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
-    if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLK_MIG_BLOCK_SIZE)) {
+    if (!buf || (block_mig_state.zero_blocks &&
+                 buffer_is_zero(buf, BLK_MIG_BLOCK_SIZE))) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS)
                      | flags);
 
     /* device name */
@@ -155,7 +162,18 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
         return;
     }
 
-    qemu_put_buffer(f, blk->buf, BLK_MIG_BLOCK_SIZE);
+    qemu_put_buffer(f, buf, BLK_MIG_BLOCK_SIZE);
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock *blk)
+{
+    int i;
+
+    for (i = 0; i < blk_mig_nr_blocks(blk); i++) {
+        blk_send_block(f, blk,
+                       blk->sector + i * BDRV_SECTORS_PER_DIRTY_CHUNK,
+                       blk->buf ? blk->buf + i * BLK_MIG_BLOCK_SIZE : NULL);
+    }
 }
 
 int blk_mig_active(void)
@@ -259,8 +277,8 @@ static void blk_mig_read_cb(void *opaque, int ret)
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
 
-    block_mig_state.submitted--;
-    block_mig_state.read_done++;
+    block_mig_state.submitted -= blk_mig_nr_blocks(blk);
+    block_mig_state.read_done += blk_mig_nr_blocks(blk);
     assert(block_mig_state.submitted >= 0);
     blk_mig_unlock();
 }
@@ -275,6 +293,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     BlkMigBlock *blk;
     int nr_sectors;
     int64_t count;
+    int ret;
 
     if (bmds->shared_base) {
         qemu_mutex_lock_iothread();
@@ -302,23 +321,67 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    /* we are going to transfer full blocks even if they are not allocated */
+    nr_sectors = block_mig_state.chunk_blocks * BDRV_SECTORS_PER_DIRTY_CHUNK;
 
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+    if (total_sectors - cur_sector < nr_sectors) {
         nr_sectors = total_sectors - cur_sector;
     }
 
     blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLK_MIG_BLOCK_SIZE);
     blk->bmds = bmds;
     blk->sector = cur_sector;
+
+    /*
+     * Blocks that read as zeroes are sent as such without reading them.
+     * The dirty bitmap is reset under the same locks as the request, so
+     * a write that comes after the check marks the block dirty again.
+     */
+    if (block_mig_state.zero_blocks) {
+        qemu_mutex_lock_iothread();
+        aio_context_acquire(blk_get_aio_context(bb));
+        ret = bdrv_block_status_above(blk_bs(bb), NULL,
+                                      cur_sector * BDRV_SECTOR_SIZE,
+                                      nr_sectors * BDRV_SECTOR_SIZE,
+                                      &count, NULL, NULL);
+        count >>= BDRV_SECTOR_BITS;
+        if (ret >= 0 && (ret & BDRV_BLOCK_ZERO) &&
+            (count >= BDRV_SECTORS_PER_DIRTY_CHUNK ||
+             cur_sector + count == total_sectors)) {
+            if (cur_sector + count < total_sectors) {
+                count &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+            }
+            bdrv_reset_dirty_bitmap(bmds->dirty_bitmap,
+                                    cur_sector * BDRV_SECTOR_SIZE,
+                                    count * BDRV_SECTOR_SIZE);
+            aio_context_release(blk_get_aio_context(bb));
+            qemu_mutex_unlock_iothread();
+
+            blk->buf = NULL;
+            blk->nr_sectors = count;
+            blk->ret = 0;
+            trace_migration_block_zero_chunk(bmds->blk_name, cur_sector,
+                                             count);
+
+            blk_mig_lock();
+            QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+            block_mig_state.read_done += blk_mig_nr_blocks(blk);
+            blk_mig_unlock();
+
+            bmds->cur_sector = cur_sector + count;
+            return (bmds->cur_sector >= total_sectors);
+        }
+        aio_context_release(blk_get_aio_context(bb));
+        qemu_mutex_unlock_iothread();
+    }
+
     blk->nr_sectors = nr_sectors;
+    blk->buf = g_malloc(blk_mig_nr_blocks(blk) * BLK_MIG_BLOCK_SIZE);
 
     qemu_iovec_init_buf(&blk->qiov, blk->buf, nr_sectors * BDRV_SECTOR_SIZE);
 
     blk_mig_lock();
-    block_mig_state.submitted++;
+    block_mig_state.submitted += blk_mig_nr_blocks(blk);
     blk_mig_unlock();
 
     /* We do not know if bs is under the main thread (and thus does
@@ -401,6 +464,8 @@ static int init_blk_migration(QEMUFile *f)
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.chunk_blocks = migrate_block_chunk_size() /
+                                   BLK_MIG_BLOCK_SIZE;
 
     for (bs = bdrv_first(&it); bs; bs = bdrv_next(&it)) {
         num_bs++;
@@ -477,18 +542,17 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
     int progress;
     int ret = 0;
 
+    /* One chunk of each device, so that they are all read at once */
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
+            } else {
+                ret = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -647,12 +711,12 @@ static int flush_blks(QEMUFile *f)
         blk_send(f, blk);
         blk_mig_lock();
 
+        block_mig_state.read_done -= blk_mig_nr_blocks(blk);
+        block_mig_state.transferred += blk_mig_nr_blocks(blk);
+        assert(block_mig_state.read_done >= 0);
+
         g_free(blk->buf);
         g_free(blk);
-
-        block_mig_state.read_done--;
-        block_mig_state.transferred++;
-        assert(block_mig_state.read_done >= 0);
     }
     blk_mig_unlock();
 
@@ -772,8 +836,9 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     /* control the rate of transfer */
     blk_mig_lock();
     while (block_mig_state.read_done * BLK_MIG_BLOCK_SIZE <
-           qemu_file_get_rate_limit(f) &&
-           block_mig_state.submitted < MAX_PARALLEL_IO &&
+           qemu_file_get_rate_burst(f) &&
+           block_mig_state.submitted <
+           MAX_PARALLEL_IO * block_mig_state.chunk_blocks &&
            (block_mig_state.submitted + block_mig_state.read_done) <
            MAX_IO_BUFFERS) {
         blk_mig_unlock();
@@ -14,6 +14,9 @@
 #ifndef MIGRATION_BLOCK_H
 #define MIGRATION_BLOCK_H
 
+/* Unit of the dirty tracking and of the migration stream */
+#define BLK_MIG_BLOCK_SIZE           (1 << 20)
+
 #ifdef CONFIG_LIVE_BLOCK_MIGRATION
 int blk_mig_active(void);
 int blk_mig_bulk_active(void);
@@ -15,10 +15,14 @@
 #include "tls.h"
 #include "migration.h"
 #include "qemu-file-channel.h"
+#include "qemu-file.h"
 #include "trace.h"
 #include "qapi/error.h"
 #include "io/channel-tls.h"
 #include "io/channel-socket.h"
+#ifdef CONFIG_ZSTD
+#include "io/channel-zstd.h"
+#endif
 #include "qemu/yank.h"
 #include "yank_functions.h"
 
@@ -94,6 +98,8 @@ void migration_channel_connect(MigrationState *s,
         } else {
             QEMUFile *f = qemu_fopen_channel_output(ioc);
 
+            qemu_file_set_buffer_size(f, migrate_stream_buffer_size(),
+                                      migrate_stream_iov_max());
             if (object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_SOCKET) ||
                 object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TLS)) {
                 yank_register_function(MIGRATION_YANK_INSTANCE,
@@ -110,3 +116,63 @@ void migration_channel_connect(MigrationState *s,
     g_free(s->hostname);
     error_free(error);
 }
+
+
+/**
+ * @migration_channel_compress - Compress an outgoing migration stream
+ *
+ * With stream-compress, wraps @ioc in a channel that compresses what
+ * is written to it.  The returned channel takes over the reference to
+ * @ioc, or NULL is returned on error and @ioc is released.
+ *
+ * @ioc: Channel to which the stream goes
+ * @errp: Pointer to a NULL-initialized error object
+ */
+QIOChannel *migration_channel_compress(QIOChannel *ioc, Error **errp)
+{
+#ifdef CONFIG_ZSTD
+    QIOChannelZstd *zioc;
+
+    if (!migrate_stream_compress()) {
+        return ioc;
+    }
+
+    zioc = qio_channel_zstd_new_client(ioc, migrate_compress_level(),
+                                       migrate_compress_threads(), errp);
+    if (zioc) {
+        qio_channel_set_name(QIO_CHANNEL(zioc), ioc->name);
+    }
+    object_unref(OBJECT(ioc));
+    return zioc ? QIO_CHANNEL(zioc) : NULL;
+#else
+    return ioc;
+#endif
+}
+
+/**
+ * @migration_channel_decompress - Decompress an incoming migration stream
+ *
+ * Wraps @ioc in a channel that decompresses the stream if it is zstd,
+ * and passes it through otherwise.  The returned channel takes over the
+ * reference to @ioc.  The pages of fixed-ram and multifd are read at
+ * their offsets in the file, so their streams are left alone.
+ *
+ * @ioc: Channel from which the stream comes
+ */
+QIOChannel *migration_channel_decompress(QIOChannel *ioc)
+{
+#ifdef CONFIG_ZSTD
+    QIOChannelZstd *zioc;
+
+    if (migrate_fixed_ram() || migrate_use_multifd()) {
+        return ioc;
+    }
+
+    zioc = qio_channel_zstd_new_server(ioc, NULL);
+    qio_channel_set_name(QIO_CHANNEL(zioc), ioc->name);
+    object_unref(OBJECT(ioc));
+    return QIO_CHANNEL(zioc);
+#else
+    return ioc;
+#endif
+}
@@ -24,4 +24,7 @@ void migration_channel_connect(MigrationState *s,
                                QIOChannel *ioc,
                                const char *hostname,
                                Error *error_in);
+
+QIOChannel *migration_channel_compress(QIOChannel *ioc, Error **errp);
+QIOChannel *migration_channel_decompress(QIOChannel *ioc);
 #endif
@@ -47,6 +47,26 @@ static COLOMode last_colo_mode;
 
 #define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
 
+/* Shortest delay between two periodic checkpoints with x-checkpoint-budget */
+#define COLO_CHECKPOINT_MIN_DELAY 100
+
+/*
+ * With x-checkpoint-budget, the periodic checkpoints are spaced so they
+ * send about that many bytes.  Every checkpoint measures how fast the
+ * Primary dirtied memory since the previous one, whether it came from
+ * the timer or from colo-compare, and the delay moves half way to the
+ * one that would have sent the budget.
+ */
+static struct {
+    /* delay of the timer in ms, 0 until the first checkpoint */
+    uint32_t delay;
+    /* start of the previous checkpoint */
+    int64_t last_time;
+    /* checkpoints that colo-compare requested, of all checkpoints */
+    unsigned int compare_requests;
+    unsigned int checkpoints;
+} colo_adaptive;
+
 bool migration_in_colo_state(void)
 {
     MigrationState *s = migrate_get_current();
@@ -398,10 +418,54 @@ static uint64_t colo_receive_message_value(QEMUFile *f, uint32_t expect_msg,
     return value;
 }
 
+/* Delay of the timer of periodic checkpoints, in ms */
+static uint32_t colo_checkpoint_delay(MigrationState *s)
+{
+    uint32_t delay = qatomic_read(&colo_adaptive.delay);
+
+    if (!s->parameters.x_checkpoint_budget || !delay) {
+        return s->parameters.x_checkpoint_delay;
+    }
+    return MIN(delay, s->parameters.x_checkpoint_delay);
+}
+
+/* Adapt the delay after a checkpoint that sent @bytes */
+static void colo_update_checkpoint_delay(MigrationState *s, uint64_t bytes)
+{
+    uint64_t budget = s->parameters.x_checkpoint_budget;
+    uint32_t max_delay = s->parameters.x_checkpoint_delay;
+    int64_t now = s->colo_checkpoint_time;
+    int64_t elapsed = now - colo_adaptive.last_time;
+    uint64_t target;
+    uint32_t delay;
+
+    colo_adaptive.checkpoints++;
+    if (!budget || !colo_adaptive.last_time || elapsed <= 0) {
+        colo_adaptive.last_time = now;
+        return;
+    }
+    colo_adaptive.last_time = now;
+
+    /* Time the Primary would take to dirty the budget at that rate */
+    target = bytes ? budget * elapsed / bytes : max_delay;
+    target = MIN(MAX(target, COLO_CHECKPOINT_MIN_DELAY), max_delay);
+
+    delay = qatomic_read(&colo_adaptive.delay);
+    delay = delay ? (delay + target) / 2 : target;
+    qatomic_set(&colo_adaptive.delay, delay);
+    trace_colo_update_checkpoint_delay(bytes, elapsed, delay,
+        qatomic_read(&colo_adaptive.compare_requests),
+        colo_adaptive.checkpoints);
+
+    /* The timer was armed with the previous delay */
+    timer_mod(s->colo_delay_timer, now + colo_checkpoint_delay(s));
+}
+
 static int colo_do_checkpoint_transaction(MigrationState *s,
                                           QIOChannelBuffer *bioc,
                                           QEMUFile *fb)
 {
+    uint64_t ram_start = stat64_get(&ram_atomic_counters.transferred);
     Error *local_err = NULL;
     int ret = -1;
 
@@ -510,6 +574,9 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("stop", "run");
 
+    colo_update_checkpoint_delay(s, bioc->usage - ram_start +
+                                 stat64_get(&ram_atomic_counters.transferred));
+
 out:
     if (local_err) {
         error_report_err(local_err);
@@ -519,6 +586,7 @@ out:
 
 static void colo_compare_notify_checkpoint(Notifier *notifier, void *data)
 {
+    qatomic_inc(&colo_adaptive.compare_requests);
     colo_checkpoint_notify(data);
 }
 
@@ -575,6 +643,7 @@ static void colo_process_checkpoint(MigrationState *s)
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("stop", "run");
 
+    memset(&colo_adaptive, 0, sizeof(colo_adaptive));
     timer_mod(s->colo_delay_timer,
             current_time + s->parameters.x_checkpoint_delay);
 
@@ -650,8 +719,7 @@ void colo_checkpoint_notify(void *opaque)
 
     qemu_event_set(&s->colo_checkpoint_event);
     s->colo_checkpoint_time = qemu_clock_get_ms(QEMU_CLOCK_HOST);
-    next_notify_time = s->colo_checkpoint_time +
-                    s->parameters.x_checkpoint_delay;
+    next_notify_time = s->colo_checkpoint_time + colo_checkpoint_delay(s);
     timer_mod(s->colo_delay_timer, next_notify_time);
 }
 
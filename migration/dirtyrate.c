@@ -15,7 +15,11 @@
 #include "qapi/error.h"
 #include "cpu.h"
 #include "exec/ramblock.h"
+#include "exec/ram_addr.h"
+#include "exec/memory.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/main-loop.h"
+#include "sysemu/kvm.h"
 #include "qapi/qapi-commands-migration.h"
 #include "ram.h"
 #include "trace.h"
@@ -26,6 +30,8 @@
 
 static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
 static struct DirtyRateStat DirtyStat;
+static DirtyRateMeasureMode dirtyrate_mode =
+                DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
 
 static int64_t set_sample_page_period(int64_t msec, int64_t initial_time)
 {
@@ -76,45 +82,85 @@ static struct DirtyRateInfo *query_dirty_rate_info(void)
     if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED) {
         info->has_dirty_rate = true;
         info->dirty_rate = dirty_rate;
+
+        if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+            DirtyRateVcpuList *head = NULL, **tail = &head;
+            int i;
+
+            for (i = 0; i < DirtyStat.dirty_ring.nvcpu; i++) {
+                DirtyRateVcpu *rate = g_new0(DirtyRateVcpu, 1);
+
+                rate->id = DirtyStat.dirty_ring.rates[i].id;
+                rate->dirty_rate = DirtyStat.dirty_ring.rates[i].dirty_rate;
+                QAPI_LIST_APPEND(tail, rate);
+            }
+            info->has_vcpu_dirty_rate = true;
+            info->vcpu_dirty_rate = head;
+        }
     }
 
     info->status = CalculatingState;
     info->start_time = DirtyStat.start_time;
     info->calc_time = DirtyStat.calc_time;
     info->sample_pages = DirtyStat.sample_pages;
+    info->mode = dirtyrate_mode;
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
 
     return info;
 }
 
-static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time,
-                                uint64_t sample_pages)
+static void init_dirtyrate_stat(int64_t start_time,
+                                struct DirtyRateConfig config)
 {
-    DirtyStat.total_dirty_samples = 0;
-    DirtyStat.total_sample_count = 0;
-    DirtyStat.total_block_mem_MB = 0;
     DirtyStat.dirty_rate = -1;
     DirtyStat.start_time = start_time;
-    DirtyStat.calc_time = calc_time;
-    DirtyStat.sample_pages = sample_pages;
+    DirtyStat.calc_time = config.sample_period_seconds;
+    DirtyStat.sample_pages = config.sample_pages_per_gigabytes;
+
+    switch (config.mode) {
+    case DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING:
+        DirtyStat.page_sampling.total_dirty_samples = 0;
+        DirtyStat.page_sampling.total_sample_count = 0;
+        DirtyStat.page_sampling.total_block_mem_MB = 0;
+        break;
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_RING:
+        DirtyStat.dirty_ring.nvcpu = -1;
+        DirtyStat.dirty_ring.rates = NULL;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Free what the previous measure left in DirtyStat; must be called
+ * before dirtyrate_mode is changed.
+ */
+static void cleanup_dirtyrate_stat(void)
+{
+    if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+        g_free(DirtyStat.dirty_ring.rates);
+        DirtyStat.dirty_ring.rates = NULL;
+        DirtyStat.dirty_ring.nvcpu = -1;
+    }
 }
 
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
 {
-    DirtyStat.total_dirty_samples += info->sample_dirty_count;
-    DirtyStat.total_sample_count += info->sample_pages_count;
+    DirtyStat.page_sampling.total_dirty_samples += info->sample_dirty_count;
+    DirtyStat.page_sampling.total_sample_count += info->sample_pages_count;
     /* size of total pages in MB */
-    DirtyStat.total_block_mem_MB += (info->ramblock_pages *
-                                     TARGET_PAGE_SIZE) >> 20;
+    DirtyStat.page_sampling.total_block_mem_MB += (info->ramblock_pages *
+                                                   TARGET_PAGE_SIZE) >> 20;
 }
 
 static void update_dirtyrate(uint64_t msec)
 {
     uint64_t dirtyrate;
-    uint64_t total_dirty_samples = DirtyStat.total_dirty_samples;
-    uint64_t total_sample_count = DirtyStat.total_sample_count;
-    uint64_t total_block_mem_MB = DirtyStat.total_block_mem_MB;
+    uint64_t total_dirty_samples = DirtyStat.page_sampling.total_dirty_samples;
+    uint64_t total_sample_count = DirtyStat.page_sampling.total_sample_count;
+    uint64_t total_block_mem_MB = DirtyStat.page_sampling.total_block_mem_MB;
 
     dirtyrate = total_dirty_samples * total_block_mem_MB *
                 1000 / (total_sample_count * msec);
@@ -327,21 +373,168 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
         update_dirtyrate_stat(block_dinfo);
     }
 
-    if (DirtyStat.total_sample_count == 0) {
+    if (DirtyStat.page_sampling.total_sample_count == 0) {
         return false;
     }
 
     return true;
 }
 
-static void calculate_dirtyrate(struct DirtyRateConfig config)
+/*
+ * Size of the pages dirtied in @dirty_pages over @msec, in MB/s.
+ */
+static int64_t do_calculate_dirtyrate(DirtyPageRecord dirty_pages,
+                                      int64_t msec)
+{
+    uint64_t increased_dirty_pages =
+        dirty_pages.end_pages - dirty_pages.start_pages;
+
+    return (increased_dirty_pages * TARGET_PAGE_SIZE * 1000 / msec) >> 20;
+}
+
+/*
+ * Clear the dirty log of the accelerator for all of RAM, so that pages
+ * are write protected again; with KVM_DIRTY_LOG_INITIALLY_SET they are
+ * not until the log is cleared for the first time.
+ */
+static void dirtyrate_manual_reset_protect(void)
+{
+    RAMBlock *block = NULL;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            memory_region_clear_dirty_bitmap(block->mr, 0,
+                                             block->used_length);
+        }
+    }
+}
+
+static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
+{
+    DirtyPageRecord dirty_pages;
+    int64_t msec = 0;
+    int64_t start_time;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+
+    /*
+     * The first sync may report all pages dirty with
+     * KVM_DIRTY_LOG_INITIALLY_SET, so start counting after it.
+     */
+    memory_global_dirty_log_sync();
+    dirtyrate_manual_reset_protect();
+    dirty_pages.start_pages = total_dirty_pages;
+    qemu_mutex_unlock_iothread();
+
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    DirtyStat.start_time = start_time / 1000;
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, start_time);
+    DirtyStat.calc_time = msec / 1000;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    dirty_pages.end_pages = total_dirty_pages;
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+    qemu_mutex_unlock_iothread();
+
+    DirtyStat.dirty_rate = do_calculate_dirtyrate(dirty_pages, msec);
+    trace_dirtyrate_calculate(DirtyStat.dirty_rate);
+}
+
+int64_t vcpu_calculate_dirtyrate(int64_t calc_time_ms, VcpuStat *stat,
+                                 unsigned int flag, bool one_shot)
+{
+    DirtyPageRecord *dirty_pages;
+    CPUState *cpu;
+    int64_t msec;
+    int64_t start_time;
+    int nvcpu = 0;
+    int i;
+
+    qemu_mutex_lock_iothread();
+    CPU_FOREACH(cpu) {
+        nvcpu++;
+    }
+    dirty_pages = g_new0(DirtyPageRecord, nvcpu);
+    stat->rates = g_new0(DirtyRateVcpu, nvcpu);
+
+    if (one_shot) {
+        memory_global_dirty_log_start(flag);
+        /* don't account what the rings already hold to this period */
+        memory_global_dirty_log_sync();
+    }
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        stat->rates[i].id = cpu->cpu_index;
+        dirty_pages[i].start_pages = cpu->dirty_pages;
+        dirty_pages[i].end_pages = cpu->dirty_pages;
+        i++;
+    }
+    qemu_mutex_unlock_iothread();
+
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    msec = set_sample_page_period(calc_time_ms, start_time);
+
+    qemu_mutex_lock_iothread();
+    /* reap the rings for the last time */
+    memory_global_dirty_log_sync();
+    CPU_FOREACH(cpu) {
+        /* the vcpus may have been hot (un)plugged in the meanwhile */
+        for (i = 0; i < nvcpu; i++) {
+            if (stat->rates[i].id == cpu->cpu_index) {
+                dirty_pages[i].end_pages = cpu->dirty_pages;
+                break;
+            }
+        }
+    }
+    if (one_shot) {
+        memory_global_dirty_log_stop(flag);
+    }
+    qemu_mutex_unlock_iothread();
+
+    for (i = 0; i < nvcpu; i++) {
+        stat->rates[i].dirty_rate = do_calculate_dirtyrate(dirty_pages[i],
+                                                           msec);
+        trace_dirtyrate_do_calculate_vcpu(stat->rates[i].id,
+                                          stat->rates[i].dirty_rate);
+    }
+    stat->nvcpu = nvcpu;
+    g_free(dirty_pages);
+
+    return msec;
+}
+
+static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config)
+{
+    VcpuStat *stat = &DirtyStat.dirty_ring;
+    int64_t msec;
+    int64_t dirtyrate_sum = 0;
+    int i;
+
+    DirtyStat.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    msec = vcpu_calculate_dirtyrate(config.sample_period_seconds * 1000,
+                                    stat, GLOBAL_DIRTY_DIRTY_RATE, true);
+    DirtyStat.calc_time = msec / 1000;
+
+    for (i = 0; i < stat->nvcpu; i++) {
+        dirtyrate_sum += stat->rates[i].dirty_rate;
+    }
+
+    DirtyStat.dirty_rate = dirtyrate_sum;
+    trace_dirtyrate_calculate(DirtyStat.dirty_rate);
+}
+
+static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
 {
     struct RamblockDirtyInfo *block_dinfo = NULL;
     int block_count = 0;
     int64_t msec = 0;
     int64_t initial_time;
 
-    rcu_register_thread();
     rcu_read_lock();
     initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     if (!record_ramblock_hash_info(&block_dinfo, config, &block_count)) {
@@ -364,7 +557,21 @@ static void calculate_dirtyrate(struct DirtyRateConfig config)
 out:
     rcu_read_unlock();
     free_ramblock_dirty_info(block_dinfo, block_count);
-    rcu_unregister_thread();
+}
+
+static void calculate_dirtyrate(struct DirtyRateConfig config)
+{
+    switch (config.mode) {
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP:
+        calculate_dirtyrate_dirty_bitmap(config);
+        break;
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_RING:
+        calculate_dirtyrate_dirty_ring(config);
+        break;
+    default:
+        calculate_dirtyrate_sample_vm(config);
+        break;
+    }
 }
 
 void *get_dirtyrate_thread(void *arg)
@@ -372,20 +579,19 @@ void *get_dirtyrate_thread(void *arg)
     struct DirtyRateConfig config = *(struct DirtyRateConfig *)arg;
     int ret;
     int64_t start_time;
-    int64_t calc_time;
-    uint64_t sample_pages;
+
+    rcu_register_thread();
 
     ret = dirtyrate_set_state(&CalculatingState, DIRTY_RATE_STATUS_UNSTARTED,
                               DIRTY_RATE_STATUS_MEASURING);
     if (ret == -1) {
         error_report("change dirtyrate state failed.");
+        rcu_unregister_thread();
         return NULL;
     }
 
     start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
-    calc_time = config.sample_period_seconds;
-    sample_pages = config.sample_pages_per_gigabytes;
-    init_dirtyrate_stat(start_time, calc_time, sample_pages);
+    init_dirtyrate_stat(start_time, config);
 
     calculate_dirtyrate(config);
 
@@ -394,16 +600,23 @@ void *get_dirtyrate_thread(void *arg)
     if (ret == -1) {
         error_report("change dirtyrate state failed.");
     }
+
+    rcu_unregister_thread();
     return NULL;
 }
 
 void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
-                         int64_t sample_pages, Error **errp)
+                         int64_t sample_pages, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
 {
     static struct DirtyRateConfig config;
     QemuThread thread;
     int ret;
 
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
     /*
      * If the dirty rate is already being measured, don't attempt to start.
      */
@@ -420,6 +633,11 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
     }
 
     if (has_sample_pages) {
+        if (mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+            error_setg(errp, "sample-pages is only valid in page-sampling "
+                       "mode.");
+            return;
+        }
         if (!is_sample_pages_valid(sample_pages)) {
             error_setg(errp, "sample-pages is out of range[%d, %d].",
                             MIN_SAMPLE_PAGE_COUNT,
@@ -430,6 +648,19 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
     }
 
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING &&
+        !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "dirty-ring mode needs the KVM dirty ring, use "
+                   "another mode instead.");
+        return;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP && !kvm_enabled()) {
+        error_setg(errp, "dirty-bitmap mode needs the KVM dirty log, use "
+                   "another mode instead.");
+        return;
+    }
+
     /*
      * Init calculation state as unstarted.
      */
@@ -440,8 +671,12 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         return;
     }
 
+    cleanup_dirtyrate_stat();
+    dirtyrate_mode = mode;
+
     config.sample_period_seconds = calc_time;
     config.sample_pages_per_gigabytes = sample_pages;
+    config.mode = mode;
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
 }
@@ -459,17 +694,30 @@ void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
                    DirtyRateStatus_str(info->status));
     monitor_printf(mon, "Start Time: %"PRIi64" (ms)\n",
                    info->start_time);
-    monitor_printf(mon, "Sample Pages: %"PRIu64" (per GB)\n",
-                   info->sample_pages);
+    monitor_printf(mon, "Mode: %s\n",
+                   DirtyRateMeasureMode_str(info->mode));
+    if (info->mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        monitor_printf(mon, "Sample Pages: %"PRIu64" (per GB)\n",
+                       info->sample_pages);
+    }
     monitor_printf(mon, "Period: %"PRIi64" (sec)\n",
                    info->calc_time);
     monitor_printf(mon, "Dirty rate: ");
     if (info->has_dirty_rate) {
         monitor_printf(mon, "%"PRIi64" (MB/s)\n", info->dirty_rate);
+        if (info->has_vcpu_dirty_rate) {
+            DirtyRateVcpuList *rate;
+
+            for (rate = info->vcpu_dirty_rate; rate; rate = rate->next) {
+                monitor_printf(mon, "vcpu[%"PRIi64"], Dirty rate: %"PRIi64
+                               " (MB/s)\n", rate->value->id,
+                               rate->value->dirty_rate);
+            }
+        }
     } else {
         monitor_printf(mon, "(not ready)\n");
     }
-    g_free(info);
+    qapi_free_DirtyRateInfo(info);
 }
 
 void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
@@ -477,6 +725,9 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
     int64_t sec = qdict_get_try_int(qdict, "second", 0);
     int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages_per_GB", -1);
     bool has_sample_pages = (sample_pages != -1);
+    bool dirty_ring = qdict_get_try_bool(qdict, "dirty_ring", false);
+    bool dirty_bitmap = qdict_get_try_bool(qdict, "dirty_bitmap", false);
+    DirtyRateMeasureMode mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
     Error *err = NULL;
 
     if (!sec) {
@@ -484,7 +735,20 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, &err);
+    if (dirty_ring && dirty_bitmap) {
+        monitor_printf(mon, "Either dirty ring or dirty bitmap "
+                       "can be specified!\n");
+        return;
+    }
+
+    if (dirty_bitmap) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP;
+    } else if (dirty_ring) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_RING;
+    }
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, true, mode,
+                        &err);
     if (err) {
         hmp_handle_error(mon, err);
         return;
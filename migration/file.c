@@ -0,0 +1,158 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+/* The file of the outgoing migration, for its multifd channels */
+static char *outgoing_filename;
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+    QIOChannel *ioc;
+
+    trace_migration_file_outgoing(filename);
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(outgoing_filename);
+    outgoing_filename = g_strdup(filename);
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    ioc = migration_channel_compress(QIO_CHANNEL(fioc), errp);
+    if (!ioc) {
+        return;
+    }
+    migration_channel_connect(s, ioc, NULL, NULL);
+    object_unref(OBJECT(ioc));
+}
+
+QIOChannel *file_send_channel_create(Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    if (!outgoing_filename) {
+        error_setg(errp, "multifd channels on a file need a file: URI");
+        return NULL;
+    }
+
+    fioc = qio_channel_file_new_path(outgoing_filename, O_WRONLY, 0, errp);
+    if (!fioc) {
+        return NULL;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "multifd-file-outgoing");
+    return QIO_CHANNEL(fioc);
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    ioc = migration_channel_decompress(ioc);
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(filename);
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(fioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
+
+int file_pwrite_all(QIOChannel *ioc, const void *buf, size_t len,
+                    off_t offset, Error **errp)
+{
+    int fd = QIO_CHANNEL_FILE(ioc)->fd;
+
+    while (len) {
+        ssize_t ret = pwrite(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno, "Unable to write to file");
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+int file_pread_all(QIOChannel *ioc, void *buf, size_t len,
+                   off_t offset, Error **errp)
+{
+    int fd = QIO_CHANNEL_FILE(ioc)->fd;
+
+    while (len) {
+        ssize_t ret = pread(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno, "Unable to read from file");
+            return -1;
+        }
+        if (ret == 0) {
+            error_setg(errp, "Unexpected end of file at offset %" PRId64,
+                       (int64_t)offset);
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+int file_mmap_private(QIOChannel *ioc, void *host, size_t len,
+                      off_t offset, Error **errp)
+{
+#ifndef _WIN32
+    int fd = QIO_CHANNEL_FILE(ioc)->fd;
+    void *ptr;
+
+    ptr = mmap(host, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+               fd, offset);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Unable to map the file");
+        return -1;
+    }
+    return 0;
+#else
+    error_setg(errp, "Mapping the migration file is not supported");
+    return -1;
+#endif
+}
@@ -0,0 +1,41 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_FILE_H
+#define QEMU_MIGRATION_FILE_H
+
+#include "io/channel.h"
+
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp);
+
+/*
+ * Open another channel on the file of the outgoing migration, for a
+ * multifd channel that writes its pages in place with fixed-ram.
+ */
+QIOChannel *file_send_channel_create(Error **errp);
+
+/*
+ * Write or read @len bytes at @offset of the file of @ioc, without
+ * moving its position.  Returns 0 or -1 with @errp set.
+ */
+int file_pwrite_all(QIOChannel *ioc, const void *buf, size_t len,
+                    off_t offset, Error **errp);
+int file_pread_all(QIOChannel *ioc, void *buf, size_t len,
+                   off_t offset, Error **errp);
+
+/*
+ * Map @len bytes at @offset of the file of @ioc copy-on-write at @host,
+ * replacing the memory that is there.  Returns 0 or -1 with @errp set.
+ */
+int file_mmap_private(QIOChannel *ioc, void *host, size_t len,
+                      off_t offset, Error **errp);
+#endif
@@ -16,14 +16,19 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
+#include "sysemu/kvm.h"
 #include "rdma.h"
 #include "ram.h"
 #include "migration/global_state.h"
@@ -46,6 +51,7 @@
 #include "block.h"
 #include "postcopy-ram.h"
 #include "qemu/thread.h"
+#include "qemu/thread-context.h"
 #include "trace.h"
 #include "exec/target_page.h"
 #include "io/channel-buffer.h"
@@ -59,13 +65,16 @@
 #include "multifd.h"
 #include "qemu/yank.h"
 #include "sysemu/cpus.h"
+#include "sysemu/numa.h"
 
 #define MAX_THROTTLE  (128 << 20)      /* Migration transfer speed throttling */
 
 /* Amount of time to allocate to each "chunk" of bandwidth-throttled
  * data. */
 #define BUFFER_DELAY     100
-#define XFER_LIMIT_RATIO (1000 / BUFFER_DELAY)
+
+/* Default burst of the rate limit, in ms of max-bandwidth */
+#define DEFAULT_MIGRATE_RATE_BURST_MS 10
 
 /* Time in milliseconds we are allowed to stop the source,
  * for sending the last part */
@@ -94,11 +103,45 @@
 /* The delay time (in ms) between two COLO checkpoints */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_PACKET_SIZE MULTIFD_PACKET_SIZE
 #define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
 /* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+#define DEFAULT_MIGRATE_MULTIFD_ZSTD_DICT_PAGES 0
+/* 1: best speed, ... 9: best compress ratio */
+#define DEFAULT_MIGRATE_MULTIFD_QATZIP_LEVEL 1
+/* Don't bind the XBZRLE caches to any NUMA node */
+#define DEFAULT_MIGRATE_XBZRLE_CACHE_NUMA_NODE -1
+/* Dirty page rate limit of each vCPU with dirty-limit, in MB/s */
+#define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT 1
+/* Only the migration thread synchronizes the dirty bitmap */
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 1
+#define DEFAULT_MIGRATE_COLO_FLUSH_THREADS 1
+/* Don't send any pages ahead of a postcopy request */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW 0
+/* Place each postcopy page on its own */
+#define DEFAULT_MIGRATE_POSTCOPY_PLACE_BATCH 1
+/* The incoming thread writes the pages into guest RAM itself */
+#define DEFAULT_MIGRATE_LOAD_THREADS 0
+#define DEFAULT_MIGRATE_COMPRESS_METHOD COMPRESS_METHOD_ZLIB
+/* Buffer of the main migration stream: 32 KiB and 64 iovecs */
+#define DEFAULT_MIGRATE_STREAM_BUFFER_SIZE (32 * 1024)
+#define MIN_MIGRATE_STREAM_BUFFER_SIZE (4 * 1024)
+#define MAX_MIGRATE_STREAM_BUFFER_SIZE (64 * 1024 * 1024)
+#define DEFAULT_MIGRATE_STREAM_IOV_MAX 64
+#define DEFAULT_MIGRATE_BLOCK_CHUNK_SIZE BLK_MIG_BLOCK_SIZE
+#define MAX_MIGRATE_BLOCK_CHUNK_SIZE (64 * BLK_MIG_BLOCK_SIZE)
+/* The migration thread saves and loads all the devices itself */
+#define DEFAULT_MIGRATE_DEVICE_STATE_THREADS 0
+/* The guest RAM of the destination is populated as the pages arrive */
+#define DEFAULT_MIGRATE_PREPOPULATE_THREADS 0
+#define DEFAULT_MIGRATE_POSTCOPY_AUTO_TIME 30000
+#define DEFAULT_MIGRATE_POSTCOPY_AUTO_ITERATIONS 5
+
+/* Weight of the last 100 ms in the average bandwidth of the downtime model */
+#define MIGRATION_BANDWIDTH_AVG_WEIGHT 0.25
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -127,10 +170,20 @@ enum mig_rp_message_type {
     MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
     MIG_RP_MSG_RECV_BITMAP,  /* send recved_bitmap back to source */
     MIG_RP_MSG_RESUME_ACK,   /* tell source that we are ready to resume */
+    MIG_RP_MSG_DEDUP_MISS,   /* data (start: be64, id: string) */
+    MIG_RP_MSG_RECV_LOAD,    /* data (nr: byte, nr * RP_RECV_LOAD_LEN) */
 
     MIG_RP_MSG_MAX
 };
 
+/*
+ * Load of a multifd channel in a RECV_LOAD message: id (1B), queued
+ * bytes (be32), rate in KiB/s (be32) and busy percentage (1B)
+ */
+#define RP_RECV_LOAD_LEN 10
+/* The source ignores the RECV_LOAD messages older than this, in ms */
+#define RECV_LOAD_TIMEOUT (10 * MULTIFD_RECV_LOAD_INTERVAL)
+
 /* Migration capabilities set */
 struct MigrateCapsSet {
     int size;                       /* Capability set size */
@@ -156,7 +209,9 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_MULTIFD,
     MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
     MIGRATION_CAPABILITY_AUTO_CONVERGE,
+    MIGRATION_CAPABILITY_DIRTY_LIMIT,
     MIGRATION_CAPABILITY_RELEASE_RAM,
+    MIGRATION_CAPABILITY_RELEASE_RAM_PRECOPY,
     MIGRATION_CAPABILITY_RDMA_PIN_ALL,
     MIGRATION_CAPABILITY_COMPRESS,
     MIGRATION_CAPABILITY_XBZRLE,
@@ -178,7 +233,8 @@ static int migration_maybe_pause(MigrationState *s,
                                  int new_state);
 static void migrate_fd_cancel(MigrationState *s);
 
-static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
+static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp,
+                                  gpointer opaque)
 {
     uintptr_t a = (uintptr_t) ap, b = (uintptr_t) bp;
 
@@ -204,10 +260,13 @@ void migration_object_init(void)
         g_array_new(FALSE, TRUE, sizeof(struct PostCopyFD));
     qemu_mutex_init(&current_incoming->rp_mutex);
     qemu_event_init(&current_incoming->main_thread_load_event, false);
+    qemu_event_init(&current_incoming->postcopy_listen_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
     qemu_mutex_init(&current_incoming->page_request_mutex);
-    current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
+    /* Each page request maps to the time it was sent, in microseconds */
+    current_incoming->page_requested = g_tree_new_full(page_request_addr_cmp,
+                                                       NULL, NULL, g_free);
 
     if (!migration_object_check(current_migration, &err)) {
         error_report_err(err);
@@ -231,6 +290,11 @@ void migration_shutdown(void)
      * stop the migration using this structure
      */
     migration_cancel();
+    if (migrate_release_ram_precopy() &&
+        current_migration->state == MIGRATION_STATUS_COMPLETED) {
+        ram_release_migrated_memory();
+    }
+    ram_collapse_stop();
     object_unref(OBJECT(current_migration));
 
     /*
@@ -264,6 +328,10 @@ MigrationIncomingState *migration_incoming_get_current(void)
 void migration_incoming_state_destroy(void)
 {
     struct MigrationIncomingState *mis = migration_incoming_get_current();
+    int i;
+
+    /* Only still running if postcopy never started */
+    postcopy_preempt_thread_join(mis, true);
 
     if (mis->to_src_file) {
         /* Tell source that we are done */
@@ -280,11 +348,17 @@ void migration_incoming_state_destroy(void)
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
     }
+    g_free(mis->postcopy_discard_ramid);
+    mis->postcopy_discard_ramid = NULL;
     if (mis->transport_cleanup) {
         mis->transport_cleanup(mis->transport_data);
     }
 
     qemu_event_reset(&mis->main_thread_load_event);
+    qemu_event_reset(&mis->postcopy_listen_event);
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        mis->last_recv_block[i] = NULL;
+    }
 
     if (mis->page_requested) {
         g_tree_destroy(mis->page_requested);
@@ -316,6 +390,20 @@ static bool migrate_late_block_activate(void)
         MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE];
 }
 
+/*
+ * Write a message on the return channel without flushing it.  The
+ * caller holds rp_mutex and has checked to_src_file.
+ */
+static void migrate_put_rp_message(MigrationIncomingState *mis,
+                                   enum mig_rp_message_type message_type,
+                                   uint16_t len, void *data)
+{
+    trace_migrate_send_rp_message((int)message_type, len);
+    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
+    qemu_put_be16(mis->to_src_file, len);
+    qemu_put_buffer(mis->to_src_file, data, len);
+}
+
 /*
  * Send a message on the return channel back to the source
  * of the migration.
@@ -326,7 +414,6 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
 {
     int ret = 0;
 
-    trace_migrate_send_rp_message((int)message_type, len);
     QEMU_LOCK_GUARD(&mis->rp_mutex);
 
     /*
@@ -338,9 +425,7 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
         return ret;
     }
 
-    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
-    qemu_put_be16(mis->to_src_file, len);
-    qemu_put_buffer(mis->to_src_file, data, len);
+    migrate_put_rp_message(mis, message_type, len, data);
     qemu_fflush(mis->to_src_file);
 
     /* It's possible that qemu file got error during sending */
@@ -349,23 +434,27 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
     return ret;
 }
 
-/* Request one page from the source VM at the given start address.
- *   rb: the RAMBlock to request the page in
- *   Start: Address offset within the RB
- *   Len: Length in bytes required - must be a multiple of pagesize
+/*
+ * Queued page requests that are contiguous are merged up to that size;
+ * the first page of a request can be bigger.
  */
-int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+#define RP_REQ_PAGES_MERGE_MAX  (256 * KiB)
+
+/*
+ * Write the page request in rp_req_batch to the return channel, with
+ * rp_mutex held.
+ */
+static void migrate_put_rp_req_pages(MigrationIncomingState *mis)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
+    RAMBlock *rb = mis->rp_req_batch.rb;
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
 
-    *(uint64_t *)bufc = cpu_to_be64((uint64_t)start);
-    *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
+    *(uint64_t *)bufc = cpu_to_be64((uint64_t)mis->rp_req_batch.start);
+    *(uint32_t *)(bufc + 8) = cpu_to_be32(mis->rp_req_batch.len);
 
     /*
      * We maintain the last ramblock that we requested for page.  Note that we
@@ -388,7 +477,67 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
         msg_type = MIG_RP_MSG_REQ_PAGES;
     }
 
-    return migrate_send_rp_message(mis, msg_type, msglen, bufc);
+    migrate_put_rp_message(mis, msg_type, msglen, bufc);
+    mis->rp_req_batch.len = 0;
+}
+
+/*
+ * Queue a request for the host page at @start of @rb.  It is merged
+ * with the previous request when they are contiguous, and nothing is
+ * sent until migrate_flush_rp_req_pages(), so that a storm of faults
+ * is sent as a few big requests in one write.  Only one thread queues
+ * requests at a time.
+ */
+int migrate_queue_rp_req_pages(MigrationIncomingState *mis,
+                               RAMBlock *rb, ram_addr_t start)
+{
+    size_t len = qemu_ram_pagesize(rb);
+
+    if (mis->rp_req_batch.len && mis->rp_req_batch.rb == rb &&
+        mis->rp_req_batch.start + mis->rp_req_batch.len == start &&
+        mis->rp_req_batch.len + len <= RP_REQ_PAGES_MERGE_MAX) {
+        mis->rp_req_batch.len += len;
+        return 0;
+    }
+
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
+    if (!mis->to_src_file) {
+        return -EIO;
+    }
+    if (mis->rp_req_batch.len) {
+        migrate_put_rp_req_pages(mis);
+    }
+    mis->rp_req_batch.rb = rb;
+    mis->rp_req_batch.start = start;
+    mis->rp_req_batch.len = len;
+    return 0;
+}
+
+/* Send the page requests queued by migrate_queue_rp_req_pages() */
+int migrate_flush_rp_req_pages(MigrationIncomingState *mis)
+{
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
+    if (!mis->to_src_file) {
+        mis->rp_req_batch.len = 0;
+        return -EIO;
+    }
+    if (mis->rp_req_batch.len) {
+        migrate_put_rp_req_pages(mis);
+    }
+    qemu_fflush(mis->to_src_file);
+    return qemu_file_get_error(mis->to_src_file);
+}
+
+/* Request one page from the source VM at the given start address.
+ *   rb: the RAMBlock to request the page in
+ *   Start: Address offset within the RB
+ */
+int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
+                                      RAMBlock *rb, ram_addr_t start)
+{
+    int ret = migrate_queue_rp_req_pages(mis, rb, start);
+
+    return ret ? ret : migrate_flush_rp_req_pages(mis);
 }
 
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
@@ -400,12 +549,14 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
     WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
         received = ramblock_recv_bitmap_test_byte_offset(rb, start);
         if (!received && !g_tree_lookup(mis->page_requested, aligned)) {
+            int64_t *request_time = g_new(int64_t, 1);
+
             /*
              * The page has not been received, and it's not yet in the page
-             * request list.  Queue it.  Set the value of element to 1, so that
-             * things like g_tree_lookup() will return TRUE (1) when found.
+             * request list.  Queue it, along with the time of the request.
              */
-            g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+            *request_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            g_tree_insert(mis->page_requested, aligned, request_time);
             mis->page_requested_count++;
             trace_postcopy_page_req_add(aligned, mis->page_requested_count);
         }
@@ -419,7 +570,7 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         return 0;
     }
 
-    return migrate_send_rp_message_req_pages(mis, rb, start);
+    return migrate_queue_rp_req_pages(mis, rb, start);
 }
 
 static bool migration_colo_enabled;
@@ -457,6 +608,10 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
     const char *p = NULL;
 
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
+    if (migrate_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "fixed-ram requires a file: migration URI");
+        return;
+    }
     if (strstart(uri, "tcp:", &p) ||
         strstart(uri, "unix:", NULL) ||
         strstart(uri, "vsock:", NULL)) {
@@ -469,6 +624,8 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -527,11 +684,20 @@ static void process_incoming_migration_bh(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
+    if (ram_fixed_postcopy_active()) {
+        /* RAM keeps being loaded from the file, as it is accessed */
+        migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_POSTCOPY_ACTIVE);
+        qemu_bh_delete(mis->bh);
+        ram_fixed_postcopy_run(mis);
+        return;
+    }
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
      * it's ready to use.
      */
+    ram_collapse_start();
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
                       MIGRATION_STATUS_COMPLETED);
     qemu_bh_delete(mis->bh);
@@ -542,6 +708,7 @@ static void process_incoming_migration_co(void *opaque)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
     PostcopyState ps;
+    int64_t start_us;
     int ret;
     Error *local_err = NULL;
 
@@ -551,7 +718,9 @@ static void process_incoming_migration_co(void *opaque)
     postcopy_state_set(POSTCOPY_INCOMING_NONE);
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = qemu_loadvm_state(mis->from_src_file);
+    mis->load_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us;
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -583,8 +752,10 @@ static void process_incoming_migration_co(void *opaque)
             goto fail;
         }
 
-        qemu_thread_create(&mis->colo_incoming_thread, "COLO incoming",
-             colo_process_incoming_thread, mis, QEMU_THREAD_JOINABLE);
+        thread_context_create_thread(THREAD_GROUP_MIGRATION,
+                                     &mis->colo_incoming_thread,
+                                     "COLO incoming",
+                                     colo_process_incoming_thread, mis);
         mis->have_colo_incoming_thread = true;
         qemu_coroutine_yield();
 
@@ -690,7 +861,10 @@ void migration_fd_process_incoming(QEMUFile *f, Error **errp)
         error_propagate(errp, local_err);
         return;
     }
-    migration_incoming_process();
+    /* Otherwise the last multifd channel starts it */
+    if (!migrate_use_multifd() || migration_has_all_channels()) {
+        migration_incoming_process();
+    }
 }
 
 void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
@@ -703,6 +877,8 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
         /* The first connection (multifd may have multiple) */
         QEMUFile *f = qemu_fopen_channel_input(ioc);
 
+        qemu_file_set_buffer_size(f, migrate_stream_buffer_size(),
+                                  migrate_stream_iov_max());
         /* If it's a recovery, we're done */
         if (postcopy_try_recover(f)) {
             return;
@@ -715,17 +891,33 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd needs more than one channel, we wait,
+         * unless the pages are read from the file with fixed-ram.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() || migrate_fixed_ram();
     } else {
-        /* Multiple connections */
-        assert(migrate_use_multifd());
-        start_migration = multifd_recv_new_channel(ioc, &local_err);
-        if (local_err) {
+        /* Multiple connections, tell them apart by their first word */
+        uint32_t magic;
+
+        if (qio_channel_read_all(ioc, (char *)&magic, sizeof(magic),
+                                 &local_err)) {
             error_propagate(errp, local_err);
             return;
         }
+        magic = be32_to_cpu(magic);
+
+        if (migrate_postcopy_preempt() && magic == POSTCOPY_PREEMPT_MAGIC) {
+            postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+            /* The preempt channel is only needed once postcopy starts */
+            start_migration = false;
+        } else {
+            assert(migrate_use_multifd());
+            start_migration = multifd_recv_new_channel(ioc, magic, &local_err);
+            if (local_err) {
+                error_propagate(errp, local_err);
+                return;
+            }
+        }
     }
 
     if (start_migration) {
@@ -745,6 +937,9 @@ bool migration_has_all_channels(void)
     bool all_channels;
 
     all_channels = multifd_recv_all_channels_created();
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
 
     return all_channels && mis->from_src_file != NULL;
 }
@@ -823,6 +1018,48 @@ void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value)
     migrate_send_rp_message(mis, MIG_RP_MSG_RESUME_ACK, sizeof(buf), &buf);
 }
 
+/*
+ * Tell the source that the page at @start of @rb, which it sent by its
+ * hash, is not in the dedup store and has to be sent whole.
+ */
+int migrate_send_rp_dedup_miss(MigrationIncomingState *mis,
+                               RAMBlock *rb, ram_addr_t start)
+{
+    uint8_t buf[8 + 1 + 255]; /* start (8), rbname up to 256 */
+    const char *rbname = qemu_ram_get_idstr(rb);
+    size_t rbname_len = strlen(rbname);
+
+    assert(rbname_len < 256);
+    *(uint64_t *)buf = cpu_to_be64((uint64_t)start);
+    buf[8] = rbname_len;
+    memcpy(buf + 9, rbname, rbname_len);
+
+    return migrate_send_rp_message(mis, MIG_RP_MSG_DEDUP_MISS,
+                                   9 + rbname_len, buf);
+}
+
+/*
+ * Tell the source the load of the @nr multifd channels of @load, for
+ * multifd-backpressure.
+ */
+void migrate_send_rp_recv_load(MigrationIncomingState *mis,
+                               const MultiFDRecvChannelLoad *load, int nr)
+{
+    uint8_t buf[1 + UINT8_MAX * RP_RECV_LOAD_LEN];
+    uint8_t *p = buf + 1;
+    int i;
+
+    assert(nr <= UINT8_MAX);
+    buf[0] = nr;
+    for (i = 0; i < nr; i++, p += RP_RECV_LOAD_LEN) {
+        p[0] = load[i].id;
+        stl_be_p(p + 1, MIN(load[i].queued, UINT32_MAX));
+        stl_be_p(p + 5, MIN(load[i].rate / KiB, UINT32_MAX));
+        p[9] = load[i].busy;
+    }
+    migrate_send_rp_message(mis, MIG_RP_MSG_RECV_LOAD, p - buf, buf);
+}
+
 MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
 {
     MigrationCapabilityStatusList *head = NULL, **tail = &head;
@@ -905,6 +1142,55 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->announce_rounds = s->parameters.announce_rounds;
     params->has_announce_step = true;
     params->announce_step = s->parameters.announce_step;
+    params->has_multifd_packet_size = true;
+    params->multifd_packet_size = s->parameters.multifd_packet_size;
+    params->has_multifd_zstd_dict_pages = true;
+    params->multifd_zstd_dict_pages = s->parameters.multifd_zstd_dict_pages;
+    params->has_multifd_qatzip_level = true;
+    params->multifd_qatzip_level = s->parameters.multifd_qatzip_level;
+    params->has_xbzrle_cache_hugetlb = true;
+    params->xbzrle_cache_hugetlb = s->parameters.xbzrle_cache_hugetlb;
+    params->has_xbzrle_cache_numa_node = true;
+    params->xbzrle_cache_numa_node = s->parameters.xbzrle_cache_numa_node;
+    params->has_vcpu_dirty_limit = true;
+    params->vcpu_dirty_limit = s->parameters.vcpu_dirty_limit;
+    params->has_dirty_sync_threads = true;
+    params->dirty_sync_threads = s->parameters.dirty_sync_threads;
+    params->has_postcopy_prefetch_window = true;
+    params->postcopy_prefetch_window = s->parameters.postcopy_prefetch_window;
+    params->has_postcopy_place_batch = true;
+    params->postcopy_place_batch = s->parameters.postcopy_place_batch;
+    params->has_load_threads = true;
+    params->load_threads = s->parameters.load_threads;
+    params->has_compress_method = true;
+    params->compress_method = s->parameters.compress_method;
+    params->has_stream_buffer_size = true;
+    params->stream_buffer_size = s->parameters.stream_buffer_size;
+    params->has_stream_iov_max = true;
+    params->stream_iov_max = s->parameters.stream_iov_max;
+    params->has_max_bandwidth_burst = true;
+    params->max_bandwidth_burst = s->parameters.max_bandwidth_burst;
+    params->has_page_dedup_store = true;
+    params->page_dedup_store = g_strdup(s->parameters.page_dedup_store ?
+                                        s->parameters.page_dedup_store : "");
+    params->has_rdma_reg_cache_size = true;
+    params->rdma_reg_cache_size = s->parameters.rdma_reg_cache_size;
+    params->has_colo_flush_threads = true;
+    params->colo_flush_threads = s->parameters.colo_flush_threads;
+    params->has_x_checkpoint_budget = true;
+    params->x_checkpoint_budget = s->parameters.x_checkpoint_budget;
+    params->has_block_chunk_size = true;
+    params->block_chunk_size = s->parameters.block_chunk_size;
+    params->has_device_state_threads = true;
+    params->device_state_threads = s->parameters.device_state_threads;
+    params->has_prepopulate_threads = true;
+    params->prepopulate_threads = s->parameters.prepopulate_threads;
+    params->has_dirty_heatmap_granularity = true;
+    params->dirty_heatmap_granularity = s->parameters.dirty_heatmap_granularity;
+    params->has_postcopy_auto_time = true;
+    params->postcopy_auto_time = s->parameters.postcopy_auto_time;
+    params->has_postcopy_auto_iterations = true;
+    params->postcopy_auto_iterations = s->parameters.postcopy_auto_iterations;
 
     if (s->parameters.has_block_bitmap_mapping) {
         params->has_block_bitmap_mapping = true;
@@ -913,6 +1199,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
                        s->parameters.block_bitmap_mapping);
     }
 
+    params->has_multifd_addresses = true;
+    params->multifd_addresses = QAPI_CLONE(MultiFDAddressList,
+                                           s->parameters.multifd_addresses);
+    params->has_dsa_accel_path = true;
+    params->dsa_accel_path = QAPI_CLONE(strList, s->parameters.dsa_accel_path);
+
     return params;
 }
 
@@ -990,6 +1282,79 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
                            s->start_time;
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
+        info->has_predicted_downtime = true;
+        info->predicted_downtime = s->predicted_downtime;
+    }
+
+    if (s->rate_limit_waits) {
+        info->has_rate_limit = true;
+        info->rate_limit = g_new0(MigrationRateLimitStats, 1);
+        info->rate_limit->waits = s->rate_limit_waits;
+        info->rate_limit->wait_time = s->rate_limit_wait_time;
+    }
+}
+
+static void populate_timings_info(MigrationInfo *info, MigrationState *s)
+{
+    MigrationTimings *timings = g_new0(MigrationTimings, 1);
+    uint64List **tail = &timings->compress;
+    uint64_t flush_time = s->flush_time;
+    int i;
+
+    WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
+        if (s->to_dst_file) {
+            flush_time += qemu_file_get_flush_time(s->to_dst_file);
+        }
+    }
+
+    timings->has_bitmap_sync = true;
+    timings->bitmap_sync = qatomic_read__nocheck(&s->bitmap_sync_time);
+    timings->has_flush = true;
+    timings->flush = flush_time;
+    if (migrate_use_multifd()) {
+        timings->has_multifd_send_wait = true;
+        timings->multifd_send_wait =
+            qatomic_read__nocheck(&s->multifd_send_wait_time);
+    }
+    if (s->state == MIGRATION_STATUS_COMPLETED ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        timings->has_device_state = true;
+        timings->device_state = s->device_state_time;
+    }
+    if (qatomic_read__nocheck(&s->return_path_latency) >= 0) {
+        timings->has_return_path_latency = true;
+        timings->return_path_latency =
+            qatomic_read__nocheck(&s->return_path_latency);
+    }
+    for (i = 0; i < s->compress_channels; i++) {
+        QAPI_LIST_APPEND(tail, qatomic_read__nocheck(&s->compress_time[i]));
+    }
+    timings->has_compress = !!timings->compress;
+
+    info->has_timings = true;
+    info->timings = timings;
+}
+
+static void populate_destination_load_info(MigrationInfo *info,
+                                           MigrationState *s)
+{
+    MultiFDRecvChannelLoadList **tail;
+    int i;
+
+    QEMU_LOCK_GUARD(&s->recv_load_lock);
+    if (!migrate_multifd_backpressure() || !s->recv_load_time) {
+        return;
+    }
+
+    info->has_destination_load = true;
+    info->destination_load = g_new0(MigrationDestinationLoad, 1);
+    info->destination_load->age = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                  s->recv_load_time;
+    info->destination_load->backpressure = s->recv_backpressure;
+    tail = &info->destination_load->channels;
+    for (i = 0; i < s->recv_load_nr; i++) {
+        QAPI_LIST_APPEND(tail, QAPI_CLONE(MultiFDRecvChannelLoad,
+                                          &s->recv_load[i]));
     }
 }
 
@@ -997,22 +1362,34 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
 {
     info->has_ram = true;
     info->ram = g_malloc0(sizeof(*info->ram));
-    info->ram->transferred = ram_counters.transferred;
+    info->ram->transferred = stat64_get(&ram_atomic_counters.transferred);
     info->ram->total = ram_bytes_total();
-    info->ram->duplicate = ram_counters.duplicate;
+    info->ram->duplicate = stat64_get(&ram_atomic_counters.duplicate);
     /* legacy value.  It is not used anymore */
     info->ram->skipped = 0;
-    info->ram->normal = ram_counters.normal;
-    info->ram->normal_bytes = ram_counters.normal *
+    info->ram->normal = stat64_get(&ram_atomic_counters.normal);
+    info->ram->normal_bytes = stat64_get(&ram_atomic_counters.normal) *
         qemu_target_page_size();
     info->ram->mbps = s->mbps;
-    info->ram->dirty_sync_count = ram_counters.dirty_sync_count;
-    info->ram->postcopy_requests = ram_counters.postcopy_requests;
+    info->ram->dirty_sync_count =
+        stat64_get(&ram_atomic_counters.dirty_sync_count);
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
+    info->ram->free_page_hint_bytes =
+        stat64_get(&ram_atomic_counters.free_page_hint_bytes);
+    info->ram->dedup_pages = stat64_get(&ram_atomic_counters.dedup_pages);
+    info->ram->dedup_misses = stat64_get(&ram_atomic_counters.dedup_misses);
+    info->ram->postcopy_requests =
+        stat64_get(&ram_atomic_counters.postcopy_requests);
     info->ram->page_size = qemu_target_page_size();
-    info->ram->multifd_bytes = ram_counters.multifd_bytes;
+    info->ram->multifd_bytes = stat64_get(&ram_atomic_counters.multifd_bytes);
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_missed_zero_copy =
+        stat64_get(&ram_atomic_counters.dirty_sync_missed_zero_copy);
+
+    info->postcopy_queue_latency = ram_postcopy_queue_latency();
+    info->has_postcopy_queue_latency = !!info->postcopy_queue_latency;
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_xbzrle() || migrate_multifd_xbzrle()) {
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
@@ -1098,6 +1475,8 @@ static void fill_source_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_POSTCOPY_RECOVER:
         /* TODO add some postcopy stats */
         populate_time_info(info, s);
+        populate_timings_info(info, s);
+        populate_destination_load_info(info, s);
         populate_ram_info(info, s);
         populate_disk_info(info);
         populate_vfio_info(info);
@@ -1108,6 +1487,7 @@ static void fill_source_migration_info(MigrationInfo *info)
         break;
     case MIGRATION_STATUS_COMPLETED:
         populate_time_info(info, s);
+        populate_timings_info(info, s);
         populate_ram_info(info, s);
         populate_vfio_info(info);
         break;
@@ -1214,6 +1594,210 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Multifd zero page detection requires multifd");
+        return false;
+    }
+
+#ifdef CONFIG_LINUX
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND] &&
+        (!cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+         migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE ||
+         migrate_use_tls())) {
+        error_setg(errp,
+                   "Zero copy only available for non-compressed non-TLS "
+                   "multifd migration");
+        return false;
+    }
+#endif
+
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_ADAPTIVE_PACKET_SIZE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Adaptive multifd packet size requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt is not compatible with "
+                       "compress");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_LIMIT]) {
+        if (cap_list[MIGRATION_CAPABILITY_AUTO_CONVERGE]) {
+            error_setg(errp, "dirty-limit conflicts with auto-converge, "
+                       "only one of them can be enabled");
+            return false;
+        }
+
+        if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+            error_setg(errp, "dirty-limit requires KVM with accelerator "
+                       "property 'dirty-ring-size' set");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_HUGETLB_MINOR] &&
+        !cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "Postcopy hugetlb minor faults require postcopy-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "fixed-ram is not compatible with xbzrle, "
+                       "compress or postcopy-ram");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_FIXED_RAM_MMAP] &&
+        !cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+        error_setg(errp, "fixed-ram-mmap requires fixed-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_FIXED_RAM_POSTCOPY]) {
+        if (!cap_list[MIGRATION_CAPABILITY_FIXED_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_FIXED_RAM_MMAP]) {
+            error_setg(errp, "fixed-ram-postcopy requires fixed-ram, and "
+                       "is not compatible with fixed-ram-mmap");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_RAM_INCREMENTAL]) {
+        if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] ||
+            cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_FIXED_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "ram-incremental is not compatible with "
+                       "background-snapshot, postcopy-ram, fixed-ram "
+                       "or x-colo");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_PAGE_DEDUP]) {
+        if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] ||
+            cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_FIXED_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "page-dedup is not compatible with "
+                       "background-snapshot, postcopy-ram, fixed-ram, "
+                       "compress or x-colo");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE] &&
+        (!cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+         cap_list[MIGRATION_CAPABILITY_FIXED_RAM])) {
+        error_setg(errp, "multifd-device-state requires multifd, and is "
+                   "not compatible with fixed-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_BITMAPS_COMPRESS] &&
+        !cap_list[MIGRATION_CAPABILITY_DIRTY_BITMAPS]) {
+        error_setg(errp, "dirty-bitmaps-compress requires dirty-bitmaps");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_EARLY_DEVICE_STATE] &&
+        (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] ||
+         cap_list[MIGRATION_CAPABILITY_X_COLO])) {
+        error_setg(errp, "early-device-state is not compatible with "
+                   "background-snapshot or x-colo");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_NUMA_AFFINITY] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "multifd-numa-affinity requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_AUTOTUNE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "multifd-autotune requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_COMPRESS_BITMAP] &&
+        !cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "postcopy-compress-bitmap requires postcopy-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_DISCARD_BITMAP] &&
+        !cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "postcopy-discard-bitmap requires postcopy-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_STREAM_COMPRESS]) {
+#ifndef CONFIG_ZSTD
+        error_setg(errp, "stream-compress requires QEMU built with zstd");
+        return false;
+#endif
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+            error_setg(errp, "stream-compress is not compatible with "
+                       "multifd or fixed-ram");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_CRC32C]) {
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "multifd-crc32c requires multifd");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+            error_setg(errp, "multifd-crc32c is not compatible with "
+                       "fixed-ram");
+            return false;
+        }
+#ifdef CONFIG_LINUX
+        if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+            error_setg(errp, "multifd-crc32c is not compatible with "
+                       "zero-copy-send");
+            return false;
+        }
+#endif
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_RELEASE_RAM_PRECOPY] &&
+        cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+        error_setg(errp, "Capability 'release-ram-precopy' is not compatible "
+                   "with x-colo");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_BACKPRESSURE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Multifd backpressure requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_AUTO] &&
+        !cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "Postcopy auto requires postcopy-ram");
+        return false;
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1260,6 +1844,9 @@ static void fill_destination_migration_info(MigrationInfo *info)
             QAPI_CLONE(SocketAddressList, mis->socket_address_list);
     }
 
+    info->multifd_recv_channels = multifd_recv_channels_stats();
+    info->has_multifd_recv_channels = !!info->multifd_recv_channels;
+
     switch (mis->state) {
     case MIGRATION_STATUS_NONE:
         return;
@@ -1276,7 +1863,13 @@ static void fill_destination_migration_info(MigrationInfo *info)
         break;
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
+        info->has_timings = true;
+        info->timings = g_new0(MigrationTimings, 1);
+        info->timings->has_load = true;
+        info->timings->load = mis->load_time;
         fill_destination_postcopy_migration_info(info);
+        info->huge_pages = ram_collapse_info();
+        info->has_huge_pages = !!info->huge_pages;
         break;
     }
     info->status = mis->state;
@@ -1368,6 +1961,15 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_max_bandwidth_burst &&
+        params->max_bandwidth_burst > INT64_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "max_bandwidth_burst",
+                   "an integer in the range of 0 to "stringify(INT64_MAX)
+                   " bytes");
+        return false;
+    }
+
     if (params->has_max_bandwidth && (params->max_bandwidth > SIZE_MAX)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
                    "max_bandwidth",
@@ -1408,6 +2010,15 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (migrate_use_zero_copy_send() &&
+        (params->multifd_compression != MULTIFD_COMPRESSION_NONE ||
+         (params->tls_creds && *params->tls_creds))) {
+        error_setg(errp,
+                   "Zero copy only available for non-compressed non-TLS "
+                   "multifd migration");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1456,43 +2067,167 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
        return false;
     }
 
-    if (params->has_block_bitmap_mapping &&
-        !check_dirty_bitmap_mig_alias_map(params->block_bitmap_mapping, errp)) {
-        error_prepend(errp, "Invalid mapping given for block-bitmap-mapping: ");
+    if (params->has_multifd_packet_size &&
+        (params->multifd_packet_size < qemu_target_page_size() ||
+         params->multifd_packet_size > MULTIFD_PACKET_SIZE_MAX ||
+         params->multifd_packet_size % qemu_target_page_size())) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_packet_size",
+                   "a multiple of the target page size no bigger than 16 MiB");
         return false;
     }
 
-    return true;
-}
-
-static void migrate_params_test_apply(MigrateSetParameters *params,
-                                      MigrationParameters *dest)
-{
-    *dest = migrate_get_current()->parameters;
-
-    /* TODO use QAPI_CLONE() instead of duplicating it inline */
-
-    if (params->has_compress_level) {
-        dest->compress_level = params->compress_level;
+    if (params->has_multifd_zstd_dict_pages &&
+        params->multifd_zstd_dict_pages > MULTIFD_ZSTD_DICT_PAGES_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_zstd_dict_pages",
+                   "a value between 0 and "
+                   stringify(MULTIFD_ZSTD_DICT_PAGES_MAX));
+        return false;
     }
 
-    if (params->has_compress_threads) {
-        dest->compress_threads = params->compress_threads;
+    if (params->has_multifd_qatzip_level &&
+        (params->multifd_qatzip_level < 1 ||
+         params->multifd_qatzip_level > 9)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_qatzip_level",
+                   "a value between 1 and 9");
+        return false;
     }
 
-    if (params->has_compress_wait_thread) {
-        dest->compress_wait_thread = params->compress_wait_thread;
+    if (params->has_xbzrle_cache_numa_node &&
+        (params->xbzrle_cache_numa_node < -1 ||
+         params->xbzrle_cache_numa_node >= MAX_NODES)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "xbzrle_cache_numa_node",
+                   "is invalid, it should be -1 or a host NUMA node");
+        return false;
     }
 
-    if (params->has_decompress_threads) {
-        dest->decompress_threads = params->decompress_threads;
+    if (params->has_vcpu_dirty_limit &&
+        (params->vcpu_dirty_limit < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "vcpu_dirty_limit",
+                   "is invalid, it must be at least 1 MB/s");
+        return false;
     }
 
-    if (params->has_throttle_trigger_threshold) {
-        dest->throttle_trigger_threshold = params->throttle_trigger_threshold;
+    if (params->has_dirty_sync_threads &&
+        (params->dirty_sync_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "dirty_sync_threads",
+                   "a value between 1 and 255");
+        return false;
     }
 
-    if (params->has_cpu_throttle_initial) {
+    if (params->has_postcopy_place_batch &&
+        (params->postcopy_place_batch < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_place_batch",
+                   "a value between 1 and 65535");
+        return false;
+    }
+
+    if (params->has_stream_buffer_size &&
+        (params->stream_buffer_size < MIN_MIGRATE_STREAM_BUFFER_SIZE ||
+         params->stream_buffer_size > MAX_MIGRATE_STREAM_BUFFER_SIZE)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "stream_buffer_size",
+                   "a value between 4 KiB and 64 MiB");
+        return false;
+    }
+
+    if (params->has_stream_iov_max &&
+        (params->stream_iov_max < 1 || params->stream_iov_max > IOV_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "stream_iov_max",
+                   "a value between 1 and the IOV_MAX of the host");
+        return false;
+    }
+
+    if (params->has_colo_flush_threads &&
+        (params->colo_flush_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "colo_flush_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
+    if (params->has_block_chunk_size &&
+        (params->block_chunk_size < BLK_MIG_BLOCK_SIZE ||
+         params->block_chunk_size > MAX_MIGRATE_BLOCK_CHUNK_SIZE ||
+         params->block_chunk_size % BLK_MIG_BLOCK_SIZE)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "block_chunk_size",
+                   "a multiple of 1 MiB, up to 64 MiB");
+        return false;
+    }
+
+    if (params->has_dirty_heatmap_granularity &&
+        params->dirty_heatmap_granularity &&
+        (params->dirty_heatmap_granularity < qemu_target_page_size() ||
+         !is_power_of_2(params->dirty_heatmap_granularity))) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "dirty_heatmap_granularity",
+                   "0 or a power of two no less than the target page size");
+        return false;
+    }
+
+    if (params->has_block_bitmap_mapping &&
+        !check_dirty_bitmap_mig_alias_map(params->block_bitmap_mapping, errp)) {
+        error_prepend(errp, "Invalid mapping given for block-bitmap-mapping: ");
+        return false;
+    }
+
+    if (params->has_multifd_addresses) {
+        MultiFDAddressList *l;
+
+        for (l = params->multifd_addresses; l; l = l->next) {
+            if (l->value->has_weight && !l->value->weight) {
+                error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                           "multifd_addresses",
+                           "weights between 1 and 255");
+                return false;
+            }
+            if (l->value->has_source &&
+                l->value->addr->type != SOCKET_ADDRESS_TYPE_INET) {
+                error_setg(errp, "multifd_addresses: only inet addresses "
+                           "can have a source");
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void migrate_params_test_apply(MigrateSetParameters *params,
+                                      MigrationParameters *dest)
+{
+    *dest = migrate_get_current()->parameters;
+
+    /* TODO use QAPI_CLONE() instead of duplicating it inline */
+
+    if (params->has_compress_level) {
+        dest->compress_level = params->compress_level;
+    }
+
+    if (params->has_compress_threads) {
+        dest->compress_threads = params->compress_threads;
+    }
+
+    if (params->has_compress_wait_thread) {
+        dest->compress_wait_thread = params->compress_wait_thread;
+    }
+
+    if (params->has_decompress_threads) {
+        dest->decompress_threads = params->decompress_threads;
+    }
+
+    if (params->has_throttle_trigger_threshold) {
+        dest->throttle_trigger_threshold = params->throttle_trigger_threshold;
+    }
+
+    if (params->has_cpu_throttle_initial) {
         dest->cpu_throttle_initial = params->cpu_throttle_initial;
     }
 
@@ -1556,11 +2291,109 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_announce_step) {
         dest->announce_step = params->announce_step;
     }
+    if (params->has_multifd_packet_size) {
+        dest->multifd_packet_size = params->multifd_packet_size;
+    }
+    if (params->has_multifd_zstd_dict_pages) {
+        dest->multifd_zstd_dict_pages = params->multifd_zstd_dict_pages;
+    }
+    if (params->has_multifd_qatzip_level) {
+        dest->multifd_qatzip_level = params->multifd_qatzip_level;
+    }
+    if (params->has_xbzrle_cache_hugetlb) {
+        dest->xbzrle_cache_hugetlb = params->xbzrle_cache_hugetlb;
+    }
+    if (params->has_xbzrle_cache_numa_node) {
+        dest->xbzrle_cache_numa_node = params->xbzrle_cache_numa_node;
+    }
+    if (params->has_vcpu_dirty_limit) {
+        dest->vcpu_dirty_limit = params->vcpu_dirty_limit;
+    }
+    if (params->has_dirty_sync_threads) {
+        dest->dirty_sync_threads = params->dirty_sync_threads;
+    }
+    if (params->has_postcopy_prefetch_window) {
+        dest->postcopy_prefetch_window = params->postcopy_prefetch_window;
+    }
+    if (params->has_postcopy_place_batch) {
+        dest->postcopy_place_batch = params->postcopy_place_batch;
+    }
+    if (params->has_load_threads) {
+        dest->load_threads = params->load_threads;
+    }
+    if (params->has_compress_method) {
+        dest->compress_method = params->compress_method;
+    }
+    if (params->has_stream_buffer_size) {
+        dest->stream_buffer_size = params->stream_buffer_size;
+    }
+    if (params->has_stream_iov_max) {
+        dest->stream_iov_max = params->stream_iov_max;
+    }
+    if (params->has_max_bandwidth_burst) {
+        dest->max_bandwidth_burst = params->max_bandwidth_burst;
+    }
+    if (params->has_page_dedup_store) {
+        assert(params->page_dedup_store->type == QTYPE_QSTRING);
+        dest->page_dedup_store = params->page_dedup_store->u.s;
+    }
+    if (params->has_rdma_reg_cache_size) {
+        dest->rdma_reg_cache_size = params->rdma_reg_cache_size;
+    }
+    if (params->has_colo_flush_threads) {
+        dest->colo_flush_threads = params->colo_flush_threads;
+    }
+    if (params->has_x_checkpoint_budget) {
+        dest->x_checkpoint_budget = params->x_checkpoint_budget;
+    }
+    if (params->has_block_chunk_size) {
+        dest->block_chunk_size = params->block_chunk_size;
+    }
+    if (params->has_device_state_threads) {
+        dest->device_state_threads = params->device_state_threads;
+    }
+    if (params->has_prepopulate_threads) {
+        dest->prepopulate_threads = params->prepopulate_threads;
+    }
+    if (params->has_dirty_heatmap_granularity) {
+        dest->dirty_heatmap_granularity = params->dirty_heatmap_granularity;
+    }
+    if (params->has_postcopy_auto_time) {
+        dest->postcopy_auto_time = params->postcopy_auto_time;
+    }
+    if (params->has_postcopy_auto_iterations) {
+        dest->postcopy_auto_iterations = params->postcopy_auto_iterations;
+    }
 
     if (params->has_block_bitmap_mapping) {
         dest->has_block_bitmap_mapping = true;
         dest->block_bitmap_mapping = params->block_bitmap_mapping;
     }
+
+    if (params->has_multifd_addresses) {
+        dest->multifd_addresses = params->multifd_addresses;
+    }
+
+    if (params->has_dsa_accel_path) {
+        dest->dsa_accel_path = params->dsa_accel_path;
+    }
+}
+
+/*
+ * Limit the main stream and the multifd channels to @bandwidth bytes
+ * per second, 0 meaning no limit, in bursts of max-bandwidth-burst.
+ */
+static void migration_set_rate_limit(MigrationState *s, int64_t bandwidth)
+{
+    int64_t burst = s->parameters.max_bandwidth_burst;
+
+    if (!bandwidth) {
+        bandwidth = INT64_MAX;
+    }
+    if (!burst) {
+        burst = bandwidth / 1000 * DEFAULT_MIGRATE_RATE_BURST_MS;
+    }
+    qemu_file_set_rate_limit(s->to_dst_file, bandwidth, burst);
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1622,8 +2455,7 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_max_bandwidth) {
         s->parameters.max_bandwidth = params->max_bandwidth;
         if (s->to_dst_file && !migration_in_postcopy()) {
-            qemu_file_set_rate_limit(s->to_dst_file,
-                                s->parameters.max_bandwidth / XFER_LIMIT_RATIO);
+            migration_set_rate_limit(s, s->parameters.max_bandwidth);
         }
     }
 
@@ -1654,8 +2486,7 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_max_postcopy_bandwidth) {
         s->parameters.max_postcopy_bandwidth = params->max_postcopy_bandwidth;
         if (s->to_dst_file && migration_in_postcopy()) {
-            qemu_file_set_rate_limit(s->to_dst_file,
-                    s->parameters.max_postcopy_bandwidth / XFER_LIMIT_RATIO);
+            migration_set_rate_limit(s, s->parameters.max_postcopy_bandwidth);
         }
     }
     if (params->has_max_cpu_throttle) {
@@ -1673,6 +2504,88 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_announce_step) {
         s->parameters.announce_step = params->announce_step;
     }
+    if (params->has_multifd_packet_size) {
+        s->parameters.multifd_packet_size = params->multifd_packet_size;
+    }
+    if (params->has_multifd_zstd_dict_pages) {
+        s->parameters.multifd_zstd_dict_pages = params->multifd_zstd_dict_pages;
+    }
+    if (params->has_multifd_qatzip_level) {
+        s->parameters.multifd_qatzip_level = params->multifd_qatzip_level;
+    }
+    if (params->has_xbzrle_cache_hugetlb) {
+        s->parameters.xbzrle_cache_hugetlb = params->xbzrle_cache_hugetlb;
+    }
+    if (params->has_xbzrle_cache_numa_node) {
+        s->parameters.xbzrle_cache_numa_node = params->xbzrle_cache_numa_node;
+    }
+    if (params->has_vcpu_dirty_limit) {
+        s->parameters.vcpu_dirty_limit = params->vcpu_dirty_limit;
+    }
+    if (params->has_dirty_sync_threads) {
+        s->parameters.dirty_sync_threads = params->dirty_sync_threads;
+    }
+    if (params->has_postcopy_prefetch_window) {
+        s->parameters.postcopy_prefetch_window = params->postcopy_prefetch_window;
+    }
+    if (params->has_postcopy_place_batch) {
+        s->parameters.postcopy_place_batch = params->postcopy_place_batch;
+    }
+    if (params->has_load_threads) {
+        s->parameters.load_threads = params->load_threads;
+    }
+    if (params->has_compress_method) {
+        s->parameters.compress_method = params->compress_method;
+    }
+    if (params->has_stream_buffer_size) {
+        s->parameters.stream_buffer_size = params->stream_buffer_size;
+    }
+    if (params->has_stream_iov_max) {
+        s->parameters.stream_iov_max = params->stream_iov_max;
+    }
+    if (params->has_max_bandwidth_burst) {
+        s->parameters.max_bandwidth_burst = params->max_bandwidth_burst;
+        if (s->to_dst_file) {
+            migration_set_rate_limit(s, migration_in_postcopy() ?
+                                     s->parameters.max_postcopy_bandwidth :
+                                     s->parameters.max_bandwidth);
+        }
+    }
+    if (params->has_page_dedup_store) {
+        g_free(s->parameters.page_dedup_store);
+        assert(params->page_dedup_store->type == QTYPE_QSTRING);
+        s->parameters.page_dedup_store =
+            g_strdup(params->page_dedup_store->u.s);
+    }
+    if (params->has_rdma_reg_cache_size) {
+        s->parameters.rdma_reg_cache_size = params->rdma_reg_cache_size;
+    }
+    if (params->has_colo_flush_threads) {
+        s->parameters.colo_flush_threads = params->colo_flush_threads;
+    }
+    if (params->has_x_checkpoint_budget) {
+        s->parameters.x_checkpoint_budget = params->x_checkpoint_budget;
+    }
+    if (params->has_block_chunk_size) {
+        s->parameters.block_chunk_size = params->block_chunk_size;
+    }
+    if (params->has_device_state_threads) {
+        s->parameters.device_state_threads = params->device_state_threads;
+    }
+    if (params->has_prepopulate_threads) {
+        s->parameters.prepopulate_threads = params->prepopulate_threads;
+    }
+    if (params->has_dirty_heatmap_granularity) {
+        s->parameters.dirty_heatmap_granularity =
+            params->dirty_heatmap_granularity;
+    }
+    if (params->has_postcopy_auto_time) {
+        s->parameters.postcopy_auto_time = params->postcopy_auto_time;
+    }
+    if (params->has_postcopy_auto_iterations) {
+        s->parameters.postcopy_auto_iterations =
+            params->postcopy_auto_iterations;
+    }
 
     if (params->has_block_bitmap_mapping) {
         qapi_free_BitmapMigrationNodeAliasList(
@@ -1683,6 +2596,18 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
             QAPI_CLONE(BitmapMigrationNodeAliasList,
                        params->block_bitmap_mapping);
     }
+
+    if (params->has_multifd_addresses) {
+        qapi_free_MultiFDAddressList(s->parameters.multifd_addresses);
+        s->parameters.multifd_addresses =
+            QAPI_CLONE(MultiFDAddressList, params->multifd_addresses);
+    }
+
+    if (params->has_dsa_accel_path) {
+        qapi_free_strList(s->parameters.dsa_accel_path);
+        s->parameters.dsa_accel_path = QAPI_CLONE(strList,
+                                                  params->dsa_accel_path);
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -1703,6 +2628,12 @@ void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
         params->tls_hostname->type = QTYPE_QSTRING;
         params->tls_hostname->u.s = strdup("");
     }
+    if (params->has_page_dedup_store
+        && params->page_dedup_store->type == QTYPE_QNULL) {
+        qobject_unref(params->page_dedup_store->u.n);
+        params->page_dedup_store->type = QTYPE_QSTRING;
+        params->page_dedup_store->u.s = strdup("");
+    }
 
     migrate_params_test_apply(params, &tmp);
 
@@ -1803,9 +2734,16 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_mutex_lock_iothread();
 
         multifd_save_cleanup();
+        if (s->postcopy_qemufile_src) {
+            s->flush_time +=
+                qemu_file_get_flush_time(s->postcopy_qemufile_src);
+            qemu_fclose(s->postcopy_qemufile_src);
+            s->postcopy_qemufile_src = NULL;
+        }
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
+        s->flush_time += qemu_file_get_flush_time(tmp);
         qemu_mutex_unlock(&s->qemu_file_lock);
         /*
          * Close the file handle without the lock to make sure the
@@ -1949,6 +2887,27 @@ bool migration_in_postcopy(void)
     }
 }
 
+/*
+ * Add the time since @start_us to one of the timings of the migration.
+ * Only the thread that owns @time may call this, but it can be read by
+ * query-migrate at any time.
+ */
+void migration_add_time(uint64_t *time, int64_t start_us)
+{
+    qatomic_set__nocheck(time, qatomic_read__nocheck(time) +
+                         qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us);
+}
+
+/* Same, for the compression time of a compression thread or channel */
+void migration_add_compress_time(int channel, int64_t start_us)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (channel < s->compress_channels) {
+        migration_add_time(&s->compress_time[channel], start_us);
+    }
+}
+
 bool migration_in_postcopy_after_devices(MigrationState *s)
 {
     return migration_in_postcopy() && s->postcopy_after_devices;
@@ -2022,6 +2981,33 @@ void migrate_init(MigrationState *s)
     s->pages_per_second = 0.0;
     s->downtime = 0;
     s->expected_downtime = 0;
+    s->predicted_downtime = 0;
+    s->bandwidth_avg = 0;
+    s->rate_limit_waits = 0;
+    s->rate_limit_wait_time = 0;
+    s->recv_load_time = 0;
+    s->recv_load_nr = 0;
+    s->recv_backpressure = false;
+    s->postcopy_auto_sync_count = 0;
+    s->postcopy_auto_iterations = 0;
+    s->bitmap_sync_time = 0;
+    s->multifd_send_wait_time = 0;
+    s->flush_time = 0;
+    s->device_state_time = 0;
+    g_free(s->compress_time);
+    if (migrate_use_multifd() &&
+        migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+        s->compress_channels = migrate_multifd_channels();
+    } else if (migrate_use_compression()) {
+        s->compress_channels = migrate_compress_threads();
+    } else {
+        s->compress_channels = 0;
+    }
+    s->compress_time = g_new0(uint64_t, s->compress_channels);
+    s->ping_value = 0;
+    s->ping_time = 0;
+    s->return_path_latency = -1;
+    s->pending_size = 0;
     s->setup_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
@@ -2035,6 +3021,7 @@ void migrate_init(MigrationState *s)
     s->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     s->total_time = 0;
     s->vm_was_running = false;
+    s->ram_released = false;
     s->iteration_initial_bytes = 0;
     s->threshold_size = 0;
 }
@@ -2089,6 +3076,8 @@ void qmp_migrate_incoming(const char *uri, Error **errp)
         error_propagate(errp, local_err);
         return;
     }
+    /* Populate guest RAM while the source connects */
+    ram_prepopulate_start();
 
     once = false;
 }
@@ -2256,264 +3245,768 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
      * new migration
      */
     memset(&ram_counters, 0, sizeof(ram_counters));
+    memset(&ram_atomic_counters, 0, sizeof(ram_atomic_counters));
+
+    return true;
+}
+
+void qmp_migrate(const char *uri, bool has_blk, bool blk,
+                 bool has_inc, bool inc, bool has_detach, bool detach,
+                 bool has_resume, bool resume, Error **errp)
+{
+    Error *local_err = NULL;
+    MigrationState *s = migrate_get_current();
+    const char *p = NULL;
+
+    if (migrate_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "fixed-ram requires a file: migration URI");
+        return;
+    }
+    if (migrate_fixed_ram() && migrate_use_multifd() &&
+        migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "fixed-ram is not compatible with multifd "
+                   "compression");
+        return;
+    }
+    if (migrate_stream_compress() && !strstart(uri, "exec:", NULL) &&
+        !strstart(uri, "fd:", NULL) && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "stream-compress requires an exec:, fd: or file: "
+                   "migration URI");
+        return;
+    }
+
+    if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
+                         has_resume && resume, errp)) {
+        /* Error detected, put into errp */
+        return;
+    }
+
+    if (!(has_resume && resume)) {
+        if (!yank_register_instance(MIGRATION_YANK_INSTANCE, errp)) {
+            return;
+        }
+    }
+
+    if (strstart(uri, "tcp:", &p) ||
+        strstart(uri, "unix:", NULL) ||
+        strstart(uri, "vsock:", NULL)) {
+        socket_start_outgoing_migration(s, p ? p : uri, &local_err);
+#ifdef CONFIG_RDMA
+    } else if (strstart(uri, "rdma:", &p)) {
+        rdma_start_outgoing_migration(s, p, &local_err);
+#endif
+    } else if (strstart(uri, "exec:", &p)) {
+        exec_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "fd:", &p)) {
+        fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
+    } else {
+        if (!(has_resume && resume)) {
+            yank_unregister_instance(MIGRATION_YANK_INSTANCE);
+        }
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                   "a valid migration protocol");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
+    if (local_err) {
+        if (!(has_resume && resume)) {
+            yank_unregister_instance(MIGRATION_YANK_INSTANCE);
+        }
+        migrate_fd_error(s, local_err);
+        error_propagate(errp, local_err);
+        return;
+    }
+}
+
+void qmp_migrate_cancel(Error **errp)
+{
+    migration_cancel();
+}
+
+void qmp_migrate_continue(MigrationStatus state, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    if (s->state != state) {
+        error_setg(errp,  "Migration not in expected state: %s",
+                   MigrationStatus_str(s->state));
+        return;
+    }
+    qemu_sem_post(&s->pause_sem);
+}
+
+bool migrate_release_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_RELEASE_RAM];
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
+bool migrate_postcopy(void)
+{
+    return migrate_postcopy_ram() || migrate_dirty_bitmaps();
+}
+
+bool migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+bool migrate_zero_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+bool migrate_postcopy_blocktime(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
+}
+
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_threads;
+}
+
+int migrate_compress_wait_thread(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_wait_thread;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.decompress_threads;
+}
+
+bool migrate_dirty_bitmaps(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS];
+}
+
+bool migrate_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
+}
+
+bool migrate_validate_uuid(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_VALIDATE_UUID];
+}
+
+bool migrate_use_events(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_EVENTS];
+}
+
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+#ifdef CONFIG_LINUX
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+#else
+    return false;
+#endif
+}
+
+bool migrate_use_tls(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.tls_creds && *s->parameters.tls_creds;
+}
+
+bool migrate_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE];
+}
+
+bool migrate_pause_before_switchover(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER];
+}
+
+bool migrate_multifd_adaptive_packet_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_MULTIFD_ADAPTIVE_PACKET_SIZE];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT];
+}
+
+bool migrate_postcopy_hugetlb_minor(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_POSTCOPY_HUGETLB_MINOR];
+}
+
+bool migrate_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM];
+}
+
+bool migrate_fixed_ram_mmap(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM_MMAP];
+}
+
+bool migrate_fixed_ram_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM_POSTCOPY];
+}
+
+bool migrate_ram_incremental(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_RAM_INCREMENTAL];
+}
+
+bool migrate_predictive_switchover(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PREDICTIVE_SWITCHOVER];
+}
+
+bool migrate_fair_iteration(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FAIR_ITERATION];
+}
+
+bool migrate_ram_cold_first(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_RAM_COLD_FIRST];
+}
+
+bool migrate_ram_huge_page_granularity(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_RAM_HUGE_PAGE_GRANULARITY];
+}
+
+const char *migrate_page_dedup_store(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.page_dedup_store;
+}
+
+bool migrate_page_dedup(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PAGE_DEDUP];
+}
+
+bool migrate_multifd_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE];
+}
+
+bool migrate_dirty_bitmaps_compress(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS_COMPRESS];
+}
+
+bool migrate_early_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_EARLY_DEVICE_STATE];
+}
+
+bool migrate_clear_dirty_log_ahead(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_CLEAR_DIRTY_LOG_AHEAD];
+}
+
+bool migrate_ram_handover(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_RAM_HANDOVER];
+}
+
+bool migrate_multifd_numa_affinity(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_NUMA_AFFINITY];
+}
+
+bool migrate_multifd_autotune(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_AUTOTUNE];
+}
+
+bool migrate_postcopy_compress_bitmap(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_POSTCOPY_COMPRESS_BITMAP];
+}
+
+bool migrate_postcopy_discard_bitmap(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_POSTCOPY_DISCARD_BITMAP];
+}
+
+bool migrate_stream_compress(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_STREAM_COMPRESS];
+}
+
+bool migrate_multifd_crc32c(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_CRC32C];
+}
+
+bool migrate_release_ram_precopy(void)
+{
+    MigrationState *s;
 
-    return true;
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_RELEASE_RAM_PRECOPY];
 }
 
-void qmp_migrate(const char *uri, bool has_blk, bool blk,
-                 bool has_inc, bool inc, bool has_detach, bool detach,
-                 bool has_resume, bool resume, Error **errp)
+bool migrate_multifd_flush_after_each_section(void)
 {
-    Error *local_err = NULL;
     MigrationState *s = migrate_get_current();
-    const char *p = NULL;
 
-    if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
-                         has_resume && resume, errp)) {
-        /* Error detected, put into errp */
-        return;
-    }
+    return s->multifd_flush_after_each_section;
+}
 
-    if (!(has_resume && resume)) {
-        if (!yank_register_instance(MIGRATION_YANK_INSTANCE, errp)) {
-            return;
-        }
-    }
+bool migrate_multifd_backpressure(void)
+{
+    MigrationState *s;
 
-    if (strstart(uri, "tcp:", &p) ||
-        strstart(uri, "unix:", NULL) ||
-        strstart(uri, "vsock:", NULL)) {
-        socket_start_outgoing_migration(s, p ? p : uri, &local_err);
-#ifdef CONFIG_RDMA
-    } else if (strstart(uri, "rdma:", &p)) {
-        rdma_start_outgoing_migration(s, p, &local_err);
-#endif
-    } else if (strstart(uri, "exec:", &p)) {
-        exec_start_outgoing_migration(s, p, &local_err);
-    } else if (strstart(uri, "fd:", &p)) {
-        fd_start_outgoing_migration(s, p, &local_err);
-    } else {
-        if (!(has_resume && resume)) {
-            yank_unregister_instance(MIGRATION_YANK_INSTANCE);
-        }
-        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
-                   "a valid migration protocol");
-        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
-                          MIGRATION_STATUS_FAILED);
-        block_cleanup_parameters(s);
-        return;
-    }
+    s = migrate_get_current();
 
-    if (local_err) {
-        if (!(has_resume && resume)) {
-            yank_unregister_instance(MIGRATION_YANK_INSTANCE);
-        }
-        migrate_fd_error(s, local_err);
-        error_propagate(errp, local_err);
-        return;
-    }
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_BACKPRESSURE];
 }
 
-void qmp_migrate_cancel(Error **errp)
+bool migrate_postcopy_auto(void)
 {
-    migration_cancel();
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_AUTO];
 }
 
-void qmp_migrate_continue(MigrationStatus state, Error **errp)
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_channels;
+}
+
+/* The multifd-addresses entry of multifd channel @id, or NULL */
+MultiFDAddress *migrate_multifd_address(int id)
 {
     MigrationState *s = migrate_get_current();
-    if (s->state != state) {
-        error_setg(errp,  "Migration not in expected state: %s",
-                   MigrationStatus_str(s->state));
-        return;
+    MultiFDAddressList *l = s->parameters.multifd_addresses;
+    int n = 0;
+
+    for (; l; l = l->next) {
+        n++;
     }
-    qemu_sem_post(&s->pause_sem);
+    if (!n) {
+        return NULL;
+    }
+    l = s->parameters.multifd_addresses;
+    for (id %= n; id; id--) {
+        l = l->next;
+    }
+    return l->value;
 }
 
-bool migrate_release_ram(void)
+int migrate_multifd_channel_weight(int id)
+{
+    MultiFDAddress *addr = migrate_multifd_address(id);
+
+    return addr && addr->has_weight ? addr->weight : 1;
+}
+
+const strList *migrate_dsa_accel_path(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_RELEASE_RAM];
+    return s->parameters.dsa_accel_path;
 }
 
-bool migrate_postcopy_ram(void)
+MultiFDCompression migrate_multifd_compression(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+    return s->parameters.multifd_compression;
 }
 
-bool migrate_postcopy(void)
+int migrate_multifd_zlib_level(void)
 {
-    return migrate_postcopy_ram() || migrate_dirty_bitmaps();
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_zlib_level;
 }
 
-bool migrate_auto_converge(void)
+int migrate_multifd_zstd_level(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+    return s->parameters.multifd_zstd_level;
 }
 
-bool migrate_zero_blocks(void)
+uint64_t migrate_multifd_packet_size(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+    return s->parameters.multifd_packet_size;
 }
 
-bool migrate_postcopy_blocktime(void)
+uint32_t migrate_multifd_zstd_dict_pages(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
+    return s->parameters.multifd_zstd_dict_pages;
 }
 
-bool migrate_use_compression(void)
+int migrate_multifd_qatzip_level(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+    return s->parameters.multifd_qatzip_level;
 }
 
-int migrate_compress_level(void)
+bool migrate_xbzrle_cache_hugetlb(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->parameters.compress_level;
+    return s->parameters.xbzrle_cache_hugetlb;
 }
 
-int migrate_compress_threads(void)
+int64_t migrate_xbzrle_cache_numa_node(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->parameters.compress_threads;
+    return s->parameters.xbzrle_cache_numa_node;
 }
 
-int migrate_compress_wait_thread(void)
+int migrate_dirty_sync_threads(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->parameters.compress_wait_thread;
+    return s->parameters.dirty_sync_threads;
 }
 
-int migrate_decompress_threads(void)
+uint16_t migrate_postcopy_prefetch_window(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->parameters.decompress_threads;
+    return s->parameters.postcopy_prefetch_window;
 }
 
-bool migrate_dirty_bitmaps(void)
+uint16_t migrate_postcopy_place_batch(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS];
+    return s->parameters.postcopy_place_batch;
 }
 
-bool migrate_ignore_shared(void)
+int migrate_load_threads(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
+    return s->parameters.load_threads;
 }
 
-bool migrate_validate_uuid(void)
+CompressMethod migrate_compress_method(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_VALIDATE_UUID];
+    return s->parameters.compress_method;
 }
 
-bool migrate_use_events(void)
+uint64_t migrate_stream_buffer_size(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_EVENTS];
+    return s->parameters.stream_buffer_size;
 }
 
-bool migrate_use_multifd(void)
+uint16_t migrate_stream_iov_max(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+    return s->parameters.stream_iov_max;
 }
 
-bool migrate_pause_before_switchover(void)
+int migrate_colo_flush_threads(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->enabled_capabilities[
-        MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER];
+    return s->parameters.colo_flush_threads;
 }
 
-int migrate_multifd_channels(void)
+uint64_t migrate_block_chunk_size(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->parameters.multifd_channels;
+    return s->parameters.block_chunk_size;
 }
 
-MultiFDCompression migrate_multifd_compression(void)
+int migrate_device_state_threads(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->parameters.multifd_compression;
+    return s->parameters.device_state_threads;
 }
 
-int migrate_multifd_zlib_level(void)
+int migrate_prepopulate_threads(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->parameters.multifd_zlib_level;
+    return s->parameters.prepopulate_threads;
 }
 
-int migrate_multifd_zstd_level(void)
+uint64_t migrate_dirty_heatmap_granularity(void)
 {
     MigrationState *s;
 
     s = migrate_get_current();
 
-    return s->parameters.multifd_zstd_level;
+    return s->parameters.dirty_heatmap_granularity;
 }
 
 int migrate_use_xbzrle(void)
@@ -2534,6 +4027,13 @@ uint64_t migrate_xbzrle_cache_size(void)
     return s->parameters.xbzrle_cache_size;
 }
 
+/* Is xbzrle done by the multifd channels? */
+bool migrate_multifd_xbzrle(void)
+{
+    return migrate_use_multifd() &&
+           migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE;
+}
+
 static int64_t migrate_max_postcopy_bandwidth(void)
 {
     MigrationState *s;
@@ -2600,6 +4100,8 @@ static struct rp_cmd_args {
     [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
     [MIG_RP_MSG_RECV_BITMAP]    = { .len = -1, .name = "RECV_BITMAP" },
     [MIG_RP_MSG_RESUME_ACK]     = { .len =  4, .name = "RESUME_ACK" },
+    [MIG_RP_MSG_DEDUP_MISS]     = { .len = -1, .name = "DEDUP_MISS" },
+    [MIG_RP_MSG_RECV_LOAD]      = { .len = -1, .name = "RECV_LOAD" },
     [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
 };
 
@@ -2677,6 +4179,23 @@ static int migrate_handle_rp_resume_ack(MigrationState *s, uint32_t value)
     return 0;
 }
 
+static void migrate_handle_rp_recv_load(MigrationState *s, int nr,
+                                        const uint8_t *buf)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&s->recv_load_lock);
+    s->recv_load = g_renew(MultiFDRecvChannelLoad, s->recv_load, nr);
+    s->recv_load_nr = nr;
+    s->recv_load_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < nr; i++, buf += RP_RECV_LOAD_LEN) {
+        s->recv_load[i].id = buf[0];
+        s->recv_load[i].queued = ldl_be_p(buf + 1);
+        s->recv_load[i].rate = (uint64_t)ldl_be_p(buf + 5) * KiB;
+        s->recv_load[i].busy = buf[9];
+    }
+}
+
 /*
  * Handles messages sent on the return path towards the source VM
  *
@@ -2686,10 +4205,12 @@ static void *source_return_path_thread(void *opaque)
     MigrationState *ms = opaque;
     QEMUFile *rp = ms->rp_state.from_dst_file;
     uint16_t header_len, header_type;
-    uint8_t buf[512];
+    /* Large enough for the RECV_LOAD of 255 channels */
+    uint8_t buf[1 + UINT8_MAX * RP_RECV_LOAD_LEN];
     uint32_t tmp32, sibling_error;
     ram_addr_t start = 0; /* =0 to silence warning */
     size_t  len = 0, expected_len;
+    int64_t ping_time;
     int res;
 
     trace_source_return_path_thread_entry();
@@ -2755,6 +4276,17 @@ retry:
         case MIG_RP_MSG_PONG:
             tmp32 = ldl_be_p(buf);
             trace_source_return_path_thread_pong(tmp32);
+            ping_time = qatomic_read__nocheck(&ms->ping_time);
+            smp_rmb();
+            if (ping_time && tmp32 == ms->ping_value) {
+                qatomic_set__nocheck(&ms->return_path_latency,
+                                     qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                     ping_time);
+                qatomic_set__nocheck(&ms->ping_time, 0);
+            }
+            if (tmp32 == MIGRATION_DEDUP_PING) {
+                qemu_sem_post(&ms->rp_state.rp_pong_acks);
+            }
             break;
 
         case MIG_RP_MSG_REQ_PAGES:
@@ -2805,6 +4337,31 @@ retry:
             }
             break;
 
+        case MIG_RP_MSG_DEDUP_MISS:
+            /* Format: start (8B) + len (1B) + idstr (<255B) */
+            if (header_len < 9 || header_len != 9 + buf[8]) {
+                error_report("RP: Dedup_Miss with length %d", header_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            start = ldq_be_p(buf);
+            buf[header_len] = '\0';
+            if (ram_dedup_miss((char *)buf + 9, start)) {
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            break;
+
+        case MIG_RP_MSG_RECV_LOAD:
+            if (header_len < 1 ||
+                header_len != 1 + buf[0] * RP_RECV_LOAD_LEN) {
+                error_report("RP: Recv_Load with length %d", header_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            migrate_handle_rp_recv_load(ms, buf[0], buf + 1);
+            break;
+
         default:
             break;
         }
@@ -2856,8 +4413,9 @@ static int open_return_path_on_source(MigrationState *ms,
         return 0;
     }
 
-    qemu_thread_create(&ms->rp_state.rp_thread, "return path",
-                       source_return_path_thread, ms, QEMU_THREAD_JOINABLE);
+    thread_context_create_thread(THREAD_GROUP_MIGRATION,
+                                 &ms->rp_state.rp_thread, "return path",
+                                 source_return_path_thread, ms);
 
     trace_open_return_path_on_source_continue();
 
@@ -2952,11 +4510,7 @@ static int postcopy_start(MigrationState *ms)
      * wrap their state up here
      */
     /* 0 max-postcopy-bandwidth means unlimited */
-    if (!bandwidth) {
-        qemu_file_set_rate_limit(ms->to_dst_file, INT64_MAX);
-    } else {
-        qemu_file_set_rate_limit(ms->to_dst_file, bandwidth / XFER_LIMIT_RATIO);
-    }
+    migration_set_rate_limit(ms, bandwidth);
     if (migrate_postcopy_ram()) {
         /* Ping just for debugging, helps line traces up */
         qemu_savevm_send_ping(ms->to_dst_file, 2);
@@ -3106,6 +4660,29 @@ static int migration_maybe_pause(MigrationState *s,
     return s->state == new_state ? 0 : -EINVAL;
 }
 
+/*
+ * Wait until the destination has looked up all the pages sent by hash,
+ * so that the pages that it asked for are dirty again and sent whole
+ * by the completion.  The ping is answered after the pages before it.
+ */
+static int migration_dedup_drain(MigrationState *s)
+{
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    qemu_savevm_send_ping(s->to_dst_file, MIGRATION_DEDUP_PING);
+    qemu_fflush(s->to_dst_file);
+    while (qemu_sem_timedwait(&s->rp_state.rp_pong_acks, 100)) {
+        if (s->rp_state.error || qemu_file_get_error(s->to_dst_file) ||
+            !s->rp_state.from_dst_file) {
+            error_report("%s: lost the return path", __func__);
+            return -1;
+        }
+    }
+    trace_migration_dedup_drain(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                start);
+    return 0;
+}
+
 /**
  * migration_completion: Used by migration_thread when there's not much left.
  *   The caller 'breaks' the loop when this returns.
@@ -3132,8 +4709,11 @@ static void migration_completion(MigrationState *s)
                 ret = migration_maybe_pause(s, &current_active_state,
                                             MIGRATION_STATUS_DEVICE);
             }
+            if (ret >= 0 && migrate_page_dedup()) {
+                ret = migration_dedup_drain(s);
+            }
             if (ret >= 0) {
-                qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+                migration_set_rate_limit(s, INT64_MAX);
                 ret = qemu_savevm_state_complete_precopy(s->to_dst_file, false,
                                                          inactivate);
             }
@@ -3331,6 +4911,16 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /*
+         * The preempt channel is not recreated on recovery, the pages
+         * requested from now on go through the main channel.
+         */
+        if (s->postcopy_qemufile_src) {
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+            qemu_fclose(s->postcopy_qemufile_src);
+            s->postcopy_qemufile_src = NULL;
+        }
+
         migrate_set_state(&s->state, s->state,
                           MIGRATION_STATUS_POSTCOPY_PAUSED);
 
@@ -3422,7 +5012,8 @@ static MigThrError migration_detect_error(MigrationState *s)
 /* How many bytes have we transferred since the beginning of the migration */
 static uint64_t migration_total_bytes(MigrationState *s)
 {
-    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes;
+    return qemu_ftell(s->to_dst_file) +
+           stat64_get(&ram_atomic_counters.multifd_bytes);
 }
 
 static void migration_calculate_complete(MigrationState *s)
@@ -3457,6 +5048,96 @@ static void update_iteration_initial_status(MigrationState *s)
     s->iteration_initial_pages = ram_get_total_transferred_pages();
 }
 
+/*
+ * Predict the downtime as the time to send what is pending, the RAM
+ * dirtied since the last bitmap sync and the non-iterable device state
+ * at the average bandwidth, plus the final bitmap sync.
+ */
+static void migration_update_downtime_model(MigrationState *s,
+                                            double bandwidth)
+{
+    uint64_t dirtied = ram_bytes_dirtied_since_sync();
+    double sync_time = ram_counters.dirty_sync_time / 1000.0;
+    double threshold;
+
+    if (!s->bandwidth_avg) {
+        s->bandwidth_avg = bandwidth;
+    } else {
+        s->bandwidth_avg += (bandwidth - s->bandwidth_avg) *
+                            MIGRATION_BANDWIDTH_AVG_WEIGHT;
+    }
+    if (!s->bandwidth_avg) {
+        return;
+    }
+
+    s->predicted_downtime = (s->pending_size + dirtied +
+                             s->device_state_size) / s->bandwidth_avg +
+                            sync_time;
+
+    if (migrate_predictive_switchover()) {
+        /*
+         * The pending size is compared right after a bitmap sync, so
+         * nothing has been dirtied since.
+         */
+        threshold = s->bandwidth_avg *
+                    (s->parameters.downtime_limit - sync_time) -
+                    s->device_state_size;
+        s->threshold_size = MAX(threshold, 0);
+    }
+
+    trace_migration_downtime_model(s->bandwidth_avg,
+                                   ram_counters.dirty_sync_time, dirtied,
+                                   s->device_state_size,
+                                   s->predicted_downtime, s->threshold_size);
+}
+
+/*
+ * With multifd-backpressure, when the destination has more bytes queued
+ * than its channels read in BUFFER_DELAY, it is the destination rather
+ * than the network that slows the migration down, and sending faster
+ * only grows its backlog.  Limit the bandwidth under the rate at which
+ * the destination applies the pages then, so the backlog drains, and
+ * lift the limit once it did or when the destination stops reporting.
+ */
+static void migration_update_backpressure(MigrationState *s,
+                                          int64_t current_time)
+{
+    uint64_t queued = 0, rate = 0;
+    int64_t bandwidth;
+    bool backpressure;
+    int i;
+
+    if (!migrate_multifd_backpressure()) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->recv_load_lock) {
+        if (current_time - s->recv_load_time < RECV_LOAD_TIMEOUT) {
+            for (i = 0; i < s->recv_load_nr; i++) {
+                queued += s->recv_load[i].queued;
+                rate += s->recv_load[i].rate;
+            }
+        }
+    }
+    backpressure = rate && queued > rate / 1000 * BUFFER_DELAY;
+    trace_migration_update_backpressure(queued, rate, backpressure);
+    if (!backpressure && !s->recv_backpressure) {
+        return;
+    }
+
+    if (migration_in_postcopy()) {
+        bandwidth = s->parameters.max_postcopy_bandwidth;
+    } else {
+        bandwidth = s->parameters.max_bandwidth;
+    }
+    rate = rate / 10 * 9;
+    if (backpressure && (!bandwidth || rate < bandwidth)) {
+        bandwidth = MAX(rate, 1);
+    }
+    s->recv_backpressure = backpressure;
+    migration_set_rate_limit(s, bandwidth);
+}
+
 static void migration_update_counters(MigrationState *s,
                                       int64_t current_time)
 {
@@ -3474,6 +5155,8 @@ static void migration_update_counters(MigrationState *s,
     bandwidth = (double)transferred / time_spent;
     s->threshold_size = bandwidth * s->parameters.downtime_limit;
 
+    migration_update_downtime_model(s, bandwidth);
+
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
 
@@ -3490,9 +5173,11 @@ static void migration_update_counters(MigrationState *s,
         s->expected_downtime = ram_counters.remaining / bandwidth;
     }
 
+    migration_update_backpressure(s, current_time);
     qemu_file_reset_rate_limit(s->to_dst_file);
 
     update_iteration_initial_status(s);
+    multifd_send_autotune(s);
 
     trace_migrate_transferred(transferred, time_spent,
                               bandwidth, s->threshold_size);
@@ -3505,6 +5190,57 @@ typedef enum {
     MIG_ITERATE_BREAK,          /* Break the loop */
 } MigIterateState;
 
+/*
+ * With postcopy-auto, ask for postcopy after each bitmap sync that
+ * finds precopy unlikely to end soon: when the guest dirtied its RAM
+ * faster than it was sent for postcopy-auto-iterations syncs in a row,
+ * or when sending what is pending at the rate that the bandwidth beats
+ * the dirty rate by would take longer than postcopy-auto-time.  A vCPU
+ * that faults on a page in postcopy waits for a round trip on the return
+ * path, so don't ask while the last one measured is longer than the
+ * downtime limit; each sync pings again for the next decision.
+ */
+static void migration_postcopy_auto(MigrationState *s, uint64_t pend_pre)
+{
+    uint64_t auto_time = s->parameters.postcopy_auto_time;
+    uint32_t auto_iterations = s->parameters.postcopy_auto_iterations;
+    uint64_t dirty_rate, remaining_time = 0;
+    double bandwidth = s->bandwidth_avg;
+    int64_t latency;
+    uint64_t sync_count = stat64_get(&ram_atomic_counters.dirty_sync_count);
+
+    if (!migrate_postcopy_auto() || qatomic_read(&s->start_postcopy) ||
+        sync_count == s->postcopy_auto_sync_count) {
+        return;
+    }
+    s->postcopy_auto_sync_count = sync_count;
+    qemu_savevm_send_ping(s->to_dst_file, MIGRATION_POSTCOPY_AUTO_PING);
+    if (!bandwidth) {
+        return;
+    }
+
+    /* In bytes per ms, as the bandwidth */
+    dirty_rate = ram_counters.dirty_pages_rate * qemu_target_page_size() /
+                 1000;
+    if (dirty_rate >= bandwidth) {
+        s->postcopy_auto_iterations++;
+    } else {
+        s->postcopy_auto_iterations = 0;
+        remaining_time = pend_pre / (bandwidth - dirty_rate);
+    }
+
+    latency = qatomic_read__nocheck(&s->return_path_latency);
+    trace_migration_postcopy_auto(bandwidth, dirty_rate, remaining_time,
+                                  s->postcopy_auto_iterations, latency);
+    if (latency < 0 || latency > s->parameters.downtime_limit * 1000) {
+        return;
+    }
+    if ((auto_iterations && s->postcopy_auto_iterations >= auto_iterations) ||
+        (auto_time && remaining_time > auto_time)) {
+        qatomic_set(&s->start_postcopy, true);
+    }
+}
+
 /*
  * Return true if continue to the next iteration directly, false
  * otherwise.
@@ -3517,12 +5253,16 @@ static MigIterateState migration_iteration_run(MigrationState *s)
     qemu_savevm_state_pending(s->to_dst_file, s->threshold_size, &pend_pre,
                               &pend_compat, &pend_post);
     pending_size = pend_pre + pend_compat + pend_post;
+    s->pending_size = pending_size;
 
     trace_migrate_pending(pending_size, s->threshold_size,
                           pend_pre, pend_compat, pend_post);
 
     if (pending_size && pending_size >= s->threshold_size) {
         /* Still a significant amount to transfer */
+        if (!in_postcopy) {
+            migration_postcopy_auto(s, pend_pre);
+        }
         if (!in_postcopy && pend_pre <= s->threshold_size &&
             qatomic_read(&s->start_postcopy)) {
             if (postcopy_start(s)) {
@@ -3532,6 +5272,9 @@ static MigIterateState migration_iteration_run(MigrationState *s)
         }
         /* Just another iteration step */
         qemu_savevm_state_iterate(s->to_dst_file, in_postcopy);
+        if (!in_postcopy && migrate_early_device_state()) {
+            qemu_savevm_state_early_devices(s->to_dst_file);
+        }
     } else {
         trace_migration_thread_low_pending(pending_size);
         migration_completion(s);
@@ -3547,6 +5290,10 @@ static void migration_iteration_finish(MigrationState *s)
     cpu_throttle_stop();
 
     qemu_mutex_lock_iothread();
+    /* Likewise for the vCPUs that dirty-limit throttled */
+    if (migrate_dirty_limit() && dirtylimit_in_service()) {
+        dirtylimit_set_all(0, false);
+    }
     switch (s->state) {
     case MIGRATION_STATUS_COMPLETED:
         migration_calculate_complete(s);
@@ -3572,7 +5319,13 @@ static void migration_iteration_finish(MigrationState *s)
     case MIGRATION_STATUS_FAILED:
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_CANCELLING:
-        if (s->vm_was_running) {
+        if (s->ram_released) {
+            error_report("migration: the VM can't be resumed, part of its "
+                         "RAM was freed");
+            if (runstate_check(RUN_STATE_FINISH_MIGRATE)) {
+                runstate_set(RUN_STATE_POSTMIGRATE);
+            }
+        } else if (s->vm_was_running) {
             vm_start();
         } else {
             if (runstate_check(RUN_STATE_FINISH_MIGRATE)) {
@@ -3641,6 +5394,34 @@ void migration_consume_urgent_request(void)
     qemu_sem_wait(&migrate_get_current()->rate_limit_sem);
 }
 
+void migration_latency_record(MigrationLatencyStats *stats,
+                              uint64_t latency_us)
+{
+    int bucket = latency_us ? 63 - clz64(latency_us) : 0;
+
+    stats->buckets[MIN(bucket, MIGRATION_LATENCY_BUCKETS - 1)]++;
+    stats->count++;
+    stats->max = MAX(stats->max, latency_us);
+}
+
+MigrationLatencyHistogram *
+migration_latency_histogram(const MigrationLatencyStats *stats)
+{
+    MigrationLatencyHistogram *hist = g_new0(MigrationLatencyHistogram, 1);
+    int i = MIGRATION_LATENCY_BUCKETS - 1;
+
+    hist->count = stats->count;
+    hist->max = stats->max;
+    while (i >= 0 && !stats->buckets[i]) {
+        i--;
+    }
+    for (; i >= 0; i--) {
+        QAPI_LIST_PREPEND(hist->buckets, stats->buckets[i]);
+    }
+
+    return hist;
+}
+
 /* Returns true if the rate limiting was broken by an urgent request */
 bool migration_rate_limit(void)
 {
@@ -3655,10 +5436,13 @@ bool migration_rate_limit(void)
             return false;
         }
         /*
-         * Wait for a delay to do rate limiting OR
+         * Wait until the rate limit lets more through OR
          * something urgent to post the semaphore.
          */
-        int ms = s->iteration_start_time + BUFFER_DELAY - now;
+        int64_t delay = qemu_file_rate_limit_delay(s->to_dst_file);
+        int ms = MIN(DIV_ROUND_UP(delay, SCALE_MS), BUFFER_DELAY);
+        int64_t wait_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
         trace_migration_rate_limit_pre(ms);
         if (qemu_sem_timedwait(&s->rate_limit_sem, ms) == 0) {
             /*
@@ -3671,6 +5455,11 @@ bool migration_rate_limit(void)
             qemu_sem_post(&s->rate_limit_sem);
             urgent = true;
         }
+        if (ms) {
+            s->rate_limit_waits++;
+            s->rate_limit_wait_time +=
+                qemu_clock_get_us(QEMU_CLOCK_REALTIME) - wait_start;
+        }
         trace_migration_rate_limit_post(urgent);
     }
     return urgent;
@@ -3836,7 +5625,7 @@ static void *bg_migration_thread(void *opaque)
     rcu_register_thread();
     object_ref(OBJECT(s));
 
-    qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+    migration_set_rate_limit(s, INT64_MAX);
 
     setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
     /*
@@ -3981,17 +5770,16 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
 
     if (resume) {
         /* This is a resumed migration */
-        rate_limit = s->parameters.max_postcopy_bandwidth /
-            XFER_LIMIT_RATIO;
+        rate_limit = s->parameters.max_postcopy_bandwidth;
     } else {
         /* This is a fresh new migration */
-        rate_limit = s->parameters.max_bandwidth / XFER_LIMIT_RATIO;
+        rate_limit = s->parameters.max_bandwidth;
 
         /* Notify before starting migration thread */
         notifier_list_notify(&migration_state_notifiers, s);
     }
 
-    qemu_file_set_rate_limit(s->to_dst_file, rate_limit);
+    migration_set_rate_limit(s, rate_limit);
     qemu_file_set_blocking(s->to_dst_file, true);
 
     /*
@@ -3999,7 +5787,8 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
      * precopy, only if user specified "return-path" capability would
      * QEMU uses the return path.
      */
-    if (migrate_postcopy_ram() || migrate_use_return_path()) {
+    if (migrate_postcopy_ram() || migrate_use_return_path() ||
+        migrate_page_dedup()) {
         if (open_return_path_on_source(s, !resume)) {
             error_report("Unable to open return-path for postcopy");
             migrate_set_state(&s->state, s->state, MIGRATION_STATUS_FAILED);
@@ -4024,12 +5813,20 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    if (postcopy_preempt_setup(s, &local_err) != 0) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     if (migrate_background_snapshot()) {
-        qemu_thread_create(&s->thread, "bg_snapshot",
-                bg_migration_thread, s, QEMU_THREAD_JOINABLE);
+        thread_context_create_thread(THREAD_GROUP_MIGRATION, &s->thread,
+                                     "bg_snapshot", bg_migration_thread, s);
     } else {
-        qemu_thread_create(&s->thread, "live_migration",
-                migration_thread, s, QEMU_THREAD_JOINABLE);
+        thread_context_create_thread(THREAD_GROUP_MIGRATION, &s->thread,
+                                     "live_migration", migration_thread, s);
     }
     s->migration_thread_running = true;
 }
@@ -4065,6 +5862,10 @@ static Property migration_properties[] = {
                      send_section_footer, true),
     DEFINE_PROP_BOOL("decompress-error-check", MigrationState,
                       decompress_error_check, true),
+    DEFINE_PROP_BOOL("multifd-multi-block", MigrationState,
+                      multifd_multi_block, true),
+    DEFINE_PROP_BOOL("multifd-flush-after-each-section", MigrationState,
+                      multifd_flush_after_each_section, false),
     DEFINE_PROP_UINT8("x-clear-bitmap-shift", MigrationState,
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
 
@@ -4132,6 +5933,75 @@ static Property migration_properties[] = {
     DEFINE_PROP_SIZE("announce-step", MigrationState,
                       parameters.announce_step,
                       DEFAULT_MIGRATE_ANNOUNCE_STEP),
+    DEFINE_PROP_SIZE("multifd-packet-size", MigrationState,
+                      parameters.multifd_packet_size,
+                      DEFAULT_MIGRATE_MULTIFD_PACKET_SIZE),
+    DEFINE_PROP_UINT32("multifd-zstd-dict-pages", MigrationState,
+                      parameters.multifd_zstd_dict_pages,
+                      DEFAULT_MIGRATE_MULTIFD_ZSTD_DICT_PAGES),
+    DEFINE_PROP_UINT8("multifd-qatzip-level", MigrationState,
+                      parameters.multifd_qatzip_level,
+                      DEFAULT_MIGRATE_MULTIFD_QATZIP_LEVEL),
+    DEFINE_PROP_BOOL("xbzrle-cache-hugetlb", MigrationState,
+                      parameters.xbzrle_cache_hugetlb,
+                      false),
+    DEFINE_PROP_INT64("xbzrle-cache-numa-node", MigrationState,
+                      parameters.xbzrle_cache_numa_node,
+                      DEFAULT_MIGRATE_XBZRLE_CACHE_NUMA_NODE),
+    DEFINE_PROP_UINT64("vcpu-dirty-limit", MigrationState,
+                      parameters.vcpu_dirty_limit,
+                      DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT),
+    DEFINE_PROP_UINT8("dirty-sync-threads", MigrationState,
+                      parameters.dirty_sync_threads,
+                      DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
+    DEFINE_PROP_UINT16("postcopy-prefetch-window", MigrationState,
+                      parameters.postcopy_prefetch_window,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW),
+    DEFINE_PROP_UINT16("postcopy-place-batch", MigrationState,
+                      parameters.postcopy_place_batch,
+                      DEFAULT_MIGRATE_POSTCOPY_PLACE_BATCH),
+    DEFINE_PROP_UINT8("load-threads", MigrationState,
+                      parameters.load_threads,
+                      DEFAULT_MIGRATE_LOAD_THREADS),
+    DEFINE_PROP_COMPRESS_METHOD("compress-method", MigrationState,
+                      parameters.compress_method,
+                      DEFAULT_MIGRATE_COMPRESS_METHOD),
+    DEFINE_PROP_SIZE("stream-buffer-size", MigrationState,
+                      parameters.stream_buffer_size,
+                      DEFAULT_MIGRATE_STREAM_BUFFER_SIZE),
+    DEFINE_PROP_UINT16("stream-iov-max", MigrationState,
+                      parameters.stream_iov_max,
+                      DEFAULT_MIGRATE_STREAM_IOV_MAX),
+    DEFINE_PROP_SIZE("max-bandwidth-burst", MigrationState,
+                      parameters.max_bandwidth_burst,
+                      0),
+    DEFINE_PROP_SIZE("rdma-reg-cache-size", MigrationState,
+                      parameters.rdma_reg_cache_size,
+                      0),
+    DEFINE_PROP_UINT8("colo-flush-threads", MigrationState,
+                      parameters.colo_flush_threads,
+                      DEFAULT_MIGRATE_COLO_FLUSH_THREADS),
+    DEFINE_PROP_SIZE("x-checkpoint-budget", MigrationState,
+                      parameters.x_checkpoint_budget,
+                      0),
+    DEFINE_PROP_SIZE("block-chunk-size", MigrationState,
+                      parameters.block_chunk_size,
+                      DEFAULT_MIGRATE_BLOCK_CHUNK_SIZE),
+    DEFINE_PROP_UINT8("device-state-threads", MigrationState,
+                      parameters.device_state_threads,
+                      DEFAULT_MIGRATE_DEVICE_STATE_THREADS),
+    DEFINE_PROP_UINT8("prepopulate-threads", MigrationState,
+                      parameters.prepopulate_threads,
+                      DEFAULT_MIGRATE_PREPOPULATE_THREADS),
+    DEFINE_PROP_SIZE("dirty-heatmap-granularity", MigrationState,
+                      parameters.dirty_heatmap_granularity,
+                      0),
+    DEFINE_PROP_UINT64("postcopy-auto-time", MigrationState,
+                      parameters.postcopy_auto_time,
+                      DEFAULT_MIGRATE_POSTCOPY_AUTO_TIME),
+    DEFINE_PROP_UINT32("postcopy-auto-iterations", MigrationState,
+                      parameters.postcopy_auto_iterations,
+                      DEFAULT_MIGRATE_POSTCOPY_AUTO_ITERATIONS),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -4146,8 +6016,62 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-multifd-zero-page",
+            MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE),
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-multifd-adaptive-packet-size",
+            MIGRATION_CAPABILITY_MULTIFD_ADAPTIVE_PACKET_SIZE),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
+    DEFINE_PROP_MIG_CAP("x-postcopy-hugetlb-minor",
+            MIGRATION_CAPABILITY_POSTCOPY_HUGETLB_MINOR),
+    DEFINE_PROP_MIG_CAP("x-fixed-ram", MIGRATION_CAPABILITY_FIXED_RAM),
+    DEFINE_PROP_MIG_CAP("x-fixed-ram-mmap",
+            MIGRATION_CAPABILITY_FIXED_RAM_MMAP),
+    DEFINE_PROP_MIG_CAP("x-fixed-ram-postcopy",
+            MIGRATION_CAPABILITY_FIXED_RAM_POSTCOPY),
+    DEFINE_PROP_MIG_CAP("x-ram-incremental",
+            MIGRATION_CAPABILITY_RAM_INCREMENTAL),
+    DEFINE_PROP_MIG_CAP("x-predictive-switchover",
+            MIGRATION_CAPABILITY_PREDICTIVE_SWITCHOVER),
+    DEFINE_PROP_MIG_CAP("x-fair-iteration",
+            MIGRATION_CAPABILITY_FAIR_ITERATION),
+    DEFINE_PROP_MIG_CAP("x-ram-cold-first",
+            MIGRATION_CAPABILITY_RAM_COLD_FIRST),
+    DEFINE_PROP_MIG_CAP("x-ram-huge-page-granularity",
+            MIGRATION_CAPABILITY_RAM_HUGE_PAGE_GRANULARITY),
+    DEFINE_PROP_MIG_CAP("x-page-dedup", MIGRATION_CAPABILITY_PAGE_DEDUP),
+    DEFINE_PROP_MIG_CAP("x-rdma-odp", MIGRATION_CAPABILITY_RDMA_ODP),
+    DEFINE_PROP_MIG_CAP("x-rdma-postcopy-pull",
+            MIGRATION_CAPABILITY_RDMA_POSTCOPY_PULL),
+    DEFINE_PROP_MIG_CAP("x-multifd-device-state",
+            MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE),
+    DEFINE_PROP_MIG_CAP("x-dirty-bitmaps-compress",
+            MIGRATION_CAPABILITY_DIRTY_BITMAPS_COMPRESS),
+    DEFINE_PROP_MIG_CAP("x-early-device-state",
+            MIGRATION_CAPABILITY_EARLY_DEVICE_STATE),
+    DEFINE_PROP_MIG_CAP("x-clear-dirty-log-ahead",
+            MIGRATION_CAPABILITY_CLEAR_DIRTY_LOG_AHEAD),
+    DEFINE_PROP_MIG_CAP("x-ram-handover", MIGRATION_CAPABILITY_RAM_HANDOVER),
+    DEFINE_PROP_MIG_CAP("x-multifd-numa-affinity",
+            MIGRATION_CAPABILITY_MULTIFD_NUMA_AFFINITY),
+    DEFINE_PROP_MIG_CAP("x-multifd-autotune",
+            MIGRATION_CAPABILITY_MULTIFD_AUTOTUNE),
+    DEFINE_PROP_MIG_CAP("x-postcopy-compress-bitmap",
+            MIGRATION_CAPABILITY_POSTCOPY_COMPRESS_BITMAP),
+    DEFINE_PROP_MIG_CAP("x-postcopy-discard-bitmap",
+            MIGRATION_CAPABILITY_POSTCOPY_DISCARD_BITMAP),
+    DEFINE_PROP_MIG_CAP("x-stream-compress",
+            MIGRATION_CAPABILITY_STREAM_COMPRESS),
+    DEFINE_PROP_MIG_CAP("x-multifd-crc32c",
+            MIGRATION_CAPABILITY_MULTIFD_CRC32C),
+    DEFINE_PROP_MIG_CAP("x-release-ram-precopy",
+            MIGRATION_CAPABILITY_RELEASE_RAM_PRECOPY),
+    DEFINE_PROP_MIG_CAP("x-multifd-backpressure",
+            MIGRATION_CAPABILITY_MULTIFD_BACKPRESSURE),
+    DEFINE_PROP_MIG_CAP("x-postcopy-auto", MIGRATION_CAPABILITY_POSTCOPY_AUTO),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -4167,14 +6091,21 @@ static void migration_instance_finalize(Object *obj)
 
     qemu_mutex_destroy(&ms->error_mutex);
     qemu_mutex_destroy(&ms->qemu_file_lock);
+    qemu_mutex_destroy(&ms->recv_load_lock);
+    g_free(ms->recv_load);
     g_free(params->tls_hostname);
     g_free(params->tls_creds);
+    g_free(params->page_dedup_store);
+    qapi_free_MultiFDAddressList(params->multifd_addresses);
+    qapi_free_strList(params->dsa_accel_path);
+    g_free(ms->compress_time);
     qemu_sem_destroy(&ms->wait_unplug_sem);
     qemu_sem_destroy(&ms->rate_limit_sem);
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
+    qemu_sem_destroy(&ms->rp_state.rp_pong_acks);
     error_free(ms->error);
 }
 
@@ -4188,6 +6119,7 @@ static void migration_instance_init(Object *obj)
     ms->pages_per_second = -1;
     qemu_sem_init(&ms->pause_sem, 0);
     qemu_mutex_init(&ms->error_mutex);
+    qemu_mutex_init(&ms->recv_load_lock);
 
     params->tls_hostname = g_strdup("");
     params->tls_creds = g_strdup("");
@@ -4215,10 +6147,34 @@ static void migration_instance_init(Object *obj)
     params->has_announce_max = true;
     params->has_announce_rounds = true;
     params->has_announce_step = true;
+    params->has_multifd_packet_size = true;
+    params->has_multifd_zstd_dict_pages = true;
+    params->has_multifd_qatzip_level = true;
+    params->has_xbzrle_cache_hugetlb = true;
+    params->has_xbzrle_cache_numa_node = true;
+    params->has_vcpu_dirty_limit = true;
+    params->has_dirty_sync_threads = true;
+    params->has_postcopy_prefetch_window = true;
+    params->has_postcopy_place_batch = true;
+    params->has_load_threads = true;
+    params->has_compress_method = true;
+    params->has_stream_buffer_size = true;
+    params->has_stream_iov_max = true;
+    params->has_max_bandwidth_burst = true;
+    params->has_rdma_reg_cache_size = true;
+    params->has_colo_flush_threads = true;
+    params->has_x_checkpoint_budget = true;
+    params->has_block_chunk_size = true;
+    params->has_device_state_threads = true;
+    params->has_prepopulate_threads = true;
+    params->has_dirty_heatmap_granularity = true;
+    params->has_postcopy_auto_time = true;
+    params->has_postcopy_auto_iterations = true;
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
+    qemu_sem_init(&ms->rp_state.rp_pong_acks, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
@@ -27,6 +27,10 @@
 struct PostcopyBlocktimeContext;
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
+/* Ping sent before the completion to wait for the dedup lookups */
+#define  MIGRATION_DEDUP_PING        (0x44454450)
+/* Ping sent after each bitmap sync to time the return path for postcopy-auto */
+#define  MIGRATION_POSTCOPY_AUTO_PING (0x50415554)
 
 /*
  * 1<<6=64 pages -> 256K chunk when page size is 4K.  This gives us
@@ -45,6 +49,27 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Channels that carry RAM pages to a postcopy destination: the main
+ * migration stream and, with postcopy-preempt, the channel for the
+ * pages that the destination asked for.
+ */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
+/* Number of buckets of a latency histogram, the last one is open-ended */
+#define MIGRATION_LATENCY_BUCKETS 32
+
+/* Latency histogram with a bucket per power of two microseconds */
+typedef struct MigrationLatencyStats {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[MIGRATION_LATENCY_BUCKETS];
+} MigrationLatencyStats;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -58,6 +83,8 @@ struct MigrationIncomingState {
      * loading state.
      */
     QemuEvent main_thread_load_event;
+    /* Time the main thread spent loading the state, in microseconds */
+    uint64_t load_time;
 
     /* For network announces */
     AnnounceTimer  announce_timer;
@@ -68,6 +95,12 @@ struct MigrationIncomingState {
     QemuSemaphore  fault_thread_sem;
     /* Set this when we want the fault thread to quit */
     bool           fault_thread_quit;
+    /*
+     * The fault thread can read pages from the source RAM with RDMA
+     * and place them itself, so the pages of the stream may be there
+     * already.
+     */
+    bool           postcopy_pull;
 
     bool           have_listen_thread;
     QemuThread     listen_thread;
@@ -81,10 +114,37 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Page request queued by the fault thread but not written yet */
+    struct {
+        RAMBlock *rb;
+        ram_addr_t start;
+        uint32_t len;
+    } rp_req_batch;
+    /* Host pages are assembled here before being placed, one per channel */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
+    /* Runs of pages waiting to be placed together, one per channel */
+    PostcopyPlaceBatch *postcopy_batches[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
+    /* Last RAMBlock received on each channel, for RAM_SAVE_FLAG_CONTINUE */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+    /*
+     * Set once postcopy listens, threads other than the main load
+     * thread must not place pages before.
+     */
+    QemuEvent postcopy_listen_event;
+
+    /* With postcopy-preempt, the channel for the pages that we asked for */
+    QEMUFile *postcopy_qemufile_dst;
+    bool      have_preempt_thread;
+    QemuThread preempt_thread;
+    /* Set when the preempt thread is stopped before the end of the stream */
+    bool      preempt_thread_quit;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
+    /* With postcopy-discard-bitmap, the range to discard that may grow */
+    char     *postcopy_discard_ramid;
+    uint64_t  postcopy_discard_start;
+    uint64_t  postcopy_discard_length;
 
     QEMUBH *bh;
 
@@ -114,6 +174,8 @@ struct MigrationIncomingState {
     GTree *page_requested;
     /* For debugging purpose only, but would be nice to keep */
     int page_requested_count;
+    /* Time from the request of a page to its placement */
+    MigrationLatencyStats postcopy_fault_latency;
     /*
      * The mutex helps to maintain the requested pages that we sent to the
      * source, IOW, to guarantee coherent between the page_requests tree and
@@ -123,7 +185,8 @@ struct MigrationIncomingState {
      * for that page already.  This is intended so that the mutex won't
      * serialize and blocked by slow operations like UFFDIO_* ioctls.  However
      * this should be enough to make sure the page_requested tree always
-     * contains valid information.
+     * contains valid information.  It also protects
+     * postcopy_fault_latency.
      */
     QemuMutex page_request_mutex;
 };
@@ -155,6 +218,11 @@ struct MigrationState {
     QEMUBH *vm_start_bh;
     QEMUBH *cleanup_bh;
     QEMUFile *to_dst_file;
+    /*
+     * With postcopy-preempt, pages requested by the destination go
+     * through this channel.  Only used by the migration thread.
+     */
+    QEMUFile *postcopy_qemufile_src;
     QIOChannelBuffer *bioc;
     /*
      * Protects to_dst_file pointer.  We need to make sure we won't
@@ -196,6 +264,8 @@ struct MigrationState {
         QemuThread    rp_thread;
         bool          error;
         QemuSemaphore rp_sem;
+        /* posted on each pong to a MIGRATION_DEDUP_PING */
+        QemuSemaphore rp_pong_acks;
     } rp_state;
 
     double mbps;
@@ -207,6 +277,46 @@ struct MigrationState {
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+    /* Times the migration thread waited for the rate limit, and for how long */
+    uint64_t rate_limit_waits;
+    uint64_t rate_limit_wait_time;
+    /*
+     * Where the time of the migration goes, in microseconds; see
+     * MigrationTimings.  Each of them is only added to by one thread.
+     */
+    uint64_t bitmap_sync_time;
+    uint64_t multifd_send_wait_time;
+    uint64_t flush_time;
+    uint64_t device_state_time;
+    /* One per compression thread or multifd channel */
+    uint64_t *compress_time;
+    int compress_channels;
+    /* Ping waiting for its pong, and when it was sent (us), or 0 */
+    uint32_t ping_value;
+    int64_t ping_time;
+    /* Round trip of the last ping on the return path (us), or -1 */
+    int64_t return_path_latency;
+    /*
+     * Last load of the destination channels for multifd-backpressure,
+     * and when it was received (ms), or 0
+     */
+    QemuMutex recv_load_lock;
+    MultiFDRecvChannelLoad *recv_load;
+    int recv_load_nr;
+    int64_t recv_load_time;
+    /* The bandwidth is limited because of the backlog of the destination */
+    bool recv_backpressure;
+    /* Downtime (ms) predicted from the model, see predicted-downtime */
+    int64_t predicted_downtime;
+    /* Moving average of the bandwidth, in bytes/ms */
+    double bandwidth_avg;
+    /* Data the iterative devices still had to send at the last check */
+    uint64_t pending_size;
+    /*
+     * Size of the non-iterable device state of the last migration or
+     * snapshot, kept between them
+     */
+    uint64_t device_state_size;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
     /*
@@ -215,9 +325,20 @@ struct MigrationState {
      * running the guest on source.
      */
     bool vm_was_running;
+    /*
+     * Whether some RAM was freed after the VM was stopped, so that it
+     * can't be resumed on the source.
+     */
+    bool ram_released;
 
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
+    /*
+     * For postcopy-auto, the bitmap sync that it last looked at, and how
+     * many of them in a row found the RAM dirtied faster than it is sent
+     */
+    uint64_t postcopy_auto_sync_count;
+    uint32_t postcopy_auto_iterations;
     /* Flag set after postcopy has sent the device state */
     bool postcopy_after_devices;
 
@@ -273,6 +394,18 @@ struct MigrationState {
      */
     bool decompress_error_check;
 
+    /*
+     * Whether multifd packets can carry pages from several RAMBlocks.
+     * Destinations older than 6.1 only understand single block packets.
+     */
+    bool multifd_multi_block;
+    /*
+     * Whether the multifd channels are synced at the end of each RAM
+     * section, as destinations older than 6.1 expect, rather than only
+     * after the bitmap syncs.
+     */
+    bool multifd_flush_after_each_section;
+
     /*
      * This decides the size of guest memory chunk that will be used
      * to track dirty bitmap clearing.  The size of memory chunk will
@@ -311,6 +444,8 @@ void migrate_init(MigrationState *s);
 bool migration_is_blocked(Error **errp);
 /* True if outgoing migration has entered postcopy phase */
 bool migration_in_postcopy(void);
+void migration_add_time(uint64_t *time, int64_t start_us);
+void migration_add_compress_time(int channel, int64_t start_us);
 MigrationState *migrate_get_current(void);
 
 bool migrate_postcopy(void);
@@ -324,14 +459,67 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_multifd_zero_page(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_use_tls(void);
 bool migrate_pause_before_switchover(void);
+bool migrate_multifd_adaptive_packet_size(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_dirty_limit(void);
+bool migrate_postcopy_hugetlb_minor(void);
+bool migrate_fixed_ram(void);
+bool migrate_fixed_ram_mmap(void);
+bool migrate_fixed_ram_postcopy(void);
+bool migrate_ram_incremental(void);
+bool migrate_predictive_switchover(void);
+bool migrate_fair_iteration(void);
+bool migrate_ram_cold_first(void);
+bool migrate_ram_huge_page_granularity(void);
+bool migrate_page_dedup(void);
+const char *migrate_page_dedup_store(void);
+bool migrate_multifd_device_state(void);
+bool migrate_dirty_bitmaps_compress(void);
+bool migrate_early_device_state(void);
+bool migrate_clear_dirty_log_ahead(void);
+bool migrate_ram_handover(void);
+bool migrate_multifd_numa_affinity(void);
+bool migrate_multifd_autotune(void);
+bool migrate_postcopy_compress_bitmap(void);
+bool migrate_postcopy_discard_bitmap(void);
+bool migrate_stream_compress(void);
+bool migrate_multifd_crc32c(void);
+bool migrate_release_ram_precopy(void);
+bool migrate_multifd_flush_after_each_section(void);
+bool migrate_multifd_backpressure(void);
+bool migrate_postcopy_auto(void);
 int migrate_multifd_channels(void);
+MultiFDAddress *migrate_multifd_address(int id);
+const strList *migrate_dsa_accel_path(void);
+int migrate_multifd_channel_weight(int id);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+uint64_t migrate_dirty_heatmap_granularity(void);
+int migrate_prepopulate_threads(void);
+int migrate_device_state_threads(void);
+uint64_t migrate_block_chunk_size(void);
+int migrate_colo_flush_threads(void);
+uint16_t migrate_stream_iov_max(void);
+uint64_t migrate_stream_buffer_size(void);
+CompressMethod migrate_compress_method(void);
+int migrate_load_threads(void);
+uint16_t migrate_postcopy_place_batch(void);
+uint16_t migrate_postcopy_prefetch_window(void);
+int migrate_dirty_sync_threads(void);
+int64_t migrate_xbzrle_cache_numa_node(void);
+bool migrate_xbzrle_cache_hugetlb(void);
+int migrate_multifd_qatzip_level(void);
+uint32_t migrate_multifd_zstd_dict_pages(void);
+uint64_t migrate_multifd_packet_size(void);
 
 int migrate_use_xbzrle(void);
 uint64_t migrate_xbzrle_cache_size(void);
+bool migrate_multifd_xbzrle(void);
 bool migrate_colo_enabled(void);
 
 bool migrate_use_block(void);
@@ -359,9 +547,16 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
                                       RAMBlock *rb, ram_addr_t start);
+int migrate_queue_rp_req_pages(MigrationIncomingState *mis,
+                               RAMBlock *rb, ram_addr_t start);
+int migrate_flush_rp_req_pages(MigrationIncomingState *mis);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
+int migrate_send_rp_dedup_miss(MigrationIncomingState *mis,
+                               RAMBlock *rb, ram_addr_t start);
+void migrate_send_rp_recv_load(MigrationIncomingState *mis,
+                               const MultiFDRecvChannelLoad *load, int nr);
 
 void dirty_bitmap_mig_before_vm_start(void);
 void dirty_bitmap_mig_cancel_outgoing(void);
@@ -381,6 +576,11 @@ void migration_consume_urgent_request(void);
 bool migration_rate_limit(void);
 void migration_cancel(void);
 
+void migration_latency_record(MigrationLatencyStats *stats,
+                              uint64_t latency_us);
+MigrationLatencyHistogram *
+migration_latency_histogram(const MigrationLatencyStats *stats);
+
 void populate_vfio_info(MigrationInfo *info);
 
 #endif
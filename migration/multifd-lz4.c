@@ -0,0 +1,286 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/bswap.h"
+#include "qemu/rcu.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each page is compressed on its own, so that lz4 never looks back
+ * into guest memory that may have changed since it was compressed.
+ * The packet has, for each page, its compressed size as a big endian
+ * uint32_t followed by the compressed data.  Pages that don't get
+ * smaller are sent uncompressed, with the page size as their size.
+ */
+
+struct lz4_data {
+    /* lz4 state for compression */
+    void *state;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+/* Multifd lz4 compression */
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Setup each channel with lz4 compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = multifd_packet_page_count();
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->state = g_try_malloc(LZ4_sizeofState());
+    /* We will never have more than page_count pages */
+    z->zbuff_len = page_count * (sizeof(uint32_t) + qemu_target_page_size());
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->state || !z->zbuff) {
+        g_free(z->state);
+        g_free(z->zbuff);
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+
+    g_free(z->state);
+    z->state = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare date to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    struct lz4_data *z = p->data;
+    uint8_t *out = z->zbuff;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        int len;
+
+        /* anything that doesn't fit in less than a page is sent as is */
+        len = LZ4_compress_fast_extState(z->state, iov[i].iov_base,
+                                         (char *)out + sizeof(uint32_t),
+                                         iov[i].iov_len, iov[i].iov_len - 1,
+                                         1);
+        if (len <= 0) {
+            memcpy(out + sizeof(uint32_t), iov[i].iov_base, iov[i].iov_len);
+            len = iov[i].iov_len;
+        }
+        stl_be_p(out, len);
+        out += sizeof(uint32_t) + len;
+    }
+    p->next_packet_size = out - z->zbuff;
+    multifd_send_data_crc(p, z->zbuff, p->next_packet_size);
+    p->flags |= MULTIFD_FLAG_LZ4;
+
+    return 0;
+}
+
+/**
+ * lz4_send_write: do the actual write of the data
+ *
+ * Do the actual write of the comprresed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct lz4_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Create the compressed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = multifd_packet_page_count();
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    /* We will never have more than page_count pages */
+    z->zbuff_len = page_count * (sizeof(uint32_t) + qemu_target_page_size());
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: setup receive side
+ *
+ * Return the memory of the compressed buffer.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->data;
+
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct lz4_data *z = p->data;
+    uint8_t *in, *end;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %d: packet size received %d bigger than %d",
+                   p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+    if (multifd_recv_check_data_crc(p, z->zbuff, in_size, errp)) {
+        return -1;
+    }
+
+    in = z->zbuff;
+    end = z->zbuff + in_size;
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        uint32_t len;
+
+        if (end - in < sizeof(uint32_t)) {
+            error_setg(errp, "multifd %d: packet too short for %d pages",
+                       p->id, used);
+            return -1;
+        }
+        len = ldl_be_p(in);
+        in += sizeof(uint32_t);
+        if (len > end - in || len > iov->iov_len) {
+            error_setg(errp, "multifd %d: invalid compressed page size %d",
+                       p->id, len);
+            return -1;
+        }
+
+        if (len == iov->iov_len) {
+            memcpy(iov->iov_base, in, len);
+        } else {
+            ret = LZ4_decompress_safe((char *)in, iov->iov_base, len,
+                                      iov->iov_len);
+            if (ret != iov->iov_len) {
+                error_setg(errp, "multifd %d: lz4 decompression of page %d "
+                           "failed with %d", p->id, i, ret);
+                return -1;
+            }
+        }
+        in += len;
+    }
+    if (in != end) {
+        error_setg(errp, "multifd %d: packet size received %d size used %td",
+                   p->id, in_size, in - z->zbuff);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .send_write = lz4_send_write,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
@@ -0,0 +1,317 @@
+/*
+ * Multifd QATzip compression implementation
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <qatzip.h>
+#include "qemu/iov.h"
+#include "qemu/rcu.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * QATzip offloads deflate to Intel QuickAssist devices.  Each packet
+ * is compressed with a single request from a buffer pinned for DMA,
+ * and the channel thread polls the device for its completion instead
+ * of compressing the pages itself.  If no device is available the
+ * library falls back to software compression.
+ */
+
+struct qatzip_data {
+    /* QATzip session, one per channel */
+    QzSession_T sess;
+    /* pinned buffer where the pages are gathered (send) or inflated (recv) */
+    uint8_t *in_buf;
+    /* size of in_buf */
+    uint32_t in_len;
+    /* pinned buffer for the compressed data */
+    uint8_t *out_buf;
+    /* size of out_buf */
+    uint32_t out_len;
+};
+
+static int qatzip_setup(QzSession_T *sess, uint8_t id, Error **errp)
+{
+    QzSessionParamsDeflate_T params;
+    int ret;
+
+    /* sw_backup: compress in software when no device can take the job */
+    ret = qzInit(sess, true);
+    if (ret != QZ_OK && ret != QZ_DUPLICATE) {
+        error_setg(errp, "multifd %d: qzInit failed with error %d", id, ret);
+        return -1;
+    }
+
+    ret = qzGetDefaultsDeflate(&params);
+    if (ret != QZ_OK) {
+        error_setg(errp, "multifd %d: qzGetDefaultsDeflate failed with "
+                   "error %d", id, ret);
+        return -1;
+    }
+    params.common_params.comp_lvl = migrate_multifd_qatzip_level();
+    params.common_params.sw_backup = true;
+    /* Each packet is compressed in a single request */
+    params.common_params.hw_buff_sz = QZ_HW_BUFF_MAX_SZ;
+
+    ret = qzSetupSessionDeflate(sess, &params);
+    if (ret != QZ_OK && ret != QZ_DUPLICATE) {
+        error_setg(errp, "multifd %d: qzSetupSessionDeflate failed with "
+                   "error %d", id, ret);
+        return -1;
+    }
+    return 0;
+}
+
+static void qatzip_data_free(struct qatzip_data *q)
+{
+    qzTeardownSession(&q->sess);
+    qzClose(&q->sess);
+    if (q->in_buf) {
+        qzFree(q->in_buf);
+    }
+    if (q->out_buf) {
+        qzFree(q->out_buf);
+    }
+    g_free(q);
+}
+
+/* Multifd QATzip compression */
+
+/**
+ * qatzip_send_setup: setup send side
+ *
+ * Setup each channel with a QATzip session and its pinned buffers.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int qatzip_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = multifd_packet_page_count();
+    struct qatzip_data *q = g_new0(struct qatzip_data, 1);
+
+    if (qatzip_setup(&q->sess, p->id, errp) < 0) {
+        qatzip_data_free(q);
+        return -1;
+    }
+
+    /* We will never have more than page_count pages */
+    q->in_len = page_count * qemu_target_page_size();
+    q->in_buf = qzMalloc(q->in_len, 0, PINNED_MEM);
+    q->out_len = qzMaxCompressedLength(q->in_len, &q->sess);
+    q->out_buf = qzMalloc(q->out_len, 0, PINNED_MEM);
+    if (!q->in_buf || !q->out_buf) {
+        qatzip_data_free(q);
+        error_setg(errp, "multifd %d: out of pinned memory for buffers",
+                   p->id);
+        return -1;
+    }
+    p->data = q;
+    return 0;
+}
+
+/**
+ * qatzip_send_cleanup: cleanup send side
+ *
+ * Close the session and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void qatzip_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    qatzip_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * qatzip_send_prepare: prepare date to be able to send
+ *
+ * Gather the pages in the pinned buffer and compress them with a
+ * single request.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ */
+static int qatzip_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    struct qatzip_data *q = p->data;
+    unsigned int size, in_len, out_len;
+    int ret;
+
+    size = iov_to_buf(iov, used, 0, q->in_buf, q->in_len);
+    in_len = size;
+    out_len = q->out_len;
+    ret = qzCompress(&q->sess, q->in_buf, &in_len, q->out_buf, &out_len, 1);
+    if (ret != QZ_OK) {
+        error_setg(errp, "multifd %d: qzCompress failed with error %d",
+                   p->id, ret);
+        return -1;
+    }
+    if (in_len != size) {
+        error_setg(errp, "multifd %d: qzCompress only took %u of %u bytes",
+                   p->id, in_len, size);
+        return -1;
+    }
+    p->next_packet_size = out_len;
+    multifd_send_data_crc(p, q->out_buf, p->next_packet_size);
+    p->flags |= MULTIFD_FLAG_QATZIP;
+
+    return 0;
+}
+
+/**
+ * qatzip_send_write: do the actual write of the data
+ *
+ * Do the actual write of the comprresed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int qatzip_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    struct qatzip_data *q = p->data;
+
+    return qio_channel_write_all(p->c, (void *)q->out_buf,
+                                 p->next_packet_size, errp);
+}
+
+/**
+ * qatzip_recv_setup: setup receive side
+ *
+ * Create the QATzip session and its pinned buffers.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int qatzip_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = multifd_packet_page_count();
+    struct qatzip_data *q = g_new0(struct qatzip_data, 1);
+
+    if (qatzip_setup(&q->sess, p->id, errp) < 0) {
+        qatzip_data_free(q);
+        return -1;
+    }
+
+    /* We will never have more than page_count pages */
+    q->in_len = page_count * qemu_target_page_size();
+    q->in_buf = qzMalloc(q->in_len, 0, PINNED_MEM);
+    q->out_len = qzMaxCompressedLength(q->in_len, &q->sess);
+    q->out_buf = qzMalloc(q->out_len, 0, PINNED_MEM);
+    if (!q->in_buf || !q->out_buf) {
+        qatzip_data_free(q);
+        error_setg(errp, "multifd %d: out of pinned memory for buffers",
+                   p->id);
+        return -1;
+    }
+    p->data = q;
+    return 0;
+}
+
+/**
+ * qatzip_recv_cleanup: cleanup receive side
+ *
+ * Close the session and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void qatzip_recv_cleanup(MultiFDRecvParams *p)
+{
+    qatzip_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * qatzip_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, decompress it with a single request and
+ * copy the result into the actual pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int qatzip_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t expected_size = used * qemu_target_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct qatzip_data *q = p->data;
+    unsigned int src_len, dst_len;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_QATZIP) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_QATZIP);
+        return -1;
+    }
+    if (in_size > q->out_len) {
+        error_setg(errp, "multifd %d: packet size received %d bigger than %d",
+                   p->id, in_size, q->out_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)q->out_buf, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+    if (multifd_recv_check_data_crc(p, q->out_buf, in_size, errp)) {
+        return -1;
+    }
+
+    src_len = in_size;
+    dst_len = q->in_len;
+    ret = qzDecompress(&q->sess, q->out_buf, &src_len, q->in_buf, &dst_len);
+    if (ret != QZ_OK) {
+        error_setg(errp, "multifd %d: qzDecompress failed with error %d",
+                   p->id, ret);
+        return -1;
+    }
+    if (dst_len != expected_size) {
+        error_setg(errp, "multifd %d: packet size received %d size expected %d",
+                   p->id, dst_len, expected_size);
+        return -1;
+    }
+    iov_from_buf(p->pages->iov, used, 0, q->in_buf, dst_len);
+    return 0;
+}
+
+static MultiFDMethods multifd_qatzip_ops = {
+    .send_setup = qatzip_send_setup,
+    .send_cleanup = qatzip_send_cleanup,
+    .send_prepare = qatzip_send_prepare,
+    .send_write = qatzip_send_write,
+    .recv_setup = qatzip_recv_setup,
+    .recv_cleanup = qatzip_recv_cleanup,
+    .recv_pages = qatzip_recv_pages
+};
+
+static void multifd_qatzip_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_QATZIP, &multifd_qatzip_ops);
+}
+
+migration_init(multifd_qatzip_register);
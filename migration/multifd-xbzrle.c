@@ -0,0 +1,542 @@
+/*
+ * Multifd xbzrle compression implementation
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * The packet has, for each page, its size as a big endian uint32_t
+ * followed by the data.  A size of zero means that the page hasn't
+ * changed since it was sent last, the page size that it is sent as
+ * is, and anything in between that the data is the xbzrle encoding
+ * of the difference with the page that was sent last.
+ *
+ * The copies of the pages that were sent last are kept in a cache
+ * that is split in one shard per channel, each one with its own
+ * lock.  Groups of MULTIFD_XBZRLE_SHARD_PAGES consecutive pages go
+ * to the same shard, so the pages of a batch mostly hit one shard
+ * and two channels only contend when they send pages that are close.
+ * Any channel can send any page, the batches are still given to the
+ * first channel that is free.
+ *
+ * A page is sent at most once between two multifd syncs, and the
+ * destination has written every page of the previous round before
+ * the sync finishes, so the page the destination applies a
+ * difference to is always the copy that we have in the cache.
+ */
+
+/* consecutive pages that go to the same shard */
+#define MULTIFD_XBZRLE_SHARD_PAGES 64
+
+typedef struct {
+    /* protects cache */
+    QemuMutex lock;
+    PageCache *cache;
+} XBZRLEShard;
+
+/* state shared by all the send channels */
+typedef struct {
+    /* channels that have been setup */
+    int users;
+    uint32_t nr_shards;
+    XBZRLEShard *shards;
+    /* inserted in the cache for pages that are sent as zero pages */
+    uint8_t *zero_page;
+    /* protects the updates of xbzrle_counters */
+    QemuMutex stats_lock;
+} XBZRLEState;
+
+static XBZRLEState *xbzrle_state;
+
+struct xbzrle_data {
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+    /* copy of the page being encoded, the guest can change the page */
+    uint8_t *current_buf;
+};
+
+typedef struct {
+    uint64_t cache_miss;
+    uint64_t pages;
+    uint64_t bytes;
+    uint64_t overflow;
+} XBZRLESendStats;
+
+static void xbzrle_state_fini(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < xbzrle_state->nr_shards; i++) {
+        cache_fini(xbzrle_state->shards[i].cache);
+        qemu_mutex_destroy(&xbzrle_state->shards[i].lock);
+    }
+    qemu_mutex_destroy(&xbzrle_state->stats_lock);
+    g_free(xbzrle_state->shards);
+    g_free(xbzrle_state->zero_page);
+    g_free(xbzrle_state);
+    xbzrle_state = NULL;
+}
+
+static int xbzrle_state_init(Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t nr_shards = migrate_multifd_channels();
+    uint64_t shard_size = migrate_xbzrle_cache_size() / nr_shards;
+    uint32_t i;
+
+    if (shard_size < page_size) {
+        error_setg(errp, "multifd: xbzrle-cache-size is too small for "
+                   "%u channels", nr_shards);
+        return -1;
+    }
+    /* the caches need a power of two number of pages */
+    shard_size = pow2floor(shard_size);
+
+    xbzrle_state = g_new0(XBZRLEState, 1);
+    xbzrle_state->shards = g_new0(XBZRLEShard, nr_shards);
+    for (i = 0; i < nr_shards; i++) {
+        XBZRLEShard *shard = &xbzrle_state->shards[i];
+
+        shard->cache = cache_init(shard_size, page_size,
+                                  migrate_xbzrle_cache_hugetlb(),
+                                  migrate_xbzrle_cache_numa_node(), errp);
+        if (!shard->cache) {
+            break;
+        }
+        qemu_mutex_init(&shard->lock);
+        xbzrle_state->nr_shards++;
+    }
+    qemu_mutex_init(&xbzrle_state->stats_lock);
+    xbzrle_state->zero_page = g_malloc0(page_size);
+
+    if (xbzrle_state->nr_shards != nr_shards) {
+        xbzrle_state_fini();
+        return -1;
+    }
+    trace_multifd_xbzrle_setup(nr_shards, shard_size);
+    return 0;
+}
+
+/*
+ * xbzrle_shard: shard of a page
+ *
+ * Returns the shard for the page at ram address @addr and stores in
+ * @key the address to look it up in the cache of the shard.  The
+ * bits that select the shard are taken out of the address so that
+ * every entry of the cache of the shard can be used.
+ */
+static XBZRLEShard *xbzrle_shard(ram_addr_t addr, uint64_t *key)
+{
+    uint64_t page = addr >> qemu_target_page_bits();
+    uint64_t group = page / MULTIFD_XBZRLE_SHARD_PAGES;
+    uint32_t nr_shards = xbzrle_state->nr_shards;
+
+    page = (group / nr_shards) * MULTIFD_XBZRLE_SHARD_PAGES +
+           page % MULTIFD_XBZRLE_SHARD_PAGES;
+    *key = page << qemu_target_page_bits();
+    return &xbzrle_state->shards[group % nr_shards];
+}
+
+/*
+ * Until the end of the first round nearly every page would miss the
+ * cache, so like the xbzrle capability only start after it.
+ *
+ * dirty_sync_count only changes when the bitmap is synced, and that
+ * only happens after a multifd sync, when no channel is sending.
+ */
+static bool xbzrle_enabled(uint64_t age)
+{
+    return age > 1;
+}
+
+/**
+ * xbzrle_save_page: encode a page
+ *
+ * Returns the size of the data written to @out: 0 if the page is
+ * the same that was sent last, the page size if the page is sent as
+ * is, or the size of the xbzrle encoding otherwise.
+ *
+ * @x: send data of the channel
+ * @addr: ram address of the page
+ * @host: the page
+ * @out: where to write the data
+ * @age: current bitmap generation
+ * @stats: where to account the page
+ */
+static uint32_t xbzrle_save_page(struct xbzrle_data *x, ram_addr_t addr,
+                                 uint8_t *host, uint8_t *out, uint64_t age,
+                                 XBZRLESendStats *stats)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t key;
+    XBZRLEShard *shard = xbzrle_shard(addr, &key);
+    uint8_t *prev;
+    int len;
+
+    QEMU_LOCK_GUARD(&shard->lock);
+
+    if (!cache_is_cached(shard->cache, key, age)) {
+        stats->cache_miss++;
+        if (cache_insert(shard->cache, key, host, age) == 0) {
+            /* send what we cached, not what the guest has now */
+            host = get_cached_data(shard->cache, key);
+        }
+        memcpy(out, host, page_size);
+        return page_size;
+    }
+
+    stats->pages++;
+    prev = get_cached_data(shard->cache, key);
+    memcpy(x->current_buf, host, page_size);
+    /* anything that is not smaller than the page is sent as is */
+    len = xbzrle_encode_buffer(prev, x->current_buf, page_size, out,
+                               page_size - 1);
+    if (len == 0) {
+        trace_multifd_xbzrle_skipping(addr);
+        return 0;
+    }
+
+    /* the destination will have the page that we are sending */
+    memcpy(prev, x->current_buf, page_size);
+    if (len < 0) {
+        trace_multifd_xbzrle_overflow(addr);
+        stats->overflow++;
+        stats->bytes += page_size;
+        memcpy(out, x->current_buf, page_size);
+        return page_size;
+    }
+    stats->bytes += sizeof(uint32_t) + len;
+    return len;
+}
+
+/* Multifd xbzrle compression */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Setup each channel with its buffers, the first one also allocates
+ * the cache that all of them share.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = multifd_packet_page_count();
+    size_t page_size = qemu_target_page_size();
+    struct xbzrle_data *x;
+
+    if (!xbzrle_state && xbzrle_state_init(errp) < 0) {
+        return -1;
+    }
+
+    x = g_new0(struct xbzrle_data, 1);
+    /* We will never have more than page_count pages */
+    x->zbuff_len = page_count * (sizeof(uint32_t) + page_size);
+    x->zbuff = g_try_malloc(x->zbuff_len);
+    x->current_buf = g_try_malloc(page_size);
+    if (!x->zbuff || !x->current_buf) {
+        g_free(x->zbuff);
+        g_free(x->current_buf);
+        g_free(x);
+        if (!xbzrle_state->users) {
+            xbzrle_state_fini();
+        }
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    xbzrle_state->users++;
+    p->data = x;
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Return the memory of the channel, and the cache once the last
+ * channel is gone.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    if (!x) {
+        return;
+    }
+    g_free(x->zbuff);
+    g_free(x->current_buf);
+    g_free(x);
+    p->data = NULL;
+
+    if (!--xbzrle_state->users) {
+        xbzrle_state_fini();
+    }
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Encode each page against the copy that was sent last.  During
+ * postcopy the destination places whole pages, so they are sent as
+ * is.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    struct xbzrle_data *x = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint64_t age = stat64_get(&ram_atomic_counters.dirty_sync_count);
+    bool use_cache = xbzrle_enabled(age) &&
+                     !(p->flags & MULTIFD_FLAG_POSTCOPY);
+    XBZRLESendStats stats = {};
+    uint8_t *out = x->zbuff;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        uint8_t *host = pages->iov[i].iov_base;
+        uint32_t len = page_size;
+
+        if (use_cache) {
+            RAMBlock *block = multifd_pages_block(pages, i);
+
+            len = xbzrle_save_page(x, block->offset + pages->offset[i], host,
+                                   out + sizeof(uint32_t), age, &stats);
+        } else {
+            memcpy(out + sizeof(uint32_t), host, page_size);
+        }
+        stl_be_p(out, len);
+        out += sizeof(uint32_t) + len;
+    }
+    p->next_packet_size = out - x->zbuff;
+    multifd_send_data_crc(p, x->zbuff, p->next_packet_size);
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    if (use_cache) {
+        QEMU_LOCK_GUARD(&xbzrle_state->stats_lock);
+        xbzrle_counters.cache_miss += stats.cache_miss;
+        xbzrle_counters.pages += stats.pages;
+        xbzrle_counters.bytes += stats.bytes;
+        xbzrle_counters.overflow += stats.overflow;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_send_write: do the actual write of the data
+ *
+ * Do the actual write of the encoded buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    return qio_channel_write_all(p->c, (void *)x->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * xbzrle_send_zero_page: a page was sent as a zero page
+ *
+ * Insert a zero page in the cache, otherwise a previous (now 0'd)
+ * cached page would be stale, and so that when a small write is made
+ * into the 0'd page it gets xbzrle sent.
+ *
+ * @block: block of the page
+ * @offset: offset of the page inside the block
+ */
+static void xbzrle_send_zero_page(RAMBlock *block, ram_addr_t offset)
+{
+    uint64_t age = stat64_get(&ram_atomic_counters.dirty_sync_count);
+    XBZRLEShard *shard;
+    uint64_t key;
+
+    if (!xbzrle_state || !xbzrle_enabled(age)) {
+        return;
+    }
+    shard = xbzrle_shard(block->offset + offset, &key);
+    QEMU_LOCK_GUARD(&shard->lock);
+    cache_insert(shard->cache, key, xbzrle_state->zero_page, age);
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the compressed buffer.  The destination doesn't need a
+ * cache, the differences are applied to the guest pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = multifd_packet_page_count();
+    struct xbzrle_data *x = g_new0(struct xbzrle_data, 1);
+
+    /* We will never have more than page_count pages */
+    x->zbuff_len = page_count * (sizeof(uint32_t) + qemu_target_page_size());
+    x->zbuff = g_try_malloc(x->zbuff_len);
+    if (!x->zbuff) {
+        g_free(x);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = x;
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: setup receive side
+ *
+ * Return the memory of the compressed buffer.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *x = p->data;
+
+    g_free(x->zbuff);
+    x->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the encoded buffer, and apply each difference to its page.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct xbzrle_data *x = p->data;
+    uint8_t *in, *end;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > x->zbuff_len) {
+        error_setg(errp, "multifd %d: packet size received %d bigger than %d",
+                   p->id, in_size, x->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)x->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+    if (multifd_recv_check_data_crc(p, x->zbuff, in_size, errp)) {
+        return -1;
+    }
+
+    in = x->zbuff;
+    end = x->zbuff + in_size;
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        uint32_t len;
+
+        if (end - in < sizeof(uint32_t)) {
+            error_setg(errp, "multifd %d: packet too short for %d pages",
+                       p->id, used);
+            return -1;
+        }
+        len = ldl_be_p(in);
+        in += sizeof(uint32_t);
+        if (len > end - in || len > iov->iov_len) {
+            error_setg(errp, "multifd %d: invalid encoded page size %d",
+                       p->id, len);
+            return -1;
+        }
+
+        if (len == iov->iov_len) {
+            memcpy(iov->iov_base, in, len);
+        } else if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            /* the page is placed at once, there is nothing to apply it to */
+            error_setg(errp, "multifd %d: xbzrle page %d received during "
+                       "postcopy", p->id, i);
+            return -1;
+        } else if (len &&
+                   xbzrle_decode_buffer(in, len, iov->iov_base,
+                                        iov->iov_len) < 0) {
+            error_setg(errp, "multifd %d: failed to decode xbzrle page %d",
+                       p->id, i);
+            return -1;
+        }
+        in += len;
+    }
+    if (in != end) {
+        error_setg(errp, "multifd %d: packet size received %d size used %td",
+                   p->id, in_size, in - x->zbuff);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .send_write = xbzrle_send_write,
+    .send_zero_page = xbzrle_send_zero_page,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
@@ -42,7 +42,7 @@ struct zlib_data {
  */
 static int zlib_send_setup(MultiFDSendParams *p, Error **errp)
 {
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = multifd_packet_page_count();
     struct zlib_data *z = g_malloc0(sizeof(struct zlib_data));
     z_stream *zs = &z->zs;
 
@@ -144,6 +144,7 @@ static int zlib_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
         out_size += available - zs->avail_out;
     }
     p->next_packet_size = out_size;
+    multifd_send_data_crc(p, z->zbuff, p->next_packet_size);
     p->flags |= MULTIFD_FLAG_ZLIB;
 
     return 0;
@@ -180,7 +181,7 @@ static int zlib_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
  */
 static int zlib_recv_setup(MultiFDRecvParams *p, Error **errp)
 {
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = multifd_packet_page_count();
     struct zlib_data *z = g_malloc0(sizeof(struct zlib_data));
     z_stream *zs = &z->zs;
 
@@ -259,16 +260,19 @@ static int zlib_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
     if (ret != 0) {
         return ret;
     }
+    if (multifd_recv_check_data_crc(p, z->zbuff, in_size, errp)) {
+        return -1;
+    }
 
     zs->avail_in = in_size;
     zs->next_in = z->zbuff;
 
-    for (i = 0; i < used; i++) {
-        struct iovec *iov = &p->pages->iov[i];
+    for (i = 0; i < p->iovs_num; i++) {
+        struct iovec *iov = &p->iov[i];
         int flush = Z_NO_FLUSH;
         unsigned long start = zs->total_out;
 
-        if (i == used - 1) {
+        if (i == p->iovs_num - 1) {
             flush = Z_SYNC_FLUSH;
         }
 
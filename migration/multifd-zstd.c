@@ -12,13 +12,21 @@
 
 #include "qemu/osdep.h"
 #include <zstd.h>
+#include <zdict.h>
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
 #include "exec/target_page.h"
+#include "exec/ramblock.h"
 #include "qapi/error.h"
 #include "migration.h"
+#include "ram.h"
 #include "trace.h"
 #include "multifd.h"
 
+/* Size of the dictionaries trained with multifd-zstd-dict-pages */
+#define ZSTD_DICT_SIZE (112 * 1024)
+
 struct zstd_data {
     /* stream for compression */
     ZSTD_CStream *zcs;
@@ -31,8 +39,83 @@ struct zstd_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /*
+     * Each packet is a zstd frame of its own, so that all of them can
+     * refer to the dictionary
+     */
+    bool frame_per_packet;
+    /* This channel holds a reference to zstd_dict */
+    bool dict_user;
+    /* level of the current frame */
+    int level;
 };
 
+/*
+ * Dictionary shared by all the send channels, trained when the first
+ * one is set up and freed when the last one is cleaned up.
+ */
+static void *zstd_dict;
+static size_t zstd_dict_len;
+static int zstd_dict_users;
+
+/**
+ * zstd_dict_train: train a dictionary from sampled guest pages
+ *
+ * Sample multifd-zstd-dict-pages non zero pages evenly spread over
+ * guest RAM, and train zstd_dict with them.  If training fails we just
+ * go on without a dictionary.
+ */
+static void zstd_dict_train(void)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t nb = migrate_multifd_zstd_dict_pages();
+    uint64_t stride = MAX(ram_bytes_total() / page_size / nb, 1) * page_size;
+    g_autofree uint8_t *samples = g_malloc(nb * page_size);
+    g_autofree size_t *sizes = g_new(size_t, nb);
+    uint32_t n = 0;
+    RAMBlock *block;
+    size_t ret;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ram_addr_t offset;
+
+            for (offset = 0; offset < block->used_length && n < nb;
+                 offset += stride) {
+                uint8_t *page = block->host + offset;
+
+                if (buffer_is_zero(page, page_size)) {
+                    continue;
+                }
+                memcpy(samples + n * page_size, page, page_size);
+                sizes[n++] = page_size;
+            }
+        }
+    }
+
+    zstd_dict = g_malloc(ZSTD_DICT_SIZE);
+    ret = ZDICT_trainFromBuffer(zstd_dict, ZSTD_DICT_SIZE, samples, sizes, n);
+    if (ZDICT_isError(ret)) {
+        warn_report("multifd: zstd dictionary training on %u pages failed "
+                    "with %s, compressing without a dictionary",
+                    n, ZDICT_getErrorName(ret));
+        g_free(zstd_dict);
+        zstd_dict = NULL;
+        return;
+    }
+    zstd_dict_len = ret;
+    trace_multifd_zstd_dict_train(n, zstd_dict_len);
+}
+
+static void zstd_dict_unref(void)
+{
+    if (!--zstd_dict_users) {
+        g_free(zstd_dict);
+        zstd_dict = NULL;
+        zstd_dict_len = 0;
+    }
+}
+
 /* Multifd zstd compression */
 
 /**
@@ -47,7 +130,7 @@ struct zstd_data {
  */
 static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
 {
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = multifd_packet_page_count();
     struct zstd_data *z = g_new0(struct zstd_data, 1);
     int res;
 
@@ -59,7 +142,8 @@ static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
         return -1;
     }
 
-    res = ZSTD_initCStream(z->zcs, migrate_multifd_zstd_level());
+    z->level = multifd_send_zstd_level();
+    res = ZSTD_initCStream(z->zcs, z->level);
     if (ZSTD_isError(res)) {
         ZSTD_freeCStream(z->zcs);
         g_free(z);
@@ -67,6 +151,7 @@ static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
                    p->id, ZSTD_getErrorName(res));
         return -1;
     }
+
     /* We will never have more than page_count pages */
     z->zbuff_len = page_count * qemu_target_page_size();
     z->zbuff_len *= 2;
@@ -77,6 +162,28 @@ static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
         error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
         return -1;
     }
+
+    if (migrate_multifd_zstd_dict_pages()) {
+        z->dict_user = true;
+        if (!zstd_dict_users++) {
+            zstd_dict_train();
+        }
+        if (zstd_dict) {
+            res = ZSTD_CCtx_loadDictionary(z->zcs, zstd_dict, zstd_dict_len);
+            if (ZSTD_isError(res)) {
+                zstd_dict_unref();
+                ZSTD_freeCStream(z->zcs);
+                g_free(z->zbuff);
+                g_free(z);
+                error_setg(errp, "multifd %d: loadDictionary failed with "
+                           "error %s", p->id, ZSTD_getErrorName(res));
+                return -1;
+            }
+            z->frame_per_packet = true;
+            p->dict = zstd_dict;
+            p->dict_len = zstd_dict_len;
+        }
+    }
     return 0;
 }
 
@@ -91,6 +198,11 @@ static void zstd_send_cleanup(MultiFDSendParams *p, Error **errp)
 {
     struct zstd_data *z = p->data;
 
+    if (z->dict_user) {
+        zstd_dict_unref();
+    }
+    p->dict = NULL;
+    p->dict_len = 0;
     ZSTD_freeCStream(z->zcs);
     z->zcs = NULL;
     g_free(z->zbuff);
@@ -114,6 +226,11 @@ static int zstd_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
     struct iovec *iov = p->pages->iov;
     struct zstd_data *z = p->data;
+    /*
+     * The level only changes between frames, so the frame ends with
+     * this packet when multifd-autotune picked another one
+     */
+    int level = multifd_send_zstd_level();
     int ret;
     uint32_t i;
 
@@ -125,7 +242,8 @@ static int zstd_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
         ZSTD_EndDirective flush = ZSTD_e_continue;
 
         if (i == used - 1) {
-            flush = ZSTD_e_flush;
+            flush = z->frame_per_packet || level != z->level ?
+                    ZSTD_e_end : ZSTD_e_flush;
         }
         z->in.src = iov[i].iov_base;
         z->in.size = iov[i].iov_len;
@@ -155,8 +273,19 @@ static int zstd_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
         }
     }
     p->next_packet_size = z->out.pos;
+    multifd_send_data_crc(p, z->zbuff, p->next_packet_size);
     p->flags |= MULTIFD_FLAG_ZSTD;
 
+    if (level != z->level) {
+        ret = ZSTD_CCtx_setParameter(z->zcs, ZSTD_c_compressionLevel, level);
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %d: setting level %d failed with "
+                       "error %s", p->id, level, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        z->level = level;
+    }
+
     return 0;
 }
 
@@ -191,7 +320,7 @@ static int zstd_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
  */
 static int zstd_recv_setup(MultiFDRecvParams *p, Error **errp)
 {
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = multifd_packet_page_count();
     struct zstd_data *z = g_new0(struct zstd_data, 1);
     int ret;
 
@@ -245,6 +374,31 @@ static void zstd_recv_cleanup(MultiFDRecvParams *p)
     p->data = NULL;
 }
 
+/**
+ * zstd_recv_dict: use the dictionary sent by the source
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @dict: the dictionary
+ * @len: size of the dictionary
+ * @errp: pointer to an error
+ */
+static int zstd_recv_dict(MultiFDRecvParams *p, const void *dict, uint32_t len,
+                          Error **errp)
+{
+    struct zstd_data *z = p->data;
+    size_t ret;
+
+    ret = ZSTD_DCtx_loadDictionary(z->zds, dict, len);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd %d: loadDictionary failed with error %s",
+                   p->id, ZSTD_getErrorName(ret));
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * zstd_recv_pages: read the data from the channel into actual pages
  *
@@ -277,13 +431,16 @@ static int zstd_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
     if (ret != 0) {
         return ret;
     }
+    if (multifd_recv_check_data_crc(p, z->zbuff, in_size, errp)) {
+        return -1;
+    }
 
     z->in.src = z->zbuff;
     z->in.size = in_size;
     z->in.pos = 0;
 
-    for (i = 0; i < used; i++) {
-        struct iovec *iov = &p->pages->iov[i];
+    for (i = 0; i < p->iovs_num; i++) {
+        struct iovec *iov = &p->iov[i];
 
         z->out.dst = iov->iov_base;
         z->out.size = iov->iov_len;
@@ -328,7 +485,8 @@ static MultiFDMethods multifd_zstd_ops = {
     .send_write = zstd_send_write,
     .recv_setup = zstd_recv_setup,
     .recv_cleanup = zstd_recv_cleanup,
-    .recv_pages = zstd_recv_pages
+    .recv_pages = zstd_recv_pages,
+    .recv_dict = zstd_recv_dict
 };
 
 static void multifd_zstd_register(void)
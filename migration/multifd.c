@@ -11,24 +11,42 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/crc32c.h"
+#include "qemu/lockable.h"
 #include "qemu/rcu.h"
+#include "qemu/thread-context.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
+#include "sysemu/hostmem.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
 #include "ram.h"
 #include "migration.h"
+#include "postcopy-ram.h"
 #include "socket.h"
 #include "tls.h"
+#include "file.h"
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "rdma.h"
+#include "ram-dedup.h"
+#include "migration/colo.h"
+#include "migration/misc.h"
+#include "savevm.h"
 
 #include "qemu/yank.h"
 #include "io/channel-socket.h"
+#include "io/channel-tls.h"
 #include "yank_functions.h"
 
+#ifndef _WIN32
+#include <sys/ioctl.h>
+#endif
+
 /* Multiple fd's */
 
 #define MULTIFD_MAGIC 0x11223344U
@@ -40,11 +58,62 @@ typedef struct {
     unsigned char uuid[16]; /* QemuUUID */
     uint8_t id;
     uint8_t unused1[7];     /* Reserved for future use */
-    uint64_t unused2[4];    /* Reserved for future use */
+    uint32_t packet_size;   /* multifd-packet-size, 0 for the default */
+    uint32_t dict_size;     /* size of the dictionary after the packet */
+    uint64_t unused2[3];    /* Reserved for future use */
 } __attribute__((packed)) MultiFDInit_t;
 
+/*
+ * With multifd-adaptive-packet-size, packets that are written faster
+ * than this grow, and packets that take longer than this shrink.
+ */
+#define MULTIFD_ADAPTIVE_GROW_NS (1 * SCALE_MS)
+#define MULTIFD_ADAPTIVE_SHRINK_NS (10 * SCALE_MS)
+/* Smallest packet size used by multifd-adaptive-packet-size */
+#define MULTIFD_ADAPTIVE_MIN_SIZE (64 * 1024)
+
+/*
+ * With fixed-ram, the send channels write the pages at their place in
+ * the migration file, without packets, and the destination reads them
+ * without channels.
+ */
+static bool multifd_recv_use_channels(void)
+{
+    return migrate_use_multifd() && !migrate_fixed_ram();
+}
+
 /* Multifd without compression */
 
+void multifd_send_data_crc(MultiFDSendParams *p, const void *buf, size_t len)
+{
+    if (migrate_multifd_crc32c()) {
+        p->data_crc = crc32c(0xffffffff, buf, len);
+    }
+}
+
+static int multifd_recv_check_crc(MultiFDRecvParams *p, const char *what,
+                                  uint32_t crc, uint32_t expected,
+                                  Error **errp)
+{
+    if (crc != expected) {
+        trace_multifd_recv_crc_mismatch(p->id, what, crc, expected);
+        error_setg(errp, "multifd %u: CRC32C of the packet %s is %08x "
+                   "instead of %08x", p->id, what, crc, expected);
+        return -1;
+    }
+    return 0;
+}
+
+int multifd_recv_check_data_crc(MultiFDRecvParams *p, const void *buf,
+                                size_t len, Error **errp)
+{
+    if (!migrate_multifd_crc32c()) {
+        return 0;
+    }
+    return multifd_recv_check_crc(p, "data", crc32c(0xffffffff, buf, len),
+                                  p->data_crc, errp);
+}
+
 /**
  * nocomp_send_setup: setup send side
  *
@@ -69,14 +138,17 @@ static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
  */
 static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
 {
-    return;
+    g_free(p->crc_buf);
+    p->crc_buf = NULL;
+    p->crc_buf_pages = 0;
 }
 
 /**
  * nocomp_send_prepare: prepare date to be able to send
  *
  * For no compression we just have to calculate the size of the
- * packet.
+ * packet.  With multifd-crc32c the pages are copied first, so that
+ * the guest can't change them after their CRC is computed.
  *
  * Returns 0 for success or -1 for error
  *
@@ -87,15 +159,35 @@ static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
 static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
                                Error **errp)
 {
-    p->next_packet_size = used * qemu_target_page_size();
+    size_t page_size = qemu_target_page_size();
+    uint32_t i;
+
+    p->next_packet_size = used * page_size;
     p->flags |= MULTIFD_FLAG_NOCOMP;
+
+    /* RDMA writes the pages to the destination itself */
+    if (!migrate_multifd_crc32c() || p->rdma) {
+        return 0;
+    }
+    if (used > p->crc_buf_pages) {
+        g_free(p->crc_buf);
+        p->crc_buf_pages = p->pages->allocated;
+        p->crc_buf = g_malloc(p->crc_buf_pages * page_size);
+    }
+    for (i = 0; i < used; i++) {
+        memcpy(p->crc_buf + i * page_size, p->pages->iov[i].iov_base,
+               page_size);
+    }
+    multifd_send_data_crc(p, p->crc_buf, p->next_packet_size);
     return 0;
 }
 
 /**
  * nocomp_send_write: do the actual write of the data
  *
- * For no compression we just have to write the data.
+ * For no compression we just have to write the data.  With
+ * zero-copy-send the kernel sends the guest pages directly, and
+ * multifd_send_sync_main() waits for the writes to complete.
  *
  * Returns 0 for success or -1 for error
  *
@@ -105,7 +197,18 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    int flags = 0;
+
+    if (migrate_multifd_crc32c()) {
+        return qio_channel_write_all(p->c, (void *)p->crc_buf,
+                                     p->next_packet_size, errp);
+    }
+    if (migrate_use_zero_copy_send()) {
+        flags |= QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+    }
+
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used,
+                                       NULL, 0, flags, errp);
 }
 
 /**
@@ -148,13 +251,25 @@ static void nocomp_recv_cleanup(MultiFDRecvParams *p)
 static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
 {
     uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t crc = 0;
+    uint32_t i;
 
     if (flags != MULTIFD_FLAG_NOCOMP) {
         error_setg(errp, "multifd %d: flags received %x flags expected %x",
                    p->id, flags, MULTIFD_FLAG_NOCOMP);
         return -1;
     }
-    return qio_channel_readv_all(p->c, p->pages->iov, used, errp);
+    if (qio_channel_readv_all(p->c, p->iov, p->iovs_num, errp)) {
+        return -1;
+    }
+    if (!migrate_multifd_crc32c()) {
+        return 0;
+    }
+    /* The source computed it over the pages one after the other */
+    for (i = 0; i < p->iovs_num; i++) {
+        crc = crc32c(crc ^ 0xffffffff, p->iov[i].iov_base, p->iov[i].iov_len);
+    }
+    return multifd_recv_check_crc(p, "data", crc, p->data_crc, errp);
 }
 
 static MultiFDMethods multifd_nocomp_ops = {
@@ -185,26 +300,41 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
     msg.version = cpu_to_be32(MULTIFD_VERSION);
     msg.id = p->id;
+    msg.packet_size = cpu_to_be32(migrate_multifd_packet_size());
+    msg.dict_size = cpu_to_be32(p->dict_len);
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
     ret = qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
     if (ret != 0) {
         return -1;
     }
+    if (p->dict_len) {
+        ret = qio_channel_write_all(p->c, p->dict, p->dict_len, errp);
+        if (ret != 0) {
+            return -1;
+        }
+    }
     return 0;
 }
 
-static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+/*
+ * The magic has already been read by the caller to find out which
+ * kind of channel this is, read the rest of the packet.
+ */
+static int multifd_recv_initial_packet(QIOChannel *c, uint32_t magic,
+                                       uint32_t *dict_size, Error **errp)
 {
     MultiFDInit_t msg;
+    uint32_t packet_size;
     int ret;
 
-    ret = qio_channel_read_all(c, (char *)&msg, sizeof(msg), errp);
+    ret = qio_channel_read_all(c, (char *)&msg + sizeof(msg.magic),
+                               sizeof(msg) - sizeof(msg.magic), errp);
     if (ret != 0) {
         return -1;
     }
 
-    msg.magic = be32_to_cpu(msg.magic);
+    msg.magic = magic;
     msg.version = be32_to_cpu(msg.version);
 
     if (msg.magic != MULTIFD_MAGIC) {
@@ -236,9 +366,32 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
+    /* Older sources don't tell, they always use the default size */
+    packet_size = be32_to_cpu(msg.packet_size) ?: MULTIFD_PACKET_SIZE;
+    if (packet_size > migrate_multifd_packet_size()) {
+        error_setg(errp, "multifd: received packet size %u bigger than "
+                   "multifd-packet-size %" PRIu64 " for channel %hhd",
+                   packet_size, migrate_multifd_packet_size(), msg.id);
+        return -1;
+    }
+
+    *dict_size = be32_to_cpu(msg.dict_size);
+    if (*dict_size > MULTIFD_DICT_SIZE_MAX) {
+        error_setg(errp, "multifd: received dictionary size %u bigger than "
+                   "%u for channel %hhd", *dict_size, MULTIFD_DICT_SIZE_MAX,
+                   msg.id);
+        return -1;
+    }
+
     return msg.id;
 }
 
+/* Number of pages in a full multifd packet */
+uint32_t multifd_packet_page_count(void)
+{
+    return migrate_multifd_packet_size() / qemu_target_page_size();
+}
+
 static MultiFDPages_t *multifd_pages_init(size_t size)
 {
     MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
@@ -246,26 +399,109 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
     pages->allocated = size;
     pages->iov = g_new0(struct iovec, size);
     pages->offset = g_new0(ram_addr_t, size);
+    pages->block_idx = g_new0(uint8_t, size);
 
     return pages;
 }
 
+/**
+ * multifd_pages_block_idx: index of a block in the batch
+ *
+ * Returns the index of @block in the block table of @pages, adding
+ * it if needed, or -1 if the batch can't carry pages from @block and
+ * needs to be sent first.
+ *
+ * @pages: batch where we want to queue a page
+ * @block: block of the page
+ * @multi_block: whether the batch can carry pages from several blocks
+ */
+static int multifd_pages_block_idx(MultiFDPages_t *pages, RAMBlock *block,
+                                   bool multi_block)
+{
+    size_t len;
+    int i;
+
+    if (!pages->block) {
+        pages->block = block;
+    }
+
+    if (!multi_block) {
+        return pages->block == block ? 0 : -1;
+    }
+
+    /* Pages of the same block usually come together, look backwards */
+    for (i = pages->nr_blocks - 1; i >= 0; i--) {
+        if (pages->blocks[i] == block) {
+            return i;
+        }
+    }
+
+    len = strlen(block->idstr);
+    if (pages->nr_blocks == MULTIFD_PACKET_MAX_BLOCKS ||
+        pages->blocks_size + 1 + len > sizeof_field(MultiFDPacket_t,
+                                                    ramblock)) {
+        return -1;
+    }
+
+    pages->blocks[pages->nr_blocks] = block;
+    pages->blocks_size += 1 + len;
+    return pages->nr_blocks++;
+}
+
+static void multifd_pages_reset(MultiFDPages_t *pages)
+{
+    pages->used = 0;
+    pages->zero_num = 0;
+    pages->block = NULL;
+    pages->nr_blocks = 0;
+    pages->blocks_size = 0;
+    g_free(pages->device_state);
+    pages->device_state = NULL;
+    pages->device_state_len = 0;
+}
+
 static void multifd_pages_clear(MultiFDPages_t *pages)
 {
     pages->used = 0;
+    pages->zero_num = 0;
     pages->allocated = 0;
     pages->packet_num = 0;
+    pages->flags = 0;
     pages->block = NULL;
+    pages->nr_blocks = 0;
+    pages->blocks_size = 0;
     g_free(pages->iov);
     pages->iov = NULL;
     g_free(pages->offset);
     pages->offset = NULL;
+    g_free(pages->block_idx);
+    pages->block_idx = NULL;
+    g_free(pages->device_state);
+    pages->device_state = NULL;
     g_free(pages);
 }
 
+static void multifd_send_fill_block_table(MultiFDPacket_t *packet,
+                                          MultiFDPages_t *pages)
+{
+    uint8_t *table = (uint8_t *)packet->ramblock;
+    int i;
+
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    for (i = 0; i < pages->nr_blocks; i++) {
+        size_t len = strlen(pages->blocks[i]->idstr);
+
+        *table++ = len;
+        memcpy(table, pages->blocks[i]->idstr, len);
+        table += len;
+    }
+}
+
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
+    bool multi_block = be32_to_cpu(packet->version) ==
+                       MULTIFD_PACKET_VERSION_MULTI_BLOCK;
     int i;
 
     packet->flags = cpu_to_be32(p->flags);
@@ -273,26 +509,122 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
-
-    if (p->pages->block) {
+    packet->zero_pages = cpu_to_be32(p->pages->zero_num);
+    packet->instance_id = cpu_to_be32(p->pages->instance_id);
+    packet->device_state_idx = cpu_to_be64(p->pages->device_state_idx);
+
+    if (p->pages->device_state) {
+        strncpy(packet->ramblock, p->pages->idstr, 256);
+    } else if (multi_block) {
+        multifd_send_fill_block_table(packet, p->pages);
+    } else if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->pages->zero_num; i++) {
         /* there are architectures where ram_addr_t is 32 bit */
         uint64_t temp = p->pages->offset[i];
 
+        if (multi_block) {
+            /* offsets are page aligned, the block index uses the low bits */
+            temp |= p->pages->block_idx[i];
+        }
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    if (migrate_multifd_crc32c()) {
+        packet->data_crc = cpu_to_be32(p->data_crc);
+        packet->packet_crc = 0;
+        packet->packet_crc = cpu_to_be32(crc32c(0xffffffff, (void *)packet,
+                                                p->packet_len));
+    }
+}
+
+/*
+ * multifd_recv_unfill_block_table: look up the blocks of a packet
+ *
+ * Returns the number of blocks in the block table of @packet, or -1
+ * on error.
+ */
+static int multifd_recv_unfill_block_table(MultiFDPacket_t *packet,
+                                           RAMBlock **blocks, Error **errp)
+{
+    uint8_t *table = (uint8_t *)packet->ramblock;
+    uint8_t *end = table + sizeof(packet->ramblock);
+    char idstr[256];
+    int nr = 0;
+
+    while (table < end && *table) {
+        size_t len = *table++;
+
+        if (len > end - table || nr == MULTIFD_PACKET_MAX_BLOCKS) {
+            error_setg(errp, "multifd: received invalid block table");
+            return -1;
+        }
+        memcpy(idstr, table, len);
+        idstr[len] = 0;
+        table += len;
+
+        blocks[nr] = qemu_ram_block_by_name(idstr);
+        if (!blocks[nr]) {
+            error_setg(errp, "multifd: unknown ram block %s", idstr);
+            return -1;
+        }
+        nr++;
+    }
+
+    return nr;
+}
+
+/*
+ * multifd_recv_coalesce_iov: merge the iovs of contiguous pages
+ *
+ * Senders queue pages in ascending order, so most of them are
+ * contiguous with the previous one.  Merging them lets the compression
+ * methods read or decompress straight into big chunks of guest memory.
+ */
+static void multifd_recv_coalesce_iov(MultiFDRecvParams *p)
+{
+    struct iovec *iov = p->pages->iov;
+    uint32_t i;
+
+    p->iovs_num = 0;
+    for (i = 0; i < p->pages->used; i++) {
+        if (p->iovs_num) {
+            struct iovec *last = &p->iov[p->iovs_num - 1];
+
+            if (last->iov_base + last->iov_len == iov[i].iov_base) {
+                last->iov_len += iov[i].iov_len;
+                continue;
+            }
+        }
+        p->iov[p->iovs_num++] = iov[i];
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
 {
     MultiFDPacket_t *packet = p->packet;
-    uint32_t pages_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
-    RAMBlock *block;
+    uint32_t pages_max = multifd_packet_page_count();
+    RAMBlock **blocks;
+    ram_addr_t page_mask = qemu_target_page_size() - 1;
+    int nr_blocks = 1;
     int i;
 
+    /* Check it before trusting any of the fields */
+    if (migrate_multifd_crc32c()) {
+        uint32_t crc = be32_to_cpu(packet->packet_crc);
+
+        packet->packet_crc = 0;
+        if (multifd_recv_check_crc(p, "header",
+                                   crc32c(0xffffffff, (void *)packet,
+                                          p->packet_len),
+                                   crc, errp)) {
+            return -1;
+        }
+        p->data_crc = be32_to_cpu(packet->data_crc);
+    }
+
     packet->magic = be32_to_cpu(packet->magic);
     if (packet->magic != MULTIFD_MAGIC) {
         error_setg(errp, "multifd: received packet "
@@ -302,10 +634,12 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    if (packet->version != MULTIFD_PACKET_VERSION_SINGLE_BLOCK &&
+        packet->version != MULTIFD_PACKET_VERSION_MULTI_BLOCK) {
         error_setg(errp, "multifd: received packet "
-                   "version %d and expected version %d",
-                   packet->version, MULTIFD_VERSION);
+                   "version %d and expected version %d or %d",
+                   packet->version, MULTIFD_PACKET_VERSION_SINGLE_BLOCK,
+                   MULTIFD_PACKET_VERSION_MULTI_BLOCK);
         return -1;
     }
 
@@ -329,6 +663,8 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     if (packet->pages_alloc > p->pages->allocated) {
         multifd_pages_clear(p->pages);
         p->pages = multifd_pages_init(packet->pages_alloc);
+        g_free(p->iov);
+        p->iov = g_new0(struct iovec, packet->pages_alloc);
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
@@ -339,24 +675,75 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->pages->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->pages->zero_num > packet->pages_alloc - p->pages->used) {
+        error_setg(errp, "multifd: received packet "
+                   "with %d zero pages and expected maximum zero pages are %d",
+                   p->pages->zero_num, packet->pages_alloc - p->pages->used);
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used == 0) {
+    if (p->flags & MULTIFD_FLAG_DEVICE_STATE) {
+        if (p->pages->used + p->pages->zero_num) {
+            error_setg(errp, "multifd: received device state packet "
+                       "with pages");
+            return -1;
+        }
+        /* make sure that the section id is 0 terminated */
+        packet->ramblock[255] = 0;
         return 0;
     }
 
-    /* make sure that ramblock is 0 terminated */
-    packet->ramblock[255] = 0;
-    block = qemu_ram_block_by_name(packet->ramblock);
-    if (!block) {
-        error_setg(errp, "multifd: unknown ram block %s",
-                   packet->ramblock);
-        return -1;
+    if (p->pages->used + p->pages->zero_num == 0) {
+        return 0;
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    /* postcopy places each page in its block */
+    blocks = p->pages->blocks;
+    if (packet->version == MULTIFD_PACKET_VERSION_MULTI_BLOCK) {
+        nr_blocks = multifd_recv_unfill_block_table(packet, blocks, errp);
+        if (nr_blocks < 0) {
+            return -1;
+        }
+    } else {
+        /* make sure that ramblock is 0 terminated */
+        packet->ramblock[255] = 0;
+        blocks[0] = qemu_ram_block_by_name(packet->ramblock);
+        if (!blocks[0]) {
+            error_setg(errp, "multifd: unknown ram block %s",
+                       packet->ramblock);
+            return -1;
+        }
+    }
+
+    /* zero pages iovs go after the ones of the normal pages */
+    p->pages->nr_blocks = nr_blocks;
+    for (i = 0; i < p->pages->used + p->pages->zero_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
+        RAMBlock *block;
+        int idx = 0;
+
+        if (packet->version == MULTIFD_PACKET_VERSION_MULTI_BLOCK) {
+            idx = offset & page_mask;
+
+            if (idx >= nr_blocks) {
+                error_setg(errp, "multifd: block index %d too big "
+                           "(max %d)", idx, nr_blocks - 1);
+                return -1;
+            }
+            offset -= idx;
+        }
+        block = blocks[idx];
+
+        if ((p->flags & MULTIFD_FLAG_POSTCOPY) &&
+            block->page_size != qemu_target_page_size()) {
+            error_setg(errp, "multifd: postcopy page in block %s, that "
+                       "uses huge pages", block->idstr);
+            return -1;
+        }
 
         if (offset > (block->used_length - qemu_target_page_size())) {
             error_setg(errp, "multifd: offset too long %" PRIu64
@@ -364,21 +751,188 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->used_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        if (migration_incoming_in_colo_state()) {
+            p->pages->iov[i].iov_base = colo_cache_recv_host(block, offset);
+        } else {
+            p->pages->iov[i].iov_base = block->host + offset;
+        }
         p->pages->iov[i].iov_len = qemu_target_page_size();
+        p->pages->block_idx[i] = idx;
     }
 
+    multifd_recv_coalesce_iov(p);
     return 0;
 }
 
+/*
+ * With multifd-numa-affinity, each channel gets one of the host NUMA
+ * nodes that back guest RAM, its thread runs on the CPUs of that node
+ * and the batches of pages of the node go through its channels.
+ */
+
+/* Host node of the memory of @block, or -1 if it isn't bound to one */
+static int multifd_ramblock_numa_node(RAMBlock *block)
+{
+    HostMemoryBackend *backend;
+    unsigned long node;
+
+    if (!block->mr->owner) {
+        return -1;
+    }
+    backend = (HostMemoryBackend *)object_dynamic_cast(block->mr->owner,
+                                                       TYPE_MEMORY_BACKEND);
+    if (!backend || (backend->policy != HOST_MEM_POLICY_BIND &&
+                     backend->policy != HOST_MEM_POLICY_PREFERRED)) {
+        return -1;
+    }
+    node = find_first_bit(backend->host_nodes, MAX_NODES);
+    if (node >= MAX_NODES ||
+        find_next_bit(backend->host_nodes, MAX_NODES, node + 1) < MAX_NODES) {
+        return -1;
+    }
+    return node;
+}
+
+static int multifd_numa_add_block(RAMBlock *block, void *opaque)
+{
+    unsigned long *nodes = opaque;
+    int node;
+
+    if (qemu_ram_is_migratable(block)) {
+        node = multifd_ramblock_numa_node(block);
+        if (node >= 0) {
+            set_bit(node, nodes);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Host node of channel @id, or -1.  The channels take the nodes of the
+ * RAM blocks in turn, and the destination does the same: with the same
+ * memory backends on both sides, the two ends of a channel are on the
+ * same node.
+ */
+static int multifd_numa_channel_node(int id)
+{
+    g_autofree unsigned long *nodes = bitmap_new(MAX_NODES);
+    int nr_nodes, node;
+
+    if (!migrate_multifd_numa_affinity()) {
+        return -1;
+    }
+    qemu_ram_foreach_block(multifd_numa_add_block, nodes);
+    nr_nodes = bitmap_count_one(nodes, MAX_NODES);
+    if (!nr_nodes) {
+        return -1;
+    }
+    node = find_first_bit(nodes, MAX_NODES);
+    for (id %= nr_nodes; id; id--) {
+        node = find_next_bit(nodes, MAX_NODES, node + 1);
+    }
+    return node;
+}
+
+/* Parse a "first[-last]" entry of a sysfs CPU list */
+static bool multifd_numa_parse_cpus(const char *range, unsigned long *first,
+                                    unsigned long *last)
+{
+    const char *end;
+
+    if (qemu_strtoul(range, &end, 10, first)) {
+        return false;
+    }
+    *last = *first;
+    if (*end == '-' && qemu_strtoul(end + 1, &end, 10, last)) {
+        return false;
+    }
+    return !*end && *last >= *first;
+}
+
+/*
+ * Run the calling channel thread on the CPUs of host node @node.  This
+ * is only a matter of speed, so failing to do it is not an error.
+ */
+static void multifd_numa_pin_self(const char *name, int node)
+{
+    g_autofree char *path = NULL;
+    g_autofree char *list = NULL;
+    g_autofree unsigned long *cpus = NULL;
+    g_auto(GStrv) ranges = NULL;
+    unsigned long first, last, nbits = 0;
+    QemuThread self;
+    int i, ret;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &list, NULL, NULL)) {
+        warn_report("%s: can't find the CPUs of host NUMA node %d",
+                    name, node);
+        return;
+    }
+    ranges = g_strsplit(g_strstrip(list), ",", 0);
+    for (i = 0; ranges[i]; i++) {
+        if (!multifd_numa_parse_cpus(ranges[i], &first, &last)) {
+            warn_report("%s: can't parse the CPUs of host NUMA node %d",
+                        name, node);
+            return;
+        }
+        nbits = MAX(nbits, last + 1);
+    }
+    if (!nbits) {
+        /* A node with memory only */
+        return;
+    }
+
+    cpus = bitmap_new(nbits);
+    for (i = 0; ranges[i]; i++) {
+        multifd_numa_parse_cpus(ranges[i], &first, &last);
+        bitmap_set(cpus, first, last - first + 1);
+    }
+    qemu_thread_get_self(&self);
+    ret = qemu_thread_set_affinity(&self, cpus, nbits);
+    if (ret) {
+        warn_report("%s: can't run on the CPUs of host NUMA node %d: %s",
+                    name, node, strerror(-ret));
+        return;
+    }
+    trace_multifd_numa_pin(name, node);
+}
+
 struct {
     MultiFDSendParams *params;
     /* array of pages to sent */
     MultiFDPages_t *pages;
     /* global number of generated multifd packets */
     uint64_t packet_num;
-    /* send channels ready */
+    /* packets can carry pages from several blocks */
+    bool multi_block;
+    /* pages after which the batch being filled is sent */
+    uint32_t batch_pages;
+    /* free batch slots in the queues of the send channels */
     QemuSemaphore channels_ready;
+    /*
+     * Order in which the channels get batches, each of them as many
+     * times as the weight of its multifd-addresses entry
+     */
+    uint8_t *schedule;
+    int schedule_len;
+    int next_slot;
+    /* with multifd-numa-affinity, host node of the batch being filled */
+    bool numa;
+    int batch_node;
+    /* last block queued, and its host node */
+    RAMBlock *numa_block;
+    int numa_block_node;
+    /* multifd-autotune state, see multifd_send_autotune() */
+    bool autotune;
+    int active_channels;
+    /* read by the channels */
+    int zstd_level;
+    int64_t tune_time;
+    uint64_t tune_rate;
+    int tune_action;
+    int tune_hold;
+    struct MultiFDAutotuneSample *tune_last;
     /*
      * Have we already run terminate threads.  There is a race when it
      * happens that we got one error while we are exiting.
@@ -389,104 +943,544 @@ struct {
     MultiFDMethods *ops;
 } *multifd_send_state;
 
+/**
+ * multifd_send_account_zero_pages: fix up counters for detected zero pages
+ *
+ * With multifd-zero-page the migration thread accounts every queued
+ * page as a normal page, and it is the channel thread that finds out
+ * which ones were zero pages and didn't go through the wire.  Move
+ * them from normal to duplicate and give back the bytes that we
+ * accounted as transferred.
+ *
+ * Called from the migration thread.
+ *
+ * @f: QEMUFile where the transfer is accounted
+ * @p: Params for the channel that detected the zero pages
+ */
+static void multifd_send_account_zero_pages(QEMUFile *f, MultiFDSendParams *p)
+{
+    uint32_t zero_pages = qatomic_xchg(&p->pending_zero_pages, 0);
+    uint64_t bytes = (uint64_t)zero_pages * qemu_target_page_size();
+
+    if (!zero_pages) {
+        return;
+    }
+
+    /* Adding the two's complement subtracts, modulo 2^64 */
+    stat64_add(&ram_atomic_counters.normal, -(uint64_t)zero_pages);
+    stat64_add(&ram_atomic_counters.duplicate, zero_pages);
+    stat64_add(&ram_atomic_counters.multifd_bytes, -bytes);
+    stat64_add(&ram_atomic_counters.transferred, -bytes);
+    qemu_file_update_transfer(f, -(int64_t)bytes);
+}
+
 /*
- * How we use multifd_send_state->pages and channel->pages?
+ * How we use multifd_send_state->pages and channel->queue?
  *
- * We create a pages for each channel, and a main one.  Each time that
- * we need to send a batch of pages we interchange the ones between
- * multifd_send_state and the channel that is sending it.  There are
- * two reasons for that:
+ * We create MULTIFD_SEND_QUEUE_LEN pages for each channel, and a main
+ * one.  Each time that we need to send a batch of pages we interchange
+ * the main one with a free slot of the queue of the channel that is
+ * going to send it.  There are two reasons for that:
  *    - to not have to do so many mallocs during migration
  *    - to make easier to know what to free at the end of migration
  *
- * This way we always know who is the owner of each "pages" struct,
- * and we don't need any locking.  It belongs to the migration thread
- * or to the channel thread.  Switching is safe because the migration
- * thread is using the channel mutex when changing it, and the channel
- * have to had finish with its own, otherwise pending_job can't be
- * false.
+ * Each queue is a single producer, single consumer ring: the migration
+ * thread only moves queue_head forward and the channel thread only
+ * moves queue_tail forward, so a slot between tail and head belongs to
+ * the channel thread and all the others to the migration thread.  The
+ * migration thread can keep filling batches while the channels are
+ * busy writing, and it only blocks when every queue is full.
+ *
+ * channels_ready counts the free slots in all the queues.  A queue can
+ * only hold MULTIFD_SEND_QUEUE_LEN - 1 batches of pages, the last slot
+ * is for the sync packet, so multifd_send_sync_main() never blocks.
  */
 
+static unsigned int multifd_send_queue_used(MultiFDSendParams *p)
+{
+    return p->queue_head - qatomic_load_acquire(&p->queue_tail);
+}
+
+/*
+ * multifd_send_queue_push: queue @pages with @flags to channel @p
+ *
+ * Returns the free batch of the slot, that now belongs to the caller.
+ * Only called from the migration thread.
+ */
+static MultiFDPages_t *multifd_send_queue_push(MultiFDSendParams *p,
+                                               MultiFDPages_t *pages,
+                                               uint32_t flags)
+{
+    unsigned int head = p->queue_head;
+    unsigned int slot = head % MULTIFD_SEND_QUEUE_LEN;
+    MultiFDPages_t *free_pages = p->queue[slot];
+
+    assert(!free_pages->used);
+    assert(!free_pages->block);
+    assert(!free_pages->device_state);
+
+    pages->packet_num = multifd_send_state->packet_num++;
+    pages->flags = flags;
+    p->queue[slot] = pages;
+    qatomic_store_release(&p->queue_head, head + 1);
+    qemu_sem_post(&p->sem);
+
+    return free_pages;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
-    int i;
-    static int next_channel;
+    int i, n, tries;
+    int node = multifd_send_state->batch_node;
+    bool any = false;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
+    uint32_t flags = 0;
     uint64_t transferred;
+    int64_t start_us;
 
     if (qatomic_read(&multifd_send_state->exiting)) {
         return -1;
     }
 
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     qemu_sem_wait(&multifd_send_state->channels_ready);
-    /*
-     * next_channel can remain from a previous migration that was
-     * using more channels, so ensure it doesn't overflow if the
-     * limit is lower now.
-     */
-    next_channel %= migrate_multifd_channels();
-    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+    migration_add_time(&migrate_get_current()->multifd_send_wait_time,
+                       start_us);
+    for (n = multifd_send_state->next_slot, tries = 0;;
+         n = (n + 1) % multifd_send_state->schedule_len, tries++) {
+        i = multifd_send_state->schedule[n];
         p = &multifd_send_state->params[i];
 
-        qemu_mutex_lock(&p->mutex);
-        if (p->quit) {
+        if (qatomic_read(&p->quit)) {
             error_report("%s: channel %d has already quit!", __func__, i);
-            qemu_mutex_unlock(&p->mutex);
             return -1;
         }
-        if (!p->pending_job) {
-            p->pending_job++;
-            next_channel = (i + 1) % migrate_multifd_channels();
+        if (tries == multifd_send_state->schedule_len) {
+            /* No channel of the node has room, any one will do */
+            node = -1;
+        } else if (tries == 2 * multifd_send_state->schedule_len) {
+            /* Only the channels that multifd-autotune idled have room */
+            any = true;
+        }
+        if ((node < 0 || p->numa_node == node) && (p->active || any) &&
+            multifd_send_queue_used(p) < MULTIFD_SEND_QUEUE_LEN - 1) {
+            multifd_send_state->next_slot =
+                (n + 1) % multifd_send_state->schedule_len;
             break;
         }
-        qemu_mutex_unlock(&p->mutex);
     }
-    assert(!p->pages->used);
-    assert(!p->pages->block);
 
-    p->packet_num = multifd_send_state->packet_num++;
-    multifd_send_state->pages = p->pages;
-    p->pages = pages;
+    multifd_send_account_zero_pages(f, p);
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
-                + p->packet_len;
+                + pages->device_state_len + p->packet_len;
+    if (migration_in_postcopy()) {
+        flags |= MULTIFD_FLAG_POSTCOPY;
+    }
+    if (pages->device_state) {
+        flags |= MULTIFD_FLAG_DEVICE_STATE;
+    }
+    trace_multifd_send_pages(p->id, pages->used, transferred,
+                             qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us);
+    multifd_send_state->pages = multifd_send_queue_push(p, pages, flags);
+    multifd_send_state->batch_node = -1;
+    /* size the next batch for the channel that is going to get it */
+    i = multifd_send_state->schedule[multifd_send_state->next_slot];
+    multifd_send_state->batch_pages =
+        qatomic_read(&multifd_send_state->params[i].batch_pages);
     qemu_file_update_transfer(f, transferred);
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;
-    qemu_mutex_unlock(&p->mutex);
-    qemu_sem_post(&p->sem);
+    stat64_add(&ram_atomic_counters.multifd_bytes, transferred);
+    stat64_add(&ram_atomic_counters.transferred, transferred);
 
     return 1;
 }
 
+/*
+ * With multifd-numa-affinity, a batch only has pages of one host node,
+ * so that a channel of that node sends it: send the pages queued so
+ * far if @block is on another node.
+ */
+static int multifd_send_numa_batch(QEMUFile *f, RAMBlock *block)
+{
+    if (block != multifd_send_state->numa_block) {
+        multifd_send_state->numa_block = block;
+        multifd_send_state->numa_block_node =
+            multifd_ramblock_numa_node(block);
+    }
+    if (multifd_send_state->pages->used &&
+        multifd_send_state->batch_node !=
+        multifd_send_state->numa_block_node) {
+        if (multifd_send_pages(f) < 0) {
+            return -1;
+        }
+    }
+    multifd_send_state->batch_node = multifd_send_state->numa_block_node;
+    return 0;
+}
+
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    return multifd_queue_pages(f, block, offset, 1) < 0 ? -1 : 1;
+}
+
+/**
+ * multifd_queue_pages: queue contiguous pages
+ *
+ * Queues the @npages pages of @block from @offset, and sends the
+ * batches as they fill up.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @f: QEMUFile where to send the data
+ * @block: RAMBlock of the pages
+ * @offset: offset of the first page in @block
+ * @npages: number of pages
+ */
+int multifd_queue_pages(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                        uint32_t npages)
+{
+    size_t page_size = qemu_target_page_size();
+
+    while (npages) {
+        MultiFDPages_t *pages;
+        uint32_t n;
+        int idx;
+
+        if (multifd_send_state->numa &&
+            multifd_send_numa_batch(f, block) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+        idx = multifd_pages_block_idx(pages, block,
+                                      multifd_send_state->multi_block);
+        if (idx < 0 || pages->used >= multifd_send_state->batch_pages) {
+            /* The batch has another block, or it shrank: send it first */
+            if (multifd_send_pages(f) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        n = MIN(npages, multifd_send_state->batch_pages - pages->used);
+        npages -= n;
+        while (n--) {
+            pages->offset[pages->used] = offset;
+            pages->block_idx[pages->used] = idx;
+            pages->iov[pages->used].iov_base = block->host + offset;
+            pages->iov[pages->used].iov_len = page_size;
+            pages->used++;
+            offset += page_size;
+        }
+
+        if (pages->used == multifd_send_state->batch_pages &&
+            multifd_send_pages(f) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_queue_reserve: make room for pages that belong together
+ *
+ * Sends the pages queued so far when the next @npages pages wouldn't
+ * fit in the same packet, so that they start a new one.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @f: QEMUFile where to send the data
+ * @npages: number of pages that are about to be queued
+ */
+int multifd_queue_reserve(QEMUFile *f, uint32_t npages)
 {
     MultiFDPages_t *pages = multifd_send_state->pages;
 
-    if (!pages->block) {
-        pages->block = block;
+    if (!pages->used ||
+        pages->used + npages <= multifd_send_state->batch_pages) {
+        return 0;
     }
+    return multifd_send_pages(f) < 0 ? -1 : 0;
+}
 
-    if (pages->block == block) {
-        pages->offset[pages->used] = offset;
-        pages->iov[pages->used].iov_base = block->host + offset;
-        pages->iov[pages->used].iov_len = qemu_target_page_size();
-        pages->used++;
+/**
+ * multifd_queue_device_state: send a buffer of device state
+ *
+ * Sends @data, that multifd owns from now on, over the next channel
+ * with room, after the pages queued so far.  The destination passes
+ * it to the load_state_buffer() handler of the section, with @idx so
+ * that the device can put its buffers back in order.
+ *
+ * Only called from the migration thread, by the handlers of the live
+ * section registered with @opaque.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @f: QEMUFile where the transfer is accounted
+ * @opaque: opaque of the section of the device
+ * @idx: index of the buffer for the device
+ * @data: buffer of device state
+ * @len: length of @data
+ */
+int multifd_queue_device_state(QEMUFile *f, void *opaque, uint32_t idx,
+                               uint8_t *data, size_t len)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    const char *idstr;
+    uint32_t instance_id;
 
-        if (pages->used < pages->allocated) {
-            return 1;
+    if (len > UINT32_MAX ||
+        qemu_savevm_section_id(opaque, &idstr, &instance_id) < 0) {
+        g_free(data);
+        return -1;
+    }
+    if (pages->used) {
+        if (multifd_send_pages(f) < 0) {
+            g_free(data);
+            return -1;
         }
+        pages = multifd_send_state->pages;
     }
 
-    if (multifd_send_pages(f) < 0) {
-        return -1;
+    pages->device_state = data;
+    pages->device_state_len = len;
+    pages->device_state_idx = idx;
+    pages->instance_id = instance_id;
+    strpadcpy(pages->idstr, sizeof(pages->idstr), idstr, '\0');
+    trace_multifd_queue_device_state(idstr, instance_id, idx, len);
+
+    return multifd_send_pages(f) < 0 ? -1 : 0;
+}
+
+bool multifd_device_state_supported(void)
+{
+    return migrate_multifd_device_state() && multifd_send_state;
+}
+
+/**
+ * multifd_device_state_save_sync: wait for the buffers of device state
+ *
+ * Returns once the channels have sent all the buffers queued with
+ * multifd_queue_device_state().  The device then tells the destination
+ * in its section, which calls multifd_device_state_load_sync().
+ *
+ * @f: QEMUFile where the transfer is accounted
+ */
+void multifd_device_state_save_sync(QEMUFile *f)
+{
+    multifd_send_sync_main(f);
+}
+
+/**
+ * multifd_device_state_load_sync: wait for the buffers of device state
+ *
+ * Returns once the receive threads have passed all the buffers that
+ * the source sent before its multifd_device_state_save_sync() to the
+ * load_state_buffer() handlers.
+ */
+void multifd_device_state_load_sync(void)
+{
+    multifd_recv_sync_main();
+}
+
+/*
+ * multifd-autotune
+ *
+ * Every MULTIFD_AUTOTUNE_INTERVAL_MS, the migration thread looks at how
+ * long the active channels spent compressing and writing, and at the
+ * pages per second that all of them sent, and takes one step:
+ *  - rate limited by max-bandwidth, with time left for compressing:
+ *    raise the zstd level, to send more pages with the same bytes
+ *  - channels busy less than half of the time: idle one of them
+ *  - channels busy, mostly compressing: use one more channel, or lower
+ *    the zstd level when all of them are in use
+ *  - channels busy, mostly writing: raise the zstd level while they
+ *    compress less than half of the time, or use one more channel
+ * A step after which fewer pages per second are sent is undone, and
+ * then nothing changes for MULTIFD_AUTOTUNE_HOLD intervals.
+ */
+#define MULTIFD_AUTOTUNE_INTERVAL_MS 1000
+#define MULTIFD_AUTOTUNE_HOLD 3
+/* Higher levels need a lot more memory for little gain */
+#define MULTIFD_AUTOTUNE_ZSTD_LEVEL_MAX 19
+
+enum {
+    MULTIFD_AUTOTUNE_NONE,
+    MULTIFD_AUTOTUNE_ADD_CHANNEL,
+    MULTIFD_AUTOTUNE_DROP_CHANNEL,
+    MULTIFD_AUTOTUNE_RAISE_LEVEL,
+    MULTIFD_AUTOTUNE_LOWER_LEVEL,
+};
+
+/* Counters of a channel at the last step */
+typedef struct MultiFDAutotuneSample {
+    uint64_t prepare_ns;
+    uint64_t write_ns;
+    uint64_t pages;
+    uint64_t bytes;
+} MultiFDAutotuneSample;
+
+/* zstd level the channels compress with */
+int multifd_send_zstd_level(void)
+{
+    return qatomic_read(&multifd_send_state->zstd_level);
+}
+
+static void multifd_autotune_apply(int action)
+{
+    int i, active = multifd_send_state->active_channels;
+
+    switch (action) {
+    case MULTIFD_AUTOTUNE_ADD_CHANNEL:
+        active++;
+        break;
+    case MULTIFD_AUTOTUNE_DROP_CHANNEL:
+        active--;
+        break;
+    case MULTIFD_AUTOTUNE_RAISE_LEVEL:
+        qatomic_inc(&multifd_send_state->zstd_level);
+        return;
+    case MULTIFD_AUTOTUNE_LOWER_LEVEL:
+        qatomic_dec(&multifd_send_state->zstd_level);
+        return;
+    default:
+        return;
     }
 
-    if (pages->block != block) {
-        return  multifd_queue_page(f, block, offset);
+    /* The batches already queued to a channel that is idled still go */
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        multifd_send_state->params[i].active = i < active;
     }
+    multifd_send_state->active_channels = active;
+}
 
-    return 1;
+static int multifd_autotune_undo(int action)
+{
+    switch (action) {
+    case MULTIFD_AUTOTUNE_ADD_CHANNEL:
+        return MULTIFD_AUTOTUNE_DROP_CHANNEL;
+    case MULTIFD_AUTOTUNE_DROP_CHANNEL:
+        return MULTIFD_AUTOTUNE_ADD_CHANNEL;
+    case MULTIFD_AUTOTUNE_RAISE_LEVEL:
+        return MULTIFD_AUTOTUNE_LOWER_LEVEL;
+    case MULTIFD_AUTOTUNE_LOWER_LEVEL:
+        return MULTIFD_AUTOTUNE_RAISE_LEVEL;
+    default:
+        return MULTIFD_AUTOTUNE_NONE;
+    }
+}
+
+/**
+ * multifd_send_autotune: take a step of multifd-autotune
+ *
+ * Called by the migration thread with the bandwidth of the last
+ * iteration.
+ *
+ * @s: current migration state
+ */
+void multifd_send_autotune(MigrationState *s)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int channels = migrate_multifd_channels();
+    int active, level, action = MULTIFD_AUTOTUNE_NONE;
+    uint64_t prepare_ns = 0, write_ns = 0, pages = 0, bytes = 0;
+    uint64_t interval_ns, busy, cpu, rate;
+    bool zstd, limited;
+    int i;
+
+    if (!multifd_send_state || !multifd_send_state->autotune ||
+        now < multifd_send_state->tune_time + MULTIFD_AUTOTUNE_INTERVAL_MS) {
+        return;
+    }
+
+    for (i = 0; i < channels; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        MultiFDAutotuneSample *last = &multifd_send_state->tune_last[i];
+        MultiFDAutotuneSample cur = {
+            .prepare_ns = qatomic_read__nocheck(&p->prepare_ns),
+            .write_ns = qatomic_read__nocheck(&p->write_ns),
+            .pages = qatomic_read__nocheck(&p->num_pages),
+            .bytes = qatomic_read__nocheck(&p->packet_bytes),
+        };
+
+        if (p->active) {
+            prepare_ns += cur.prepare_ns - last->prepare_ns;
+            write_ns += cur.write_ns - last->write_ns;
+        }
+        pages += cur.pages - last->pages;
+        bytes += cur.bytes - last->bytes;
+        *last = cur;
+    }
+
+    active = multifd_send_state->active_channels;
+    level = multifd_send_state->zstd_level;
+    interval_ns = (now - multifd_send_state->tune_time) * SCALE_MS;
+    multifd_send_state->tune_time = now;
+    /* In percents of the time of the active channels */
+    busy = (prepare_ns + write_ns) * 100 / (active * interval_ns);
+    cpu = prepare_ns * 100 / (active * interval_ns);
+    rate = pages * NANOSECONDS_PER_SECOND / interval_ns;
+    zstd = migrate_multifd_compression() == MULTIFD_COMPRESSION_ZSTD;
+    limited = s->parameters.max_bandwidth &&
+              s->mbps * 1000 * 1000 / 8 >=
+              s->parameters.max_bandwidth * 0.9;
+
+    if (multifd_send_state->tune_action != MULTIFD_AUTOTUNE_NONE &&
+        rate < multifd_send_state->tune_rate * 9 / 10) {
+        action = multifd_autotune_undo(multifd_send_state->tune_action);
+        multifd_autotune_apply(action);
+        multifd_send_state->tune_action = MULTIFD_AUTOTUNE_NONE;
+        multifd_send_state->tune_hold = MULTIFD_AUTOTUNE_HOLD;
+    } else if (multifd_send_state->tune_hold) {
+        multifd_send_state->tune_hold--;
+        multifd_send_state->tune_action = MULTIFD_AUTOTUNE_NONE;
+    } else {
+        if (limited && zstd && cpu < 50 &&
+            level < MULTIFD_AUTOTUNE_ZSTD_LEVEL_MAX) {
+            action = MULTIFD_AUTOTUNE_RAISE_LEVEL;
+        } else if (busy < 50) {
+            if (active > 1) {
+                action = MULTIFD_AUTOTUNE_DROP_CHANNEL;
+            }
+        } else if (busy > 90 && cpu * 2 > busy) {
+            if (active < channels) {
+                action = MULTIFD_AUTOTUNE_ADD_CHANNEL;
+            } else if (zstd && level > 1) {
+                action = MULTIFD_AUTOTUNE_LOWER_LEVEL;
+            }
+        } else if (busy > 90) {
+            if (zstd && cpu < 50 && level < MULTIFD_AUTOTUNE_ZSTD_LEVEL_MAX) {
+                action = MULTIFD_AUTOTUNE_RAISE_LEVEL;
+            } else if (active < channels) {
+                action = MULTIFD_AUTOTUNE_ADD_CHANNEL;
+            }
+        }
+        multifd_autotune_apply(action);
+        multifd_send_state->tune_action = action;
+    }
+    multifd_send_state->tune_rate = rate;
+
+    trace_multifd_send_autotune(active, level, busy, cpu, rate,
+                                bytes ? pages * qemu_target_page_size() * 100 /
+                                        bytes : 0,
+                                action);
+}
+
+/**
+ * multifd_send_zero_page: tell the channels about a zero page
+ *
+ * Compression methods that keep a copy of the pages, like xbzrle,
+ * need to know when a page is sent as a zero page outside of the
+ * channels.
+ *
+ * @block: block of the page
+ * @offset: offset of the page inside the block
+ */
+void multifd_send_zero_page(RAMBlock *block, ram_addr_t offset)
+{
+    if (multifd_send_state && multifd_send_state->ops->send_zero_page) {
+        multifd_send_state->ops->send_zero_page(block, offset);
+    }
 }
 
 static void multifd_send_terminate_threads(Error *err)
@@ -545,8 +1539,13 @@ void multifd_save_cleanup(void)
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
         Error *local_err = NULL;
+        int j;
 
-        socket_send_channel_destroy(p->c);
+        if (migrate_fixed_ram() || p->rdma) {
+            object_unref(OBJECT(p->c));
+        } else {
+            socket_send_channel_destroy(p->c);
+        }
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
@@ -555,11 +1554,16 @@ void multifd_save_cleanup(void)
         p->name = NULL;
         g_free(p->tls_hostname);
         p->tls_hostname = NULL;
-        multifd_pages_clear(p->pages);
+        for (j = 0; j < MULTIFD_SEND_QUEUE_LEN; j++) {
+            multifd_pages_clear(p->queue[j]);
+            p->queue[j] = NULL;
+        }
         p->pages = NULL;
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        qemu_dsa_batch_task_free(p->dsa_task);
+        p->dsa_task = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -569,15 +1573,21 @@ void multifd_save_cleanup(void)
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
+    g_free(multifd_send_state->schedule);
+    multifd_send_state->schedule = NULL;
+    g_free(multifd_send_state->tune_last);
+    multifd_send_state->tune_last = NULL;
     multifd_pages_clear(multifd_send_state->pages);
     multifd_send_state->pages = NULL;
     g_free(multifd_send_state);
     multifd_send_state = NULL;
+    qemu_dsa_cleanup();
 }
 
 void multifd_send_sync_main(QEMUFile *f)
 {
     int i;
+    bool flush_zero_copy;
 
     if (!migrate_use_multifd()) {
         return;
@@ -593,32 +1603,190 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_signal(p->id);
 
-        qemu_mutex_lock(&p->mutex);
-
-        if (p->quit) {
+        if (qatomic_read(&p->quit)) {
             error_report("%s: channel %d has already quit", __func__, i);
-            qemu_mutex_unlock(&p->mutex);
             return;
         }
 
-        p->packet_num = multifd_send_state->packet_num++;
-        p->flags |= MULTIFD_FLAG_SYNC;
-        p->pending_job++;
+        /* The last slot of the queue is always free for us */
+        assert(multifd_send_queue_used(p) < MULTIFD_SEND_QUEUE_LEN);
+        /* The main batch is empty here, it only carries the flag */
+        multifd_send_state->pages =
+            multifd_send_queue_push(p, multifd_send_state->pages,
+                                    MULTIFD_FLAG_SYNC);
         qemu_file_update_transfer(f, p->packet_len);
-        ram_counters.multifd_bytes += p->packet_len;
-        ram_counters.transferred += p->packet_len;
-        qemu_mutex_unlock(&p->mutex);
-        qemu_sem_post(&p->sem);
+        stat64_add(&ram_atomic_counters.multifd_bytes, p->packet_len);
+        stat64_add(&ram_atomic_counters.transferred, p->packet_len);
     }
+
+    /*
+     * When using zero-copy, it's necessary to flush the pages before any of
+     * the pages can be sent again, so we'll make sure the new version of the
+     * pages will always arrive _later_ than the old pages.
+     *
+     * Currently we achieve this by flushing the zero-copy requested writes
+     * per ram iteration, but in the future we could potentially optimize it
+     * to be less frequent, e.g. only after we finished one whole scanning of
+     * all the dirty bitmaps.
+     */
+    flush_zero_copy = migrate_use_zero_copy_send();
+
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        multifd_send_account_zero_pages(f, p);
+
+        if (flush_zero_copy && p->c) {
+            Error *err = NULL;
+            int ret = qio_channel_flush(p->c, &err);
+
+            if (ret < 0) {
+                error_prepend(&err, "multifd %d: ", p->id);
+                multifd_send_terminate_threads(err);
+                error_free(err);
+                return;
+            }
+            if (ret == 1) {
+                stat64_add(&ram_atomic_counters.dirty_sync_missed_zero_copy, 1);
+            }
+        }
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/**
+ * multifd_send_zero_page_detect: split the pages in normal and zero ones
+ *
+ * Reorders the pages of the channel so that the normal pages come
+ * first and the zero pages last.  Afterwards, pages->used is the
+ * number of normal pages that need to be written to the channel, and
+ * pages->zero_num the number of zero pages whose offsets are only
+ * sent in the packet header.  With dsa-accel-path, a DSA device checks
+ * all the pages of the batch first.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i = 0;
+    uint32_t j = pages->used;
+    bool *zero = NULL;
+
+    if (qemu_dsa_is_running()) {
+        if (!p->dsa_task) {
+            p->dsa_task = qemu_dsa_batch_task_new();
+        }
+        zero = qemu_dsa_buffer_is_zero_batch(p->dsa_task, pages->iov,
+                                             pages->used);
+    }
+
+    while (i < j) {
+        ram_addr_t offset = pages->offset[i];
+        struct iovec iov = pages->iov[i];
+        uint8_t block_idx = pages->block_idx[i];
+
+        if (zero ? !zero[i] : !buffer_is_zero(iov.iov_base, page_size)) {
+            i++;
+            continue;
+        }
+        /* swap it with the last page that we haven't checked yet */
+        j--;
+        pages->offset[i] = pages->offset[j];
+        pages->iov[i] = pages->iov[j];
+        pages->block_idx[i] = pages->block_idx[j];
+        pages->offset[j] = offset;
+        pages->iov[j] = iov;
+        pages->block_idx[j] = block_idx;
+        if (zero) {
+            zero[i] = zero[j];
+            zero[j] = true;
+        }
+    }
+
+    pages->zero_num = pages->used - i;
+    pages->used = i;
+}
+
+/**
+ * multifd_send_adapt_batch: resize the batches of a channel
+ *
+ * Grow the batches queued to the channel when full ones are written
+ * quickly (amortizing the per packet costs over more pages), and
+ * shrink them when a write takes too long (so that a packet doesn't
+ * hold the channel for long).
+ *
+ * @p: channel that has just written a packet
+ * @pages: number of pages in that packet
+ * @latency_ns: time it took to write it
+ */
+static void multifd_send_adapt_batch(MultiFDSendParams *p, uint32_t pages,
+                                     int64_t latency_ns)
+{
+    uint32_t page_count = multifd_packet_page_count();
+    uint32_t min_pages = MULTIFD_ADAPTIVE_MIN_SIZE / qemu_target_page_size();
+    uint32_t batch = p->batch_pages;
+
+    min_pages = MAX(MIN(min_pages, page_count), 1);
+    if (latency_ns < MULTIFD_ADAPTIVE_GROW_NS && pages >= batch) {
+        batch = MIN(batch * 2, page_count);
+    } else if (latency_ns > MULTIFD_ADAPTIVE_SHRINK_NS) {
+        batch = MAX(batch / 2, min_pages);
+    }
+
+    if (batch != p->batch_pages) {
+        trace_multifd_send_adapt_batch(p->id, latency_ns, batch);
+        qatomic_set(&p->batch_pages, batch);
+    }
+}
+
+/**
+ * multifd_file_write_pages: write the pages of the channel with fixed-ram
+ *
+ * Writes the normal pages at their place in the migration file, with
+ * one write for each run of contiguous pages, and updates the bitmaps
+ * of the pages that are in the file.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_file_write_pages(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    int bits = qemu_target_page_bits();
+    uint32_t i, j;
+
+    for (i = 0; i < pages->used; i = j) {
+        RAMBlock *block = multifd_pages_block(pages, i);
+        ram_addr_t offset = pages->offset[i];
+
+        for (j = i + 1; j < pages->used; j++) {
+            if (multifd_pages_block(pages, j) != block ||
+                pages->offset[j] != offset + (j - i) * page_size) {
+                break;
+            }
+        }
+        if (file_pwrite_all(p->c, block->host + offset, (j - i) * page_size,
+                            block->pages_offset + offset, errp) < 0) {
+            return -1;
+        }
+        bitmap_set_atomic(block->file_bmap, offset >> bits, j - i);
+    }
+
+    for (i = pages->used; i < pages->used + pages->zero_num; i++) {
+        clear_bit_atomic(pages->offset[i] >> bits,
+                         multifd_pages_block(pages, i)->file_bmap);
+    }
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -628,73 +1796,150 @@ static void *multifd_send_thread(void *opaque)
 
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
+    if (p->numa_node >= 0) {
+        multifd_numa_pin_self(p->name, p->numa_node);
+    }
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        ret = -1;
-        goto out;
+    if (!migrate_fixed_ram()) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            ret = -1;
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
+        unsigned int tail = p->queue_tail;
+        uint64_t packet_num;
+        uint32_t used, zero_num;
+
         qemu_sem_wait(&p->sem);
 
         if (qatomic_read(&multifd_send_state->exiting)) {
             break;
         }
-        qemu_mutex_lock(&p->mutex);
 
-        if (p->pending_job) {
-            uint32_t used = p->pages->used;
-            uint64_t packet_num = p->packet_num;
-            flags = p->flags;
+        if (tail == qatomic_load_acquire(&p->queue_head)) {
+            if (qatomic_read(&p->quit)) {
+                break;
+            }
+            /* sometimes there are spurious wakeups */
+            continue;
+        }
+
+        int64_t start;
 
-            if (used) {
-                ret = multifd_send_state->ops->send_prepare(p, used,
-                                                            &local_err);
-                if (ret != 0) {
-                    qemu_mutex_unlock(&p->mutex);
-                    break;
-                }
+        /* The batch belongs to us until we move queue_tail */
+        p->pages = p->queue[tail % MULTIFD_SEND_QUEUE_LEN];
+        p->packet_num = p->pages->packet_num;
+        p->flags = p->pages->flags;
+        p->data_crc = 0;
+        packet_num = p->packet_num;
+        flags = p->flags;
+
+        /* With fixed-ram, zero pages are not written to the file */
+        if ((migrate_multifd_zero_page() || migrate_fixed_ram()) &&
+            p->pages->used) {
+            multifd_send_zero_page_detect(p);
+        }
+        used = p->pages->used;
+        zero_num = p->pages->zero_num;
+
+        if (multifd_send_state->ops->send_zero_page) {
+            uint32_t i;
+
+            for (i = used; i < used + zero_num; i++) {
+                multifd_send_state->ops->send_zero_page(
+                    multifd_pages_block(p->pages, i), p->pages->offset[i]);
+            }
+        }
+
+        if (used && !migrate_fixed_ram()) {
+            int64_t start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+            ret = multifd_send_state->ops->send_prepare(p, used,
+                                                        &local_err);
+            /* No-op without multifd compression */
+            migration_add_compress_time(p->id, start_us);
+            qatomic_set__nocheck(&p->prepare_ns, p->prepare_ns +
+                (qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us) *
+                SCALE_US);
+            if (ret != 0) {
+                break;
             }
+        } else if (p->pages->device_state) {
+            p->next_packet_size = p->pages->device_state_len;
+            multifd_send_data_crc(p, p->pages->device_state,
+                                  p->pages->device_state_len);
+        }
+        if (!migrate_fixed_ram()) {
             multifd_send_fill_packet(p);
-            p->flags = 0;
-            p->num_packets++;
-            p->num_pages += used;
-            p->pages->used = 0;
-            p->pages->block = NULL;
-            qemu_mutex_unlock(&p->mutex);
+        }
+        p->flags = 0;
+        p->num_packets++;
+        qatomic_set__nocheck(&p->num_pages, p->num_pages + used);
+        qatomic_set__nocheck(&p->packet_bytes,
+                             p->packet_bytes + p->next_packet_size);
+        p->num_zero_pages += zero_num;
+        if (zero_num) {
+            qatomic_add(&p->pending_zero_pages, zero_num);
+        }
 
-            trace_multifd_send(p->id, packet_num, used, flags,
-                               p->next_packet_size);
+        trace_multifd_send(p->id, packet_num, used, zero_num, flags,
+                           p->next_packet_size);
 
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (migrate_fixed_ram()) {
+            ret = multifd_file_write_pages(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        } else {
             ret = qio_channel_write_all(p->c, (void *)p->packet,
                                         p->packet_len, &local_err);
             if (ret != 0) {
                 break;
             }
 
-            if (used) {
-                ret = multifd_send_state->ops->send_write(p, used, &local_err);
+            if (p->pages->device_state) {
+                ret = qio_channel_write_all(p->c,
+                                            (void *)p->pages->device_state,
+                                            p->pages->device_state_len,
+                                            &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            } else if (used && p->rdma) {
+                ret = rdma_multifd_write_pages(p->c, p->pages->iov, used,
+                                               &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            } else if (used) {
+                ret = multifd_send_state->ops->send_write(p, used,
+                                                          &local_err);
                 if (ret != 0) {
                     break;
                 }
             }
+        }
 
-            qemu_mutex_lock(&p->mutex);
-            p->pending_job--;
-            qemu_mutex_unlock(&p->mutex);
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        qatomic_set__nocheck(&p->write_ns, p->write_ns + start);
+        if (migrate_multifd_adaptive_packet_size() &&
+            !(flags & MULTIFD_FLAG_SYNC)) {
+            multifd_send_adapt_batch(p, used + zero_num, start);
+        }
 
-            if (flags & MULTIFD_FLAG_SYNC) {
-                qemu_sem_post(&p->sem_sync);
-            }
-            qemu_sem_post(&multifd_send_state->channels_ready);
-        } else if (p->quit) {
-            qemu_mutex_unlock(&p->mutex);
-            break;
+        multifd_pages_reset(p->pages);
+        p->pages = NULL;
+        qatomic_store_release(&p->queue_tail, tail + 1);
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&p->sem_sync);
         } else {
-            qemu_mutex_unlock(&p->mutex);
-            /* sometimes there are spurious wakeups */
+            qemu_sem_post(&multifd_send_state->channels_ready);
         }
     }
 
@@ -719,7 +1964,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -782,9 +2028,9 @@ static void multifd_tls_channel_connect(MultiFDSendParams *p,
     trace_multifd_tls_outgoing_handshake_start(ioc, tioc, hostname);
     qio_channel_set_name(QIO_CHANNEL(tioc), "multifd-tls-outgoing");
     p->c = QIO_CHANNEL(tioc);
-    qemu_thread_create(&p->thread, "multifd-tls-handshake-worker",
-                       multifd_tls_handshake_thread, p,
-                       QEMU_THREAD_JOINABLE);
+    thread_context_create_thread(THREAD_GROUP_MULTIFD, &p->thread,
+                                 "multifd-tls-handshake-worker",
+                                 multifd_tls_handshake_thread, p);
 }
 
 static bool multifd_channel_connect(MultiFDSendParams *p,
@@ -815,8 +2061,8 @@ static bool multifd_channel_connect(MultiFDSendParams *p,
         } else {
             /* update for tls qio channel */
             p->c = ioc;
-            qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
-                                   QEMU_THREAD_JOINABLE);
+            thread_context_create_thread(THREAD_GROUP_MULTIFD, &p->thread,
+                                         p->name, multifd_send_thread, p);
        }
        return true;
     }
@@ -851,6 +2097,13 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     if (qio_task_propagate_error(task, &local_err)) {
         goto cleanup;
     } else {
+        if (migrate_use_zero_copy_send() &&
+            !qio_channel_has_feature(sioc,
+                                     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+            error_setg(&local_err, "multifd %d: zero copy send feature not "
+                       "detected in host kernel", p->id);
+            goto cleanup;
+        }
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
         p->running = true;
@@ -864,43 +2117,136 @@ cleanup:
     multifd_new_send_channel_cleanup(p, sioc, local_err);
 }
 
+/* With fixed-ram, each channel opens the migration file again */
+static void multifd_file_channel_connect(MultiFDSendParams *p)
+{
+    Error *local_err = NULL;
+    QIOChannel *ioc = file_send_channel_create(&local_err);
+
+    if (!ioc) {
+        multifd_new_send_channel_cleanup(p, NULL, local_err);
+        return;
+    }
+
+    p->c = ioc;
+    p->running = true;
+    thread_context_create_thread(THREAD_GROUP_MULTIFD, &p->thread, p->name,
+                                 multifd_send_thread, p);
+}
+
+/*
+ * Interleave the channels by their weight (smooth weighted round-robin),
+ * so that the channels of a link don't get all their batches in a row.
+ */
+static void multifd_send_schedule_init(int thread_count)
+{
+    g_autofree int *current = g_new0(int, thread_count);
+    int total = 0;
+    int i, n;
+
+    for (i = 0; i < thread_count; i++) {
+        total += migrate_multifd_channel_weight(i);
+    }
+    multifd_send_state->schedule = g_new(uint8_t, total);
+    multifd_send_state->schedule_len = total;
+    multifd_send_state->next_slot = 0;
+
+    for (n = 0; n < total; n++) {
+        int best = 0;
+
+        for (i = 0; i < thread_count; i++) {
+            current[i] += migrate_multifd_channel_weight(i);
+            if (current[i] > current[best]) {
+                best = i;
+            }
+        }
+        current[best] -= total;
+        multifd_send_state->schedule[n] = best;
+    }
+}
+
 int multifd_save_setup(Error **errp)
 {
     int thread_count;
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = multifd_packet_page_count();
     uint8_t i;
     MigrationState *s;
+    bool rdma;
 
     if (!migrate_use_multifd()) {
         return 0;
     }
     s = migrate_get_current();
+    rdma = qio_channel_is_rdma(qemu_file_get_ioc(s->to_dst_file));
+    if (rdma && (migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE ||
+                 migrate_postcopy_ram())) {
+        error_setg(errp, "multifd over RDMA writes the pages straight to "
+                   "the destination RAM: it doesn't support compression "
+                   "or postcopy");
+        return -1;
+    }
+    if (qemu_dsa_init(migrate_dsa_accel_path(), errp)) {
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
     multifd_send_state->pages = multifd_pages_init(page_count);
-    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->channels_ready,
+                  thread_count * (MULTIFD_SEND_QUEUE_LEN - 1));
+    multifd_send_state->multi_block = s->multifd_multi_block;
+    multifd_send_state->batch_pages = page_count;
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_send_schedule_init(thread_count);
+    multifd_send_state->numa = migrate_multifd_numa_affinity();
+    multifd_send_state->batch_node = -1;
+    multifd_send_state->autotune = migrate_multifd_autotune();
+    multifd_send_state->active_channels = thread_count;
+    multifd_send_state->zstd_level = migrate_multifd_zstd_level();
+    multifd_send_state->tune_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    multifd_send_state->tune_last = g_new0(MultiFDAutotuneSample,
+                                           thread_count);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
+        int j;
 
         qemu_mutex_init(&p->mutex);
         qemu_sem_init(&p->sem, 0);
         qemu_sem_init(&p->sem_sync, 0);
         p->quit = false;
-        p->pending_job = 0;
         p->id = i;
-        p->pages = multifd_pages_init(page_count);
+        for (j = 0; j < MULTIFD_SEND_QUEUE_LEN; j++) {
+            p->queue[j] = multifd_pages_init(page_count);
+        }
+        p->queue_head = 0;
+        p->queue_tail = 0;
+        p->pending_zero_pages = 0;
+        p->batch_pages = page_count;
+        p->numa_node = multifd_numa_channel_node(i);
+        p->active = true;
+        p->name = g_strdup_printf("multifdsend_%d", i);
+        p->tls_hostname = g_strdup(s->hostname);
+        if (migrate_fixed_ram()) {
+            /* No packets, the pages go straight to the file */
+            multifd_file_channel_connect(p);
+            continue;
+        }
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-        p->packet->version = cpu_to_be32(MULTIFD_VERSION);
-        p->name = g_strdup_printf("multifdsend_%d", i);
-        p->tls_hostname = g_strdup(s->hostname);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        p->packet->version = cpu_to_be32(multifd_send_state->multi_block ?
+                                         MULTIFD_PACKET_VERSION_MULTI_BLOCK :
+                                         MULTIFD_PACKET_VERSION_SINGLE_BLOCK);
+        p->rdma = rdma;
+        if (rdma) {
+            rdma_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p,
+                                       i);
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -925,6 +2271,10 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* taken by the channel that measures the load of all of them */
+    QemuMutex load_mutex;
+    /* when the load was last measured, in ms */
+    int64_t load_time;
     /* multifd ops */
     MultiFDMethods *ops;
 } *multifd_recv_state;
@@ -967,10 +2317,12 @@ int multifd_load_cleanup(Error **errp)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
+    /* Wake up the channels waiting for postcopy to listen */
+    qemu_event_set(&migration_incoming_get_current()->postcopy_listen_event);
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -1003,16 +2355,30 @@ int multifd_load_cleanup(Error **errp)
         p->name = NULL;
         multifd_pages_clear(p->pages);
         p->pages = NULL;
+        g_free(p->iov);
+        p->iov = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
+        g_free(p->postcopy_host);
+        p->postcopy_host = NULL;
+        p->postcopy_pages = 0;
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        qemu_dsa_batch_task_free(p->dsa_task);
+        p->dsa_task = NULL;
+        g_free(p->dsa_iov);
+        p->dsa_iov = NULL;
+        p->dsa_iov_num = 0;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_mutex_destroy(&multifd_recv_state->load_mutex);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
     multifd_recv_state = NULL;
+    qemu_dsa_cleanup();
 
     return 0;
 }
@@ -1021,7 +2387,7 @@ void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1044,6 +2410,233 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_postcopy_pages: receive and place the pages of a packet
+ *
+ * During postcopy guest memory can't be written directly: the pages
+ * are read into a buffer of the channel and then placed one by one.
+ * The source only sends pages of blocks without huge pages through
+ * multifd during postcopy, so each page is a whole host page.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_postcopy_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t used = pages->used;
+    uint32_t i;
+    int ret;
+
+    if (pages->allocated > p->postcopy_pages) {
+        g_free(p->postcopy_buf);
+        g_free(p->postcopy_host);
+        p->postcopy_pages = pages->allocated;
+        p->postcopy_buf = g_malloc(p->postcopy_pages * page_size);
+        p->postcopy_host = g_new(void *, p->postcopy_pages);
+    }
+
+    if (used) {
+        for (i = 0; i < used; i++) {
+            p->postcopy_host[i] = pages->iov[i].iov_base;
+            pages->iov[i].iov_base = p->postcopy_buf + i * page_size;
+        }
+        multifd_recv_coalesce_iov(p);
+
+        ret = multifd_recv_state->ops->recv_pages(p, used, errp);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < used + pages->zero_num; i++) {
+        RAMBlock *block = pages->blocks[pages->block_idx[i]];
+
+        if (i < used) {
+            ret = postcopy_place_page(mis, p->postcopy_host[i],
+                                      pages->iov[i].iov_base, block);
+        } else {
+            ret = postcopy_place_page_zero(mis, pages->iov[i].iov_base,
+                                           block);
+        }
+        if (ret) {
+            error_setg(errp, "multifd %d: failed to place page: %s",
+                       p->id, strerror(-ret));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * multifd_recv_device_state: read the buffer of a device state packet
+ *
+ * Reads the buffer that follows the packet and passes it to the
+ * section of its device.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    uint8_t *data = g_try_malloc(p->next_packet_size);
+
+    if (!data) {
+        error_setg(errp, "multifd %u: can't allocate %u bytes of device "
+                   "state", p->id, p->next_packet_size);
+        return -1;
+    }
+    if (qio_channel_read_all(p->c, (void *)data, p->next_packet_size,
+                             errp) ||
+        multifd_recv_check_data_crc(p, data, p->next_packet_size, errp)) {
+        g_free(data);
+        return -1;
+    }
+    return qemu_loadvm_load_state_buffer(packet->ramblock,
+                                         be32_to_cpu(packet->instance_id),
+                                         be64_to_cpu(packet->device_state_idx),
+                                         data, p->next_packet_size, errp);
+}
+
+/**
+ * multifd_recv_zero_pages_dsa: zero the zero pages of a packet with DSA
+ *
+ * Like ram_handle_compressed(), only writes the pages that are not
+ * zero already, so that they don't get allocated: one batch compares
+ * the pages that may have been written before, and another one zeroes
+ * the ones that are not zero.
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of normal pages of the packet, the zero ones follow
+ * @zero_num: number of zero pages of the packet
+ * @colo: whether the pages are in the RAM cache of COLO
+ */
+static void multifd_recv_zero_pages_dsa(MultiFDRecvParams *p, uint32_t used,
+                                        uint32_t zero_num, bool colo)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i, n = 0, fill = 0;
+    bool *zero;
+
+    if (!p->dsa_task) {
+        p->dsa_task = qemu_dsa_batch_task_new();
+    }
+    if (pages->allocated > p->dsa_iov_num) {
+        g_free(p->dsa_iov);
+        p->dsa_iov_num = pages->allocated;
+        p->dsa_iov = g_new(struct iovec, p->dsa_iov_num);
+    }
+
+    for (i = used; i < used + zero_num; i++) {
+        RAMBlock *block = multifd_pages_block(pages, i);
+
+        if (colo || !ramblock_recv_page_is_pristine(block,
+                                                    pages->iov[i].iov_base)) {
+            p->dsa_iov[n++] = pages->iov[i];
+        }
+    }
+    if (!n) {
+        return;
+    }
+
+    zero = qemu_dsa_buffer_is_zero_batch(p->dsa_task, p->dsa_iov, n);
+    for (i = 0; i < n; i++) {
+        if (!zero[i]) {
+            p->dsa_iov[fill++] = p->dsa_iov[i];
+        }
+    }
+    if (fill) {
+        qemu_dsa_fill_zero_batch(p->dsa_task, p->dsa_iov, fill);
+    }
+}
+
+/* Socket under @ioc, whose receive queue holds the backlog of the channel */
+static int multifd_recv_channel_fd(QIOChannel *ioc)
+{
+    if (object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TLS)) {
+        ioc = QIO_CHANNEL_TLS(ioc)->master;
+    }
+    if (object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_SOCKET)) {
+        return QIO_CHANNEL_SOCKET(ioc)->fd;
+    }
+    return -1;
+}
+
+/* Bytes that the host received for @p and that the channel didn't read */
+static uint64_t multifd_recv_queued(MultiFDRecvParams *p)
+{
+    int queued;
+
+    if (p->sock_fd < 0 || ioctlsocket(p->sock_fd, FIONREAD, &queued) < 0) {
+        return 0;
+    }
+    return queued;
+}
+
+/**
+ * multifd_recv_load: measure the load of the channels
+ *
+ * Called by the channels after each packet.  Every
+ * MULTIFD_RECV_LOAD_INTERVAL, the first one to get here measures the
+ * load of all of them and, with multifd-backpressure, reports it to
+ * the source on the return path.
+ */
+static void multifd_recv_load(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int channels = migrate_multifd_channels();
+    g_autofree MultiFDRecvChannelLoad *load = NULL;
+    int64_t now, interval;
+    int i, nr = 0;
+
+    if (qemu_mutex_trylock(&multifd_recv_state->load_mutex)) {
+        /* Another channel is at it */
+        return;
+    }
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    interval = now - multifd_recv_state->load_time;
+    if (interval < MULTIFD_RECV_LOAD_INTERVAL) {
+        qemu_mutex_unlock(&multifd_recv_state->load_mutex);
+        return;
+    }
+    multifd_recv_state->load_time = now;
+
+    load = g_new0(MultiFDRecvChannelLoad, channels);
+    for (i = 0; i < channels; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (!p->c) {
+            continue;
+        }
+        WITH_QEMU_LOCK_GUARD(&p->mutex) {
+            p->load_rate = (p->num_bytes - p->load_bytes) * 1000 / interval;
+            p->load_busy = MIN((p->busy_ns - p->load_busy_ns) * 100 /
+                               (interval * SCALE_MS), 100);
+            p->load_bytes = p->num_bytes;
+            p->load_busy_ns = p->busy_ns;
+            load[nr].rate = p->load_rate;
+            load[nr].busy = p->load_busy;
+        }
+        load[nr].id = p->id;
+        load[nr].queued = multifd_recv_queued(p);
+        trace_multifd_recv_load(p->id, load[nr].queued, load[nr].rate,
+                                load[nr].busy);
+        nr++;
+    }
+    qemu_mutex_unlock(&multifd_recv_state->load_mutex);
+
+    if (migrate_multifd_backpressure() && mis->to_src_file) {
+        migrate_send_rp_recv_load(mis, load, nr);
+    }
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1052,10 +2645,14 @@ static void *multifd_recv_thread(void *opaque)
 
     trace_multifd_recv_thread_start(p->id);
     rcu_register_thread();
+    if (p->numa_node >= 0) {
+        multifd_numa_pin_self(p->name, p->numa_node);
+    }
 
     while (true) {
-        uint32_t used;
+        uint32_t used, zero_num, i;
         uint32_t flags;
+        int64_t start, busy_start, now;
 
         if (p->quit) {
             break;
@@ -1069,6 +2666,7 @@ static void *multifd_recv_thread(void *opaque)
         if (ret == -1) {   /* Error */
             break;
         }
+        busy_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
         qemu_mutex_lock(&p->mutex);
         ret = multifd_recv_unfill_packet(p, &local_err);
@@ -1078,21 +2676,95 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        zero_num = p->pages->zero_num;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, used, zero_num, flags,
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
+        p->num_zero_pages += zero_num;
+        p->num_bytes += p->packet_len + p->next_packet_size;
         qemu_mutex_unlock(&p->mutex);
 
-        if (used) {
-            ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
+        if (flags & MULTIFD_FLAG_DEVICE_STATE) {
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            ret = multifd_recv_device_state(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        } else if ((flags & MULTIFD_FLAG_POSTCOPY) && (used + zero_num)) {
+            /* The main thread may not have processed the listen yet */
+            qemu_event_wait(&migration_incoming_get_current()->
+                            postcopy_listen_event);
+            if (p->quit) {
+                break;
+            }
+
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            ret = multifd_recv_postcopy_pages(p, &local_err);
             if (ret != 0) {
                 break;
             }
+        } else {
+            /* Pages of COLO checkpoints are in the RAM cache */
+            bool colo = migration_incoming_in_colo_state();
+
+            /*
+             * Zero pages are not in the stream.  Don't touch them if
+             * they are already zero, so we don't allocate memory for
+             * them, and don't even read them if they were never
+             * received, so they are not faulted in.
+             */
+            if (qemu_dsa_is_running()) {
+                multifd_recv_zero_pages_dsa(p, used, zero_num, colo);
+            } else {
+                for (i = used; i < used + zero_num; i++) {
+                    RAMBlock *block = multifd_pages_block(p->pages, i);
+                    void *host = p->pages->iov[i].iov_base;
+
+                    if (colo || !ramblock_recv_page_is_pristine(block, host)) {
+                        ram_handle_compressed(host, 0,
+                                              p->pages->iov[i].iov_len);
+                    }
+                }
+            }
+            for (i = 0; !colo && i < used + zero_num; i++) {
+                ramblock_recv_bitmap_set(multifd_pages_block(p->pages, i),
+                                         p->pages->iov[i].iov_base);
+            }
+
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            /* RDMA wrote the pages before the packet arrived */
+            if (used && !p->rdma) {
+                ret = multifd_recv_state->ops->recv_pages(p, used,
+                                                          &local_err);
+                if (ret != 0) {
+                    break;
+                }
+                if (ram_dedup_store_active()) {
+                    for (i = 0; i < used; i++) {
+                        ram_dedup_store_insert(p->pages->iov[i].iov_base);
+                    }
+                }
+            }
+            /* Keep the RAM cache a copy of guest RAM until COLO starts */
+            if (!colo && migration_incoming_colo_enabled()) {
+                for (i = 0; i < used + zero_num; i++) {
+                    colo_cache_backup_page(multifd_pages_block(p->pages, i),
+                                           p->pages->iov[i].iov_base);
+                }
+            }
+        }
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        qemu_mutex_lock(&p->mutex);
+        if (used) {
+            p->decompress_time_ns += now - start;
         }
+        p->busy_ns += now - busy_start;
+        qemu_mutex_unlock(&p->mutex);
+        multifd_recv_load();
 
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
@@ -1109,7 +2781,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -1117,17 +2790,22 @@ static void *multifd_recv_thread(void *opaque)
 int multifd_load_setup(Error **errp)
 {
     int thread_count;
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = multifd_packet_page_count();
     uint8_t i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return 0;
     }
+    if (qemu_dsa_init(migrate_dsa_accel_path(), errp)) {
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     qatomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_mutex_init(&multifd_recv_state->load_mutex);
+    multifd_recv_state->load_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
@@ -1138,9 +2816,12 @@ int multifd_load_setup(Error **errp)
         p->quit = false;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
+        p->iov = g_new0(struct iovec, page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
+        p->numa_node = multifd_numa_channel_node(i);
+        p->sock_fd = -1;
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
 
@@ -1158,11 +2839,53 @@ int multifd_load_setup(Error **errp)
     return 0;
 }
 
+MultiFDRecvChannelStatsList *multifd_recv_channels_stats(void)
+{
+    MultiFDRecvChannelStatsList *head = NULL, **tail = &head;
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int i;
+
+    if (!multifd_recv_state) {
+        return NULL;
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        MultiFDRecvChannelStats *stats;
+        int64_t elapsed;
+
+        if (!p->c) {
+            continue;
+        }
+
+        stats = g_new0(MultiFDRecvChannelStats, 1);
+        stats->id = p->id;
+        WITH_QEMU_LOCK_GUARD(&p->mutex) {
+            stats->packets = p->num_packets;
+            stats->pages = p->num_pages;
+            stats->zero_pages = p->num_zero_pages;
+            stats->bytes = p->num_bytes;
+            stats->decompress_time = p->decompress_time_ns / SCALE_US;
+            stats->rate = p->load_rate;
+            stats->busy = p->load_busy;
+        }
+        stats->queued = multifd_recv_queued(p);
+        elapsed = now - p->start_time;
+        if (elapsed > 0) {
+            /* bits per millisecond is Kbps, so divide again for Mbps */
+            stats->mbps = (double)stats->bytes * 8 / elapsed / 1000;
+        }
+        QAPI_LIST_APPEND(tail, stats);
+    }
+
+    return head;
+}
+
 bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return true;
     }
 
@@ -1180,13 +2903,30 @@ bool multifd_recv_all_channels_created(void)
  * - Return false and do not set @errp when correctly receiving the current one;
  * - Return false and set @errp when failing to receive the current channel.
  */
-bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
+static int multifd_recv_load_dict(MultiFDRecvParams *p, QIOChannel *ioc,
+                                  uint32_t dict_size, Error **errp)
+{
+    g_autofree void *dict = g_malloc(dict_size);
+
+    if (!multifd_recv_state->ops->recv_dict) {
+        error_setg(errp, "received a dictionary that the compression "
+                   "method doesn't use");
+        return -1;
+    }
+    if (qio_channel_read_all(ioc, dict, dict_size, errp) < 0) {
+        return -1;
+    }
+    return multifd_recv_state->ops->recv_dict(p, dict, dict_size, errp);
+}
+
+bool multifd_recv_new_channel(QIOChannel *ioc, uint32_t magic, Error **errp)
 {
     MultiFDRecvParams *p;
     Error *local_err = NULL;
+    uint32_t dict_size;
     int id;
 
-    id = multifd_recv_initial_packet(ioc, &local_err);
+    id = multifd_recv_initial_packet(ioc, magic, &dict_size, &local_err);
     if (id < 0) {
         multifd_recv_terminate_threads(local_err);
         error_propagate_prepend(errp, local_err,
@@ -1205,14 +2945,25 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
         error_propagate(errp, local_err);
         return false;
     }
+    if (dict_size && multifd_recv_load_dict(p, ioc, dict_size,
+                                            &local_err) < 0) {
+        error_prepend(&local_err, "multifd %d: ", id);
+        multifd_recv_terminate_threads(local_err);
+        error_propagate(errp, local_err);
+        return false;
+    }
     p->c = ioc;
     object_ref(OBJECT(ioc));
+    p->rdma = qio_channel_is_rdma(ioc);
+    p->sock_fd = multifd_recv_channel_fd(ioc);
     /* initial packet */
     p->num_packets = 1;
+    p->num_bytes = sizeof(MultiFDInit_t) + dict_size;
+    p->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     p->running = true;
-    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
-                       QEMU_THREAD_JOINABLE);
+    thread_context_create_thread(THREAD_GROUP_MULTIFD, &p->thread, p->name,
+                                 multifd_recv_thread, p);
     qatomic_inc(&multifd_recv_state->count);
     return qatomic_read(&multifd_recv_state->count) ==
            migrate_multifd_channels();
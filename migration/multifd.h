@@ -13,15 +13,28 @@
 #ifndef QEMU_MIGRATION_MULTIFD_H
 #define QEMU_MIGRATION_MULTIFD_H
 
+#include "qemu/dsa.h"
+
 int multifd_save_setup(Error **errp);
 void multifd_save_cleanup(void);
 int multifd_load_setup(Error **errp);
 int multifd_load_cleanup(Error **errp);
 bool multifd_recv_all_channels_created(void);
-bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
+bool multifd_recv_new_channel(QIOChannel *ioc, uint32_t magic, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+int multifd_queue_pages(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                        uint32_t npages);
+int multifd_queue_reserve(QEMUFile *f, uint32_t npages);
+void multifd_send_zero_page(RAMBlock *block, ram_addr_t offset);
+uint32_t multifd_packet_page_count(void);
+void multifd_send_autotune(MigrationState *s);
+int multifd_send_zstd_level(void);
+MultiFDRecvChannelStatsList *multifd_recv_channels_stats(void);
+
+/* How often the destination channels measure their load, in ms */
+#define MULTIFD_RECV_LOAD_INTERVAL 100
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,9 +45,53 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
+#define MULTIFD_FLAG_QATZIP (4 << 1)
+#define MULTIFD_FLAG_XBZRLE (5 << 1)
+
+/*
+ * Sent during postcopy: the destination has to place the pages
+ * atomically instead of writing them to guest memory.
+ */
+#define MULTIFD_FLAG_POSTCOPY (1 << 4)
+
+/*
+ * The packet carries a buffer of device state instead of pages, from
+ * multifd_queue_device_state(): ramblock[] holds the id of the section
+ * of the device, and the buffer of next_packet_size bytes follows.
+ */
+#define MULTIFD_FLAG_DEVICE_STATE (1 << 5)
 
-/* This value needs to be a multiple of qemu_target_page_size() */
+/*
+ * Default for the multifd-packet-size parameter.  It needs to be a
+ * multiple of qemu_target_page_size()
+ */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
+#define MULTIFD_PACKET_SIZE_MAX (16 * 1024 * 1024)
+
+/* Biggest compression dictionary sent after the initial packet */
+#define MULTIFD_DICT_SIZE_MAX (1 * 1024 * 1024)
+/* Most pages sampled to train a zstd dictionary */
+#define MULTIFD_ZSTD_DICT_PAGES_MAX 65536
+
+/*
+ * Packet versions.  Version 2 packets can carry pages from several
+ * RAMBlocks: ramblock[] holds a table of block names, each one
+ * prefixed by its length in a byte and the table ends with a zero
+ * length, and the index of the block of each page in that table is
+ * stored in the low bits of its (page aligned) offset.
+ */
+#define MULTIFD_PACKET_VERSION_SINGLE_BLOCK 1
+#define MULTIFD_PACKET_VERSION_MULTI_BLOCK 2
+
+/* Maximum number of blocks in a packet, each name uses two bytes at least */
+#define MULTIFD_PACKET_MAX_BLOCKS 128
+
+/*
+ * Number of batches that can be queued to each send channel.  Must
+ * be a power of two.  One slot is always kept for the sync packet.
+ */
+#define MULTIFD_SEND_QUEUE_LEN 8
 
 typedef struct {
     uint32_t magic;
@@ -46,7 +103,22 @@ typedef struct {
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /*
+     * number of zero pages, their offsets go after the ones of the
+     * pages_used normal pages.  Only used with multifd-zero-page.
+     */
+    uint32_t zero_pages;
+    /* with MULTIFD_FLAG_DEVICE_STATE, instance of the section */
+    uint32_t instance_id;
+    /* with MULTIFD_FLAG_DEVICE_STATE, index of the buffer of the device */
+    uint64_t device_state_idx;
+    /*
+     * with multifd-crc32c, CRC32C of the packet with packet_crc zero,
+     * and of the data that follows it
+     */
+    uint32_t packet_crc;
+    uint32_t data_crc;
+    uint64_t unused64;    /* Reserved for future use */
     char ramblock[256];
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -54,17 +126,43 @@ typedef struct {
 typedef struct {
     /* number of used pages */
     uint32_t used;
+    /* number of zero pages, stored after the used ones */
+    uint32_t zero_num;
     /* number of allocated pages */
     uint32_t allocated;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* multifd flags of the packet carrying this batch */
+    uint32_t flags;
     /* offset of each page */
     ram_addr_t *offset;
     /* pointer to each page */
     struct iovec *iov;
+    /* block of the first page */
     RAMBlock *block;
+    /* for multi block packets, blocks of the pages */
+    RAMBlock *blocks[MULTIFD_PACKET_MAX_BLOCKS];
+    /* number of blocks in blocks[] */
+    uint32_t nr_blocks;
+    /* size of the block names table in the packet */
+    uint32_t blocks_size;
+    /* index in blocks[] of each page */
+    uint8_t *block_idx;
+    /* buffer of device state sent instead of pages, owned by the batch */
+    uint8_t *device_state;
+    uint32_t device_state_len;
+    uint32_t device_state_idx;
+    /* section of the device */
+    char idstr[256];
+    uint32_t instance_id;
 } MultiFDPages_t;
 
+/* block of page @i of @pages */
+static inline RAMBlock *multifd_pages_block(MultiFDPages_t *pages, uint32_t i)
+{
+    return pages->nr_blocks ? pages->blocks[pages->block_idx[i]] : pages->block;
+}
+
 typedef struct {
     /* this fields are not changed once the thread is created */
     /* channel number */
@@ -85,12 +183,34 @@ typedef struct {
     bool running;
     /* should this thread finish */
     bool quit;
-    /* thread has work to do */
-    int pending_job;
-    /* array of pages to sent */
-    MultiFDPages_t *pages;
+    /* the pages are written with RDMA, not sent through the channel */
+    bool rdma;
+    /*
+     * Ring of batches queued to this channel.  queue_head is only
+     * written by the migration thread and queue_tail only by the
+     * channel thread, so no lock is needed to queue or dequeue.
+     */
+    MultiFDPages_t *queue[MULTIFD_SEND_QUEUE_LEN];
+    unsigned int queue_head;
+    unsigned int queue_tail;
+    /* zero pages not yet accounted in ram_counters, updated atomically */
+    uint32_t pending_zero_pages;
+    /*
+     * pages the next batch for this channel should have, only changed
+     * by the channel thread with multifd-adaptive-packet-size
+     */
+    uint32_t batch_pages;
     /* packet allocated len */
     uint32_t packet_len;
+    /*
+     * compression dictionary sent after the initial packet, owned by
+     * the compression method and set up by send_setup()
+     */
+    const void *dict;
+    uint32_t dict_len;
+    /* thread local variables */
+    /* batch of pages being sent, it belongs to the queue */
+    MultiFDPages_t *pages;
     /* pointer to the packet */
     MultiFDPacket_t *packet;
     /* multifd flags for each packet */
@@ -99,13 +219,33 @@ typedef struct {
     uint32_t next_packet_size;
     /* global number of generated multifd packets */
     uint64_t packet_num;
-    /* thread local variables */
     /* packets sent through this channel */
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages detected by this channel */
+    uint64_t num_zero_pages;
+    /* with multifd-numa-affinity, host node of the channel, or -1 */
+    int numa_node;
+    /*
+     * whether the channel gets new batches, only changed by the
+     * migration thread with multifd-autotune
+     */
+    bool active;
+    /* time spent compressing and writing packets, in ns */
+    uint64_t prepare_ns;
+    uint64_t write_ns;
+    /* bytes sent after the packet headers */
+    uint64_t packet_bytes;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* with multifd-crc32c, CRC32C of the data sent after the packet */
+    uint32_t data_crc;
+    /* without compression, with multifd-crc32c, the pages sent */
+    uint8_t *crc_buf;
+    uint32_t crc_buf_pages;
+    /* with dsa-accel-path, batch of the zero page detection */
+    QemuDsaBatchTask *dsa_task;
     /* used for compression methods */
     void *data;
 }  MultiFDSendParams;
@@ -126,6 +266,8 @@ typedef struct {
     bool running;
     /* should this thread finish */
     bool quit;
+    /* the source writes the pages to guest RAM with RDMA */
+    bool rdma;
     /* array of pages to receive */
     MultiFDPages_t *pages;
     /* packet allocated len */
@@ -136,13 +278,51 @@ typedef struct {
     uint32_t flags;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* bytes received through this channel, packet headers included */
+    uint64_t num_bytes;
+    /* time spent placing the page data, decompression included, in ns */
+    uint64_t decompress_time_ns;
+    /* when the channel was set up, in ms */
+    int64_t start_time;
+    /* time spent on packets rather than waiting for them, in ns */
+    uint64_t busy_ns;
+    /* socket under the channel, -1 if it's not a socket */
+    int sock_fd;
+    /*
+     * load over the last MULTIFD_RECV_LOAD_INTERVAL, and num_bytes and
+     * busy_ns at its start
+     */
+    uint64_t load_rate;
+    uint8_t load_busy;
+    uint64_t load_bytes;
+    uint64_t load_busy_ns;
     /* thread local variables */
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
+    /* with multifd-crc32c, CRC32C of the data that follows the packet */
+    uint32_t data_crc;
+    /* normal pages of the packet, with contiguous pages coalesced */
+    struct iovec *iov;
+    /* number of entries used in iov */
+    uint32_t iovs_num;
+    /* during postcopy, pages are read here and then placed */
+    uint8_t *postcopy_buf;
+    /* guest address of each page in postcopy_buf */
+    void **postcopy_host;
+    /* number of pages that fit in postcopy_buf */
+    uint32_t postcopy_pages;
+    /* with dsa-accel-path, batches that zero the zero pages */
+    QemuDsaBatchTask *dsa_task;
+    struct iovec *dsa_iov;
+    uint32_t dsa_iov_num;
     /* packets sent through this channel */
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages received through this channel */
+    uint64_t num_zero_pages;
+    /* with multifd-numa-affinity, host node of the channel, or -1 */
+    int numa_node;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for de-compression methods */
@@ -164,9 +344,27 @@ typedef struct {
     void (*recv_cleanup)(MultiFDRecvParams *p);
     /* Read all pages */
     int (*recv_pages)(MultiFDRecvParams *p, uint32_t used, Error **errp);
+    /* Optional: use the dictionary sent after the initial packet */
+    int (*recv_dict)(MultiFDRecvParams *p, const void *dict, uint32_t len,
+                     Error **errp);
+    /*
+     * Optional: a page was sent as a zero page, either by a channel or
+     * by the migration thread.  Can be called from any of them.
+     */
+    void (*send_zero_page)(RAMBlock *block, ram_addr_t offset);
 } MultiFDMethods;
 
 void multifd_register_ops(int method, MultiFDMethods *ops);
 
+/*
+ * With multifd-crc32c, the send_prepare() of compression methods pass
+ * the data they send to multifd_send_data_crc(), and their recv_pages()
+ * pass the data they read to multifd_recv_check_data_crc() before using
+ * it.  Both do nothing without it.
+ */
+void multifd_send_data_crc(MultiFDSendParams *p, const void *buf, size_t len);
+int multifd_recv_check_data_crc(MultiFDRecvParams *p, const void *buf,
+                                size_t len, Error **errp);
+
 #endif
 
@@ -16,16 +16,31 @@
 
 #include "qapi/qmp/qerror.h"
 #include "qapi/error.h"
+#include "qemu/bitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/memfd.h"
+#include "qemu/mmap-alloc.h"
 #include "page_cache.h"
 #include "trace.h"
 
+#ifdef CONFIG_NUMA
+#include <numaif.h>
+#endif
+
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * The cache is set associative: a page can be in any of the
+ * PAGE_CACHE_WAYS items of the set picked by its address, so pages
+ * that fall in the same set don't keep evicting each other.
+ */
+#define PAGE_CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
+    /* -1 if the item is free */
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
@@ -36,9 +51,113 @@ struct PageCache {
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    /* items in each set, a power of two */
+    size_t ways;
+    /* number of sets, a power of two */
+    size_t num_sets;
+    /* for each set, the way where the CLOCK hand looks for a victim */
+    uint8_t *hand;
+    /* memory for the data of all the items */
+    uint8_t *pool;
+    size_t pool_size;
+    /* memfd backing the pool with huge pages, or -1 */
+    int pool_fd;
 };
 
-PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
+static void cache_free_pool(PageCache *cache)
+{
+    if (cache->pool_fd >= 0) {
+        qemu_ram_munmap(cache->pool_fd, cache->pool, cache->pool_size);
+        close(cache->pool_fd);
+    } else {
+        qemu_anon_ram_free(cache->pool, cache->pool_size);
+    }
+    cache->pool = NULL;
+}
+
+/*
+ * cache_alloc_pool: allocate the memory where the pages are cached
+ *
+ * The pool is only populated as pages get inserted, and it is backed
+ * by transparent huge pages when the host has them, or by huge pages
+ * of the default size with @hugetlb.  With @numa_node >= 0 it is
+ * bound to that host NUMA node, before anything is populated.
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int cache_alloc_pool(PageCache *cache, size_t size, bool hugetlb,
+                            int64_t numa_node, Error **errp)
+{
+    cache->pool_fd = -1;
+    cache->pool_size = size;
+
+    if (hugetlb) {
+#ifdef CONFIG_LINUX
+        int fd = qemu_memfd_create("page-cache", 0, true, 0, 0, errp);
+        size_t hpagesize;
+
+        if (fd < 0) {
+            return -1;
+        }
+        hpagesize = qemu_fd_getpagesize(fd);
+        cache->pool_size = ROUND_UP(size, hpagesize);
+        if (ftruncate(fd, cache->pool_size) < 0) {
+            error_setg_errno(errp, errno, "Failed to resize page cache");
+            close(fd);
+            return -1;
+        }
+        cache->pool = qemu_ram_mmap(fd, cache->pool_size, hpagesize,
+                                    QEMU_MAP_SHARED, 0);
+        if (cache->pool == MAP_FAILED) {
+            error_setg_errno(errp, errno,
+                             "Failed to map huge pages for page cache");
+            cache->pool = NULL;
+            close(fd);
+            return -1;
+        }
+        cache->pool_fd = fd;
+#else
+        error_setg(errp, "Huge pages for page cache are not supported on "
+                   "this host");
+        return -1;
+#endif
+    } else {
+        cache->pool = qemu_anon_ram_alloc(size, NULL, false, true);
+        if (!cache->pool) {
+            error_setg(errp, "Failed to allocate page cache");
+            return -1;
+        }
+        qemu_madvise(cache->pool, size, QEMU_MADV_HUGEPAGE);
+    }
+
+    if (numa_node >= 0) {
+#ifdef CONFIG_NUMA
+        unsigned long *nodes = bitmap_new(numa_node + 1);
+        int ret;
+
+        set_bit(numa_node, nodes);
+        /* mbind() ignores the last bit of maxnode, see hostmem.c */
+        ret = mbind(cache->pool, cache->pool_size, MPOL_BIND, nodes,
+                    numa_node + 2, MPOL_MF_STRICT | MPOL_MF_MOVE);
+        g_free(nodes);
+        if (ret) {
+            error_setg_errno(errp, errno, "Cannot bind page cache to host "
+                             "NUMA node %" PRId64, numa_node);
+            cache_free_pool(cache);
+            return -1;
+        }
+#else
+        error_setg(errp, "Binding page cache to a host NUMA node is not "
+                   "supported on this host");
+        cache_free_pool(cache);
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+PageCache *cache_init(uint64_t new_size, size_t page_size, bool hugetlb,
+                      int64_t numa_node, Error **errp)
 {
     int64_t i;
     size_t num_pages = new_size / page_size;
@@ -66,20 +185,34 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
 
-    trace_migration_pagecache_init(cache->max_num_items);
+    trace_migration_pagecache_init(cache->max_num_items, cache->ways,
+                                   hugetlb, numa_node);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->hand = g_try_malloc0(cache->num_sets);
+    if (!cache->page_cache || !cache->hand) {
         error_setg(errp, "Failed to allocate page cache");
+        g_free(cache->page_cache);
+        g_free(cache->hand);
+        g_free(cache);
+        return NULL;
+    }
+
+    if (cache_alloc_pool(cache, num_pages * page_size, hugetlb, numa_node,
+                         errp) < 0) {
+        g_free(cache->page_cache);
+        g_free(cache->hand);
         g_free(cache);
         return NULL;
     }
 
     for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_data = cache->pool + i * page_size;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
     }
@@ -89,42 +222,82 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
+    cache_free_pool(cache);
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    g_free(cache->hand);
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
+static size_t cache_get_cache_set(const PageCache *cache,
                                   uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    size_t i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = &cache->page_cache[cache_get_cache_set(cache, addr) * cache->ways];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    return &cache->page_cache[pos];
+/*
+ * cache_get_victim: pick the item of the set of @addr to replace
+ *
+ * Returns a free item if there is one, otherwise the item that was
+ * least recently used, in bitmap generations.  The CLOCK hand of the
+ * set breaks the ties, so pages of the same generation are replaced
+ * in turn.  Returns NULL if even that item is still fresh.
+ */
+static CacheItem *cache_get_victim(PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    size_t set_idx = cache_get_cache_set(cache, addr);
+    CacheItem *set = &cache->page_cache[set_idx * cache->ways];
+    size_t hand = cache->hand[set_idx];
+    CacheItem *victim = NULL;
+    size_t i;
+
+    for (i = 0; i < cache->ways; i++) {
+        size_t way = (hand + i) & (cache->ways - 1);
+        CacheItem *it = &set[way];
+
+        if (it->it_addr == -1) {
+            return it;
+        }
+        if (!victim || it->it_age < victim->it_age) {
+            victim = it;
+        }
+    }
+
+    if (victim->it_age + CACHED_PAGE_LIFETIME > current_age) {
+        /* the cache page is fresh, don't replace it */
+        return NULL;
+    }
+    cache->hand[set_idx] = (victim - set + 1) & (cache->ways - 1);
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -134,7 +307,7 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
         return true;
@@ -150,19 +323,13 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
-    }
-    /* allocate page */
-    if (!it->it_data) {
-        it->it_data = g_try_malloc(cache->page_size);
-        if (!it->it_data) {
-            trace_migration_pagecache_insert();
+    if (!it) {
+        it = cache_get_victim(cache, addr, current_age);
+        if (!it) {
             return -1;
         }
+    }
+    if (it->it_addr == -1) {
         cache->num_items++;
     }
 
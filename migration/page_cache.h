@@ -24,11 +24,17 @@ typedef struct PageCache PageCache;
  *
  * Returns new allocated cache or NULL on error
  *
+ * The memory for the pages is allocated up front but only populated
+ * as pages get inserted.
+ *
  * @cache_size: cache size in bytes
  * @page_size: cache page size
+ * @hugetlb: back the cache with huge pages instead of transparent ones
+ * @numa_node: host NUMA node to bind the cache memory to, or -1
  * @errp: set *errp if the check failed, with reason
  */
-PageCache *cache_init(uint64_t cache_size, size_t page_size, Error **errp);
+PageCache *cache_init(uint64_t cache_size, size_t page_size, bool hugetlb,
+                      int64_t numa_node, Error **errp);
 /**
  * cache_fini: free all cache resources
  * @cache pointer to the PageCache struct
@@ -24,8 +24,13 @@
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "rdma.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
+#include "qemu/thread-context.h"
+#include "qemu/units.h"
 #include "qemu/rcu.h"
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
@@ -38,6 +43,14 @@
  */
 #define MAX_DISCARDS_PER_COMMAND 12
 
+/*
+ * With postcopy-discard-bitmap, ranges of up to that many pages go in a
+ * bitmap of up to MAX_DISCARD_BITMAP_BYTES per command; any longer one
+ * takes less room as a start and a length.
+ */
+#define MAX_DISCARD_BITMAP_RANGE 128
+#define MAX_DISCARD_BITMAP_BYTES (32 * KiB)
+
 struct PostcopyDiscardState {
     const char *ramblock_name;
     uint16_t cur_entry;
@@ -46,10 +59,35 @@ struct PostcopyDiscardState {
      */
     uint64_t start_list[MAX_DISCARDS_PER_COMMAND];
     uint64_t length_list[MAX_DISCARDS_PER_COMMAND];
+    /*
+     * With postcopy-discard-bitmap, the pages to discard from page
+     * bitmap_start; bit n of byte i is page bitmap_start + i * 8 + n, and
+     * bitmap_bits is one past the last page set.
+     */
+    bool use_bitmap;
+    unsigned long bitmap_start;
+    unsigned long bitmap_bits;
+    uint8_t bitmap[MAX_DISCARD_BITMAP_BYTES];
     unsigned int nsentwords;
     unsigned int nsentcmds;
 };
 
+/*
+ * Contiguous pages of a RAMBlock received on one channel, waiting to be
+ * placed together
+ */
+struct PostcopyPlaceBatch {
+    RAMBlock *rb;
+    /* Where the first page goes */
+    uint8_t *host;
+    /* The pages, one after the other */
+    uint8_t *buf;
+    /* Bytes queued in buf */
+    size_t len;
+    /* Size of buf */
+    size_t size;
+};
+
 static NotifierWithReturnList postcopy_notifier_list;
 
 void postcopy_infrastructure_init(void)
@@ -177,6 +215,12 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     info->postcopy_blocktime = bc->total_blocktime;
     info->has_postcopy_vcpu_blocktime = true;
     info->postcopy_vcpu_blocktime = get_vcpu_blocktime_list(bc);
+
+    info->has_postcopy_fault_latency = true;
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        info->postcopy_fault_latency =
+            migration_latency_histogram(&mis->postcopy_fault_latency);
+    }
 }
 
 static uint32_t get_postcopy_total_blocktime(void)
@@ -295,6 +339,17 @@ static bool ufd_check_and_apply(int ufd, MigrationIncomingState *mis)
     }
 #endif
 
+#ifdef UFFD_FEATURE_MINOR_HUGETLBFS
+    if (migrate_postcopy_hugetlb_minor() && mis) {
+        if (!(supported_features & UFFD_FEATURE_MINOR_HUGETLBFS)) {
+            error_report("Userfault on this host does not support minor "
+                         "faults on huge pages");
+            return false;
+        }
+        asked_features |= UFFD_FEATURE_MINOR_HUGETLBFS;
+    }
+#endif
+
     /*
      * request features, even if asked_features is 0, due to
      * kernel expects UFFD_API before UFFDIO_REGISTER, per
@@ -494,6 +549,11 @@ static int cleanup_range(RAMBlock *rb, void *opaque)
      */
     qemu_madvise(host_addr, length, QEMU_MADV_HUGEPAGE);
 
+    if (rb->postcopy_alias) {
+        munmap(rb->postcopy_alias, length);
+        rb->postcopy_alias = NULL;
+    }
+
     /*
      * We can also turn off userfault now since we should have all the
      * pages.   It can be useful to leave it on to debug postcopy
@@ -530,8 +590,17 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /*
+     * The source ends the preempt channel when postcopy completes, a
+     * migration that failed won't do it.
+     */
+    postcopy_preempt_thread_join(mis, mis->state !=
+                                 MIGRATION_STATUS_POSTCOPY_ACTIVE);
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -566,9 +635,16 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
+        if (mis->postcopy_batches[i]) {
+            qemu_vfree(mis->postcopy_batches[i]->buf);
+            g_free(mis->postcopy_batches[i]);
+            mis->postcopy_batches[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -618,6 +694,17 @@ int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * Whether the pages of @rb are written through a second mapping and
+ * placed with UFFDIO_CONTINUE: only the file of a shared RAMBlock can
+ * be mapped twice, and huge pages are where it saves the copies.
+ */
+static bool postcopy_use_alias(RAMBlock *rb)
+{
+    return migrate_postcopy_hugetlb_minor() && qemu_ram_is_shared(rb) &&
+           rb->fd >= 0 && qemu_ram_pagesize(rb) > qemu_real_host_page_size;
+}
+
 /*
  * Mark the given area of RAM as requiring notification to unwritten areas
  * Used as a  callback on foreach_not_ignored_block.
@@ -631,10 +718,18 @@ static int ram_block_enable_notify(RAMBlock *rb, void *opaque)
 {
     MigrationIncomingState *mis = opaque;
     struct uffdio_register reg_struct;
+    bool use_alias = postcopy_use_alias(rb);
 
     reg_struct.range.start = (uintptr_t)qemu_ram_get_host_addr(rb);
     reg_struct.range.len = rb->postcopy_length;
     reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (use_alias) {
+        /*
+         * The pages written through the alias are in the page cache but
+         * not mapped in the guest yet: accessing them is a minor fault.
+         */
+        reg_struct.mode |= UFFDIO_REGISTER_MODE_MINOR;
+    }
 
     /* Now tell our userfault_fd that it's responsible for this area */
     if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
@@ -649,6 +744,25 @@ static int ram_block_enable_notify(RAMBlock *rb, void *opaque)
         qemu_ram_set_uf_zeroable(rb);
     }
 
+    if (use_alias) {
+        void *alias;
+
+        if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_CONTINUE))) {
+            error_report("%s userfault: Region doesn't support CONTINUE",
+                         __func__);
+            return -1;
+        }
+        alias = mmap(NULL, rb->postcopy_length, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, rb->fd, rb->fd_offset);
+        if (alias == MAP_FAILED) {
+            error_report("%s: Failed to map the alias of %s: %s", __func__,
+                         qemu_ram_get_idstr(rb), strerror(errno));
+            return -1;
+        }
+        rb->postcopy_alias = alias;
+        trace_postcopy_ram_alias(qemu_ram_get_idstr(rb), alias);
+    }
+
     return 0;
 }
 
@@ -671,6 +785,27 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
     return ret;
 }
 
+/*
+ * Wake the threads that fault on [host, host + len) of guest RAM
+ * returns 0 on success
+ */
+static int postcopy_wake_page(MigrationIncomingState *mis, void *host,
+                              size_t len)
+{
+    struct uffdio_range range;
+    int ret;
+
+    range.start = (uint64_t)(uintptr_t)host;
+    range.len = len;
+    ret = ioctl(mis->userfault_fd, UFFDIO_WAKE, &range);
+    if (ret) {
+        ret = -errno;
+        error_report("%s: Failed to wake: %p (size: %zd) (%s)",
+                     __func__, host, len, strerror(-ret));
+    }
+    return ret;
+}
+
 /*
  * Callback from shared fault handlers to ask for a page,
  * the page must be specified by a RAMBlock and an offset in that rb
@@ -893,16 +1028,34 @@ static void *postcopy_ram_fault_thread(void *opaque)
         /*
          * We're mainly waiting for the kernel to give us a faulting HVA,
          * however we can be told to quit via userfault_quit_fd which is
-         * an eventfd
+         * an eventfd.
+         *
+         * The page requests are queued while there are faults to read,
+         * and sent at once when there are none left.
          */
-
-        poll_result = poll(pfd, pfd_len, -1 /* Wait forever */);
+        poll_result = poll(pfd, pfd_len, mis->rp_req_batch.len ? 0 : -1);
         if (poll_result == -1) {
             error_report("%s: userfault poll: %s", __func__, strerror(errno));
             break;
         }
+        if (poll_result == 0) {
+            ret = migrate_flush_rp_req_pages(mis);
+            if (ret) {
+                /*
+                 * Don't retry them: the requests that weren't served are
+                 * sent again when postcopy resumes.
+                 */
+                if (ret == -EIO && postcopy_pause_fault_thread(mis)) {
+                    continue;
+                }
+                error_report("%s: migrate_flush_rp_req_pages() get %d",
+                             __func__, ret);
+                break;
+            }
+            continue;
+        }
 
-        if (!mis->to_src_file) {
+        if (!mis->to_src_file && !migrate_fixed_ram_postcopy()) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
@@ -979,6 +1132,27 @@ static void *postcopy_ram_fault_thread(void *opaque)
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
 
+            if (migrate_fixed_ram_postcopy()) {
+                /* There is no source, the page is read from the file */
+                ret = ram_fixed_postcopy_place(mis, rb, rb_offset);
+                if (ret) {
+                    error_report("%s: ram_fixed_postcopy_place() get %d",
+                                 __func__, ret);
+                    break;
+                }
+                goto placed;
+            }
+
+            /* Read it from the source RAM if RDMA lets us */
+            ret = rdma_postcopy_pull_page(rb, rb_offset);
+            if (!ret) {
+                goto placed;
+            }
+            if (ret != -ENOENT) {
+                error_report("%s: rdma_postcopy_pull_page() get %d",
+                             __func__, ret);
+                break;
+            }
 retry:
             /*
              * Send the request to the source - we want to request one
@@ -998,6 +1172,19 @@ retry:
                     break;
                 }
             }
+placed:
+
+            /*
+             * A batch of pages is placed without waking the faulting
+             * threads, only those of the requests recorded by then are
+             * woken.  If the page was placed before this fault got
+             * recorded, nobody else wakes it.
+             */
+            if (ramblock_recv_bitmap_test_byte_offset(rb, rb_offset) &&
+                postcopy_wake_page(mis, rb->host + rb_offset,
+                                   qemu_ram_pagesize(rb))) {
+                break;
+            }
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1064,6 +1251,8 @@ retry:
 
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1090,8 +1279,9 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
 
     qemu_sem_init(&mis->fault_thread_sem, 0);
-    qemu_thread_create(&mis->fault_thread, "postcopy/fault",
-                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
+    thread_context_create_thread(THREAD_GROUP_POSTCOPY, &mis->fault_thread,
+                                 "postcopy/fault", postcopy_ram_fault_thread,
+                                 mis);
     qemu_sem_wait(&mis->fault_thread_sem);
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
@@ -1102,14 +1292,29 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        void *tmp_page;
+
+        if (i == RAM_CHANNEL_POSTCOPY && !migrate_postcopy_preempt()) {
+            continue;
+        }
+        tmp_page = mmap(NULL, mis->largest_page_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tmp_page == MAP_FAILED) {
+            error_report("%s: Failed to map postcopy_tmp_page %s",
+                         __func__, strerror(errno));
+            return -1;
+        }
+        mis->postcopy_tmp_pages[i] = tmp_page;
+
+        if (migrate_postcopy_place_batch() > 1) {
+            PostcopyPlaceBatch *batch = g_new0(PostcopyPlaceBatch, 1);
+
+            batch->size = migrate_postcopy_place_batch() *
+                          qemu_target_page_size();
+            batch->buf = qemu_memalign(qemu_real_host_page_size, batch->size);
+            mis->postcopy_batches[i] = batch;
+        }
     }
 
     /*
@@ -1133,6 +1338,50 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * Drop the request of the page at host_addr, if any, once it is placed,
+ * and account for its latency.
+ * Called with page_request_mutex held.
+ * Returns true if the page was requested
+ */
+static bool postcopy_page_req_del(MigrationIncomingState *mis,
+                                  void *host_addr)
+{
+    int64_t *request_time = g_tree_lookup(mis->page_requested, host_addr);
+    uint64_t latency_us;
+
+    if (!request_time) {
+        return false;
+    }
+
+    latency_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - *request_time;
+    migration_latency_record(&mis->postcopy_fault_latency, latency_us);
+    trace_postcopy_page_req_latency(host_addr, latency_us);
+
+    g_tree_remove(mis->page_requested, host_addr);
+    mis->page_requested_count--;
+    trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
+    return true;
+}
+
+/*
+ * Account for the page at host_addr that the guest can now access
+ */
+static void postcopy_page_placed(MigrationIncomingState *mis, void *host_addr,
+                                 uint64_t pagesize, RAMBlock *rb)
+{
+    qemu_mutex_lock(&mis->page_request_mutex);
+    ramblock_recv_bitmap_set_range(rb, host_addr,
+                                   pagesize / qemu_target_page_size());
+    /*
+     * If this page resolves a page fault for a previous recorded faulted
+     * address, take a special note to maintain the requested page list.
+     */
+    postcopy_page_req_del(mis, host_addr);
+    qemu_mutex_unlock(&mis->page_request_mutex);
+    mark_postcopy_blocktime_end((uintptr_t)host_addr);
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
@@ -1154,20 +1403,7 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
         ret = ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
     }
     if (!ret) {
-        qemu_mutex_lock(&mis->page_request_mutex);
-        ramblock_recv_bitmap_set_range(rb, host_addr,
-                                       pagesize / qemu_target_page_size());
-        /*
-         * If this page resolves a page fault for a previous recorded faulted
-         * address, take a special note to maintain the requested page list.
-         */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
-            g_tree_remove(mis->page_requested, host_addr);
-            mis->page_requested_count--;
-            trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
-        }
-        qemu_mutex_unlock(&mis->page_request_mutex);
-        mark_postcopy_blocktime_end((uintptr_t)host_addr);
+        postcopy_page_placed(mis, host_addr, pagesize, rb);
     }
     return ret;
 }
@@ -1204,6 +1440,11 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
      */
     if (qemu_ufd_copy_ioctl(mis, host, from, pagesize, rb)) {
         int e = errno;
+
+        /* The stream and the fault thread both brought it */
+        if (e == EEXIST && mis->postcopy_pull) {
+            return 0;
+        }
         error_report("%s: %s copy host: %p from: %p (size: %zd)",
                      __func__, strerror(e), host, from, pagesize);
 
@@ -1231,6 +1472,10 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     if (qemu_ram_is_uf_zeroable(rb)) {
         if (qemu_ufd_copy_ioctl(mis, host, NULL, pagesize, rb)) {
             int e = errno;
+
+            if (e == EEXIST && mis->postcopy_pull) {
+                return 0;
+            }
             error_report("%s: %s zero host: %p",
                          __func__, strerror(e), host);
 
@@ -1244,6 +1489,139 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     }
 }
 
+/*
+ * Map the host page at (host), that was written through the alias of
+ * its RAMBlock, into the guest
+ * returns 0 on success
+ */
+int postcopy_place_page_alias(MigrationIncomingState *mis, void *host,
+                              RAMBlock *rb)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    struct uffdio_continue continue_struct;
+
+    continue_struct.range.start = (uint64_t)(uintptr_t)host;
+    continue_struct.range.len = pagesize;
+    continue_struct.mode = 0;
+    if (ioctl(mis->userfault_fd, UFFDIO_CONTINUE, &continue_struct)) {
+        int e = errno;
+        error_report("%s: %s continue host: %p (size: %zd)",
+                     __func__, strerror(e), host, pagesize);
+        return -e;
+    }
+    postcopy_page_placed(mis, host, pagesize, rb);
+
+    trace_postcopy_place_page_alias(host);
+    return postcopy_notify_shared_wake(rb,
+                                       qemu_ram_block_host_offset(rb, host));
+}
+
+/*
+ * Place the pages of the batch of @channel with a single UFFDIO_COPY,
+ * and only wake the threads that wait for some of them.
+ * returns 0 on success
+ */
+int postcopy_place_page_flush(MigrationIncomingState *mis, int channel)
+{
+    PostcopyPlaceBatch *batch = mis->postcopy_batches[channel];
+    struct uffdio_copy copy_struct;
+    uint8_t *wake_start = NULL, *wake_end = NULL;
+    size_t pagesize, offset = 0;
+    int ret = 0;
+
+    if (!batch || !batch->len) {
+        return 0;
+    }
+
+    pagesize = qemu_ram_pagesize(batch->rb);
+    while (offset < batch->len) {
+        copy_struct.dst = (uint64_t)(uintptr_t)(batch->host + offset);
+        copy_struct.src = (uint64_t)(uintptr_t)(batch->buf + offset);
+        copy_struct.len = batch->len - offset;
+        copy_struct.mode = UFFDIO_COPY_MODE_DONTWAKE;
+        copy_struct.copy = 0;
+        if (ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct) &&
+            errno != EAGAIN) {
+            int e = errno;
+
+            /* The fault thread pulled that page from the source */
+            if (e == EEXIST && mis->postcopy_pull) {
+                offset += pagesize;
+                continue;
+            }
+            error_report("%s: %s copy host: %p (size: %zd)",
+                         __func__, strerror(e), batch->host + offset,
+                         batch->len - offset);
+            return -e;
+        }
+        /* On EAGAIN, the kernel may have copied part of the range */
+        if (copy_struct.copy > 0) {
+            offset += copy_struct.copy;
+        }
+    }
+
+    qemu_mutex_lock(&mis->page_request_mutex);
+    ramblock_recv_bitmap_set_range(batch->rb, batch->host,
+                                   batch->len / qemu_target_page_size());
+    for (offset = 0; offset < batch->len; offset += pagesize) {
+        uint8_t *host = batch->host + offset;
+
+        if (postcopy_page_req_del(mis, host)) {
+            if (!wake_start) {
+                wake_start = host;
+            }
+            wake_end = host + pagesize;
+        }
+    }
+    qemu_mutex_unlock(&mis->page_request_mutex);
+
+    trace_postcopy_place_page_flush(batch->host, batch->len / pagesize,
+                                    wake_start, wake_end - wake_start);
+    if (wake_start) {
+        ret = postcopy_wake_page(mis, wake_start, wake_end - wake_start);
+    }
+
+    for (offset = 0; !ret && offset < batch->len; offset += pagesize) {
+        mark_postcopy_blocktime_end((uintptr_t)(batch->host + offset));
+        ret = postcopy_notify_shared_wake(batch->rb,
+                qemu_ram_block_host_offset(batch->rb, batch->host + offset));
+    }
+
+    batch->len = 0;
+    return ret;
+}
+
+/*
+ * Queue a page (from) to be placed at (host) with the ones queued
+ * before it on @channel, when it directly follows them.  Otherwise, or
+ * when the batch is full, the pages queued so far are placed first.
+ * returns 0 on success
+ */
+int postcopy_place_page_batch(MigrationIncomingState *mis, int channel,
+                              void *host, void *from, RAMBlock *rb)
+{
+    PostcopyPlaceBatch *batch = mis->postcopy_batches[channel];
+    size_t pagesize = qemu_ram_pagesize(rb);
+    int ret;
+
+    if (batch->len && (batch->rb != rb || batch->host + batch->len != host ||
+                       batch->len + pagesize > batch->size)) {
+        ret = postcopy_place_page_flush(mis, channel);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (!batch->len) {
+        batch->rb = rb;
+        batch->host = host;
+    }
+    memcpy(batch->buf + batch->len, from, pagesize);
+    batch->len += pagesize;
+
+    return 0;
+}
+
 #else
 /* No target OS support, stubs just fail */
 void fill_destination_postcopy_migration_info(MigrationInfo *info)
@@ -1301,6 +1679,25 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
+int postcopy_place_page_alias(MigrationIncomingState *mis, void *host,
+                              RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page_batch(MigrationIncomingState *mis, int channel,
+                              void *host, void *from, RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page_flush(MigrationIncomingState *mis, int channel)
+{
+    return 0;
+}
+
 int postcopy_wake_shared(struct PostCopyFD *pcfd,
                          uint64_t client_addr,
                          RAMBlock *rb)
@@ -1340,10 +1737,52 @@ void postcopy_discard_send_init(MigrationState *ms, const char *name)
 {
     pds.ramblock_name = name;
     pds.cur_entry = 0;
+    pds.use_bitmap = migrate_postcopy_discard_bitmap();
+    pds.bitmap_bits = 0;
     pds.nsentwords = 0;
     pds.nsentcmds = 0;
 }
 
+static void postcopy_discard_send_bitmap(MigrationState *ms)
+{
+    size_t len = DIV_ROUND_UP(pds.bitmap_bits, 8);
+
+    qemu_savevm_send_postcopy_ram_discard_bitmap(ms->to_dst_file,
+                                                 pds.ramblock_name,
+                                                 pds.bitmap_start *
+                                                 qemu_target_page_size(),
+                                                 pds.bitmap, len);
+    memset(pds.bitmap, 0, len);
+    pds.bitmap_bits = 0;
+    pds.nsentcmds++;
+}
+
+/* Ranges come in order, so they only ever need a new bitmap after */
+static void postcopy_discard_bitmap_add(MigrationState *ms,
+                                        unsigned long start,
+                                        unsigned long length)
+{
+    unsigned long end = start + length;
+    unsigned long bit;
+
+    trace_postcopy_discard_send_range(pds.ramblock_name, start, length);
+    pds.nsentwords++;
+
+    for (; start < end; start++) {
+        if (pds.bitmap_bits &&
+            (start < pds.bitmap_start ||
+             start - pds.bitmap_start >= MAX_DISCARD_BITMAP_BYTES * 8)) {
+            postcopy_discard_send_bitmap(ms);
+        }
+        if (!pds.bitmap_bits) {
+            pds.bitmap_start = start;
+        }
+        bit = start - pds.bitmap_start;
+        pds.bitmap[bit / 8] |= 1 << (bit % 8);
+        pds.bitmap_bits = bit + 1;
+    }
+}
+
 /**
  * postcopy_discard_send_range: Called by the bitmap code for each chunk to
  *   discard. May send a discard message, may just leave it queued to
@@ -1357,6 +1796,12 @@ void postcopy_discard_send_range(MigrationState *ms, unsigned long start,
                                  unsigned long length)
 {
     size_t tp_size = qemu_target_page_size();
+
+    if (pds.use_bitmap && length <= MAX_DISCARD_BITMAP_RANGE) {
+        postcopy_discard_bitmap_add(ms, start, length);
+        return;
+    }
+
     /* Convert to byte offsets within the RAM block */
     pds.start_list[pds.cur_entry] = start  * tp_size;
     pds.length_list[pds.cur_entry] = length * tp_size;
@@ -1393,6 +1838,9 @@ void postcopy_discard_send_finish(MigrationState *ms)
                                               pds.length_list);
         pds.nsentcmds++;
     }
+    if (pds.bitmap_bits) {
+        postcopy_discard_send_bitmap(ms);
+    }
 
     trace_postcopy_discard_send_finish(pds.ramblock_name, pds.nsentwords,
                                        pds.nsentcmds);
@@ -1443,3 +1891,109 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+/* ------------------------------------------------------------------------- */
+/* postcopy-preempt: a dedicated channel for the pages we ask for */
+
+/*
+ * Connect the preempt channel on the source.  It is connected for the
+ * whole migration, so that postcopy can start without waiting for it.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    QIOChannel *ioc;
+
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (migrate_use_tls()) {
+        error_setg(errp, "postcopy-preempt doesn't support TLS yet");
+        return -1;
+    }
+
+    ioc = socket_send_channel_create_sync(errp);
+    if (!ioc) {
+        return -1;
+    }
+    qio_channel_set_name(ioc, "migration-postcopy-preempt");
+    s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+
+    /* Let the destination tell it apart from the multifd channels */
+    qemu_put_be32(s->postcopy_qemufile_src, POSTCOPY_PREEMPT_MAGIC);
+    qemu_fflush(s->postcopy_qemufile_src);
+    trace_postcopy_preempt_setup();
+
+    return 0;
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret = 0;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    /* Nothing can be placed before we listen */
+    qemu_event_wait(&mis->postcopy_listen_event);
+
+    if (!qatomic_read(&mis->preempt_thread_quit)) {
+        /* The source ends the channel with RAM_SAVE_FLAG_EOS */
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(mis->postcopy_qemufile_dst,
+                                    RAM_CHANNEL_POSTCOPY);
+        }
+    }
+    if (ret && !qatomic_read(&mis->preempt_thread_quit)) {
+        error_report("%s: postcopy preempt channel failed: %s", __func__,
+                     strerror(-ret));
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+
+    return NULL;
+}
+
+/*
+ * Called on the destination when the source connects the preempt
+ * channel.  Its thread waits until postcopy listens to place the
+ * pages it receives.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    trace_postcopy_preempt_new_channel();
+
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    mis->preempt_thread_quit = false;
+    mis->have_preempt_thread = true;
+    thread_context_create_thread(THREAD_GROUP_POSTCOPY, &mis->preempt_thread,
+                                 "postcopy/preempt", postcopy_preempt_thread,
+                                 mis);
+}
+
+/*
+ * Wait for the preempt thread to finish and close its channel.  With
+ * @abort the thread is stopped instead of waiting for the source to
+ * end the channel.
+ */
+void postcopy_preempt_thread_join(MigrationIncomingState *mis, bool abort)
+{
+    if (!mis->have_preempt_thread) {
+        return;
+    }
+
+    if (abort) {
+        qatomic_set(&mis->preempt_thread_quit, true);
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        qemu_event_set(&mis->postcopy_listen_event);
+    }
+    qemu_thread_join(&mis->preempt_thread);
+    mis->have_preempt_thread = false;
+
+    qemu_fclose(mis->postcopy_qemufile_dst);
+    mis->postcopy_qemufile_dst = NULL;
+}
@@ -78,6 +78,29 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
 int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                              RAMBlock *rb);
 
+/*
+ * Map the host page at (host) into the guest once it has been written
+ * through the postcopy_alias of @rb, see postcopy-hugetlb-minor
+ * returns 0 on success
+ */
+int postcopy_place_page_alias(MigrationIncomingState *mis, void *host,
+                              RAMBlock *rb);
+
+/*
+ * Queue a page (from) to be placed at (host) together with the
+ * contiguous pages received before it on @channel, see
+ * postcopy-place-batch.  The pages are copied, so (from) can be reused.
+ * returns 0 on success
+ */
+int postcopy_place_page_batch(MigrationIncomingState *mis, int channel,
+                              void *host, void *from, RAMBlock *rb);
+
+/*
+ * Place the pages queued by postcopy_place_page_batch() on @channel
+ * returns 0 on success
+ */
+int postcopy_place_page_flush(MigrationIncomingState *mis, int channel);
+
 /* The current postcopy state is read/set by postcopy_state_get/set
  * which update it atomically.
  * The state is updated as postcopy messages are received, and
@@ -106,6 +129,13 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/* First word sent on the postcopy-preempt channel, "QPRE" */
+#define POSTCOPY_PREEMPT_MAGIC 0x51505245U
+
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+void postcopy_preempt_thread_join(MigrationIncomingState *mis, bool abort);
+
 /*
  * To be called once at the start before any device initialisation
  */
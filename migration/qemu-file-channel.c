@@ -27,9 +27,11 @@
 #include "qemu-file.h"
 #include "io/channel-socket.h"
 #include "io/channel-tls.h"
+#include "io/channel-file.h"
 #include "qemu/iov.h"
 #include "qemu/yank.h"
 #include "yank_functions.h"
+#include "file.h"
 
 
 static ssize_t channel_writev_buffer(void *opaque,
@@ -74,17 +76,25 @@ static ssize_t channel_writev_buffer(void *opaque,
 }
 
 
-static ssize_t channel_get_buffer(void *opaque,
-                                  uint8_t *buf,
-                                  int64_t pos,
-                                  size_t size,
-                                  Error **errp)
+static ssize_t channel_get_buffer_fds(void *opaque,
+                                      uint8_t *buf,
+                                      int64_t pos,
+                                      size_t size,
+                                      int **fds,
+                                      size_t *nfds,
+                                      Error **errp)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
     ssize_t ret;
 
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS)) {
+        fds = NULL;
+        nfds = NULL;
+    }
+
     do {
-        ret = qio_channel_read(ioc, (char *)buf, size, errp);
+        ret = qio_channel_readv_full(ioc, &iov, 1, fds, nfds, errp);
         if (ret < 0) {
             if (ret == QIO_CHANNEL_ERR_BLOCK) {
                 if (qemu_in_coroutine()) {
@@ -102,6 +112,31 @@ static ssize_t channel_get_buffer(void *opaque,
 }
 
 
+static ssize_t channel_get_buffer(void *opaque,
+                                  uint8_t *buf,
+                                  int64_t pos,
+                                  size_t size,
+                                  Error **errp)
+{
+    return channel_get_buffer_fds(opaque, buf, pos, size, NULL, NULL, errp);
+}
+
+
+static int channel_send_fd(void *opaque, int fd, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    uint8_t byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS)) {
+        error_setg(errp, "The migration channel can't pass file descriptors,"
+                   " it needs to be a UNIX socket");
+        return -1;
+    }
+    return qio_channel_writev_full_all(ioc, &iov, 1, &fd, 1, 0, errp);
+}
+
+
 static int channel_close(void *opaque, Error **errp)
 {
     int ret;
@@ -170,21 +205,73 @@ static QEMUFile *channel_get_output_return_path(void *opaque)
     return qemu_fopen_channel_input(ioc);
 }
 
+static QIOChannel *channel_get_ioc(void *opaque)
+{
+    return QIO_CHANNEL(opaque);
+}
+
+static int channel_seek(void *opaque, int64_t pos, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    return qio_channel_io_seek(ioc, pos, SEEK_SET, errp) < 0 ? -1 : 0;
+}
+
+/* Only files can be accessed at random */
+static bool channel_is_file(QIOChannel *ioc, Error **errp)
+{
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "Channel %s is not a file", ioc->name);
+        return false;
+    }
+    return true;
+}
+
+static int channel_write_at(void *opaque, const uint8_t *buf, size_t size,
+                            int64_t pos, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (!channel_is_file(ioc, errp)) {
+        return -1;
+    }
+    return file_pwrite_all(ioc, buf, size, pos, errp);
+}
+
+static int channel_read_at(void *opaque, uint8_t *buf, size_t size,
+                           int64_t pos, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (!channel_is_file(ioc, errp)) {
+        return -1;
+    }
+    return file_pread_all(ioc, buf, size, pos, errp);
+}
+
 static const QEMUFileOps channel_input_ops = {
     .get_buffer = channel_get_buffer,
+    .get_buffer_fds = channel_get_buffer_fds,
     .close = channel_close,
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .get_ioc = channel_get_ioc,
+    .seek = channel_seek,
+    .read_at = channel_read_at,
 };
 
 
 static const QEMUFileOps channel_output_ops = {
     .writev_buffer = channel_writev_buffer,
+    .send_fd = channel_send_fd,
     .close = channel_close,
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .get_ioc = channel_get_ioc,
+    .seek = channel_seek,
+    .write_at = channel_write_at,
 };
 
 
@@ -22,9 +22,9 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 #include "migration.h"
 #include "qemu-file.h"
 #include "trace.h"
@@ -39,22 +39,41 @@ struct QEMUFile {
     void *opaque;
 
     int64_t bytes_xfer;
+    /*
+     * Token bucket of the rate limit: it fills with @xfer_limit bytes
+     * per second up to @xfer_burst, and every byte transferred takes
+     * one.  @tokens is what was left at @tokens_time, when @bytes_xfer
+     * was @tokens_xfer.
+     */
     int64_t xfer_limit;
+    int64_t xfer_burst;
+    int64_t tokens;
+    int64_t tokens_xfer;
+    int64_t tokens_time;
+    /* bytes_xfer at which the budget of qemu_file_set_budget() ends, or 0 */
+    int64_t budget_end;
+    /* Time spent writing out the buffer, in microseconds */
+    int64_t flush_time;
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    int buf_max;
+    uint8_t *buf;
 
-    DECLARE_BITMAP(may_free, MAX_IOV_SIZE);
-    struct iovec iov[MAX_IOV_SIZE];
+    unsigned long *may_free;
+    struct iovec *iov;
     unsigned int iovcnt;
+    unsigned int iov_max;
 
     int last_error;
     Error *last_error_obj;
     /* has the file has been shutdown */
     bool shutdown;
+    /* File descriptors received and not taken by qemu_file_recv_fd() yet */
+    int *fds;
+    size_t nfds;
 };
 
 /*
@@ -109,9 +128,41 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->buf_max = IO_BUF_SIZE;
+    f->buf = g_malloc(f->buf_max);
+    f->iov_max = MAX_IOV_SIZE;
+    f->iov = g_new(struct iovec, f->iov_max);
+    f->may_free = bitmap_new(f->iov_max);
     return f;
 }
 
+/*
+ * Buffer @buf_size bytes and @iov_max iovecs in @f before they are
+ * written, or read @buf_size bytes at once, instead of the default
+ * IO_BUF_SIZE and MAX_IOV_SIZE.  Must be called before @f is used.
+ */
+void qemu_file_set_buffer_size(QEMUFile *f, size_t buf_size,
+                               unsigned int iov_max)
+{
+    assert(!f->buf_index && !f->buf_size && !f->iovcnt);
+    assert(buf_size && buf_size <= INT_MAX);
+    assert(iov_max && iov_max <= IOV_MAX);
+
+    if (buf_size != f->buf_max) {
+        f->buf_max = buf_size;
+        g_free(f->buf);
+        f->buf = g_malloc(f->buf_max);
+    }
+    if (iov_max != f->iov_max) {
+        f->iov_max = iov_max;
+        g_free(f->iov);
+        f->iov = g_new(struct iovec, f->iov_max);
+        g_free(f->may_free);
+        f->may_free = bitmap_new(f->iov_max);
+    }
+    trace_qemu_file_set_buffer_size(buf_size, iov_max);
+}
+
 
 void qemu_file_set_hooks(QEMUFile *f, const QEMUFileHooks *hooks)
 {
@@ -205,7 +256,7 @@ static void qemu_iovec_release_ram(QEMUFile *f)
             error_report("migrate: madvise DONTNEED failed %p %zd: %s",
                          iov.iov_base, iov.iov_len, strerror(errno));
     }
-    memset(f->may_free, 0, sizeof(f->may_free));
+    bitmap_zero(f->may_free, f->iov_max);
 }
 
 /**
@@ -219,6 +270,7 @@ void qemu_fflush(QEMUFile *f)
     ssize_t ret = 0;
     ssize_t expect = 0;
     Error *local_error = NULL;
+    int64_t start_us;
 
     if (!qemu_file_is_writable(f)) {
         return;
@@ -229,8 +281,12 @@ void qemu_fflush(QEMUFile *f)
     }
     if (f->iovcnt > 0) {
         expect = iov_size(f->iov, f->iovcnt);
+        start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos,
                                     &local_error);
+        qatomic_set__nocheck(&f->flush_time, f->flush_time +
+                             qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                             start_us);
 
         qemu_iovec_release_ram(f);
     }
@@ -345,8 +401,23 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
         return 0;
     }
 
-    len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                             IO_BUF_SIZE - pending, &local_error);
+    if (f->ops->get_buffer_fds) {
+        int *fds = NULL;
+        size_t nfds = 0;
+
+        len = f->ops->get_buffer_fds(f->opaque, f->buf + pending, f->pos,
+                                     f->buf_max - pending, &fds, &nfds,
+                                     &local_error);
+        if (nfds) {
+            f->fds = g_renew(int, f->fds, f->nfds + nfds);
+            memcpy(f->fds + f->nfds, fds, nfds * sizeof(int));
+            f->nfds += nfds;
+            g_free(fds);
+        }
+    } else {
+        len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
+                                 f->buf_max - pending, &local_error);
+    }
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -393,6 +464,13 @@ int qemu_fclose(QEMUFile *f)
         ret = f->last_error;
     }
     error_free(f->last_error_obj);
+    while (f->nfds) {
+        close(f->fds[--f->nfds]);
+    }
+    g_free(f->fds);
+    g_free(f->may_free);
+    g_free(f->iov);
+    g_free(f->buf);
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -416,7 +494,7 @@ static int add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
     {
         f->iov[f->iovcnt - 1].iov_len += size;
     } else {
-        if (f->iovcnt >= MAX_IOV_SIZE) {
+        if (f->iovcnt >= f->iov_max) {
             /* Should only happen if a previous fflush failed */
             assert(f->shutdown || !qemu_file_is_writable(f));
             return 1;
@@ -428,7 +506,7 @@ static int add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= f->iov_max) {
         qemu_fflush(f);
         return 1;
     }
@@ -440,7 +518,7 @@ static void add_buf_to_iovec(QEMUFile *f, size_t len)
 {
     if (!add_to_iovec(f, f->buf + f->buf_index, len, false)) {
         f->buf_index += len;
-        if (f->buf_index == IO_BUF_SIZE) {
+        if (f->buf_index == f->buf_max) {
             qemu_fflush(f);
         }
     }
@@ -466,7 +544,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size)
     }
 
     while (size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        l = f->buf_max - f->buf_index;
         if (l > size) {
             l = size;
         }
@@ -513,8 +591,8 @@ size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset)
     size_t index;
 
     assert(!qemu_file_is_writable(f));
-    assert(offset < IO_BUF_SIZE);
-    assert(size <= IO_BUF_SIZE - offset);
+    assert(offset < f->buf_max);
+    assert(size <= f->buf_max - offset);
 
     /* The 1st byte to read from */
     index = f->buf_index + offset;
@@ -564,7 +642,7 @@ size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size)
         size_t res;
         uint8_t *src;
 
-        res = qemu_peek_buffer(f, &src, MIN(pending, IO_BUF_SIZE), 0);
+        res = qemu_peek_buffer(f, &src, MIN(pending, f->buf_max), 0);
         if (res == 0) {
             return done;
         }
@@ -598,7 +676,7 @@ size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size)
  */
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size)
 {
-    if (size < IO_BUF_SIZE) {
+    if (size < f->buf_max) {
         size_t res;
         uint8_t *src = NULL;
 
@@ -623,7 +701,7 @@ int qemu_peek_byte(QEMUFile *f, int offset)
     int index = f->buf_index + offset;
 
     assert(!qemu_file_is_writable(f));
-    assert(offset < IO_BUF_SIZE);
+    assert(offset < f->buf_max);
 
     if (index >= f->buf_size) {
         qemu_fill_buffer(f);
@@ -635,6 +713,17 @@ int qemu_peek_byte(QEMUFile *f, int offset)
     return f->buf[index];
 }
 
+/*
+ * Returns the number of bytes that can be read from @f without waiting
+ * for more data from the channel.
+ */
+size_t qemu_file_buffered(QEMUFile *f)
+{
+    assert(!qemu_file_is_writable(f));
+
+    return f->buf_size - f->buf_index;
+}
+
 int qemu_get_byte(QEMUFile *f)
 {
     int result;
@@ -644,6 +733,57 @@ int qemu_get_byte(QEMUFile *f)
     return result;
 }
 
+int qemu_file_send_fd(QEMUFile *f, int fd)
+{
+    Error *local_error = NULL;
+
+    /* The byte that carries @fd goes after what is buffered */
+    qemu_fflush(f);
+    if (qemu_file_get_error(f)) {
+        return -1;
+    }
+    if (!f->ops->send_fd) {
+        error_setg(&local_error, "The migration stream can't pass file "
+                   "descriptors");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return -1;
+    }
+    if (f->ops->send_fd(f->opaque, fd, &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return -1;
+    }
+    f->pos++;
+    return 0;
+}
+
+int qemu_file_recv_fd(QEMUFile *f)
+{
+    Error *local_error = NULL;
+    int fd;
+
+    /* Reading the byte that carried it receives the descriptor */
+    qemu_get_byte(f);
+    if (qemu_file_get_error(f)) {
+        return -1;
+    }
+    if (!f->nfds) {
+        error_setg(&local_error, "No file descriptor in the migration "
+                   "stream where one was expected");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return -1;
+    }
+    fd = f->fds[0];
+    f->nfds--;
+    memmove(f->fds, f->fds + 1, f->nfds * sizeof(int));
+    return fd;
+}
+
+/* Can be called from another thread than the writer of @f */
+int64_t qemu_file_get_flush_time(QEMUFile *f)
+{
+    return qatomic_read__nocheck(&f->flush_time);
+}
+
 int64_t qemu_ftell_fast(QEMUFile *f)
 {
     int64_t ret = f->pos;
@@ -662,6 +802,95 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+QIOChannel *qemu_file_get_ioc(QEMUFile *f)
+{
+    return f->ops->get_ioc ? f->ops->get_ioc(f->opaque) : NULL;
+}
+
+/*
+ * Move a file that can seek to @pos, after writing what is buffered
+ * or dropping what was read ahead.
+ *
+ * Returns 0 on success and negative on error, that is also set as
+ * the error of the file.
+ */
+int qemu_file_seek(QEMUFile *f, int64_t pos)
+{
+    Error *local_err = NULL;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+
+    if (f->ops->seek(f->opaque, pos, &local_err) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_err);
+        return -EIO;
+    }
+    f->pos = pos;
+    return 0;
+}
+
+/*
+ * Write @size bytes at @pos of a file that is not only a stream.  The
+ * position of the stream doesn't change, and the file error is not
+ * set, so it can be called from other threads if the backend allows.
+ *
+ * Returns 0 on success and negative on error.
+ */
+int qemu_file_write_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                       int64_t pos, Error **errp)
+{
+    if (!f->ops->write_at) {
+        error_setg(errp, "This migration file can only be a stream");
+        return -ENOTSUP;
+    }
+    return f->ops->write_at(f->opaque, buf, size, pos, errp) < 0 ? -EIO : 0;
+}
+
+/* Same as qemu_file_write_at(), but reads */
+int qemu_file_read_at(QEMUFile *f, uint8_t *buf, size_t size,
+                      int64_t pos, Error **errp)
+{
+    if (!f->ops->read_at) {
+        error_setg(errp, "This migration file can only be a stream");
+        return -ENOTSUP;
+    }
+    return f->ops->read_at(f->opaque, buf, size, pos, errp) < 0 ? -EIO : 0;
+}
+
+static bool qemu_file_rate_limited(QEMUFile *f)
+{
+    return f->xfer_limit > 0 && f->xfer_limit != INT64_MAX;
+}
+
+/* Bring the token bucket of @f up to date */
+static void qemu_file_refill_tokens(QEMUFile *f)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - f->tokens_time;
+
+    if (elapsed > 0) {
+        double refill = (double)f->xfer_limit * elapsed /
+                        NANOSECONDS_PER_SECOND;
+
+        f->tokens = MIN(f->tokens + refill, f->xfer_burst);
+        f->tokens_time = now;
+    }
+    f->tokens -= f->bytes_xfer - f->tokens_xfer;
+    f->tokens_xfer = f->bytes_xfer;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
@@ -670,25 +899,97 @@ int qemu_file_rate_limit(QEMUFile *f)
     if (qemu_file_get_error(f)) {
         return 1;
     }
-    if (f->xfer_limit > 0 && f->bytes_xfer > f->xfer_limit) {
+    if (qemu_file_rate_limited(f)) {
+        qemu_file_refill_tokens(f);
+        if (f->tokens <= 0) {
+            return 1;
+        }
+    }
+    if (f->budget_end && f->bytes_xfer >= f->budget_end) {
         return 1;
     }
     return 0;
 }
 
+/*
+ * Returns how many bytes can be transferred before the rate limit
+ * trips, INT64_MAX if there is none.
+ */
+int64_t qemu_file_rate_limit_remaining(QEMUFile *f)
+{
+    if (!qemu_file_rate_limited(f)) {
+        return INT64_MAX;
+    }
+    qemu_file_refill_tokens(f);
+    return MAX(f->tokens, 0);
+}
+
+/*
+ * Returns how many nanoseconds it takes for the rate limit to let more
+ * bytes through, 0 if it already does.
+ */
+int64_t qemu_file_rate_limit_delay(QEMUFile *f)
+{
+    if (!qemu_file_rate_limited(f)) {
+        return 0;
+    }
+    qemu_file_refill_tokens(f);
+    if (f->tokens > 0) {
+        return 0;
+    }
+    return (double)(1 - f->tokens) * NANOSECONDS_PER_SECOND / f->xfer_limit;
+}
+
+/*
+ * Make qemu_file_rate_limit() also trip once @budget more bytes have
+ * been transferred, or stop doing so if @budget is 0.
+ */
+void qemu_file_set_budget(QEMUFile *f, int64_t budget)
+{
+    f->budget_end = budget ? f->bytes_xfer + budget : 0;
+}
+
 int64_t qemu_file_get_rate_limit(QEMUFile *f)
 {
     return f->xfer_limit;
 }
 
-void qemu_file_set_rate_limit(QEMUFile *f, int64_t limit)
+/* Returns the most bytes that the rate limit lets through at once */
+int64_t qemu_file_get_rate_burst(QEMUFile *f)
 {
+    return qemu_file_rate_limited(f) ? f->xfer_burst : INT64_MAX;
+}
+
+/*
+ * Limit the transfers of @f to @limit bytes per second, in bursts of at
+ * most @burst bytes.  0 or INT64_MAX for @limit mean no limit.  The
+ * bytes transferred by the multifd channels count too, through
+ * qemu_file_update_transfer().
+ */
+void qemu_file_set_rate_limit(QEMUFile *f, int64_t limit, int64_t burst)
+{
+    if (qemu_file_rate_limited(f)) {
+        qemu_file_refill_tokens(f);
+    } else {
+        /* Start with a full bucket */
+        f->tokens = burst;
+        f->tokens_xfer = f->bytes_xfer;
+        f->tokens_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
     f->xfer_limit = limit;
+    f->xfer_burst = MAX(burst, 1);
+    f->tokens = MIN(f->tokens, f->xfer_burst);
+    trace_qemu_file_set_rate_limit(limit, f->xfer_burst);
 }
 
 void qemu_file_reset_rate_limit(QEMUFile *f)
 {
+    if (qemu_file_rate_limited(f)) {
+        qemu_file_refill_tokens(f);
+    }
     f->bytes_xfer = 0;
+    f->tokens_xfer = 0;
+    f->budget_end = 0;
 }
 
 void qemu_file_update_transfer(QEMUFile *f, int64_t len)
@@ -742,73 +1043,6 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* return the size after compression, or negative value on error */
-static int qemu_compress_data(z_stream *stream, uint8_t *dest, size_t dest_len,
-                              const uint8_t *source, size_t source_len)
-{
-    int err;
-
-    err = deflateReset(stream);
-    if (err != Z_OK) {
-        return -1;
-    }
-
-    stream->avail_in = source_len;
-    stream->next_in = (uint8_t *)source;
-    stream->avail_out = dest_len;
-    stream->next_out = dest;
-
-    err = deflate(stream, Z_FINISH);
-    if (err != Z_STREAM_END) {
-        return -1;
-    }
-
-    return stream->next_out - dest;
-}
-
-/* Compress size bytes of data start at p and store the compressed
- * data to the buffer of f.
- *
- * Since the file is dummy file with empty_ops, return -1 if f has no space to
- * save the compressed data.
- */
-ssize_t qemu_put_compression_data(QEMUFile *f, z_stream *stream,
-                                  const uint8_t *p, size_t size)
-{
-    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
-
-    if (blen < compressBound(size)) {
-        return -1;
-    }
-
-    blen = qemu_compress_data(stream, f->buf + f->buf_index + sizeof(int32_t),
-                              blen, p, size);
-    if (blen < 0) {
-        return -1;
-    }
-
-    qemu_put_be32(f, blen);
-    add_buf_to_iovec(f, blen);
-    return blen + sizeof(int32_t);
-}
-
-/* Put the data in the buffer of f_src to the buffer of f_des, and
- * then reset the buf_index of f_src to 0.
- */
-
-int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
-{
-    int len = 0;
-
-    if (f_src->buf_index > 0) {
-        len = f_src->buf_index;
-        qemu_put_buffer(f_des, f_src->buf, f_src->buf_index);
-        f_src->buf_index = 0;
-        f_src->iovcnt = 0;
-    }
-    return len;
-}
-
 /*
  * Get a string whose length is determined by a single preceding byte
  * A preallocated 256 byte buffer must be passed in.
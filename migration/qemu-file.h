@@ -25,8 +25,8 @@
 #ifndef MIGRATION_QEMU_FILE_H
 #define MIGRATION_QEMU_FILE_H
 
-#include <zlib.h>
 #include "exec/cpu-common.h"
+#include "io/channel.h"
 
 /* Read a chunk of data from a file at the given position.  The pos argument
  * can be ignored if the file is only be used for streaming.  The number of
@@ -103,6 +103,41 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr,
                                    Error **errp);
 
+/*
+ * Return the channel that the QEMUFile reads or writes, if there is one
+ */
+typedef QIOChannel *(QEMUFileGetIOCFunc)(void *opaque);
+
+/*
+ * Move the stream to @pos.  Returns 0 on success, -1 on error.
+ */
+typedef int (QEMUFileSeekFunc)(void *opaque, int64_t pos, Error **errp);
+
+/*
+ * Write or read @size bytes at @pos, for files that are not only
+ * streams, without moving the stream.  Returns 0 on success, -1 on
+ * error.
+ */
+typedef int (QEMUFileWriteAtFunc)(void *opaque, const uint8_t *buf,
+                                  size_t size, int64_t pos, Error **errp);
+typedef int (QEMUFileReadAtFunc)(void *opaque, uint8_t *buf,
+                                 size_t size, int64_t pos, Error **errp);
+
+/*
+ * Like QEMUFileGetBufferFunc, also returning in @fds the @nfds file
+ * descriptors that came with the data, if the transport passes them.
+ */
+typedef ssize_t (QEMUFileGetBufferFDsFunc)(void *opaque, uint8_t *buf,
+                                           int64_t pos, size_t size,
+                                           int **fds, size_t *nfds,
+                                           Error **errp);
+
+/*
+ * Send the file descriptor @fd to the other side, with a byte of data
+ * that carries it.  Returns 0 on success, -1 on error.
+ */
+typedef int (QEMUFileSendFDFunc)(void *opaque, int fd, Error **errp);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -110,6 +145,12 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileGetIOCFunc *get_ioc;
+    QEMUFileSeekFunc *seek;
+    QEMUFileWriteAtFunc *write_at;
+    QEMUFileReadAtFunc *read_at;
+    QEMUFileGetBufferFDsFunc *get_buffer_fds;
+    QEMUFileSendFDFunc *send_fd;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -121,10 +162,25 @@ typedef struct QEMUFileHooks {
 
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
 void qemu_file_set_hooks(QEMUFile *f, const QEMUFileHooks *hooks);
+void qemu_file_set_buffer_size(QEMUFile *f, size_t buf_size,
+                               unsigned int iov_max);
 int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 int64_t qemu_ftell_fast(QEMUFile *f);
+int64_t qemu_file_get_flush_time(QEMUFile *f);
+QIOChannel *qemu_file_get_ioc(QEMUFile *f);
+int qemu_file_seek(QEMUFile *f, int64_t pos);
+int qemu_file_write_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                       int64_t pos, Error **errp);
+int qemu_file_read_at(QEMUFile *f, uint8_t *buf, size_t size,
+                      int64_t pos, Error **errp);
+/*
+ * Pass a file descriptor in the stream, over a UNIX socket.  The
+ * receiver gets a new descriptor for the same file, that it owns.
+ */
+int qemu_file_send_fd(QEMUFile *f, int fd);
+int qemu_file_recv_fd(QEMUFile *f);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
@@ -138,9 +194,6 @@ bool qemu_file_is_writable(QEMUFile *f);
 
 size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
-ssize_t qemu_put_compression_data(QEMUFile *f, z_stream *stream,
-                                  const uint8_t *p, size_t size);
-int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 
 /*
  * Note that you can only peek continuous bytes from where the current pointer
@@ -148,12 +201,17 @@ int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
  * previously peeked +n-1.
  */
 int qemu_peek_byte(QEMUFile *f, int offset);
+size_t qemu_file_buffered(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
 void qemu_file_reset_rate_limit(QEMUFile *f);
 void qemu_file_update_transfer(QEMUFile *f, int64_t len);
-void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
+void qemu_file_set_rate_limit(QEMUFile *f, int64_t limit, int64_t burst);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
+int64_t qemu_file_get_rate_burst(QEMUFile *f);
+int64_t qemu_file_rate_limit_remaining(QEMUFile *f);
+int64_t qemu_file_rate_limit_delay(QEMUFile *f);
+void qemu_file_set_budget(QEMUFile *f, int64_t budget);
 int qemu_file_get_error_obj(QEMUFile *f, Error **errp);
 void qemu_file_set_error_obj(QEMUFile *f, int ret, Error *err);
 void qemu_file_set_error(QEMUFile *f, int ret);
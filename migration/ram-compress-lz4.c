@@ -0,0 +1,86 @@
+/*
+ * lz4 compression for the compress capability
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "ram-compress.h"
+
+/*
+ * lz4 has no compression levels, compress-level is not used.  The
+ * decompression needs no state.
+ */
+
+static int lz4_compress_setup(void **state, int level, Error **errp)
+{
+    *state = g_try_malloc(LZ4_sizeofState());
+    if (!*state) {
+        error_setg(errp, "compress: out of memory for the lz4 state");
+        return -1;
+    }
+    return 0;
+}
+
+static void lz4_compress_cleanup(void *state)
+{
+    g_free(state);
+}
+
+static int lz4_compress(void *state, uint8_t *dst, size_t dst_len,
+                        const uint8_t *src, size_t src_len)
+{
+    int ret;
+
+    ret = LZ4_compress_fast_extState(state, (const char *)src, (char *)dst,
+                                     src_len, dst_len, 1);
+    return ret > 0 ? ret : -1;
+}
+
+static int lz4_decompress_setup(void **state, Error **errp)
+{
+    *state = NULL;
+    return 0;
+}
+
+static void lz4_decompress_cleanup(void *state)
+{
+}
+
+static int lz4_decompress(void *state, uint8_t *dst, size_t dst_len,
+                          const uint8_t *src, size_t src_len)
+{
+    int ret;
+
+    ret = LZ4_decompress_safe((const char *)src, (char *)dst, src_len,
+                              dst_len);
+    return ret >= 0 ? ret : -1;
+}
+
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+static const RAMCompressMethods ram_compress_lz4_ops = {
+    .compress_setup = lz4_compress_setup,
+    .compress_cleanup = lz4_compress_cleanup,
+    .compress = lz4_compress,
+    .decompress_setup = lz4_decompress_setup,
+    .decompress_cleanup = lz4_decompress_cleanup,
+    .decompress = lz4_decompress,
+    .bound = lz4_bound,
+};
+
+static void ram_compress_lz4_register(void)
+{
+    ram_compress_register_ops(COMPRESS_METHOD_LZ4, &ram_compress_lz4_ops);
+}
+
+migration_init(ram_compress_lz4_register);
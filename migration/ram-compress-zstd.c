@@ -0,0 +1,107 @@
+/*
+ * zstd compression for the compress capability
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zstd.h>
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "ram-compress.h"
+
+struct zstd_compress_data {
+    ZSTD_CCtx *cctx;
+    int level;
+};
+
+static int zstd_compress_setup(void **state, int level, Error **errp)
+{
+    struct zstd_compress_data *z = g_new0(struct zstd_compress_data, 1);
+
+    z->cctx = ZSTD_createCCtx();
+    if (!z->cctx) {
+        g_free(z);
+        error_setg(errp, "compress: zstd createCCtx failed");
+        return -1;
+    }
+    /* 0 is zstd's default level */
+    z->level = level;
+    *state = z;
+    return 0;
+}
+
+static void zstd_compress_cleanup(void *state)
+{
+    struct zstd_compress_data *z = state;
+
+    ZSTD_freeCCtx(z->cctx);
+    g_free(z);
+}
+
+static int zstd_compress(void *state, uint8_t *dst, size_t dst_len,
+                         const uint8_t *src, size_t src_len)
+{
+    struct zstd_compress_data *z = state;
+    size_t ret;
+
+    ret = ZSTD_compressCCtx(z->cctx, dst, dst_len, src, src_len, z->level);
+    if (ZSTD_isError(ret)) {
+        return -1;
+    }
+    return ret;
+}
+
+static int zstd_decompress_setup(void **state, Error **errp)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+    if (!dctx) {
+        error_setg(errp, "compress: zstd createDCtx failed");
+        return -1;
+    }
+    *state = dctx;
+    return 0;
+}
+
+static void zstd_decompress_cleanup(void *state)
+{
+    ZSTD_freeDCtx(state);
+}
+
+static int zstd_decompress(void *state, uint8_t *dst, size_t dst_len,
+                           const uint8_t *src, size_t src_len)
+{
+    size_t ret;
+
+    ret = ZSTD_decompressDCtx(state, dst, dst_len, src, src_len);
+    if (ZSTD_isError(ret)) {
+        return -1;
+    }
+    return ret;
+}
+
+static size_t zstd_bound(size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+static const RAMCompressMethods ram_compress_zstd_ops = {
+    .compress_setup = zstd_compress_setup,
+    .compress_cleanup = zstd_compress_cleanup,
+    .compress = zstd_compress,
+    .decompress_setup = zstd_decompress_setup,
+    .decompress_cleanup = zstd_decompress_cleanup,
+    .decompress = zstd_decompress,
+    .bound = zstd_bound,
+};
+
+static void ram_compress_zstd_register(void)
+{
+    ram_compress_register_ops(COMPRESS_METHOD_ZSTD, &ram_compress_zstd_ops);
+}
+
+migration_init(ram_compress_zstd_register);
@@ -0,0 +1,133 @@
+/*
+ * Compression methods of the compress capability, and zlib
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "ram-compress.h"
+
+static const RAMCompressMethods *ram_compress_ops[COMPRESS_METHOD__MAX];
+
+void ram_compress_register_ops(CompressMethod method,
+                               const RAMCompressMethods *ops)
+{
+    assert(method < COMPRESS_METHOD__MAX);
+    ram_compress_ops[method] = ops;
+}
+
+const RAMCompressMethods *ram_compress_get_ops(CompressMethod method)
+{
+    assert(method < COMPRESS_METHOD__MAX && ram_compress_ops[method]);
+    return ram_compress_ops[method];
+}
+
+/* zlib compression */
+
+static int zlib_compress_setup(void **state, int level, Error **errp)
+{
+    z_stream *zs = g_new0(z_stream, 1);
+
+    if (deflateInit(zs, level) != Z_OK) {
+        g_free(zs);
+        error_setg(errp, "compress: deflate init failed");
+        return -1;
+    }
+    *state = zs;
+    return 0;
+}
+
+static void zlib_compress_cleanup(void *state)
+{
+    deflateEnd(state);
+    g_free(state);
+}
+
+static int zlib_compress(void *state, uint8_t *dst, size_t dst_len,
+                         const uint8_t *src, size_t src_len)
+{
+    z_stream *zs = state;
+
+    if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    zs->avail_in = src_len;
+    zs->next_in = (uint8_t *)src;
+    zs->avail_out = dst_len;
+    zs->next_out = dst;
+
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+
+    return zs->next_out - dst;
+}
+
+static int zlib_decompress_setup(void **state, Error **errp)
+{
+    z_stream *zs = g_new0(z_stream, 1);
+
+    if (inflateInit(zs) != Z_OK) {
+        g_free(zs);
+        error_setg(errp, "compress: inflate init failed");
+        return -1;
+    }
+    *state = zs;
+    return 0;
+}
+
+static void zlib_decompress_cleanup(void *state)
+{
+    inflateEnd(state);
+    g_free(state);
+}
+
+static int zlib_decompress(void *state, uint8_t *dst, size_t dst_len,
+                           const uint8_t *src, size_t src_len)
+{
+    z_stream *zs = state;
+
+    if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    zs->avail_in = src_len;
+    zs->next_in = (uint8_t *)src;
+    zs->avail_out = dst_len;
+    zs->next_out = dst;
+
+    if (inflate(zs, Z_NO_FLUSH) != Z_STREAM_END) {
+        return -1;
+    }
+
+    return zs->total_out;
+}
+
+static size_t zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static const RAMCompressMethods ram_compress_zlib_ops = {
+    .compress_setup = zlib_compress_setup,
+    .compress_cleanup = zlib_compress_cleanup,
+    .compress = zlib_compress,
+    .decompress_setup = zlib_decompress_setup,
+    .decompress_cleanup = zlib_decompress_cleanup,
+    .decompress = zlib_decompress,
+    .bound = zlib_bound,
+};
+
+static void ram_compress_zlib_register(void)
+{
+    ram_compress_register_ops(COMPRESS_METHOD_ZLIB, &ram_compress_zlib_ops);
+}
+
+migration_init(ram_compress_zlib_register);
@@ -0,0 +1,46 @@
+/*
+ * Compression methods of the compress capability
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_RAM_COMPRESS_H
+#define QEMU_MIGRATION_RAM_COMPRESS_H
+
+#include "qapi/qapi-types-migration.h"
+
+/*
+ * Each page is compressed on its own by a compression thread, with a
+ * state that the thread keeps for the whole migration.
+ */
+typedef struct {
+    /* Create the state of a compression thread, returns 0 or -1 */
+    int (*compress_setup)(void **state, int level, Error **errp);
+    void (*compress_cleanup)(void *state);
+    /*
+     * Compress @src_len bytes at @src into @dst, that has room for
+     * bound(@src_len) bytes.  Returns the compressed size or -1.
+     */
+    int (*compress)(void *state, uint8_t *dst, size_t dst_len,
+                    const uint8_t *src, size_t src_len);
+    /* Create the state of a decompression thread, returns 0 or -1 */
+    int (*decompress_setup)(void **state, Error **errp);
+    void (*decompress_cleanup)(void *state);
+    /*
+     * Decompress @src_len bytes at @src into @dst of @dst_len bytes.
+     * Returns the decompressed size or -1.
+     */
+    int (*decompress)(void *state, uint8_t *dst, size_t dst_len,
+                      const uint8_t *src, size_t src_len);
+    /* Largest compressed size of @len bytes */
+    size_t (*bound)(size_t len);
+} RAMCompressMethods;
+
+void ram_compress_register_ops(CompressMethod method,
+                               const RAMCompressMethods *ops);
+const RAMCompressMethods *ram_compress_get_ops(CompressMethod method);
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * Content-addressed dedup of RAM pages on migration
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "crypto/hash.h"
+#include "exec/target_page.h"
+#include "ram-dedup.h"
+#include "trace.h"
+
+/*
+ * Layout of the store: a header page, the hashes of the slots, rounded
+ * up to a page, and the pages of the slots.  A page can go to any of
+ * RAM_DEDUP_STORE_WAYS slots from its hash; a slot with a zero hash is
+ * free.  The hash of a slot is zeroed while its page is written, and
+ * pages are hashed again after they are copied out, so QEMU processes
+ * can use the store at the same time without any locking.  This also
+ * catches the torn accesses to the hashes on 32-bit hosts.
+ */
+#define RAM_DEDUP_STORE_MAGIC   0x5145445550535452ULL /* "QEDUPSTR" */
+#define RAM_DEDUP_STORE_VERSION 1
+#define RAM_DEDUP_STORE_WAYS    4
+/* Size of the stores created by QEMU */
+#define RAM_DEDUP_STORE_DEFAULT_SIZE (1 * GiB)
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t nr_slots;
+} RAMDedupStoreHeader;
+
+static struct {
+    uint8_t *base;
+    size_t size;
+    RAMDedupHash *hashes;
+    uint8_t *pages;
+    uint64_t nr_slots;
+} ram_dedup_store;
+
+bool ram_dedup_hash(const uint8_t *page, RAMDedupHash *hash)
+{
+    uint8_t *result = NULL;
+    size_t resultlen = 0;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, (const char *)page,
+                           qemu_target_page_size(), &result, &resultlen,
+                           NULL) < 0) {
+        return false;
+    }
+    memcpy(hash, result, sizeof(*hash));
+    g_free(result);
+    /* That one means a free slot */
+    return hash->lo || hash->hi;
+}
+
+static uint64_t ram_dedup_store_slots(size_t size, size_t page_size)
+{
+    uint64_t slots = (size - page_size) / (page_size + sizeof(RAMDedupHash));
+
+    /* Leave room for rounding the hashes up to a page */
+    while (slots &&
+           page_size + ROUND_UP(slots * sizeof(RAMDedupHash), page_size) +
+           slots * page_size > size) {
+        slots--;
+    }
+    return slots;
+}
+
+#ifndef _WIN32
+int ram_dedup_store_open(const char *path, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    RAMDedupStoreHeader *header;
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = qemu_create(path, O_RDWR, 0600, errp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* The processes that open a new store at once don't all set it up */
+    while (qemu_lock_fd(fd, 0, 1, true)) {
+        g_usleep(1000);
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "dedup store: can't stat %s", path);
+        goto fail;
+    }
+    if (!st.st_size) {
+        if (ftruncate(fd, RAM_DEDUP_STORE_DEFAULT_SIZE) < 0) {
+            error_setg_errno(errp, errno, "dedup store: can't size %s", path);
+            goto fail;
+        }
+        st.st_size = RAM_DEDUP_STORE_DEFAULT_SIZE;
+    }
+    if (st.st_size < 2 * page_size + sizeof(RAMDedupHash)) {
+        error_setg(errp, "dedup store: %s is too small", path);
+        goto fail;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        error_setg_errno(errp, errno, "dedup store: can't map %s", path);
+        goto fail;
+    }
+
+    header = base;
+    if (!header->magic) {
+        header->version = RAM_DEDUP_STORE_VERSION;
+        header->page_size = page_size;
+        header->nr_slots = ram_dedup_store_slots(st.st_size, page_size);
+        smp_wmb();
+        qatomic_set__nocheck(&header->magic, RAM_DEDUP_STORE_MAGIC);
+    }
+    if (header->magic != RAM_DEDUP_STORE_MAGIC ||
+        header->version != RAM_DEDUP_STORE_VERSION ||
+        header->page_size != page_size ||
+        header->nr_slots != ram_dedup_store_slots(st.st_size, page_size)) {
+        error_setg(errp, "dedup store: %s is not a store for pages of %zu "
+                   "bytes", path, page_size);
+        munmap(base, st.st_size);
+        goto fail;
+    }
+    qemu_unlock_fd(fd, 0, 1);
+    close(fd);
+
+    ram_dedup_store.base = base;
+    ram_dedup_store.size = st.st_size;
+    ram_dedup_store.nr_slots = header->nr_slots;
+    ram_dedup_store.hashes = base + page_size;
+    ram_dedup_store.pages = base + page_size +
+        ROUND_UP(header->nr_slots * sizeof(RAMDedupHash), page_size);
+    trace_ram_dedup_store_open(path, header->nr_slots);
+    return 0;
+
+fail:
+    qemu_unlock_fd(fd, 0, 1);
+    close(fd);
+    return -1;
+}
+
+void ram_dedup_store_close(void)
+{
+    if (ram_dedup_store.base) {
+        munmap(ram_dedup_store.base, ram_dedup_store.size);
+        ram_dedup_store.base = NULL;
+    }
+}
+#else
+int ram_dedup_store_open(const char *path, Error **errp)
+{
+    error_setg(errp, "dedup store: not supported on this host");
+    return -1;
+}
+
+void ram_dedup_store_close(void)
+{
+}
+#endif
+
+bool ram_dedup_store_active(void)
+{
+    return ram_dedup_store.base;
+}
+
+static uint8_t *ram_dedup_store_page(uint64_t slot)
+{
+    return ram_dedup_store.pages + slot * qemu_target_page_size();
+}
+
+bool ram_dedup_store_lookup(const RAMDedupHash *hash, uint8_t *page)
+{
+    uint64_t slot = hash->lo % ram_dedup_store.nr_slots;
+    RAMDedupHash check;
+    int i;
+
+    for (i = 0; i < RAM_DEDUP_STORE_WAYS; i++) {
+        RAMDedupHash *h = &ram_dedup_store.hashes[slot];
+
+        if (qatomic_read__nocheck(&h->lo) == hash->lo &&
+            qatomic_read__nocheck(&h->hi) == hash->hi) {
+            smp_rmb();
+            memcpy(page, ram_dedup_store_page(slot),
+                   qemu_target_page_size());
+            /* Another process may have replaced it while we copied it */
+            return ram_dedup_hash(page, &check) &&
+                   check.lo == hash->lo && check.hi == hash->hi;
+        }
+        slot = (slot + 1) % ram_dedup_store.nr_slots;
+    }
+    return false;
+}
+
+void ram_dedup_store_insert(const uint8_t *page)
+{
+    RAMDedupHash hash;
+    uint64_t first, slot;
+    RAMDedupHash *h;
+    int i;
+
+    if (!ram_dedup_hash(page, &hash)) {
+        return;
+    }
+
+    first = hash.lo % ram_dedup_store.nr_slots;
+    slot = first;
+    for (i = 0; i < RAM_DEDUP_STORE_WAYS; i++) {
+        h = &ram_dedup_store.hashes[slot];
+        if (qatomic_read__nocheck(&h->lo) == hash.lo &&
+            qatomic_read__nocheck(&h->hi) == hash.hi) {
+            return;
+        }
+        if (!qatomic_read__nocheck(&h->lo) && !qatomic_read__nocheck(&h->hi)) {
+            break;
+        }
+        slot = (slot + 1) % ram_dedup_store.nr_slots;
+    }
+    if (i == RAM_DEDUP_STORE_WAYS) {
+        /* All taken: replace one of them */
+        slot = (first + hash.hi % RAM_DEDUP_STORE_WAYS) %
+               ram_dedup_store.nr_slots;
+    }
+
+    h = &ram_dedup_store.hashes[slot];
+    qatomic_set__nocheck(&h->lo, 0);
+    qatomic_set__nocheck(&h->hi, 0);
+    smp_wmb();
+    memcpy(ram_dedup_store_page(slot), page, qemu_target_page_size());
+    smp_wmb();
+    qatomic_set__nocheck(&h->hi, hash.hi);
+    qatomic_set__nocheck(&h->lo, hash.lo);
+}
@@ -0,0 +1,44 @@
+/*
+ * Content-addressed dedup of RAM pages on migration
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_RAM_DEDUP_H
+#define QEMU_MIGRATION_RAM_DEDUP_H
+
+/* First 128 bits of the SHA-256 of a target page */
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} RAMDedupHash;
+
+/*
+ * Hash the target page at @page.  Returns false if it couldn't, and
+ * the page has to be sent whole.
+ */
+bool ram_dedup_hash(const uint8_t *page, RAMDedupHash *hash);
+
+/*
+ * The store is a file, usually on tmpfs or a memfd passed with add-fd,
+ * that all the QEMU processes which receive migrations on a host share.
+ * It keeps the most recently received pages by hash: pages that their
+ * siblings also have don't need to be sent again.
+ */
+int ram_dedup_store_open(const char *path, Error **errp);
+void ram_dedup_store_close(void);
+bool ram_dedup_store_active(void);
+
+/*
+ * Copy the page of @hash from the store to @page.  Returns false if it
+ * is not in the store, and the page has to be asked for.
+ */
+bool ram_dedup_store_lookup(const RAMDedupHash *hash, uint8_t *page);
+
+/* Add the target page at @page to the store */
+void ram_dedup_store_insert(const uint8_t *page);
+
+#endif
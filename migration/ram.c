@@ -28,9 +28,11 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
+#include "qemu/thread-context.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
@@ -43,6 +45,7 @@
 #include "qapi/error.h"
 #include "qapi/qapi-types-migration.h"
 #include "qapi/qapi-events-migration.h"
+#include "qapi/qapi-commands-migration.h"
 #include "qapi/qmp/qerror.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
@@ -51,10 +54,15 @@
 #include "migration/colo.h"
 #include "block.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "ram-compress.h"
+#include "ram-dedup.h"
+#include "file.h"
 #include "sysemu/runstate.h"
+#include "qemu/event_notifier.h"
 
 #if defined(__linux__)
 #include "qemu/userfaultfd.h"
@@ -69,7 +77,11 @@
  * RAM_SSAVE_FLAG_COMPRESS_PAGE just rename it.
  */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/*
+ * 0x01 was RAM_SAVE_FLAG_FULL, unused since 2010.  With target pages of
+ * 1 KiB there's no other bit left, so it's now for the multifd syncs.
+ */
+#define RAM_SAVE_FLAG_MULTIFD_FLUSH 0x01
 #define RAM_SAVE_FLAG_ZERO     0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -78,6 +90,20 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* The page is sent by its hash, for the destination's dedup store */
+#define RAM_SAVE_FLAG_HASH_PAGE        0x200
+
+/*
+ * With fixed-ram, the pages of each RAMBlock start at a multiple of
+ * this in the migration file.
+ */
+#define FIXED_RAM_FILE_ALIGN 0x100000
+
+/*
+ * Upper bound of the size of a page in the stream: the address and
+ * flags, the RAMBlock id and a page, compressed or not
+ */
+#define RAM_LOAD_PAGE_RECORD_MAX (8 + 1 + 255 + 4 + 2 * TARGET_PAGE_SIZE)
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
@@ -149,7 +175,9 @@ int xbzrle_cache_resize(uint64_t new_size, Error **errp)
     XBZRLE_cache_lock();
 
     if (XBZRLE.cache != NULL) {
-        new_cache = cache_init(new_size, TARGET_PAGE_SIZE, errp);
+        new_cache = cache_init(new_size, TARGET_PAGE_SIZE,
+                               migrate_xbzrle_cache_hugetlb(),
+                               migrate_xbzrle_cache_numa_node(), errp);
         if (!new_cache) {
             ret = -1;
             goto out;
@@ -163,10 +191,18 @@ out:
     return ret;
 }
 
+/* With ram-handover, blocks whose memory goes to the destination as is */
+static bool ramblock_is_handed_over(RAMBlock *block)
+{
+    return migrate_ram_handover() && qemu_ram_is_shared(block) &&
+           block->fd >= 0;
+}
+
 bool ramblock_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
-           (migrate_ignore_shared() && qemu_ram_is_shared(block));
+           (migrate_ignore_shared() && qemu_ram_is_shared(block)) ||
+           ramblock_is_handed_over(block);
 }
 
 #undef RAMBLOCK_FOREACH
@@ -208,6 +244,20 @@ bool ramblock_recv_bitmap_test_byte_offset(RAMBlock *rb, uint64_t byte_offset)
     return test_bit(byte_offset >> TARGET_PAGE_BITS, rb->receivedmap);
 }
 
+/*
+ * Whether the page at @host_addr is known to be zero because nothing
+ * wrote it since the destination started: anonymous guest RAM starts
+ * out zero until its pages are received, unlike the files and ROMs
+ * that the destination fills in itself, or a guest that ran before
+ * loadvm.
+ */
+bool ramblock_recv_page_is_pristine(RAMBlock *rb, void *host_addr)
+{
+    return runstate_check(RUN_STATE_INMIGRATE) &&
+           rb->fd < 0 && !memory_region_is_rom(rb->mr) &&
+           !rb->mr->rom_device && !ramblock_recv_bitmap_test(rb, host_addr);
+}
+
 void ramblock_recv_bitmap_set(RAMBlock *rb, void *host_addr)
 {
     set_bit_atomic(ramblock_recv_bitmap_offset(host_addr, rb), rb->receivedmap);
@@ -223,9 +273,55 @@ void ramblock_recv_bitmap_set_range(RAMBlock *rb, void *host_addr,
 
 #define  RAMBLOCK_RECV_BITMAP_ENDING  (0x0123456789abcdefULL)
 
+/*
+ * Run-length encode the first @nbits bits of the received bitmap of
+ * @block into @buf: the lengths of the runs of clear and set bits, one
+ * after the other and starting with clear bits, as LEB128 numbers.
+ *
+ * Returns the size of the encoding, or 0 if it needs more than @max
+ * bytes.
+ */
+static size_t ramblock_recv_bitmap_encode(RAMBlock *block,
+                                          unsigned long nbits,
+                                          uint8_t *buf, size_t max)
+{
+    unsigned long pos = 0, next;
+    bool set = false;
+    size_t len = 0;
+
+    while (pos < nbits) {
+        uint64_t run;
+
+        if (set) {
+            next = find_next_zero_bit(block->receivedmap, nbits, pos);
+        } else {
+            next = find_next_bit(block->receivedmap, nbits, pos);
+        }
+        /* Only the first run can be empty */
+        run = next - pos;
+        do {
+            if (len == max) {
+                return 0;
+            }
+            buf[len++] = (run & 0x7f) | (run > 0x7f ? 0x80 : 0);
+            run >>= 7;
+        } while (run);
+
+        pos = next;
+        set = !set;
+    }
+
+    return len;
+}
+
 /*
  * Format: bitmap_size (8 bytes) + whole_bitmap (N bytes).
  *
+ * With postcopy-compress-bitmap: bitmap_size (8 bytes) + encoded_size
+ * (8 bytes) + run-length encoded bitmap (encoded_size bytes).  When the
+ * encoding is not smaller than the bitmap, encoded_size is 0 and the
+ * whole bitmap follows instead.
+ *
  * Returns >0 if success with sent bytes, or <0 if error.
  */
 int64_t ramblock_recv_bitmap_send(QEMUFile *file,
@@ -233,7 +329,8 @@ int64_t ramblock_recv_bitmap_send(QEMUFile *file,
 {
     RAMBlock *block = qemu_ram_block_by_name(block_name);
     unsigned long *le_bitmap, nbits;
-    uint64_t size;
+    uint64_t size, encoded = 0;
+    int64_t sent;
 
     if (!block) {
         error_report("%s: invalid block name: %s", __func__, block_name);
@@ -268,7 +365,21 @@ int64_t ramblock_recv_bitmap_send(QEMUFile *file,
     size = ROUND_UP(size, 8);
 
     qemu_put_be64(file, size);
-    qemu_put_buffer(file, (const uint8_t *)le_bitmap, size);
+    sent = sizeof(size);
+    if (migrate_postcopy_compress_bitmap()) {
+        uint8_t *buf = g_malloc(size);
+
+        encoded = ramblock_recv_bitmap_encode(block, nbits, buf, size - 1);
+        qemu_put_be64(file, encoded);
+        qemu_put_buffer(file, buf, encoded);
+        sent += sizeof(encoded) + encoded;
+        g_free(buf);
+        trace_ramblock_recv_bitmap_encode(block_name, size, encoded);
+    }
+    if (!encoded) {
+        qemu_put_buffer(file, (const uint8_t *)le_bitmap, size);
+        sent += size;
+    }
     /*
      * Mark as an end, in case the middle part is screwed up due to
      * some "mysterious" reason.
@@ -282,7 +393,7 @@ int64_t ramblock_recv_bitmap_send(QEMUFile *file,
         return qemu_file_get_error(file);
     }
 
-    return size + sizeof(size);
+    return sent;
 }
 
 /*
@@ -293,29 +404,68 @@ struct RAMSrcPageRequest {
     RAMBlock *rb;
     hwaddr    offset;
     hwaddr    len;
+    /* When the request was received, in microseconds */
+    int64_t   time_us;
 
+    /* Until the migration thread takes it out of src_page_requests_new */
+    QSLIST_ENTRY(RAMSrcPageRequest) next_new;
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/*
+ * A host page that the guest wanted to write during a background
+ * snapshot, copied before it was unprotected
+ */
+typedef struct {
+    RAMBlock *block;
+    /* offset of the host page in the block */
+    ram_addr_t offset;
+    /* target pages of the host page that are sent from data */
+    unsigned long *pages;
+    uint8_t *data;
+} RAMStagedPage;
+
 /* State of RAM for migration */
 struct RAMState {
     /* QEMUFile used for this migration */
     QEMUFile *f;
     /* UFFD file descriptor, used in 'write-tracking' migration */
     int uffdio_fd;
+    /* Thread that resolves the UFFD write faults of 'write-tracking' */
+    QemuThread wp_thread;
+    EventNotifier wp_quit_notifier;
+    bool wp_quit;
+    /* Ring of the pages copied by wp_thread, protected by wp_lock */
+    QemuMutex wp_lock;
+    QemuCond wp_cond;
+    RAMStagedPage *wp_staged;
+    unsigned int wp_nr_staged;
+    unsigned int wp_head;
+    unsigned int wp_count;
+    /* Target pages in the ring, that are not dirty anymore but not sent */
+    unsigned long wp_staged_pages;
     /* Last block that we have visited searching for dirty pages */
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Last block sent through the postcopy-preempt channel */
+    RAMBlock *postcopy_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
     uint32_t last_version;
+    /* Snapshot that this one applies on top of with ram-incremental, or 0 */
+    uint64_t incremental_parent;
+    uint64_t incremental_generation;
+    /* ram_save_complete() succeeded */
+    bool completed;
     /* How many times we have dirty too many pages */
     int dirty_rate_high_cnt;
     /* these variables are used for bitmap sync */
     /* last time we did a full bitmap_sync */
     int64_t time_last_bitmap_sync;
+    /* end of the last bitmap sync, in ms */
+    int64_t time_last_sync_end;
     /* bytes transferred at start_time */
     uint64_t bytes_xfer_prev;
     /* number of dirty pages since start_time */
@@ -343,13 +493,52 @@ struct RAMState {
     uint64_t target_page_count;
     /* number of dirty bits in the bitmap */
     uint64_t migration_dirty_pages;
+    /*
+     * With ram-cold-first: whether the search skips the hot chunks, the
+     * dirty pages in them after the last sync, and what ram_save_pending
+     * was last asked to fit in the downtime
+     */
+    bool skip_hot;
+    /*
+     * Whether a bitmap sync found pages dirty again since the multifd
+     * channels were last synced, so they must be synced before any of
+     * them is sent
+     */
+    bool multifd_flush_pending;
+    uint64_t hot_dirty_pages;
+    uint64_t switchover_threshold;
+    /*
+     * With dirty-heatmap-granularity, its value when the migration
+     * started, and the bitmap syncs counted in the heatmap
+     */
+    uint64_t heatmap_granularity;
+    uint64_t heatmap_syncs;
     /* Protects modification of the bitmap and migration dirty pages */
     QemuMutex bitmap_mutex;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
-    /* Queue of outstanding page requests from the destination */
-    QemuMutex src_page_req_mutex;
+    /*
+     * Page requests from the destination, pushed without a lock by
+     * ram_save_queue_pages(), newest first
+     */
+    QSLIST_HEAD(, RAMSrcPageRequest) src_page_requests_new;
+    /*
+     * Queue of outstanding page requests from the destination, only
+     * accessed by the migration thread
+     */
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+
+    /* Postcopy prefetch, only accessed by the migration thread */
+    /* RAMBlock of the last page requested by the destination */
+    RAMBlock *prefetch_block;
+    /* Host page index of the last requested page */
+    long prefetch_last_hpage;
+    /* Distance from the requested page before the last one, in host pages */
+    long prefetch_last_delta;
+    /* Distance between the host pages to send, possibly negative */
+    long prefetch_stride;
+    /* Number of the next host page of the window to send, from 1 */
+    unsigned int prefetch_next;
 };
 typedef struct RAMState RAMState;
 
@@ -387,7 +576,26 @@ uint64_t ram_bytes_remaining(void)
                        0;
 }
 
+/*
+ * Estimate of the bytes of RAM that the guest wrote since the last
+ * bitmap sync, from the dirty page rate of the last period.  The next
+ * sync adds them to ram_bytes_remaining().
+ */
+uint64_t ram_bytes_dirtied_since_sync(void)
+{
+    RAMState *rs = ram_state;
+    int64_t elapsed;
+
+    if (!rs || !rs->time_last_sync_end) {
+        return 0;
+    }
+    elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - rs->time_last_sync_end;
+    return MIN(ram_counters.dirty_pages_rate * elapsed / 1000 *
+               TARGET_PAGE_SIZE, ram_bytes_total());
+}
+
 MigrationStats ram_counters;
+MigrationAtomicStats ram_atomic_counters;
 
 /* used by the search for pages to send */
 struct PageSearchStatus {
@@ -397,23 +605,48 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* The destination asked for this page */
+    bool         postcopy_requested;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
 CompressionStats compression_counters;
 
+/* Time from the reception of a page request to its last page being sent */
+static MigrationLatencyStats postcopy_queue_latency;
+
+MigrationLatencyHistogram *ram_postcopy_queue_latency(void)
+{
+    if (!postcopy_queue_latency.count) {
+        return NULL;
+    }
+    return migration_latency_histogram(&postcopy_queue_latency);
+}
+
+/*
+ * The migration thread hands the pages over to the compression threads
+ * COMPRESS_BATCH_PAGES at a time.
+ */
+#define COMPRESS_BATCH_PAGES 32
+
 struct CompressParam {
     bool done;
     bool quit;
-    bool zero_page;
-    QEMUFile *file;
     QemuMutex mutex;
     QemuCond cond;
+    /* pages to compress, all in block */
     RAMBlock *block;
-    ram_addr_t offset;
+    ram_addr_t offsets[COMPRESS_BATCH_PAGES];
+    int count;
+
+    /* records of the last batch, that the migration thread sends */
+    uint8_t *outbuf;
+    size_t outlen;
+    int zero_pages;
+    int compressed_pages;
 
     /* internally used fields */
-    z_stream stream;
+    void *state;
     uint8_t *originbuf;
 };
 typedef struct CompressParam CompressParam;
@@ -426,7 +659,7 @@ struct DecompressParam {
     void *des;
     uint8_t *compbuf;
     int len;
-    z_stream stream;
+    void *state;
 };
 typedef struct DecompressParam DecompressParam;
 
@@ -438,39 +671,86 @@ static QemuThread *compress_threads;
  */
 static QemuMutex comp_done_lock;
 static QemuCond comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
+static const RAMCompressMethods *comp_ops;
+/* pages queued for the next free compression thread */
+static struct {
+    RAMBlock *block;
+    ram_addr_t offsets[COMPRESS_BATCH_PAGES];
+    int count;
+} comp_batch;
 
 static QEMUFile *decomp_file;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
+static const RAMCompressMethods *decomp_ops;
+
+/*
+ * With load-threads, the pages that the incoming thread reads from the
+ * main stream are queued, with their payload, to the load thread that
+ * owns their chunk of LOAD_BATCH_PAGES target pages.  A page thus always
+ * goes to the same thread, and is written in the order it was received.
+ */
+#define LOAD_BATCH_PAGES 64
+
+struct LoadPage {
+    /* where the page goes */
+    void *host;
+    /* RAM_SAVE_FLAG_PAGE, RAM_SAVE_FLAG_ZERO or RAM_SAVE_FLAG_XBZRLE */
+    int flags;
+    /* filling byte of a zero page, or length of the XBZRLE data */
+    unsigned int arg;
+};
+typedef struct LoadPage LoadPage;
+
+struct LoadBatch {
+    LoadPage pages[LOAD_BATCH_PAGES];
+    /* payload of each page, TARGET_PAGE_SIZE bytes apart */
+    uint8_t *buf;
+    int count;
+};
+typedef struct LoadBatch LoadBatch;
+
+struct LoadParam {
+    /* no batch handed over or being written, protected by load_done_lock */
+    bool done;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* batch being filled by the incoming thread */
+    LoadBatch *fill;
+    /* batch handed over to the load thread */
+    LoadBatch *apply;
+    LoadBatch batches[2];
+};
+typedef struct LoadParam LoadParam;
+
+static QEMUFile *load_file;
+static LoadParam *load_param;
+static QemuThread *load_threads;
+static int load_thread_count;
+static QemuMutex load_done_lock;
+static QemuCond load_done_cond;
 
-static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
-                                 ram_addr_t offset, uint8_t *source_buf);
+static void do_compress_ram_batch(CompressParam *param);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
-    RAMBlock *block;
-    ram_addr_t offset;
-    bool zero_page;
 
     qemu_mutex_lock(&param->mutex);
     while (!param->quit) {
-        if (param->block) {
-            block = param->block;
-            offset = param->offset;
-            param->block = NULL;
+        if (param->count) {
+            int64_t start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
             qemu_mutex_unlock(&param->mutex);
 
-            zero_page = do_compress_ram_page(param->file, &param->stream,
-                                             block, offset, param->originbuf);
+            do_compress_ram_batch(param);
+            migration_add_compress_time(param - comp_param, start_us);
 
             qemu_mutex_lock(&comp_done_lock);
             param->done = true;
-            param->zero_page = zero_page;
             qemu_cond_signal(&comp_done_cond);
             qemu_mutex_unlock(&comp_done_lock);
 
@@ -498,7 +778,7 @@ static void compress_threads_save_cleanup(void)
          * we use it as a indicator which shows if the thread is
          * properly init'd or not
          */
-        if (!comp_param[i].file) {
+        if (!comp_param[i].outbuf) {
             break;
         }
 
@@ -510,10 +790,10 @@ static void compress_threads_save_cleanup(void)
         qemu_thread_join(compress_threads + i);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
-        deflateEnd(&comp_param[i].stream);
+        comp_ops->compress_cleanup(comp_param[i].state);
         g_free(comp_param[i].originbuf);
-        qemu_fclose(comp_param[i].file);
-        comp_param[i].file = NULL;
+        g_free(comp_param[i].outbuf);
+        comp_param[i].outbuf = NULL;
     }
     qemu_mutex_destroy(&comp_done_lock);
     qemu_cond_destroy(&comp_done_cond);
@@ -526,6 +806,8 @@ static void compress_threads_save_cleanup(void)
 static int compress_threads_save_setup(void)
 {
     int i, thread_count;
+    size_t outbuf_size;
+    Error *local_err = NULL;
 
     if (!migrate_use_compression()) {
         return 0;
@@ -535,29 +817,38 @@ static int compress_threads_save_setup(void)
     comp_param = g_new0(CompressParam, thread_count);
     qemu_cond_init(&comp_done_cond);
     qemu_mutex_init(&comp_done_lock);
+    comp_ops = ram_compress_get_ops(migrate_compress_method());
+    comp_batch.count = 0;
+    /* header, compressed size and data of each page */
+    outbuf_size = COMPRESS_BATCH_PAGES *
+                  (8 + 4 + comp_ops->bound(TARGET_PAGE_SIZE));
     for (i = 0; i < thread_count; i++) {
         comp_param[i].originbuf = g_try_malloc(TARGET_PAGE_SIZE);
         if (!comp_param[i].originbuf) {
             goto exit;
         }
 
-        if (deflateInit(&comp_param[i].stream,
-                        migrate_compress_level()) != Z_OK) {
+        if (comp_ops->compress_setup(&comp_param[i].state,
+                                     migrate_compress_level(),
+                                     &local_err)) {
+            error_report_err(local_err);
             g_free(comp_param[i].originbuf);
             goto exit;
         }
 
-        /* comp_param[i].file is just used as a dummy buffer to save data,
-         * set its ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].outbuf = g_try_malloc(outbuf_size);
+        if (!comp_param[i].outbuf) {
+            comp_ops->compress_cleanup(comp_param[i].state);
+            g_free(comp_param[i].originbuf);
+            goto exit;
+        }
         comp_param[i].done = true;
         comp_param[i].quit = false;
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
-        qemu_thread_create(compress_threads + i, "compress",
-                           do_data_compress, comp_param + i,
-                           QEMU_THREAD_JOINABLE);
+        thread_context_create_thread(THREAD_GROUP_COMPRESS,
+                                     compress_threads + i, "compress",
+                                     do_data_compress, comp_param + i);
     }
     return 0;
 
@@ -639,6 +930,32 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
     }
 }
 
+/**
+ * migration_dirty_limit_guest: throttle down the vCPUs that dirty fast
+ *
+ * Unlike mig_throttle_guest_down(), limit the dirty page rate of each
+ * vCPU to vcpu-dirty-limit, so that only the vCPUs dirtying memory
+ * faster than that get throttled.
+ */
+static void migration_dirty_limit_guest(void)
+{
+    MigrationState *s = migrate_get_current();
+    static uint64_t quota_dirtyrate;
+
+    /*
+     * Nothing to do if the limit is already on, unless the parameter
+     * was changed in the meanwhile.
+     */
+    if (dirtylimit_in_service() &&
+        quota_dirtyrate == s->parameters.vcpu_dirty_limit) {
+        return;
+    }
+
+    quota_dirtyrate = s->parameters.vcpu_dirty_limit;
+    dirtylimit_set_all(quota_dirtyrate, true);
+    trace_migration_dirty_limit_guest(quota_dirtyrate);
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -660,7 +977,7 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
     cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+                 stat64_get(&ram_atomic_counters.dirty_sync_count));
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -685,13 +1002,13 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
 {
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
+    uint64_t sync_count = stat64_get(&ram_atomic_counters.dirty_sync_count);
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr,
-                         ram_counters.dirty_sync_count)) {
+    if (!cache_is_cached(XBZRLE.cache, current_addr, sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
             if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+                             sync_count) == -1) {
                 return -1;
             } else {
                 /* update *current_data when the page has been
@@ -756,12 +1073,12 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     qemu_put_buffer(rs->f, XBZRLE.encoded_buf, encoded_len);
     bytes_xbzrle += encoded_len + 1 + 2;
     /*
-     * Like compressed_size (please see update_compress_thread_counts),
+     * Like compressed_size (please see compress_send_output),
      * the xbzrle encoded bytes don't count the 8 byte header with
      * RAM_SAVE_FLAG_CONTINUE.
      */
     xbzrle_counters.bytes += bytes_xbzrle - 8;
-    ram_counters.transferred += bytes_xbzrle;
+    stat64_add(&ram_atomic_counters.transferred, bytes_xbzrle);
 
     return 1;
 }
@@ -781,2051 +1098,3844 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
 {
     unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
     unsigned long *bitmap = rb->bmap;
+    unsigned long words = BITS_TO_LONGS(size);
+    unsigned long word;
 
     if (ramblock_is_ignored(rb)) {
         return size;
     }
 
-    return find_next_bit(bitmap, size, start);
-}
-
-static inline bool migration_bitmap_clear_dirty(RAMState *rs,
-                                                RAMBlock *rb,
-                                                unsigned long page)
-{
-    bool ret;
-
-    QEMU_LOCK_GUARD(&rs->bitmap_mutex);
-
-    /*
-     * Clear dirty bitmap if needed.  This _must_ be called before we
-     * send any of the page in the chunk because we need to make sure
-     * we can capture further page content changes when we sync dirty
-     * log the next time.  So as long as we are going to send any of
-     * the page in the chunk we clear the remote dirty bitmap for all.
-     * Clearing it earlier won't be a problem, but too late will.
-     */
-    if (rb->clear_bmap && clear_bmap_test_and_clear(rb, page)) {
-        uint8_t shift = rb->clear_bmap_shift;
-        hwaddr size = 1ULL << (TARGET_PAGE_BITS + shift);
-        hwaddr start = (((ram_addr_t)page) << TARGET_PAGE_BITS) & (-size);
-
-        /*
-         * CLEAR_BITMAP_SHIFT_MIN should always guarantee this... this
-         * can make things easier sometimes since then start address
-         * of the small chunk will always be 64 pages aligned so the
-         * bitmap will always be aligned to unsigned long.  We should
-         * even be able to remove this restriction but I'm simply
-         * keeping it.
-         */
-        assert(shift >= 6);
-        trace_migration_bitmap_clear_dirty(rb->idstr, start, size, page);
-        memory_region_clear_dirty_bitmap(rb->mr, start, size);
+    if (!rb->bmap_summary) {
+        return find_next_bit(bitmap, size, start);
     }
 
-    ret = test_and_clear_bit(page, rb->bmap);
+    for (word = BIT_WORD(start); ; word++) {
+        unsigned long bits;
 
-    if (ret) {
-        rs->migration_dirty_pages--;
+        word = find_next_bit(rb->bmap_summary, words, word);
+        if (word >= words) {
+            return size;
+        }
+        bits = bitmap[word];
+        if (!bits) {
+            clear_bit(word, rb->bmap_summary);
+            continue;
+        }
+        if (word == BIT_WORD(start)) {
+            bits &= BITMAP_FIRST_WORD_MASK(start);
+        }
+        if (bits) {
+            return MIN(word * BITS_PER_LONG + ctzl(bits), size);
+        }
     }
-
-    return ret;
 }
 
-/* Called with RCU critical section */
-static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
+/* Marks the bmap words of @npages pages from @start as maybe dirty */
+static void ramblock_bmap_summary_set(RAMBlock *rb, unsigned long start,
+                                      unsigned long npages)
 {
-    uint64_t new_dirty_pages =
-        cpu_physical_memory_sync_dirty_bitmap(rb, 0, rb->used_length);
-
-    rs->migration_dirty_pages += new_dirty_pages;
-    rs->num_dirty_pages_period += new_dirty_pages;
+    if (rb->bmap_summary && npages) {
+        bitmap_set(rb->bmap_summary, BIT_WORD(start),
+                   BIT_WORD(start + npages - 1) - BIT_WORD(start) + 1);
+    }
 }
 
-/**
- * ram_pagesize_summary: calculate all the pagesizes of a VM
- *
- * Returns a summary bitmap of the page sizes of all RAMBlocks
- *
- * For VMs with just normal pages this is equivalent to the host page
- * size. If it's got some huge pages then it's the OR of all the
- * different page sizes.
+/*
+ * With clear-dirty-log-ahead, a helper thread clears the dirty log of
+ * the RAM_CLEAR_AHEAD_CHUNKS clear_bmap chunks after the one that the
+ * migration thread is sending, so it finds them cleared when it gets
+ * there.  Whoever clears the bit of a chunk in clear_bmap first clears
+ * its dirty log; the migration thread only has to wait for the helper
+ * if it is still clearing that very chunk.
  */
-uint64_t ram_pagesize_summary(void)
-{
+#define RAM_CLEAR_AHEAD_CHUNKS 4
+
+static struct {
+    QemuThread thread;
+    /* Protects the send cursor and the chunk being cleared below */
+    QemuMutex lock;
+    QemuCond cond;
+    /* Chunk of @block that the migration thread is in */
     RAMBlock *block;
-    uint64_t summary = 0;
+    unsigned long chunk;
+    /* Chunk that the helper is clearing, when @busy_block is set */
+    RAMBlock *busy_block;
+    unsigned long busy_chunk;
+    bool active;
+    bool quit;
+} ram_clear;
 
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        summary |= block->page_size;
-    }
+static void migration_clear_dirty_log_chunk(RAMBlock *rb, unsigned long page)
+{
+    uint8_t shift = rb->clear_bmap_shift;
+    hwaddr size, start;
 
-    return summary;
-}
+    size = 1ULL << (TARGET_PAGE_BITS + shift);
+    start = (((ram_addr_t)page) << TARGET_PAGE_BITS) & (-size);
 
-uint64_t ram_get_total_transferred_pages(void)
-{
-    return  ram_counters.normal + ram_counters.duplicate +
-                compression_counters.pages + xbzrle_counters.pages;
+    /*
+     * CLEAR_BITMAP_SHIFT_MIN should always guarantee this... this
+     * can make things easier sometimes since then start address
+     * of the small chunk will always be 64 pages aligned so the
+     * bitmap will always be aligned to unsigned long.  We should
+     * even be able to remove this restriction but I'm simply
+     * keeping it.
+     */
+    assert(shift >= 6);
+    trace_migration_bitmap_clear_dirty(rb->idstr, start, size, page);
+    memory_region_clear_dirty_bitmap(rb->mr, start, size);
 }
 
-static void migration_update_rates(RAMState *rs, int64_t end_time)
+/* Wait for the helper to clear @chunk of @rb, if it is doing it */
+static void ram_clear_wait(RAMBlock *rb, unsigned long chunk)
 {
-    uint64_t page_count = rs->target_page_count - rs->target_page_count_prev;
-    double compressed_size;
-
-    /* calculate period counters */
-    ram_counters.dirty_pages_rate = rs->num_dirty_pages_period * 1000
-                / (end_time - rs->time_last_bitmap_sync);
-
-    if (!page_count) {
+    if (qatomic_read(&ram_clear.busy_block) != rb) {
         return;
     }
 
-    if (migrate_use_xbzrle()) {
-        double encoded_size, unencoded_size;
+    QEMU_LOCK_GUARD(&ram_clear.lock);
+    while (ram_clear.busy_block == rb && ram_clear.busy_chunk == chunk) {
+        qemu_cond_wait(&ram_clear.cond, &ram_clear.lock);
+    }
+}
 
-        xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
-            rs->xbzrle_cache_miss_prev) / page_count;
-        rs->xbzrle_cache_miss_prev = xbzrle_counters.cache_miss;
-        unencoded_size = (xbzrle_counters.pages - rs->xbzrle_pages_prev) *
-                         TARGET_PAGE_SIZE;
-        encoded_size = xbzrle_counters.bytes - rs->xbzrle_bytes_prev;
-        if (xbzrle_counters.pages == rs->xbzrle_pages_prev || !encoded_size) {
-            xbzrle_counters.encoding_rate = 0;
-        } else {
-            xbzrle_counters.encoding_rate = unencoded_size / encoded_size;
-        }
-        rs->xbzrle_pages_prev = xbzrle_counters.pages;
-        rs->xbzrle_bytes_prev = xbzrle_counters.bytes;
+/*
+ * Clear the dirty log of the clear_bmap chunk of @page, if it wasn't
+ * yet after the last sync.  This _must_ be called before we send any
+ * of the page in the chunk, or drop it from the migration bitmap,
+ * because we need to make sure we can capture further page content
+ * changes when we sync dirty log the next time.  So as long as we are
+ * going to send any of the page in the chunk we clear the remote dirty
+ * bitmap for all.  Clearing it earlier won't be a problem, but too
+ * late will.
+ */
+static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
+                                                       unsigned long page)
+{
+    if (!rb->clear_bmap) {
+        return;
     }
 
-    if (migrate_use_compression()) {
-        compression_counters.busy_rate = (double)(compression_counters.busy -
-            rs->compress_thread_busy_prev) / page_count;
-        rs->compress_thread_busy_prev = compression_counters.busy;
+    if (clear_bmap_test_and_clear(rb, page)) {
+        migration_clear_dirty_log_chunk(rb, page);
+    } else if (ram_clear.active) {
+        ram_clear_wait(rb, page >> rb->clear_bmap_shift);
+    }
+}
 
-        compressed_size = compression_counters.compressed_size -
-                          rs->compressed_size_prev;
-        if (compressed_size) {
-            double uncompressed_size = (compression_counters.pages -
-                                    rs->compress_pages_prev) * TARGET_PAGE_SIZE;
+/* Let the helper clear the chunks after the one of @page */
+static void ram_clear_ahead(RAMBlock *rb, unsigned long page)
+{
+    unsigned long chunk;
 
-            /* Compression-Ratio = Uncompressed-size / Compressed-size */
-            compression_counters.compression_rate =
-                                        uncompressed_size / compressed_size;
+    if (!ram_clear.active || !rb->clear_bmap) {
+        return;
+    }
 
-            rs->compress_pages_prev = compression_counters.pages;
-            rs->compressed_size_prev = compression_counters.compressed_size;
-        }
+    /* Only the migration thread changes the cursor */
+    chunk = page >> rb->clear_bmap_shift;
+    if (rb == ram_clear.block && chunk == ram_clear.chunk) {
+        return;
     }
+
+    QEMU_LOCK_GUARD(&ram_clear.lock);
+    ram_clear.block = rb;
+    ram_clear.chunk = chunk;
+    qemu_cond_broadcast(&ram_clear.cond);
 }
 
-static void migration_trigger_throttle(RAMState *rs)
+static void *ram_clear_thread(void *opaque)
 {
-    MigrationState *s = migrate_get_current();
-    uint64_t threshold = s->parameters.throttle_trigger_threshold;
+    RAMBlock *block = NULL;
+    unsigned long chunk = 0, next = 0, pages;
+    uint8_t shift;
 
-    uint64_t bytes_xfer_period = ram_counters.transferred - rs->bytes_xfer_prev;
-    uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
-    uint64_t bytes_dirty_threshold = bytes_xfer_period * threshold / 100;
+    rcu_register_thread();
+    qemu_mutex_lock(&ram_clear.lock);
+    while (!ram_clear.quit) {
+        if (ram_clear.block != block || ram_clear.chunk != chunk) {
+            block = ram_clear.block;
+            chunk = ram_clear.chunk;
+            next = chunk + 1;
+        }
+        if (!block || next > chunk + RAM_CLEAR_AHEAD_CHUNKS) {
+            qemu_cond_wait(&ram_clear.cond, &ram_clear.lock);
+            continue;
+        }
 
-    /* During block migration the auto-converge logic incorrectly detects
-     * that ram migration makes no progress. Avoid this by disabling the
-     * throttling logic during the bulk phase of block migration. */
-    if (migrate_auto_converge() && !blk_mig_bulk_active()) {
-        /* The following detection logic can be refined later. For now:
-           Check to see if the ratio between dirtied bytes and the approx.
-           amount of bytes that just got transferred since the last time
-           we were in this routine reaches the threshold. If that happens
-           twice, start or increase throttling. */
+        ram_clear.busy_chunk = next;
+        qatomic_set(&ram_clear.busy_block, block);
+        qemu_mutex_unlock(&ram_clear.lock);
+        /* Pairs with clear_bmap_test_and_clear() in the migration thread */
+        smp_mb();
 
-        if ((bytes_dirty_period > bytes_dirty_threshold) &&
-            (++rs->dirty_rate_high_cnt >= 2)) {
-            trace_migration_throttle();
-            rs->dirty_rate_high_cnt = 0;
-            mig_throttle_guest_down(bytes_dirty_period,
-                                    bytes_dirty_threshold);
+        WITH_RCU_READ_LOCK_GUARD() {
+            shift = block->clear_bmap_shift;
+            pages = block->used_length >> TARGET_PAGE_BITS;
+            if (next < clear_bmap_size(pages, shift) &&
+                clear_bmap_test_and_clear(block, next << shift)) {
+                migration_clear_dirty_log_chunk(block, next << shift);
+            }
         }
+
+        qemu_mutex_lock(&ram_clear.lock);
+        qatomic_set(&ram_clear.busy_block, NULL);
+        qemu_cond_broadcast(&ram_clear.cond);
+        next++;
     }
+    qemu_mutex_unlock(&ram_clear.lock);
+    rcu_unregister_thread();
+
+    return NULL;
 }
 
-static void migration_bitmap_sync(RAMState *rs)
+static void ram_clear_thread_setup(void)
 {
     RAMBlock *block;
-    int64_t end_time;
-
-    ram_counters.dirty_sync_count++;
+    bool clear_bmap = false;
 
-    if (!rs->time_last_bitmap_sync) {
-        rs->time_last_bitmap_sync = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        clear_bmap |= !!block->clear_bmap;
+    }
+    if (!migrate_clear_dirty_log_ahead() || !clear_bmap || ram_clear.active) {
+        return;
     }
 
-    trace_migration_bitmap_sync_start();
-    memory_global_dirty_log_sync();
+    qemu_mutex_init(&ram_clear.lock);
+    qemu_cond_init(&ram_clear.cond);
+    ram_clear.block = NULL;
+    ram_clear.busy_block = NULL;
+    ram_clear.quit = false;
+    ram_clear.active = true;
+    thread_context_create_thread(THREAD_GROUP_MIGRATION, &ram_clear.thread,
+                                 "mig/clear", ram_clear_thread, NULL);
+}
 
-    qemu_mutex_lock(&rs->bitmap_mutex);
-    WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
-        ram_counters.remaining = ram_bytes_remaining();
+static void ram_clear_thread_cleanup(void)
+{
+    if (!ram_clear.active) {
+        return;
     }
-    qemu_mutex_unlock(&rs->bitmap_mutex);
-
-    memory_global_after_dirty_log_sync();
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
 
-    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-
-    /* more than 1 second = 1000 millisecons */
-    if (end_time > rs->time_last_bitmap_sync + 1000) {
-        migration_trigger_throttle(rs);
-
-        migration_update_rates(rs, end_time);
+    WITH_QEMU_LOCK_GUARD(&ram_clear.lock) {
+        ram_clear.quit = true;
+        qemu_cond_broadcast(&ram_clear.cond);
+    }
+    qemu_thread_join(&ram_clear.thread);
+    ram_clear.active = false;
+    qemu_cond_destroy(&ram_clear.cond);
+    qemu_mutex_destroy(&ram_clear.lock);
+}
 
-        rs->target_page_count_prev = rs->target_page_count;
+/* Same for all the clear_bmap chunks of @npages pages from @start */
+static void
+migration_clear_memory_region_dirty_bitmap_range(RAMBlock *rb,
+                                                 unsigned long start,
+                                                 unsigned long npages)
+{
+    unsigned long i, chunk_pages = 1UL << rb->clear_bmap_shift;
+    unsigned long chunk_start = QEMU_ALIGN_DOWN(start, chunk_pages);
+    unsigned long chunk_end = QEMU_ALIGN_UP(start + npages, chunk_pages);
 
-        /* reset period counters */
-        rs->time_last_bitmap_sync = end_time;
-        rs->num_dirty_pages_period = 0;
-        rs->bytes_xfer_prev = ram_counters.transferred;
-    }
-    if (migrate_use_events()) {
-        qapi_event_send_migration_pass(ram_counters.dirty_sync_count);
+    for (i = chunk_start; i < chunk_end; i += chunk_pages) {
+        migration_clear_memory_region_dirty_bitmap(rb, i);
     }
 }
 
-static void migration_bitmap_sync_precopy(RAMState *rs)
+static inline bool migration_bitmap_clear_dirty(RAMState *rs,
+                                                RAMBlock *rb,
+                                                unsigned long page)
 {
-    Error *local_err = NULL;
+    bool ret;
 
-    /*
-     * The current notifier usage is just an optimization to migration, so we
-     * don't stop the normal migration process in the error case.
-     */
-    if (precopy_notify(PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC, &local_err)) {
-        error_report_err(local_err);
-        local_err = NULL;
-    }
+    QEMU_LOCK_GUARD(&rs->bitmap_mutex);
 
-    migration_bitmap_sync(rs);
+    ram_clear_ahead(rb, page);
+    migration_clear_memory_region_dirty_bitmap(rb, page);
 
-    if (precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC, &local_err)) {
-        error_report_err(local_err);
+    ret = test_and_clear_bit(page, rb->bmap);
+
+    if (ret) {
+        rs->migration_dirty_pages--;
     }
+
+    return ret;
 }
 
-/**
- * save_zero_page_to_file: send the zero page to the file
- *
- * Returns the size of data written to the file, 0 means the page is not
- * a zero page
+/*
+ * Call @fn for the parts of @rb the guest can use: the whole RAMBlock,
+ * or only the populated (e.g. plugged virtio-mem) parts when it has a
+ * RamDiscardManager.  Discarded parts are never dirtied by the guest and
+ * don't need to be synced or migrated.
  *
- * @rs: current RAM state
- * @file: the file where the data is saved
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
+ * Called with RCU critical section
  */
-static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
-                                  RAMBlock *block, ram_addr_t offset)
+static int ramblock_for_each_populated(RAMBlock *rb, ReplayRamPopulate fn,
+                                       void *opaque)
 {
-    uint8_t *p = block->host + offset;
-    int len = 0;
+    MemoryRegionSection section = {
+        .mr = rb->mr,
+        .offset_within_region = 0,
+        .size = int128_make64(rb->used_length),
+    };
 
-    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-        len += save_page_header(rs, file, block, offset | RAM_SAVE_FLAG_ZERO);
-        qemu_put_byte(file, 0);
-        len += 1;
+    if (rb->mr && memory_region_has_ram_discard_manager(rb->mr)) {
+        RamDiscardManager *rdm = memory_region_get_ram_discard_manager(rb->mr);
+
+        return ram_discard_manager_replay_populated(rdm, &section, fn, opaque);
     }
-    return len;
+    return fn(&section, opaque);
 }
 
-/**
- * save_zero_page: send the zero page to the stream
- *
- * Returns the number of pages written.
- *
- * @rs: current RAM state
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- */
-static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+static int ramblock_sync_populated_section(MemoryRegionSection *section,
+                                           void *opaque)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    uint64_t *new_dirty_pages = opaque;
 
-    if (len) {
-        ram_counters.duplicate++;
-        ram_counters.transferred += len;
-        return 1;
-    }
-    return -1;
+    *new_dirty_pages += cpu_physical_memory_sync_dirty_bitmap(
+        section->mr->ram_block, section->offset_within_region,
+        int128_get64(section->size));
+    return 0;
 }
 
-static void ram_release_pages(const char *rbname, uint64_t offset, int pages)
+/* Called with RCU critical section */
+static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 {
-    if (!migrate_release_ram() || !migration_in_postcopy()) {
-        return;
-    }
+    uint64_t new_dirty_pages = 0;
+
+    ramblock_for_each_populated(rb, ramblock_sync_populated_section,
+                                &new_dirty_pages);
 
-    ram_discard_range(rbname, offset, ((ram_addr_t)pages) << TARGET_PAGE_BITS);
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
 }
 
 /*
- * @pages: the number of pages written by the control path,
- *        < 0 - error
- *        > 0 - number of pages written
+ * Bitmap sync threads
  *
- * Return true if the pages has been saved, otherwise false is returned.
+ * On large guests most of migration_bitmap_sync() is spent merging the
+ * dirty bitmaps into the migration bitmap.  The RAMBlocks are split in
+ * chunks that the migration thread and dirty-sync-threads - 1 helper
+ * threads pick up in turn.  Chunks start on a word of the migration
+ * bitmap, so no two threads ever write the same word of it.
  */
-static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
-                              int *pages)
+
+/* Size of a chunk in target pages, a multiple of BITS_PER_LONG */
+#define BITMAP_SYNC_CHUNK_PAGES (1UL << 18)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncChunk;
+
+typedef struct {
+    QemuThread thread;
+    /* posted by the migration thread when there are chunks to sync */
+    QemuSemaphore sem;
+    /* new dirty pages found by this thread during the last sync */
+    uint64_t num_dirty;
+} BitmapSyncParam;
+
+typedef struct {
+    /* number of helper threads */
+    int thread_count;
+    BitmapSyncParam *params;
+    /* chunks of the current sync, rebuilt on each sync */
+    GArray *chunks;
+    /* index of the next chunk to sync */
+    unsigned int next_chunk;
+    /* posted by each helper thread when there are no chunks left */
+    QemuSemaphore done_sem;
+    bool quit;
+} BitmapSyncState;
+
+static BitmapSyncState *bitmap_sync;
+
+static uint64_t bitmap_sync_chunks(void)
 {
-    uint64_t bytes_xmit = 0;
-    int ret;
+    uint64_t num_dirty = 0;
+    unsigned int i;
 
-    *pages = -1;
-    ret = ram_control_save_page(rs->f, block->offset, offset, TARGET_PAGE_SIZE,
-                                &bytes_xmit);
-    if (ret == RAM_SAVE_CONTROL_NOT_SUPP) {
-        return false;
-    }
+    while ((i = qatomic_fetch_inc(&bitmap_sync->next_chunk)) <
+           bitmap_sync->chunks->len) {
+        BitmapSyncChunk *chunk = &g_array_index(bitmap_sync->chunks,
+                                                BitmapSyncChunk, i);
 
-    if (bytes_xmit) {
-        ram_counters.transferred += bytes_xmit;
-        *pages = 1;
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(chunk->block,
+                                                           chunk->start,
+                                                           chunk->length);
     }
+    return num_dirty;
+}
 
-    if (ret == RAM_SAVE_CONTROL_DELAYED) {
-        return true;
-    }
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncParam *p = opaque;
 
-    if (bytes_xmit > 0) {
-        ram_counters.normal++;
-    } else if (bytes_xmit == 0) {
-        ram_counters.duplicate++;
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        if (qatomic_read(&bitmap_sync->quit)) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            p->num_dirty = bitmap_sync_chunks();
+        }
+        qemu_sem_post(&bitmap_sync->done_sem);
     }
+    rcu_unregister_thread();
 
-    return true;
+    return NULL;
 }
 
-/*
- * directly send the page to the stream
- *
- * Returns the number of pages written.
- *
- * @rs: current RAM state
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- * @buf: the page to be sent
- * @async: send to page asyncly
- */
-static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
-                            uint8_t *buf, bool async)
+static void bitmap_sync_threads_cleanup(void)
 {
-    ram_counters.transferred += save_page_header(rs, rs->f, block,
-                                                 offset | RAM_SAVE_FLAG_PAGE);
-    if (async) {
-        qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
-                              migrate_release_ram() &
-                              migration_in_postcopy());
-    } else {
-        qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+    int i;
+
+    if (!bitmap_sync) {
+        return;
     }
-    ram_counters.transferred += TARGET_PAGE_SIZE;
-    ram_counters.normal++;
-    return 1;
+
+    qatomic_set(&bitmap_sync->quit, true);
+    for (i = 0; i < bitmap_sync->thread_count; i++) {
+        qemu_sem_post(&bitmap_sync->params[i].sem);
+    }
+    for (i = 0; i < bitmap_sync->thread_count; i++) {
+        qemu_thread_join(&bitmap_sync->params[i].thread);
+        qemu_sem_destroy(&bitmap_sync->params[i].sem);
+    }
+    qemu_sem_destroy(&bitmap_sync->done_sem);
+    g_array_free(bitmap_sync->chunks, true);
+    g_free(bitmap_sync->params);
+    g_free(bitmap_sync);
+    bitmap_sync = NULL;
 }
 
-/**
- * ram_save_page: send the given page to the stream
- *
- * Returns the number of pages written.
- *          < 0 - error
- *          >=0 - Number of pages written - this might legally be 0
- *                if xbzrle noticed the page was the same.
- *
- * @rs: current RAM state
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- * @last_stage: if we are at the completion stage
- */
-static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
+static void bitmap_sync_threads_setup(void)
 {
-    int pages = -1;
-    uint8_t *p;
-    bool send_async = true;
-    RAMBlock *block = pss->block;
-    ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
-    ram_addr_t current_addr = block->offset + offset;
+    int i, thread_count = migrate_dirty_sync_threads() - 1;
 
-    p = block->host + offset;
-    trace_ram_save_page(block->idstr, (uint64_t)offset, p);
-
-    XBZRLE_cache_lock();
-    if (rs->xbzrle_enabled && !migration_in_postcopy()) {
-        pages = save_xbzrle_page(rs, &p, current_addr, block,
-                                 offset, last_stage);
-        if (!last_stage) {
-            /* Can't send this cached data async, since the cache page
-             * might get updated before it gets to the wire
-             */
-            send_async = false;
-        }
+    if (thread_count <= 0 || bitmap_sync) {
+        return;
     }
 
-    /* XBZRLE overflow or normal page */
-    if (pages == -1) {
-        pages = save_normal_page(rs, block, offset, p, send_async);
+    bitmap_sync = g_new0(BitmapSyncState, 1);
+    bitmap_sync->thread_count = thread_count;
+    bitmap_sync->params = g_new0(BitmapSyncParam, thread_count);
+    bitmap_sync->chunks = g_array_new(false, false, sizeof(BitmapSyncChunk));
+    qemu_sem_init(&bitmap_sync->done_sem, 0);
+    for (i = 0; i < thread_count; i++) {
+        qemu_sem_init(&bitmap_sync->params[i].sem, 0);
+        thread_context_create_thread(THREAD_GROUP_MIGRATION,
+                                     &bitmap_sync->params[i].thread,
+                                     "mig/dirtysync", bitmap_sync_thread,
+                                     &bitmap_sync->params[i]);
     }
-
-    XBZRLE_cache_unlock();
-
-    return pages;
 }
 
-static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
-                                 ram_addr_t offset)
+static int bitmap_sync_add_chunks(MemoryRegionSection *section, void *opaque)
 {
-    if (multifd_queue_page(rs->f, block, offset) < 0) {
-        return -1;
-    }
-    ram_counters.normal++;
+    ram_addr_t chunk_size = (ram_addr_t)BITMAP_SYNC_CHUNK_PAGES <<
+                            TARGET_PAGE_BITS;
+    ram_addr_t offset = section->offset_within_region;
+    ram_addr_t end = offset + int128_get64(section->size);
 
-    return 1;
+    while (offset < end) {
+        /* Keep chunks on word boundaries of the migration bitmap */
+        ram_addr_t next = MIN(QEMU_ALIGN_DOWN(offset + chunk_size,
+                                              chunk_size), end);
+        BitmapSyncChunk chunk = {
+            .block = section->mr->ram_block,
+            .start = offset,
+            .length = next - offset,
+        };
+
+        g_array_append_val(bitmap_sync->chunks, chunk);
+        offset = next;
+    }
+    return 0;
 }
 
-static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
-                                 ram_addr_t offset, uint8_t *source_buf)
+/* Called with RCU critical section */
+static void ramblock_sync_dirty_bitmap_threads(RAMState *rs)
 {
-    RAMState *rs = ram_state;
-    uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
-    bool zero_page = false;
-    int ret;
+    uint64_t new_dirty_pages;
+    RAMBlock *block;
+    int i;
 
-    if (save_zero_page_to_file(rs, f, block, offset)) {
-        zero_page = true;
-        goto exit;
+    g_array_set_size(bitmap_sync->chunks, 0);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ramblock_for_each_populated(block, bitmap_sync_add_chunks, NULL);
     }
+    trace_migration_bitmap_sync_threads(bitmap_sync->thread_count + 1,
+                                        bitmap_sync->chunks->len);
 
-    save_page_header(rs, f, block, offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+    bitmap_sync->next_chunk = 0;
+    for (i = 0; i < bitmap_sync->thread_count; i++) {
+        qemu_sem_post(&bitmap_sync->params[i].sem);
+    }
 
-    /*
-     * copy it to a internal buffer to avoid it being modified by VM
-     * so that we can catch up the error during compression and
-     * decompression
-     */
-    memcpy(source_buf, p, TARGET_PAGE_SIZE);
-    ret = qemu_put_compression_data(f, stream, source_buf, TARGET_PAGE_SIZE);
-    if (ret < 0) {
-        qemu_file_set_error(migrate_get_current()->to_dst_file, ret);
-        error_report("compressed data failed!");
-        return false;
+    new_dirty_pages = bitmap_sync_chunks();
+
+    for (i = 0; i < bitmap_sync->thread_count; i++) {
+        qemu_sem_wait(&bitmap_sync->done_sem);
+    }
+    for (i = 0; i < bitmap_sync->thread_count; i++) {
+        new_dirty_pages += bitmap_sync->params[i].num_dirty;
     }
 
-exit:
-    ram_release_pages(block->idstr, offset & TARGET_PAGE_MASK, 1);
-    return zero_page;
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
 }
 
-static void
-update_compress_thread_counts(const CompressParam *param, int bytes_xmit)
+/**
+ * ram_pagesize_summary: calculate all the pagesizes of a VM
+ *
+ * Returns a summary bitmap of the page sizes of all RAMBlocks
+ *
+ * For VMs with just normal pages this is equivalent to the host page
+ * size. If it's got some huge pages then it's the OR of all the
+ * different page sizes.
+ */
+uint64_t ram_pagesize_summary(void)
 {
-    ram_counters.transferred += bytes_xmit;
+    RAMBlock *block;
+    uint64_t summary = 0;
 
-    if (param->zero_page) {
-        ram_counters.duplicate++;
-        return;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        summary |= block->page_size;
     }
 
-    /* 8 means a header with RAM_SAVE_FLAG_CONTINUE. */
-    compression_counters.compressed_size += bytes_xmit - 8;
-    compression_counters.pages++;
+    return summary;
 }
 
-static bool save_page_use_compression(RAMState *rs);
+uint64_t ram_get_total_transferred_pages(void)
+{
+    return  stat64_get(&ram_atomic_counters.normal) +
+            stat64_get(&ram_atomic_counters.duplicate) +
+            compression_counters.pages + xbzrle_counters.pages;
+}
 
-static void flush_compressed_data(RAMState *rs)
+static void migration_update_rates(RAMState *rs, int64_t end_time)
 {
-    int idx, len, thread_count;
+    uint64_t page_count = rs->target_page_count - rs->target_page_count_prev;
+    double compressed_size;
 
-    if (!save_page_use_compression(rs)) {
+    /* calculate period counters */
+    ram_counters.dirty_pages_rate = rs->num_dirty_pages_period * 1000
+                / (end_time - rs->time_last_bitmap_sync);
+
+    if (!page_count) {
         return;
     }
-    thread_count = migrate_compress_threads();
 
-    qemu_mutex_lock(&comp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!comp_param[idx].done) {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        }
-    }
-    qemu_mutex_unlock(&comp_done_lock);
+    if (migrate_use_xbzrle() || migrate_multifd_xbzrle()) {
+        double encoded_size, unencoded_size;
 
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        if (!comp_param[idx].quit) {
-            len = qemu_put_qemu_file(rs->f, comp_param[idx].file);
-            /*
-             * it's safe to fetch zero_page without holding comp_done_lock
-             * as there is no further request submitted to the thread,
-             * i.e, the thread should be waiting for a request at this point.
-             */
-            update_compress_thread_counts(&comp_param[idx], len);
+        xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
+            rs->xbzrle_cache_miss_prev) / page_count;
+        rs->xbzrle_cache_miss_prev = xbzrle_counters.cache_miss;
+        unencoded_size = (xbzrle_counters.pages - rs->xbzrle_pages_prev) *
+                         TARGET_PAGE_SIZE;
+        encoded_size = xbzrle_counters.bytes - rs->xbzrle_bytes_prev;
+        if (xbzrle_counters.pages == rs->xbzrle_pages_prev || !encoded_size) {
+            xbzrle_counters.encoding_rate = 0;
+        } else {
+            xbzrle_counters.encoding_rate = unencoded_size / encoded_size;
         }
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+        rs->xbzrle_pages_prev = xbzrle_counters.pages;
+        rs->xbzrle_bytes_prev = xbzrle_counters.bytes;
     }
-}
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
-{
-    param->block = block;
-    param->offset = offset;
-}
+    if (migrate_use_compression()) {
+        compression_counters.busy_rate = (double)(compression_counters.busy -
+            rs->compress_thread_busy_prev) / page_count;
+        rs->compress_thread_busy_prev = compression_counters.busy;
 
-static int compress_page_with_multi_thread(RAMState *rs, RAMBlock *block,
-                                           ram_addr_t offset)
-{
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
-    bool wait = migrate_compress_wait_thread();
+        compressed_size = compression_counters.compressed_size -
+                          rs->compressed_size_prev;
+        if (compressed_size) {
+            double uncompressed_size = (compression_counters.pages -
+                                    rs->compress_pages_prev) * TARGET_PAGE_SIZE;
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(&comp_done_lock);
-retry:
-    for (idx = 0; idx < thread_count; idx++) {
-        if (comp_param[idx].done) {
-            comp_param[idx].done = false;
-            bytes_xmit = qemu_put_qemu_file(rs->f, comp_param[idx].file);
-            qemu_mutex_lock(&comp_param[idx].mutex);
-            set_compress_params(&comp_param[idx], block, offset);
-            qemu_cond_signal(&comp_param[idx].cond);
-            qemu_mutex_unlock(&comp_param[idx].mutex);
-            pages = 1;
-            update_compress_thread_counts(&comp_param[idx], bytes_xmit);
-            break;
-        }
-    }
+            /* Compression-Ratio = Uncompressed-size / Compressed-size */
+            compression_counters.compression_rate =
+                                        uncompressed_size / compressed_size;
 
-    /*
-     * wait for the free thread if the user specifies 'compress-wait-thread',
-     * otherwise we will post the page out in the main thread as normal page.
-     */
-    if (pages < 0 && wait) {
-        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        goto retry;
+            rs->compress_pages_prev = compression_counters.pages;
+            rs->compressed_size_prev = compression_counters.compressed_size;
+        }
     }
-    qemu_mutex_unlock(&comp_done_lock);
-
-    return pages;
 }
 
-/**
- * find_dirty_block: find the next dirty page and update any state
- * associated with the search process.
- *
- * Returns true if a page is found
- *
- * @rs: current RAM state
- * @pss: data about the state of the current dirty page scan
- * @again: set to false if the search has scanned the whole of RAM
- */
-static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
+static void migration_trigger_throttle(RAMState *rs)
 {
-    pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
-    if (pss->complete_round && pss->block == rs->last_seen_block &&
-        pss->page >= rs->last_page) {
-        /*
-         * We've been once around the RAM and haven't found anything.
-         * Give up.
-         */
-        *again = false;
-        return false;
-    }
-    if (!offset_in_ramblock(pss->block,
-                            ((ram_addr_t)pss->page) << TARGET_PAGE_BITS)) {
-        /* Didn't find anything in this RAM Block */
-        pss->page = 0;
-        pss->block = QLIST_NEXT_RCU(pss->block, next);
-        if (!pss->block) {
-            /*
-             * If memory migration starts over, we will meet a dirtied page
-             * which may still exists in compression threads's ring, so we
-             * should flush the compressed data to make sure the new page
-             * is not overwritten by the old one in the destination.
-             *
-             * Also If xbzrle is on, stop using the data compression at this
-             * point. In theory, xbzrle can do better than compression.
-             */
-            flush_compressed_data(rs);
+    MigrationState *s = migrate_get_current();
+    uint64_t threshold = s->parameters.throttle_trigger_threshold;
 
-            /* Hit the end of the list */
-            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
-            /* Flag that we've looped */
-            pss->complete_round = true;
-            /* After the first round, enable XBZRLE. */
-            if (migrate_use_xbzrle()) {
-                rs->xbzrle_enabled = true;
+    uint64_t bytes_xfer_period =
+        stat64_get(&ram_atomic_counters.transferred) - rs->bytes_xfer_prev;
+    uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
+    uint64_t bytes_dirty_threshold = bytes_xfer_period * threshold / 100;
+
+    /* During block migration the auto-converge logic incorrectly detects
+     * that ram migration makes no progress. Avoid this by disabling the
+     * throttling logic during the bulk phase of block migration. */
+    if ((migrate_auto_converge() || migrate_dirty_limit()) &&
+        !blk_mig_bulk_active()) {
+        /* The following detection logic can be refined later. For now:
+           Check to see if the ratio between dirtied bytes and the approx.
+           amount of bytes that just got transferred since the last time
+           we were in this routine reaches the threshold. If that happens
+           twice, start or increase throttling. */
+
+        if ((bytes_dirty_period > bytes_dirty_threshold) &&
+            (++rs->dirty_rate_high_cnt >= 2)) {
+            rs->dirty_rate_high_cnt = 0;
+            if (migrate_auto_converge()) {
+                trace_migration_throttle();
+                mig_throttle_guest_down(bytes_dirty_period,
+                                        bytes_dirty_threshold);
+            } else {
+                migration_dirty_limit_guest();
             }
         }
-        /* Didn't find anything this time, but try again on the new block */
-        *again = true;
-        return false;
-    } else {
-        /* Can go around again, but... */
-        *again = true;
-        /* We've found something so probably don't need to */
-        return true;
     }
 }
 
-/**
- * unqueue_page: gets a page of the queue
- *
- * Helper for 'get_queued_page' - gets a page off the queue
- *
- * Returns the block of the page (or NULL if none available)
+/*
+ * Cold pages first
  *
- * @rs: current RAM state
- * @offset: used to return the offset within the RAMBlock
+ * With ram-cold-first, each RAMBlock has one byte per chunk of
+ * RAM_HEAT_CHUNK_PAGES pages (at least a host page) that records, one
+ * bit per bitmap sync, whether the chunk was dirty after the last ones.
+ * A chunk dirty after each of the last RAM_HEAT_HOT_SYNCS syncs is hot:
+ * its pages would most likely be written again before the switchover,
+ * so the search skips them until all the cold pages have been sent.
+ * They are sent in the downtime if they fit in it, at the end of the
+ * round otherwise.
  */
-static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
+#define RAM_HEAT_CHUNK_PAGES 512
+#define RAM_HEAT_HOT_SYNCS 3
+#define RAM_HEAT_HOT_MASK ((1U << RAM_HEAT_HOT_SYNCS) - 1)
+
+static unsigned long ram_heat_chunk_pages(RAMBlock *rb)
 {
-    RAMBlock *block = NULL;
+    return MAX(RAM_HEAT_CHUNK_PAGES, rb->page_size >> TARGET_PAGE_BITS);
+}
 
-    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
-        return NULL;
-    }
+static bool ram_chunk_is_hot(RAMBlock *rb, unsigned long page)
+{
+    uint8_t heat = rb->dirty_heat[page / ram_heat_chunk_pages(rb)];
 
-    QEMU_LOCK_GUARD(&rs->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
-        struct RAMSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&rs->src_page_requests);
-        block = entry->rb;
-        *offset = entry->offset;
+    return (heat & RAM_HEAT_HOT_MASK) == RAM_HEAT_HOT_MASK;
+}
 
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
-            entry->offset += TARGET_PAGE_SIZE;
-        } else {
-            memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
-            g_free(entry);
-            migration_consume_urgent_request();
+/* Called with bitmap_mutex held, after the dirty bitmaps are synced */
+static void ram_update_heat(RAMState *rs)
+{
+    uint64_t hot_chunks = 0;
+    RAMBlock *block;
+
+    rs->hot_dirty_pages = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long chunk_pages = ram_heat_chunk_pages(block);
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long start;
+
+        for (start = 0; start < pages; start += chunk_pages) {
+            unsigned long end = MIN(start + chunk_pages, pages);
+            uint8_t *heat = &block->dirty_heat[start / chunk_pages];
+            bool dirty = find_next_bit(block->bmap, end, start) < end;
+
+            *heat = (*heat << 1) | dirty;
+            if (ram_chunk_is_hot(block, start)) {
+                hot_chunks++;
+                rs->hot_dirty_pages +=
+                    bitmap_count_one_with_offset(block->bmap, start,
+                                                 end - start);
+            }
         }
     }
-
-    return block;
+    rs->skip_hot = true;
+    trace_ram_update_heat(hot_chunks, rs->hot_dirty_pages);
 }
 
-#if defined(__linux__)
-/**
- * poll_fault_page: try to get next UFFD write fault page and, if pending fault
- *   is found, return RAM block pointer and page offset
- *
- * Returns pointer to the RAMBlock containing faulting page,
- *   NULL if no write faults are pending
- *
- * @rs: current RAM state
- * @offset: page offset from the beginning of the block
+/*
+ * Returns the first dirty page of @rb from @start that is not in a hot
+ * chunk, or the size of @rb
  */
-static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+static unsigned long ram_find_cold_dirty(RAMState *rs, RAMBlock *rb,
+                                         unsigned long start)
 {
-    struct uffd_msg uffd_msg;
-    void *page_address;
-    RAMBlock *block;
-    int res;
+    unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
+    unsigned long chunk_pages = ram_heat_chunk_pages(rb);
+    unsigned long page = migration_bitmap_find_dirty(rs, rb, start);
 
-    if (!migrate_background_snapshot()) {
-        return NULL;
+    while (page < size && ram_chunk_is_hot(rb, page)) {
+        page = migration_bitmap_find_dirty(rs, rb,
+                                           QEMU_ALIGN_UP(page + 1,
+                                                         chunk_pages));
     }
+    return page;
+}
 
-    res = uffd_read_events(rs->uffdio_fd, &uffd_msg, 1);
-    if (res <= 0) {
-        return NULL;
-    }
+/*
+ * Size of the pages in which @rb is tracked and sent: its host page
+ * size, or the transparent huge page size for RAMBlocks of small pages
+ * with the ram-huge-page-granularity capability.
+ */
+static size_t ramblock_migration_pagesize(RAMBlock *rb)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
 
-    page_address = (void *)(uintptr_t) uffd_msg.arg.pagefault.address;
-    block = qemu_ram_block_from_host(page_address, false, offset);
-    assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
-    return block;
+    if (migrate_ram_huge_page_granularity() &&
+        pagesize == qemu_real_host_page_size &&
+        QEMU_VMALLOC_ALIGN > pagesize &&
+        QEMU_PTR_IS_ALIGNED(rb->host, QEMU_VMALLOC_ALIGN)) {
+        return QEMU_VMALLOC_ALIGN;
+    }
+    return pagesize;
 }
 
-/**
- * ram_save_release_protection: release UFFD write protection after
- *   a range of pages has been saved
- *
- * @rs: current RAM state
- * @pss: page-search-status structure
- * @start_page: index of the first page in the range relative to pss->block
+/*
+ * Mark the whole migration page dirty when any of its target pages is,
+ * so that it is sent in one go.
  *
- * Returns 0 on success, negative value in case of an error
-*/
-static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
-        unsigned long start_page)
+ * Called with bitmap_mutex held, after the dirty bitmap is synced.
+ */
+static void ramblock_dirty_bitmap_round_up(RAMState *rs, RAMBlock *rb)
 {
-    int res = 0;
-
-    /* Check if page is from UFFD-managed region. */
-    if (pss->block->flags & RAM_UF_WRITEPROTECT) {
-        void *page_address = pss->block->host + (start_page << TARGET_PAGE_BITS);
-        uint64_t run_length = (pss->page - start_page + 1) << TARGET_PAGE_BITS;
+    unsigned long granule = ramblock_migration_pagesize(rb) >>
+                            TARGET_PAGE_BITS;
+    unsigned long pages = rb->used_length >> TARGET_PAGE_BITS;
+    unsigned long page;
 
-        /* Flush async buffers before un-protect. */
-        qemu_fflush(rs->f);
-        /* Un-protect memory range. */
-        res = uffd_change_protection(rs->uffdio_fd, page_address, run_length,
-                false, false);
+    if (granule == qemu_ram_pagesize(rb) >> TARGET_PAGE_BITS) {
+        return;
     }
 
-    return res;
+    page = find_next_bit(rb->bmap, pages, 0);
+    while (page < pages) {
+        unsigned long start = QEMU_ALIGN_DOWN(page, granule);
+        unsigned long end = MIN(start + granule, pages);
+
+        rs->migration_dirty_pages += end - start -
+            bitmap_count_one_with_offset(rb->bmap, start, end - start);
+        bitmap_set(rb->bmap, start, end - start);
+        ramblock_bmap_summary_set(rb, start, end - start);
+        page = find_next_bit(rb->bmap, pages, end);
+    }
 }
 
-/* ram_write_tracking_available: check if kernel supports required UFFD features
+/*
+ * Dirty heatmap
  *
- * Returns true if supports, false otherwise
+ * With dirty-heatmap-granularity, each RAMBlock has two counters per
+ * bucket of that many bytes: the dirty pages in the bucket after each
+ * bitmap sync, and the syncs after which it had any.  The first sync,
+ * after which every page is dirty, is not counted.  The buckets that
+ * are dirty after most syncs are the ones that the migration can't
+ * keep up with.
  */
-bool ram_write_tracking_available(void)
+static unsigned long ram_heatmap_buckets(RAMState *rs, ram_addr_t length)
 {
-    uint64_t uffd_features;
-    int res;
+    return DIV_ROUND_UP(length, rs->heatmap_granularity);
+}
 
-    res = uffd_query_features(&uffd_features);
-    return (res == 0 &&
-            (uffd_features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) != 0);
+/* Called with bitmap_mutex held, after the dirty bitmaps are synced */
+static void ram_update_heatmap(RAMState *rs)
+{
+    unsigned long bucket_pages = rs->heatmap_granularity >> TARGET_PAGE_BITS;
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long start;
+
+        for (start = 0; start < pages; start += bucket_pages) {
+            unsigned long i = start / bucket_pages;
+            unsigned long dirty;
+
+            dirty = bitmap_count_one_with_offset(block->bmap, start,
+                                                 MIN(bucket_pages,
+                                                     pages - start));
+            if (dirty) {
+                block->heatmap_pages[i] += dirty;
+                block->heatmap_syncs[i]++;
+            }
+        }
+    }
+    rs->heatmap_syncs++;
 }
 
-/* ram_write_tracking_compatible: check if guest configuration is
- *   compatible with 'write-tracking'
- *
- * Returns true if compatible, false otherwise
- */
-bool ram_write_tracking_compatible(void)
+DirtyHeatmap *qmp_query_dirty_heatmap(Error **errp)
 {
-    const uint64_t uffd_ioctls_mask = BIT(_UFFDIO_WRITEPROTECT);
-    int uffd_fd;
+    RAMState *rs = ram_state;
+    DirtyHeatmapBlockList **tail;
+    DirtyHeatmap *heatmap;
     RAMBlock *block;
-    bool ret = false;
 
-    /* Open UFFD file descriptor */
-    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false);
-    if (uffd_fd < 0) {
-        return false;
+    if (!rs || !rs->heatmap_granularity) {
+        error_setg(errp, "No dirty heatmap: migration is not running, or "
+                   "dirty-heatmap-granularity was 0 when it started");
+        return NULL;
     }
 
-    RCU_READ_LOCK_GUARD();
+    heatmap = g_new0(DirtyHeatmap, 1);
+    heatmap->granularity = rs->heatmap_granularity;
+    tail = &heatmap->blocks;
 
+    RCU_READ_LOCK_GUARD();
+    QEMU_LOCK_GUARD(&rs->bitmap_mutex);
+    heatmap->syncs = rs->heatmap_syncs;
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        uint64_t uffd_ioctls;
-
-        /* Nothing to do with read-only and MMIO-writable regions */
-        if (block->mr->readonly || block->mr->rom_device) {
-            continue;
-        }
-        /* Try to register block memory via UFFD-IO to track writes */
-        if (uffd_register_memory(uffd_fd, block->host, block->max_length,
-                UFFDIO_REGISTER_MODE_WP, &uffd_ioctls)) {
-            goto out;
-        }
-        if ((uffd_ioctls & uffd_ioctls_mask) != uffd_ioctls_mask) {
-            goto out;
+        DirtyHeatmapBlock *info = g_new0(DirtyHeatmapBlock, 1);
+        DirtyHeatmapBucketList **buckets = &info->buckets;
+        unsigned long i;
+
+        info->id = g_strdup(block->idstr);
+        for (i = 0; i < ram_heatmap_buckets(rs, block->used_length); i++) {
+            DirtyHeatmapBucket *bucket = g_new0(DirtyHeatmapBucket, 1);
+
+            bucket->offset = i * rs->heatmap_granularity;
+            bucket->dirty_pages = block->heatmap_pages[i];
+            bucket->dirty_syncs = block->heatmap_syncs[i];
+            QAPI_LIST_APPEND(buckets, bucket);
         }
+        QAPI_LIST_APPEND(tail, info);
     }
-    ret = true;
-
-out:
-    uffd_close_fd(uffd_fd);
-    return ret;
+    return heatmap;
 }
 
-/*
- * ram_block_populate_pages: populate memory in the RAM block by reading
- *   an integer from the beginning of each page.
- *
- * Since it's solely used for userfault_fd WP feature, here we just
- *   hardcode page size to qemu_real_host_page_size.
- *
- * @block: RAM block to populate
- */
-static void ram_block_populate_pages(RAMBlock *block)
+static void migration_bitmap_sync(RAMState *rs)
 {
-    char *ptr = (char *) block->host;
-
-    for (ram_addr_t offset = 0; offset < block->used_length;
-            offset += qemu_real_host_page_size) {
-        char tmp = *(ptr + offset);
+    RAMBlock *block;
+    int64_t start_time_us;
+    int64_t end_time;
 
-        /* Don't optimize the read out */
-        asm volatile("" : "+r" (tmp));
+    stat64_add(&ram_atomic_counters.dirty_sync_count, 1);
+    start_time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    if (migrate_use_multifd() && !migrate_multifd_flush_after_each_section()) {
+        rs->multifd_flush_pending = true;
     }
-}
 
-/*
- * ram_write_tracking_prepare: prepare for UFFD-WP memory tracking
- */
-void ram_write_tracking_prepare(void)
-{
-    RAMBlock *block;
+    if (!rs->time_last_bitmap_sync) {
+        rs->time_last_bitmap_sync = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    }
 
-    RCU_READ_LOCK_GUARD();
+    trace_migration_bitmap_sync_start();
+    memory_global_dirty_log_sync();
 
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        /* Nothing to do with read-only and MMIO-writable regions */
-        if (block->mr->readonly || block->mr->rom_device) {
-            continue;
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (bitmap_sync) {
+            ramblock_sync_dirty_bitmap_threads(rs);
+        } else {
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                ramblock_sync_dirty_bitmap(rs, block);
+            }
+        }
+        if (migrate_ram_huge_page_granularity()) {
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                ramblock_dirty_bitmap_round_up(rs, block);
+            }
+        }
+        if (migrate_ram_cold_first() && !migration_in_postcopy()) {
+            ram_update_heat(rs);
         }
+        if (rs->heatmap_granularity) {
+            ram_update_heatmap(rs);
+        }
+        ram_counters.remaining = ram_bytes_remaining();
+    }
+    qemu_mutex_unlock(&rs->bitmap_mutex);
 
-        /*
-         * Populate pages of the RAM block before enabling userfault_fd
-         * write protection.
-         *
-         * This stage is required since ioctl(UFFDIO_WRITEPROTECT) with
-         * UFFDIO_WRITEPROTECT_MODE_WP mode setting would silently skip
-         * pages with pte_none() entries in page table.
-         */
-        ram_block_populate_pages(block);
+    memory_global_after_dirty_log_sync();
+    ram_counters.dirty_sync_time =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time_us;
+    migration_add_time(&migrate_get_current()->bitmap_sync_time,
+                       start_time_us);
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    ram_counters.dirty_sync_time);
+
+    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    rs->time_last_sync_end = end_time;
+
+    /* more than 1 second = 1000 millisecons */
+    if (end_time > rs->time_last_bitmap_sync + 1000) {
+        migration_trigger_throttle(rs);
+
+        migration_update_rates(rs, end_time);
+
+        rs->target_page_count_prev = rs->target_page_count;
+
+        /* reset period counters */
+        rs->time_last_bitmap_sync = end_time;
+        rs->num_dirty_pages_period = 0;
+        rs->bytes_xfer_prev = stat64_get(&ram_atomic_counters.transferred);
+    }
+    if (migrate_use_events()) {
+        qapi_event_send_migration_pass(
+            stat64_get(&ram_atomic_counters.dirty_sync_count));
     }
 }
 
 /*
- * ram_write_tracking_start: start UFFD-WP memory tracking
+ * ram_multifd_send_sync: sync the multifd channels
  *
- * Returns 0 for success or negative value in case of error
+ * The destination receives all the pages sent so far before any page
+ * sent after this.  A page that was sent on one channel, dirtied again
+ * and sent on another can't be overwritten by its older copy then.
+ * That's only needed when a bitmap sync found pages dirty again, and at
+ * the start and end of the migration.  Older machine types sync at the
+ * end of each section instead, and their destination doesn't expect
+ * RAM_SAVE_FLAG_MULTIFD_FLUSH.
+ *
+ * @rs: current RAM state
+ * @f: QEMUFile where to send the data
  */
-int ram_write_tracking_start(void)
+static void ram_multifd_send_sync(RAMState *rs, QEMUFile *f)
 {
-    int uffd_fd;
-    RAMState *rs = ram_state;
-    RAMBlock *block;
-
-    /* Open UFFD file descriptor */
-    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
-    if (uffd_fd < 0) {
-        return uffd_fd;
+    multifd_send_sync_main(f);
+    rs->multifd_flush_pending = false;
+    if (migrate_use_multifd() && !migrate_multifd_flush_after_each_section()) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_FLUSH);
+        stat64_add(&ram_atomic_counters.transferred, 8);
     }
-    rs->uffdio_fd = uffd_fd;
-
-    RCU_READ_LOCK_GUARD();
-
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        /* Nothing to do with read-only and MMIO-writable regions */
-        if (block->mr->readonly || block->mr->rom_device) {
-            continue;
-        }
+}
 
-        /* Register block memory with UFFD to track writes */
-        if (uffd_register_memory(rs->uffdio_fd, block->host,
-                block->max_length, UFFDIO_REGISTER_MODE_WP, NULL)) {
-            goto fail;
-        }
-        /* Apply UFFD write protection to the block memory range */
-        if (uffd_change_protection(rs->uffdio_fd, block->host,
-                block->max_length, true, false)) {
-            goto fail;
-        }
-        block->flags |= RAM_UF_WRITEPROTECT;
-        memory_region_ref(block->mr);
+static void migration_bitmap_sync_precopy(RAMState *rs)
+{
+    Error *local_err = NULL;
 
-        trace_ram_write_tracking_ramblock_start(block->idstr, block->page_size,
-                block->host, block->max_length);
+    /*
+     * The current notifier usage is just an optimization to migration, so we
+     * don't stop the normal migration process in the error case.
+     */
+    if (precopy_notify(PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC, &local_err)) {
+        error_report_err(local_err);
+        local_err = NULL;
     }
 
-    return 0;
-
-fail:
-    error_report("ram_write_tracking_start() failed: restoring initial memory state");
+    migration_bitmap_sync(rs);
 
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
-            continue;
-        }
-        /*
-         * In case some memory block failed to be write-protected
-         * remove protection and unregister all succeeded RAM blocks
-         */
-        uffd_change_protection(rs->uffdio_fd, block->host, block->max_length,
-                false, false);
-        uffd_unregister_memory(rs->uffdio_fd, block->host, block->max_length);
-        /* Cleanup flags and remove reference */
-        block->flags &= ~RAM_UF_WRITEPROTECT;
-        memory_region_unref(block->mr);
+    if (precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC, &local_err)) {
+        error_report_err(local_err);
     }
-
-    uffd_close_fd(uffd_fd);
-    rs->uffdio_fd = -1;
-    return -1;
 }
 
 /**
- * ram_write_tracking_stop: stop UFFD-WP memory tracking and remove protection
+ * save_zero_page_to_file: send the zero page to the file
+ *
+ * Returns the size of data written to the file, 0 means the page is not
+ * a zero page
+ *
+ * @rs: current RAM state
+ * @file: the file where the data is saved
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @p: contents of the page
  */
-void ram_write_tracking_stop(void)
+static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
+                                  RAMBlock *block, ram_addr_t offset,
+                                  uint8_t *p)
 {
-    RAMState *rs = ram_state;
-    RAMBlock *block;
-
-    RCU_READ_LOCK_GUARD();
-
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
-            continue;
-        }
-        /* Remove protection and unregister all affected RAM blocks */
-        uffd_change_protection(rs->uffdio_fd, block->host, block->max_length,
-                false, false);
-        uffd_unregister_memory(rs->uffdio_fd, block->host, block->max_length);
-
-        trace_ram_write_tracking_ramblock_stop(block->idstr, block->page_size,
-                block->host, block->max_length);
+    int len = 0;
 
-        /* Cleanup flags and remove reference */
-        block->flags &= ~RAM_UF_WRITEPROTECT;
-        memory_region_unref(block->mr);
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        len += save_page_header(rs, file, block, offset | RAM_SAVE_FLAG_ZERO);
+        qemu_put_byte(file, 0);
+        len += 1;
     }
-
-    /* Finally close UFFD file descriptor */
-    uffd_close_fd(rs->uffdio_fd);
-    rs->uffdio_fd = -1;
+    return len;
 }
 
-#else
-/* No target OS support, stubs just fail or ignore */
-
-static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+/**
+ * save_zero_page: send the zero page to the stream
+ *
+ * Returns the number of pages written.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @p: contents of the page
+ */
+static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                          uint8_t *p)
 {
-    (void) rs;
-    (void) offset;
+    int len = save_zero_page_to_file(rs, rs->f, block, offset, p);
 
-    return NULL;
+    if (len) {
+        stat64_add(&ram_atomic_counters.duplicate, 1);
+        stat64_add(&ram_atomic_counters.transferred, len);
+        return 1;
+    }
+    return -1;
 }
 
-static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
-        unsigned long start_page)
+/*
+ * Whether the pages of @block are freed once they are sent: in postcopy
+ * with release-ram, or at the end of precopy with release-ram-precopy.
+ * Shared memory isn't freed in precopy, it may well be the destination's.
+ */
+static bool ram_release_sent_pages(RAMBlock *block)
 {
-    (void) rs;
-    (void) pss;
-    (void) start_page;
-
-    return 0;
+    if (migration_in_postcopy()) {
+        return migrate_release_ram();
+    }
+    return migrate_get_current()->ram_released && !qemu_ram_is_shared(block);
 }
 
-bool ram_write_tracking_available(void)
+static void ram_release_pages(RAMBlock *block, uint64_t offset, int pages)
 {
-    return false;
-}
+    if (!ram_release_sent_pages(block)) {
+        return;
+    }
 
-bool ram_write_tracking_compatible(void)
-{
-    assert(0);
-    return false;
+    ram_discard_range(block->idstr, offset,
+                      ((ram_addr_t)pages) << TARGET_PAGE_BITS);
 }
 
-int ram_write_tracking_start(void)
-{
-    assert(0);
-    return -1;
-}
+#define RAM_RELEASE_CHUNK_SIZE  (1 * GiB)
+#define RAM_RELEASE_MAX_THREADS 16
 
-void ram_write_tracking_stop(void)
+static struct {
+    struct iovec *chunks;
+    size_t nr_chunks;
+    size_t next;
+} ram_release;
+
+static void *ram_release_thread(void *opaque)
 {
-    assert(0);
+    size_t i;
+
+    while ((i = qatomic_fetch_inc(&ram_release.next)) <
+           ram_release.nr_chunks) {
+        struct iovec *chunk = &ram_release.chunks[i];
+
+        qemu_madvise(chunk->iov_base, chunk->iov_len, QEMU_MADV_DONTNEED);
+    }
+    return NULL;
 }
-#endif /* defined(__linux__) */
 
-/**
- * get_queued_page: unqueue a page from the postcopy requests
- *
- * Skips pages that are already sent (!dirty)
- *
- * Returns true if a queued page is found
+/*
+ * ram_release_migrated_memory: free the RAM of a migrated VM before quitting
  *
- * @rs: current RAM state
- * @pss: data about the state of the current dirty page scan
+ * The kernel would free it from the exit path of the last thread, one page
+ * at a time: that takes seconds per TiB, and the host can't hand that
+ * memory to the destination or to other VMs until QEMU is gone.  Free it
+ * with a thread per CPU instead, a chunk at a time.
  */
-static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
+void ram_release_migrated_memory(void)
 {
-    RAMBlock  *block;
-    ram_addr_t offset;
-    bool dirty;
+    int nr_threads = MIN(g_get_num_processors(), RAM_RELEASE_MAX_THREADS);
+    g_autofree QemuThread *threads = g_new(QemuThread, nr_threads);
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    RAMBlock *block;
+    size_t chunks = 0;
+    int i;
 
-    do {
-        block = unqueue_page(rs, &offset);
-        /*
-         * We're sending this page, and since it's postcopy nothing else
-         * will dirty it, and we must make sure it doesn't get sent again
-         * even if this queue request was received after the background
-         * search already sent it.
-         */
-        if (block) {
-            unsigned long page;
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            if (!qemu_ram_is_shared(block)) {
+                chunks += DIV_ROUND_UP(block->used_length,
+                                       RAM_RELEASE_CHUNK_SIZE);
+            }
+        }
+        ram_release.chunks = g_new(struct iovec, chunks);
+        ram_release.nr_chunks = 0;
+        ram_release.next = 0;
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ram_addr_t offset;
 
-            page = offset >> TARGET_PAGE_BITS;
-            dirty = test_bit(page, block->bmap);
-            if (!dirty) {
-                trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
-                                                page);
-            } else {
-                trace_get_queued_page(block->idstr, (uint64_t)offset, page);
+            if (qemu_ram_is_shared(block)) {
+                continue;
+            }
+            for (offset = 0; offset < block->used_length;
+                 offset += RAM_RELEASE_CHUNK_SIZE) {
+                struct iovec *chunk =
+                    &ram_release.chunks[ram_release.nr_chunks++];
+
+                chunk->iov_base = block->host + offset;
+                chunk->iov_len = MIN(block->used_length - offset,
+                                     RAM_RELEASE_CHUNK_SIZE);
             }
         }
 
-    } while (block && !dirty);
+        for (i = 0; i < nr_threads; i++) {
+            thread_context_create_thread(THREAD_GROUP_MIGRATION, &threads[i],
+                                         "mig/release", ram_release_thread,
+                                         NULL);
+        }
+        for (i = 0; i < nr_threads; i++) {
+            qemu_thread_join(&threads[i]);
+        }
+    }
 
-    if (!block) {
-        /*
-         * Poll write faults too if background snapshot is enabled; that's
-         * when we have vcpus got blocked by the write protected pages.
-         */
-        block = poll_fault_page(rs, &offset);
+    trace_ram_release_migrated_memory(ram_release.nr_chunks, nr_threads,
+                                      qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                      start);
+    g_free(ram_release.chunks);
+    ram_release.chunks = NULL;
+}
+
+/*
+ * @pages: the number of pages written by the control path,
+ *        < 0 - error
+ *        > 0 - number of pages written
+ *
+ * Return true if the pages has been saved, otherwise false is returned.
+ */
+static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                              int *pages)
+{
+    uint64_t bytes_xmit = 0;
+    int ret;
+
+    *pages = -1;
+    ret = ram_control_save_page(rs->f, block->offset, offset, TARGET_PAGE_SIZE,
+                                &bytes_xmit);
+    if (ret == RAM_SAVE_CONTROL_NOT_SUPP) {
+        return false;
     }
 
-    if (block) {
-        /*
-         * We want the background search to continue from the queued page
-         * since the guest is likely to want other pages near to the page
-         * it just requested.
-         */
-        pss->block = block;
-        pss->page = offset >> TARGET_PAGE_BITS;
+    if (bytes_xmit) {
+        stat64_add(&ram_atomic_counters.transferred, bytes_xmit);
+        *pages = 1;
+    }
 
-        /*
-         * This unqueued page would break the "one round" check, even is
-         * really rare.
-         */
-        pss->complete_round = false;
+    if (ret == RAM_SAVE_CONTROL_DELAYED) {
+        return true;
     }
 
-    return !!block;
+    if (bytes_xmit > 0) {
+        stat64_add(&ram_atomic_counters.normal, 1);
+    } else if (bytes_xmit == 0) {
+        stat64_add(&ram_atomic_counters.duplicate, 1);
+    }
+
+    return true;
 }
 
-/**
- * migration_page_queue_free: drop any remaining pages in the ram
- * request queue
+/*
+ * directly send the page to the stream
  *
- * It should be empty at the end anyway, but in error cases there may
- * be some left.  in case that there is any page left, we drop it.
+ * Returns the number of pages written.
  *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @buf: the page to be sent
+ * @async: send to page asyncly
  */
-static void migration_page_queue_free(RAMState *rs)
+static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                            uint8_t *buf, bool async)
 {
-    struct RAMSrcPageRequest *mspr, *next_mspr;
-    /* This queue generally should be empty - but in the case of a failed
-     * migration might have some droppings in.
-     */
-    RCU_READ_LOCK_GUARD();
-    QSIMPLEQ_FOREACH_SAFE(mspr, &rs->src_page_requests, next_req, next_mspr) {
-        memory_region_unref(mspr->rb->mr);
-        QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
-        g_free(mspr);
+    stat64_add(&ram_atomic_counters.transferred,
+               save_page_header(rs, rs->f, block,
+                                offset | RAM_SAVE_FLAG_PAGE));
+    if (async) {
+        qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
+                              ram_release_sent_pages(block));
+    } else {
+        qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
     }
+    stat64_add(&ram_atomic_counters.transferred, TARGET_PAGE_SIZE);
+    stat64_add(&ram_atomic_counters.normal, 1);
+    return 1;
 }
 
 /**
- * ram_save_queue_pages: queue the page for transmission
- *
- * A request from postcopy destination for example.
+ * ram_save_page: send the given page to the stream
  *
- * Returns zero on success or negative on error
+ * Returns the number of pages written.
+ *          < 0 - error
+ *          >=0 - Number of pages written - this might legally be 0
+ *                if xbzrle noticed the page was the same.
  *
- * @rbname: Name of the RAMBLock of the request. NULL means the
- *          same that last one.
- * @start: starting address from the start of the RAMBlock
- * @len: length (in bytes) to send
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @last_stage: if we are at the completion stage
  */
-int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 {
-    RAMBlock *ramblock;
-    RAMState *rs = ram_state;
-
-    ram_counters.postcopy_requests++;
-    RCU_READ_LOCK_GUARD();
+    int pages = -1;
+    uint8_t *p;
+    bool send_async = true;
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    ram_addr_t current_addr = block->offset + offset;
 
-    if (!rbname) {
-        /* Reuse last RAMBlock */
-        ramblock = rs->last_req_rb;
+    p = block->host + offset;
+    trace_ram_save_page(block->idstr, (uint64_t)offset, p);
 
-        if (!ramblock) {
-            /*
-             * Shouldn't happen, we can't reuse the last RAMBlock if
-             * it's the 1st request.
+    XBZRLE_cache_lock();
+    if (rs->xbzrle_enabled && !migration_in_postcopy()) {
+        pages = save_xbzrle_page(rs, &p, current_addr, block,
+                                 offset, last_stage);
+        if (!last_stage) {
+            /* Can't send this cached data async, since the cache page
+             * might get updated before it gets to the wire
              */
-            error_report("ram_save_queue_pages no previous block");
-            return -1;
-        }
-    } else {
-        ramblock = qemu_ram_block_by_name(rbname);
-
-        if (!ramblock) {
-            /* We shouldn't be asked for a non-existent RAMBlock */
-            error_report("ram_save_queue_pages no block '%s'", rbname);
-            return -1;
+            send_async = false;
         }
-        rs->last_req_rb = ramblock;
-    }
-    trace_ram_save_queue_pages(ramblock->idstr, start, len);
-    if (!offset_in_ramblock(ramblock, start + len - 1)) {
-        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
-                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
-                     __func__, start, len, ramblock->used_length);
-        return -1;
     }
 
-    struct RAMSrcPageRequest *new_entry =
-        g_malloc0(sizeof(struct RAMSrcPageRequest));
-    new_entry->rb = ramblock;
-    new_entry->offset = start;
-    new_entry->len = len;
+    /* XBZRLE overflow or normal page */
+    if (pages == -1) {
+        pages = save_normal_page(rs, block, offset, p, send_async);
+    }
 
-    memory_region_ref(ramblock->mr);
-    qemu_mutex_lock(&rs->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
-    migration_make_urgent_request();
-    qemu_mutex_unlock(&rs->src_page_req_mutex);
+    XBZRLE_cache_unlock();
 
-    return 0;
+    return pages;
 }
 
-static bool save_page_use_compression(RAMState *rs)
+/*
+ * save_fixed_ram_page: write the page at its place in the migration file
+ *
+ * Returns the number of pages written, or negative on error.
+ *
+ * Zero pages are not written, only left out of the bitmap of the block:
+ * the destination doesn't touch them.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @p: contents of the page
+ */
+static int save_fixed_ram_page(RAMState *rs, RAMBlock *block,
+                               ram_addr_t offset, uint8_t *p)
 {
-    if (!migrate_use_compression()) {
-        return false;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    Error *local_err = NULL;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        stat64_add(&ram_atomic_counters.duplicate, 1);
+        return 1;
     }
 
-    /*
-     * If xbzrle is enabled (e.g., after first round of migration), stop
-     * using the data compression. In theory, xbzrle can do better than
-     * compression.
-     */
-    if (rs->xbzrle_enabled) {
-        return false;
+    if (qemu_file_write_at(rs->f, p, TARGET_PAGE_SIZE,
+                           block->pages_offset + offset, &local_err) < 0) {
+        qemu_file_set_error_obj(rs->f, -EIO, local_err);
+        return -EIO;
     }
+    set_bit(page, block->file_bmap);
 
-    return true;
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    stat64_add(&ram_atomic_counters.transferred, TARGET_PAGE_SIZE);
+    stat64_add(&ram_atomic_counters.normal, 1);
+    return 1;
 }
 
-/*
- * try to compress the page before posting it out, return true if the page
- * has been properly handled by compression, otherwise needs other
- * paths to handle it
- */
-static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
+                                 ram_addr_t offset)
 {
-    if (!save_page_use_compression(rs)) {
-        return false;
+    if (multifd_queue_page(rs->f, block, offset) < 0) {
+        return -1;
     }
+    stat64_add(&ram_atomic_counters.normal, 1);
 
-    /*
-     * When starting the process of a new block, the first page of
-     * the block should be sent out before other pages in the same
-     * block, and all the pages in last block should have been sent
-     * out, keeping this order is important, because the 'cont' flag
-     * is used to avoid resending the block name.
-     *
-     * We post the fist page as normal page as compression will take
-     * much CPU resource.
-     */
-    if (block != rs->last_sent_block) {
-        flush_compressed_data(rs);
-        return false;
+    return 1;
+}
+
+/*
+ * Compress the pages of the batch of @param into its outbuf, as the
+ * records that save_zero_page_to_file() and the compression of a page
+ * would write.  The pages are in last_sent_block, so their headers
+ * always have RAM_SAVE_FLAG_CONTINUE.
+ */
+static void do_compress_ram_batch(CompressParam *param)
+{
+    RAMBlock *block = param->block;
+    size_t bound = comp_ops->bound(TARGET_PAGE_SIZE);
+    uint8_t *out = param->outbuf;
+    int i, len;
+
+    for (i = 0; i < param->count; i++) {
+        ram_addr_t offset = param->offsets[i];
+        uint8_t *p = block->host + offset;
+
+        if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+            stq_be_p(out, offset | RAM_SAVE_FLAG_CONTINUE | RAM_SAVE_FLAG_ZERO);
+            out[8] = 0;
+            out += 8 + 1;
+            param->zero_pages++;
+        } else {
+            /*
+             * copy it to a internal buffer to avoid it being modified by VM
+             * so that we can catch up the error during compression and
+             * decompression
+             */
+            memcpy(param->originbuf, p, TARGET_PAGE_SIZE);
+            len = comp_ops->compress(param->state, out + 8 + 4, bound,
+                                     param->originbuf, TARGET_PAGE_SIZE);
+            if (len < 0) {
+                qemu_file_set_error(migrate_get_current()->to_dst_file,
+                                    -EIO);
+                error_report("compressed data failed!");
+                break;
+            }
+            stq_be_p(out, offset | RAM_SAVE_FLAG_CONTINUE |
+                          RAM_SAVE_FLAG_COMPRESS_PAGE);
+            stl_be_p(out + 8, len);
+            out += 8 + 4 + len;
+            param->compressed_pages++;
+        }
+        ram_release_pages(block, offset, 1);
     }
+    param->outlen = out - param->outbuf;
+    param->count = 0;
+}
 
-    if (compress_page_with_multi_thread(rs, block, offset) > 0) {
-        return true;
+/* Send the records of the last batch of @param */
+static void compress_send_output(RAMState *rs, CompressParam *param)
+{
+    if (!param->outlen) {
+        return;
     }
 
-    compression_counters.busy++;
-    return false;
+    qemu_put_buffer(rs->f, param->outbuf, param->outlen);
+    stat64_add(&ram_atomic_counters.transferred, param->outlen);
+    stat64_add(&ram_atomic_counters.duplicate, param->zero_pages);
+
+    /* Without the headers, 8 bytes with RAM_SAVE_FLAG_CONTINUE. */
+    compression_counters.compressed_size += param->outlen -
+        (8 + 1) * param->zero_pages - 8 * param->compressed_pages;
+    compression_counters.pages += param->compressed_pages;
+
+    param->outlen = 0;
+    param->zero_pages = 0;
+    param->compressed_pages = 0;
 }
 
-/**
- * ram_save_target_page: save one target page
- *
- * Returns the number of pages written
- *
- * @rs: current RAM state
- * @pss: data about the page we want to send
- * @last_stage: if we are at the completion stage
+/*
+ * Returns the index of a free compression thread, or -1 if there is
+ * none and !@wait.
+ * Called with comp_done_lock held.
  */
-static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
-                                bool last_stage)
+static int compress_thread_get(bool wait)
 {
-    RAMBlock *block = pss->block;
-    ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
-    int res;
+    int idx, thread_count = migrate_compress_threads();
 
-    if (control_save_page(rs, block, offset, &res)) {
-        return res;
+    while (true) {
+        for (idx = 0; idx < thread_count; idx++) {
+            if (comp_param[idx].done) {
+                return idx;
+            }
+        }
+        if (!wait) {
+            return -1;
+        }
+        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
     }
+}
 
-    if (save_compress_page(rs, block, offset)) {
-        return 1;
+/*
+ * Hand the queued pages over to the free compression thread @idx,
+ * after sending the records of its last batch.
+ * Called with comp_done_lock held.
+ */
+static void compress_batch_dispatch(RAMState *rs, int idx)
+{
+    CompressParam *param = &comp_param[idx];
+
+    param->done = false;
+    compress_send_output(rs, param);
+
+    qemu_mutex_lock(&param->mutex);
+    param->block = comp_batch.block;
+    memcpy(param->offsets, comp_batch.offsets,
+           comp_batch.count * sizeof(ram_addr_t));
+    param->count = comp_batch.count;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    trace_compress_batch_dispatch(idx, comp_batch.count);
+    comp_batch.count = 0;
+}
+
+static bool save_page_use_compression(RAMState *rs);
+
+static void flush_compressed_data(RAMState *rs)
+{
+    int idx, thread_count;
+
+    if (!save_page_use_compression(rs)) {
+        return;
     }
+    thread_count = migrate_compress_threads();
 
-    res = save_zero_page(rs, block, offset);
-    if (res > 0) {
-        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-         * page would be stale
-         */
-        if (!save_page_use_compression(rs)) {
-            XBZRLE_cache_lock();
-            xbzrle_cache_zero_page(rs, block->offset + offset);
-            XBZRLE_cache_unlock();
+    qemu_mutex_lock(&comp_done_lock);
+    if (comp_batch.count) {
+        compress_batch_dispatch(rs, compress_thread_get(true));
+    }
+    for (idx = 0; idx < thread_count; idx++) {
+        while (!comp_param[idx].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
         }
-        ram_release_pages(block->idstr, offset, res);
-        return res;
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    for (idx = 0; idx < thread_count; idx++) {
+        qemu_mutex_lock(&comp_param[idx].mutex);
+        if (!comp_param[idx].quit) {
+            /*
+             * it's safe to fetch the output without holding comp_done_lock
+             * as there is no further request submitted to the thread,
+             * i.e, the thread should be waiting for a request at this point.
+             */
+            compress_send_output(rs, &comp_param[idx]);
+        }
+        qemu_mutex_unlock(&comp_param[idx].mutex);
+    }
+}
+
+static int compress_page_with_multi_thread(RAMState *rs, RAMBlock *block,
+                                           ram_addr_t offset)
+{
+    int idx;
+
+    comp_batch.block = block;
+    comp_batch.offsets[comp_batch.count++] = offset;
+    if (comp_batch.count < COMPRESS_BATCH_PAGES) {
+        return 1;
     }
 
+    qemu_mutex_lock(&comp_done_lock);
     /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
+     * wait for the free thread if the user specifies 'compress-wait-thread',
+     * otherwise we will post the page out in the main thread as normal page.
      */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
-        return ram_save_multifd_page(rs, block, offset);
+    idx = compress_thread_get(migrate_compress_wait_thread());
+    if (idx >= 0) {
+        compress_batch_dispatch(rs, idx);
+    } else {
+        comp_batch.count--;
     }
+    qemu_mutex_unlock(&comp_done_lock);
 
-    return ram_save_page(rs, pss, last_stage);
+    return idx >= 0 ? 1 : -1;
 }
 
 /**
- * ram_save_host_page: save a whole host page
- *
- * Starting at *offset send pages up to the end of the current host
- * page. It's valid for the initial offset to point into the middle of
- * a host page in which case the remainder of the hostpage is sent.
- * Only dirty target pages are sent. Note that the host page size may
- * be a huge page for this block.
- * The saving stops at the boundary of the used_length of the block
- * if the RAMBlock isn't a multiple of the host page size.
+ * find_dirty_block: find the next dirty page and update any state
+ * associated with the search process.
  *
- * Returns the number of pages written or negative on error
+ * Returns true if a page is found
  *
  * @rs: current RAM state
- * @ms: current migration state
- * @pss: data about the page we want to send
- * @last_stage: if we are at the completion stage
+ * @pss: data about the state of the current dirty page scan
+ * @again: set to false if the search has scanned the whole of RAM
  */
-static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
-                              bool last_stage)
+static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
 {
-    int tmppages, pages = 0;
-    size_t pagesize_bits =
-        qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
-    unsigned long hostpage_boundary =
-        QEMU_ALIGN_UP(pss->page + 1, pagesize_bits);
-    unsigned long start_page = pss->page;
-    int res;
+    bool skip_hot = rs->skip_hot && !migration_in_postcopy();
 
-    if (ramblock_is_ignored(pss->block)) {
-        error_report("block %s should not be migrated !", pss->block->idstr);
-        return 0;
+    if (skip_hot) {
+        pss->page = ram_find_cold_dirty(rs, pss->block, pss->page);
+    } else {
+        pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
     }
-
-    do {
-        /* Check the pages is dirty and if it is send it */
-        if (migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
-            tmppages = ram_save_target_page(rs, pss, last_stage);
-            if (tmppages < 0) {
-                return tmppages;
-            }
-
-            pages += tmppages;
+    if (pss->complete_round && pss->block == rs->last_seen_block &&
+        pss->page >= rs->last_page) {
+        /*
+         * Only hot pages are left and they don't fit in the downtime:
+         * go around once more for them.
+         */
+        if (skip_hot &&
+            rs->hot_dirty_pages * TARGET_PAGE_SIZE > rs->switchover_threshold) {
+            rs->skip_hot = false;
+            pss->complete_round = false;
+            *again = true;
+            return false;
+        }
+        /*
+         * We've been once around the RAM and haven't found anything.
+         * Give up.
+         */
+        *again = false;
+        return false;
+    }
+    if (!offset_in_ramblock(pss->block,
+                            ((ram_addr_t)pss->page) << TARGET_PAGE_BITS)) {
+        /* Didn't find anything in this RAM Block */
+        pss->page = 0;
+        pss->block = QLIST_NEXT_RCU(pss->block, next);
+        if (!pss->block) {
             /*
-             * Allow rate limiting to happen in the middle of huge pages if
-             * something is sent in the current iteration.
+             * If memory migration starts over, we will meet a dirtied page
+             * which may still exists in compression threads's ring, so we
+             * should flush the compressed data to make sure the new page
+             * is not overwritten by the old one in the destination.
+             *
+             * Also If xbzrle is on, stop using the data compression at this
+             * point. In theory, xbzrle can do better than compression.
              */
-            if (pagesize_bits > 1 && tmppages > 0) {
-                migration_rate_limit();
+            flush_compressed_data(rs);
+
+            /* Hit the end of the list */
+            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
+            /* Flag that we've looped */
+            pss->complete_round = true;
+            /* After the first round, enable XBZRLE. */
+            if (migrate_use_xbzrle()) {
+                rs->xbzrle_enabled = true;
             }
         }
-        pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
-    } while ((pss->page < hostpage_boundary) &&
-             offset_in_ramblock(pss->block,
-                                ((ram_addr_t)pss->page) << TARGET_PAGE_BITS));
-    /* The offset we leave with is the min boundary of host page and block */
-    pss->page = MIN(pss->page, hostpage_boundary) - 1;
-
-    res = ram_save_release_protection(rs, pss, start_page);
-    return (res < 0 ? res : pages);
+        /* Didn't find anything this time, but try again on the new block */
+        *again = true;
+        return false;
+    } else {
+        /* Can go around again, but... */
+        *again = true;
+        /* We've found something so probably don't need to */
+        return true;
+    }
 }
 
 /**
- * ram_find_and_save_block: finds a dirty page and sends it to f
+ * migration_page_queue_take: take the new page requests
  *
- * Called within an RCU critical section.
+ * Move the requests pushed by ram_save_queue_pages() to the tail of
+ * src_page_requests, in the order they were queued.  A request that
+ * starts within or right after the last one in the queue, in the same
+ * RAMBlock, is merged into it.
  *
- * Returns the number of pages written where zero means no dirty pages,
- * or negative on error
+ * Only called by the migration thread.
  *
  * @rs: current RAM state
- * @last_stage: if we are at the completion stage
- *
- * On systems where host-page-size > target-page-size it will send all the
- * pages in a host page that are dirty.
  */
-
-static int ram_find_and_save_block(RAMState *rs, bool last_stage)
+static void migration_page_queue_take(RAMState *rs)
 {
-    PageSearchStatus pss;
-    int pages = 0;
-    bool again, found;
+    QSLIST_HEAD(, RAMSrcPageRequest) straight, reversed;
+    struct RAMSrcPageRequest *entry, *last;
 
-    /* No dirty page as there is zero RAM */
-    if (!ram_bytes_total()) {
-        return pages;
+    if (!qatomic_read(&rs->src_page_requests_new.slh_first)) {
+        return;
     }
 
-    pss.block = rs->last_seen_block;
-    pss.page = rs->last_page;
-    pss.complete_round = false;
+    QSLIST_MOVE_ATOMIC(&reversed, &rs->src_page_requests_new);
+    QSLIST_INIT(&straight);
 
-    if (!pss.block) {
-        pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
+    while (!QSLIST_EMPTY(&reversed)) {
+        entry = QSLIST_FIRST(&reversed);
+        QSLIST_REMOVE_HEAD(&reversed, next_new);
+        QSLIST_INSERT_HEAD(&straight, entry, next_new);
     }
 
-    do {
-        again = true;
-        found = get_queued_page(rs, &pss);
-
-        if (!found) {
-            /* priority queue empty, so just search for something dirty */
-            found = find_dirty_block(rs, &pss, &again);
-        }
+    while (!QSLIST_EMPTY(&straight)) {
+        entry = QSLIST_FIRST(&straight);
+        QSLIST_REMOVE_HEAD(&straight, next_new);
 
-        if (found) {
-            pages = ram_save_host_page(rs, &pss, last_stage);
+        last = QSIMPLEQ_LAST(&rs->src_page_requests, RAMSrcPageRequest,
+                             next_req);
+        if (last && last->rb == entry->rb &&
+            entry->offset >= last->offset &&
+            entry->offset <= last->offset + last->len) {
+            last->len = MAX(last->len,
+                            entry->offset + entry->len - last->offset);
+            trace_migration_page_queue_merge(entry->rb->idstr, entry->offset,
+                                             entry->len, last->offset,
+                                             last->len);
+            memory_region_unref(entry->rb->mr);
+            g_free(entry);
+            migration_consume_urgent_request();
+        } else {
+            QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, entry, next_req);
         }
-    } while (!pages && again);
-
-    rs->last_seen_block = pss.block;
-    rs->last_page = pss.page;
-
-    return pages;
+    }
 }
 
-void acct_update_position(QEMUFile *f, size_t size, bool zero)
+/**
+ * migration_page_queue_empty: check if there are page requests left
+ *
+ * Only called by the migration thread.
+ *
+ * @rs: current RAM state
+ */
+static bool migration_page_queue_empty(RAMState *rs)
 {
-    uint64_t pages = size / TARGET_PAGE_SIZE;
-
-    if (zero) {
-        ram_counters.duplicate += pages;
-    } else {
-        ram_counters.normal += pages;
-        ram_counters.transferred += size;
-        qemu_update_position(f, size);
-    }
+    return QSIMPLEQ_EMPTY(&rs->src_page_requests) &&
+           !qatomic_read(&rs->src_page_requests_new.slh_first);
 }
 
-static uint64_t ram_bytes_total_common(bool count_ignored)
+/**
+ * unqueue_page: gets a page of the queue
+ *
+ * Helper for 'get_queued_page' - gets a page off the queue
+ *
+ * Returns the block of the page (or NULL if none available)
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock
+ */
+static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
 {
+    struct RAMSrcPageRequest *entry;
     RAMBlock *block;
-    uint64_t total = 0;
 
-    RCU_READ_LOCK_GUARD();
+    migration_page_queue_take(rs);
+    if (QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
+        return NULL;
+    }
 
-    if (count_ignored) {
-        RAMBLOCK_FOREACH_MIGRATABLE(block) {
-            total += block->used_length;
-        }
+    entry = QSIMPLEQ_FIRST(&rs->src_page_requests);
+    block = entry->rb;
+    *offset = entry->offset;
+
+    if (entry->len > TARGET_PAGE_SIZE) {
+        entry->len -= TARGET_PAGE_SIZE;
+        entry->offset += TARGET_PAGE_SIZE;
     } else {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            total += block->used_length;
-        }
-    }
-    return total;
-}
+        uint64_t latency_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                              entry->time_us;
 
-uint64_t ram_bytes_total(void)
-{
-    return ram_bytes_total_common(false);
-}
+        migration_latency_record(&postcopy_queue_latency, latency_us);
+        trace_unqueue_page_latency(block->idstr, entry->offset, latency_us);
+        memory_region_unref(block->mr);
+        QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+        g_free(entry);
+        migration_consume_urgent_request();
+    }
 
-static void xbzrle_load_setup(void)
-{
-    XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    return block;
 }
 
-static void xbzrle_load_cleanup(void)
-{
-    g_free(XBZRLE.decoded_buf);
-    XBZRLE.decoded_buf = NULL;
-}
+/* Room for the pages that the guest wrote and that are not saved yet */
+#define RAM_WP_STAGING_SIZE (64 * MiB)
+/* UFFD write faults read at once */
+#define RAM_WP_FAULT_BATCH 16
 
-static void ram_state_cleanup(RAMState **rsp)
+/**
+ * ram_save_staged_page: save the oldest page copied by the write fault
+ *   thread of a background snapshot, if any
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ */
+static int ram_save_staged_page(RAMState *rs)
 {
-    if (*rsp) {
-        migration_page_queue_free(*rsp);
-        qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
-        qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
-        g_free(*rsp);
-        *rsp = NULL;
+    RAMStagedPage *sp;
+    unsigned long i, npages;
+    int pages = 0;
+
+    if (!rs->wp_staged) {
+        return 0;
     }
-}
 
-static void xbzrle_cleanup(void)
-{
-    XBZRLE_cache_lock();
-    if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
-        g_free(XBZRLE.zero_target_page);
-        XBZRLE.cache = NULL;
-        XBZRLE.encoded_buf = NULL;
-        XBZRLE.current_buf = NULL;
-        XBZRLE.zero_target_page = NULL;
+    WITH_QEMU_LOCK_GUARD(&rs->wp_lock) {
+        if (!rs->wp_count) {
+            return 0;
+        }
+        /* The slot is ours until it goes back to the ring */
+        sp = &rs->wp_staged[rs->wp_head];
     }
-    XBZRLE_cache_unlock();
+
+    npages = qemu_ram_pagesize(sp->block) >> TARGET_PAGE_BITS;
+    for (i = find_first_bit(sp->pages, npages); i < npages;
+         i = find_next_bit(sp->pages, npages, i + 1)) {
+        ram_addr_t offset = sp->offset + (i << TARGET_PAGE_BITS);
+        uint8_t *p = sp->data + (i << TARGET_PAGE_BITS);
+        int res;
+
+        if (migrate_fixed_ram()) {
+            res = save_fixed_ram_page(rs, sp->block, offset, p);
+        } else {
+            res = save_zero_page(rs, sp->block, offset, p);
+            if (res < 0) {
+                res = save_normal_page(rs, sp->block, offset, p, false);
+            }
+        }
+        if (res < 0) {
+            return res;
+        }
+        pages += res;
+    }
+    trace_ram_save_staged_page(sp->block->idstr, sp->offset, pages);
+
+    qemu_mutex_lock(&rs->wp_lock);
+    qatomic_sub(&rs->wp_staged_pages, bitmap_count_one(sp->pages, npages));
+    rs->wp_head = (rs->wp_head + 1) % rs->wp_nr_staged;
+    rs->wp_count--;
+    qemu_cond_signal(&rs->wp_cond);
+    qemu_mutex_unlock(&rs->wp_lock);
+
+    return pages;
 }
 
-static void ram_save_cleanup(void *opaque)
+#if defined(__linux__)
+/**
+ * ram_wp_stage_page: resolve a UFFD write fault of a background snapshot
+ *
+ * The host page is copied into the staging ring for the migration
+ * thread to save it, and unprotected right away so that the vCPU goes
+ * on without waiting for the page to be written out.  The page is only
+ * staged if the migration thread didn't take it first; when it took
+ * part of the host page, it unprotects the page once it is saved.
+ *
+ * @rs: current RAM state
+ * @host: faulting address
+ */
+static void ram_wp_stage_page(RAMState *rs, void *host)
 {
-    RAMState **rsp = opaque;
+    RAMStagedPage *sp;
     RAMBlock *block;
+    ram_addr_t offset;
+    unsigned long i, page, npages;
+    size_t pagesize;
+    bool unprotect = true;
 
-    /* We don't use dirty log with background snapshots */
-    if (!migrate_background_snapshot()) {
-        /* caller have hold iothread lock or is in a bh, so there is
-         * no writing race against the migration bitmap
-         */
-        memory_global_dirty_log_stop();
+    block = qemu_ram_block_from_host(host, false, &offset);
+    assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
+    pagesize = qemu_ram_pagesize(block);
+    offset = ROUND_DOWN(offset, pagesize);
+    page = offset >> TARGET_PAGE_BITS;
+    npages = pagesize >> TARGET_PAGE_BITS;
+
+    qemu_mutex_lock(&rs->wp_lock);
+    while (rs->wp_count == rs->wp_nr_staged && !rs->wp_quit) {
+        qemu_cond_wait(&rs->wp_cond, &rs->wp_lock);
+    }
+    if (rs->wp_quit) {
+        qemu_mutex_unlock(&rs->wp_lock);
+        return;
     }
 
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        g_free(block->clear_bmap);
-        block->clear_bmap = NULL;
-        g_free(block->bmap);
-        block->bmap = NULL;
+    sp = &rs->wp_staged[(rs->wp_head + rs->wp_count) % rs->wp_nr_staged];
+    sp->block = block;
+    sp->offset = offset;
+    bitmap_zero(sp->pages, npages);
+    /*
+     * The page can't change while it is protected, and it stays
+     * protected until it is not dirty anymore: copy it first.
+     */
+    memcpy(sp->data, block->host + offset, pagesize);
+    /* Counted before they stop being dirty, see ram_save_pending() */
+    qatomic_add(&rs->wp_staged_pages, npages);
+    smp_wmb();
+    for (i = 0; i < npages; i++) {
+        if (migration_bitmap_clear_dirty(rs, block, page + i)) {
+            set_bit(i, sp->pages);
+        } else {
+            unprotect = false;
+        }
     }
+    qatomic_sub(&rs->wp_staged_pages,
+                npages - bitmap_count_one(sp->pages, npages));
+    if (!bitmap_empty(sp->pages, npages)) {
+        rs->wp_count++;
+    }
+    qemu_mutex_unlock(&rs->wp_lock);
 
-    xbzrle_cleanup();
-    compress_threads_save_cleanup();
-    ram_state_cleanup(rsp);
+    trace_ram_wp_stage_page(block->idstr, offset, unprotect);
+    if (unprotect) {
+        uffd_change_protection(rs->uffdio_fd, block->host + offset, pagesize,
+                               false, false);
+    }
 }
 
-static void ram_state_reset(RAMState *rs)
+static void *ram_wp_fault_thread(void *opaque)
 {
-    rs->last_seen_block = NULL;
-    rs->last_sent_block = NULL;
-    rs->last_page = 0;
-    rs->last_version = ram_list.version;
-    rs->xbzrle_enabled = false;
-}
+    RAMState *rs = opaque;
+    struct uffd_msg msgs[RAM_WP_FAULT_BATCH];
+    struct pollfd pfd[2] = {
+        { .fd = rs->uffdio_fd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&rs->wp_quit_notifier),
+          .events = POLLIN },
+    };
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+    rcu_register_thread();
 
-/*
- * 'expected' is the value you expect the bitmap mostly to be full
- * of; it won't bother printing lines that are all this value.
- * If 'todump' is null the migration bitmap is dumped.
- */
-void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
-                           unsigned long pages)
-{
-    int64_t cur;
-    int64_t linelen = 128;
-    char linebuf[129];
+    while (!qatomic_read(&rs->wp_quit)) {
+        int i, n;
 
-    for (cur = 0; cur < pages; cur += linelen) {
-        int64_t curb;
-        bool found = false;
-        /*
-         * Last line; catch the case where the line length
-         * is longer than remaining ram
-         */
-        if (cur + linelen > pages) {
-            linelen = pages - cur;
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll: %s", __func__, strerror(errno));
+            break;
         }
-        for (curb = 0; curb < linelen; curb++) {
-            bool thisbit = test_bit(cur + curb, todump);
-            linebuf[curb] = thisbit ? '1' : '.';
-            found = found || (thisbit != expected);
+        if (pfd[1].revents) {
+            break;
         }
-        if (found) {
-            linebuf[curb] = '\0';
-            fprintf(stderr,  "0x%08" PRIx64 " : %s\n", cur, linebuf);
+
+        n = uffd_read_events(rs->uffdio_fd, msgs, RAM_WP_FAULT_BATCH);
+        if (n < 0) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            for (i = 0; i < n; i++) {
+                ram_wp_stage_page(rs, (void *)(uintptr_t)
+                                  msgs[i].arg.pagefault.address);
+            }
         }
     }
-}
 
-/* **** functions for postcopy ***** */
+    rcu_unregister_thread();
+    return NULL;
+}
 
-void ram_postcopy_migrated_memory_release(MigrationState *ms)
+/* Start resolving the write faults of 'write-tracking' in wp_thread */
+static void ram_wp_fault_thread_start(RAMState *rs)
 {
-    struct RAMBlock *block;
-
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        unsigned long *bitmap = block->bmap;
-        unsigned long range = block->used_length >> TARGET_PAGE_BITS;
-        unsigned long run_start = find_next_zero_bit(bitmap, range, 0);
+    size_t pagesize = qemu_ram_pagesize_largest();
+    unsigned int i;
 
-        while (run_start < range) {
-            unsigned long run_end = find_next_bit(bitmap, range, run_start + 1);
-            ram_discard_range(block->idstr,
-                              ((ram_addr_t)run_start) << TARGET_PAGE_BITS,
-                              ((ram_addr_t)(run_end - run_start))
-                                << TARGET_PAGE_BITS);
-            run_start = find_next_zero_bit(bitmap, range, run_end + 1);
-        }
+    rs->wp_nr_staged = MAX(RAM_WP_STAGING_SIZE / pagesize, 1);
+    rs->wp_staged = g_new0(RAMStagedPage, rs->wp_nr_staged);
+    for (i = 0; i < rs->wp_nr_staged; i++) {
+        rs->wp_staged[i].pages = bitmap_new(pagesize >> TARGET_PAGE_BITS);
+        rs->wp_staged[i].data = qemu_memalign(qemu_real_host_page_size,
+                                              pagesize);
     }
+    rs->wp_head = 0;
+    rs->wp_count = 0;
+    rs->wp_staged_pages = 0;
+    rs->wp_quit = false;
+    qemu_mutex_init(&rs->wp_lock);
+    qemu_cond_init(&rs->wp_cond);
+    event_notifier_init(&rs->wp_quit_notifier, false);
+
+    thread_context_create_thread(THREAD_GROUP_MIGRATION, &rs->wp_thread,
+                                 "bg-snapshot/wp", ram_wp_fault_thread, rs);
 }
 
-/**
- * postcopy_send_discard_bm_ram: discard a RAMBlock
- *
- * Returns zero on success
- *
- * Callback from postcopy_each_ram_send_discard for each RAMBlock
- *
- * @ms: current migration state
- * @block: RAMBlock to discard
- */
-static int postcopy_send_discard_bm_ram(MigrationState *ms, RAMBlock *block)
+static void ram_wp_fault_thread_stop(RAMState *rs)
 {
-    unsigned long end = block->used_length >> TARGET_PAGE_BITS;
-    unsigned long current;
-    unsigned long *bitmap = block->bmap;
+    unsigned int i;
 
-    for (current = 0; current < end; ) {
-        unsigned long one = find_next_bit(bitmap, end, current);
-        unsigned long zero, discard_length;
-
-        if (one >= end) {
-            break;
-        }
+    if (!rs->wp_staged) {
+        return;
+    }
 
-        zero = find_next_zero_bit(bitmap, end, one + 1);
+    qemu_mutex_lock(&rs->wp_lock);
+    qatomic_set(&rs->wp_quit, true);
+    qemu_cond_signal(&rs->wp_cond);
+    qemu_mutex_unlock(&rs->wp_lock);
+    event_notifier_set(&rs->wp_quit_notifier);
+    qemu_thread_join(&rs->wp_thread);
 
-        if (zero >= end) {
-            discard_length = end - one;
-        } else {
-            discard_length = zero - one;
-        }
-        postcopy_discard_send_range(ms, one, discard_length);
-        current = one + discard_length;
+    event_notifier_cleanup(&rs->wp_quit_notifier);
+    qemu_cond_destroy(&rs->wp_cond);
+    qemu_mutex_destroy(&rs->wp_lock);
+    for (i = 0; i < rs->wp_nr_staged; i++) {
+        g_free(rs->wp_staged[i].pages);
+        qemu_vfree(rs->wp_staged[i].data);
     }
-
-    return 0;
+    g_free(rs->wp_staged);
+    rs->wp_staged = NULL;
 }
 
 /**
- * postcopy_each_ram_send_discard: discard all RAMBlocks
- *
- * Returns 0 for success or negative for error
+ * ram_save_release_protection: release UFFD write protection after
+ *   a range of pages has been saved
  *
- * Utility for the outgoing postcopy code.
- *   Calls postcopy_send_discard_bm_ram for each RAMBlock
- *   passing it bitmap indexes and name.
- * (qemu_ram_foreach_block ends up passing unscaled lengths
- *  which would mean postcopy code would have to deal with target page)
+ * @rs: current RAM state
+ * @pss: page-search-status structure
+ * @start_page: index of the first page in the range relative to pss->block
  *
- * @ms: current migration state
- */
-static int postcopy_each_ram_send_discard(MigrationState *ms)
+ * Returns 0 on success, negative value in case of an error
+*/
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+        unsigned long start_page)
 {
-    struct RAMBlock *block;
-    int ret;
+    int res = 0;
 
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        postcopy_discard_send_init(ms, block->idstr);
+    /* Check if page is from UFFD-managed region. */
+    if (pss->block->flags & RAM_UF_WRITEPROTECT) {
+        void *page_address = pss->block->host + (start_page << TARGET_PAGE_BITS);
+        uint64_t run_length = (pss->page - start_page + 1) << TARGET_PAGE_BITS;
 
-        /*
-         * Postcopy sends chunks of bitmap over the wire, but it
-         * just needs indexes at this point, avoids it having
-         * target page specific code.
-         */
-        ret = postcopy_send_discard_bm_ram(ms, block);
-        postcopy_discard_send_finish(ms);
-        if (ret) {
-            return ret;
-        }
+        /* Flush async buffers before un-protect. */
+        qemu_fflush(rs->f);
+        /* Un-protect memory range. */
+        res = uffd_change_protection(rs->uffdio_fd, page_address, run_length,
+                false, false);
     }
 
-    return 0;
+    return res;
 }
 
-/**
- * postcopy_chunk_hostpages_pass: canonicalize bitmap in hostpages
- *
- * Helper for postcopy_chunk_hostpages; it's called twice to
- * canonicalize the two bitmaps, that are similar, but one is
- * inverted.
- *
- * Postcopy requires that all target pages in a hostpage are dirty or
- * clean, not a mix.  This function canonicalizes the bitmaps.
+/* ram_write_tracking_available: check if kernel supports required UFFD features
  *
- * @ms: current migration state
- * @block: block that contains the page we want to canonicalize
+ * Returns true if supports, false otherwise
  */
-static void postcopy_chunk_hostpages_pass(MigrationState *ms, RAMBlock *block)
+bool ram_write_tracking_available(void)
 {
-    RAMState *rs = ram_state;
-    unsigned long *bitmap = block->bmap;
-    unsigned int host_ratio = block->page_size / TARGET_PAGE_SIZE;
-    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
-    unsigned long run_start;
+    uint64_t uffd_features;
+    int res;
 
-    if (block->page_size == TARGET_PAGE_SIZE) {
-        /* Easy case - TPS==HPS for a non-huge page RAMBlock */
-        return;
-    }
+    res = uffd_query_features(&uffd_features);
+    return (res == 0 &&
+            (uffd_features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) != 0);
+}
 
-    /* Find a dirty page */
-    run_start = find_next_bit(bitmap, pages, 0);
+/* ram_write_tracking_compatible: check if guest configuration is
+ *   compatible with 'write-tracking'
+ *
+ * Returns true if compatible, false otherwise
+ */
+bool ram_write_tracking_compatible(void)
+{
+    const uint64_t uffd_ioctls_mask = BIT(_UFFDIO_WRITEPROTECT);
+    int uffd_fd;
+    RAMBlock *block;
+    bool ret = false;
 
-    while (run_start < pages) {
+    /* Open UFFD file descriptor */
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false);
+    if (uffd_fd < 0) {
+        return false;
+    }
 
-        /*
-         * If the start of this run of pages is in the middle of a host
-         * page, then we need to fixup this host page.
-         */
-        if (QEMU_IS_ALIGNED(run_start, host_ratio)) {
-            /* Find the end of this run */
-            run_start = find_next_zero_bit(bitmap, pages, run_start + 1);
-            /*
-             * If the end isn't at the start of a host page, then the
-             * run doesn't finish at the end of a host page
-             * and we need to discard.
-             */
-        }
+    RCU_READ_LOCK_GUARD();
 
-        if (!QEMU_IS_ALIGNED(run_start, host_ratio)) {
-            unsigned long page;
-            unsigned long fixup_start_addr = QEMU_ALIGN_DOWN(run_start,
-                                                             host_ratio);
-            run_start = QEMU_ALIGN_UP(run_start, host_ratio);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t uffd_ioctls;
 
-            /* Clean up the bitmap */
-            for (page = fixup_start_addr;
-                 page < fixup_start_addr + host_ratio; page++) {
-                /*
-                 * Remark them as dirty, updating the count for any pages
-                 * that weren't previously dirty.
-                 */
-                rs->migration_dirty_pages += !test_and_set_bit(page, bitmap);
-            }
+        /* Nothing to do with read-only and MMIO-writable regions */
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
+        }
+        /* Try to register block memory via UFFD-IO to track writes */
+        if (uffd_register_memory(uffd_fd, block->host, block->max_length,
+                UFFDIO_REGISTER_MODE_WP, &uffd_ioctls)) {
+            goto out;
+        }
+        if ((uffd_ioctls & uffd_ioctls_mask) != uffd_ioctls_mask) {
+            goto out;
         }
-
-        /* Find the next dirty page for the next iteration */
-        run_start = find_next_bit(bitmap, pages, run_start);
     }
+    ret = true;
+
+out:
+    uffd_close_fd(uffd_fd);
+    return ret;
 }
 
-/**
- * postcopy_chunk_hostpages: discard any partially sent host page
- *
- * Utility for the outgoing postcopy code.
- *
- * Discard any partially sent host-page size chunks, mark any partially
- * dirty host-page size chunks as all dirty.  In this case the host-page
- * is the host-page for the particular RAMBlock, i.e. it might be a huge page
+/*
+ * ram_block_populate_pages: populate memory in the RAM block by reading
+ *   an integer from the beginning of each page.
  *
- * Returns zero on success
+ * Since it's solely used for userfault_fd WP feature, here we just
+ *   hardcode page size to qemu_real_host_page_size.
  *
- * @ms: current migration state
- * @block: block we want to work with
+ * @block: RAM block to populate
  */
-static int postcopy_chunk_hostpages(MigrationState *ms, RAMBlock *block)
+static void ram_block_populate_pages(RAMBlock *block)
 {
-    postcopy_discard_send_init(ms, block->idstr);
+    char *ptr = (char *) block->host;
 
-    /*
-     * Ensure that all partially dirty host pages are made fully dirty.
-     */
-    postcopy_chunk_hostpages_pass(ms, block);
+    for (ram_addr_t offset = 0; offset < block->used_length;
+            offset += qemu_real_host_page_size) {
+        char tmp = *(ptr + offset);
 
-    postcopy_discard_send_finish(ms);
-    return 0;
+        /* Don't optimize the read out */
+        asm volatile("" : "+r" (tmp));
+    }
 }
 
-/**
- * ram_postcopy_send_discard_bitmap: transmit the discard bitmap
- *
- * Returns zero on success
- *
- * Transmit the set of pages to be discarded after precopy to the target
- * these are pages that:
- *     a) Have been previously transmitted but are now dirty again
- *     b) Pages that have never been transmitted, this ensures that
- *        any pages on the destination that have been mapped by background
- *        tasks get discarded (transparent huge pages is the specific concern)
- * Hopefully this is pretty sparse
- *
- * @ms: current migration state
+/*
+ * ram_write_tracking_prepare: prepare for UFFD-WP memory tracking
  */
-int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+void ram_write_tracking_prepare(void)
 {
-    RAMState *rs = ram_state;
     RAMBlock *block;
-    int ret;
 
     RCU_READ_LOCK_GUARD();
 
-    /* This should be our last sync, the src is now paused */
-    migration_bitmap_sync(rs);
-
-    /* Easiest way to make sure we don't resume in the middle of a host-page */
-    rs->last_seen_block = NULL;
-    rs->last_sent_block = NULL;
-    rs->last_page = 0;
-
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        /* Deal with TPS != HPS and huge pages */
-        ret = postcopy_chunk_hostpages(ms, block);
-        if (ret) {
-            return ret;
+        /* Nothing to do with read-only and MMIO-writable regions */
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
         }
 
-#ifdef DEBUG_POSTCOPY
-        ram_debug_dump_bitmap(block->bmap, true,
-                              block->used_length >> TARGET_PAGE_BITS);
-#endif
+        /*
+         * Populate pages of the RAM block before enabling userfault_fd
+         * write protection.
+         *
+         * This stage is required since ioctl(UFFDIO_WRITEPROTECT) with
+         * UFFDIO_WRITEPROTECT_MODE_WP mode setting would silently skip
+         * pages with pte_none() entries in page table.
+         */
+        ram_block_populate_pages(block);
     }
-    trace_ram_postcopy_send_discard_bitmap();
-
-    return postcopy_each_ram_send_discard(ms);
 }
 
-/**
- * ram_discard_range: discard dirtied pages at the beginning of postcopy
- *
- * Returns zero on success
+/*
+ * ram_write_tracking_start: start UFFD-WP memory tracking
  *
- * @rbname: name of the RAMBlock of the request. NULL means the
- *          same that last one.
- * @start: RAMBlock starting page
- * @length: RAMBlock size
+ * Returns 0 for success or negative value in case of error
  */
-int ram_discard_range(const char *rbname, uint64_t start, size_t length)
+int ram_write_tracking_start(void)
 {
-    trace_ram_discard_range(rbname, start, length);
+    int uffd_fd;
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    /* Open UFFD file descriptor */
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
+    if (uffd_fd < 0) {
+        return uffd_fd;
+    }
+    rs->uffdio_fd = uffd_fd;
 
     RCU_READ_LOCK_GUARD();
-    RAMBlock *rb = qemu_ram_block_by_name(rbname);
 
-    if (!rb) {
-        error_report("ram_discard_range: Failed to find block '%s'", rbname);
-        return -1;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        /* Nothing to do with read-only and MMIO-writable regions */
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
+        }
+
+        /* Register block memory with UFFD to track writes */
+        if (uffd_register_memory(rs->uffdio_fd, block->host,
+                block->max_length, UFFDIO_REGISTER_MODE_WP, NULL)) {
+            goto fail;
+        }
+        /* Apply UFFD write protection to the block memory range */
+        if (uffd_change_protection(rs->uffdio_fd, block->host,
+                block->max_length, true, false)) {
+            goto fail;
+        }
+        block->flags |= RAM_UF_WRITEPROTECT;
+        memory_region_ref(block->mr);
+
+        trace_ram_write_tracking_ramblock_start(block->idstr, block->page_size,
+                block->host, block->max_length);
     }
 
-    /*
-     * On source VM, we don't need to update the received bitmap since
-     * we don't even have one.
-     */
-    if (rb->receivedmap) {
-        bitmap_clear(rb->receivedmap, start >> qemu_target_page_bits(),
-                     length >> qemu_target_page_bits());
+    ram_wp_fault_thread_start(rs);
+    return 0;
+
+fail:
+    error_report("ram_write_tracking_start() failed: restoring initial memory state");
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
+            continue;
+        }
+        /*
+         * In case some memory block failed to be write-protected
+         * remove protection and unregister all succeeded RAM blocks
+         */
+        uffd_change_protection(rs->uffdio_fd, block->host, block->max_length,
+                false, false);
+        uffd_unregister_memory(rs->uffdio_fd, block->host, block->max_length);
+        /* Cleanup flags and remove reference */
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
     }
 
-    return ram_block_discard_range(rb, start, length);
+    uffd_close_fd(uffd_fd);
+    rs->uffdio_fd = -1;
+    return -1;
 }
 
-/*
- * For every allocation, we will try not to crash the VM if the
- * allocation failed.
+/**
+ * ram_write_tracking_stop: stop UFFD-WP memory tracking and remove protection
  */
-static int xbzrle_init(void)
+void ram_write_tracking_stop(void)
 {
-    Error *local_err = NULL;
-
-    if (!migrate_use_xbzrle()) {
-        return 0;
-    }
+    RAMState *rs = ram_state;
+    RAMBlock *block;
 
-    XBZRLE_cache_lock();
+    /* Once the thread is gone, the waiting vCPUs are woken up below */
+    ram_wp_fault_thread_stop(rs);
 
-    XBZRLE.zero_target_page = g_try_malloc0(TARGET_PAGE_SIZE);
-    if (!XBZRLE.zero_target_page) {
-        error_report("%s: Error allocating zero page", __func__);
-        goto err_out;
-    }
+    RCU_READ_LOCK_GUARD();
 
-    XBZRLE.cache = cache_init(migrate_xbzrle_cache_size(),
-                              TARGET_PAGE_SIZE, &local_err);
-    if (!XBZRLE.cache) {
-        error_report_err(local_err);
-        goto free_zero_page;
-    }
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
+            continue;
+        }
+        /* Remove protection and unregister all affected RAM blocks */
+        uffd_change_protection(rs->uffdio_fd, block->host, block->max_length,
+                false, false);
+        uffd_unregister_memory(rs->uffdio_fd, block->host, block->max_length);
 
-    XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
-    if (!XBZRLE.encoded_buf) {
-        error_report("%s: Error allocating encoded_buf", __func__);
-        goto free_cache;
-    }
+        trace_ram_write_tracking_ramblock_stop(block->idstr, block->page_size,
+                block->host, block->max_length);
 
-    XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
-    if (!XBZRLE.current_buf) {
-        error_report("%s: Error allocating current_buf", __func__);
-        goto free_encoded_buf;
+        /* Cleanup flags and remove reference */
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
     }
 
-    /* We are all good */
-    XBZRLE_cache_unlock();
-    return 0;
-
-free_encoded_buf:
-    g_free(XBZRLE.encoded_buf);
-    XBZRLE.encoded_buf = NULL;
-free_cache:
-    cache_fini(XBZRLE.cache);
-    XBZRLE.cache = NULL;
-free_zero_page:
-    g_free(XBZRLE.zero_target_page);
-    XBZRLE.zero_target_page = NULL;
-err_out:
-    XBZRLE_cache_unlock();
-    return -ENOMEM;
+    /* Finally close UFFD file descriptor */
+    uffd_close_fd(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
 }
 
-static int ram_state_init(RAMState **rsp)
-{
-    *rsp = g_try_new0(RAMState, 1);
-
-    if (!*rsp) {
-        error_report("%s: Init ramstate fail", __func__);
-        return -1;
-    }
-
-    qemu_mutex_init(&(*rsp)->bitmap_mutex);
-    qemu_mutex_init(&(*rsp)->src_page_req_mutex);
-    QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+#else
+/* No target OS support, stubs just fail or ignore */
 
-    /*
-     * Count the total number of pages used by ram blocks not including any
-     * gaps due to alignment or unplugs.
-     * This must match with the initial values of dirty bitmap.
-     */
-    (*rsp)->migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
-    ram_state_reset(*rsp);
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+        unsigned long start_page)
+{
+    (void) rs;
+    (void) pss;
+    (void) start_page;
 
     return 0;
 }
 
-static void ram_list_init_bitmaps(void)
+bool ram_write_tracking_available(void)
 {
-    MigrationState *ms = migrate_get_current();
-    RAMBlock *block;
-    unsigned long pages;
-    uint8_t shift;
-
-    /* Skip setting bitmap if there is no RAM */
-    if (ram_bytes_total()) {
-        shift = ms->clear_bitmap_shift;
-        if (shift > CLEAR_BITMAP_SHIFT_MAX) {
-            error_report("clear_bitmap_shift (%u) too big, using "
-                         "max value (%u)", shift, CLEAR_BITMAP_SHIFT_MAX);
-            shift = CLEAR_BITMAP_SHIFT_MAX;
-        } else if (shift < CLEAR_BITMAP_SHIFT_MIN) {
-            error_report("clear_bitmap_shift (%u) too small, using "
-                         "min value (%u)", shift, CLEAR_BITMAP_SHIFT_MIN);
-            shift = CLEAR_BITMAP_SHIFT_MIN;
-        }
-
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            pages = block->max_length >> TARGET_PAGE_BITS;
-            /*
-             * The initial dirty bitmap for migration must be set with all
-             * ones to make sure we'll migrate every guest RAM page to
-             * destination.
-             * Here we set RAMBlock.bmap all to 1 because when rebegin a
-             * new migration after a failed migration, ram_list.
-             * dirty_memory[DIRTY_MEMORY_MIGRATION] don't include the whole
-             * guest memory.
-             */
-            block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
-            block->clear_bmap_shift = shift;
-            block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
-        }
-    }
+    return false;
 }
 
-static void ram_init_bitmaps(RAMState *rs)
+bool ram_write_tracking_compatible(void)
 {
-    /* For memory_global_dirty_log_start below.  */
-    qemu_mutex_lock_iothread();
-    qemu_mutex_lock_ramlist();
-
-    WITH_RCU_READ_LOCK_GUARD() {
-        ram_list_init_bitmaps();
-        /* We don't use dirty log with background snapshots */
-        if (!migrate_background_snapshot()) {
-            memory_global_dirty_log_start();
-            migration_bitmap_sync_precopy(rs);
-        }
-    }
-    qemu_mutex_unlock_ramlist();
-    qemu_mutex_unlock_iothread();
+    assert(0);
+    return false;
 }
 
-static int ram_init_all(RAMState **rsp)
+int ram_write_tracking_start(void)
 {
-    if (ram_state_init(rsp)) {
-        return -1;
-    }
-
-    if (xbzrle_init()) {
-        ram_state_cleanup(rsp);
-        return -1;
-    }
-
-    ram_init_bitmaps(*rsp);
-
-    return 0;
+    assert(0);
+    return -1;
 }
 
-static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
+void ram_write_tracking_stop(void)
 {
-    RAMBlock *block;
-    uint64_t pages = 0;
-
-    /*
-     * Postcopy is not using xbzrle/compression, so no need for that.
-     * Also, since source are already halted, we don't need to care
-     * about dirty page logging as well.
-     */
-
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        pages += bitmap_count_one(block->bmap,
-                                  block->used_length >> TARGET_PAGE_BITS);
-    }
-
-    /* This may not be aligned with current bitmaps. Recalculate. */
-    rs->migration_dirty_pages = pages;
-
-    ram_state_reset(rs);
-
-    /* Update RAMState cache of output QEMUFile */
-    rs->f = out;
-
-    trace_ram_state_resume_prepare(pages);
+    assert(0);
 }
+#endif /* defined(__linux__) */
 
-/*
- * This function clears bits of the free pages reported by the caller from the
- * migration dirty bitmap. @addr is the host address corresponding to the
- * start of the continuous guest free pages, and @len is the total bytes of
- * those pages.
+/**
+ * postcopy_prefetch_start: open a prefetch window after a requested page
+ *
+ * Pick the host pages that get sent right after the one the destination
+ * asked for.  A page request that lands within a window of the last one
+ * carries on the sequential access that the window did not cover, in
+ * the same direction.  Further away, the same distance between the last
+ * three requests is taken as a stride.  Anything else falls back to the
+ * pages that follow.
+ *
+ * @rs: current RAM state
+ * @block: RAMBlock of the requested page
+ * @page: requested target page within @block
  */
-void qemu_guest_free_page_hint(void *addr, size_t len)
+static void postcopy_prefetch_start(RAMState *rs, RAMBlock *block,
+                                    unsigned long page)
 {
-    RAMBlock *block;
-    ram_addr_t offset;
-    size_t used_len, start, npages;
-    MigrationState *s = migrate_get_current();
+    long window = migrate_postcopy_prefetch_window();
+    long hpage = page / (qemu_ram_pagesize(block) >> TARGET_PAGE_BITS);
+    long delta = 0;
 
-    /* This function is currently expected to be used during live migration */
-    if (!migration_is_setup_or_active(s->state)) {
+    if (!window || !migration_in_postcopy()) {
+        rs->prefetch_block = NULL;
         return;
     }
 
-    for (; len > 0; len -= used_len, addr += used_len) {
-        block = qemu_ram_block_from_host(addr, false, &offset);
-        if (unlikely(!block || offset >= block->used_length)) {
-            /*
-             * The implementation might not support RAMBlock resize during
-             * live migration, but it could happen in theory with future
-             * updates. So we add a check here to capture that case.
-             */
-            error_report_once("%s unexpected error", __func__);
-            return;
-        }
-
-        if (len <= block->used_length - offset) {
-            used_len = len;
-        } else {
-            used_len = block->used_length - offset;
+    rs->prefetch_stride = 1;
+    if (block == rs->prefetch_block) {
+        delta = hpage - rs->prefetch_last_hpage;
+        if (delta && labs(delta) <= window + 1) {
+            rs->prefetch_stride = delta > 0 ? 1 : -1;
+        } else if (delta && delta == rs->prefetch_last_delta) {
+            rs->prefetch_stride = delta;
         }
-
-        start = offset >> TARGET_PAGE_BITS;
-        npages = used_len >> TARGET_PAGE_BITS;
-
-        qemu_mutex_lock(&ram_state->bitmap_mutex);
-        ram_state->migration_dirty_pages -=
-                      bitmap_count_one_with_offset(block->bmap, start, npages);
-        bitmap_clear(block->bmap, start, npages);
-        qemu_mutex_unlock(&ram_state->bitmap_mutex);
     }
-}
 
-/*
- * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
- * long-running RCU critical section.  When rcu-reclaims in the code
- * start to become numerous it will be necessary to reduce the
- * granularity of these critical sections.
- */
+    rs->prefetch_block = block;
+    rs->prefetch_last_hpage = hpage;
+    rs->prefetch_last_delta = delta;
+    rs->prefetch_next = 1;
+    trace_postcopy_prefetch_start(block->idstr, hpage, rs->prefetch_stride);
+}
 
 /**
- * ram_save_setup: Setup RAM for migration
+ * postcopy_prefetch_page: get the next dirty page of the prefetch window
  *
- * Returns zero to indicate success and negative for error
+ * Returns the block of the page (or NULL if none is left in the window)
  *
- * @f: QEMUFile where to send the data
- * @opaque: RAMState pointer
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock
  */
-static int ram_save_setup(QEMUFile *f, void *opaque)
+static RAMBlock *postcopy_prefetch_page(RAMState *rs, ram_addr_t *offset)
 {
-    RAMState **rsp = opaque;
-    RAMBlock *block;
+    RAMBlock *block = rs->prefetch_block;
+    unsigned int window = migrate_postcopy_prefetch_window();
+    size_t pagesize_bits;
+    unsigned long nr_pages;
 
-    if (compress_threads_save_setup()) {
-        return -1;
+    if (!block || rs->prefetch_next > window) {
+        return NULL;
     }
 
-    /* migration has already setup the bitmap, reuse it. */
-    if (!migration_in_colo_state()) {
-        if (ram_init_all(rsp) != 0) {
-            compress_threads_save_cleanup();
-            return -1;
-        }
-    }
-    (*rsp)->f = f;
+    pagesize_bits = qemu_ram_pagesize(block) >> TARGET_PAGE_BITS;
+    nr_pages = block->used_length >> TARGET_PAGE_BITS;
 
-    WITH_RCU_READ_LOCK_GUARD() {
-        qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
+    while (rs->prefetch_next <= window) {
+        long hpage = rs->prefetch_last_hpage +
+                     rs->prefetch_stride * (long)rs->prefetch_next++;
+        unsigned long start, end;
 
-        RAMBLOCK_FOREACH_MIGRATABLE(block) {
-            qemu_put_byte(f, strlen(block->idstr));
-            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-            qemu_put_be64(f, block->used_length);
-            if (migrate_postcopy_ram() && block->page_size !=
-                                          qemu_host_page_size) {
-                qemu_put_be64(f, block->page_size);
-            }
-            if (migrate_ignore_shared()) {
-                qemu_put_be64(f, block->mr->addr);
-            }
+        if (hpage < 0 || hpage * pagesize_bits >= nr_pages) {
+            break;
         }
-    }
-
-    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
-    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
-    multifd_send_sync_main(f);
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-    qemu_fflush(f);
+        start = hpage * pagesize_bits;
+        end = MIN(start + pagesize_bits, nr_pages);
+        start = find_next_bit(block->bmap, end, start);
+        if (start < end) {
+            *offset = (ram_addr_t)start << TARGET_PAGE_BITS;
+            trace_postcopy_prefetch_page(block->idstr, hpage);
+            return block;
+        }
+    }
 
-    return 0;
+    rs->prefetch_next = window + 1;
+    return NULL;
 }
 
 /**
- * ram_save_iterate: iterative stage for migration
+ * get_queued_page: unqueue a page from the postcopy requests
  *
- * Returns zero to indicate success and negative for error
+ * Skips pages that are already sent (!dirty)
  *
- * @f: QEMUFile where to send the data
- * @opaque: RAMState pointer
+ * Returns true if a queued page is found
+ *
+ * @rs: current RAM state
+ * @pss: data about the state of the current dirty page scan
  */
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 {
-    RAMState **temp = opaque;
-    RAMState *rs = *temp;
-    int ret = 0;
-    int i;
-    int64_t t0;
-    int done = 0;
+    RAMBlock  *block;
+    ram_addr_t offset;
+    bool dirty;
+
+    do {
+        block = unqueue_page(rs, &offset);
+        /*
+         * We're sending this page, and since it's postcopy nothing else
+         * will dirty it, and we must make sure it doesn't get sent again
+         * even if this queue request was received after the background
+         * search already sent it.
+         */
+        if (block) {
+            unsigned long page;
+
+            page = offset >> TARGET_PAGE_BITS;
+            dirty = test_bit(page, block->bmap);
+            if (!dirty) {
+                trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
+                                                page);
+            } else {
+                trace_get_queued_page(block->idstr, (uint64_t)offset, page);
+            }
+        }
+
+    } while (block && !dirty);
+
+    if (block) {
+        postcopy_prefetch_start(rs, block, offset >> TARGET_PAGE_BITS);
+    } else {
+        block = postcopy_prefetch_page(rs, &offset);
+    }
+
+    pss->postcopy_requested = !!block;
+
+    if (block) {
+        /*
+         * We want the background search to continue from the queued page
+         * since the guest is likely to want other pages near to the page
+         * it just requested.
+         */
+        pss->block = block;
+        pss->page = offset >> TARGET_PAGE_BITS;
+
+        /*
+         * This unqueued page would break the "one round" check, even is
+         * really rare.
+         */
+        pss->complete_round = false;
+    }
+
+    return !!block;
+}
+
+/**
+ * migration_page_queue_free: drop any remaining pages in the ram
+ * request queue
+ *
+ * It should be empty at the end anyway, but in error cases there may
+ * be some left.  in case that there is any page left, we drop it.
+ *
+ */
+static void migration_page_queue_free(RAMState *rs)
+{
+    struct RAMSrcPageRequest *mspr, *next_mspr;
+    /* This queue generally should be empty - but in the case of a failed
+     * migration might have some droppings in.
+     */
+    RCU_READ_LOCK_GUARD();
+    migration_page_queue_take(rs);
+    QSIMPLEQ_FOREACH_SAFE(mspr, &rs->src_page_requests, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+        g_free(mspr);
+    }
+}
+
+/**
+ * ram_save_queue_pages: queue the page for transmission
+ *
+ * A request from postcopy destination for example.
+ *
+ * Returns zero on success or negative on error
+ *
+ * @rbname: Name of the RAMBLock of the request. NULL means the
+ *          same that last one.
+ * @start: starting address from the start of the RAMBlock
+ * @len: length (in bytes) to send
+ */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+{
+    RAMBlock *ramblock;
+    RAMState *rs = ram_state;
+
+    stat64_add(&ram_atomic_counters.postcopy_requests, 1);
+    RCU_READ_LOCK_GUARD();
+
+    if (!rbname) {
+        /* Reuse last RAMBlock */
+        ramblock = rs->last_req_rb;
+
+        if (!ramblock) {
+            /*
+             * Shouldn't happen, we can't reuse the last RAMBlock if
+             * it's the 1st request.
+             */
+            error_report("ram_save_queue_pages no previous block");
+            return -1;
+        }
+    } else {
+        ramblock = qemu_ram_block_by_name(rbname);
+
+        if (!ramblock) {
+            /* We shouldn't be asked for a non-existent RAMBlock */
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            return -1;
+        }
+        rs->last_req_rb = ramblock;
+    }
+    trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (!offset_in_ramblock(ramblock, start + len - 1)) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        return -1;
+    }
+
+    struct RAMSrcPageRequest *new_entry =
+        g_malloc0(sizeof(struct RAMSrcPageRequest));
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+    new_entry->time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    memory_region_ref(ramblock->mr);
+    /*
+     * Post the urgent request first, so that the migration thread never
+     * waits for it once it has seen the entry.
+     */
+    migration_make_urgent_request();
+    QSLIST_INSERT_HEAD_ATOMIC(&rs->src_page_requests_new, new_entry, next_new);
+
+    return 0;
+}
+
+static bool save_page_use_compression(RAMState *rs)
+{
+    if (!migrate_use_compression()) {
+        return false;
+    }
+
+    /*
+     * If xbzrle is enabled (e.g., after first round of migration), stop
+     * using the data compression. In theory, xbzrle can do better than
+     * compression.
+     */
+    if (rs->xbzrle_enabled) {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * try to compress the page before posting it out, return true if the page
+ * has been properly handled by compression, otherwise needs other
+ * paths to handle it
+ */
+static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+{
+    if (!save_page_use_compression(rs)) {
+        return false;
+    }
+
+    /*
+     * When starting the process of a new block, the first page of
+     * the block should be sent out before other pages in the same
+     * block, and all the pages in last block should have been sent
+     * out, keeping this order is important, because the 'cont' flag
+     * is used to avoid resending the block name.
+     *
+     * We post the fist page as normal page as compression will take
+     * much CPU resource.
+     */
+    if (block != rs->last_sent_block) {
+        flush_compressed_data(rs);
+        return false;
+    }
+
+    if (compress_page_with_multi_thread(rs, block, offset) > 0) {
+        return true;
+    }
+
+    compression_counters.busy++;
+    return false;
+}
+
+/*
+ * Do not use multifd for:
+ * 1. Compression as the first page in the new block should be posted out
+ *    before sending the compressed page
+ * 2. In postcopy as one whole host page should be placed, unless
+ *    postcopy-preempt is on: then the destination places the background
+ *    pages of blocks without huge pages as they come, and only the pages
+ *    that it asked for still go through the migration channels.
+ */
+static bool save_page_use_multifd(RAMState *rs, PageSearchStatus *pss)
+{
+    if (save_page_use_compression(rs) || !migrate_use_multifd()) {
+        return false;
+    }
+    if (!migration_in_postcopy()) {
+        return true;
+    }
+    return migrate_postcopy_preempt() && !pss->postcopy_requested &&
+           pss->block->page_size == TARGET_PAGE_SIZE;
+}
+
+/*
+ * With page-dedup, each page is sent by its hash the first time only:
+ * if the destination doesn't have it, it is sent whole the next time.
+ * Not at the completion, as there is no next time then.
+ */
+static bool save_page_use_dedup(PageSearchStatus *pss, bool last_stage)
+{
+    return pss->block->dedup_bmap && !last_stage &&
+           !test_bit(pss->page, pss->block->dedup_bmap);
+}
+
+/**
+ * save_hash_page: send the hash of a page to the stream
+ *
+ * Returns the number of pages written.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int save_hash_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+{
+    RAMDedupHash hash;
+    uint64_t buf[2];
+
+    set_bit(offset >> TARGET_PAGE_BITS, block->dedup_bmap);
+    if (!ram_dedup_hash(block->host + offset, &hash)) {
+        return -1;
+    }
+
+    stat64_add(&ram_atomic_counters.transferred,
+               save_page_header(rs, rs->f, block,
+                                offset | RAM_SAVE_FLAG_HASH_PAGE));
+    buf[0] = cpu_to_be64(hash.lo);
+    buf[1] = cpu_to_be64(hash.hi);
+    qemu_put_buffer(rs->f, (uint8_t *)buf, sizeof(buf));
+    stat64_add(&ram_atomic_counters.transferred, sizeof(buf));
+    stat64_add(&ram_atomic_counters.dedup_pages, 1);
+    return 1;
+}
+
+/**
+ * ram_save_target_page: save one target page
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
+                                bool last_stage)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    int res;
+
+    if (control_save_page(rs, block, offset, &res)) {
+        return res;
+    }
+
+    if (save_compress_page(rs, block, offset)) {
+        return 1;
+    }
+
+    /* With multifd, the channels write the pages and look for zeroes */
+    if (migrate_fixed_ram()) {
+        if (save_page_use_multifd(rs, pss)) {
+            return ram_save_multifd_page(rs, block, offset);
+        }
+        return save_fixed_ram_page(rs, block, offset, block->host + offset);
+    }
+
+    /*
+     * With multifd-zero-page the multifd channels look for the zero
+     * pages, so the migration thread doesn't need to scan them.
+     */
+    if (save_page_use_multifd(rs, pss) && migrate_multifd_zero_page() &&
+        !save_page_use_dedup(pss, last_stage)) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    res = save_zero_page(rs, block, offset, block->host + offset);
+    if (res > 0) {
+        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+         * page would be stale
+         */
+        if (!save_page_use_compression(rs)) {
+            XBZRLE_cache_lock();
+            xbzrle_cache_zero_page(rs, block->offset + offset);
+            XBZRLE_cache_unlock();
+        }
+        /* and so must the multifd channels for their own copies */
+        if (migrate_use_multifd()) {
+            multifd_send_zero_page(block, offset);
+        }
+        ram_release_pages(block, offset, res);
+        return res;
+    }
+
+    if (save_page_use_dedup(pss, last_stage)) {
+        res = save_hash_page(rs, block, offset);
+        if (res > 0) {
+            return res;
+        }
+    }
+
+    if (save_page_use_multifd(rs, pss)) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    return ram_save_page(rs, pss, last_stage);
+}
+
+/*
+ * Whether the multifd channels handle the pages from pss->page on their
+ * own, so that ram_save_target_page() would only queue each of them.
+ * That's for RAMBlocks of small pages only: runs could end in the middle
+ * of a huge page.
+ */
+static bool save_page_use_multifd_run(RAMState *rs, PageSearchStatus *pss,
+                                      bool last_stage)
+{
+    if (ramblock_migration_pagesize(pss->block) != TARGET_PAGE_SIZE ||
+        !save_page_use_multifd(rs, pss) || pss->postcopy_requested) {
+        return false;
+    }
+    /* The search would skip the hot pages of the run */
+    if (rs->skip_hot && !migration_in_postcopy()) {
+        return false;
+    }
+    if (pss->block->dedup_bmap && !last_stage) {
+        return false;
+    }
+    return migrate_fixed_ram() || migrate_multifd_zero_page();
+}
+
+/* Longest run of pages queued at once, so that rate limiting still works */
+#define RAM_SAVE_RUN_MAX_PAGES 128
+
+/**
+ * ram_save_multifd_run: save the run of dirty pages at pss->page
+ *
+ * The dirty bits of the run are cleared together and its pages go to
+ * multifd in one call, instead of one at a time.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static int ram_save_multifd_run(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    unsigned long start = pss->page;
+    unsigned long end = MIN(start + RAM_SAVE_RUN_MAX_PAGES,
+                            block->used_length >> TARGET_PAGE_BITS);
+    unsigned long npages;
+
+    WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
+        end = find_next_zero_bit(block->bmap, end, start);
+        npages = end - start;
+        if (!npages) {
+            return 0;
+        }
+        ram_clear_ahead(block, end - 1);
+        migration_clear_memory_region_dirty_bitmap_range(block, start,
+                                                         npages);
+        bitmap_clear(block->bmap, start, npages);
+        rs->migration_dirty_pages -= npages;
+    }
+
+    if (multifd_queue_pages(rs->f, block,
+                            ((ram_addr_t)start) << TARGET_PAGE_BITS,
+                            npages) < 0) {
+        return -1;
+    }
+    stat64_add(&ram_atomic_counters.normal, npages);
+    /* The last page sent, as ram_save_host_page() leaves it */
+    pss->page = end - 1;
+
+    return npages;
+}
+
+/**
+ * ram_save_host_page: save a whole host page
+ *
+ * Starting at *offset send pages up to the end of the current host
+ * page. It's valid for the initial offset to point into the middle of
+ * a host page in which case the remainder of the hostpage is sent.
+ * Only dirty target pages are sent. Note that the host page size may
+ * be a huge page for this block.
+ * The saving stops at the boundary of the used_length of the block
+ * if the RAMBlock isn't a multiple of the host page size.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @ms: current migration state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
+                              bool last_stage)
+{
+    int tmppages, pages = 0;
+    size_t pagesize_bits =
+        ramblock_migration_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long hostpage_boundary =
+        QEMU_ALIGN_UP(pss->page + 1, pagesize_bits);
+    unsigned long start_page = pss->page;
+    int res;
+
+    if (ramblock_is_ignored(pss->block)) {
+        error_report("block %s should not be migrated !", pss->block->idstr);
+        return 0;
+    }
+
+    if (save_page_use_multifd_run(rs, pss, last_stage)) {
+        pages = ram_save_multifd_run(rs, pss);
+        trace_ram_save_host_page(pss->block->idstr,
+                                 (uint64_t)start_page << TARGET_PAGE_BITS,
+                                 pages);
+        return pages;
+    }
+
+    /* Keep the dirty part of the host page in a single multifd packet */
+    if (pagesize_bits > 1 && save_page_use_multifd(rs, pss)) {
+        unsigned long end = MIN(hostpage_boundary,
+                                pss->block->used_length >> TARGET_PAGE_BITS);
+
+        if (multifd_queue_reserve(rs->f,
+                bitmap_count_one_with_offset(pss->block->bmap, pss->page,
+                                             end - pss->page)) < 0) {
+            return -1;
+        }
+    }
+
+    do {
+        /* Check the pages is dirty and if it is send it */
+        if (migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
+            tmppages = ram_save_target_page(rs, pss, last_stage);
+            if (tmppages < 0) {
+                return tmppages;
+            }
+
+            pages += tmppages;
+            /*
+             * Allow rate limiting to happen in the middle of huge pages if
+             * something is sent in the current iteration.
+             */
+            if (pagesize_bits > 1 && tmppages > 0) {
+                migration_rate_limit();
+            }
+        }
+        pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
+    } while ((pss->page < hostpage_boundary) &&
+             offset_in_ramblock(pss->block,
+                                ((ram_addr_t)pss->page) << TARGET_PAGE_BITS));
+    /* The offset we leave with is the min boundary of host page and block */
+    pss->page = MIN(pss->page, hostpage_boundary) - 1;
+    trace_ram_save_host_page(pss->block->idstr,
+                             (uint64_t)start_page << TARGET_PAGE_BITS, pages);
+
+    res = ram_save_release_protection(rs, pss, start_page);
+    return (res < 0 ? res : pages);
+}
+
+/**
+ * ram_save_host_page_urgent: save a requested host page right away
+ *
+ * With postcopy-preempt, the pages that the destination asked for go
+ * through their own channel, flushed after each host page, instead of
+ * waiting behind the background pages of the main channel.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_host_page_urgent(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    QEMUFile *f = rs->f;
+    RAMBlock *last_sent_block = rs->last_sent_block;
+    int pages, ret;
+
+    /* RAM_SAVE_FLAG_CONTINUE refers to the last block of each channel */
+    rs->f = migrate_get_current()->postcopy_qemufile_src;
+    rs->last_sent_block = rs->postcopy_last_sent_block;
+
+    pages = ram_save_host_page(rs, pss, last_stage);
+    qemu_fflush(rs->f);
+    ret = qemu_file_get_error(rs->f);
+
+    rs->postcopy_last_sent_block = rs->last_sent_block;
+    rs->f = f;
+    rs->last_sent_block = last_sent_block;
+
+    return ret < 0 ? ret : pages;
+}
+
+/**
+ * ram_find_and_save_block: finds a dirty page and sends it to f
+ *
+ * Called within an RCU critical section.
+ *
+ * Returns the number of pages written where zero means no dirty pages,
+ * or negative on error
+ *
+ * @rs: current RAM state
+ * @last_stage: if we are at the completion stage
+ *
+ * On systems where host-page-size > target-page-size it will send all the
+ * pages in a host page that are dirty.
+ */
+
+static int ram_find_and_save_block(RAMState *rs, bool last_stage)
+{
+    PageSearchStatus pss;
+    int pages = 0;
+    bool again, found;
+
+    /* No dirty page as there is zero RAM */
+    if (!ram_bytes_total()) {
+        return pages;
+    }
+
+    pss.block = rs->last_seen_block;
+    pss.page = rs->last_page;
+    pss.complete_round = false;
+    pss.postcopy_requested = false;
+
+    if (!pss.block) {
+        pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
+    }
+
+    /* The pages copied by the write fault thread are not dirty anymore */
+    pages = ram_save_staged_page(rs);
+    if (pages) {
+        return pages;
+    }
+
+    do {
+        again = true;
+        found = get_queued_page(rs, &pss);
+
+        if (!found) {
+            /* priority queue empty, so just search for something dirty */
+            found = find_dirty_block(rs, &pss, &again);
+        }
+
+        if (found) {
+            if (pss.postcopy_requested &&
+                migrate_get_current()->postcopy_qemufile_src) {
+                pages = ram_save_host_page_urgent(rs, &pss, last_stage);
+            } else {
+                pages = ram_save_host_page(rs, &pss, last_stage);
+            }
+        }
+    } while (!pages && again);
+
+    rs->last_seen_block = pss.block;
+    rs->last_page = pss.page;
+
+    /* A page can be staged after it was skipped by the search */
+    if (!pages) {
+        pages = ram_save_staged_page(rs);
+    }
+
+    return pages;
+}
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero)
+{
+    uint64_t pages = size / TARGET_PAGE_SIZE;
+
+    if (zero) {
+        stat64_add(&ram_atomic_counters.duplicate, pages);
+    } else {
+        stat64_add(&ram_atomic_counters.normal, pages);
+        stat64_add(&ram_atomic_counters.transferred, size);
+        qemu_update_position(f, size);
+    }
+}
+
+static uint64_t ram_bytes_total_common(bool count_ignored)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    if (count_ignored) {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            total += block->used_length;
+        }
+    } else {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            total += block->used_length;
+        }
+    }
+    return total;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    return ram_bytes_total_common(false);
+}
+
+static void xbzrle_load_setup(void)
+{
+    XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+}
+
+static void xbzrle_load_cleanup(void)
+{
+    g_free(XBZRLE.decoded_buf);
+    XBZRLE.decoded_buf = NULL;
+}
+
+static void ram_state_cleanup(RAMState **rsp)
+{
+    if (*rsp) {
+        migration_page_queue_free(*rsp);
+        qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
+            g_free(*rsp);
+        *rsp = NULL;
+    }
+}
+
+static void xbzrle_cleanup(void)
+{
+    XBZRLE_cache_lock();
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        g_free(XBZRLE.zero_target_page);
+        XBZRLE.cache = NULL;
+        XBZRLE.encoded_buf = NULL;
+        XBZRLE.current_buf = NULL;
+        XBZRLE.zero_target_page = NULL;
+    }
+    XBZRLE_cache_unlock();
+}
+
+static void ram_save_cleanup(void *opaque)
+{
+    RAMState **rsp = opaque;
+    RAMState *rs = *rsp;
+    RAMBlock *block;
+
+    if (migrate_ram_incremental() && rs && rs->completed) {
+        /* Keep logging the pages written until the next one */
+        ram_incremental.active = true;
+        ram_incremental.ram_list_version = ram_list.version;
+        ram_incremental.saved = rs->incremental_generation;
+    } else if (!migrate_background_snapshot()) {
+        /* We don't use dirty log with background snapshots;
+         * caller have hold iothread lock or is in a bh, so there is
+         * no writing race against the migration bitmap
+         */
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
+    }
+
+    ram_clear_thread_cleanup();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        g_free(block->clear_bmap);
+        block->clear_bmap = NULL;
+        g_free(block->bmap);
+        block->bmap = NULL;
+        g_free(block->bmap_summary);
+        block->bmap_summary = NULL;
+        g_free(block->dedup_bmap);
+        block->dedup_bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+        g_free(block->dirty_heat);
+        block->dirty_heat = NULL;
+        g_free(block->heatmap_pages);
+        block->heatmap_pages = NULL;
+        g_free(block->heatmap_syncs);
+        block->heatmap_syncs = NULL;
+    }
+
+    xbzrle_cleanup();
+    compress_threads_save_cleanup();
+    bitmap_sync_threads_cleanup();
+    ram_state_cleanup(rsp);
+}
+
+static void ram_state_reset(RAMState *rs)
+{
+    rs->last_seen_block = NULL;
+    rs->last_sent_block = NULL;
+    rs->last_page = 0;
+    rs->last_version = ram_list.version;
+    rs->xbzrle_enabled = false;
+    rs->prefetch_block = NULL;
+}
+
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+/*
+ * 'expected' is the value you expect the bitmap mostly to be full
+ * of; it won't bother printing lines that are all this value.
+ * If 'todump' is null the migration bitmap is dumped.
+ */
+void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
+                           unsigned long pages)
+{
+    int64_t cur;
+    int64_t linelen = 128;
+    char linebuf[129];
+
+    for (cur = 0; cur < pages; cur += linelen) {
+        int64_t curb;
+        bool found = false;
+        /*
+         * Last line; catch the case where the line length
+         * is longer than remaining ram
+         */
+        if (cur + linelen > pages) {
+            linelen = pages - cur;
+        }
+        for (curb = 0; curb < linelen; curb++) {
+            bool thisbit = test_bit(cur + curb, todump);
+            linebuf[curb] = thisbit ? '1' : '.';
+            found = found || (thisbit != expected);
+        }
+        if (found) {
+            linebuf[curb] = '\0';
+            fprintf(stderr,  "0x%08" PRIx64 " : %s\n", cur, linebuf);
+        }
+    }
+}
+
+/* **** functions for postcopy ***** */
+
+void ram_postcopy_migrated_memory_release(MigrationState *ms)
+{
+    struct RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long *bitmap = block->bmap;
+        unsigned long range = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long run_start = find_next_zero_bit(bitmap, range, 0);
+
+        while (run_start < range) {
+            unsigned long run_end = find_next_bit(bitmap, range, run_start + 1);
+            ram_discard_range(block->idstr,
+                              ((ram_addr_t)run_start) << TARGET_PAGE_BITS,
+                              ((ram_addr_t)(run_end - run_start))
+                                << TARGET_PAGE_BITS);
+            run_start = find_next_zero_bit(bitmap, range, run_end + 1);
+        }
+    }
+}
+
+/**
+ * postcopy_send_discard_bm_ram: discard a RAMBlock
+ *
+ * Returns zero on success
+ *
+ * Callback from postcopy_each_ram_send_discard for each RAMBlock
+ *
+ * @ms: current migration state
+ * @block: RAMBlock to discard
+ */
+static int postcopy_send_discard_bm_ram(MigrationState *ms, RAMBlock *block)
+{
+    unsigned long end = block->used_length >> TARGET_PAGE_BITS;
+    unsigned long current;
+    unsigned long *bitmap = block->bmap;
+
+    for (current = 0; current < end; ) {
+        unsigned long one = find_next_bit(bitmap, end, current);
+        unsigned long zero, discard_length;
+
+        if (one >= end) {
+            break;
+        }
+
+        zero = find_next_zero_bit(bitmap, end, one + 1);
+
+        if (zero >= end) {
+            discard_length = end - one;
+        } else {
+            discard_length = zero - one;
+        }
+        postcopy_discard_send_range(ms, one, discard_length);
+        current = one + discard_length;
+    }
+
+    return 0;
+}
+
+/**
+ * postcopy_each_ram_send_discard: discard all RAMBlocks
+ *
+ * Returns 0 for success or negative for error
+ *
+ * Utility for the outgoing postcopy code.
+ *   Calls postcopy_send_discard_bm_ram for each RAMBlock
+ *   passing it bitmap indexes and name.
+ * (qemu_ram_foreach_block ends up passing unscaled lengths
+ *  which would mean postcopy code would have to deal with target page)
+ *
+ * @ms: current migration state
+ */
+static int postcopy_each_ram_send_discard(MigrationState *ms)
+{
+    struct RAMBlock *block;
+    int ret;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        postcopy_discard_send_init(ms, block->idstr);
+
+        /*
+         * Postcopy sends chunks of bitmap over the wire, but it
+         * just needs indexes at this point, avoids it having
+         * target page specific code.
+         */
+        ret = postcopy_send_discard_bm_ram(ms, block);
+        postcopy_discard_send_finish(ms);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * postcopy_chunk_hostpages_pass: canonicalize bitmap in hostpages
+ *
+ * Helper for postcopy_chunk_hostpages; it's called twice to
+ * canonicalize the two bitmaps, that are similar, but one is
+ * inverted.
+ *
+ * Postcopy requires that all target pages in a hostpage are dirty or
+ * clean, not a mix.  This function canonicalizes the bitmaps.
+ *
+ * @ms: current migration state
+ * @block: block that contains the page we want to canonicalize
+ */
+static void postcopy_chunk_hostpages_pass(MigrationState *ms, RAMBlock *block)
+{
+    RAMState *rs = ram_state;
+    unsigned long *bitmap = block->bmap;
+    unsigned int host_ratio = block->page_size / TARGET_PAGE_SIZE;
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    unsigned long run_start;
+
+    if (block->page_size == TARGET_PAGE_SIZE) {
+        /* Easy case - TPS==HPS for a non-huge page RAMBlock */
+        return;
+    }
+
+    /* Find a dirty page */
+    run_start = find_next_bit(bitmap, pages, 0);
+
+    while (run_start < pages) {
+
+        /*
+         * If the start of this run of pages is in the middle of a host
+         * page, then we need to fixup this host page.
+         */
+        if (QEMU_IS_ALIGNED(run_start, host_ratio)) {
+            /* Find the end of this run */
+            run_start = find_next_zero_bit(bitmap, pages, run_start + 1);
+            /*
+             * If the end isn't at the start of a host page, then the
+             * run doesn't finish at the end of a host page
+             * and we need to discard.
+             */
+        }
+
+        if (!QEMU_IS_ALIGNED(run_start, host_ratio)) {
+            unsigned long page;
+            unsigned long fixup_start_addr = QEMU_ALIGN_DOWN(run_start,
+                                                             host_ratio);
+            run_start = QEMU_ALIGN_UP(run_start, host_ratio);
+
+            /* Clean up the bitmap */
+            for (page = fixup_start_addr;
+                 page < fixup_start_addr + host_ratio; page++) {
+                /*
+                 * Remark them as dirty, updating the count for any pages
+                 * that weren't previously dirty.
+                 */
+                rs->migration_dirty_pages += !test_and_set_bit(page, bitmap);
+            }
+            ramblock_bmap_summary_set(block, fixup_start_addr, host_ratio);
+        }
+
+        /* Find the next dirty page for the next iteration */
+        run_start = find_next_bit(bitmap, pages, run_start);
+    }
+}
+
+/**
+ * postcopy_chunk_hostpages: discard any partially sent host page
+ *
+ * Utility for the outgoing postcopy code.
+ *
+ * Discard any partially sent host-page size chunks, mark any partially
+ * dirty host-page size chunks as all dirty.  In this case the host-page
+ * is the host-page for the particular RAMBlock, i.e. it might be a huge page
+ *
+ * Returns zero on success
+ *
+ * @ms: current migration state
+ * @block: block we want to work with
+ */
+static int postcopy_chunk_hostpages(MigrationState *ms, RAMBlock *block)
+{
+    postcopy_discard_send_init(ms, block->idstr);
+
+    /*
+     * Ensure that all partially dirty host pages are made fully dirty.
+     */
+    postcopy_chunk_hostpages_pass(ms, block);
+
+    postcopy_discard_send_finish(ms);
+    return 0;
+}
+
+/**
+ * ram_postcopy_send_discard_bitmap: transmit the discard bitmap
+ *
+ * Returns zero on success
+ *
+ * Transmit the set of pages to be discarded after precopy to the target
+ * these are pages that:
+ *     a) Have been previously transmitted but are now dirty again
+ *     b) Pages that have never been transmitted, this ensures that
+ *        any pages on the destination that have been mapped by background
+ *        tasks get discarded (transparent huge pages is the specific concern)
+ * Hopefully this is pretty sparse
+ *
+ * @ms: current migration state
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+    int ret;
+
+    RCU_READ_LOCK_GUARD();
+
+    /* This should be our last sync, the src is now paused */
+    migration_bitmap_sync(rs);
+
+    /* Easiest way to make sure we don't resume in the middle of a host-page */
+    rs->last_seen_block = NULL;
+    rs->last_sent_block = NULL;
+    rs->last_page = 0;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        /* Deal with TPS != HPS and huge pages */
+        ret = postcopy_chunk_hostpages(ms, block);
+        if (ret) {
+            return ret;
+        }
+
+#ifdef DEBUG_POSTCOPY
+        ram_debug_dump_bitmap(block->bmap, true,
+                              block->used_length >> TARGET_PAGE_BITS);
+#endif
+    }
+    trace_ram_postcopy_send_discard_bitmap();
+
+    return postcopy_each_ram_send_discard(ms);
+}
+
+/**
+ * ram_discard_range: discard dirtied pages at the beginning of postcopy
+ *
+ * Returns zero on success
+ *
+ * @rbname: name of the RAMBlock of the request. NULL means the
+ *          same that last one.
+ * @start: RAMBlock starting page
+ * @length: RAMBlock size
+ */
+int ram_discard_range(const char *rbname, uint64_t start, size_t length)
+{
+    trace_ram_discard_range(rbname, start, length);
+
+    RCU_READ_LOCK_GUARD();
+    RAMBlock *rb = qemu_ram_block_by_name(rbname);
+
+    if (!rb) {
+        error_report("ram_discard_range: Failed to find block '%s'", rbname);
+        return -1;
+    }
+
+    /*
+     * On source VM, we don't need to update the received bitmap since
+     * we don't even have one.
+     */
+    if (rb->receivedmap) {
+        bitmap_clear(rb->receivedmap, start >> qemu_target_page_bits(),
+                     length >> qemu_target_page_bits());
+    }
+
+    return ram_block_discard_range(rb, start, length);
+}
+
+/*
+ * For every allocation, we will try not to crash the VM if the
+ * allocation failed.
+ */
+static int xbzrle_init(void)
+{
+    Error *local_err = NULL;
+
+    if (!migrate_use_xbzrle()) {
+        return 0;
+    }
+
+    XBZRLE_cache_lock();
+
+    XBZRLE.zero_target_page = g_try_malloc0(TARGET_PAGE_SIZE);
+    if (!XBZRLE.zero_target_page) {
+        error_report("%s: Error allocating zero page", __func__);
+        goto err_out;
+    }
+
+    XBZRLE.cache = cache_init(migrate_xbzrle_cache_size(),
+                              TARGET_PAGE_SIZE,
+                              migrate_xbzrle_cache_hugetlb(),
+                              migrate_xbzrle_cache_numa_node(), &local_err);
+    if (!XBZRLE.cache) {
+        error_report_err(local_err);
+        goto free_zero_page;
+    }
+
+    XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
+    if (!XBZRLE.encoded_buf) {
+        error_report("%s: Error allocating encoded_buf", __func__);
+        goto free_cache;
+    }
+
+    XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
+    if (!XBZRLE.current_buf) {
+        error_report("%s: Error allocating current_buf", __func__);
+        goto free_encoded_buf;
+    }
+
+    /* We are all good */
+    XBZRLE_cache_unlock();
+    return 0;
+
+free_encoded_buf:
+    g_free(XBZRLE.encoded_buf);
+    XBZRLE.encoded_buf = NULL;
+free_cache:
+    cache_fini(XBZRLE.cache);
+    XBZRLE.cache = NULL;
+free_zero_page:
+    g_free(XBZRLE.zero_target_page);
+    XBZRLE.zero_target_page = NULL;
+err_out:
+    XBZRLE_cache_unlock();
+    return -ENOMEM;
+}
+
+static int ram_state_init(RAMState **rsp)
+{
+    *rsp = g_try_new0(RAMState, 1);
+
+    if (!*rsp) {
+        error_report("%s: Init ramstate fail", __func__);
+        return -1;
+    }
+
+    qemu_mutex_init(&(*rsp)->bitmap_mutex);
+    memset(&postcopy_queue_latency, 0, sizeof(postcopy_queue_latency));
+    QSLIST_INIT(&(*rsp)->src_page_requests_new);
+    QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+
+    /*
+     * Count the total number of pages used by ram blocks not including any
+     * gaps due to alignment or unplugs.
+     * This must match with the initial values of dirty bitmap.
+     */
+    (*rsp)->migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
+    ram_state_reset(*rsp);
+
+    return 0;
+}
+
+/* Dirty logging kept between the migrations of ram-incremental */
+static struct {
+    /* dirty logging is still on since the last migration */
+    bool active;
+    /* ram_list.version when it completed */
+    uint32_t ram_list_version;
+    /* generation of the last migration that was saved */
+    uint64_t saved;
+    /* generation of the RAM before the current load, and after it */
+    uint64_t load_base;
+    uint64_t loaded;
+} ram_incremental;
+
+/* Stop the dirty logging of ram-incremental, the next migration is full */
+static void ram_incremental_reset(void)
+{
+    if (ram_incremental.active) {
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
+        ram_incremental.active = false;
+    }
+}
+
+/*
+ * Whether the migration only sends the pages written since the last
+ * one: the dirty log kept since then must cover the same RAM blocks.
+ */
+static bool ram_incremental_delta(void)
+{
+    return migrate_ram_incremental() && ram_incremental.active &&
+           ram_incremental.ram_list_version == ram_list.version;
+}
+
+static void ram_list_init_bitmaps(bool delta)
+{
+    MigrationState *ms = migrate_get_current();
+    RAMBlock *block;
+    unsigned long pages;
+    uint8_t shift;
+
+    /* Skip setting bitmap if there is no RAM */
+    if (ram_bytes_total()) {
+        shift = ms->clear_bitmap_shift;
+        if (shift > CLEAR_BITMAP_SHIFT_MAX) {
+            error_report("clear_bitmap_shift (%u) too big, using "
+                         "max value (%u)", shift, CLEAR_BITMAP_SHIFT_MAX);
+            shift = CLEAR_BITMAP_SHIFT_MAX;
+        } else if (shift < CLEAR_BITMAP_SHIFT_MIN) {
+            error_report("clear_bitmap_shift (%u) too small, using "
+                         "min value (%u)", shift, CLEAR_BITMAP_SHIFT_MIN);
+            shift = CLEAR_BITMAP_SHIFT_MIN;
+        }
+
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            pages = block->max_length >> TARGET_PAGE_BITS;
+            /*
+             * The initial dirty bitmap for migration must be set with all
+             * ones to make sure we'll migrate every guest RAM page to
+             * destination.
+             * Here we set RAMBlock.bmap all to 1 because when rebegin a
+             * new migration after a failed migration, ram_list.
+             * dirty_memory[DIRTY_MEMORY_MIGRATION] don't include the whole
+             * guest memory.
+             */
+            block->bmap = bitmap_new(pages);
+            block->bmap_summary = bitmap_new(BITS_TO_LONGS(pages));
+            if (migrate_page_dedup()) {
+                block->dedup_bmap = bitmap_new(pages);
+            }
+            /* Only the dirty log says what changed since the last one */
+            if (!delta) {
+                bitmap_set(block->bmap, 0, pages);
+                ramblock_bmap_summary_set(block, 0, pages);
+            }
+            block->clear_bmap_shift = shift;
+            block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            if (migrate_ram_cold_first()) {
+                block->dirty_heat =
+                    g_new0(uint8_t, DIV_ROUND_UP(pages,
+                                                 ram_heat_chunk_pages(block)));
+            }
+        }
+    }
+}
+
+static void dirty_bitmap_clear_section(MemoryRegionSection *section,
+                                       void *opaque)
+{
+    const unsigned long start = section->offset_within_region >>
+                                TARGET_PAGE_BITS;
+    const unsigned long npages = int128_get64(section->size) >>
+                                 TARGET_PAGE_BITS;
+    RAMBlock *rb = section->mr->ram_block;
+    uint64_t *cleared_bits = opaque;
+
+    *cleared_bits += bitmap_count_one_with_offset(rb->bmap, start, npages);
+    bitmap_clear(rb->bmap, start, npages);
+}
+
+/*
+ * Exclude all discarded parts of @rb from migration, e.g. the unplugged
+ * memory of a virtio-mem device, which can't change while migrating.
+ *
+ * Returns the number of cleared bits in the migration bitmap.
+ */
+static uint64_t ramblock_dirty_bitmap_clear_discarded_pages(RAMBlock *rb)
+{
+    uint64_t cleared_bits = 0;
+
+    if (rb->mr && rb->bmap && memory_region_has_ram_discard_manager(rb->mr)) {
+        RamDiscardManager *rdm = memory_region_get_ram_discard_manager(rb->mr);
+        MemoryRegionSection section = {
+            .mr = rb->mr,
+            .offset_within_region = 0,
+            .size = int128_make64(rb->used_length),
+        };
+
+        ram_discard_manager_replay_discarded(rdm, &section,
+                                             dirty_bitmap_clear_section,
+                                             &cleared_bits);
+        trace_ram_init_bitmaps_discarded(rb->idstr, cleared_bits);
+    }
+    return cleared_bits;
+}
+
+static void ram_init_bitmaps(RAMState *rs)
+{
+    RAMBlock *block;
+
+    /* For memory_global_dirty_log_start below.  */
+    qemu_mutex_lock_iothread();
+    qemu_mutex_lock_ramlist();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        bool delta = ram_incremental_delta();
+
+        if (!delta) {
+            ram_incremental_reset();
+        }
+        if (migrate_ram_incremental()) {
+            rs->incremental_parent = delta ? ram_incremental.saved : 0;
+            rs->incremental_generation = ((uint64_t)g_random_int() << 32) |
+                                         g_random_int();
+            trace_ram_incremental_save(rs->incremental_parent,
+                                       rs->incremental_generation);
+        }
+        /* The log is back to a single user until this one completes */
+        ram_incremental.active = false;
+
+        ram_list_init_bitmaps(delta);
+        if (delta) {
+            rs->migration_dirty_pages = 0;
+        }
+        /* We don't use dirty log with background snapshots */
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
+            migration_bitmap_sync_precopy(rs);
+        }
+
+        /* Set up after the first sync, so that it isn't counted */
+        rs->heatmap_granularity = migrate_dirty_heatmap_granularity();
+        if (rs->heatmap_granularity) {
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                unsigned long buckets = ram_heatmap_buckets(rs,
+                                                            block->max_length);
+
+                block->heatmap_pages = g_new0(uint64_t, buckets);
+                block->heatmap_syncs = g_new0(uint64_t, buckets);
+            }
+        }
+
+        /* The initial bitmap of all ones doesn't know about discards */
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            uint64_t pages = ramblock_dirty_bitmap_clear_discarded_pages(block);
+
+            rs->migration_dirty_pages -= pages;
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+    qemu_mutex_unlock_iothread();
+}
+
+static int ram_init_all(RAMState **rsp)
+{
+    if (ram_state_init(rsp)) {
+        return -1;
+    }
+
+    if (xbzrle_init()) {
+        ram_state_cleanup(rsp);
+        return -1;
+    }
+
+    ram_init_bitmaps(*rsp);
+
+    return 0;
+}
+
+static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
+{
+    RAMBlock *block;
+    uint64_t pages = 0;
+
+    /*
+     * Postcopy is not using xbzrle/compression, so no need for that.
+     * Also, since source are already halted, we don't need to care
+     * about dirty page logging as well.
+     */
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        pages += bitmap_count_one(block->bmap,
+                                  block->used_length >> TARGET_PAGE_BITS);
+    }
+
+    /* This may not be aligned with current bitmaps. Recalculate. */
+    rs->migration_dirty_pages = pages;
+
+    ram_state_reset(rs);
+
+    /* Update RAMState cache of output QEMUFile */
+    rs->f = out;
+
+    trace_ram_state_resume_prepare(pages);
+}
+
+/*
+ * The destination didn't find the page at @start of the block @rbname
+ * in its dedup store: send it again, whole this time.
+ *
+ * Returns 0 for success or -1 for error
+ */
+int ram_dedup_miss(const char *rbname, ram_addr_t start)
+{
+    RAMState *rs = ram_state;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    RAMBlock *rb;
+
+    RCU_READ_LOCK_GUARD();
+    rb = qemu_ram_block_by_name(rbname);
+    if (!rb || !rb->dedup_bmap || !offset_in_ramblock(rb, start) ||
+        !test_bit(page, rb->dedup_bmap)) {
+        error_report("%s: unexpected page %s:" RAM_ADDR_FMT, __func__,
+                     rbname, start);
+        return -1;
+    }
+
+    trace_ram_dedup_miss(rbname, start);
+    WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
+        if (!test_and_set_bit(page, rb->bmap)) {
+            rs->migration_dirty_pages++;
+        }
+        ramblock_bmap_summary_set(rb, page, 1);
+        stat64_add(&ram_atomic_counters.dedup_misses, 1);
+    }
+    return 0;
+}
+
+/*
+ * This function clears bits of the free pages reported by the caller from the
+ * migration dirty bitmap.  @iov lists @iovcnt ranges of guest free pages,
+ * each one from the host address in iov_base for iov_len bytes.  The dirty
+ * log of the chunks that they cover is cleared first, so that the guest
+ * writes to these pages after the hint are still caught by the next sync.
+ */
+void qemu_guest_free_page_hints(const struct iovec *iov, int iovcnt)
+{
+    RAMState *rs = ram_state;
+    MigrationState *s = migrate_get_current();
+    uint64_t freed = 0;
+    int i;
+
+    /* This function is currently expected to be used during live migration */
+    if (!migration_is_setup_or_active(s->state) || !rs) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    for (i = 0; i < iovcnt; i++) {
+        void *addr = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        size_t used_len;
+
+        for (; len > 0; len -= used_len, addr += used_len) {
+            RAMBlock *block;
+            ram_addr_t offset;
+            size_t start, npages, cleared;
+
+            block = qemu_ram_block_from_host(addr, false, &offset);
+            if (unlikely(!block || offset >= block->used_length)) {
+                /*
+                 * The implementation might not support RAMBlock resize
+                 * during live migration, but it could happen in theory
+                 * with future updates. So we add a check here to capture
+                 * that case.
+                 */
+                error_report_once("%s unexpected error", __func__);
+                goto out;
+            }
+
+            used_len = MIN(len, block->used_length - offset);
+            start = offset >> TARGET_PAGE_BITS;
+            npages = used_len >> TARGET_PAGE_BITS;
+            if (!npages) {
+                continue;
+            }
+
+            migration_clear_memory_region_dirty_bitmap_range(block, start,
+                                                             npages);
+            cleared = bitmap_count_one_with_offset(block->bmap, start,
+                                                   npages);
+            bitmap_clear(block->bmap, start, npages);
+            rs->migration_dirty_pages -= cleared;
+            freed += cleared;
+        }
+    }
+out:
+    stat64_add(&ram_atomic_counters.free_page_hint_bytes,
+               freed * TARGET_PAGE_SIZE);
+    qemu_mutex_unlock(&rs->bitmap_mutex);
+    trace_qemu_guest_free_page_hints(iovcnt, freed);
+}
+
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    struct iovec iov = { .iov_base = addr, .iov_len = len };
+
+    qemu_guest_free_page_hints(&iov, 1);
+}
+
+/*
+ * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
+ * long-running RCU critical section.  When rcu-reclaims in the code
+ * start to become numerous it will be necessary to reduce the
+ * granularity of these critical sections.
+ */
+
+/**
+ * ram_save_setup: Setup RAM for migration
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @f: QEMUFile where to send the data
+ * @opaque: RAMState pointer
+ */
+/*
+ * Bits in the fixed-ram bitmap of a block of @length bytes.  It is stored
+ * as little endian 64 bit words, whatever the size of a long.
+ */
+static unsigned long fixed_ram_bitmap_bits(ram_addr_t length)
+{
+    return ROUND_UP(length >> TARGET_PAGE_BITS, 64);
+}
+
+/*
+ * Reserve the room for the bitmap and for the pages of @block in the
+ * migration file, right after the header of the block in the stream,
+ * and move the stream after them.
+ */
+static void fixed_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long nbits = fixed_ram_bitmap_bits(block->used_length);
+
+    block->file_bmap = bitmap_new(nbits);
+    block->bitmap_offset = qemu_ftell(f) + 2 * sizeof(uint64_t);
+    block->pages_offset = ROUND_UP(block->bitmap_offset + nbits / 8,
+                                   FIXED_RAM_FILE_ALIGN);
+
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_file_seek(f, block->pages_offset + block->used_length);
+}
+
+/* Write the bitmaps of the blocks, once all their pages are in the file */
+static int fixed_ram_save_bitmaps(RAMState *rs)
+{
+    Error *local_err = NULL;
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long nbits = fixed_ram_bitmap_bits(block->used_length);
+        g_autofree unsigned long *le_bmap = bitmap_new(nbits);
+
+        bitmap_to_le(le_bmap, block->file_bmap, nbits);
+        if (qemu_file_write_at(rs->f, (uint8_t *)le_bmap, nbits / 8,
+                               block->bitmap_offset, &local_err) < 0) {
+            qemu_file_set_error_obj(rs->f, -EIO, local_err);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/*
+ * With ram-handover, every block says whether it is handed over, and
+ * the ones that are come with their fd instead of their pages.
+ */
+static void ram_save_handover(QEMUFile *f, RAMBlock *block)
+{
+    if (!ramblock_is_handed_over(block)) {
+        qemu_put_byte(f, 0);
+        return;
+    }
+    qemu_put_byte(f, 1);
+    qemu_put_be64(f, block->fd_offset);
+    qemu_file_send_fd(f, block->fd);
+    trace_ram_save_handover(block->idstr);
+}
+
+static int ram_load_handover(QEMUFile *f, RAMBlock *block)
+{
+    Error *local_err = NULL;
+    uint64_t offset;
+    int fd;
+
+    if (!qemu_get_byte(f)) {
+        if (ramblock_is_handed_over(block)) {
+            error_report("RAM block %s is shared memory here, but not on "
+                         "the source", block->idstr);
+            return -EINVAL;
+        }
+        return 0;
+    }
+    offset = qemu_get_be64(f);
+    fd = qemu_file_recv_fd(f);
+    if (fd < 0) {
+        return -EINVAL;
+    }
+    if (qemu_ram_adopt_fd(block, fd, offset, &local_err) < 0) {
+        error_report_err(local_err);
+        close(fd);
+        return -EINVAL;
+    }
+    trace_ram_load_handover(block->idstr);
+    return 0;
+}
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    RAMState **rsp = opaque;
+    RAMBlock *block;
+
+    if (compress_threads_save_setup()) {
+        return -1;
+    }
+    bitmap_sync_threads_setup();
+
+    /* migration has already setup the bitmap, reuse it. */
+    if (!migration_in_colo_state()) {
+        if (ram_init_all(rsp) != 0) {
+            compress_threads_save_cleanup();
+            bitmap_sync_threads_cleanup();
+            return -1;
+        }
+    }
+    (*rsp)->f = f;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        ram_clear_thread_setup();
+        qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
+
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+            qemu_put_be64(f, block->used_length);
+            if (migrate_postcopy_ram() && block->page_size !=
+                                          qemu_host_page_size) {
+                qemu_put_be64(f, block->page_size);
+            }
+            if (migrate_ignore_shared()) {
+                qemu_put_be64(f, block->mr->addr);
+            }
+            if (migrate_ram_handover()) {
+                ram_save_handover(f, block);
+            }
+            if (migrate_fixed_ram()) {
+                fixed_ram_setup_block(f, block);
+            }
+        }
+    }
+    if (migrate_ram_incremental()) {
+        qemu_put_be64(f, (*rsp)->incremental_parent);
+        qemu_put_be64(f, (*rsp)->incremental_generation);
+    }
+
+    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
+    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+
+    ram_multifd_send_sync(*rsp, f);
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(f);
+
+    return 0;
+}
+
+/**
+ * ram_save_iterate: iterative stage for migration
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @f: QEMUFile where to send the data
+ * @opaque: RAMState pointer
+ */
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    RAMState **temp = opaque;
+    RAMState *rs = *temp;
+    int ret = 0;
+    int i;
+    int64_t t0;
+    int done = 0;
 
     if (blk_mig_bulk_active()) {
         /* Avoid transferring ram during bulk phase of block migration as
@@ -2834,495 +4944,1230 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         goto out;
     }
 
-    WITH_RCU_READ_LOCK_GUARD() {
-        if (ram_list.version != rs->last_version) {
-            ram_state_reset(rs);
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (ram_list.version != rs->last_version) {
+            ram_state_reset(rs);
+        }
+
+        /* Read version before ram_list.blocks */
+        smp_rmb();
+
+        if (rs->multifd_flush_pending) {
+            ram_multifd_send_sync(rs, f);
+        }
+
+        ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+
+        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        i = 0;
+        while ((ret = qemu_file_rate_limit(f)) == 0 ||
+                !migration_page_queue_empty(rs)) {
+            int pages;
+
+            if (qemu_file_get_error(f)) {
+                break;
+            }
+
+            pages = ram_find_and_save_block(rs, false);
+            /* no more pages to sent */
+            if (pages == 0) {
+                done = 1;
+                break;
+            }
+
+            if (pages < 0) {
+                qemu_file_set_error(f, pages);
+                break;
+            }
+
+            rs->target_page_count += pages;
+
+            /*
+             * During postcopy, it is necessary to make sure one whole host
+             * page is sent in one chunk.
+             */
+            if (migrate_postcopy_ram()) {
+                flush_compressed_data(rs);
+            }
+
+            /*
+             * we want to check in the 1st loop, just in case it was the 1st
+             * time and we had to sync the dirty bitmap.
+             * qemu_clock_get_ns() is a bit expensive, so we only check each
+             * some iterations
+             */
+            if ((i & 63) == 0) {
+                uint64_t t1 = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) /
+                              1000000;
+                if (t1 > MAX_WAIT) {
+                    trace_ram_save_iterate_big_wait(t1, i);
+                    break;
+                }
+            }
+            i++;
+        }
+    }
+
+    /*
+     * Must occur before EOS (or any QEMUFile operation)
+     * because of RDMA protocol.
+     */
+    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+
+out:
+    if (ret >= 0
+        && migration_is_setup_or_active(migrate_get_current()->state)) {
+        if (migrate_multifd_flush_after_each_section()) {
+            multifd_send_sync_main(rs->f);
+        }
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(f);
+        stat64_add(&ram_atomic_counters.transferred, 8);
+
+        ret = qemu_file_get_error(f);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    return done;
+}
+
+/**
+ * ram_save_complete: function called to send the remaining amount of ram
+ *
+ * Returns zero to indicate success or negative on error
+ *
+ * Called with iothread lock
+ *
+ * @f: QEMUFile where to send the data
+ * @opaque: RAMState pointer
+ */
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    RAMState **temp = opaque;
+    RAMState *rs = *temp;
+    int ret = 0;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (!migration_in_postcopy()) {
+            migration_bitmap_sync_precopy(rs);
+            /*
+             * The pages sent from now on are final, but only free them
+             * when the VM was stopped to complete a migration, not for
+             * a snapshot or a COLO checkpoint.
+             */
+            if (migrate_release_ram_precopy() &&
+                runstate_check(RUN_STATE_FINISH_MIGRATE)) {
+                migrate_get_current()->ram_released = true;
+            }
+        }
+        /* The hot pages were kept for now */
+        rs->skip_hot = false;
+        if (rs->multifd_flush_pending) {
+            ram_multifd_send_sync(rs, f);
+        }
+
+        ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+
+        /* try transferring iterative blocks of memory */
+
+        /* flush all remaining blocks regardless of rate limiting */
+        while (true) {
+            int pages;
+
+            pages = ram_find_and_save_block(rs, !migration_in_colo_state());
+            /* no more blocks to sent */
+            if (pages == 0) {
+                break;
+            }
+            if (pages < 0) {
+                ret = pages;
+                break;
+            }
+        }
+
+        flush_compressed_data(rs);
+        ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    }
+
+    if (ret >= 0) {
+        QEMUFile *preempt = migrate_get_current()->postcopy_qemufile_src;
+
+        ram_multifd_send_sync(rs, rs->f);
+        if (migrate_fixed_ram()) {
+            ret = fixed_ram_save_bitmaps(rs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(f);
+
+        /* Let the preempt thread on the destination finish */
+        if (preempt) {
+            qemu_put_be64(preempt, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(preempt);
+        }
+        rs->completed = true;
+    }
+
+    return ret;
+}
+
+static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
+                             uint64_t *res_precopy_only,
+                             uint64_t *res_compatible,
+                             uint64_t *res_postcopy_only)
+{
+    RAMState **temp = opaque;
+    RAMState *rs = *temp;
+    uint64_t remaining_size;
+
+    remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+    rs->switchover_threshold = max_size;
+
+    if (!migration_in_postcopy() &&
+        remaining_size < max_size) {
+        qemu_mutex_lock_iothread();
+        WITH_RCU_READ_LOCK_GUARD() {
+            migration_bitmap_sync_precopy(rs);
+        }
+        qemu_mutex_unlock_iothread();
+        remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+    }
+    /* Read after the dirty pages, see ram_wp_stage_page() */
+    smp_rmb();
+    remaining_size += qatomic_read(&rs->wp_staged_pages) * TARGET_PAGE_SIZE;
+
+    if (migrate_postcopy_ram()) {
+        /* We can do postcopy, and all the data is postcopiable */
+        *res_compatible += remaining_size;
+    } else {
+        *res_precopy_only += remaining_size;
+    }
+}
+
+/* Read the header of an XBZRLE page and return the length of its data */
+static int load_xbzrle_header(QEMUFile *f)
+{
+    unsigned int xh_len;
+    int xh_flags;
+
+    /* extract RLE header */
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        error_report("Failed to load XBZRLE page - wrong compression!");
+        return -1;
+    }
+
+    if (xh_len > TARGET_PAGE_SIZE) {
+        error_report("Failed to load XBZRLE page - len overflow!");
+        return -1;
+    }
+
+    return xh_len;
+}
+
+static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+{
+    int xh_len;
+    uint8_t *loaded_data;
+
+    xh_len = load_xbzrle_header(f);
+    if (xh_len < 0) {
+        return -1;
+    }
+    loaded_data = XBZRLE.decoded_buf;
+    /* load data and decode */
+    /* it can change loaded_data to point to an internal buffer */
+    qemu_get_buffer_in_place(f, &loaded_data, xh_len);
+
+    /* decode RLE */
+    if (xbzrle_decode_buffer(loaded_data, xh_len, host,
+                             TARGET_PAGE_SIZE) == -1) {
+        error_report("Failed to load XBZRLE page - decode error!");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * ram_block_from_stream: read a RAMBlock id from the migration stream
+ *
+ * Must be called from within a rcu critical section.
+ *
+ * Returns a pointer from within the RCU-protected ram_list.
+ *
+ * @mis: the migration incoming state pointer
+ * @f: QEMUFile where to read the data from
+ * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel we're using, each one has its own last block
+ */
+static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
+                                              QEMUFile *f, int flags,
+                                              int channel)
+{
+    RAMBlock *block = mis->last_recv_block[channel];
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block) {
+            error_report("Ack, bad migration stream!");
+            return NULL;
         }
+        return block;
+    }
 
-        /* Read version before ram_list.blocks */
-        smp_rmb();
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
 
-        ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+    block = qemu_ram_block_by_name(id);
+    if (!block) {
+        error_report("Can't find block %s", id);
+        return NULL;
+    }
 
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        i = 0;
-        while ((ret = qemu_file_rate_limit(f)) == 0 ||
-                !QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
-            int pages;
+    if (ramblock_is_ignored(block)) {
+        error_report("block %s should not be migrated !", id);
+        return NULL;
+    }
 
-            if (qemu_file_get_error(f)) {
-                break;
+    mis->last_recv_block[channel] = block;
+
+    return block;
+}
+
+static inline void *host_from_ram_block_offset(RAMBlock *block,
+                                               ram_addr_t offset)
+{
+    if (!offset_in_ramblock(block, offset)) {
+        return NULL;
+    }
+
+    return block->host + offset;
+}
+
+static void *host_page_from_ram_block_offset(RAMBlock *block,
+                                             ram_addr_t offset)
+{
+    /* Note: Explicitly no check against offset_in_ramblock(). */
+    return (void *)QEMU_ALIGN_DOWN((uintptr_t)(block->host + offset),
+                                   block->page_size);
+}
+
+static ram_addr_t host_page_offset_from_ram_block_offset(RAMBlock *block,
+                                                         ram_addr_t offset)
+{
+    return ((uintptr_t)block->host + offset) & (block->page_size - 1);
+}
+
+static inline void *colo_cache_from_block_offset(RAMBlock *block,
+                             ram_addr_t offset, bool record_bitmap)
+{
+    if (!offset_in_ramblock(block, offset)) {
+        return NULL;
+    }
+    if (!block->colo_cache) {
+        error_report("%s: colo_cache is NULL in block :%s",
+                     __func__, block->idstr);
+        return NULL;
+    }
+
+    /*
+    * During colo checkpoint, we need bitmap of these migrated pages.
+    * It help us to decide which pages in ram cache should be flushed
+    * into VM's RAM later.
+    */
+    if (record_bitmap &&
+        !test_and_set_bit(offset >> TARGET_PAGE_BITS, block->bmap)) {
+        ram_state->migration_dirty_pages++;
+    }
+    return block->colo_cache + offset;
+}
+
+/**
+ * ram_handle_compressed: handle the zero page case
+ *
+ * If a page (or a whole RDMA chunk) has been
+ * determined to be zero, then zap it.
+ *
+ * @host: host address for the zero page
+ * @ch: what the page is filled from.  We only support zero
+ * @size: size of the zero page
+ */
+void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+{
+    if (ch != 0 || !is_zero_range(host, size)) {
+        memset(host, ch, size);
+    }
+}
+
+/* Largest compressed page that the decompression threads accept */
+static size_t decompress_bound(void)
+{
+    return decomp_ops ? decomp_ops->bound(TARGET_PAGE_SIZE) : 0;
+}
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    unsigned long pagesize;
+    uint8_t *des;
+    int len, ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->des) {
+            des = param->des;
+            len = param->len;
+            param->des = 0;
+            qemu_mutex_unlock(&param->mutex);
+
+            pagesize = TARGET_PAGE_SIZE;
+
+            ret = decomp_ops->decompress(param->state, des, pagesize,
+                                         param->compbuf, len);
+            if (ret < 0 && migrate_get_current()->decompress_error_check) {
+                error_report("decompress data failed");
+                qemu_file_set_error(decomp_file, ret);
             }
 
-            pages = ram_find_and_save_block(rs, false);
-            /* no more pages to sent */
-            if (pages == 0) {
-                done = 1;
-                break;
-            }
+            qemu_mutex_lock(&decomp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static int wait_for_decompress_done(void)
+{
+    int idx, thread_count;
+
+    if (!migrate_use_compression()) {
+        return 0;
+    }
+
+    thread_count = migrate_decompress_threads();
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < thread_count; idx++) {
+        while (!decomp_param[idx].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+    return qemu_file_get_error(decomp_file);
+}
+
+static void compress_threads_load_cleanup(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    thread_count = migrate_decompress_threads();
+    for (i = 0; i < thread_count; i++) {
+        /*
+         * we use it as a indicator which shows if the thread is
+         * properly init'd or not
+         */
+        if (!decomp_param[i].compbuf) {
+            break;
+        }
+
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+    }
+    for (i = 0; i < thread_count; i++) {
+        if (!decomp_param[i].compbuf) {
+            break;
+        }
+
+        qemu_thread_join(decompress_threads + i);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        decomp_ops->decompress_cleanup(decomp_param[i].state);
+        g_free(decomp_param[i].compbuf);
+        decomp_param[i].compbuf = NULL;
+    }
+    g_free(decompress_threads);
+    g_free(decomp_param);
+    decompress_threads = NULL;
+    decomp_param = NULL;
+    decomp_file = NULL;
+    decomp_ops = NULL;
+}
+
+static int compress_threads_load_setup(QEMUFile *f)
+{
+    Error *local_err = NULL;
+    int i, thread_count;
+
+    if (!migrate_use_compression()) {
+        return 0;
+    }
+
+    thread_count = migrate_decompress_threads();
+    decompress_threads = g_new0(QemuThread, thread_count);
+    decomp_param = g_new0(DecompressParam, thread_count);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    decomp_file = f;
+    decomp_ops = ram_compress_get_ops(migrate_compress_method());
+    for (i = 0; i < thread_count; i++) {
+        if (decomp_ops->decompress_setup(&decomp_param[i].state,
+                                         &local_err) < 0) {
+            error_report_err(local_err);
+            goto exit;
+        }
+
+        decomp_param[i].compbuf =
+            g_malloc0(decomp_ops->bound(TARGET_PAGE_SIZE));
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        decomp_param[i].done = true;
+        decomp_param[i].quit = false;
+        thread_context_create_thread(THREAD_GROUP_COMPRESS,
+                                     decompress_threads + i, "decompress",
+                                     do_data_decompress, decomp_param + i);
+    }
+    return 0;
+exit:
+    compress_threads_load_cleanup();
+    return -1;
+}
+
+static void decompress_data_with_multi_threads(QEMUFile *f,
+                                               void *host, int len)
+{
+    int idx, thread_count;
 
-            if (pages < 0) {
-                qemu_file_set_error(f, pages);
+    thread_count = migrate_decompress_threads();
+    QEMU_LOCK_GUARD(&decomp_done_lock);
+    while (true) {
+        for (idx = 0; idx < thread_count; idx++) {
+            if (decomp_param[idx].done) {
+                decomp_param[idx].done = false;
+                qemu_mutex_lock(&decomp_param[idx].mutex);
+                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
+                decomp_param[idx].des = host;
+                decomp_param[idx].len = len;
+                qemu_cond_signal(&decomp_param[idx].cond);
+                qemu_mutex_unlock(&decomp_param[idx].mutex);
                 break;
             }
+        }
+        if (idx < thread_count) {
+            break;
+        } else {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+}
 
-            rs->target_page_count += pages;
+static void load_batch_apply(LoadBatch *batch)
+{
+    int i;
 
-            /*
-             * During postcopy, it is necessary to make sure one whole host
-             * page is sent in one chunk.
-             */
-            if (migrate_postcopy_ram()) {
-                flush_compressed_data(rs);
-            }
+    for (i = 0; i < batch->count; i++) {
+        LoadPage *page = &batch->pages[i];
+        uint8_t *data = batch->buf + i * TARGET_PAGE_SIZE;
 
-            /*
-             * we want to check in the 1st loop, just in case it was the 1st
-             * time and we had to sync the dirty bitmap.
-             * qemu_clock_get_ns() is a bit expensive, so we only check each
-             * some iterations
-             */
-            if ((i & 63) == 0) {
-                uint64_t t1 = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) /
-                              1000000;
-                if (t1 > MAX_WAIT) {
-                    trace_ram_save_iterate_big_wait(t1, i);
-                    break;
-                }
+        switch (page->flags) {
+        case RAM_SAVE_FLAG_ZERO:
+            ram_handle_compressed(page->host, page->arg, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            memcpy(page->host, data, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_XBZRLE:
+            if (xbzrle_decode_buffer(data, page->arg, page->host,
+                                     TARGET_PAGE_SIZE) == -1) {
+                error_report("Failed to load XBZRLE page - decode error!");
+                qemu_file_set_error(load_file, -EINVAL);
             }
-            i++;
+            break;
+        default:
+            g_assert_not_reached();
         }
     }
+    batch->count = 0;
+}
 
-    /*
-     * Must occur before EOS (or any QEMUFile operation)
-     * because of RDMA protocol.
-     */
-    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
-
-out:
-    if (ret >= 0
-        && migration_is_setup_or_active(migrate_get_current()->state)) {
-        multifd_send_sync_main(rs->f);
-        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-        qemu_fflush(f);
-        ram_counters.transferred += 8;
+static void *do_data_load(void *opaque)
+{
+    LoadParam *param = opaque;
+    LoadBatch *batch;
 
-        ret = qemu_file_get_error(f);
-    }
-    if (ret < 0) {
-        return ret;
-    }
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->apply) {
+            batch = param->apply;
+            param->apply = NULL;
+            qemu_mutex_unlock(&param->mutex);
 
-    return done;
-}
+            load_batch_apply(batch);
 
-/**
- * ram_save_complete: function called to send the remaining amount of ram
- *
- * Returns zero to indicate success or negative on error
- *
- * Called with iothread lock
- *
- * @f: QEMUFile where to send the data
- * @opaque: RAMState pointer
- */
-static int ram_save_complete(QEMUFile *f, void *opaque)
-{
-    RAMState **temp = opaque;
-    RAMState *rs = *temp;
-    int ret = 0;
+            qemu_mutex_lock(&load_done_lock);
+            param->done = true;
+            qemu_cond_signal(&load_done_cond);
+            qemu_mutex_unlock(&load_done_lock);
 
-    WITH_RCU_READ_LOCK_GUARD() {
-        if (!migration_in_postcopy()) {
-            migration_bitmap_sync_precopy(rs);
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
         }
+    }
+    qemu_mutex_unlock(&param->mutex);
 
-        ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+    return NULL;
+}
 
-        /* try transferring iterative blocks of memory */
+/* Hand the batch filled for @param over to its thread */
+static void load_batch_dispatch(LoadParam *param)
+{
+    trace_ram_load_batch_dispatch(param - load_param, param->fill->count);
 
-        /* flush all remaining blocks regardless of rate limiting */
-        while (true) {
-            int pages;
+    qemu_mutex_lock(&load_done_lock);
+    while (!param->done) {
+        qemu_cond_wait(&load_done_cond, &load_done_lock);
+    }
+    param->done = false;
+    qemu_mutex_unlock(&load_done_lock);
 
-            pages = ram_find_and_save_block(rs, !migration_in_colo_state());
-            /* no more blocks to sent */
-            if (pages == 0) {
-                break;
-            }
-            if (pages < 0) {
-                ret = pages;
-                break;
-            }
-        }
+    qemu_mutex_lock(&param->mutex);
+    param->apply = param->fill;
+    param->fill = param->apply == &param->batches[0] ? &param->batches[1] :
+                                                        &param->batches[0];
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
 
-        flush_compressed_data(rs);
-        ram_control_after_iterate(f, RAM_CONTROL_FINISH);
-    }
+/*
+ * Reserve the entry of the page at @host in the batch of its load
+ * thread, and return where its payload goes
+ */
+static uint8_t *load_page_queue(void *host, int flags, unsigned int arg)
+{
+    uintptr_t chunk = (uintptr_t)host / (LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+    LoadParam *param = &load_param[chunk % load_thread_count];
+    LoadBatch *batch = param->fill;
+    LoadPage *page;
 
-    if (ret >= 0) {
-        multifd_send_sync_main(rs->f);
-        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-        qemu_fflush(f);
+    if (batch->count == LOAD_BATCH_PAGES) {
+        load_batch_dispatch(param);
+        batch = param->fill;
     }
 
-    return ret;
+    page = &batch->pages[batch->count];
+    page->host = host;
+    page->flags = flags;
+    page->arg = arg;
+    return batch->buf + batch->count++ * TARGET_PAGE_SIZE;
 }
 
-static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
-                             uint64_t *res_precopy_only,
-                             uint64_t *res_compatible,
-                             uint64_t *res_postcopy_only)
+/* Write all the queued pages and return the first error it hit */
+static int wait_for_load_done(void)
 {
-    RAMState **temp = opaque;
-    RAMState *rs = *temp;
-    uint64_t remaining_size;
+    int i;
 
-    remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+    if (!load_param) {
+        return 0;
+    }
 
-    if (!migration_in_postcopy() &&
-        remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        WITH_RCU_READ_LOCK_GUARD() {
-            migration_bitmap_sync_precopy(rs);
+    for (i = 0; i < load_thread_count; i++) {
+        if (load_param[i].fill->count) {
+            load_batch_dispatch(&load_param[i]);
         }
-        qemu_mutex_unlock_iothread();
-        remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
     }
 
-    if (migrate_postcopy_ram()) {
-        /* We can do postcopy, and all the data is postcopiable */
-        *res_compatible += remaining_size;
-    } else {
-        *res_precopy_only += remaining_size;
+    qemu_mutex_lock(&load_done_lock);
+    for (i = 0; i < load_thread_count; i++) {
+        while (!load_param[i].done) {
+            qemu_cond_wait(&load_done_cond, &load_done_lock);
+        }
     }
+    qemu_mutex_unlock(&load_done_lock);
+    return qemu_file_get_error(load_file);
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+static void load_threads_cleanup(void)
 {
-    unsigned int xh_len;
-    int xh_flags;
-    uint8_t *loaded_data;
-
-    /* extract RLE header */
-    xh_flags = qemu_get_byte(f);
-    xh_len = qemu_get_be16(f);
+    int i, j;
 
-    if (xh_flags != ENCODING_FLAG_XBZRLE) {
-        error_report("Failed to load XBZRLE page - wrong compression!");
-        return -1;
+    if (!load_param) {
+        return;
     }
 
-    if (xh_len > TARGET_PAGE_SIZE) {
-        error_report("Failed to load XBZRLE page - len overflow!");
-        return -1;
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_lock(&load_param[i].mutex);
+        load_param[i].quit = true;
+        qemu_cond_signal(&load_param[i].cond);
+        qemu_mutex_unlock(&load_param[i].mutex);
     }
-    loaded_data = XBZRLE.decoded_buf;
-    /* load data and decode */
-    /* it can change loaded_data to point to an internal buffer */
-    qemu_get_buffer_in_place(f, &loaded_data, xh_len);
-
-    /* decode RLE */
-    if (xbzrle_decode_buffer(loaded_data, xh_len, host,
-                             TARGET_PAGE_SIZE) == -1) {
-        error_report("Failed to load XBZRLE page - decode error!");
-        return -1;
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_thread_join(load_threads + i);
+        qemu_mutex_destroy(&load_param[i].mutex);
+        qemu_cond_destroy(&load_param[i].cond);
+        for (j = 0; j < ARRAY_SIZE(load_param[i].batches); j++) {
+            g_free(load_param[i].batches[j].buf);
+        }
     }
-
-    return 0;
+    qemu_mutex_destroy(&load_done_lock);
+    qemu_cond_destroy(&load_done_cond);
+    g_free(load_threads);
+    g_free(load_param);
+    load_threads = NULL;
+    load_param = NULL;
+    load_thread_count = 0;
+    load_file = NULL;
 }
 
-/**
- * ram_block_from_stream: read a RAMBlock id from the migration stream
- *
- * Must be called from within a rcu critical section.
- *
- * Returns a pointer from within the RCU-protected ram_list.
- *
- * @f: QEMUFile where to read the data from
- * @flags: Page flags (mostly to see if it's a continuation of previous block)
- */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static void load_threads_setup(QEMUFile *f)
 {
-    static RAMBlock *block;
-    char id[256];
-    uint8_t len;
+    int i, j;
 
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            error_report("Ack, bad migration stream!");
-            return NULL;
-        }
-        return block;
+    /* The decompress threads would write pages behind the load threads */
+    if (!migrate_load_threads() || migrate_use_compression()) {
+        return;
     }
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
-
-    block = qemu_ram_block_by_name(id);
-    if (!block) {
-        error_report("Can't find block %s", id);
-        return NULL;
+    load_thread_count = migrate_load_threads();
+    load_threads = g_new0(QemuThread, load_thread_count);
+    load_param = g_new0(LoadParam, load_thread_count);
+    qemu_mutex_init(&load_done_lock);
+    qemu_cond_init(&load_done_cond);
+    load_file = f;
+    for (i = 0; i < load_thread_count; i++) {
+        for (j = 0; j < ARRAY_SIZE(load_param[i].batches); j++) {
+            load_param[i].batches[j].buf =
+                g_malloc(LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+        }
+        load_param[i].fill = &load_param[i].batches[0];
+        qemu_mutex_init(&load_param[i].mutex);
+        qemu_cond_init(&load_param[i].cond);
+        load_param[i].done = true;
+        thread_context_create_thread(THREAD_GROUP_MIGRATION,
+                                     load_threads + i, "mig/load",
+                                     do_data_load, load_param + i);
     }
+}
 
-    if (ramblock_is_ignored(block)) {
-        error_report("block %s should not be migrated !", id);
-        return NULL;
-    }
+/*
+ * RAM pre-population
+ *
+ * With prepopulate-threads, the guest RAM of the destination is
+ * populated with MADV_POPULATE_WRITE from the start of the incoming
+ * migration, so that the pages that arrive don't fault each on its own
+ * and serialize on the mm locks.  The RAM blocks are split in chunks
+ * that the threads pick up in turn.  MADV_POPULATE_WRITE doesn't change
+ * the contents of the pages, so it can race with the pages being
+ * loaded; the runs of pages that were received already, zero pages
+ * included, are skipped.
+ */
 
-    return block;
-}
+/* Size of a chunk in target pages, at least a host page of the block */
+#define PREPOPULATE_CHUNK_PAGES (1UL << 12)
 
-static inline void *host_from_ram_block_offset(RAMBlock *block,
-                                               ram_addr_t offset)
-{
-    if (!offset_in_ramblock(block, offset)) {
-        return NULL;
-    }
+typedef struct {
+    RAMBlock *block;
+    unsigned long start;
+    unsigned long end;
+} PrepopulateChunk;
 
-    return block->host + offset;
+static struct {
+    int thread_count;
+    QemuThread *threads;
+    GArray *chunks;
+    /* index of the next chunk to populate */
+    unsigned int next_chunk;
+    /* bytes populated, for the trace */
+    size_t bytes;
+    int64_t start_ms;
+    bool quit;
+} prepopulate;
+
+/* Returns false if the host can't populate the chunk */
+static bool prepopulate_chunk(PrepopulateChunk *chunk)
+{
+    RAMBlock *block = chunk->block;
+    unsigned long page = chunk->start, run_end;
+    ram_addr_t start, end;
+    unsigned long *map;
+
+    while (page < chunk->end && !qatomic_read(&prepopulate.quit)) {
+        map = qatomic_read(&block->receivedmap);
+        run_end = chunk->end;
+        if (map) {
+            page = find_next_zero_bit(map, chunk->end, page);
+            if (page >= chunk->end) {
+                break;
+            }
+            run_end = find_next_bit(map, chunk->end, page);
+        }
+        start = ROUND_DOWN((ram_addr_t)page << TARGET_PAGE_BITS,
+                           block->page_size);
+        end = ROUND_UP((ram_addr_t)run_end << TARGET_PAGE_BITS,
+                       block->page_size);
+        if (qemu_madvise(block->host + start, end - start,
+                         QEMU_MADV_POPULATE_WRITE)) {
+            if (errno == EINVAL) {
+                warn_report_once("prepopulate-threads: the host can't "
+                                 "populate guest RAM ahead");
+            }
+            trace_ram_prepopulate_error(block->idstr, start, errno);
+            return false;
+        }
+        qatomic_add(&prepopulate.bytes, end - start);
+        page = run_end;
+    }
+    return true;
 }
 
-static void *host_page_from_ram_block_offset(RAMBlock *block,
-                                             ram_addr_t offset)
+static void *prepopulate_thread(void *opaque)
 {
-    /* Note: Explicitly no check against offset_in_ramblock(). */
-    return (void *)QEMU_ALIGN_DOWN((uintptr_t)(block->host + offset),
-                                   block->page_size);
-}
+    unsigned int i;
 
-static ram_addr_t host_page_offset_from_ram_block_offset(RAMBlock *block,
-                                                         ram_addr_t offset)
-{
-    return ((uintptr_t)block->host + offset) & (block->page_size - 1);
+    rcu_register_thread();
+    while (!qatomic_read(&prepopulate.quit) &&
+           (i = qatomic_fetch_inc(&prepopulate.next_chunk)) <
+           prepopulate.chunks->len) {
+        if (!prepopulate_chunk(&g_array_index(prepopulate.chunks,
+                                              PrepopulateChunk, i))) {
+            /* Nothing else is going to work either */
+            qatomic_set(&prepopulate.quit, true);
+        }
+    }
+    rcu_unregister_thread();
+
+    return NULL;
 }
 
-static inline void *colo_cache_from_block_offset(RAMBlock *block,
-                             ram_addr_t offset, bool record_bitmap)
+/**
+ * ram_prepopulate_start: start populating the guest RAM of the
+ * destination with prepopulate-threads threads
+ *
+ * Called from the main thread when the incoming migration starts.
+ */
+void ram_prepopulate_start(void)
 {
-    if (!offset_in_ramblock(block, offset)) {
-        return NULL;
+    PrepopulateChunk chunk;
+    unsigned long pages, chunk_pages;
+    RAMBlock *block;
+    int i;
+
+    /* The pages of fixed-ram may be mapped from the file instead */
+    if (!migrate_prepopulate_threads() || prepopulate.threads ||
+        migrate_fixed_ram()) {
+        return;
     }
-    if (!block->colo_cache) {
-        error_report("%s: colo_cache is NULL in block :%s",
-                     __func__, block->idstr);
-        return NULL;
+
+    prepopulate.chunks = g_array_new(false, false, sizeof(PrepopulateChunk));
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            pages = block->used_length >> TARGET_PAGE_BITS;
+            chunk_pages = MAX(PREPOPULATE_CHUNK_PAGES,
+                              block->page_size >> TARGET_PAGE_BITS);
+            chunk.block = block;
+            for (chunk.start = 0; chunk.start < pages;
+                 chunk.start += chunk_pages) {
+                chunk.end = MIN(chunk.start + chunk_pages, pages);
+                g_array_append_val(prepopulate.chunks, chunk);
+            }
+        }
     }
 
-    /*
-    * During colo checkpoint, we need bitmap of these migrated pages.
-    * It help us to decide which pages in ram cache should be flushed
-    * into VM's RAM later.
-    */
-    if (record_bitmap &&
-        !test_and_set_bit(offset >> TARGET_PAGE_BITS, block->bmap)) {
-        ram_state->migration_dirty_pages++;
+    prepopulate.thread_count = migrate_prepopulate_threads();
+    prepopulate.threads = g_new0(QemuThread, prepopulate.thread_count);
+    prepopulate.next_chunk = 0;
+    prepopulate.bytes = 0;
+    prepopulate.start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    prepopulate.quit = false;
+    for (i = 0; i < prepopulate.thread_count; i++) {
+        thread_context_create_thread(THREAD_GROUP_MIGRATION,
+                                     &prepopulate.threads[i],
+                                     "mig/prepopulate", prepopulate_thread,
+                                     NULL);
     }
-    return block->colo_cache + offset;
 }
 
 /**
- * ram_handle_compressed: handle the zero page case
+ * ram_prepopulate_stop: stop populating the guest RAM and wait for the
+ * threads
  *
- * If a page (or a whole RDMA chunk) has been
- * determined to be zero, then zap it.
+ * Called when the load ends, before the received maps go away, and
+ * before postcopy registers the guest RAM with userfaultfd.
+ */
+void ram_prepopulate_stop(void)
+{
+    int i;
+
+    if (!prepopulate.threads) {
+        return;
+    }
+
+    qatomic_set(&prepopulate.quit, true);
+    for (i = 0; i < prepopulate.thread_count; i++) {
+        qemu_thread_join(&prepopulate.threads[i]);
+    }
+    trace_ram_prepopulate_stop(prepopulate.bytes,
+                               MIN(prepopulate.next_chunk,
+                                   prepopulate.chunks->len),
+                               prepopulate.chunks->len,
+                               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                               prepopulate.start_ms);
+    g_array_free(prepopulate.chunks, true);
+    g_free(prepopulate.threads);
+    memset(&prepopulate, 0, sizeof(prepopulate));
+}
+
+/*
+ * Huge page collapse
  *
- * @host: host address for the zero page
- * @ch: what the page is filled from.  We only support zero
- * @size: size of the zero page
+ * With ram-huge-page-granularity, the source sends the RAM that small
+ * host pages back a whole transparent huge page at a time, but the
+ * destination still maps what it receives with small pages: precopy
+ * writes the pages one at a time as they arrive, and postcopy places
+ * them with UFFDIO_COPY.  khugepaged collapses them eventually, at a
+ * few MiB per second.  Once the VM runs, a thread collapses them with
+ * MADV_COLLAPSE instead.  The huge pages that have no memory in them
+ * are skipped, so that the zero pages that the source didn't send are
+ * not allocated after all.
  */
-void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+
+typedef struct {
+    RAMBlock *block;
+    /* number of whole huge pages in the block */
+    ram_addr_t pages;
+} CollapseBlock;
+
+static struct {
+    QemuThread thread;
+    /* The RAMBlocks to collapse, with a reference; NULL once joined */
+    GArray *blocks;
+    bool started;
+    bool quit;
+    bool done;
+    /* Huge pages with memory in them that were checked so far */
+    Stat64 populated;
+    /* How many of them are mapped with a huge page now */
+    Stat64 collapsed;
+} ram_collapse;
+
+#ifdef CONFIG_LINUX
+static bool ram_collapse_populated(void *host, unsigned char *vec,
+                                   size_t nr_pages)
 {
-    if (ch != 0 || !is_zero_range(host, size)) {
-        memset(host, ch, size);
+    size_t i;
+
+    /* Let MADV_COLLAPSE decide if mincore() can't */
+    if (mincore(host, QEMU_VMALLOC_ALIGN, vec)) {
+        return true;
+    }
+    for (i = 0; i < nr_pages; i++) {
+        if (vec[i] & 1) {
+            return true;
+        }
     }
+    return false;
 }
 
-/* return the size after decompression, or negative value on error */
-static int
-qemu_uncompress_data(z_stream *stream, uint8_t *dest, size_t dest_len,
-                     const uint8_t *source, size_t source_len)
+static void ram_collapse_block(CollapseBlock *cb, unsigned char *vec,
+                               size_t nr_pages)
 {
-    int err;
+    ram_addr_t page;
 
-    err = inflateReset(stream);
-    if (err != Z_OK) {
-        return -1;
+    for (page = 0; page < cb->pages && !qatomic_read(&ram_collapse.quit);
+         page++) {
+        void *host = cb->block->host + page * QEMU_VMALLOC_ALIGN;
+
+        if (!ram_collapse_populated(host, vec, nr_pages)) {
+            continue;
+        }
+        stat64_add(&ram_collapse.populated, 1);
+        if (!qemu_madvise(host, QEMU_VMALLOC_ALIGN, QEMU_MADV_COLLAPSE)) {
+            stat64_add(&ram_collapse.collapsed, 1);
+            continue;
+        }
+        trace_ram_collapse_error(cb->block->idstr, page * QEMU_VMALLOC_ALIGN,
+                                 errno);
+        /*
+         * The kernel doesn't support MADV_COLLAPSE, or not for this
+         * mapping.  EAGAIN and ENOMEM only hold for this huge page.
+         */
+        if (errno == EINVAL) {
+            return;
+        }
     }
+}
 
-    stream->avail_in = source_len;
-    stream->next_in = (uint8_t *)source;
-    stream->avail_out = dest_len;
-    stream->next_out = dest;
+static void ram_collapse_join_bh(void *opaque);
 
-    err = inflate(stream, Z_NO_FLUSH);
-    if (err != Z_STREAM_END) {
-        return -1;
+static void *ram_collapse_thread(void *opaque)
+{
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    size_t nr_pages = QEMU_VMALLOC_ALIGN / qemu_real_host_page_size;
+    g_autofree unsigned char *vec = g_malloc(nr_pages);
+    guint i;
+
+    for (i = 0; i < ram_collapse.blocks->len &&
+         !qatomic_read(&ram_collapse.quit); i++) {
+        ram_collapse_block(&g_array_index(ram_collapse.blocks,
+                                          CollapseBlock, i),
+                           vec, nr_pages);
     }
+    trace_ram_collapse_done(stat64_get(&ram_collapse.populated),
+                            stat64_get(&ram_collapse.collapsed),
+                            qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start);
+    qatomic_set(&ram_collapse.done, true);
 
-    return stream->total_out;
+    /* The RAMBlocks are dropped from the main loop */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), ram_collapse_join_bh,
+                            NULL);
+    return NULL;
 }
 
-static void *do_data_decompress(void *opaque)
+static void ram_collapse_join(void)
 {
-    DecompressParam *param = opaque;
-    unsigned long pagesize;
-    uint8_t *des;
-    int len, ret;
+    guint i;
 
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->des) {
-            des = param->des;
-            len = param->len;
-            param->des = 0;
-            qemu_mutex_unlock(&param->mutex);
+    if (!ram_collapse.blocks) {
+        return;
+    }
+    qemu_thread_join(&ram_collapse.thread);
+    for (i = 0; i < ram_collapse.blocks->len; i++) {
+        memory_region_unref(g_array_index(ram_collapse.blocks,
+                                          CollapseBlock, i).block->mr);
+    }
+    g_array_free(ram_collapse.blocks, true);
+    ram_collapse.blocks = NULL;
+}
 
-            pagesize = TARGET_PAGE_SIZE;
+static void ram_collapse_join_bh(void *opaque)
+{
+    ram_collapse_join();
+}
 
-            ret = qemu_uncompress_data(&param->stream, des, pagesize,
-                                       param->compbuf, len);
-            if (ret < 0 && migrate_get_current()->decompress_error_check) {
-                error_report("decompress data failed");
-                qemu_file_set_error(decomp_file, ret);
-            }
+/**
+ * ram_collapse_start: collapse the guest RAM of the destination into
+ * transparent huge pages, in the background
+ *
+ * Called once the incoming migration is done, with the BQL held.
+ */
+void ram_collapse_start(void)
+{
+    CollapseBlock cb;
+    RAMBlock *block;
 
-            qemu_mutex_lock(&decomp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&decomp_done_cond);
-            qemu_mutex_unlock(&decomp_done_lock);
+    if (!migrate_ram_huge_page_granularity() || ram_collapse.started ||
+        QEMU_MADV_COLLAPSE == QEMU_MADV_INVALID) {
+        return;
+    }
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
+    ram_collapse.blocks = g_array_new(false, false, sizeof(CollapseBlock));
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            if (qemu_ram_is_shared(block) ||
+                ramblock_migration_pagesize(block) ==
+                qemu_ram_pagesize(block)) {
+                continue;
+            }
+            cb.block = block;
+            cb.pages = block->used_length / QEMU_VMALLOC_ALIGN;
+            memory_region_ref(block->mr);
+            g_array_append_val(ram_collapse.blocks, cb);
         }
     }
-    qemu_mutex_unlock(&param->mutex);
+    if (!ram_collapse.blocks->len) {
+        g_array_free(ram_collapse.blocks, true);
+        ram_collapse.blocks = NULL;
+        return;
+    }
 
-    return NULL;
+    trace_ram_collapse_start(ram_collapse.blocks->len);
+    ram_collapse.started = true;
+    thread_context_create_thread(THREAD_GROUP_MIGRATION, &ram_collapse.thread,
+                                 "mig/collapse", ram_collapse_thread, NULL);
 }
 
-static int wait_for_decompress_done(void)
+/**
+ * ram_collapse_stop: stop collapsing the guest RAM and wait for the thread
+ *
+ * Called from the main thread when QEMU quits.
+ */
+void ram_collapse_stop(void)
 {
-    int idx, thread_count;
+    qatomic_set(&ram_collapse.quit, true);
+    ram_collapse_join();
+}
+#else
+void ram_collapse_start(void)
+{
+}
 
-    if (!migrate_use_compression()) {
-        return 0;
+void ram_collapse_stop(void)
+{
+}
+#endif
+
+/**
+ * ram_collapse_info: the huge pages of the guest RAM of the destination,
+ * or NULL if they were not collapsed
+ */
+MigrationHugePageStats *ram_collapse_info(void)
+{
+    MigrationHugePageStats *stats;
+
+    if (!ram_collapse.started) {
+        return NULL;
     }
+    stats = g_new0(MigrationHugePageStats, 1);
+    stats->populated = stat64_get(&ram_collapse.populated);
+    stats->collapsed = stat64_get(&ram_collapse.collapsed);
+    stats->active = !qatomic_read(&ram_collapse.done);
+    return stats;
+}
 
-    thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!decomp_param[idx].done) {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+/*
+ * COLO flush threads
+ *
+ * At each checkpoint, the pages that the PVM sent or that the SVM
+ * dirtied are copied from the RAM cache into the memory of the SVM
+ * while both VMs are stopped.  The RAMBlocks are split in chunks that
+ * the COLO incoming thread and colo-flush-threads - 1 helper threads
+ * pick up in turn, like the bitmap sync threads do.  Chunks start on a
+ * word of the bitmap, so no two threads ever write the same word of it.
+ */
+
+/* Size of a chunk in target pages, a multiple of BITS_PER_LONG */
+#define COLO_FLUSH_CHUNK_PAGES (1UL << 15)
+
+typedef struct {
+    RAMBlock *block;
+    unsigned long start;
+    unsigned long end;
+} ColoFlushChunk;
+
+typedef struct {
+    QemuThread thread;
+    /* posted by the COLO incoming thread when there are chunks to flush */
+    QemuSemaphore sem;
+    /* pages copied by this thread during the last flush */
+    uint64_t num_pages;
+} ColoFlushParam;
+
+static struct {
+    int thread_count;
+    ColoFlushParam *params;
+    /* chunks of the current flush, rebuilt on each flush */
+    GArray *chunks;
+    /* index of the next chunk to flush */
+    unsigned int next_chunk;
+    /* posted by each helper thread when there are no chunks left */
+    QemuSemaphore done_sem;
+    bool quit;
+} colo_flush;
+
+static uint64_t colo_flush_chunks(void)
+{
+    uint64_t num_pages = 0;
+    unsigned int i;
+
+    while ((i = qatomic_fetch_inc(&colo_flush.next_chunk)) <
+           colo_flush.chunks->len) {
+        ColoFlushChunk *chunk = &g_array_index(colo_flush.chunks,
+                                               ColoFlushChunk, i);
+        RAMBlock *block = chunk->block;
+        unsigned long page = chunk->start, run_end;
+
+        /* Copy runs of dirty pages at once */
+        while ((page = find_next_bit(block->bmap, chunk->end, page)) <
+               chunk->end) {
+            ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+
+            run_end = find_next_zero_bit(block->bmap, chunk->end, page);
+            bitmap_clear(block->bmap, page, run_end - page);
+            memcpy(block->host + offset, block->colo_cache + offset,
+                   (ram_addr_t)(run_end - page) << TARGET_PAGE_BITS);
+            num_pages += run_end - page;
+            page = run_end;
         }
     }
-    qemu_mutex_unlock(&decomp_done_lock);
-    return qemu_file_get_error(decomp_file);
+    return num_pages;
 }
 
-static void compress_threads_load_cleanup(void)
+static void *colo_flush_thread(void *opaque)
 {
-    int i, thread_count;
+    ColoFlushParam *p = opaque;
 
-    if (!migrate_use_compression()) {
-        return;
-    }
-    thread_count = migrate_decompress_threads();
-    for (i = 0; i < thread_count; i++) {
-        /*
-         * we use it as a indicator which shows if the thread is
-         * properly init'd or not
-         */
-        if (!decomp_param[i].compbuf) {
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        if (qatomic_read(&colo_flush.quit)) {
             break;
         }
-
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        decomp_param[i].quit = true;
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
-    }
-    for (i = 0; i < thread_count; i++) {
-        if (!decomp_param[i].compbuf) {
-            break;
+        WITH_RCU_READ_LOCK_GUARD() {
+            p->num_pages = colo_flush_chunks();
         }
-
-        qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        inflateEnd(&decomp_param[i].stream);
-        g_free(decomp_param[i].compbuf);
-        decomp_param[i].compbuf = NULL;
+        qemu_sem_post(&colo_flush.done_sem);
     }
-    g_free(decompress_threads);
-    g_free(decomp_param);
-    decompress_threads = NULL;
-    decomp_param = NULL;
-    decomp_file = NULL;
+    rcu_unregister_thread();
+
+    return NULL;
 }
 
-static int compress_threads_load_setup(QEMUFile *f)
+static void colo_flush_threads_cleanup(void)
 {
-    int i, thread_count;
+    int i;
 
-    if (!migrate_use_compression()) {
-        return 0;
+    if (!colo_flush.chunks) {
+        return;
     }
 
-    thread_count = migrate_decompress_threads();
-    decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
-    qemu_mutex_init(&decomp_done_lock);
-    qemu_cond_init(&decomp_done_cond);
-    decomp_file = f;
-    for (i = 0; i < thread_count; i++) {
-        if (inflateInit(&decomp_param[i].stream) != Z_OK) {
-            goto exit;
-        }
-
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].done = true;
-        decomp_param[i].quit = false;
-        qemu_thread_create(decompress_threads + i, "decompress",
-                           do_data_decompress, decomp_param + i,
-                           QEMU_THREAD_JOINABLE);
+    qatomic_set(&colo_flush.quit, true);
+    for (i = 0; i < colo_flush.thread_count; i++) {
+        qemu_sem_post(&colo_flush.params[i].sem);
     }
-    return 0;
-exit:
-    compress_threads_load_cleanup();
-    return -1;
+    for (i = 0; i < colo_flush.thread_count; i++) {
+        qemu_thread_join(&colo_flush.params[i].thread);
+        qemu_sem_destroy(&colo_flush.params[i].sem);
+    }
+    qemu_sem_destroy(&colo_flush.done_sem);
+    g_array_free(colo_flush.chunks, true);
+    g_free(colo_flush.params);
+    memset(&colo_flush, 0, sizeof(colo_flush));
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+static void colo_flush_threads_setup(void)
 {
-    int idx, thread_count;
+    int i, thread_count = migrate_colo_flush_threads() - 1;
 
-    thread_count = migrate_decompress_threads();
-    QEMU_LOCK_GUARD(&decomp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (decomp_param[idx].done) {
-                decomp_param[idx].done = false;
-                qemu_mutex_lock(&decomp_param[idx].mutex);
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                qemu_cond_signal(&decomp_param[idx].cond);
-                qemu_mutex_unlock(&decomp_param[idx].mutex);
-                break;
-            }
-        }
-        if (idx < thread_count) {
-            break;
-        } else {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
-        }
+    colo_flush.thread_count = MAX(thread_count, 0);
+    colo_flush.params = g_new0(ColoFlushParam, colo_flush.thread_count);
+    colo_flush.chunks = g_array_new(false, false, sizeof(ColoFlushChunk));
+    qemu_sem_init(&colo_flush.done_sem, 0);
+    for (i = 0; i < colo_flush.thread_count; i++) {
+        qemu_sem_init(&colo_flush.params[i].sem, 0);
+        thread_context_create_thread(THREAD_GROUP_MIGRATION,
+                                     &colo_flush.params[i].thread,
+                                     "colo/flush", colo_flush_thread,
+                                     &colo_flush.params[i]);
     }
 }
 
@@ -3374,6 +6219,7 @@ int colo_init_ram_cache(void)
     }
 
     colo_init_ram_state();
+    colo_flush_threads_setup();
     return 0;
 }
 
@@ -3392,7 +6238,7 @@ void colo_incoming_start_dirty_log(void)
             /* Discard this dirty bitmap record */
             bitmap_zero(block->bmap, block->max_length >> TARGET_PAGE_BITS);
         }
-        memory_global_dirty_log_start();
+        memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
     }
     ram_state->migration_dirty_pages = 0;
     qemu_mutex_unlock_ramlist();
@@ -3404,7 +6250,8 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
-    memory_global_dirty_log_stop();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
+    colo_flush_threads_cleanup();
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
@@ -3421,6 +6268,18 @@ void colo_release_ram_cache(void)
     ram_state_cleanup(&ram_state);
 }
 
+/* The pages of a fixed-ram file that are loaded after the guest starts */
+static struct {
+    QIOChannel *ioc;
+    /* serializes the fault thread and the prefetch thread */
+    QemuMutex lock;
+    /* host page read from the file before it is placed */
+    uint8_t *buf;
+    QemuThread thread;
+    QEMUBH *bh;
+    bool active;
+} fixed_ram_postcopy;
+
 /**
  * ram_load_setup: Setup RAM for migration incoming side
  *
@@ -3437,6 +6296,26 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
 
     xbzrle_load_setup();
     ramblock_recv_map_init();
+    load_threads_setup(f);
+
+    if (migrate_page_dedup()) {
+        const char *store = migrate_page_dedup_store();
+        Error *local_err = NULL;
+
+        if (!store || !*store) {
+            error_report("page-dedup needs a page-dedup-store");
+            return -1;
+        }
+        if (ram_dedup_store_open(store, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
+    /* The writes of the load are not logged */
+    ram_incremental_reset();
+    ram_incremental.load_base = ram_incremental.loaded;
+    ram_incremental.loaded = 0;
 
     return 0;
 }
@@ -3451,7 +6330,14 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    load_threads_cleanup();
+    ram_prepopulate_stop();
+    ram_dedup_store_close();
 
+    /* The pages loaded after the guest starts are still tracked */
+    if (fixed_ram_postcopy.active) {
+        return 0;
+    }
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
         rb->receivedmap = NULL;
@@ -3473,6 +6359,8 @@ static int ram_load_cleanup(void *opaque)
  */
 int ram_postcopy_incoming_init(MigrationIncomingState *mis)
 {
+    /* Populated pages would get in the way of placing the pages */
+    ram_prepopulate_stop();
     return postcopy_ram_incoming_init(mis);
 }
 
@@ -3481,19 +6369,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the preempt thread
+ * for the postcopy-preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel that @f belongs to
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = mis->postcopy_tmp_pages[channel];
     void *host_page = NULL;
     bool all_zero = true;
     int target_pages = 0;
@@ -3523,7 +6413,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
             if (!block) {
                 ret = -EINVAL;
                 break;
@@ -3551,9 +6441,16 @@ static int ram_load_postcopy(QEMUFile *f)
              * The migration protocol uses,  possibly smaller, target-pages
              * however the source ensures it always sends all the components
              * of a host page in one chunk.
+             * With an alias, the page is read in place instead: the guest
+             * can't see it until it is mapped with UFFDIO_CONTINUE.
              */
-            page_buffer = postcopy_host_page +
-                          host_page_offset_from_ram_block_offset(block, addr);
+            if (block->postcopy_alias) {
+                page_buffer = block->postcopy_alias + addr;
+            } else {
+                page_buffer = postcopy_host_page +
+                              host_page_offset_from_ram_block_offset(block,
+                                                                     addr);
+            }
             /* If all TP are zero then we can optimise the place */
             if (target_pages == 1) {
                 host_page = host_page_from_ram_block_offset(block, addr);
@@ -3612,7 +6509,7 @@ static int ram_load_postcopy(QEMUFile *f)
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             all_zero = false;
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > decompress_bound()) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -3620,9 +6517,15 @@ static int ram_load_postcopy(QEMUFile *f)
             decompress_data_with_multi_threads(f, page_buffer, len);
             break;
 
+        case RAM_SAVE_FLAG_MULTIFD_FLUSH:
+            multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY &&
+                migrate_multifd_flush_after_each_section()) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3642,8 +6545,14 @@ static int ram_load_postcopy(QEMUFile *f)
         }
 
         if (!ret && place_needed) {
-            if (all_zero) {
+            if (block->postcopy_alias) {
+                ret = postcopy_place_page_alias(mis, host_page, block);
+            } else if (all_zero) {
                 ret = postcopy_place_page_zero(mis, host_page, block);
+            } else if (mis->postcopy_batches[channel] &&
+                       matches_target_page_size) {
+                ret = postcopy_place_page_batch(mis, channel, host_page,
+                                                place_source, block);
             } else {
                 ret = postcopy_place_page(mis, host_page, place_source,
                                           block);
@@ -3653,6 +6562,18 @@ static int ram_load_postcopy(QEMUFile *f)
             /* Assume we have a zero page until we detect something different */
             all_zero = true;
         }
+
+        /*
+         * The guest may be waiting for the pages of the batch: place them
+         * before a read that could wait for the source.
+         */
+        if (!ret && qemu_file_buffered(f) < RAM_LOAD_PAGE_RECORD_MAX) {
+            ret = postcopy_place_page_flush(mis, channel);
+        }
+    }
+
+    if (!ret) {
+        ret = postcopy_place_page_flush(mis, channel);
     }
 
     return ret;
@@ -3677,9 +6598,8 @@ static bool postcopy_is_running(void)
 void colo_flush_ram_cache(void)
 {
     RAMBlock *block = NULL;
-    void *dst_host;
-    void *src_host;
-    unsigned long offset = 0;
+    uint64_t num_pages;
+    int i;
 
     memory_global_dirty_log_sync();
     WITH_RCU_READ_LOCK_GUARD() {
@@ -3690,26 +6610,468 @@ void colo_flush_ram_cache(void)
 
     trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
     WITH_RCU_READ_LOCK_GUARD() {
-        block = QLIST_FIRST_RCU(&ram_list.blocks);
+        g_array_set_size(colo_flush.chunks, 0);
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+            unsigned long start;
 
-        while (block) {
-            offset = migration_bitmap_find_dirty(ram_state, block, offset);
+            for (start = 0; start < pages; start += COLO_FLUSH_CHUNK_PAGES) {
+                ColoFlushChunk chunk = {
+                    .block = block,
+                    .start = start,
+                    .end = MIN(start + COLO_FLUSH_CHUNK_PAGES, pages),
+                };
 
-            if (!offset_in_ramblock(block,
-                                    ((ram_addr_t)offset) << TARGET_PAGE_BITS)) {
-                offset = 0;
-                block = QLIST_NEXT_RCU(block, next);
-            } else {
-                migration_bitmap_clear_dirty(ram_state, block, offset);
-                dst_host = block->host
-                         + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                src_host = block->colo_cache
-                         + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                memcpy(dst_host, src_host, TARGET_PAGE_SIZE);
+                g_array_append_val(colo_flush.chunks, chunk);
+            }
+        }
+
+        colo_flush.next_chunk = 0;
+        for (i = 0; i < colo_flush.thread_count; i++) {
+            qemu_sem_post(&colo_flush.params[i].sem);
+        }
+
+        num_pages = colo_flush_chunks();
+
+        for (i = 0; i < colo_flush.thread_count; i++) {
+            qemu_sem_wait(&colo_flush.done_sem);
+        }
+        for (i = 0; i < colo_flush.thread_count; i++) {
+            num_pages += colo_flush.params[i].num_pages;
+        }
+    }
+    /*
+     * The bitmaps are all clear now.  The multifd receive threads don't
+     * count the pages they put in the cache, so don't subtract.
+     */
+    ram_state->migration_dirty_pages = 0;
+    trace_colo_flush_ram_cache_end(num_pages, colo_flush.thread_count + 1);
+}
+
+/*
+ * With COLO, the multifd receive threads put the pages of checkpoints
+ * in the RAM cache, and mark them for colo_flush_ram_cache() like
+ * ram_load_precopy() does.  Returns where the page at @offset of
+ * @block is received.
+ */
+void *colo_cache_recv_host(RAMBlock *block, ram_addr_t offset)
+{
+    set_bit_atomic(offset >> TARGET_PAGE_BITS, block->bmap);
+    return block->colo_cache + offset;
+}
+
+/*
+ * Before the first checkpoint, the pages received in guest RAM at
+ * @host are also copied to the RAM cache.
+ */
+void colo_cache_backup_page(RAMBlock *block, void *host)
+{
+    ram_addr_t offset = (uint8_t *)host - block->host;
+
+    memcpy(block->colo_cache + offset, host, TARGET_PAGE_SIZE);
+}
+
+typedef struct {
+    QemuThread thread;
+    QEMUFile *f;
+    RAMBlock *block;
+    unsigned long *bmap;
+    off_t pages_offset;
+    /* map the pages from the file instead of reading them */
+    bool mmap;
+    /* range of pages read by this thread */
+    unsigned long start;
+    unsigned long end;
+    Error *err;
+} FixedRamLoadParam;
+
+static void *fixed_ram_load_thread(void *opaque)
+{
+    FixedRamLoadParam *param = opaque;
+    RAMBlock *block = param->block;
+    unsigned long run = param->start, run_end;
+
+    while (run < param->end) {
+        void *host = block->host + ((ram_addr_t)run << TARGET_PAGE_BITS);
+        size_t len;
+        off_t pos;
+        int ret;
+
+        /* The pages that are not in the file are zero */
+        run_end = find_next_bit(param->bmap, param->end, run);
+        len = (ram_addr_t)(run_end - run) << TARGET_PAGE_BITS;
+        if (len && !ramblock_recv_page_is_pristine(block, host)) {
+            ram_handle_compressed(host, 0, len);
+        }
+        run = run_end;
+        if (run == param->end) {
+            break;
+        }
+
+        host = block->host + ((ram_addr_t)run << TARGET_PAGE_BITS);
+        run_end = find_next_zero_bit(param->bmap, param->end, run);
+        len = (ram_addr_t)(run_end - run) << TARGET_PAGE_BITS;
+        pos = param->pages_offset + ((ram_addr_t)run << TARGET_PAGE_BITS);
+        if (param->mmap) {
+            ret = file_mmap_private(qemu_file_get_ioc(param->f), host, len,
+                                    pos, &param->err);
+        } else {
+            ret = qemu_file_read_at(param->f, host, len, pos, &param->err);
+        }
+        if (ret < 0) {
+            break;
+        }
+        ramblock_recv_bitmap_set_range(block, host, run_end - run);
+        run = run_end;
+    }
+
+    return NULL;
+}
+
+/*
+ * Whether the pages of @block can be mapped from the migration file
+ * at @pages_offset: the mapping replaces the memory of anonymous
+ * blocks only, one host page at a time.
+ */
+static bool fixed_ram_can_mmap(QEMUFile *f, RAMBlock *block,
+                               uint64_t pages_offset)
+{
+    return migrate_fixed_ram_mmap() && qemu_file_get_ioc(f) &&
+           block->fd < 0 && !qemu_ram_is_shared(block) &&
+           qemu_ram_pagesize(block) == qemu_real_host_page_size &&
+           qemu_real_host_page_size <= TARGET_PAGE_SIZE &&
+           QEMU_IS_ALIGNED(pages_offset, qemu_real_host_page_size);
+}
+
+/*
+ * fixed_ram_load_block: read the pages of @block from the migration file
+ *
+ * Reads the pages that the bitmap of the block marks as present, with
+ * one thread per multifd channel, or maps them from the file with
+ * fixed-ram-mmap, and moves the stream after them.  A snapshot in a
+ * block device is read by the main thread only.
+ *
+ * Returns 0 for success or -errno in case of error
+ *
+ * @f: QEMUFile where the header of the block is read
+ * @block: block whose pages we want to load
+ * @length: length of the block on the source
+ */
+static int fixed_ram_load_block(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t length)
+{
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    unsigned long nbits = fixed_ram_bitmap_bits(length);
+    unsigned long npages = length >> TARGET_PAGE_BITS;
+    g_autofree unsigned long *le_bmap = bitmap_new(nbits);
+    g_autofree unsigned long *bmap = bitmap_new(nbits);
+    g_autofree FixedRamLoadParam *params = NULL;
+    bool use_mmap = fixed_ram_can_mmap(f, block, pages_offset);
+    int i, threads = 1;
+    unsigned long stripe;
+    Error *local_err = NULL;
+    int ret;
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    if (qemu_file_read_at(f, (uint8_t *)le_bmap, nbits / 8, bitmap_offset,
+                          &local_err) < 0) {
+        error_report_err(local_err);
+        return -EIO;
+    }
+    bitmap_from_le(bmap, le_bmap, nbits);
+
+    if (migrate_fixed_ram_postcopy()) {
+        /* Pages are placed on demand once the guest runs */
+        block->file_bmap = g_steal_pointer(&bmap);
+        block->pages_offset = pages_offset;
+        return qemu_file_seek(f, pages_offset + length);
+    }
+
+    if (!use_mmap && qemu_file_get_ioc(f) && migrate_use_multifd()) {
+        threads = migrate_multifd_channels();
+    }
+
+    /* Each thread gets whole words of the bitmap */
+    stripe = ROUND_UP(DIV_ROUND_UP(npages, threads), 64);
+    params = g_new0(FixedRamLoadParam, threads);
+    for (i = 0; i < threads; i++) {
+        params[i].f = f;
+        params[i].block = block;
+        params[i].bmap = bmap;
+        params[i].pages_offset = pages_offset;
+        params[i].mmap = use_mmap;
+        params[i].start = MIN(i * stripe, npages);
+        params[i].end = MIN(params[i].start + stripe, npages);
+        if (i) {
+            thread_context_create_thread(THREAD_GROUP_MIGRATION,
+                                         &params[i].thread, "fixed-ram-load",
+                                         fixed_ram_load_thread, &params[i]);
+        }
+    }
+    fixed_ram_load_thread(&params[0]);
+
+    for (i = 0; i < threads; i++) {
+        if (i) {
+            qemu_thread_join(&params[i].thread);
+        }
+        if (params[i].err) {
+            error_report_err(params[i].err);
+            ret = -EIO;
+        }
+    }
+    trace_fixed_ram_load_block(block->idstr, threads, use_mmap,
+                               bitmap_count_one(bmap, npages));
+
+    if (!ret) {
+        ret = qemu_file_seek(f, pages_offset + length);
+    }
+    return ret;
+}
+
+/*
+ * Read which migration the stream of ram-incremental applies on top
+ * of: only the pages written since then are in it.
+ */
+static int ram_incremental_load(QEMUFile *f)
+{
+    uint64_t parent = qemu_get_be64(f);
+    uint64_t generation = qemu_get_be64(f);
+
+    if (parent && parent != ram_incremental.load_base) {
+        error_report("RAM of migration %016" PRIx64 " is incremental over "
+                     "%016" PRIx64 ", but RAM is from %016" PRIx64,
+                     generation, parent, ram_incremental.load_base);
+        return -EINVAL;
+    }
+    trace_ram_incremental_load(parent, generation);
+    ram_incremental.loaded = generation;
+    return 0;
+}
+
+/*
+ * Start serving the faults on guest RAM from the fixed-ram file of @f,
+ * once all the blocks and their bitmaps are known.  RAM is discarded
+ * and registered with userfaultfd like for postcopy.
+ */
+static int fixed_ram_postcopy_setup(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    RAMBlock *block;
+
+    if (!ioc) {
+        error_report("fixed-ram-postcopy requires a file: migration URI");
+        return -EINVAL;
+    }
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (qemu_ram_is_shared(block)) {
+            error_report("fixed-ram-postcopy: RAM block %s is shared",
+                         block->idstr);
+            return -EINVAL;
+        }
+    }
+    if (!postcopy_ram_supported_by_host(mis)) {
+        return -EINVAL;
+    }
+
+    object_ref(OBJECT(ioc));
+    fixed_ram_postcopy.ioc = ioc;
+    fixed_ram_postcopy.buf = qemu_memalign(qemu_real_host_page_size,
+                                           mis->largest_page_size);
+    qemu_mutex_init(&fixed_ram_postcopy.lock);
+    fixed_ram_postcopy.active = true;
+
+    if (postcopy_ram_incoming_init(mis) ||
+        postcopy_ram_incoming_setup(mis)) {
+        return -EINVAL;
+    }
+    trace_fixed_ram_postcopy_setup();
+    return 0;
+}
+
+bool ram_fixed_postcopy_active(void)
+{
+    return fixed_ram_postcopy.active;
+}
+
+/**
+ * ram_fixed_postcopy_place: place a host page read from the fixed-ram file
+ *
+ * Called by the fault thread, and by the prefetch thread for the pages
+ * that the guest didn't touch.  Placing a page that is already there
+ * does nothing.
+ *
+ * Returns 0 for success or -errno in case of error
+ *
+ * @mis: current migration incoming state
+ * @rb: block of the page
+ * @offset: offset of the page in the block
+ */
+int ram_fixed_postcopy_place(MigrationIncomingState *mis, RAMBlock *rb,
+                             ram_addr_t offset)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    unsigned long start, end, run, run_end;
+    uint8_t *buf = fixed_ram_postcopy.buf;
+    Error *local_err = NULL;
+    void *host;
+
+    offset = ROUND_DOWN(offset, pagesize);
+    host = rb->host + offset;
+    start = offset >> TARGET_PAGE_BITS;
+    end = start + (pagesize >> TARGET_PAGE_BITS);
+
+    QEMU_LOCK_GUARD(&fixed_ram_postcopy.lock);
+
+    if (ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+        return 0;
+    }
+    trace_ram_fixed_postcopy_place(rb->idstr, offset);
+
+    /* The pages that are not in the file are zero */
+    if (!rb->file_bmap || find_next_bit(rb->file_bmap, end, start) == end) {
+        return postcopy_place_page_zero(mis, host, rb);
+    }
+
+    memset(buf, 0, pagesize);
+    run = find_next_bit(rb->file_bmap, end, start);
+    while (run < end) {
+        run_end = find_next_zero_bit(rb->file_bmap, end, run);
+        if (file_pread_all(fixed_ram_postcopy.ioc,
+                           buf + ((run - start) << TARGET_PAGE_BITS),
+                           (ram_addr_t)(run_end - run) << TARGET_PAGE_BITS,
+                           rb->pages_offset +
+                           ((ram_addr_t)run << TARGET_PAGE_BITS),
+                           &local_err) < 0) {
+            error_report_err(local_err);
+            return -EIO;
+        }
+        run = find_next_bit(rb->file_bmap, end, run_end);
+    }
+
+    return postcopy_place_page(mis, host, buf, rb);
+}
+
+/* Once all the pages of the file are in, RAM is normal memory again */
+static void fixed_ram_postcopy_end_bh(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    RAMBlock *block;
+
+    qemu_thread_join(&fixed_ram_postcopy.thread);
+    qemu_bh_delete(fixed_ram_postcopy.bh);
+    fixed_ram_postcopy.bh = NULL;
+
+    postcopy_ram_incoming_cleanup(mis);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+            g_free(block->receivedmap);
+            block->receivedmap = NULL;
+        }
+    }
+    object_unref(OBJECT(fixed_ram_postcopy.ioc));
+    fixed_ram_postcopy.ioc = NULL;
+    qemu_vfree(fixed_ram_postcopy.buf);
+    fixed_ram_postcopy.buf = NULL;
+    qemu_mutex_destroy(&fixed_ram_postcopy.lock);
+    fixed_ram_postcopy.active = false;
+
+    trace_fixed_ram_postcopy_end();
+    migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                      MIGRATION_STATUS_COMPLETED);
+    migration_incoming_state_destroy();
+}
+
+/* Read the pages that the guest didn't touch yet, in file order */
+static void *fixed_ram_postcopy_prefetch_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    RAMBlock *block;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            unsigned long npages = block->used_length >> TARGET_PAGE_BITS;
+            unsigned long step = qemu_ram_pagesize(block) >> TARGET_PAGE_BITS;
+            unsigned long page;
+
+            if (!block->file_bmap) {
+                continue;
+            }
+            page = find_next_bit(block->file_bmap, npages, 0);
+            while (!ret && page < npages) {
+                ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+
+                ret = ram_fixed_postcopy_place(mis, block, offset);
+                page = find_next_bit(block->file_bmap, npages,
+                                     ROUND_UP(page + 1, step));
+            }
+            if (ret) {
+                break;
             }
         }
     }
-    trace_colo_flush_ram_cache_end();
+
+    rcu_unregister_thread();
+
+    if (ret) {
+        /* The guest is running without some of its RAM */
+        error_report("%s: loading RAM failed: %s", __func__, strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * The pages that are not in the file are zero: they don't need the
+     * fault thread anymore.
+     */
+    qemu_bh_schedule(fixed_ram_postcopy.bh);
+    return NULL;
+}
+
+/*
+ * ram_fixed_postcopy_run: load the rest of RAM once the guest runs
+ *
+ * Called in the main thread once the guest starts, the migration stays
+ * postcopy-active until all the pages of the file are in.
+ *
+ * @mis: current migration incoming state
+ */
+void ram_fixed_postcopy_run(MigrationIncomingState *mis)
+{
+    trace_ram_fixed_postcopy_run();
+    fixed_ram_postcopy.bh = qemu_bh_new(fixed_ram_postcopy_end_bh, mis);
+    thread_context_create_thread(THREAD_GROUP_POSTCOPY,
+                                 &fixed_ram_postcopy.thread,
+                                 "fixed-ram/prefetch",
+                                 fixed_ram_postcopy_prefetch_thread, mis);
+}
+
+/*
+ * The RAMBlocks by name, for the records of RAM_SAVE_FLAG_MEM_SIZE.
+ * Looking each of them up in the list would be quadratic, and that
+ * shows with the thousands of small shared blocks of some guests.
+ *
+ * Called with RCU critical section
+ */
+static GHashTable *ram_block_names_new(void)
+{
+    GHashTable *names = g_hash_table_new(g_str_hash, g_str_equal);
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH(block) {
+        g_hash_table_insert(names, block->idstr, block);
+    }
+    return names;
 }
 
 /**
@@ -3724,16 +7086,26 @@ void colo_flush_ram_cache(void)
  */
 static int ram_load_precopy(QEMUFile *f)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     int flags = 0, ret = 0, invalid_flags = 0, len = 0, i = 0;
     /* ADVISE is earlier, it shows the source has the postcopy capability on */
     bool postcopy_advised = postcopy_is_advised();
+    /* COLO keeps a copy of each page as soon as it is loaded */
+    bool use_load_threads = load_param && !migration_incoming_colo_enabled();
     if (!migrate_use_compression()) {
         invalid_flags |= RAM_SAVE_FLAG_COMPRESS_PAGE;
     }
+    if (!migrate_page_dedup()) {
+        invalid_flags |= RAM_SAVE_FLAG_HASH_PAGE;
+    }
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        RAMBlock *rb = NULL;
+        GHashTable *block_names;
         void *host = NULL, *host_bak = NULL;
+        bool pristine = false;
+        uint8_t *data;
         uint8_t ch;
 
         /*
@@ -3755,14 +7127,21 @@ static int ram_load_precopy(QEMUFile *f)
             if (flags & invalid_flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
                 error_report("Received an unexpected compressed page");
             }
+            if (flags & invalid_flags & RAM_SAVE_FLAG_HASH_PAGE) {
+                error_report("Received a page hash without page-dedup");
+            }
 
             ret = -EINVAL;
             break;
         }
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_HASH_PAGE)) {
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
+
+            rb = block;
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3794,6 +7173,7 @@ static int ram_load_precopy(QEMUFile *f)
                 break;
             }
             if (!migration_incoming_in_colo_state()) {
+                pristine = ramblock_recv_page_is_pristine(block, host);
                 ramblock_recv_bitmap_set(block, host);
             }
 
@@ -3804,6 +7184,7 @@ static int ram_load_precopy(QEMUFile *f)
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
+            block_names = ram_block_names_new();
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 char id[256];
@@ -3814,7 +7195,7 @@ static int ram_load_precopy(QEMUFile *f)
                 id[len] = 0;
                 length = qemu_get_be64(f);
 
-                block = qemu_ram_block_by_name(id);
+                block = g_hash_table_lookup(block_names, id);
                 if (block && !qemu_ram_is_migratable(block)) {
                     error_report("block %s should not be migrated !", id);
                     ret = -EINVAL;
@@ -3851,6 +7232,12 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_ram_handover()) {
+                        ret = ram_load_handover(f, block);
+                    }
+                    if (!ret && migrate_fixed_ram()) {
+                        ret = fixed_ram_load_block(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3861,20 +7248,57 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            g_hash_table_destroy(block_names);
+            if (!ret && migrate_ram_incremental()) {
+                ret = ram_incremental_load(f);
+            }
+            if (!ret && migrate_fixed_ram_postcopy()) {
+                ret = fixed_ram_postcopy_setup(f);
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
             ch = qemu_get_byte(f);
+            if (!ch && pristine) {
+                /* Don't even read it, that would fault it in */
+                break;
+            }
+            if (use_load_threads) {
+                load_page_queue(host, RAM_SAVE_FLAG_ZERO, ch);
+                break;
+            }
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
             break;
 
         case RAM_SAVE_FLAG_PAGE:
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (use_load_threads) {
+                data = load_page_queue(host, RAM_SAVE_FLAG_PAGE, 0);
+                qemu_get_buffer(f, data, TARGET_PAGE_SIZE);
+            } else {
+                data = host;
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
+            if (ram_dedup_store_active()) {
+                ram_dedup_store_insert(data);
+            }
+            break;
+
+        case RAM_SAVE_FLAG_HASH_PAGE: {
+            uint64_t buf[2];
+            RAMDedupHash hash;
+
+            qemu_get_buffer(f, (uint8_t *)buf, sizeof(buf));
+            hash.lo = be64_to_cpu(buf[0]);
+            hash.hi = be64_to_cpu(buf[1]);
+            if (!ram_dedup_store_lookup(&hash, host)) {
+                ret = migrate_send_rp_dedup_miss(mis, rb, addr);
+            }
             break;
+        }
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > decompress_bound()) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -3883,6 +7307,16 @@ static int ram_load_precopy(QEMUFile *f)
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
+            if (use_load_threads) {
+                len = load_xbzrle_header(f);
+                if (len < 0) {
+                    ret = -EINVAL;
+                    break;
+                }
+                data = load_page_queue(host, RAM_SAVE_FLAG_XBZRLE, len);
+                qemu_get_buffer(f, data, len);
+                break;
+            }
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
                              RAM_ADDR_FMT, addr);
@@ -3890,9 +7324,14 @@ static int ram_load_precopy(QEMUFile *f)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_FLUSH:
+            multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (migrate_multifd_flush_after_each_section()) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
@@ -3912,6 +7351,7 @@ static int ram_load_precopy(QEMUFile *f)
     }
 
     ret |= wait_for_decompress_done();
+    ret |= wait_for_load_done();
     return ret;
 }
 
@@ -3939,7 +7379,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -3995,6 +7435,44 @@ static void ram_dirty_bitmap_reload_notify(MigrationState *s)
     qemu_sem_post(&s->rp_state.rp_sem);
 }
 
+/*
+ * Decode the run-length encoding of a received bitmap of @nbits bits
+ * (see ramblock_recv_bitmap_encode()) into the dirty bitmap of @block,
+ * as the pages which weren't received.
+ */
+static int ram_dirty_bitmap_decode(RAMBlock *block, unsigned long nbits,
+                                   const uint8_t *buf, size_t len)
+{
+    unsigned long pos = 0;
+    bool set = false;
+    size_t i = 0;
+
+    bitmap_zero(block->bmap, nbits);
+    while (i < len) {
+        uint64_t run = 0;
+        int shift = 0;
+
+        do {
+            if (i == len || shift > 63) {
+                return -EINVAL;
+            }
+            run |= (uint64_t)(buf[i] & 0x7f) << shift;
+            shift += 7;
+        } while (buf[i++] & 0x80);
+
+        if (run > nbits - pos) {
+            return -EINVAL;
+        }
+        if (!set) {
+            bitmap_set(block->bmap, pos, run);
+        }
+        pos += run;
+        set = !set;
+    }
+
+    return pos == nbits ? 0 : -EINVAL;
+}
+
 /*
  * Read the received bitmap, revert it as the initial dirty bitmap.
  * This is only used when the postcopy migration is paused but wants
@@ -4006,7 +7484,7 @@ int ram_dirty_bitmap_reload(MigrationState *s, RAMBlock *block)
     QEMUFile *file = s->rp_state.from_dst_file;
     unsigned long *le_bitmap, nbits = block->used_length >> TARGET_PAGE_BITS;
     uint64_t local_size = DIV_ROUND_UP(nbits, 8);
-    uint64_t size, end_mark;
+    uint64_t size, len, encoded = 0, end_mark;
 
     trace_ram_dirty_bitmap_reload_begin(block->idstr);
 
@@ -4036,14 +7514,26 @@ int ram_dirty_bitmap_reload(MigrationState *s, RAMBlock *block)
         goto out;
     }
 
-    size = qemu_get_buffer(file, (uint8_t *)le_bitmap, local_size);
+    if (migrate_postcopy_compress_bitmap()) {
+        encoded = qemu_get_be64(file);
+        if (encoded >= local_size) {
+            error_report("%s: ramblock '%s' encoded bitmap too large "
+                         "(0x%"PRIx64" >= 0x%"PRIx64")", __func__,
+                         block->idstr, encoded, local_size);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+    len = encoded ?: local_size;
+
+    size = qemu_get_buffer(file, (uint8_t *)le_bitmap, len);
     end_mark = qemu_get_be64(file);
 
     ret = qemu_file_get_error(file);
-    if (ret || size != local_size) {
+    if (ret || size != len) {
         error_report("%s: read bitmap failed for ramblock '%s': %d"
                      " (size 0x%"PRIx64", got: 0x%"PRIx64")",
-                     __func__, block->idstr, ret, local_size, size);
+                     __func__, block->idstr, ret, len, size);
         ret = -EIO;
         goto out;
     }
@@ -4056,16 +7546,28 @@ int ram_dirty_bitmap_reload(MigrationState *s, RAMBlock *block)
     }
 
     /*
-     * Endianness conversion. We are during postcopy (though paused).
-     * The dirty bitmap won't change. We can directly modify it.
+     * We are during postcopy (though paused).  The dirty bitmap won't
+     * change.  We can directly modify it.
      */
-    bitmap_from_le(block->bmap, le_bitmap, nbits);
+    if (encoded) {
+        if (ram_dirty_bitmap_decode(block, nbits, (uint8_t *)le_bitmap,
+                                    encoded)) {
+            error_report("%s: ramblock '%s' encoded bitmap is corrupted",
+                         __func__, block->idstr);
+            ret = -EINVAL;
+            goto out;
+        }
+    } else {
+        /* Endianness conversion */
+        bitmap_from_le(block->bmap, le_bitmap, nbits);
 
-    /*
-     * What we received is "received bitmap". Revert it as the initial
-     * dirty bitmap for this ramblock.
-     */
-    bitmap_complement(block->bmap, block->bmap, nbits);
+        /*
+         * What we received is "received bitmap". Revert it as the initial
+         * dirty bitmap for this ramblock.
+         */
+        bitmap_complement(block->bmap, block->bmap, nbits);
+    }
+    ramblock_bmap_summary_set(block, 0, nbits);
 
     trace_ram_dirty_bitmap_reload_complete(block->idstr);
 
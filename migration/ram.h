@@ -32,11 +32,35 @@
 #include "qapi/qapi-types-migration.h"
 #include "exec/cpu-common.h"
 #include "io/channel.h"
+#include "qemu/stats64.h"
 
+/*
+ * The counters that the multifd threads update, or that they read
+ * while the migration thread updates them.  Each one is a single
+ * 64-bit atomic, so no lock is needed to add to it or to read it,
+ * even on hosts without 64-bit atomics.  query-migrate copies them
+ * to the MigrationStats it returns.
+ */
+typedef struct {
+    Stat64 dirty_sync_count;
+    Stat64 dirty_sync_missed_zero_copy;
+    Stat64 duplicate;
+    Stat64 multifd_bytes;
+    Stat64 normal;
+    Stat64 postcopy_requests;
+    Stat64 transferred;
+    Stat64 dedup_pages;
+    Stat64 dedup_misses;
+    Stat64 free_page_hint_bytes;
+} MigrationAtomicStats;
+
+extern MigrationAtomicStats ram_atomic_counters;
 extern MigrationStats ram_counters;
 extern XBZRLECacheStats xbzrle_counters;
 extern CompressionStats compression_counters;
 
+MigrationLatencyHistogram *ram_postcopy_queue_latency(void);
+
 bool ramblock_is_ignored(RAMBlock *block);
 /* Should be holding either ram_list.mutex, or the RCU lock. */
 #define RAMBLOCK_FOREACH_NOT_IGNORED(block)            \
@@ -49,6 +73,8 @@ bool ramblock_is_ignored(RAMBlock *block);
 
 int xbzrle_cache_resize(uint64_t new_size, Error **errp);
 uint64_t ram_bytes_remaining(void);
+uint64_t ram_bytes_dirtied_since_sync(void);
+int ram_dedup_miss(const char *rbname, ram_addr_t start);
 uint64_t ram_bytes_total(void);
 
 uint64_t ram_pagesize_summary(void);
@@ -57,16 +83,28 @@ void acct_update_position(QEMUFile *f, size_t size, bool zero);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
                            unsigned long pages);
 void ram_postcopy_migrated_memory_release(MigrationState *ms);
+void ram_release_migrated_memory(void);
 /* For outgoing discard bitmap */
 int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 /* For incoming postcopy discard */
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+void ram_prepopulate_start(void);
+void ram_prepopulate_stop(void);
+void ram_collapse_start(void);
+void ram_collapse_stop(void);
+MigrationHugePageStats *ram_collapse_info(void);
+int ram_load_postcopy(QEMUFile *f, int channel);
+bool ram_fixed_postcopy_active(void);
+int ram_fixed_postcopy_place(MigrationIncomingState *mis, RAMBlock *rb,
+                             ram_addr_t offset);
+void ram_fixed_postcopy_run(MigrationIncomingState *mis);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
 int ramblock_recv_bitmap_test(RAMBlock *rb, void *host_addr);
 bool ramblock_recv_bitmap_test_byte_offset(RAMBlock *rb, uint64_t byte_offset);
+bool ramblock_recv_page_is_pristine(RAMBlock *rb, void *host_addr);
 void ramblock_recv_bitmap_set(RAMBlock *rb, void *host_addr);
 void ramblock_recv_bitmap_set_range(RAMBlock *rb, void *host_addr, size_t nr);
 int64_t ramblock_recv_bitmap_send(QEMUFile *file,
@@ -76,6 +114,8 @@ int ram_dirty_bitmap_reload(MigrationState *s, RAMBlock *rb);
 /* ram cache */
 int colo_init_ram_cache(void);
 void colo_flush_ram_cache(void);
+void *colo_cache_recv_host(RAMBlock *block, ram_addr_t offset);
+void colo_cache_backup_page(RAMBlock *block, void *host);
 void colo_release_ram_cache(void);
 void colo_incoming_start_dirty_log(void);
 
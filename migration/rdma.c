@@ -21,13 +21,16 @@
 #include "migration.h"
 #include "qemu-file.h"
 #include "ram.h"
+#include "postcopy-ram.h"
 #include "qemu-file-channel.h"
+#include "io/task.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/rcu.h"
 #include "qemu/sockets.h"
 #include "qemu/bitmap.h"
+#include "qemu/queue.h"
 #include "qemu/coroutine.h"
 #include "exec/memory.h"
 #include <sys/socket.h>
@@ -76,12 +79,22 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+/* The connection is a multifd channel, not the main one */
+#define RDMA_CAPABILITY_MULTIFD 0x02
+/*
+ * On the main connection: the source sends its RAM blocks, and the
+ * destination reads the pages of postcopy faults from them.  On
+ * another connection: the queue pair for these reads.
+ */
+#define RDMA_CAPABILITY_POSTCOPY_PULL 0x04
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_MULTIFD |
+                                     RDMA_CAPABILITY_POSTCOPY_PULL;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -127,6 +140,8 @@ static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
 enum {
     RDMA_WRID_NONE = 0,
     RDMA_WRID_RDMA_WRITE = 1,
+    RDMA_WRID_MULTIFD_WRITE = 2,
+    RDMA_WRID_POSTCOPY_PULL = 3,
     RDMA_WRID_SEND_CONTROL = 2000,
     RDMA_WRID_RECV_CONTROL = 4000,
 };
@@ -134,6 +149,8 @@ enum {
 static const char *wrid_desc[] = {
     [RDMA_WRID_NONE] = "NONE",
     [RDMA_WRID_RDMA_WRITE] = "WRITE RDMA",
+    [RDMA_WRID_MULTIFD_WRITE] = "WRITE MULTIFD",
+    [RDMA_WRID_POSTCOPY_PULL] = "READ POSTCOPY PULL",
     [RDMA_WRID_SEND_CONTROL] = "CONTROL SEND",
     [RDMA_WRID_RECV_CONTROL] = "CONTROL RECV",
 };
@@ -168,6 +185,7 @@ enum {
     RDMA_CONTROL_REGISTER_FINISHED,   /* current iteration finished */
     RDMA_CONTROL_UNREGISTER_REQUEST,  /* dynamic UN-registration */
     RDMA_CONTROL_UNREGISTER_FINISHED, /* unpinning finished */
+    RDMA_CONTROL_SOURCE_BLOCKS,       /* RAMBlocks for postcopy pull */
 };
 
 
@@ -202,6 +220,16 @@ static void network_to_caps(RDMACapabilities *cap)
     cap->flags = ntohl(cap->flags);
 }
 
+/*
+ * A registered chunk in the list of the least recently written ones,
+ * see qemu_rdma_reg_cache_use().  Its chunk is its place in the array
+ * of the block.
+ */
+typedef struct RDMAChunkLRU {
+    QTAILQ_ENTRY(RDMAChunkLRU) next;
+    int index;                      /* which block it is in */
+} RDMAChunkLRU;
+
 /*
  * Representation of a RAMBlock from an RDMA perspective.
  * This is not transmitted, only local.
@@ -218,9 +246,12 @@ typedef struct RDMALocalBlock {
     struct         ibv_mr **pmr;    /* MRs for chunk-level registration */
     struct         ibv_mr *mr;      /* MR for non-chunk-level registration */
     uint32_t      *remote_keys;     /* rkeys for chunk-level registration */
+    RDMAChunkLRU  *lru;             /* LRU for chunk-level registration */
     uint32_t       remote_rkey;     /* rkeys for non-chunk-level registration */
     int            index;           /* which block are we */
     unsigned int   src_index;       /* (Only used on dest) */
+    uint64_t       src_host_addr;   /* (Only used on dest) source address */
+    uint32_t       src_rkey;        /* and rkey, for postcopy pull */
     bool           is_ram_block;
     int            nb_chunks;
     unsigned long *transit_bitmap;
@@ -257,9 +288,10 @@ static const char *control_desc(unsigned int rdma_control)
         [RDMA_CONTROL_REGISTER_FINISHED] = "REGISTER FINISHED",
         [RDMA_CONTROL_UNREGISTER_REQUEST] = "UNREGISTER REQUEST",
         [RDMA_CONTROL_UNREGISTER_FINISHED] = "UNREGISTER FINISHED",
+        [RDMA_CONTROL_SOURCE_BLOCKS] = "SOURCE BLOCKS",
     };
 
-    if (rdma_control > RDMA_CONTROL_UNREGISTER_FINISHED) {
+    if (rdma_control > RDMA_CONTROL_SOURCE_BLOCKS) {
         return "??BAD CONTROL VALUE??";
     }
 
@@ -393,11 +425,41 @@ typedef struct RDMAContext {
     int unregister_current, unregister_next;
     uint64_t unregistrations[RDMA_SIGNALED_SEND_MAX];
 
+    /*
+     * rdma-reg-cache-size, the bytes that chunk-level registration
+     * holds, and the registered chunks, least recently written first.
+     */
+    uint64_t reg_cache_size;
+    uint64_t reg_cache_bytes;
+    QTAILQ_HEAD(, RDMAChunkLRU) reg_lru;
+
+    /* Register guest RAM with on-demand paging rather than pinning it */
+    bool odp;
+
     GHashTable *blockmap;
 
     /* the RDMAContext for return path */
     struct RDMAContext *return_path;
     bool is_return_path;
+
+    /*
+     * For the multifd channels and the postcopy pull connection, the
+     * context of the main connection: they use its protection domain
+     * and its RAM registrations.
+     */
+    struct RDMAContext *main_ctx;
+
+    /*
+     * On the main connection, whether the destination reads the pages
+     * of postcopy faults from the source RAM, and the connection for
+     * these reads.  The destination reads them into pull_buf.
+     */
+    bool postcopy_pull;
+    struct RDMAContext *pull;
+    bool is_postcopy_pull;
+    uint8_t *pull_buf;
+    size_t pull_len;
+    struct ibv_mr *pull_mr;
 } RDMAContext;
 
 #define TYPE_QIO_CHANNEL_RDMA "qio-channel-rdma"
@@ -680,6 +742,10 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
             if (!block->pmr[j]) {
                 continue;
             }
+            if (block->lru && QTAILQ_IN_USE(&block->lru[j], next)) {
+                QTAILQ_REMOVE(&rdma->reg_lru, &block->lru[j], next);
+                rdma->reg_cache_bytes -= block->pmr[j]->length;
+            }
             ibv_dereg_mr(block->pmr[j]);
             rdma->total_registrations--;
         }
@@ -687,6 +753,9 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
         block->pmr = NULL;
     }
 
+    g_free(block->lru);
+    block->lru = NULL;
+
     if (block->mr) {
         ibv_dereg_mr(block->mr);
         rdma->total_registrations--;
@@ -1052,8 +1121,12 @@ err_resolve_create_id:
  */
 static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
 {
-    /* allocate pd */
-    rdma->pd = ibv_alloc_pd(rdma->verbs);
+    /* allocate pd, other connections share the one of the main one */
+    if (rdma->main_ctx) {
+        rdma->pd = rdma->main_ctx->pd;
+    } else {
+        rdma->pd = ibv_alloc_pd(rdma->verbs);
+    }
     if (!rdma->pd) {
         error_report("failed to allocate protection domain");
         return -1;
@@ -1080,7 +1153,7 @@ static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
     return 0;
 
 err_alloc_pd_cq:
-    if (rdma->pd) {
+    if (rdma->pd && !rdma->main_ctx) {
         ibv_dealloc_pd(rdma->pd);
     }
     if (rdma->comp_channel) {
@@ -1117,18 +1190,44 @@ static int qemu_rdma_alloc_qp(RDMAContext *rdma)
     return 0;
 }
 
+/*
+ * Whether the device can register memory with on-demand paging for
+ * the reliable connections used by migration: the pages are then
+ * faulted in when the device accesses them rather than pinned at
+ * registration.
+ */
+static bool qemu_rdma_has_odp(struct ibv_context *verbs)
+{
+    struct ibv_device_attr_ex attr = {};
+
+    if (ibv_query_device_ex(verbs, NULL, &attr)) {
+        return false;
+    }
+    return (attr.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+           (attr.odp_caps.per_transport_caps.rc_odp_caps &
+            IBV_ODP_SUPPORT_WRITE);
+}
+
+/* Access flags for the registrations of guest RAM */
+static int qemu_rdma_ram_access(RDMAContext *rdma, int access)
+{
+    return rdma->odp ? access | IBV_ACCESS_ON_DEMAND : access;
+}
+
 static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 {
     int i;
     RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    /* With postcopy pull, the destination reads from the source RAM */
+    int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                 (rdma->postcopy_pull ? IBV_ACCESS_REMOTE_READ : 0);
 
     for (i = 0; i < local->nb_blocks; i++) {
         local->block[i].mr =
             ibv_reg_mr(rdma->pd,
                     local->block[i].local_host_addr,
                     local->block[i].length,
-                    IBV_ACCESS_LOCAL_WRITE |
-                    IBV_ACCESS_REMOTE_WRITE
+                    qemu_rdma_ram_access(rdma, access)
                     );
         if (!local->block[i].mr) {
             perror("Failed to register local dest ram block!");
@@ -1219,8 +1318,9 @@ static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
 
         block->pmr[chunk] = ibv_reg_mr(rdma->pd,
                 chunk_start, len,
-                (rkey ? (IBV_ACCESS_LOCAL_WRITE |
-                        IBV_ACCESS_REMOTE_WRITE) : 0));
+                qemu_rdma_ram_access(rdma, rkey ? (IBV_ACCESS_LOCAL_WRITE |
+                                                  IBV_ACCESS_REMOTE_WRITE) :
+                                                 0));
 
         if (!block->pmr[chunk]) {
             perror("Failed to register chunk!");
@@ -1295,6 +1395,44 @@ const char *print_wrid(int wrid)
  */
 /* #define RDMA_UNREGISTRATION_EXAMPLE */
 
+/*
+ * Unregister a chunk that is not being written, here and on the
+ * destination.
+ */
+static int qemu_rdma_unregister_chunk(RDMAContext *rdma, uint64_t index,
+                                      uint64_t chunk)
+{
+    RDMALocalBlock *block = &(rdma->local_ram_blocks.block[index]);
+    RDMARegister reg = { .current_index = index };
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_UNREGISTER_FINISHED,
+                             };
+    RDMAControlHeader head = { .len = sizeof(RDMARegister),
+                               .type = RDMA_CONTROL_UNREGISTER_REQUEST,
+                               .repeat = 1,
+                             };
+    int ret;
+
+    if (block->lru && QTAILQ_IN_USE(&block->lru[chunk], next)) {
+        QTAILQ_REMOVE(&rdma->reg_lru, &block->lru[chunk], next);
+        rdma->reg_cache_bytes -= block->pmr[chunk]->length;
+    }
+
+    ret = ibv_dereg_mr(block->pmr[chunk]);
+    block->pmr[chunk] = NULL;
+    block->remote_keys[chunk] = 0;
+
+    if (ret != 0) {
+        perror("unregistration chunk failed");
+        return -ret;
+    }
+    rdma->total_registrations--;
+
+    reg.key.chunk = chunk;
+    register_to_network(rdma, &reg);
+    return qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+                                   &resp, NULL, NULL);
+}
+
 /*
  * Perform a non-optimized memory unregistration after every transfer
  * for demonstration purposes, only if pin-all is not requested.
@@ -1303,8 +1441,10 @@ const char *print_wrid(int wrid)
  * 1. Start a new thread to run this function continuously
         - for bit clearing
         - and for receipt of unregister messages
- * 2. Use an LRU.
- * 3. Use workload hints.
+ * 2. Use workload hints.
+ *
+ * rdma-reg-cache-size unregisters chunks from an LRU instead, see
+ * qemu_rdma_reg_cache_evict().
  */
 static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
 {
@@ -1317,13 +1457,6 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
             (wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
         RDMALocalBlock *block =
             &(rdma->local_ram_blocks.block[index]);
-        RDMARegister reg = { .current_index = index };
-        RDMAControlHeader resp = { .type = RDMA_CONTROL_UNREGISTER_FINISHED,
-                                 };
-        RDMAControlHeader head = { .len = sizeof(RDMARegister),
-                                   .type = RDMA_CONTROL_UNREGISTER_REQUEST,
-                                   .repeat = 1,
-                                 };
 
         trace_qemu_rdma_unregister_waiting_proc(chunk,
                                                 rdma->unregister_current);
@@ -1350,22 +1483,14 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
             continue;
         }
 
-        trace_qemu_rdma_unregister_waiting_send(chunk);
-
-        ret = ibv_dereg_mr(block->pmr[chunk]);
-        block->pmr[chunk] = NULL;
-        block->remote_keys[chunk] = 0;
-
-        if (ret != 0) {
-            perror("unregistration chunk failed");
-            return -ret;
+        /* The LRU may have unregistered it already */
+        if (!block->pmr || !block->pmr[chunk]) {
+            continue;
         }
-        rdma->total_registrations--;
 
-        reg.key.chunk = chunk;
-        register_to_network(rdma, &reg);
-        ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
-                                &resp, NULL, NULL);
+        trace_qemu_rdma_unregister_waiting_send(chunk);
+
+        ret = qemu_rdma_unregister_chunk(rdma, index, chunk);
         if (ret < 0) {
             return ret;
         }
@@ -1441,6 +1566,11 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
 
     wr_id = wc.wr_id & RDMA_WRID_TYPE_MASK;
 
+    if (wc.status == IBV_WC_WR_FLUSH_ERR && rdma->main_ctx &&
+        !rdma->nb_sent) {
+        /* The peer closed a secondary connection, it's not an error */
+        return -EPIPE;
+    }
     if (wc.status != IBV_WC_SUCCESS) {
         fprintf(stderr, "ibv_poll_cq wc.status=%d %s!\n",
                         wc.status, ibv_wc_status_str(wc.status));
@@ -1484,6 +1614,11 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
             qemu_rdma_signal_unregister(rdma, index, chunk, wc.wr_id);
 #endif
         }
+    } else if (wr_id == RDMA_WRID_MULTIFD_WRITE) {
+        trace_qemu_rdma_poll_other(print_wrid(wr_id), wr_id, rdma->nb_sent);
+        if (rdma->nb_sent > 0) {
+            rdma->nb_sent--;
+        }
     } else {
         trace_qemu_rdma_poll_other(print_wrid(wr_id), wr_id, rdma->nb_sent);
     }
@@ -1521,23 +1656,31 @@ static int qemu_rdma_wait_comp_channel(RDMAContext *rdma)
          */
         while (!rdma->error_state  && !rdma->received_error) {
             GPollFD pfds[2];
+            /*
+             * The secondary connections of the destination have no CM
+             * channel of their own: the main loop gets their events.
+             */
+            int nfds = rdma->channel ? 2 : 1;
+
             pfds[0].fd = rdma->comp_channel->fd;
             pfds[0].events = G_IO_IN | G_IO_HUP | G_IO_ERR;
             pfds[0].revents = 0;
 
-            pfds[1].fd = rdma->channel->fd;
-            pfds[1].events = G_IO_IN | G_IO_HUP | G_IO_ERR;
-            pfds[1].revents = 0;
+            if (rdma->channel) {
+                pfds[1].fd = rdma->channel->fd;
+                pfds[1].events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+                pfds[1].revents = 0;
+            }
 
             /* 0.1s timeout, should be fine for a 'cancel' */
-            switch (qemu_poll_ns(pfds, 2, 100 * 1000 * 1000)) {
+            switch (qemu_poll_ns(pfds, nfds, 100 * 1000 * 1000)) {
             case 2:
             case 1: /* fd active */
                 if (pfds[0].revents) {
                     return 0;
                 }
 
-                if (pfds[1].revents) {
+                if (nfds > 1 && pfds[1].revents) {
                     ret = rdma_get_cm_event(rdma->channel, &cm_event);
                     if (ret) {
                         error_report("failed to get cm event while wait "
@@ -1970,6 +2113,67 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * With dynamic registration, the chunks stay registered on both sides
+ * once they've been written.  With rdma-reg-cache-size, they're kept
+ * in a list from the least recently written one, and the ones at its
+ * head are unregistered on both sides when a new chunk needs room, so
+ * that the registrations never hold more than rdma-reg-cache-size.
+ */
+static void qemu_rdma_reg_cache_use(RDMAContext *rdma, RDMALocalBlock *block,
+                                    uint64_t chunk)
+{
+    RDMAChunkLRU *entry;
+
+    if (!rdma->reg_cache_size) {
+        return;
+    }
+
+    if (!block->lru) {
+        block->lru = g_new0(RDMAChunkLRU, block->nb_chunks);
+    }
+    entry = &block->lru[chunk];
+    if (QTAILQ_IN_USE(entry, next)) {
+        QTAILQ_REMOVE(&rdma->reg_lru, entry, next);
+    } else {
+        entry->index = block->index;
+        rdma->reg_cache_bytes += block->pmr[chunk]->length;
+    }
+    QTAILQ_INSERT_TAIL(&rdma->reg_lru, entry, next);
+}
+
+/* Make room for the registration of @len more bytes */
+static int qemu_rdma_reg_cache_evict(RDMAContext *rdma, uint64_t len)
+{
+    RDMAChunkLRU *entry;
+    RDMALocalBlock *block;
+    uint64_t chunk;
+    int ret;
+
+    while (rdma->reg_cache_size &&
+           rdma->reg_cache_bytes + len > rdma->reg_cache_size &&
+           (entry = QTAILQ_FIRST(&rdma->reg_lru))) {
+        block = &rdma->local_ram_blocks.block[entry->index];
+        chunk = entry - block->lru;
+
+        while (test_bit(chunk, block->transit_bitmap)) {
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        trace_qemu_rdma_reg_cache_evict(entry->index, chunk,
+                                        rdma->reg_cache_bytes);
+        ret = qemu_rdma_unregister_chunk(rdma, entry->index, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
@@ -2081,6 +2285,11 @@ retry:
                 return 1;
             }
 
+            ret = qemu_rdma_reg_cache_evict(rdma, chunk_end - chunk_start);
+            if (ret < 0) {
+                return ret;
+            }
+
             /*
              * Otherwise, tell other side to register.
              */
@@ -2129,6 +2338,7 @@ retry:
                 return -EINVAL;
             }
         }
+        qemu_rdma_reg_cache_use(rdma, block, chunk);
 
         send_wr.wr.rdma.rkey = block->remote_keys[chunk];
     } else {
@@ -2320,6 +2530,13 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
 {
     int idx;
 
+    /* It uses the protection domain of this one */
+    if (rdma->pull) {
+        qemu_rdma_cleanup(rdma->pull);
+        g_free(rdma->pull);
+        rdma->pull = NULL;
+    }
+
     if (rdma->cm_id && rdma->connected) {
         if ((rdma->error_state ||
              migrate_get_current()->state == MIGRATION_STATUS_CANCELLING) &&
@@ -2337,7 +2554,7 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
         rdma->connected = false;
     }
 
-    if (rdma->channel) {
+    if (rdma->channel && !rdma->main_ctx) {
         qemu_set_fd_handler(rdma->channel->fd, NULL, NULL, NULL);
     }
     g_free(rdma->dest_blocks);
@@ -2351,6 +2568,13 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
         rdma->wr_data[idx].control_mr = NULL;
     }
 
+    if (rdma->pull_mr) {
+        ibv_dereg_mr(rdma->pull_mr);
+        rdma->pull_mr = NULL;
+    }
+    qemu_vfree(rdma->pull_buf);
+    rdma->pull_buf = NULL;
+
     if (rdma->local_ram_blocks.block) {
         while (rdma->local_ram_blocks.nb_blocks) {
             rdma_delete_block(rdma, &rdma->local_ram_blocks.block[0]);
@@ -2370,7 +2594,9 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
         rdma->comp_channel = NULL;
     }
     if (rdma->pd) {
-        ibv_dealloc_pd(rdma->pd);
+        if (!rdma->main_ctx) {
+            ibv_dealloc_pd(rdma->pd);
+        }
         rdma->pd = NULL;
     }
     if (rdma->cm_id) {
@@ -2420,6 +2646,18 @@ static int qemu_rdma_source_init(RDMAContext *rdma, bool pin_all, Error **errp)
         goto err_rdma_source_init;
     }
 
+    if (rdma->main_ctx && rdma->verbs != rdma->main_ctx->verbs) {
+        ERROR(temp, "rdma migration: connection on another device!");
+        ret = -1;
+        goto err_rdma_source_init;
+    }
+
+    if (rdma->odp && !qemu_rdma_has_odp(rdma->verbs)) {
+        ERROR(temp, "rdma migration: device has no on-demand paging!");
+        ret = -1;
+        goto err_rdma_source_init;
+    }
+
     ret = qemu_rdma_alloc_pd_cq(rdma);
     if (ret) {
         ERROR(temp, "rdma migration: error allocating pd and cq! Your mlock()"
@@ -2434,18 +2672,21 @@ static int qemu_rdma_source_init(RDMAContext *rdma, bool pin_all, Error **errp)
         goto err_rdma_source_init;
     }
 
-    ret = qemu_rdma_init_ram_blocks(rdma);
-    if (ret) {
-        ERROR(temp, "rdma migration: error initializing ram blocks!");
-        goto err_rdma_source_init;
-    }
+    /* The other connections use the RAM blocks of the main one */
+    if (!rdma->main_ctx) {
+        ret = qemu_rdma_init_ram_blocks(rdma);
+        if (ret) {
+            ERROR(temp, "rdma migration: error initializing ram blocks!");
+            goto err_rdma_source_init;
+        }
 
-    /* Build the hash that maps from offset to RAMBlock */
-    rdma->blockmap = g_hash_table_new(g_direct_hash, g_direct_equal);
-    for (idx = 0; idx < rdma->local_ram_blocks.nb_blocks; idx++) {
-        g_hash_table_insert(rdma->blockmap,
+        /* Build the hash that maps from offset to RAMBlock */
+        rdma->blockmap = g_hash_table_new(g_direct_hash, g_direct_equal);
+        for (idx = 0; idx < rdma->local_ram_blocks.nb_blocks; idx++) {
+            g_hash_table_insert(rdma->blockmap,
                 (void *)(uintptr_t)rdma->local_ram_blocks.block[idx].offset,
                 &rdma->local_ram_blocks.block[idx]);
+        }
     }
 
     for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
@@ -2506,6 +2747,7 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp, bool return_path)
                                           .private_data_len = sizeof(cap),
                                         };
     struct rdma_cm_event *cm_event;
+    uint32_t secondary = 0;
     int ret;
 
     /*
@@ -2516,6 +2758,16 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp, bool return_path)
         trace_qemu_rdma_connect_pin_all_requested();
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
+    if (rdma->is_postcopy_pull) {
+        secondary = RDMA_CAPABILITY_POSTCOPY_PULL;
+        /* The destination reads from this one */
+        conn_param.responder_resources = 2;
+    } else if (rdma->main_ctx) {
+        secondary = RDMA_CAPABILITY_MULTIFD;
+    } else if (rdma->postcopy_pull) {
+        cap.flags |= RDMA_CAPABILITY_POSTCOPY_PULL;
+    }
+    cap.flags |= secondary;
 
     caps_to_network(&cap);
 
@@ -2554,6 +2806,18 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp, bool return_path)
     memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
     network_to_caps(&cap);
 
+    if (secondary && !(cap.flags & secondary)) {
+        ERROR(errp, "destination doesn't support %s over RDMA",
+              rdma->is_postcopy_pull ? "postcopy pull" : "multifd");
+        rdma_ack_cm_event(cm_event);
+        goto err_rdma_source_connect;
+    }
+    if (rdma->postcopy_pull && !(cap.flags & RDMA_CAPABILITY_POSTCOPY_PULL)) {
+        warn_report("rdma: destination can't pull postcopy pages, it will "
+                    "ask for them");
+        rdma->postcopy_pull = false;
+    }
+
     /*
      * Verify that the *requested* capabilities are supported by the destination
      * and disable them otherwise.
@@ -2681,9 +2945,14 @@ static void *qemu_rdma_data_init(const char *host_port, Error **errp)
     InetSocketAddress *addr;
 
     if (host_port) {
+        MigrationState *s = migrate_get_current();
+
         rdma = g_new0(RDMAContext, 1);
         rdma->current_index = -1;
         rdma->current_chunk = -1;
+        rdma->odp = s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_ODP];
+        rdma->reg_cache_size = s->parameters.rdma_reg_cache_size;
+        QTAILQ_INIT(&rdma->reg_lru);
 
         addr = g_new(InetSocketAddress, 1);
         if (!inet_parse(addr, host_port, NULL)) {
@@ -2712,6 +2981,7 @@ static ssize_t qio_channel_rdma_writev(QIOChannel *ioc,
                                        size_t niov,
                                        int *fds,
                                        size_t nfds,
+                                       int flags,
                                        Error **errp)
 {
     QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(ioc);
@@ -3188,6 +3458,11 @@ static size_t qemu_rdma_save_page(QEMUFile *f, void *opaque,
         return RAM_SAVE_CONTROL_NOT_SUPP;
     }
 
+    /* The multifd channels write the pages */
+    if (migrate_use_multifd()) {
+        return RAM_SAVE_CONTROL_NOT_SUPP;
+    }
+
     qemu_fflush(f);
 
     if (size > 0) {
@@ -3277,6 +3552,157 @@ err:
 
 static void rdma_accept_incoming_migration(void *opaque);
 
+/*
+ * Accept a connection other than the main one, requested by @cm_event
+ * on the CM channel of the main context @main_rdma.  It gets a queue
+ * pair and completion queue of its own in the protection domain of
+ * @main_rdma, so that the source can access the RAM that @main_rdma
+ * registered, or the other way around.  @flag is the capability that
+ * tells what it is for.
+ */
+static RDMAContext *qemu_rdma_accept_secondary(RDMAContext *main_rdma,
+                                               struct rdma_cm_event *cm_event,
+                                               uint32_t flag)
+{
+    RDMACapabilities cap = {
+                                .version = RDMA_CONTROL_VERSION_CURRENT,
+                                .flags = flag,
+                           };
+    struct rdma_conn_param conn_param = {
+                                            .responder_resources = 2,
+                                            .private_data = &cap,
+                                            .private_data_len = sizeof(cap),
+                                         };
+    RDMAContext *rdma;
+    int idx;
+
+    rdma = qemu_rdma_data_init(main_rdma->host_port, NULL);
+    rdma->main_ctx = main_rdma;
+    rdma->is_postcopy_pull = flag == RDMA_CAPABILITY_POSTCOPY_PULL;
+    rdma->cm_id = cm_event->id;
+    /* Tells the events of this connection apart from the main one */
+    rdma->cm_id->context = rdma;
+    rdma->verbs = cm_event->id->verbs;
+    rdma_ack_cm_event(cm_event);
+
+    trace_qemu_rdma_accept_secondary(rdma->verbs, flag);
+    if (rdma->verbs != main_rdma->verbs || !main_rdma->pin_all) {
+        error_report("rdma: secondary connections need rdma-pin-all and the "
+                     "device of the main connection");
+        goto err;
+    }
+    if (rdma->is_postcopy_pull) {
+        /* This side reads from the source */
+        conn_param.initiator_depth = 2;
+    }
+
+    if (qemu_rdma_alloc_pd_cq(rdma) || qemu_rdma_alloc_qp(rdma)) {
+        error_report("rdma: error allocating the secondary queues");
+        goto err;
+    }
+
+    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+        if (qemu_rdma_reg_control(rdma, idx)) {
+            error_report("rdma: error registering %d control", idx);
+            goto err;
+        }
+    }
+
+    caps_to_network(&cap);
+    if (rdma_accept(rdma->cm_id, &conn_param)) {
+        error_report("rdma: secondary rdma_accept failed");
+        goto err;
+    }
+
+    if (rdma_get_cm_event(main_rdma->channel, &cm_event)) {
+        error_report("rdma: secondary rdma_accept get_cm_event failed");
+        goto err;
+    }
+    if (cm_event->event != RDMA_CM_EVENT_ESTABLISHED ||
+        cm_event->id != rdma->cm_id) {
+        error_report("rdma: secondary rdma_accept not event established");
+        rdma_ack_cm_event(cm_event);
+        goto err;
+    }
+    rdma_ack_cm_event(cm_event);
+    rdma->connected = true;
+
+    if (qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY)) {
+        error_report("rdma: error posting secondary control recv");
+        goto err;
+    }
+    return rdma;
+
+err:
+    qemu_rdma_cleanup(rdma);
+    g_free(rdma);
+    return NULL;
+}
+
+/*
+ * Accept the connection of a multifd channel: the source writes pages
+ * to the RAM that @main_rdma registered.
+ */
+static void rdma_accept_multifd_channel(RDMAContext *main_rdma,
+                                        struct rdma_cm_event *cm_event)
+{
+    QIOChannelRDMA *rioc;
+    Error *local_err = NULL;
+    RDMAContext *rdma;
+
+    rdma = qemu_rdma_accept_secondary(main_rdma, cm_event,
+                                      RDMA_CAPABILITY_MULTIFD);
+    if (!rdma) {
+        return;
+    }
+
+    rioc = QIO_CHANNEL_RDMA(object_new(TYPE_QIO_CHANNEL_RDMA));
+    rioc->rdmain = rdma;
+    qio_channel_set_name(QIO_CHANNEL(rioc), "migration-rdma-multifd");
+    migration_ioc_process_incoming(QIO_CHANNEL(rioc), &local_err);
+    object_unref(OBJECT(rioc));
+    if (local_err) {
+        error_reportf_err(local_err, "RDMA ERROR:");
+    }
+}
+
+/*
+ * Accept the connection that the postcopy fault thread reads pages
+ * from the source RAM with, see rdma_postcopy_pull_page().
+ */
+static void rdma_accept_pull_channel(RDMAContext *main_rdma,
+                                     struct rdma_cm_event *cm_event)
+{
+    RDMAContext *rdma;
+
+    if (!main_rdma->postcopy_pull || main_rdma->pull) {
+        error_report("rdma: unexpected postcopy pull connection");
+        rdma_reject(cm_event->id, NULL, 0);
+        rdma_ack_cm_event(cm_event);
+        return;
+    }
+
+    rdma = qemu_rdma_accept_secondary(main_rdma, cm_event,
+                                      RDMA_CAPABILITY_POSTCOPY_PULL);
+    if (!rdma) {
+        return;
+    }
+
+    rdma->pull_len = qemu_ram_pagesize_largest();
+    rdma->pull_buf = qemu_memalign(qemu_real_host_page_size, rdma->pull_len);
+    rdma->pull_mr = ibv_reg_mr(rdma->pd, rdma->pull_buf, rdma->pull_len,
+                               IBV_ACCESS_LOCAL_WRITE);
+    if (!rdma->pull_mr) {
+        error_report("rdma: error registering the postcopy pull buffer");
+        qemu_rdma_cleanup(rdma);
+        g_free(rdma);
+        return;
+    }
+
+    main_rdma->pull = rdma;
+    migration_incoming_get_current()->postcopy_pull = true;
+}
+
 static void rdma_cm_poll_handler(void *opaque)
 {
     RDMAContext *rdma = opaque;
@@ -3290,6 +3716,32 @@ static void rdma_cm_poll_handler(void *opaque)
         return;
     }
 
+    if (cm_event->event == RDMA_CM_EVENT_CONNECT_REQUEST) {
+        RDMAContext *main_rdma = rdma->is_return_path ? rdma->return_path :
+                                                        rdma;
+        RDMACapabilities cap;
+
+        memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+        network_to_caps(&cap);
+        if (cap.flags & RDMA_CAPABILITY_POSTCOPY_PULL) {
+            rdma_accept_pull_channel(main_rdma, cm_event);
+            return;
+        }
+        if (migrate_use_multifd()) {
+            rdma_accept_multifd_channel(main_rdma, cm_event);
+            return;
+        }
+    }
+
+    if (cm_event->id->context) {
+        /*
+         * An event of a secondary connection: the multifd threads read
+         * the page packets, and see when the connection breaks.
+         */
+        rdma_ack_cm_event(cm_event);
+        return;
+    }
+
     if (cm_event->event == RDMA_CM_EVENT_DISCONNECTED ||
         cm_event->event == RDMA_CM_EVENT_DEVICE_REMOVAL) {
         if (!rdma->error_state &&
@@ -3372,6 +3824,9 @@ static int qemu_rdma_accept(RDMAContext *rdma)
     if (cap.flags & RDMA_CAPABILITY_PIN_ALL) {
         rdma->pin_all = true;
     }
+    if (cap.flags & RDMA_CAPABILITY_POSTCOPY_PULL) {
+        rdma->postcopy_pull = true;
+    }
 
     rdma->cm_id = cm_event->id;
     verbs = cm_event->id->verbs;
@@ -3394,6 +3849,12 @@ static int qemu_rdma_accept(RDMAContext *rdma)
 
     qemu_rdma_dump_id("dest_init", verbs);
 
+    if (rdma->odp && !qemu_rdma_has_odp(verbs)) {
+        error_report("rdma migration: device has no on-demand paging!");
+        ret = -EINVAL;
+        goto err_rdma_dest_wait;
+    }
+
     ret = qemu_rdma_alloc_pd_cq(rdma);
     if (ret) {
         error_report("rdma migration: error allocating pd and cq!");
@@ -3744,6 +4205,31 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
                 goto out;
             }
             break;
+        case RDMA_CONTROL_SOURCE_BLOCKS:
+            trace_qemu_rdma_registration_handle_source_blocks(head.len);
+
+            if (head.len != local->nb_blocks * sizeof(RDMADestBlock)) {
+                error_report("rdma: source blocks mismatch (%u bytes for "
+                             "%d blocks)", head.len, local->nb_blocks);
+                ret = -EIO;
+                goto out;
+            }
+            for (i = 0; i < local->nb_blocks; i++) {
+                RDMADestBlock *src_block =
+                    (RDMADestBlock *)rdma->wr_data[idx].control_curr + i;
+
+                network_to_dest_block(src_block);
+                /* The blocks are in the order of the source already */
+                if (src_block->length != local->block[i].length) {
+                    error_report("rdma: source block %s has a different "
+                                 "length", local->block[i].block_name);
+                    ret = -EIO;
+                    goto out;
+                }
+                local->block[i].src_host_addr = src_block->remote_host_addr;
+                local->block[i].src_rkey = src_block->remote_rkey;
+            }
+            break;
         case RDMA_CONTROL_REGISTER_RESULT:
             error_report("Invalid RESULT message at dest.");
             ret = -EIO;
@@ -3846,6 +4332,37 @@ static int qemu_rdma_registration_start(QEMUFile *f, void *opaque,
  * Inform dest that dynamic registrations are done for now.
  * First, flush writes, if any.
  */
+/*
+ * Tell the destination where the RAM blocks are on the source, for it
+ * to read the pages of postcopy faults from them.
+ */
+static int qemu_rdma_send_source_blocks(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMAControlHeader head = { .len = local->nb_blocks *
+                                      sizeof(RDMADestBlock),
+                               .type = RDMA_CONTROL_SOURCE_BLOCKS,
+                               .repeat = 1,
+                             };
+    RDMADestBlock *blocks = g_new0(RDMADestBlock, local->nb_blocks);
+    int i, ret;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        blocks[i].remote_host_addr =
+            (uintptr_t)local->block[i].local_host_addr;
+        blocks[i].remote_rkey = local->block[i].mr->rkey;
+        blocks[i].offset = local->block[i].offset;
+        blocks[i].length = local->block[i].length;
+        dest_block_to_network(&blocks[i]);
+    }
+
+    trace_qemu_rdma_send_source_blocks(local->nb_blocks);
+    ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *)blocks,
+                                  NULL, NULL, NULL);
+    g_free(blocks);
+    return ret;
+}
+
 static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
                                        uint64_t flags, void *data)
 {
@@ -3939,6 +4456,13 @@ static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
                     rdma->dest_blocks[i].remote_host_addr;
             local->block[i].remote_rkey = rdma->dest_blocks[i].remote_rkey;
         }
+
+        if (rdma->postcopy_pull) {
+            ret = qemu_rdma_send_source_blocks(rdma);
+            if (ret < 0) {
+                goto err;
+            }
+        }
     }
 
     trace_qemu_rdma_registration_stop(flags);
@@ -4036,6 +4560,158 @@ static QEMUFile *qemu_fopen_rdma(RDMAContext *rdma, const char *mode)
     return rioc->file;
 }
 
+bool qio_channel_is_rdma(QIOChannel *ioc)
+{
+    return object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_RDMA);
+}
+
+/* The destination takes the connections of the multifd channels in turn */
+static QemuMutex rdma_multifd_connect_lock;
+
+static void rdma_multifd_connect_init(void)
+{
+    qemu_mutex_init(&rdma_multifd_connect_lock);
+}
+migration_init(rdma_multifd_connect_init);
+
+static void rdma_multifd_connect_worker(QIOTask *task, gpointer opaque)
+{
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(qio_task_get_source(task));
+    RDMAContext *main_rdma = opaque;
+    RDMAContext *rdma;
+    Error *local_err = NULL;
+
+    if (!main_rdma->pin_all) {
+        error_setg(&local_err, "RDMA: multifd needs rdma-pin-all");
+        qio_task_set_error(task, local_err);
+        return;
+    }
+
+    rdma = qemu_rdma_data_init(main_rdma->host_port, &local_err);
+    if (!rdma) {
+        qio_task_set_error(task, local_err);
+        return;
+    }
+    rdma->main_ctx = main_rdma;
+
+    qemu_mutex_lock(&rdma_multifd_connect_lock);
+    if (qemu_rdma_source_init(rdma, false, &local_err) ||
+        qemu_rdma_connect(rdma, &local_err, true)) {
+        qemu_mutex_unlock(&rdma_multifd_connect_lock);
+        g_free(rdma);
+        qio_task_set_error(task, local_err);
+        return;
+    }
+    qemu_mutex_unlock(&rdma_multifd_connect_lock);
+
+    trace_rdma_multifd_connect(main_rdma->host_port);
+    rioc->rdmaout = rdma;
+}
+
+void rdma_send_channel_create(QIOTaskFunc f, void *data)
+{
+    QEMUFile *main_file = migrate_get_current()->to_dst_file;
+    QIOChannelRDMA *main_rioc = QIO_CHANNEL_RDMA(qemu_file_get_ioc(main_file));
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(object_new(TYPE_QIO_CHANNEL_RDMA));
+    QIOTask *task = qio_task_new(OBJECT(rioc), f, data, NULL);
+
+    qio_channel_set_name(QIO_CHANNEL(rioc), "migration-rdma-multifd");
+    /* The main channel outlives the multifd ones */
+    qio_task_run_in_thread(task, rdma_multifd_connect_worker,
+                           main_rioc->rdmaout, NULL, NULL);
+}
+
+static RDMALocalBlock *qemu_rdma_find_local_block(RDMAContext *rdma,
+                                                  uint8_t *host)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int i;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        RDMALocalBlock *block = &local->block[i];
+
+        if (host >= block->local_host_addr &&
+            host < block->local_host_addr + block->length) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+int rdma_multifd_write_pages(QIOChannel *ioc, const struct iovec *iov,
+                             size_t niov, Error **errp)
+{
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(ioc);
+    struct ibv_send_wr send_wr = {
+        .wr_id = RDMA_WRID_MULTIFD_WRITE,
+        .opcode = IBV_WR_RDMA_WRITE,
+        .send_flags = IBV_SEND_SIGNALED,
+        .num_sge = 1,
+    };
+    struct ibv_send_wr *bad_wr;
+    struct ibv_sge sge;
+    RDMAContext *rdma;
+    size_t i;
+    int ret;
+
+    RCU_READ_LOCK_GUARD();
+    rdma = qatomic_rcu_read(&rioc->rdmaout);
+    if (!rdma) {
+        error_setg(errp, "RDMA: multifd channel is closed");
+        return -1;
+    }
+
+    for (i = 0; i < niov; i++) {
+        uint8_t *host = iov[i].iov_base;
+        RDMALocalBlock *block =
+            qemu_rdma_find_local_block(rdma->main_ctx, host);
+        size_t len = iov[i].iov_len;
+
+        if (!block || !block->mr) {
+            error_setg(errp, "RDMA: page %p is not registered", host);
+            return -1;
+        }
+        /* One write for contiguous pages */
+        while (i + 1 < niov && iov[i + 1].iov_base == host + len &&
+               host + len + iov[i + 1].iov_len <=
+               block->local_host_addr + block->length) {
+            len += iov[++i].iov_len;
+        }
+
+        sge.addr = (uintptr_t)host;
+        sge.length = len;
+        sge.lkey = block->mr->lkey;
+        send_wr.sg_list = &sge;
+        send_wr.wr.rdma.remote_addr = block->remote_host_addr +
+                                      (host - block->local_host_addr);
+        send_wr.wr.rdma.rkey = block->remote_rkey;
+
+        trace_rdma_multifd_write_pages(host, len, rdma->nb_sent);
+        while ((ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr)) == ENOMEM) {
+            /* The send queue is full, wait for a write to complete */
+            if (qemu_rdma_block_for_wrid(rdma, RDMA_WRID_MULTIFD_WRITE,
+                                         NULL) < 0) {
+                error_setg(errp, "RDMA: multifd write failed");
+                return -1;
+            }
+        }
+        if (ret) {
+            error_setg_errno(errp, ret, "RDMA: multifd ibv_post_send failed");
+            return -1;
+        }
+        rdma->nb_sent++;
+    }
+
+    while (rdma->nb_sent) {
+        if (qemu_rdma_block_for_wrid(rdma, RDMA_WRID_MULTIFD_WRITE,
+                                     NULL) < 0) {
+            error_setg(errp, "RDMA: multifd write failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static void rdma_accept_incoming_migration(void *opaque)
 {
     RDMAContext *rdma = opaque;
@@ -4071,6 +4747,74 @@ static void rdma_accept_incoming_migration(void *opaque)
     }
 }
 
+int rdma_postcopy_pull_page(RAMBlock *rb, ram_addr_t offset)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    size_t pagesize = qemu_ram_pagesize(rb);
+    uint8_t *host = rb->host + offset;
+    struct ibv_send_wr send_wr = {
+        .wr_id = RDMA_WRID_POSTCOPY_PULL,
+        .opcode = IBV_WR_RDMA_READ,
+        .send_flags = IBV_SEND_SIGNALED,
+        .num_sge = 1,
+    };
+    struct ibv_send_wr *bad_wr;
+    struct ibv_sge sge;
+    RDMAContext *rdma, *pull;
+    RDMALocalBlock *block;
+    QIOChannel *ioc;
+    int ret;
+
+    if (!mis->postcopy_pull || !mis->from_src_file) {
+        return -ENOENT;
+    }
+    ioc = qemu_file_get_ioc(mis->from_src_file);
+    if (!qio_channel_is_rdma(ioc)) {
+        return -ENOENT;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    rdma = qatomic_rcu_read(&QIO_CHANNEL_RDMA(ioc)->rdmain);
+    if (!rdma || !rdma->pull || rdma->pull->error_state) {
+        return -ENOENT;
+    }
+    pull = rdma->pull;
+    block = qemu_rdma_find_local_block(rdma, host);
+    if (!block || !block->src_rkey || pagesize > pull->pull_len) {
+        return -ENOENT;
+    }
+
+    /* The stream may have brought it meanwhile */
+    if (ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+        return 0;
+    }
+
+    sge.addr = (uintptr_t)pull->pull_buf;
+    sge.length = pagesize;
+    sge.lkey = pull->pull_mr->lkey;
+    send_wr.sg_list = &sge;
+    send_wr.wr.rdma.remote_addr = block->src_host_addr +
+                                  (host - block->local_host_addr);
+    send_wr.wr.rdma.rkey = block->src_rkey;
+
+    trace_rdma_postcopy_pull_page(rb->idstr, offset, pagesize);
+    ret = ibv_post_send(pull->qp, &send_wr, &bad_wr);
+    if (!ret) {
+        ret = qemu_rdma_block_for_wrid(pull, RDMA_WRID_POSTCOPY_PULL, NULL);
+    } else {
+        ret = -ret;
+    }
+    if (ret < 0) {
+        /* Ask the source for the pages from now on */
+        warn_report("rdma: postcopy pull failed (%d), asking the source "
+                    "for the pages", ret);
+        pull->error_state = ret;
+        return -ENOENT;
+    }
+
+    return postcopy_place_page(mis, host, pull->pull_buf, rb);
+}
+
 void rdma_start_incoming_migration(const char *host_port, Error **errp)
 {
     int ret;
@@ -4149,6 +4893,10 @@ void rdma_start_outgoing_migration(void *opaque,
         goto err;
     }
 
+    /* The destination reads from the registrations of the whole blocks */
+    rdma->postcopy_pull = migrate_postcopy() && rdma->pin_all &&
+        s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_POSTCOPY_PULL];
+
     trace_rdma_start_outgoing_migration_after_rdma_source_init();
     ret = qemu_rdma_connect(rdma, errp, false);
 
@@ -4182,6 +4930,19 @@ void rdma_start_outgoing_migration(void *opaque,
         rdma_return_path->is_return_path = true;
     }
 
+    if (rdma->postcopy_pull) {
+        RDMAContext *pull = qemu_rdma_data_init(host_port, errp);
+
+        pull->main_ctx = rdma;
+        pull->is_postcopy_pull = true;
+        if (qemu_rdma_source_init(pull, false, errp) ||
+            qemu_rdma_connect(pull, errp, true)) {
+            g_free(pull);
+            goto return_path_err;
+        }
+        rdma->pull = pull;
+    }
+
     trace_rdma_start_outgoing_migration_after_rdma_connect();
 
     s->to_dst_file = qemu_fopen_rdma(rdma, "wb");
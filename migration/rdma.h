@@ -17,9 +17,64 @@
 #ifndef QEMU_MIGRATION_RDMA_H
 #define QEMU_MIGRATION_RDMA_H
 
+#include "exec/cpu-common.h"
+#include "io/channel.h"
+#include "io/task.h"
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port,
                                    Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
 
+#ifdef CONFIG_RDMA
+bool qio_channel_is_rdma(QIOChannel *ioc);
+
+/*
+ * Connect a multifd channel to the destination of the RDMA migration
+ * in progress, with a queue pair and completion queue of its own.
+ * Like socket_send_channel_create(), @f is called with the channel.
+ */
+void rdma_send_channel_create(QIOTaskFunc f, void *data);
+
+/*
+ * Write the pages of @iov, in guest RAM, to the RAM of the destination
+ * through the multifd channel @ioc.  Needs rdma-pin-all, the channels
+ * use the registrations of the main one.  The packet that describes
+ * the pages is sent after them on the same queue pair, so they are in
+ * place when the destination reads it.
+ */
+int rdma_multifd_write_pages(QIOChannel *ioc, const struct iovec *iov,
+                             size_t niov, Error **errp);
+
+/*
+ * With rdma-postcopy-pull, read the host page at @offset of @rb with
+ * RDMA straight from the source RAM, and place it.  Called by the
+ * postcopy fault thread, without going through the source migration
+ * thread.  Returns -ENOENT if the page has to be asked for instead.
+ */
+int rdma_postcopy_pull_page(RAMBlock *rb, ram_addr_t offset);
+#else
+static inline bool qio_channel_is_rdma(QIOChannel *ioc)
+{
+    return false;
+}
+
+static inline void rdma_send_channel_create(QIOTaskFunc f, void *data)
+{
+    g_assert_not_reached();
+}
+
+static inline int rdma_multifd_write_pages(QIOChannel *ioc,
+                                           const struct iovec *iov,
+                                           size_t niov, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+static inline int rdma_postcopy_pull_page(RAMBlock *rb, ram_addr_t offset)
+{
+    return -ENOENT;
+}
+#endif
+
 #endif
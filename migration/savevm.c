@@ -52,9 +52,11 @@
 #include "exec/target_page.h"
 #include "trace.h"
 #include "qemu/iov.h"
+#include "qemu/thread-context.h"
 #include "qemu/main-loop.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "sysemu/replay.h"
@@ -87,10 +89,18 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_POSTCOPY_RAM_DISCARD_BITMAP, /* A bitmap of pages to discard,
+                                            postcopy-discard-bitmap */
     MIG_CMD_MAX
 };
 
 #define MAX_VM_CMD_PACKAGED_SIZE UINT32_MAX
+/* How often the early device state is saved again while iterating */
+#define EARLY_DEVICE_STATE_INTERVAL 1000
+
+/* Smallest byte budget of a live handler with fair-iteration */
+#define SAVEVM_FAIR_MIN_SHARE (64 * 1024)
+
 static struct mig_cmd_args {
     ssize_t     len; /* -1 = variable */
     const char *name;
@@ -106,6 +116,8 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_POSTCOPY_RAM_DISCARD_BITMAP] = {
+                            .len = -1, .name = "POSTCOPY_RAM_DISCARD_BITMAP" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -129,47 +141,252 @@ static struct mig_cmd_args {
 /***********************************************************/
 /* savevm/loadvm support */
 
+/*
+ * The VM state is written in large buffers, with several of them in flight
+ * at once, and read ahead the same way, instead of doing synchronous I/O
+ * for every IO_BUF_SIZE that QEMUFile has.
+ */
+#define VMSTATE_BUF_SIZE    (8 * MiB)
+#define VMSTATE_NR_BUFS     4
+
+typedef struct BdrvVMState BdrvVMState;
+
+typedef struct BdrvVMStateBuf {
+    BdrvVMState *s;
+    uint8_t *data;
+    /* Position of the buffer in the VM state, and bytes that are valid */
+    int64_t pos;
+    size_t len;
+    bool busy;
+    int ret;
+} BdrvVMStateBuf;
+
+struct BdrvVMState {
+    BlockDriverState *bs;
+    bool is_writable;
+    /* The buffer being filled or consumed, the next ones are in flight */
+    unsigned int cur;
+    BdrvVMStateBuf bufs[VMSTATE_NR_BUFS];
+    /* First error of a write */
+    int ret;
+};
+
+static void coroutine_fn bdrv_vmstate_co_entry(void *opaque)
+{
+    BdrvVMStateBuf *b = opaque;
+    BdrvVMState *s = b->s;
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_buf(&qiov, b->data, b->len);
+    if (s->is_writable) {
+        b->ret = bdrv_writev_vmstate(s->bs, &qiov, b->pos);
+        if (b->ret < 0 && s->ret == 0) {
+            s->ret = b->ret;
+        }
+        b->len = 0;
+    } else {
+        b->ret = bdrv_readv_vmstate(s->bs, &qiov, b->pos);
+    }
+    trace_bdrv_vmstate_io_done(s->is_writable, b->pos, qiov.size, b->ret);
+
+    b->busy = false;
+    aio_wait_kick();
+}
+
+static void bdrv_vmstate_submit(BdrvVMStateBuf *b, int64_t pos, size_t len)
+{
+    Coroutine *co = qemu_coroutine_create(bdrv_vmstate_co_entry, b);
+
+    assert(!b->busy);
+    b->pos = pos;
+    b->len = len;
+    b->busy = true;
+    bdrv_coroutine_enter(b->s->bs, co);
+}
+
+static void bdrv_vmstate_wait(BdrvVMStateBuf *b)
+{
+    BDRV_POLL_WHILE(b->s->bs, b->busy);
+}
+
+/* Write what is buffered and wait for all the I/O in flight */
+static int bdrv_vmstate_drain(BdrvVMState *s)
+{
+    BdrvVMStateBuf *b = &s->bufs[s->cur];
+    int i;
+
+    if (s->is_writable && b->len) {
+        bdrv_vmstate_submit(b, b->pos, b->len);
+    }
+    for (i = 0; i < VMSTATE_NR_BUFS; i++) {
+        bdrv_vmstate_wait(&s->bufs[i]);
+        if (!s->is_writable) {
+            /* Force a new readahead */
+            s->bufs[i].len = 0;
+        }
+    }
+    return s->ret;
+}
+
 static ssize_t block_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                    int64_t pos, Error **errp)
 {
-    int ret;
-    QEMUIOVector qiov;
+    BdrvVMState *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
 
-    qemu_iovec_init_external(&qiov, iov, iovcnt);
-    ret = bdrv_writev_vmstate(opaque, &qiov, pos);
-    if (ret < 0) {
-        return ret;
+    while (done < size) {
+        BdrvVMStateBuf *b = &s->bufs[s->cur];
+        size_t n;
+
+        if (s->ret < 0) {
+            return s->ret;
+        }
+        if (b->len && b->pos + b->len != pos + done) {
+            /* Not contiguous, write what we have first */
+            bdrv_vmstate_submit(b, b->pos, b->len);
+        } else {
+            if (!b->len) {
+                b->pos = pos + done;
+            }
+            n = iov_to_buf(iov, iovcnt, done, b->data + b->len,
+                           VMSTATE_BUF_SIZE - b->len);
+            b->len += n;
+            done += n;
+            if (b->len < VMSTATE_BUF_SIZE) {
+                continue;
+            }
+            bdrv_vmstate_submit(b, b->pos, b->len);
+        }
+
+        /* Wait until the next buffer is available */
+        s->cur = (s->cur + 1) % VMSTATE_NR_BUFS;
+        bdrv_vmstate_wait(&s->bufs[s->cur]);
     }
 
-    return qiov.size;
+    return size;
 }
 
 static ssize_t block_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
                                 size_t size, Error **errp)
 {
-    return bdrv_load_vmstate(opaque, buf, pos, size);
+    BdrvVMState *s = opaque;
+    BdrvVMStateBuf *b = &s->bufs[s->cur];
+    int i;
+
+    if (b->len && pos == b->pos + b->len) {
+        /* Done with this buffer, read ahead the one after the last */
+        int64_t next = s->bufs[(s->cur + VMSTATE_NR_BUFS - 1) %
+                               VMSTATE_NR_BUFS].pos + VMSTATE_BUF_SIZE;
+
+        bdrv_vmstate_submit(b, next, VMSTATE_BUF_SIZE);
+        s->cur = (s->cur + 1) % VMSTATE_NR_BUFS;
+        b = &s->bufs[s->cur];
+    }
+    if (!b->len || pos < b->pos || pos >= b->pos + b->len) {
+        /* Start reading ahead from @pos, e.g. the first time */
+        bdrv_vmstate_drain(s);
+        trace_bdrv_vmstate_readahead(pos);
+        for (i = 0; i < VMSTATE_NR_BUFS; i++) {
+            bdrv_vmstate_submit(&s->bufs[(s->cur + i) % VMSTATE_NR_BUFS],
+                                pos + i * VMSTATE_BUF_SIZE, VMSTATE_BUF_SIZE);
+        }
+    }
+
+    bdrv_vmstate_wait(b);
+    if (b->ret < 0) {
+        /* Read it again next time */
+        b->len = 0;
+        return b->ret;
+    }
+
+    size = MIN(size, b->pos + b->len - pos);
+    memcpy(buf, b->data + (pos - b->pos), size);
+    return size;
 }
 
 static int bdrv_fclose(void *opaque, Error **errp)
 {
-    return bdrv_flush(opaque);
+    BdrvVMState *s = opaque;
+    int ret = bdrv_vmstate_drain(s);
+    int i;
+
+    for (i = 0; i < VMSTATE_NR_BUFS; i++) {
+        qemu_vfree(s->bufs[i].data);
+    }
+    if (ret == 0) {
+        ret = bdrv_flush(s->bs);
+    }
+    g_free(s);
+    return ret;
+}
+
+/* Each access gives its position in the vmstate, there's nothing to do */
+static int block_seek(void *opaque, int64_t pos, Error **errp)
+{
+    return 0;
+}
+
+static int block_write_at(void *opaque, const uint8_t *buf, size_t size,
+                          int64_t pos, Error **errp)
+{
+    BdrvVMState *s = opaque;
+    int ret = bdrv_vmstate_drain(s);
+
+    if (ret == 0) {
+        ret = bdrv_save_vmstate(s->bs, buf, pos, size);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Unable to write the VM state");
+        return -1;
+    }
+    return 0;
+}
+
+static int block_read_at(void *opaque, uint8_t *buf, size_t size,
+                         int64_t pos, Error **errp)
+{
+    BdrvVMState *s = opaque;
+    int ret = bdrv_load_vmstate(s->bs, buf, pos, size);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Unable to read the VM state");
+        return -1;
+    }
+    return 0;
 }
 
 static const QEMUFileOps bdrv_read_ops = {
     .get_buffer = block_get_buffer,
-    .close =      bdrv_fclose
+    .close =      bdrv_fclose,
+    .seek =       block_seek,
+    .read_at =    block_read_at,
 };
 
 static const QEMUFileOps bdrv_write_ops = {
     .writev_buffer  = block_writev_buffer,
-    .close          = bdrv_fclose
+    .close          = bdrv_fclose,
+    .seek           = block_seek,
+    .write_at       = block_write_at,
 };
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
+    BdrvVMState *s = g_new0(BdrvVMState, 1);
+    int i;
+
+    s->bs = bs;
+    s->is_writable = is_writable;
+    for (i = 0; i < VMSTATE_NR_BUFS; i++) {
+        s->bufs[i].s = s;
+        s->bufs[i].data = qemu_blockalign(bs, VMSTATE_BUF_SIZE);
+    }
+
     if (is_writable) {
-        return qemu_fopen_ops(bs, &bdrv_write_ops);
+        return qemu_fopen_ops(s, &bdrv_write_ops);
     }
+    return qemu_fopen_ops(s, &bdrv_read_ops);
+}
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
 
@@ -248,12 +465,18 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* What save_live_pending reported last, for fair-iteration */
+    uint64_t pending;
+    /* The section sent for early-device-state, NULL if none */
+    GByteArray *early_state;
 } SaveStateEntry;
 
 typedef struct SaveState {
     QTAILQ_HEAD(, SaveStateEntry) handlers;
     SaveStateEntry *handler_pri_head[MIG_PRI_MAX + 1];
     int global_section_id;
+    /* When the early device state was last sent */
+    int64_t early_state_time;
     uint32_t len;
     const char *name;
     uint32_t target_page_bits;
@@ -1005,9 +1228,17 @@ void qemu_savevm_send_colo_enable(QEMUFile *f)
 
 void qemu_savevm_send_ping(QEMUFile *f, uint32_t value)
 {
+    MigrationState *s = migrate_get_current();
     uint32_t buf;
 
     trace_savevm_send_ping(value);
+    /* Time the round trip of one ping at a time on the main stream */
+    if (f == s->to_dst_file && !qatomic_read__nocheck(&s->ping_time)) {
+        s->ping_value = value;
+        smp_wmb();
+        qatomic_set__nocheck(&s->ping_time,
+                             qemu_clock_get_us(QEMU_CLOCK_REALTIME));
+    }
     buf = cpu_to_be32(value);
     qemu_savevm_command_send(f, MIG_CMD_PING, sizeof(value), (uint8_t *)&buf);
 }
@@ -1109,6 +1340,39 @@ void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
     g_free(buf);
 }
 
+/*
+ * Discard the pages of @name from @start (bytes) for which a bit is set
+ * in @bitmap, of @len bytes.  Bit n of byte i is page i * 8 + n.
+ */
+void qemu_savevm_send_postcopy_ram_discard_bitmap(QEMUFile *f,
+                                                  const char *name,
+                                                  uint64_t start,
+                                                  const uint8_t *bitmap,
+                                                  uint16_t len)
+{
+    uint8_t *buf;
+    uint16_t tmplen;
+    size_t name_len = strlen(name);
+
+    trace_qemu_savevm_send_postcopy_ram_discard_bitmap(name, start, len);
+    assert(name_len < 256);
+    assert(1 + 1 + name_len + 1 + 8 + len <= UINT16_MAX);
+    buf = g_malloc0(1 + 1 + name_len + 1 + 8 + len);
+    buf[0] = postcopy_ram_discard_version;
+    buf[1] = name_len;
+    memcpy(buf + 2, name, name_len);
+    tmplen = 2 + name_len;
+    buf[tmplen++] = '\0';
+    stq_be_p(buf + tmplen, start);
+    tmplen += 8;
+    memcpy(buf + tmplen, bitmap, len);
+    tmplen += len;
+
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD_BITMAP,
+                             tmplen, buf);
+    g_free(buf);
+}
+
 /* Get the destination into a state where it can receive postcopy data. */
 void qemu_savevm_send_postcopy_listen(QEMUFile *f)
 {
@@ -1202,6 +1466,7 @@ void qemu_savevm_state_setup(QEMUFile *f)
     int ret;
 
     trace_savevm_state_setup();
+    savevm_state.early_state_time = 0;
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->save_setup) {
             continue;
@@ -1257,50 +1522,118 @@ int qemu_savevm_state_resume_prepare(MigrationState *s)
  *   0 : We haven't finished, caller have to go again
  *   1 : We have finished, we can go to complete phase
  */
-int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
+static bool savevm_state_should_iterate(SaveStateEntry *se, bool postcopy)
+{
+    if (!se->ops || !se->ops->save_live_iterate) {
+        return false;
+    }
+    if (se->ops->is_active &&
+        !se->ops->is_active(se->opaque)) {
+        return false;
+    }
+    if (se->ops->is_active_iterate &&
+        !se->ops->is_active_iterate(se->opaque)) {
+        return false;
+    }
+    /*
+     * In the postcopy phase, any device that doesn't know how to
+     * do postcopy should have saved it's state in the _complete
+     * call that's already run, it might get confused if we call
+     * iterate afterwards.
+     */
+    if (postcopy &&
+        !(se->ops->has_postcopy && se->ops->has_postcopy(se->opaque))) {
+        return false;
+    }
+    return true;
+}
+
+static int savevm_state_iterate_one(QEMUFile *f, SaveStateEntry *se)
+{
+    int ret;
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+
+    save_section_header(f, se, QEMU_VM_SECTION_PART);
+
+    ret = se->ops->save_live_iterate(f, se->opaque);
+    trace_savevm_section_end(se->idstr, se->section_id, ret);
+    save_section_footer(f, se);
+
+    if (ret < 0) {
+        error_report("failed to save SaveStateEntry with id(name): %d(%s)",
+                     se->section_id, se->idstr);
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
+/*
+ * With fair-iteration, share what the rate limit lets through among all
+ * the live handlers, in proportion to what each of them has pending,
+ * so that they all get done at about the same time instead of one
+ * after the other.
+ */
+static int qemu_savevm_state_iterate_fair(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
+    uint64_t pending = 0;
+    int64_t budget;
     int ret = 1;
 
-    trace_savevm_state_iterate();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
-        if (!se->ops || !se->ops->save_live_iterate) {
-            continue;
-        }
-        if (se->ops->is_active &&
-            !se->ops->is_active(se->opaque)) {
-            continue;
-        }
-        if (se->ops->is_active_iterate &&
-            !se->ops->is_active_iterate(se->opaque)) {
-            continue;
+        if (savevm_state_should_iterate(se, postcopy)) {
+            pending += se->pending;
         }
-        /*
-         * In the postcopy phase, any device that doesn't know how to
-         * do postcopy should have saved it's state in the _complete
-         * call that's already run, it might get confused if we call
-         * iterate afterwards.
-         */
-        if (postcopy &&
-            !(se->ops->has_postcopy && se->ops->has_postcopy(se->opaque))) {
+    }
+    budget = MIN(qemu_file_rate_limit_remaining(f), pending);
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int64_t share;
+        int r;
+
+        if (!savevm_state_should_iterate(se, postcopy)) {
             continue;
         }
         if (qemu_file_rate_limit(f)) {
             return 0;
         }
-        trace_savevm_section_start(se->idstr, se->section_id);
+        /* Without pending sizes (savevm), only the rate limit applies */
+        share = 0;
+        if (pending) {
+            share = MAX((double)budget * se->pending / pending,
+                        SAVEVM_FAIR_MIN_SHARE);
+        }
+        trace_savevm_state_iterate_fair(se->idstr, se->pending, share);
 
-        save_section_header(f, se, QEMU_VM_SECTION_PART);
+        qemu_file_set_budget(f, share);
+        r = savevm_state_iterate_one(f, se);
+        qemu_file_set_budget(f, 0);
+        if (r < 0) {
+            return r;
+        }
+        ret = MIN(ret, r);
+    }
+    return ret;
+}
 
-        ret = se->ops->save_live_iterate(f, se->opaque);
-        trace_savevm_section_end(se->idstr, se->section_id, ret);
-        save_section_footer(f, se);
+int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
+{
+    SaveStateEntry *se;
+    int ret = 1;
 
-        if (ret < 0) {
-            error_report("failed to save SaveStateEntry with id(name): %d(%s)",
-                         se->section_id, se->idstr);
-            qemu_file_set_error(f, ret);
+    trace_savevm_state_iterate();
+    if (migrate_fair_iteration()) {
+        return qemu_savevm_state_iterate_fair(f, postcopy);
+    }
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!savevm_state_should_iterate(se, postcopy)) {
+            continue;
+        }
+        if (qemu_file_rate_limit(f)) {
+            return 0;
         }
+        ret = savevm_state_iterate_one(f, se);
         if (ret <= 0) {
             /* Do not proceed to the next vmstate before this one reported
                completion of the current stage. This serializes the migration
@@ -1358,6 +1691,79 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * Save @se to a buffer, and send it to @f if it isn't what was sent
+ * last for early-device-state.  Returns 1 if it was sent, 0 if it
+ * didn't change, or -errno.
+ */
+static int qemu_savevm_send_early_state(QEMUFile *f, SaveStateEntry *se)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(4096);
+    QEMUFile *fb;
+    int ret;
+
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-savevm-early");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+
+    save_section_header(fb, se, QEMU_VM_SECTION_FULL);
+    ret = vmstate_save(fb, se, NULL);
+    if (!ret) {
+        save_section_footer(fb, se);
+        qemu_fflush(fb);
+        ret = qemu_file_get_error(fb);
+    }
+    if (ret) {
+        goto out;
+    }
+
+    if (se->early_state && se->early_state->len == bioc->usage &&
+        !memcmp(se->early_state->data, bioc->data, bioc->usage)) {
+        goto out;
+    }
+    qemu_put_buffer(f, bioc->data, bioc->usage);
+    if (se->early_state) {
+        g_byte_array_set_size(se->early_state, 0);
+    } else {
+        se->early_state = g_byte_array_sized_new(bioc->usage);
+    }
+    g_byte_array_append(se->early_state, bioc->data, bioc->usage);
+    ret = 1;
+
+out:
+    trace_savevm_send_early_state(se->idstr, se->section_id, bioc->usage,
+                                  ret);
+    qemu_fclose(fb);
+    object_unref(OBJECT(bioc));
+    return ret;
+}
+
+void qemu_savevm_state_early_devices(QEMUFile *f)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    SaveStateEntry *se;
+    int ret = 0;
+
+    if (savevm_state.early_state_time &&
+        now - savevm_state.early_state_time < EARLY_DEVICE_STATE_INTERVAL) {
+        return;
+    }
+    savevm_state.early_state_time = now;
+
+    qemu_mutex_lock_iothread();
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!se->vmsd || !se->vmsd->early ||
+            !vmstate_save_needed(se->vmsd, se->opaque)) {
+            continue;
+        }
+        ret = qemu_savevm_send_early_state(f, se);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            break;
+        }
+    }
+    qemu_mutex_unlock_iothread();
+}
+
 static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
@@ -1393,21 +1799,308 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
+/*
+ * With device-state-threads, the devices whose VMStateDescription is
+ * parallel are saved to buffers, and loaded from them, by a pool of
+ * threads outside the iothread lock.  The buffers are sent in the
+ * order of the handlers, so that the other sections don't move:
+ *
+ *   QEMU_VM_SECTION_BUFFERED, be32 length, QEMU_VM_SECTION_FULL section
+ *
+ * On the destination, a run of buffered sections is loaded at once and
+ * waited for before the next section that isn't buffered.
+ */
+typedef struct DeviceStateJob {
+    /* The entry to save, NULL to load */
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    bool done;
+    int ret;
+    QSIMPLEQ_ENTRY(DeviceStateJob) next;
+} DeviceStateJob;
+
+static struct {
+    QemuThread *threads;
+    int nr_threads;
+    QemuMutex lock;
+    QemuCond cond;
+    QemuCond done_cond;
+    QSIMPLEQ_HEAD(, DeviceStateJob) jobs;
+    unsigned int pending;
+    /* First error of the loads */
+    int ret;
+    bool quit;
+} device_state_pool;
+
+static int qemu_loadvm_section_start_full(QEMUFile *f,
+                                          MigrationIncomingState *mis);
+
+static int device_state_job_run(DeviceStateJob *job)
+{
+    int ret;
+
+    if (job->se) {
+        save_section_header(job->fb, job->se, QEMU_VM_SECTION_FULL);
+        ret = vmstate_save(job->fb, job->se, NULL);
+        if (ret) {
+            return ret;
+        }
+        save_section_footer(job->fb, job->se);
+        qemu_fflush(job->fb);
+        return qemu_file_get_error(job->fb);
+    }
+
+    if (qemu_get_byte(job->fb) != QEMU_VM_SECTION_FULL) {
+        error_report("Buffered section is not a full section");
+        return -EINVAL;
+    }
+    return qemu_loadvm_section_start_full(job->fb,
+                                          migration_incoming_get_current());
+}
+
+static void *device_state_thread(void *opaque)
+{
+    DeviceStateJob *job;
+    int ret;
+
+    qemu_mutex_lock(&device_state_pool.lock);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&device_state_pool.jobs);
+        if (!job) {
+            if (device_state_pool.quit) {
+                break;
+            }
+            qemu_cond_wait(&device_state_pool.cond, &device_state_pool.lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&device_state_pool.jobs, next);
+        qemu_mutex_unlock(&device_state_pool.lock);
+
+        ret = device_state_job_run(job);
+        trace_device_state_job(job->se ? "save" : "load", ret);
+
+        qemu_mutex_lock(&device_state_pool.lock);
+        job->ret = ret;
+        job->done = true;
+        if (!job->se) {
+            if (ret < 0 && !device_state_pool.ret) {
+                device_state_pool.ret = ret;
+            }
+            qemu_fclose(job->fb);
+            g_free(job);
+        }
+        device_state_pool.pending--;
+        qemu_cond_broadcast(&device_state_pool.done_cond);
+    }
+    qemu_mutex_unlock(&device_state_pool.lock);
+
+    return NULL;
+}
+
+static void device_state_pool_start(void)
+{
+    int i;
+
+    if (device_state_pool.threads) {
+        return;
+    }
+
+    qemu_mutex_init(&device_state_pool.lock);
+    qemu_cond_init(&device_state_pool.cond);
+    qemu_cond_init(&device_state_pool.done_cond);
+    QSIMPLEQ_INIT(&device_state_pool.jobs);
+    device_state_pool.pending = 0;
+    device_state_pool.ret = 0;
+    device_state_pool.quit = false;
+    device_state_pool.nr_threads = migrate_device_state_threads();
+    device_state_pool.threads = g_new0(QemuThread,
+                                       device_state_pool.nr_threads);
+    for (i = 0; i < device_state_pool.nr_threads; i++) {
+        thread_context_create_thread(THREAD_GROUP_MIGRATION,
+                                     &device_state_pool.threads[i],
+                                     "devstate", device_state_thread, NULL);
+    }
+}
+
+/* The queued jobs are all run before the threads exit */
+static void device_state_pool_stop(void)
+{
+    int i;
+
+    if (!device_state_pool.threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&device_state_pool.lock);
+    device_state_pool.quit = true;
+    qemu_cond_broadcast(&device_state_pool.cond);
+    qemu_mutex_unlock(&device_state_pool.lock);
+
+    for (i = 0; i < device_state_pool.nr_threads; i++) {
+        qemu_thread_join(&device_state_pool.threads[i]);
+    }
+    g_free(device_state_pool.threads);
+    device_state_pool.threads = NULL;
+    device_state_pool.nr_threads = 0;
+    qemu_cond_destroy(&device_state_pool.done_cond);
+    qemu_cond_destroy(&device_state_pool.cond);
+    qemu_mutex_destroy(&device_state_pool.lock);
+}
+
+static void device_state_pool_queue(DeviceStateJob *job)
+{
+    qemu_mutex_lock(&device_state_pool.lock);
+    QSIMPLEQ_INSERT_TAIL(&device_state_pool.jobs, job, next);
+    device_state_pool.pending++;
+    qemu_cond_signal(&device_state_pool.cond);
+    qemu_mutex_unlock(&device_state_pool.lock);
+}
+
+/* Wait for all the queued jobs, returns the first error of the loads */
+static int device_state_pool_wait(void)
+{
+    int ret;
+
+    if (!device_state_pool.threads) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&device_state_pool.lock);
+    while (device_state_pool.pending) {
+        qemu_cond_wait(&device_state_pool.done_cond, &device_state_pool.lock);
+    }
+    ret = device_state_pool.ret;
+    device_state_pool.ret = 0;
+    qemu_mutex_unlock(&device_state_pool.lock);
+
+    return ret;
+}
+
+static void device_state_job_wait(DeviceStateJob *job)
+{
+    qemu_mutex_lock(&device_state_pool.lock);
+    while (!job->done) {
+        qemu_cond_wait(&device_state_pool.done_cond, &device_state_pool.lock);
+    }
+    qemu_mutex_unlock(&device_state_pool.lock);
+}
+
+static bool device_state_parallel(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->parallel &&
+           vmstate_save_needed(se->vmsd, se->opaque);
+}
+
+/* Queue the parallel devices, returns the jobs in the handlers' order */
+static DeviceStateJob *device_state_save_start(int *nr_jobs)
+{
+    DeviceStateJob *jobs;
+    SaveStateEntry *se;
+    int i = 0;
+
+    *nr_jobs = 0;
+    if (!migrate_device_state_threads()) {
+        return NULL;
+    }
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (device_state_parallel(se)) {
+            (*nr_jobs)++;
+        }
+    }
+    if (!*nr_jobs) {
+        return NULL;
+    }
+
+    device_state_pool_start();
+    jobs = g_new0(DeviceStateJob, *nr_jobs);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (device_state_parallel(se)) {
+            jobs[i].se = se;
+            jobs[i].bioc = qio_channel_buffer_new(4096);
+            qio_channel_set_name(QIO_CHANNEL(jobs[i].bioc),
+                                 "migration-savevm-buffer");
+            jobs[i].fb = qemu_fopen_channel_output(QIO_CHANNEL(jobs[i].bioc));
+            device_state_pool_queue(&jobs[i]);
+            i++;
+        }
+    }
+    return jobs;
+}
+
+static void device_state_save_finish(DeviceStateJob *jobs, int nr_jobs)
+{
+    int i;
+
+    if (!jobs) {
+        return;
+    }
+    for (i = 0; i < nr_jobs; i++) {
+        device_state_job_wait(&jobs[i]);
+        qemu_fclose(jobs[i].fb);
+        object_unref(OBJECT(jobs[i].bioc));
+    }
+    g_free(jobs);
+    device_state_pool_stop();
+}
+
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
 {
     g_autoptr(JSONWriter) vmdesc = NULL;
+    int64_t start = qemu_ftell_fast(f);
+    int64_t start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    DeviceStateJob *jobs, *job;
+    int nr_jobs, job_idx = 0;
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
+    jobs = device_state_save_start(&nr_jobs);
+
     vmdesc = json_writer_new(false);
     json_writer_start_object(vmdesc, NULL);
     json_writer_int64(vmdesc, "page_size", qemu_target_page_size());
     json_writer_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
+        if (se->early_state) {
+            ret = qemu_savevm_send_early_state(f, se);
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                goto out;
+            }
+            if (ret) {
+                /* The fields can't be described from the buffer */
+                json_writer_start_object(vmdesc, NULL);
+                json_writer_str(vmdesc, "name", se->idstr);
+                json_writer_int64(vmdesc, "instance_id", se->instance_id);
+                json_writer_end_object(vmdesc);
+            }
+            continue;
+        }
+        if (job_idx < nr_jobs && jobs[job_idx].se == se) {
+            job = &jobs[job_idx++];
+            device_state_job_wait(job);
+            if (job->ret) {
+                ret = job->ret;
+                qemu_file_set_error(f, ret);
+                goto out;
+            }
+            trace_savevm_section_buffered(se->idstr, se->section_id,
+                                          job->bioc->usage);
+            /* The fields can't be described from the buffer */
+            json_writer_start_object(vmdesc, NULL);
+            json_writer_str(vmdesc, "name", se->idstr);
+            json_writer_int64(vmdesc, "instance_id", se->instance_id);
+            json_writer_end_object(vmdesc);
+
+            qemu_put_byte(f, QEMU_VM_SECTION_BUFFERED);
+            qemu_put_be32(f, job->bioc->usage);
+            qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+            continue;
+        }
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
@@ -1426,13 +2119,15 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
-            return ret;
+            goto out;
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
 
         json_writer_end_object(vmdesc);
     }
+    device_state_save_finish(jobs, nr_jobs);
+    jobs = NULL;
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -1460,7 +2155,15 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         qemu_put_buffer(f, (uint8_t *)json_writer_get(vmdesc), vmdesc_len);
     }
 
+    /* For the downtime model of the next migration */
+    migrate_get_current()->device_state_size = qemu_ftell_fast(f) - start;
+    migrate_get_current()->device_state_time =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us;
     return 0;
+
+out:
+    device_state_save_finish(jobs, nr_jobs);
+    return ret;
 }
 
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
@@ -1525,9 +2228,14 @@ void qemu_savevm_state_pending(QEMUFile *f, uint64_t threshold_size,
                 continue;
             }
         }
+        uint64_t pre = 0, compat = 0, post = 0;
+
         se->ops->save_live_pending(f, se->opaque, threshold_size,
-                                   res_precopy_only, res_compatible,
-                                   res_postcopy_only);
+                                   &pre, &compat, &post);
+        se->pending = pre + compat + post;
+        *res_precopy_only += pre;
+        *res_compatible += compat;
+        *res_postcopy_only += post;
     }
 }
 
@@ -1545,6 +2253,10 @@ void qemu_savevm_state_cleanup(void)
         if (se->ops && se->ops->save_cleanup) {
             se->ops->save_cleanup(se->opaque);
         }
+        if (se->early_state) {
+            g_byte_array_unref(se->early_state);
+            se->early_state = NULL;
+        }
     }
 }
 
@@ -1566,6 +2278,7 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
 
     migrate_init(ms);
     memset(&ram_counters, 0, sizeof(ram_counters));
+    memset(&ram_atomic_counters, 0, sizeof(ram_atomic_counters));
     ms->to_dst_file = f;
 
     qemu_mutex_unlock_iothread();
@@ -1668,6 +2381,49 @@ static SaveStateEntry *find_se(const char *idstr, uint32_t instance_id)
     return NULL;
 }
 
+/*
+ * Find the id of the live section registered with @opaque, for the
+ * device state that its handlers send outside of the stream.
+ *
+ * Returns 0 for success or -1 if there is no such section
+ */
+int qemu_savevm_section_id(void *opaque, const char **idstr,
+                           uint32_t *instance_id)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->ops && se->opaque == opaque) {
+            *idstr = se->idstr;
+            *instance_id = se->instance_id;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Pass a buffer of device state received on a multifd channel to the
+ * section it belongs to.  Called from the multifd receive threads.
+ *
+ * Returns 0 for success or -1 for error
+ */
+int qemu_loadvm_load_state_buffer(const char *idstr, uint32_t instance_id,
+                                  uint32_t idx, uint8_t *data, size_t len,
+                                  Error **errp)
+{
+    SaveStateEntry *se = find_se(idstr, instance_id);
+
+    trace_qemu_loadvm_load_state_buffer(idstr, instance_id, idx, len);
+    if (!se || !se->ops || !se->ops->load_state_buffer) {
+        error_setg(errp, "Device state for unknown section %s instance %u",
+                   idstr, instance_id);
+        g_free(data);
+        return -1;
+    }
+    return se->ops->load_state_buffer(se->opaque, idx, data, len, errp);
+}
+
 enum LoadVMExitCodes {
     /* Allow a command to quit all layers of nested loadvm loops */
     LOADVM_QUIT     =  1,
@@ -1761,20 +2517,61 @@ static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
     return 0;
 }
 
-/* After postcopy we will be told to throw some pages away since they're
- * dirty and will have to be demand fetched.  Must happen before CPU is
- * started.
- * There can be 0..many of these messages, each encoding multiple pages.
+/* Discard the range waiting to be merged with the next one, if any */
+static int loadvm_postcopy_ram_discard_flush(MigrationIncomingState *mis)
+{
+    int ret = 0;
+
+    if (mis->postcopy_discard_ramid) {
+        ret = ram_discard_range(mis->postcopy_discard_ramid,
+                                mis->postcopy_discard_start,
+                                mis->postcopy_discard_length);
+        g_free(mis->postcopy_discard_ramid);
+        mis->postcopy_discard_ramid = NULL;
+    }
+    return ret;
+}
+
+/*
+ * With postcopy-discard-bitmap, a range that follows the previous one in
+ * the same RAMBlock is merged with it, so that a page range split over
+ * several messages is discarded at once.
  */
-static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
-                                              uint16_t len)
+static int loadvm_postcopy_ram_discard_range(MigrationIncomingState *mis,
+                                             const char *ramid,
+                                             uint64_t start, uint64_t length)
+{
+    int ret;
+
+    if (!migrate_postcopy_discard_bitmap()) {
+        return ram_discard_range(ramid, start, length);
+    }
+
+    if (mis->postcopy_discard_ramid &&
+        !strcmp(mis->postcopy_discard_ramid, ramid) &&
+        mis->postcopy_discard_start + mis->postcopy_discard_length == start) {
+        mis->postcopy_discard_length += length;
+        return 0;
+    }
+
+    ret = loadvm_postcopy_ram_discard_flush(mis);
+    mis->postcopy_discard_ramid = g_strdup(ramid);
+    mis->postcopy_discard_start = start;
+    mis->postcopy_discard_length = length;
+    return ret;
+}
+
+/*
+ * Check the state and read the header of a discard command: the
+ * version, and the RAM ID string (length byte, name, 0 term).  Returns
+ * with @len reduced to the payload that follows.
+ */
+static int loadvm_postcopy_ram_discard_header(MigrationIncomingState *mis,
+                                              char *ramid, uint16_t *len)
 {
     int tmp;
-    char ramid[256];
     PostcopyState ps = postcopy_state_get();
 
-    trace_loadvm_postcopy_ram_handle_discard();
-
     switch (ps) {
     case POSTCOPY_INCOMING_ADVISE:
         /* 1st discard */
@@ -1793,15 +2590,6 @@ static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
                      ps);
         return -1;
     }
-    /* We're expecting a
-     *    Version (0)
-     *    a RAM ID string (length byte, name, 0 term)
-     *    then at least 1 16 byte chunk
-    */
-    if (len < (1 + 1 + 1 + 1 + 2 * 8)) {
-        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
-        return -1;
-    }
 
     tmp = qemu_get_byte(mis->from_src_file);
     if (tmp != postcopy_ram_discard_version) {
@@ -1819,7 +2607,35 @@ static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
         return -1;
     }
 
-    len -= 3 + strlen(ramid);
+    *len -= 3 + strlen(ramid);
+    return 0;
+}
+
+/* After postcopy we will be told to throw some pages away since they're
+ * dirty and will have to be demand fetched.  Must happen before CPU is
+ * started.
+ * There can be 0..many of these messages, each encoding multiple pages.
+ */
+static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
+                                              uint16_t len)
+{
+    char ramid[256];
+
+    trace_loadvm_postcopy_ram_handle_discard();
+
+    /* We're expecting a
+     *    Version (0)
+     *    a RAM ID string (length byte, name, 0 term)
+     *    then at least 1 16 byte chunk
+    */
+    if (len < (1 + 1 + 1 + 1 + 2 * 8)) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+
+    if (loadvm_postcopy_ram_discard_header(mis, ramid, &len)) {
+        return -1;
+    }
     if (len % 16) {
         error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
         return -1;
@@ -1831,7 +2647,8 @@ static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
         block_length = qemu_get_be64(mis->from_src_file);
 
         len -= 16;
-        int ret = ram_discard_range(ramid, start_addr, block_length);
+        int ret = loadvm_postcopy_ram_discard_range(mis, ramid, start_addr,
+                                                    block_length);
         if (ret) {
             return ret;
         }
@@ -1841,6 +2658,63 @@ static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
     return 0;
 }
 
+/*
+ * Same as CMD_POSTCOPY_RAM_DISCARD, with a start (be64) and a bitmap of
+ * the pages that follow it instead of the list of chunks.
+ */
+static int loadvm_postcopy_ram_handle_discard_bitmap(
+    MigrationIncomingState *mis, uint16_t len)
+{
+    size_t tp_size = qemu_target_page_size();
+    unsigned long *le_bitmap, *bitmap, nbits, first, last = 0;
+    char ramid[256];
+    uint64_t start;
+    int ret = 0;
+
+    trace_loadvm_postcopy_ram_handle_discard();
+
+    if (len < (1 + 1 + 1 + 1 + 8 + 1)) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD_BITMAP invalid length (%d)",
+                     len);
+        return -1;
+    }
+
+    if (loadvm_postcopy_ram_discard_header(mis, ramid, &len)) {
+        return -1;
+    }
+    if (len < 8 + 1) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD_BITMAP invalid length (%d)",
+                     len);
+        return -1;
+    }
+    trace_loadvm_postcopy_ram_handle_discard_header(ramid, len);
+
+    start = qemu_get_be64(mis->from_src_file);
+    len -= 8;
+    nbits = len * 8;
+    /* Little endian longs are the bytes in order */
+    le_bitmap = bitmap_new(nbits + BITS_PER_LONG);
+    bitmap = bitmap_new(nbits);
+    qemu_get_buffer(mis->from_src_file, (uint8_t *)le_bitmap, len);
+    bitmap_from_le(bitmap, le_bitmap, nbits);
+
+    while ((first = find_next_bit(bitmap, nbits, last)) < nbits) {
+        last = find_next_zero_bit(bitmap, nbits, first + 1);
+        ret = loadvm_postcopy_ram_discard_range(mis, ramid,
+                                                start + first * tp_size,
+                                                (last - first) * tp_size);
+        if (ret) {
+            break;
+        }
+    }
+
+    g_free(bitmap);
+    g_free(le_bitmap);
+    trace_loadvm_postcopy_ram_handle_discard_end();
+
+    return ret;
+}
+
 /*
  * Triggered by a postcopy_listen command; this thread takes over reading
  * the input stream, leaving the main thread free to carry on loading the rest
@@ -1920,6 +2794,11 @@ static void *postcopy_ram_listen_thread(void *opaque)
         exit(EXIT_FAILURE);
     }
 
+    /* The RAM is no longer registered with userfaultfd */
+    qemu_mutex_lock_iothread();
+    ram_collapse_start();
+    qemu_mutex_unlock_iothread();
+
     migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_ACTIVE,
                                    MIGRATION_STATUS_COMPLETED);
     /*
@@ -1959,6 +2838,8 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
         if (migrate_postcopy_ram()) {
             postcopy_ram_prepare_discard(mis);
         }
+    } else if (loadvm_postcopy_ram_discard_flush(mis)) {
+        return -1;
     }
 
     /*
@@ -1971,6 +2852,8 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
             postcopy_ram_incoming_cleanup(mis);
             return -1;
         }
+        /* The preempt and multifd channels can place pages from now on */
+        qemu_event_set(&mis->postcopy_listen_event);
     }
 
     if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_LISTEN, &local_err)) {
@@ -2074,7 +2957,7 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_queue_rp_req_pages(mis, rb, rb_offset);
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -2092,6 +2975,9 @@ static void migrate_send_rp_req_pages_pending(MigrationIncomingState *mis)
     WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
         g_tree_foreach(mis->page_requested, postcopy_sync_page_req, mis);
     }
+    if (migrate_flush_rp_req_pages(mis)) {
+        error_report("%s: send rp message failed", __func__);
+    }
 }
 
 static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
@@ -2107,6 +2993,8 @@ static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
      * the source should have it reset already.
      */
     mis->last_rb = NULL;
+    /* The requests the fault thread didn't send are in page_requested */
+    mis->rp_req_batch.len = 0;
 
     /*
      * This means source VM is ready to resume the postcopy migration.
@@ -2328,6 +3216,9 @@ static int loadvm_process_command(QEMUFile *f)
     case MIG_CMD_RECV_BITMAP:
         return loadvm_handle_recv_bitmap(mis, len);
 
+    case MIG_CMD_POSTCOPY_RAM_DISCARD_BITMAP:
+        return loadvm_postcopy_ram_handle_discard_bitmap(mis, len);
+
     case MIG_CMD_ENABLE_COLO:
         return loadvm_process_enable_colo(mis);
     }
@@ -2551,6 +3442,7 @@ void qemu_loadvm_state_cleanup(void)
     SaveStateEntry *se;
 
     trace_loadvm_state_cleanup();
+    device_state_pool_stop();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (se->ops && se->ops->load_cleanup) {
             se->ops->load_cleanup(se->opaque);
@@ -2598,6 +3490,44 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
     return true;
 }
 
+static int qemu_loadvm_section_buffered(QEMUFile *f,
+                                        MigrationIncomingState *mis)
+{
+    uint32_t length = qemu_get_be32(f);
+    DeviceStateJob local_job = { 0 }, *job;
+    QIOChannelBuffer *bioc;
+    int ret;
+
+    trace_qemu_loadvm_section_buffered(length);
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large buffered section: 0x%x", length);
+        return -EINVAL;
+    }
+
+    bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-loadvm-buffer");
+    ret = qemu_get_buffer(f, bioc->data, length);
+    if (ret != length) {
+        object_unref(OBJECT(bioc));
+        error_report("Buffered section: read %d/%u", ret, length);
+        return ret < 0 ? ret : -EAGAIN;
+    }
+    bioc->usage += length;
+
+    job = migrate_device_state_threads() ? g_new0(DeviceStateJob, 1)
+                                         : &local_job;
+    job->fb = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    if (job == &local_job) {
+        ret = device_state_job_run(job);
+        qemu_fclose(job->fb);
+        return ret;
+    }
+    device_state_pool_start();
+    device_state_pool_queue(job);
+    return 0;
+}
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
     uint8_t section_type;
@@ -2613,6 +3543,12 @@ retry:
         }
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_BUFFERED) {
+            ret = device_state_pool_wait();
+            if (ret < 0) {
+                goto out;
+            }
+        }
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
@@ -2628,6 +3564,12 @@ retry:
                 goto out;
             }
             break;
+        case QEMU_VM_SECTION_BUFFERED:
+            ret = qemu_loadvm_section_buffered(f, mis);
+            if (ret < 0) {
+                goto out;
+            }
+            break;
         case QEMU_VM_COMMAND:
             ret = loadvm_process_command(f);
             trace_qemu_loadvm_state_section_command(ret);
@@ -2647,6 +3589,8 @@ retry:
 
 out:
     if (ret < 0) {
+        /* Nothing can be left running on the devices */
+        device_state_pool_wait();
         qemu_file_set_error(f, ret);
 
         /* Cancel bitmaps incoming regardless of recovery */
@@ -32,13 +32,41 @@ struct SocketOutgoingArgs {
     SocketAddress *saddr;
 } outgoing_args;
 
-void socket_send_channel_create(QIOTaskFunc f, void *data)
+void socket_send_channel_create(QIOTaskFunc f, void *data, int id)
 {
     QIOChannelSocket *sioc = qio_channel_socket_new();
+    MultiFDAddress *addr = migrate_multifd_address(id);
+
+    if (addr) {
+        trace_migration_socket_channel_address(id, addr->has_source ?
+                                               addr->source : "");
+        qio_channel_socket_connect_from_async(sioc, addr->addr,
+                                              addr->source, f, data,
+                                              NULL, NULL);
+        return;
+    }
     qio_channel_socket_connect_async(sioc, outgoing_args.saddr,
                                      f, data, NULL, NULL);
 }
 
+QIOChannel *socket_send_channel_create_sync(Error **errp)
+{
+    QIOChannelSocket *sioc = qio_channel_socket_new();
+
+    if (!outgoing_args.saddr) {
+        object_unref(OBJECT(sioc));
+        error_setg(errp, "Initial sock address not set!");
+        return NULL;
+    }
+
+    if (qio_channel_socket_connect_sync(sioc, outgoing_args.saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+
+    return QIO_CHANNEL(sioc);
+}
+
 int socket_send_channel_destroy(QIOChannel *send)
 {
     /* Remove channel */
@@ -159,6 +187,9 @@ socket_start_incoming_migration_internal(SocketAddress *saddr,
     if (migrate_use_multifd()) {
         num = migrate_multifd_channels();
     }
+    if (migrate_postcopy_preempt()) {
+        num++;
+    }
 
     if (qio_net_listener_open_sync(listener, saddr, num, errp) < 0) {
         object_unref(OBJECT(listener));
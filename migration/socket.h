@@ -20,7 +20,12 @@
 #include "io/channel.h"
 #include "io/task.h"
 
-void socket_send_channel_create(QIOTaskFunc f, void *data);
+/*
+ * Connect multifd channel @id, to its multifd-addresses entry if there
+ * are some, or else to the address of the migration
+ */
+void socket_send_channel_create(QIOTaskFunc f, void *data, int id);
+QIOChannel *socket_send_channel_create_sync(Error **errp);
 int socket_send_channel_destroy(QIOChannel *send);
 
 void socket_start_incoming_migration(const char *str, Error **errp);
@@ -93,6 +93,7 @@ void migration_tls_channel_process_incoming(MigrationState *s,
     if (!tioc) {
         return;
     }
+    qio_channel_tls_enable_ktls(tioc);
 
     trace_migration_tls_incoming_handshake_start();
     qio_channel_set_name(QIO_CHANNEL(tioc), "migration-tls-incoming");
@@ -144,6 +145,9 @@ QIOChannelTLS *migration_tls_client_create(MigrationState *s,
 
     tioc = qio_channel_tls_new_client(
         ioc, creds, hostname, errp);
+    if (tioc) {
+        qio_channel_tls_enable_ktls(tioc);
+    }
 
     return tioc;
 }
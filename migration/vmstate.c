@@ -17,7 +17,9 @@
 #include "qapi/qmp/json-writer.h"
 #include "qemu-file.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "trace.h"
 
 static int vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
@@ -75,11 +77,184 @@ static void vmstate_handle_alloc(void *ptr, const VMStateField *field,
     }
 }
 
+/*
+ * The plan of a VMStateDescription lists its runs of integer fields
+ * that are always sent at the current version, of the same size and
+ * back to back in the device state.  A run is saved and loaded with a
+ * single copy and a byteswap pass, instead of one VMStateInfo call per
+ * element.  Plans are built the first time a description is used.
+ */
+typedef struct VMStateRun {
+    const VMStateField *first;
+    /* One past the last field of the run */
+    const VMStateField *end;
+    size_t elem_size;
+    size_t len;
+} VMStateRun;
+
+typedef struct VMStatePlan {
+    int nr_runs;
+    VMStateRun runs[];
+} VMStatePlan;
+
+static GHashTable *vmstate_plans;
+static QemuMutex vmstate_plans_lock;
+
+static void __attribute__((__constructor__)) vmstate_plans_init(void)
+{
+    qemu_mutex_init(&vmstate_plans_lock);
+    vmstate_plans = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+}
+
+/* Size of the elements of @field if it can be part of a run, or 0 */
+static size_t vmstate_run_elem_size(const VMStateDescription *vmsd,
+                                    const VMStateField *field)
+{
+    size_t size;
+
+    if (field->field_exists || field->version_id > vmsd->version_id ||
+        (field->flags != VMS_SINGLE && field->flags != VMS_ARRAY)) {
+        return 0;
+    }
+    if (field->info == &vmstate_info_uint8 ||
+        field->info == &vmstate_info_int8) {
+        size = 1;
+    } else if (field->info == &vmstate_info_uint16 ||
+               field->info == &vmstate_info_int16) {
+        size = 2;
+    } else if (field->info == &vmstate_info_uint32 ||
+               field->info == &vmstate_info_int32) {
+        size = 4;
+    } else if (field->info == &vmstate_info_uint64 ||
+               field->info == &vmstate_info_int64) {
+        size = 8;
+    } else {
+        return 0;
+    }
+    return field->size == size ? size : 0;
+}
+
+static VMStatePlan *vmstate_plan_build(const VMStateDescription *vmsd)
+{
+    const VMStateField *field, *end;
+    VMStatePlan *plan;
+    size_t elem_size, len;
+    int nr_fields = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        nr_fields++;
+    }
+    plan = g_malloc0(sizeof(*plan) + nr_fields * sizeof(VMStateRun));
+
+    field = vmsd->fields;
+    while (field->name) {
+        elem_size = vmstate_run_elem_size(vmsd, field);
+        if (!elem_size) {
+            field++;
+            continue;
+        }
+        len = 0;
+        end = field;
+        do {
+            len += elem_size * (end->flags & VMS_ARRAY ? end->num : 1);
+            end++;
+        } while (end->name && vmstate_run_elem_size(vmsd, end) == elem_size &&
+                 end->offset == field->offset + len);
+
+        /* A single element is as fast through its VMStateInfo */
+        if (len > elem_size) {
+            plan->runs[plan->nr_runs++] = (VMStateRun) {
+                .first = field,
+                .end = end,
+                .elem_size = elem_size,
+                .len = len,
+            };
+        }
+        field = end;
+    }
+    trace_vmstate_plan_build(vmsd->name, plan->nr_runs);
+    return plan;
+}
+
+static const VMStatePlan *vmstate_get_plan(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+
+    QEMU_LOCK_GUARD(&vmstate_plans_lock);
+    plan = g_hash_table_lookup(vmstate_plans, vmsd);
+    if (!plan) {
+        plan = vmstate_plan_build(vmsd);
+        g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+    }
+    return plan;
+}
+
+static void vmstate_save_run(QEMUFile *f, const VMStateRun *run,
+                             void *opaque)
+{
+    uint8_t *src = opaque + run->first->offset;
+
+#ifndef HOST_WORDS_BIGENDIAN
+    if (run->elem_size > 1) {
+        uint8_t buf[4096];
+        size_t done, i, n;
+
+        for (done = 0; done < run->len; done += n) {
+            n = MIN(run->len - done, sizeof(buf));
+            for (i = 0; i < n; i += run->elem_size) {
+                switch (run->elem_size) {
+                case 2:
+                    stw_be_p(buf + i, lduw_he_p(src + done + i));
+                    break;
+                case 4:
+                    stl_be_p(buf + i, ldl_he_p(src + done + i));
+                    break;
+                default:
+                    stq_be_p(buf + i, ldq_he_p(src + done + i));
+                    break;
+                }
+            }
+            qemu_put_buffer(f, buf, n);
+        }
+        return;
+    }
+#endif
+    qemu_put_buffer(f, src, run->len);
+}
+
+static void vmstate_load_run(QEMUFile *f, const VMStateRun *run,
+                             void *opaque)
+{
+    uint8_t *dst = opaque + run->first->offset;
+
+    qemu_get_buffer(f, dst, run->len);
+#ifndef HOST_WORDS_BIGENDIAN
+    if (run->elem_size > 1) {
+        size_t i;
+
+        for (i = 0; i < run->len; i += run->elem_size) {
+            switch (run->elem_size) {
+            case 2:
+                stw_he_p(dst + i, lduw_be_p(dst + i));
+                break;
+            case 4:
+                stl_he_p(dst + i, ldl_be_p(dst + i));
+                break;
+            default:
+                stq_he_p(dst + i, ldq_be_p(dst + i));
+                break;
+            }
+        }
+    }
+#endif
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
     const VMStateField *field = vmsd->fields;
-    int ret = 0;
+    const VMStatePlan *plan = NULL;
+    int ret = 0, run = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
     if (version_id > vmsd->version_id) {
@@ -108,7 +283,24 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
+    if (version_id == vmsd->version_id) {
+        plan = vmstate_get_plan(vmsd);
+    }
     while (field->name) {
+        if (plan && run < plan->nr_runs && field == plan->runs[run].first) {
+            trace_vmstate_load_state_run(vmsd->name, field->name,
+                                         plan->runs[run].len);
+            vmstate_load_run(f, &plan->runs[run], opaque);
+            ret = qemu_file_get_error(f);
+            if (ret < 0) {
+                error_report("Failed to load %s:%s", vmsd->name,
+                             field->name);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+            field = plan->runs[run++].end;
+            continue;
+        }
         trace_vmstate_load_state_field(vmsd->name, field->name);
         if ((field->field_exists &&
              field->field_exists(opaque, version_id)) ||
@@ -326,8 +518,9 @@ int vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
 int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
                          void *opaque, JSONWriter *vmdesc, int version_id)
 {
-    int ret = 0;
+    int ret = 0, run = 0;
     const VMStateField *field = vmsd->fields;
+    const VMStatePlan *plan = NULL;
 
     trace_vmstate_save_state_top(vmsd->name);
 
@@ -346,7 +539,24 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
         json_writer_start_array(vmdesc, "fields");
     }
 
+    if (version_id == vmsd->version_id) {
+        plan = vmstate_get_plan(vmsd);
+    }
     while (field->name) {
+        if (plan && run < plan->nr_runs && field == plan->runs[run].first) {
+            const VMStateRun *r = &plan->runs[run++];
+
+            trace_vmstate_save_state_run(vmsd->name, field->name, r->len);
+            /* Like the compressed arrays of the loop below */
+            for (; field < r->end; field++) {
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0,
+                                      field->flags & VMS_ARRAY ?
+                                      field->num : 1);
+                vmsd_desc_field_end(vmsd, vmdesc, field, r->elem_size, 0);
+            }
+            vmstate_save_run(f, r, opaque);
+            continue;
+        }
         if ((field->field_exists &&
              field->field_exists(opaque, version_id)) ||
             (!field->field_exists &&
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,285 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+/*
+ * The vectorized encoders compare a whole vector at a time and get
+ * back a mask with one bit per byte, set where old and new are equal.
+ * The runs are then found with ctz on that mask, so the masks are fed
+ * to a small state machine that emits exactly the same stream as
+ * xbzrle_encode_buffer_int(), including where it gives up with -1.
+ */
+typedef struct {
+    uint8_t *dst;
+    int dlen;
+    int d;
+    /* are we in the middle of an nzrun? */
+    bool in_nzrun;
+    uint32_t zrun_len;
+    uint32_t nzrun_len;
+    uint8_t *nzrun_start;
+} XBZRLEEncodeState;
+
+static inline int xbzrle_emit_nzrun(XBZRLEEncodeState *s)
+{
+    s->d += uleb128_encode_small(s->dst + s->d, s->nzrun_len);
+    /* overflow */
+    if (s->d + s->nzrun_len > s->dlen) {
+        return -1;
+    }
+    memcpy(s->dst + s->d, s->nzrun_start, s->nzrun_len);
+    s->d += s->nzrun_len;
+    s->nzrun_len = 0;
+    s->in_nzrun = false;
+    return 0;
+}
+
+/*
+ * Account for @n bytes starting at @new_buf, where bit i of @eq is set
+ * if byte i is unchanged.  Returns -1 on overflow, 0 otherwise.
+ */
+static inline int xbzrle_encode_mask(XBZRLEEncodeState *s, uint8_t *new_buf,
+                                     uint64_t eq, int n)
+{
+    int pos = 0;
+
+    while (pos < n) {
+        uint64_t limit = n - pos == 64 ? -1ULL : (1ULL << (n - pos)) - 1;
+        uint64_t m;
+        int run;
+
+        if (!s->in_nzrun) {
+            m = ~(eq >> pos) & limit;
+            if (!m) {
+                s->zrun_len += n - pos;
+                return 0;
+            }
+            run = ctz64(m);
+            s->zrun_len += run;
+            pos += run;
+
+            s->d += uleb128_encode_small(s->dst + s->d, s->zrun_len);
+            s->zrun_len = 0;
+            s->nzrun_start = new_buf + pos;
+            s->in_nzrun = true;
+            /* overflow */
+            if (s->d + 2 > s->dlen) {
+                return -1;
+            }
+        } else {
+            m = (eq >> pos) & limit;
+            if (!m) {
+                s->nzrun_len += n - pos;
+                return 0;
+            }
+            run = ctz64(m);
+            s->nzrun_len += run;
+            pos += run;
+
+            if (xbzrle_emit_nzrun(s) < 0) {
+                return -1;
+            }
+            /* overflow, checked before every zrun */
+            if (s->d + 2 > s->dlen) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Encode the bytes that don't fill a whole vector */
+static inline int xbzrle_encode_tail(XBZRLEEncodeState *s, uint8_t *old_buf,
+                                     uint8_t *new_buf, int n)
+{
+    uint64_t eq = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        eq |= (uint64_t)(old_buf[i] == new_buf[i]) << i;
+    }
+    return xbzrle_encode_mask(s, new_buf, eq, n);
+}
+
+static inline int xbzrle_encode_finish(XBZRLEEncodeState *s, int slen)
+{
+    if (s->in_nzrun) {
+        if (xbzrle_emit_nzrun(s) < 0) {
+            return -1;
+        }
+        return s->d;
+    }
+    /* buffer unchanged */
+    if (s->zrun_len == slen) {
+        return 0;
+    }
+    /* skip last zero run */
+    return s->d;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    XBZRLEEncodeState s = { .dst = dst, .dlen = dlen };
+    int i = 0;
+
+    if (slen && dlen < 2) {
+        return -1;
+    }
+
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        /* fast path: keep going in the current run */
+        if (eq == UINT32_MAX && !s.in_nzrun) {
+            s.zrun_len += 32;
+        } else if (eq == 0 && s.in_nzrun) {
+            s.nzrun_len += 32;
+        } else if (xbzrle_encode_mask(&s, new_buf + i, eq, 32) < 0) {
+            return -1;
+        }
+    }
+    if (i < slen &&
+        xbzrle_encode_tail(&s, old_buf + i, new_buf + i, slen - i) < 0) {
+        return -1;
+    }
+    return xbzrle_encode_finish(&s, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512F_OPT
+/*
+ * Byte compares need AVX512BW, which every compiler that can build
+ * the AVX512F code also knows about.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    XBZRLEEncodeState s = { .dst = dst, .dlen = dlen };
+    int i = 0;
+
+    if (slen && dlen < 2) {
+        return -1;
+    }
+
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+
+        /* fast path: keep going in the current run */
+        if (eq == UINT64_MAX && !s.in_nzrun) {
+            s.zrun_len += 64;
+        } else if (eq == 0 && s.in_nzrun) {
+            s.nzrun_len += 64;
+        } else if (xbzrle_encode_mask(&s, new_buf + i, eq, 64) < 0) {
+            return -1;
+        }
+    }
+    if (i < slen &&
+        xbzrle_encode_tail(&s, old_buf + i, new_buf + i, slen - i) < 0) {
+        return -1;
+    }
+    return xbzrle_encode_finish(&s, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
+
+/*
+ * Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+typedef int (*xbzrle_encode_fn)(uint8_t *, uint8_t *, int, uint8_t *, int);
+
+static unsigned cpuid_cache;
+static xbzrle_encode_fn encode_accel = xbzrle_encode_buffer_int;
+
+static void init_accel(unsigned cache)
+{
+    xbzrle_encode_fn fn = xbzrle_encode_buffer_int;
+
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512F_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    encode_accel = fn;
+}
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* XCR0[7:5] and XCR0[2:1] enabled by the OS, see bufferiszero.c */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested xbzrle_encode_buffer_int, and
+     * there are no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -216,6 +216,29 @@ static char *SocketAddress_to_str(SocketAddress *addr)
     }
 }
 
+static void hmp_info_migrate_latency(Monitor *mon, const char *name,
+                                     MigrationLatencyHistogram *hist)
+{
+    uint64List *bucket;
+    int i = 0;
+
+    monitor_printf(mon, "%s: %" PRIu64 " samples, max %" PRIu64 " us\n",
+                   name, hist->count, hist->max);
+    for (bucket = hist->buckets; bucket; bucket = bucket->next, i++) {
+        if (!bucket->value) {
+            continue;
+        }
+        /* The last bucket counts everything from 2^31 us */
+        if (i == 31) {
+            monitor_printf(mon, "  %" PRIu64 "- us: %" PRIu64 "\n",
+                           1ULL << i, bucket->value);
+        } else {
+            monitor_printf(mon, "  %" PRIu64 "-%" PRIu64 " us: %" PRIu64 "\n",
+                           i ? 1ULL << i : 0, (2ULL << i) - 1, bucket->value);
+        }
+    }
+}
+
 void hmp_info_migrate(Monitor *mon, const QDict *qdict)
 {
     MigrationInfo *info;
@@ -249,6 +272,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "expected downtime: %" PRIu64 " ms\n",
                            info->expected_downtime);
         }
+        if (info->has_predicted_downtime) {
+            monitor_printf(mon, "predicted downtime: %" PRIu64 " ms\n",
+                           info->predicted_downtime);
+        }
+        if (info->has_rate_limit) {
+            monitor_printf(mon, "rate limit waits: %" PRIu64 "\n",
+                           info->rate_limit->waits);
+            monitor_printf(mon, "rate limit wait time: %" PRIu64 " us\n",
+                           info->rate_limit->wait_time);
+        }
         if (info->has_downtime) {
             monitor_printf(mon, "downtime: %" PRIu64 " ms\n",
                            info->downtime);
@@ -278,6 +311,18 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_time);
+        if (info->ram->free_page_hint_bytes) {
+            monitor_printf(mon, "free page hint: %" PRIu64 " kbytes\n",
+                           info->ram->free_page_hint_bytes >> 10);
+        }
+        if (info->ram->dedup_pages) {
+            monitor_printf(mon, "dedup pages: %" PRIu64 " pages\n",
+                           info->ram->dedup_pages);
+            monitor_printf(mon, "dedup misses: %" PRIu64 " pages\n",
+                           info->ram->dedup_misses);
+        }
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
@@ -293,6 +338,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->dirty_sync_missed_zero_copy) {
+            monitor_printf(mon,
+                           "Zero-copy-send fallbacks happened: %" PRIu64
+                           " times\n",
+                           info->ram->dirty_sync_missed_zero_copy);
+        }
     }
 
     if (info->has_disk) {
@@ -355,6 +406,53 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_postcopy_fault_latency) {
+        hmp_info_migrate_latency(mon, "postcopy fault latency",
+                                 info->postcopy_fault_latency);
+    }
+
+    if (info->has_postcopy_queue_latency) {
+        hmp_info_migrate_latency(mon, "postcopy queue latency",
+                                 info->postcopy_queue_latency);
+    }
+
+    if (info->has_timings) {
+        MigrationTimings *t = info->timings;
+
+        if (t->has_bitmap_sync) {
+            monitor_printf(mon, "bitmap sync time: %" PRIu64 " us\n",
+                           t->bitmap_sync);
+        }
+        if (t->has_multifd_send_wait) {
+            monitor_printf(mon, "multifd send wait time: %" PRIu64 " us\n",
+                           t->multifd_send_wait);
+        }
+        if (t->has_flush) {
+            monitor_printf(mon, "flush time: %" PRIu64 " us\n", t->flush);
+        }
+        if (t->has_compress) {
+            Visitor *v;
+            char *str;
+            v = string_output_visitor_new(false, &str);
+            visit_type_uint64List(v, NULL, &t->compress, &error_abort);
+            visit_complete(v, &str);
+            monitor_printf(mon, "compress time: %s us\n", str);
+            g_free(str);
+            visit_free(v);
+        }
+        if (t->has_device_state) {
+            monitor_printf(mon, "device state time: %" PRIu64 " us\n",
+                           t->device_state);
+        }
+        if (t->has_return_path_latency) {
+            monitor_printf(mon, "return path latency: %" PRIu64 " us\n",
+                           t->return_path_latency);
+        }
+        if (t->has_load) {
+            monitor_printf(mon, "load time: %" PRIu64 " us\n", t->load);
+        }
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -373,6 +471,43 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->vfio->transferred >> 10);
     }
 
+    if (info->has_multifd_recv_channels) {
+        MultiFDRecvChannelStatsList *chan;
+
+        monitor_printf(mon, "multifd receive channels:\n");
+        for (chan = info->multifd_recv_channels; chan; chan = chan->next) {
+            MultiFDRecvChannelStats *stats = chan->value;
+
+            monitor_printf(mon, "\t%u: packets %" PRIu64 " pages %" PRIu64
+                           " zero pages %" PRIu64 " %" PRIu64 " kbytes"
+                           " %0.2f mbps decompress time %" PRIu64 " us"
+                           " queued %" PRIu64 " kbytes rate %" PRIu64
+                           " kbytes/s busy %u%%\n",
+                           stats->id, stats->packets, stats->pages,
+                           stats->zero_pages, stats->bytes >> 10,
+                           stats->mbps, stats->decompress_time,
+                           stats->queued >> 10, stats->rate >> 10,
+                           stats->busy);
+        }
+    }
+
+    if (info->has_destination_load) {
+        MultiFDRecvChannelLoadList *chan;
+
+        monitor_printf(mon, "destination load: %" PRId64 " ms ago%s\n",
+                       info->destination_load->age,
+                       info->destination_load->backpressure ?
+                       ", limiting the bandwidth" : "");
+        for (chan = info->destination_load->channels; chan;
+             chan = chan->next) {
+            MultiFDRecvChannelLoad *load = chan->value;
+
+            monitor_printf(mon, "\t%u: queued %" PRIu64 " kbytes rate %"
+                           PRIu64 " kbytes/s busy %u%%\n", load->id,
+                           load->queued >> 10, load->rate >> 10, load->busy);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
 }
 
@@ -487,6 +622,80 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_PACKET_SIZE),
+            params->multifd_packet_size);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZSTD_DICT_PAGES),
+            params->multifd_zstd_dict_pages);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_QATZIP_LEVEL),
+            params->multifd_qatzip_level);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_HUGETLB),
+            params->xbzrle_cache_hugetlb ? "on" : "off");
+        monitor_printf(mon, "%s: %" PRIi64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_NUMA_NODE),
+            params->xbzrle_cache_numa_node);
+        monitor_printf(mon, "%s: %" PRIu64 " MB/s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT),
+            params->vcpu_dirty_limit);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRTY_SYNC_THREADS),
+            params->dirty_sync_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW),
+            params->postcopy_prefetch_window);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PLACE_BATCH),
+            params->postcopy_place_batch);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_LOAD_THREADS),
+            params->load_threads);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_METHOD),
+            CompressMethod_str(params->compress_method));
+        monitor_printf(mon, "%s: %" PRIu64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_STREAM_BUFFER_SIZE),
+            params->stream_buffer_size);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_STREAM_IOV_MAX),
+            params->stream_iov_max);
+        monitor_printf(mon, "%s: %" PRIu64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MAX_BANDWIDTH_BURST),
+            params->max_bandwidth_burst);
+        monitor_printf(mon, "%s: '%s'\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_PAGE_DEDUP_STORE),
+            params->page_dedup_store);
+        monitor_printf(mon, "%s: %" PRIu64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_RDMA_REG_CACHE_SIZE),
+            params->rdma_reg_cache_size);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_COLO_FLUSH_THREADS),
+            params->colo_flush_threads);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_CHECKPOINT_BUDGET),
+            params->x_checkpoint_budget);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_BLOCK_CHUNK_SIZE),
+            params->block_chunk_size);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DEVICE_STATE_THREADS),
+            params->device_state_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_PREPOPULATE_THREADS),
+            params->prepopulate_threads);
+        monitor_printf(mon, "%s: %" PRIu64 "\n",
+            MigrationParameter_str(
+                MIGRATION_PARAMETER_DIRTY_HEATMAP_GRANULARITY),
+            params->dirty_heatmap_granularity);
+        monitor_printf(mon, "%s: %" PRIu64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_AUTO_TIME),
+            params->postcopy_auto_time);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(
+                MIGRATION_PARAMETER_POSTCOPY_AUTO_ITERATIONS),
+            params->postcopy_auto_iterations);
 
         if (params->has_block_bitmap_mapping) {
             const BitmapMigrationNodeAliasList *bmnal;
@@ -513,6 +722,35 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
                 }
             }
         }
+
+        if (params->multifd_addresses) {
+            const MultiFDAddressList *mal;
+
+            monitor_printf(mon, "%s:\n",
+                           MigrationParameter_str(
+                               MIGRATION_PARAMETER_MULTIFD_ADDRESSES));
+
+            for (mal = params->multifd_addresses; mal; mal = mal->next) {
+                const MultiFDAddress *ma = mal->value;
+                g_autofree char *addr = SocketAddress_to_str(ma->addr);
+
+                monitor_printf(mon, "  %s from '%s' weight %u\n", addr,
+                               ma->has_source ? ma->source : "",
+                               ma->has_weight ? ma->weight : 1);
+            }
+        }
+
+        if (params->dsa_accel_path) {
+            const strList *l;
+
+            monitor_printf(mon, "%s:\n",
+                           MigrationParameter_str(
+                               MIGRATION_PARAMETER_DSA_ACCEL_PATH));
+
+            for (l = params->dsa_accel_path; l; l = l->next) {
+                monitor_printf(mon, "  %s\n", l->value);
+            }
+        }
     }
 
     qapi_free_MigrationParameters(params);
@@ -1395,10 +1633,116 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_announce_step = true;
         visit_type_size(v, param, &p->announce_step, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_PACKET_SIZE:
+        p->has_multifd_packet_size = true;
+        visit_type_size(v, param, &p->multifd_packet_size, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZSTD_DICT_PAGES:
+        p->has_multifd_zstd_dict_pages = true;
+        visit_type_uint32(v, param, &p->multifd_zstd_dict_pages, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_QATZIP_LEVEL:
+        p->has_multifd_qatzip_level = true;
+        visit_type_uint8(v, param, &p->multifd_qatzip_level, &err);
+        break;
+    case MIGRATION_PARAMETER_XBZRLE_CACHE_HUGETLB:
+        p->has_xbzrle_cache_hugetlb = true;
+        visit_type_bool(v, param, &p->xbzrle_cache_hugetlb, &err);
+        break;
+    case MIGRATION_PARAMETER_XBZRLE_CACHE_NUMA_NODE:
+        p->has_xbzrle_cache_numa_node = true;
+        visit_type_int(v, param, &p->xbzrle_cache_numa_node, &err);
+        break;
+    case MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT:
+        p->has_vcpu_dirty_limit = true;
+        visit_type_uint64(v, param, &p->vcpu_dirty_limit, &err);
+        break;
+    case MIGRATION_PARAMETER_DIRTY_SYNC_THREADS:
+        p->has_dirty_sync_threads = true;
+        visit_type_uint8(v, param, &p->dirty_sync_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW:
+        p->has_postcopy_prefetch_window = true;
+        visit_type_uint16(v, param, &p->postcopy_prefetch_window, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PLACE_BATCH:
+        p->has_postcopy_place_batch = true;
+        visit_type_uint16(v, param, &p->postcopy_place_batch, &err);
+        break;
+    case MIGRATION_PARAMETER_LOAD_THREADS:
+        p->has_load_threads = true;
+        visit_type_uint8(v, param, &p->load_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_COMPRESS_METHOD:
+        p->has_compress_method = true;
+        visit_type_CompressMethod(v, param, &p->compress_method, &err);
+        break;
+    case MIGRATION_PARAMETER_STREAM_BUFFER_SIZE:
+        p->has_stream_buffer_size = true;
+        visit_type_size(v, param, &p->stream_buffer_size, &err);
+        break;
+    case MIGRATION_PARAMETER_STREAM_IOV_MAX:
+        p->has_stream_iov_max = true;
+        visit_type_uint16(v, param, &p->stream_iov_max, &err);
+        break;
+    case MIGRATION_PARAMETER_MAX_BANDWIDTH_BURST:
+        p->has_max_bandwidth_burst = true;
+        visit_type_size(v, param, &p->max_bandwidth_burst, &err);
+        break;
+    case MIGRATION_PARAMETER_PAGE_DEDUP_STORE:
+        p->has_page_dedup_store = true;
+        p->page_dedup_store = g_new0(StrOrNull, 1);
+        p->page_dedup_store->type = QTYPE_QSTRING;
+        visit_type_str(v, param, &p->page_dedup_store->u.s, &err);
+        break;
+    case MIGRATION_PARAMETER_RDMA_REG_CACHE_SIZE:
+        p->has_rdma_reg_cache_size = true;
+        visit_type_size(v, param, &p->rdma_reg_cache_size, &err);
+        break;
+    case MIGRATION_PARAMETER_COLO_FLUSH_THREADS:
+        p->has_colo_flush_threads = true;
+        visit_type_uint8(v, param, &p->colo_flush_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_X_CHECKPOINT_BUDGET:
+        p->has_x_checkpoint_budget = true;
+        visit_type_size(v, param, &p->x_checkpoint_budget, &err);
+        break;
+    case MIGRATION_PARAMETER_BLOCK_CHUNK_SIZE:
+        p->has_block_chunk_size = true;
+        visit_type_size(v, param, &p->block_chunk_size, &err);
+        break;
+    case MIGRATION_PARAMETER_DEVICE_STATE_THREADS:
+        p->has_device_state_threads = true;
+        visit_type_uint8(v, param, &p->device_state_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_PREPOPULATE_THREADS:
+        p->has_prepopulate_threads = true;
+        visit_type_uint8(v, param, &p->prepopulate_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_DIRTY_HEATMAP_GRANULARITY:
+        p->has_dirty_heatmap_granularity = true;
+        visit_type_size(v, param, &p->dirty_heatmap_granularity, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_AUTO_TIME:
+        p->has_postcopy_auto_time = true;
+        visit_type_uint64(v, param, &p->postcopy_auto_time, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_AUTO_ITERATIONS:
+        p->has_postcopy_auto_iterations = true;
+        visit_type_uint32(v, param, &p->postcopy_auto_iterations, &err);
+        break;
     case MIGRATION_PARAMETER_BLOCK_BITMAP_MAPPING:
         error_setg(&err, "The block-bitmap-mapping parameter can only be set "
                    "through QMP");
         break;
+    case MIGRATION_PARAMETER_MULTIFD_ADDRESSES:
+        error_setg(&err, "The multifd-addresses parameter can only be set "
+                   "through QMP");
+        break;
+    case MIGRATION_PARAMETER_DSA_ACCEL_PATH:
+        error_setg(&err, "The dsa-accel-path parameter can only be set "
+                   "through QMP");
+        break;
     default:
         assert(0);
     }
@@ -1893,6 +2237,12 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  poll-hits=%" PRId64 "\n", value->poll_hits);
+        monitor_printf(mon, "  poll-misses=%" PRId64 "\n", value->poll_misses);
+        monitor_printf(mon, "  coroutine-pool-hits=%" PRId64 "\n",
+                       value->coroutine_pool_hits);
+        monitor_printf(mon, "  coroutine-pool-misses=%" PRId64 "\n",
+                       value->coroutine_pool_misses);
     }
 
     qapi_free_IOThreadInfoList(info_list);
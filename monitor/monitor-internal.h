@@ -167,6 +167,8 @@ extern int mon_refcount;
 extern HMPCommand hmp_cmds[];
 
 int monitor_puts(Monitor *mon, const char *str);
+int monitor_puts_locked(Monitor *mon, const char *str);
+void monitor_flush_locked(Monitor *mon);
 void monitor_data_init(Monitor *mon, bool is_qmp, bool skip_flush,
                        bool use_io_thread);
 void monitor_data_destroy(Monitor *mon);
@@ -154,8 +154,6 @@ static inline bool monitor_is_hmp_non_interactive(const Monitor *mon)
     return !monitor_uses_readline(container_of(mon, MonitorHMP, common));
 }
 
-static void monitor_flush_locked(Monitor *mon);
-
 static gboolean monitor_unblocked(GIOChannel *chan, GIOCondition cond,
                                   void *opaque)
 {
@@ -169,7 +167,7 @@ static gboolean monitor_unblocked(GIOChannel *chan, GIOCondition cond,
 }
 
 /* Caller must hold mon->mon_lock */
-static void monitor_flush_locked(Monitor *mon)
+void monitor_flush_locked(Monitor *mon)
 {
     int rc;
     size_t len;
@@ -208,13 +206,12 @@ void monitor_flush(Monitor *mon)
     qemu_mutex_unlock(&mon->mon_lock);
 }
 
-/* flush at every end of line */
-int monitor_puts(Monitor *mon, const char *str)
+/* flush at every end of line; caller must hold mon->mon_lock */
+int monitor_puts_locked(Monitor *mon, const char *str)
 {
     int i;
     char c;
 
-    qemu_mutex_lock(&mon->mon_lock);
     for (i = 0; str[i]; i++) {
         c = str[i];
         if (c == '\n') {
@@ -225,6 +222,16 @@ int monitor_puts(Monitor *mon, const char *str)
             monitor_flush_locked(mon);
         }
     }
+
+    return i;
+}
+
+int monitor_puts(Monitor *mon, const char *str)
+{
+    int i;
+
+    qemu_mutex_lock(&mon->mon_lock);
+    i = monitor_puts_locked(mon, str);
     qemu_mutex_unlock(&mon->mon_lock);
 
     return i;
@@ -16,6 +16,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qemu/main-loop.h"
 #include "qemu/option.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
@@ -33,9 +34,12 @@
 #include "qapi/error.h"
 #include "qapi/qapi-commands-acpi.h"
 #include "qapi/qapi-commands-block.h"
+#include "qapi/qapi-commands-block-core.h"
 #include "qapi/qapi-commands-control.h"
 #include "qapi/qapi-commands-machine.h"
+#include "qapi/qapi-commands-migration.h"
 #include "qapi/qapi-commands-misc.h"
+#include "qapi/qapi-commands-stats.h"
 #include "qapi/qapi-commands-ui.h"
 #include "qapi/qmp/qerror.h"
 #include "hw/mem/memory-device.h"
@@ -351,3 +355,54 @@ void qmp_display_reload(DisplayReloadOptions *arg, Error **errp)
         abort();
     }
 }
+
+StatisticsInfo *qmp_query_statistics(StatisticsCategoryList *categories,
+                                     Error **errp)
+{
+    ERRP_GUARD();
+    StatisticsInfo *info = g_new0(StatisticsInfo, 1);
+    StatisticsCategoryList *cat;
+
+    for (cat = categories; cat; cat = cat->next) {
+        switch (cat->value) {
+        case STATISTICS_CATEGORY_MIGRATE:
+            if (info->has_migrate) {
+                break;
+            }
+            info->migrate = qmp_query_migrate(errp);
+            info->has_migrate = true;
+            break;
+        case STATISTICS_CATEGORY_BLOCKSTATS:
+            if (info->has_blockstats) {
+                break;
+            }
+            info->blockstats = qmp_query_blockstats(false, false, errp);
+            info->has_blockstats = true;
+            break;
+        case STATISTICS_CATEGORY_CPUS_FAST:
+            if (info->has_cpus_fast) {
+                break;
+            }
+            info->cpus_fast = qmp_query_cpus_fast(errp);
+            info->has_cpus_fast = true;
+            break;
+        case STATISTICS_CATEGORY_BQL:
+            if (info->has_bql) {
+                break;
+            }
+            info->bql = g_new0(BQLStatistics, 1);
+            qemu_mutex_iothread_get_stats(&info->bql->acquisitions,
+                                          &info->bql->hold_ns,
+                                          &info->bql->max_hold_ns);
+            info->has_bql = true;
+            break;
+        default:
+            abort();
+        }
+        if (*errp) {
+            qapi_free_StatisticsInfo(info);
+            return NULL;
+        }
+    }
+    return info;
+}
@@ -31,6 +31,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qlist.h"
+#include "qemu/units.h"
 #include "trace.h"
 
 struct QMPRequest {
@@ -105,19 +106,34 @@ static void monitor_qmp_cleanup_queue_and_resume(MonitorQMP *mon)
 
 }
 
-void qmp_send_response(MonitorQMP *mon, const QDict *rsp)
-{
-    const QObject *data = QOBJECT(rsp);
-    GString *json;
+/*
+ * Large responses such as query-block or query-qmp-schema are passed to
+ * the chardev in chunks of this size while they are serialized, rather
+ * than first as one big string.
+ */
+#define QMP_RESPONSE_CHUNK_SIZE (64 * KiB)
 
-    json = qobject_to_json_pretty(data, mon->pretty);
-    assert(json != NULL);
-    trace_monitor_qmp_respond(mon, json->str);
+static void qmp_send_response_chunk(void *opaque, const char *buf, size_t len)
+{
+    MonitorQMP *mon = opaque;
 
-    g_string_append_c(json, '\n');
-    monitor_puts(&mon->common, json->str);
+    trace_monitor_qmp_respond(mon, buf);
+    monitor_puts_locked(&mon->common, buf);
+    monitor_flush_locked(&mon->common);
+}
 
-    g_string_free(json, true);
+void qmp_send_response(MonitorQMP *mon, const QDict *rsp)
+{
+    /*
+     * Hold mon_lock throughout, so that events and out-of-band
+     * responses cannot end up in the middle of this one.
+     */
+    qemu_mutex_lock(&mon->common.mon_lock);
+    qobject_to_json_stream(QOBJECT(rsp), mon->pretty,
+                           QMP_RESPONSE_CHUNK_SIZE,
+                           qmp_send_response_chunk, mon);
+    monitor_puts_locked(&mon->common, "\n");
+    qemu_mutex_unlock(&mon->common.mon_lock);
 }
 
 /*
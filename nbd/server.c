@@ -1962,6 +1962,74 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
 }
 
+/*
+ * The chunks of a sparse read are queued and sent with one sendmsg()
+ * when there are NBD_READ_BATCH_CHUNKS of them or the last one is
+ * queued, so that a fragmented image doesn't cost a system call and a
+ * round trip through send_lock per extent.
+ */
+#define NBD_READ_BATCH_CHUNKS 32
+
+typedef struct NBDReadBatch {
+    union {
+        NBDStructuredReadData data;
+        NBDStructuredReadHole hole;
+    } chunks[NBD_READ_BATCH_CHUNKS];
+    struct iovec iov[NBD_READ_BATCH_CHUNKS * 2];
+    unsigned int nr_chunks;
+    unsigned int niov;
+} NBDReadBatch;
+
+static int coroutine_fn nbd_read_batch_send(NBDClient *client,
+                                            NBDReadBatch *batch,
+                                            Error **errp)
+{
+    int ret = 0;
+
+    if (batch->niov) {
+        ret = nbd_co_send_iov(client, batch->iov, batch->niov, errp);
+    }
+    batch->nr_chunks = 0;
+    batch->niov = 0;
+    return ret;
+}
+
+static void nbd_read_batch_add_hole(NBDReadBatch *batch, uint64_t handle,
+                                    uint64_t offset, uint32_t size,
+                                    bool final)
+{
+    NBDStructuredReadHole *chunk = &batch->chunks[batch->nr_chunks++].hole;
+
+    trace_nbd_co_send_structured_read_hole(handle, offset, size);
+    set_be_chunk(&chunk->h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_HOLE,
+                 handle, sizeof(*chunk) - sizeof(chunk->h));
+    stq_be_p(&chunk->offset, offset);
+    stl_be_p(&chunk->length, size);
+    batch->iov[batch->niov++] = (struct iovec) {
+        .iov_base = chunk, .iov_len = sizeof(*chunk),
+    };
+}
+
+static void nbd_read_batch_add_data(NBDReadBatch *batch, uint64_t handle,
+                                    uint64_t offset, void *data,
+                                    size_t size, bool final)
+{
+    NBDStructuredReadData *chunk = &batch->chunks[batch->nr_chunks++].data;
+
+    trace_nbd_co_send_structured_read(handle, offset, data, size);
+    set_be_chunk(&chunk->h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(*chunk) - sizeof(chunk->h) + size);
+    stq_be_p(&chunk->offset, offset);
+    batch->iov[batch->niov++] = (struct iovec) {
+        .iov_base = chunk, .iov_len = sizeof(*chunk),
+    };
+    batch->iov[batch->niov++] = (struct iovec) {
+        .iov_base = data, .iov_len = size,
+    };
+}
+
 /* Do a sparse read and send the structured reply to the client.
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
@@ -1975,6 +2043,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
 {
     int ret = 0;
     NBDExport *exp = client->exp;
+    NBDReadBatch batch = { .nr_chunks = 0 };
     size_t progress = 0;
 
     while (progress < size) {
@@ -1989,27 +2058,19 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             char *msg = g_strdup_printf("unable to check for holes: %s",
                                         strerror(-status));
 
-            ret = nbd_co_send_structured_error(client, handle, -status, msg,
-                                               errp);
+            ret = nbd_read_batch_send(client, &batch, errp);
+            if (ret == 0) {
+                ret = nbd_co_send_structured_error(client, handle, -status,
+                                                   msg, errp);
+            }
             g_free(msg);
             return ret;
         }
         assert(pnum && pnum <= size - progress);
         final = progress + pnum == size;
         if (status & BDRV_BLOCK_ZERO) {
-            NBDStructuredReadHole chunk;
-            struct iovec iov[] = {
-                {.iov_base = &chunk, .iov_len = sizeof(chunk)},
-            };
-
-            trace_nbd_co_send_structured_read_hole(handle, offset + progress,
-                                                   pnum);
-            set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
-                         NBD_REPLY_TYPE_OFFSET_HOLE,
-                         handle, sizeof(chunk) - sizeof(chunk.h));
-            stq_be_p(&chunk.offset, offset + progress);
-            stl_be_p(&chunk.length, pnum);
-            ret = nbd_co_send_iov(client, iov, 1, errp);
+            nbd_read_batch_add_hole(&batch, handle, offset + progress, pnum,
+                                    final);
         } else {
             ret = blk_pread(exp->common.blk, offset + progress,
                             data + progress, pnum);
@@ -2017,13 +2078,15 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                 error_setg_errno(errp, -ret, "reading from file failed");
                 break;
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
+            nbd_read_batch_add_data(&batch, handle, offset + progress,
+                                    data + progress, pnum, final);
         }
 
-        if (ret < 0) {
-            break;
+        if (final || batch.nr_chunks == NBD_READ_BATCH_CHUNKS) {
+            ret = nbd_read_batch_send(client, &batch, errp);
+            if (ret < 0) {
+                break;
+            }
         }
         progress += pnum;
     }
@@ -130,6 +130,12 @@ struct CompareState {
     GQueue conn_list;
     /* Record the connection without repetition */
     GHashTable *connection_track_table;
+    /*
+     * Connection that packets were queued to since it was last compared.
+     * The packets of a read usually belong to few connections, so they
+     * are compared once for the whole run.
+     */
+    Connection *pending_conn;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -194,12 +200,6 @@ static void colo_compare_inconsistency_notify(CompareState *s)
     }
 }
 
-/* Use restricted to colo_insert_packet() */
-static gint seq_sorter(Packet *a, Packet *b, gpointer data)
-{
-    return a->tcp_seq - b->tcp_seq;
-}
-
 static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
 {
     Packet *pkt = data;
@@ -217,6 +217,11 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
     pkt->flags = tcphd->th_flags;
 }
 
+static inline bool after(uint32_t seq1, uint32_t seq2)
+{
+        return (int32_t)(seq1 - seq2) > 0;
+}
+
 /*
  * Return 1 on success, if return 0 means the
  * packet will be dropped
@@ -225,11 +230,22 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
 {
     if (g_queue_get_length(queue) <= max_queue_size) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
+            GList *link = queue->tail;
+
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            /*
+             * Segments mostly arrive in order, so look for their place
+             * from the tail.  Equal sequence numbers keep arrival order.
+             */
+            while (link && after(((Packet *)link->data)->tcp_seq,
+                                 pkt->tcp_seq)) {
+                link = link->prev;
+            }
+            if (link) {
+                g_queue_insert_after(queue, link, pkt);
+            } else {
+                g_queue_push_head(queue, pkt);
+            }
         } else {
             g_queue_push_tail(queue, pkt);
         }
@@ -238,6 +254,8 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     return 0;
 }
 
+static void colo_compare_pending(CompareState *s);
+
 /*
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
@@ -266,6 +284,13 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
     }
     fill_connection_key(pkt, &key);
 
+    /* connection_get() may destroy all the connections to make room */
+    if (s->pending_conn &&
+        g_hash_table_size(s->connection_track_table) > HASHTABLE_MAX_SIZE &&
+        !connection_has_tracked(s->connection_track_table, &key)) {
+        colo_compare_pending(s);
+    }
+
     conn = connection_get(s->connection_track_table,
                           &key,
                           &s->conn_list);
@@ -293,11 +318,6 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
     return 0;
 }
 
-static inline bool after(uint32_t seq1, uint32_t seq2)
-{
-        return (int32_t)(seq1 - seq2) > 0;
-}
-
 static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
@@ -722,6 +742,29 @@ static void colo_compare_connection(void *opaque, void *user_data)
     }
 }
 
+/* Compare the connection that packets were last queued to, if any */
+static void colo_compare_pending(CompareState *s)
+{
+    Connection *conn = s->pending_conn;
+
+    if (conn) {
+        s->pending_conn = NULL;
+        colo_compare_connection(conn, s);
+    }
+}
+
+/*
+ * Called when a packet was queued to @conn: delay its comparison until
+ * the packets for another connection, or the end of the read.
+ */
+static void colo_compare_queued(CompareState *s, Connection *conn)
+{
+    if (s->pending_conn != conn) {
+        colo_compare_pending(s);
+        s->pending_conn = conn;
+    }
+}
+
 static void coroutine_fn _compare_chr_send(void *opaque)
 {
     SendCo *sendco = opaque;
@@ -848,6 +891,7 @@ static void compare_pri_chr_in(void *opaque, const uint8_t *buf, int size)
     int ret;
 
     ret = net_fill_rstate(&s->pri_rs, buf, size);
+    colo_compare_pending(s);
     if (ret == -1) {
         qemu_chr_fe_set_handlers(&s->chr_pri_in, NULL, NULL, NULL, NULL,
                                  NULL, NULL, true);
@@ -865,6 +909,7 @@ static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
     int ret;
 
     ret = net_fill_rstate(&s->sec_rs, buf, size);
+    colo_compare_pending(s);
     if (ret == -1) {
         qemu_chr_fe_set_handlers(&s->chr_sec_in, NULL, NULL, NULL, NULL,
                                  NULL, NULL, true);
@@ -1159,6 +1204,8 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 
     if (packet_enqueue(s, PRIMARY_IN, &conn)) {
         trace_colo_compare_main("primary: unsupported packet in");
+        /* Keep the order of the packets */
+        colo_compare_pending(s);
         compare_chr_send(s,
                          pri_rs->buf,
                          pri_rs->packet_len,
@@ -1167,7 +1214,7 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          false);
     } else {
         /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_queued(s, conn);
     }
 }
 
@@ -1180,7 +1227,7 @@ static void compare_sec_rs_finalize(SocketReadState *sec_rs)
         trace_colo_compare_main("secondary: unsupported packet in");
     } else {
         /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_queued(s, conn);
     }
 }
 
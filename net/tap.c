@@ -47,6 +47,22 @@
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
+#include "trace.h"
+
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+
+/* Most packets that tap_send() reads with one io_uring_enter() */
+#define TAP_URING_BATCH 16
+#endif
+
+/*
+ * When the host keeps receiving more packets while tap_send() is
+ * running we can hog the QEMU global mutex.  Limit the number of
+ * packets that are processed per tap_send() callback to prevent
+ * stalling the guest.
+ */
+#define TAP_SEND_MAX_PACKETS 50
 
 typedef struct TAPState {
     NetClientState nc;
@@ -62,6 +78,12 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+#ifdef CONFIG_LINUX_IO_URING
+    /* NULL when the packets are read one by one with read() */
+    struct io_uring *ring;
+    uint8_t *ring_bufs;
+    int ring_batch;
+#endif
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -182,35 +204,158 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/*
+ * Send the packet that was read in @buf to the peer.  Returns what
+ * qemu_send_packet_async() did: 0 when the packet was queued and the
+ * peer cannot take more.
+ */
+static ssize_t tap_send_packet(TAPState *s, uint8_t *buf, int size)
+{
+    uint8_t min_pkt[ETH_ZLEN];
+    size_t min_pktsz = sizeof(min_pkt);
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        buf  += s->host_vnet_hdr_len;
+        size -= s->host_vnet_hdr_len;
+    }
+
+    if (net_peer_needs_padding(&s->nc)) {
+        if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
+            buf = min_pkt;
+            size = min_pktsz;
+        }
+    }
+
+    return qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static void tap_uring_init(TAPState *s)
+{
+    struct io_uring_params params = { 0 };
+
+    s->ring = g_new0(struct io_uring, 1);
+    /*
+     * The reads must complete inline, with -EAGAIN once the device is
+     * empty, rather than wait for a packet: the kernels that poll the
+     * files instead of blocking a worker also honour O_NONBLOCK.
+     */
+    if (io_uring_queue_init_params(TAP_URING_BATCH, s->ring, &params) < 0) {
+        g_free(s->ring);
+        s->ring = NULL;
+        return;
+    }
+    if (!(params.features & IORING_FEAT_FAST_POLL)) {
+        io_uring_queue_exit(s->ring);
+        g_free(s->ring);
+        s->ring = NULL;
+        return;
+    }
+    s->ring_bufs = g_malloc(TAP_URING_BATCH * NET_BUFSIZE);
+    s->ring_batch = TAP_URING_BATCH;
+}
+
+static void tap_uring_cleanup(TAPState *s)
+{
+    if (s->ring) {
+        io_uring_queue_exit(s->ring);
+        g_free(s->ring);
+        s->ring = NULL;
+        g_free(s->ring_bufs);
+        s->ring_bufs = NULL;
+    }
+}
+
+/*
+ * Read up to @max packets with one system call.  The reads are issued
+ * in order, so the packets are delivered in the order the device had
+ * them; a read that found the device empty is skipped.
+ */
+static int tap_uring_send(TAPState *s, int max, bool *more)
+{
+    ssize_t sizes[TAP_URING_BATCH];
+    struct io_uring_cqe *cqe;
+    int i, ret, filled = 0;
+    bool blocked = false;
+
+    for (i = 0; i < max; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(s->ring);
+
+        io_uring_prep_read(sqe, s->fd, s->ring_bufs + i * NET_BUFSIZE,
+                           NET_BUFSIZE, 0);
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+    }
+    ret = io_uring_submit_and_wait(s->ring, max);
+    if (ret != max) {
+        /* Go back to read() */
+        error_report("tap: io_uring submission failed: %s",
+                     strerror(ret < 0 ? -ret : EIO));
+        tap_uring_cleanup(s);
+        *more = false;
+        return 0;
+    }
+
+    for (i = 0; i < max; i++) {
+        ret = io_uring_wait_cqe(s->ring, &cqe);
+        assert(ret == 0);
+        sizes[(uintptr_t)io_uring_cqe_get_data(cqe)] = cqe->res;
+        io_uring_cqe_seen(s->ring, cqe);
+    }
+
+    for (i = 0; i < max; i++) {
+        if (sizes[i] <= 0) {
+            continue;
+        }
+        filled++;
+        /*
+         * Once the peer stops taking packets, the ones that were
+         * already read are queued rather than dropped.
+         */
+        ret = tap_send_packet(s, s->ring_bufs + i * NET_BUFSIZE, sizes[i]);
+        if (ret == 0) {
+            blocked = true;
+        }
+    }
+    if (blocked) {
+        tap_read_poll(s, false);
+    }
+
+    /* Only ask for as many packets as the device seems to have */
+    s->ring_batch = MIN(MAX(2 * filled, 1), TAP_URING_BATCH);
+    trace_tap_uring_send(s, max, filled);
+
+    *more = filled == max && !blocked;
+    return filled;
+}
+#endif
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
     int packets = 0;
 
-    while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
+    qemu_net_receive_batch_begin(&s->nc);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->ring) {
+        bool more = true;
 
+        while (more && packets < TAP_SEND_MAX_PACKETS) {
+            packets += tap_uring_send(s, MIN(s->ring_batch,
+                                             TAP_SEND_MAX_PACKETS - packets),
+                                      &more);
+        }
+        qemu_net_receive_batch_end(&s->nc);
+        return;
+    }
+#endif
+    while (true) {
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
-
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
-            }
-        }
-
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+        size = tap_send_packet(s, s->buf, size);
         if (size == 0) {
             tap_read_poll(s, false);
             break;
@@ -218,17 +363,12 @@ static void tap_send(void *opaque)
             break;
         }
 
-        /*
-         * When the host keeps receiving more packets while tap_send() is
-         * running we can hog the QEMU global mutex.  Limit the number of
-         * packets that are processed per tap_send() callback to prevent
-         * stalling the guest.
-         */
         packets++;
-        if (packets >= 50) {
+        if (packets >= TAP_SEND_MAX_PACKETS) {
             break;
         }
     }
+    qemu_net_receive_batch_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -336,6 +476,9 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+#ifdef CONFIG_LINUX_IO_URING
+    tap_uring_cleanup(s);
+#endif
     close(s->fd);
     s->fd = -1;
 }
@@ -409,6 +552,9 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
     if (tap_probe_vnet_hdr_len(s->fd, s->host_vnet_hdr_len)) {
         tap_fd_set_vnet_hdr_len(s->fd, s->host_vnet_hdr_len);
     }
+#ifdef CONFIG_LINUX_IO_URING
+    tap_uring_init(s);
+#endif
     tap_read_poll(s, true);
     s->vhost_net = NULL;
 
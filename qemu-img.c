@@ -33,6 +33,7 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qnum.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
@@ -82,6 +83,8 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_WRITE_PERCENT = 277,
+    OPTION_RANDOM = 278,
 };
 
 typedef enum OutputFormat {
@@ -1620,6 +1623,14 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+/* 24 MiB of extents at most, after that block status is queried again */
+#define MAX_CONVERT_EXTENTS (1 << 20)
+
+typedef struct ImgConvertExtent {
+    int64_t start;
+    int64_t end;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1654,6 +1665,14 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+    /*
+     * Block status of the source, saved while counting the allocated
+     * sectors so that the copy doesn't query it again under s->lock.
+     * Adjacent extents with the same status are merged.
+     */
+    GArray *extents;
+    guint extent_index;
+    bool record_extents;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1668,6 +1687,52 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+static void convert_record_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent *last;
+    ImgConvertExtent extent = {
+        .start = sector_num,
+        .end = s->sector_next_status,
+        .status = s->status,
+    };
+
+    if (!s->extents->len) {
+        g_array_append_val(s->extents, extent);
+        return;
+    }
+    last = &g_array_index(s->extents, ImgConvertExtent, s->extents->len - 1);
+    if (last->end == sector_num && last->status == s->status) {
+        last->end = s->sector_next_status;
+    } else if (s->extents->len < MAX_CONVERT_EXTENTS) {
+        g_array_append_val(s->extents, extent);
+    } else {
+        s->record_extents = false;
+    }
+}
+
+static bool convert_lookup_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent *extent;
+
+    if (!s->extents || s->record_extents) {
+        return false;
+    }
+    while (s->extent_index < s->extents->len) {
+        extent = &g_array_index(s->extents, ImgConvertExtent,
+                                s->extent_index);
+        if (extent->end > sector_num) {
+            if (extent->start > sector_num) {
+                return false;
+            }
+            s->status = extent->status;
+            s->sector_next_status = extent->end;
+            return true;
+        }
+        s->extent_index++;
+    }
+    return false;
+}
+
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
     int64_t src_cur_offset;
@@ -1689,7 +1754,8 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (s->sector_next_status <= sector_num &&
+        !convert_lookup_extent(s, sector_num)) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
@@ -1752,6 +1818,9 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         s->sector_next_status = sector_num + n;
+        if (s->record_extents) {
+            convert_record_extent(s, sector_num);
+        }
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
@@ -2063,9 +2132,13 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    s->extents = g_array_new(false, false, sizeof(ImgConvertExtent));
+    s->record_extents = true;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
+            g_array_free(s->extents, true);
+            s->extents = NULL;
             return n;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
@@ -2074,6 +2147,8 @@ static int convert_do_copy(ImgConvertState *s)
         }
         sector_num += n;
     }
+    s->record_extents = false;
+    s->extent_index = 0;
 
     /* Do the copy */
     s->sector_next_status = 0;
@@ -2089,6 +2164,8 @@ static int convert_do_copy(ImgConvertState *s)
     while (s->running_coroutines) {
         main_loop_wait(false);
     }
+    g_array_free(s->extents, true);
+    s->extents = NULL;
 
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
@@ -4178,10 +4255,37 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+/*
+ * Request latencies are counted in buckets whose width doubles with every
+ * power of two, each power of two getting 2^BENCH_LAT_SUB_BITS of them.
+ * That keeps the percentiles within about 6% of the real value.
+ */
+#define BENCH_LAT_SUB_BITS 4
+#define BENCH_LAT_BUCKETS ((64 - BENCH_LAT_SUB_BITS + 1) << BENCH_LAT_SUB_BITS)
+
+typedef struct BenchLatency {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[BENCH_LAT_BUCKETS];
+} BenchLatency;
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    bool write;
+    int64_t start_ns;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
     bool write;
+    int write_percent;
+    bool random;
+    GRand *rand;
     int bufsize;
     int step;
     int nrreq;
@@ -4189,12 +4293,135 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    int *free_reqs;
+    int nr_free_reqs;
 
     int in_flight;
     bool in_flush;
+    uint64_t start_offset;
     uint64_t offset;
-} BenchData;
+
+    /* Indexed by BenchRequest.write */
+    BenchLatency lat[2];
+};
+
+static int bench_lat_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < (1 << BENCH_LAT_SUB_BITS)) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return ((msb - BENCH_LAT_SUB_BITS + 1) << BENCH_LAT_SUB_BITS) +
+           ((ns >> (msb - BENCH_LAT_SUB_BITS)) &
+            ((1 << BENCH_LAT_SUB_BITS) - 1));
+}
+
+/* The highest latency that is counted in @bucket */
+static uint64_t bench_lat_bucket_max(int bucket)
+{
+    int shift;
+    uint64_t sub;
+
+    if (bucket < (1 << BENCH_LAT_SUB_BITS)) {
+        return bucket;
+    }
+    shift = (bucket >> BENCH_LAT_SUB_BITS) - 1;
+    sub = (1 << BENCH_LAT_SUB_BITS) |
+          (bucket & ((1 << BENCH_LAT_SUB_BITS) - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+static void bench_lat_add(BenchLatency *lat, uint64_t ns)
+{
+    lat->count++;
+    lat->total_ns += ns;
+    lat->max_ns = MAX(lat->max_ns, ns);
+    lat->buckets[bench_lat_bucket(ns)]++;
+}
+
+static uint64_t bench_lat_percentile(const BenchLatency *lat,
+                                     double percentile)
+{
+    uint64_t target = MAX(1, (uint64_t)(lat->count * percentile / 100));
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        seen += lat->buckets[i];
+        if (seen >= target) {
+            return MIN(bench_lat_bucket_max(i), lat->max_ns);
+        }
+    }
+    return lat->max_ns;
+}
+
+static const double bench_percentiles[] = { 50, 99, 99.9 };
+
+static void bench_print_latency(const char *name, const BenchLatency *lat,
+                                double seconds)
+{
+    int i;
+
+    if (!lat->count) {
+        return;
+    }
+    printf("%s: %" PRIu64 " requests, %.1f IOPS, latency (us): avg %.1f",
+           name, lat->count, lat->count / seconds,
+           (double)lat->total_ns / lat->count / 1000);
+    for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+        printf(", p%g %.1f", bench_percentiles[i],
+               bench_lat_percentile(lat, bench_percentiles[i]) / 1000.0);
+    }
+    printf(", max %.1f\n", lat->max_ns / 1000.0);
+}
+
+static QDict *bench_latency_to_qdict(const BenchLatency *lat, double seconds,
+                                     int bufsize)
+{
+    QDict *dict = qdict_new();
+    QDict *percentiles = qdict_new();
+    int i;
+
+    qdict_put_int(dict, "requests", lat->count);
+    qdict_put_int(dict, "bytes", lat->count * bufsize);
+    qdict_put(dict, "iops", qnum_from_double(lat->count / seconds));
+    if (lat->count) {
+        qdict_put_int(dict, "avg-ns", lat->total_ns / lat->count);
+        qdict_put_int(dict, "max-ns", lat->max_ns);
+        for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+            g_autofree char *key = g_strdup_printf("p%g",
+                                                   bench_percentiles[i]);
+            qdict_put_int(percentiles, key,
+                          bench_lat_percentile(lat, bench_percentiles[i]));
+        }
+    }
+    qdict_put(dict, "percentiles-ns", percentiles);
+    return dict;
+}
+
+static void bench_dump_json(BenchData *b, double seconds)
+{
+    QDict *dict = qdict_new();
+    GString *str;
+
+    qdict_put(dict, "seconds", qnum_from_double(seconds));
+    qdict_put_int(dict, "buffer-size", b->bufsize);
+    qdict_put_int(dict, "depth", b->nrreq);
+    qdict_put_int(dict, "write-percent", b->write_percent);
+    qdict_put_bool(dict, "random", b->random);
+    qdict_put(dict, "read", bench_latency_to_qdict(&b->lat[false], seconds,
+                                                   b->bufsize));
+    qdict_put(dict, "write", bench_latency_to_qdict(&b->lat[true], seconds,
+                                                    b->bufsize));
+
+    str = qobject_to_json_pretty(QOBJECT(dict), true);
+    printf("%s\n", str->str);
+    g_string_free(str, true);
+    qobject_unref(dict);
+}
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4204,6 +4431,35 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
+static void bench_cb(void *opaque, int ret);
+
+static void bench_req_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    bench_lat_add(&b->lat[req->write], get_clock() - req->start_ns);
+    b->free_reqs[b->nr_free_reqs++] = req - b->reqs;
+    bench_cb(b, ret);
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset = b->offset;
+
+    if (b->random) {
+        uint64_t steps = (b->image_size - b->start_offset) / b->step;
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+
+        return b->start_offset + r % steps * b->step;
+    }
+
+    b->offset += b->step;
+    b->offset %= b->image_size;
+    return offset;
+}
+
 static void bench_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
@@ -4249,18 +4505,23 @@ static void bench_cb(void *opaque, int ret)
     }
 
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+        BenchRequest *req = &b->reqs[b->free_reqs[--b->nr_free_reqs]];
+        int64_t offset = bench_next_offset(b);
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
          * and b->offset is ready for the next submission.
          */
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+        req->write = b->write_percent == 100 ||
+            (b->write_percent &&
+             g_rand_int_range(b->rand, 0, 100) < b->write_percent);
+        req->start_ns = get_clock();
+        if (req->write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0,
+                                  bench_req_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_req_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -4284,6 +4545,11 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    int write_percent = -1;
+    bool random_offsets = false;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    const char *output = NULL;
+    double seconds;
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
@@ -4302,6 +4568,9 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"write-percent", required_argument, 0, OPTION_WRITE_PERCENT},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
@@ -4435,6 +4704,27 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_WRITE_PERCENT:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            write_percent = res;
+            if (res) {
+                flags |= BDRV_O_RDWR;
+                is_write = true;
+            }
+            break;
+        }
+        case OPTION_RANDOM:
+            random_offsets = true;
+            break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
         }
     }
 
@@ -4443,6 +4733,19 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    if (write_percent < 0) {
+        write_percent = is_write ? 100 : 0;
+    }
+
     if (!is_write && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
@@ -4474,18 +4777,36 @@ static int img_bench(int argc, char **argv)
         .step           = step ?: bufsize,
         .nrreq          = depth,
         .n              = count,
+        .start_offset   = offset,
         .offset         = offset,
         .write          = is_write,
+        .write_percent  = write_percent,
+        .random         = random_offsets,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    if (random_offsets && image_size - offset < data.step) {
+        error_report("The image is too small for random requests");
+        ret = -1;
+        goto out;
     }
+    if (output_format == OFORMAT_HUMAN) {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(starting at offset %" PRId64 ", step size %d)\n",
+               data.n, data.write ? "write" : "read", data.bufsize,
+               data.nrreq, data.start_offset, data.step);
+        if (write_percent && write_percent < 100) {
+            printf("Writing %d%% of the requests\n", write_percent);
+        }
+        if (random_offsets) {
+            printf("Using random offsets\n");
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
+    }
+    /* A fixed seed, so that runs can be compared */
+    data.rand = g_rand_new_with_seed(0);
 
     buf_size = data.nrreq * data.bufsize;
     data.buf = blk_blockalign(blk, buf_size);
@@ -4493,12 +4814,16 @@ static int img_bench(int argc, char **argv)
 
     blk_register_buf(blk, data.buf, buf_size);
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
+    data.reqs = g_new0(BenchRequest, data.nrreq);
+    data.free_reqs = g_new(int, data.nrreq);
     for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
+        data.reqs[i].b = &data;
+        qemu_iovec_init(&data.reqs[i].qiov, 1);
+        qemu_iovec_add(&data.reqs[i].qiov,
                        data.buf + i * data.bufsize, data.bufsize);
+        data.free_reqs[i] = i;
     }
+    data.nr_free_reqs = data.nrreq;
 
     gettimeofday(&t1, NULL);
     bench_cb(&data, 0);
@@ -4508,11 +4833,27 @@ static int img_bench(int argc, char **argv)
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    seconds = (t2.tv_sec - t1.tv_sec)
+              + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+    if (output_format == OFORMAT_JSON) {
+        bench_dump_json(&data, seconds);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", seconds);
+        bench_print_latency("read", &data.lat[false], seconds);
+        bench_print_latency("write", &data.lat[true], seconds);
+    }
 
 out:
+    if (data.reqs) {
+        for (i = 0; i < data.nrreq; i++) {
+            qemu_iovec_destroy(&data.reqs[i].qiov);
+        }
+        g_free(data.reqs);
+        g_free(data.free_reqs);
+    }
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
     if (data.buf) {
         blk_unregister_buf(blk, data.buf);
     }
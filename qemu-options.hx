@@ -142,6 +142,9 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
+    "                                  (TCG dirty ring page count, default 0)\n"
+    "                halt-poll-ns=n (KVM halt polling limit, default 0)\n"
+    "                victim-tlb-size=n (TCG victim TLB entries, default 8)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
 SRST
 ``-accel name[,prop=value[,...]]``
@@ -193,6 +196,29 @@ SRST
         is disabled (dirty-ring-size=0).  When enabled, KVM will instead
         record dirty pages in a bitmap.
 
+        With TCG, it is the size of the per-vCPU rings where the pages
+        that the guest dirties during a migration are logged, instead of
+        being set in the shared dirty bitmap on the first write to each
+        of them.  It should be a power of two, 0 disables the rings.
+
+    ``halt-poll-ns=n``
+        When the KVM accelerator is used, it is the longest time in
+        nanoseconds that a halted vCPU polls for an interrupt before
+        it sleeps.  It is passed to the kernel for the vCPUs that halt
+        there, and without an in-kernel irqchip the vCPU threads poll
+        in userspace; each vCPU adapts its polling window to how soon
+        it is woken up, doubling it up to this limit and halving it
+        after long halts.  The default, 0, leaves the kernel setting
+        alone and does not poll in userspace.
+
+    ``victim-tlb-size=n``
+        Controls the number of entries, between 1 and 256, of the fully
+        associative victim TLB that keeps the entries evicted from the
+        softmmu TLB of each MMU mode.  A larger victim TLB saves page
+        table walks for guests that touch many pages that collide in
+        the TLB, at the cost of a longer search on each TLB miss.  The
+        default is 8.  ``info jit`` shows how often the victim TLB hits.
+
 ERST
 
 DEF("smp", HAS_ARG, QEMU_OPTION_smp,
@@ -2598,6 +2624,12 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m]\n"
+    "                attach to the existing network interface 'name' with AF_XDP\n"
+    "                sockets on 'n' of its queues, starting with queue 'm'\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -3065,6 +3097,28 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
+``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m]``
+    Connect to queues of the existing network interface ``name`` with
+    AF_XDP sockets. An XDP program is attached to the interface to
+    redirect the packets of these queues to QEMU, in the driver with
+    ``mode=native`` or in the generic code with ``mode=skb``; by
+    default the native mode is tried first. The interface should be
+    configured so that the packets for the guest land on queues
+    ``start-queue`` to ``start-queue`` + ``queues`` - 1, for example
+    with ``ethtool -N``. Each queue of the guest device then uses one
+    of them. ``force-copy=on`` disables the zero-copy mode of the
+    driver. This option is only available if QEMU has been compiled
+    with libxdp.
+
+    Example:
+
+    .. parsed-literal::
+
+        # use queues 4 and 5 of eth0
+        ethtool -L eth0 combined 6
+        |qemu_system| linux.img -netdev af-xdp,id=n1,ifname=eth0,queues=2,start-queue=4 \\
+                   -device virtio-net-pci,netdev=n1,mq=on
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -4267,6 +4321,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration from a given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -4286,6 +4342,10 @@ SRST
     Accept incoming migration as an output from specified external
     command.
 
+``-incoming file:filename``
+    Accept incoming migration from a file written by ``migrate
+    file:filename``.
+
 ``-incoming defer``
     Wait for the URI to be specified via migrate\_incoming. The monitor
     can be used to change settings (such as migration parameters) prior
@@ -5298,6 +5358,27 @@ SRST
         ::
 
             (qemu) qom-set /objects/iothread1 poll-max-ns 100000
+
+    ``-object thread-context,id=id,threads=threads[,cpu-affinity=cpus][,node-affinity=nodes]``
+        Restricts groups of threads that QEMU creates for its own work
+        to some host CPUs, for example to keep them away from the CPUs
+        that run the vCPUs. ``threads`` is a list of groups among
+        ``iothread``, ``migration``, ``multifd``, ``compress``,
+        ``postcopy`` and ``dirty-ring-reaper``. A group can only be
+        placed by one thread-context.
+
+        Exactly one of ``cpu-affinity``, a list of host CPUs, and
+        ``node-affinity``, a list of host NUMA nodes whose CPUs to use,
+        must be set.
+
+        Threads are placed when they are created, so a thread-context
+        for the iothreads has to come before the ``-object iothread``
+        options on the command line:
+
+        ::
+
+            -object thread-context,id=tc0,threads.0=iothread,threads.1=migration,threads.2=multifd,node-affinity.0=1
+            -object iothread,id=iothread0
 ERST
 
 
@@ -22,11 +22,16 @@ struct JSONWriter {
     bool need_comma;
     GString *contents;
     GByteArray *container_is_array;
+    /* for streaming writers: where the contents go, and how much went */
+    JSONWriterFlushFunc *flush;
+    void *flush_opaque;
+    size_t chunk_size;
+    size_t flushed;
 };
 
 JSONWriter *json_writer_new(bool pretty)
 {
-    JSONWriter *writer = g_new(JSONWriter, 1);
+    JSONWriter *writer = g_new0(JSONWriter, 1);
 
     writer->pretty = pretty;
     writer->need_comma = false;
@@ -35,8 +40,42 @@ JSONWriter *json_writer_new(bool pretty)
     return writer;
 }
 
+JSONWriter *json_writer_new_stream(bool pretty, size_t chunk_size,
+                                   JSONWriterFlushFunc *flush, void *opaque)
+{
+    JSONWriter *writer = json_writer_new(pretty);
+
+    assert(flush && chunk_size);
+    writer->flush = flush;
+    writer->flush_opaque = opaque;
+    writer->chunk_size = chunk_size;
+    g_string_set_size(writer->contents, chunk_size);
+    g_string_truncate(writer->contents, 0);
+    return writer;
+}
+
+void json_writer_flush(JSONWriter *writer)
+{
+    GString *contents = writer->contents;
+
+    assert(writer->flush);
+    if (contents->len) {
+        writer->flush(writer->flush_opaque, contents->str, contents->len);
+        writer->flushed += contents->len;
+        g_string_truncate(contents, 0);
+    }
+}
+
+static void maybe_flush(JSONWriter *writer)
+{
+    if (writer->flush && writer->contents->len >= writer->chunk_size) {
+        json_writer_flush(writer);
+    }
+}
+
 const char *json_writer_get(JSONWriter *writer)
 {
+    g_assert(!writer->flush);
     g_assert(!writer->container_is_array->len);
     return writer->contents->str;
 }
@@ -156,11 +195,12 @@ static void quoted_str(JSONWriter *writer, const char *str)
 
 static void maybe_comma_name(JSONWriter *writer, const char *name)
 {
+    maybe_flush(writer);
     if (writer->need_comma) {
         g_string_append_c(writer->contents, ',');
         pretty_newline_or_space(writer);
     } else {
-        if (writer->contents->len) {
+        if (writer->contents->len || writer->flushed) {
             pretty_newline(writer);
         }
         writer->need_comma = true;
@@ -226,6 +226,22 @@ GString *qobject_to_json_pretty(const QObject *obj, bool pretty)
     return json_writer_get_and_free(writer);
 }
 
+/*
+ * Like qobject_to_json_pretty(), but pass the text to @flush in chunks
+ * of about @chunk_size bytes as it is produced.
+ */
+void qobject_to_json_stream(const QObject *obj, bool pretty,
+                            size_t chunk_size,
+                            JSONWriterFlushFunc *flush, void *opaque)
+{
+    JSONWriter *writer = json_writer_new_stream(pretty, chunk_size,
+                                                flush, opaque);
+
+    to_json(writer, NULL, obj);
+    json_writer_flush(writer);
+    json_writer_free(writer);
+}
+
 GString *qobject_to_json(const QObject *obj)
 {
     return qobject_to_json_pretty(obj, false);
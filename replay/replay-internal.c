@@ -15,6 +15,7 @@
 #include "replay-internal.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 
 /* Mutex to protect reading and writing events to the log.
    data_kind and has_unread_data are also protected
@@ -44,11 +45,272 @@ static void replay_read_error(void)
     exit(1);
 }
 
+/*
+ * The log goes through a ring of chunks, so that the vCPU thread only
+ * copies the events to memory.  While recording, a thread writes the
+ * chunks that were filled; while replaying, it reads ahead into the
+ * free ones.  The chunk at @tail belongs to the replay_mutex holder,
+ * the @count ones before it (recording) or from it (replaying) are
+ * waiting for the thread or for the replay_mutex holder.
+ */
+#define REPLAY_IO_CHUNK_SIZE (256 * KiB)
+#define REPLAY_IO_CHUNKS     8
+
+typedef struct ReplayIOChunk {
+    uint8_t *data;
+    size_t len;
+    /* Offset of data[0] in the log */
+    uint64_t offset;
+} ReplayIOChunk;
+
+static struct {
+    QemuThread thread;
+    bool running;
+    QemuMutex lock;
+    QemuCond cond;
+    ReplayIOChunk chunks[REPLAY_IO_CHUNKS];
+    unsigned int head;
+    unsigned int tail;
+    unsigned int count;
+    bool stop;
+    bool eof;
+    bool error;
+    /* Replaying: whether chunks[tail] is being consumed */
+    bool have_chunk;
+    /* Position of the replay_mutex holder in chunks[tail] */
+    size_t pos;
+    /* Replaying: offset in the log of the next chunk to read */
+    uint64_t read_offset;
+    /* Replaying: offset in the log of the next byte to consume */
+    uint64_t unread_offset;
+    /* Replaying: an event was read past the end of the log */
+    bool read_past_eof;
+} replay_io;
+
+static void *replay_io_write_thread(void *opaque)
+{
+    qemu_mutex_lock(&replay_io.lock);
+    while (true) {
+        ReplayIOChunk *chunk;
+
+        while (!replay_io.count && !replay_io.stop) {
+            qemu_cond_wait(&replay_io.cond, &replay_io.lock);
+        }
+        if (!replay_io.count) {
+            break;
+        }
+        chunk = &replay_io.chunks[replay_io.head];
+        qemu_mutex_unlock(&replay_io.lock);
+
+        if (fwrite(chunk->data, 1, chunk->len, replay_file) != chunk->len ||
+            fflush(replay_file)) {
+            qatomic_set(&replay_io.error, true);
+        }
+
+        qemu_mutex_lock(&replay_io.lock);
+        replay_io.head = (replay_io.head + 1) % REPLAY_IO_CHUNKS;
+        replay_io.count--;
+        qemu_cond_broadcast(&replay_io.cond);
+    }
+    qemu_mutex_unlock(&replay_io.lock);
+    return NULL;
+}
+
+static void *replay_io_read_thread(void *opaque)
+{
+    qemu_mutex_lock(&replay_io.lock);
+    while (true) {
+        ReplayIOChunk *chunk;
+        size_t len;
+
+        while (replay_io.count == REPLAY_IO_CHUNKS && !replay_io.stop) {
+            qemu_cond_wait(&replay_io.cond, &replay_io.lock);
+        }
+        if (replay_io.stop) {
+            break;
+        }
+        chunk = &replay_io.chunks[replay_io.head];
+        qemu_mutex_unlock(&replay_io.lock);
+
+        len = fread(chunk->data, 1, REPLAY_IO_CHUNK_SIZE, replay_file);
+
+        qemu_mutex_lock(&replay_io.lock);
+        if (len) {
+            chunk->len = len;
+            chunk->offset = replay_io.read_offset;
+            replay_io.read_offset += len;
+            replay_io.head = (replay_io.head + 1) % REPLAY_IO_CHUNKS;
+            replay_io.count++;
+        }
+        if (len < REPLAY_IO_CHUNK_SIZE) {
+            replay_io.eof = true;
+            replay_io.error = ferror(replay_file);
+        }
+        qemu_cond_broadcast(&replay_io.cond);
+        if (replay_io.eof) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&replay_io.lock);
+    return NULL;
+}
+
+/* Start the thread, at the current position of replay_file */
+static void replay_io_start_thread(void)
+{
+    uint64_t offset = ftell(replay_file);
+
+    replay_io.head = replay_io.tail = replay_io.count = 0;
+    replay_io.stop = replay_io.eof = false;
+    replay_io.have_chunk = false;
+    replay_io.pos = 0;
+    replay_io.chunks[0].offset = offset;
+    replay_io.read_offset = offset;
+    replay_io.unread_offset = offset;
+    replay_io.running = true;
+    qemu_thread_create(&replay_io.thread, "replay-io",
+                       replay_mode == REPLAY_MODE_RECORD ?
+                       replay_io_write_thread : replay_io_read_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+static void replay_io_stop_thread(void)
+{
+    if (!replay_io.running) {
+        return;
+    }
+    qemu_mutex_lock(&replay_io.lock);
+    replay_io.stop = true;
+    qemu_cond_broadcast(&replay_io.cond);
+    qemu_mutex_unlock(&replay_io.lock);
+    qemu_thread_join(&replay_io.thread);
+    replay_io.running = false;
+}
+
+/* Recording: hand chunks[tail] over to the thread */
+static void replay_io_submit(void)
+{
+    uint64_t offset = replay_io.chunks[replay_io.tail].offset;
+
+    if (qatomic_read(&replay_io.error)) {
+        replay_write_error();
+    }
+
+    qemu_mutex_lock(&replay_io.lock);
+    replay_io.chunks[replay_io.tail].len = replay_io.pos;
+    replay_io.tail = (replay_io.tail + 1) % REPLAY_IO_CHUNKS;
+    replay_io.count++;
+    qemu_cond_broadcast(&replay_io.cond);
+    while (replay_io.count == REPLAY_IO_CHUNKS) {
+        qemu_cond_wait(&replay_io.cond, &replay_io.lock);
+    }
+    qemu_mutex_unlock(&replay_io.lock);
+
+    replay_io.chunks[replay_io.tail].offset = offset + replay_io.pos;
+    replay_io.pos = 0;
+}
+
+/* Recording: wait until everything was written to replay_file */
+static void replay_io_flush(void)
+{
+    if (replay_io.pos) {
+        replay_io_submit();
+    }
+    qemu_mutex_lock(&replay_io.lock);
+    while (replay_io.count) {
+        qemu_cond_wait(&replay_io.cond, &replay_io.lock);
+    }
+    qemu_mutex_unlock(&replay_io.lock);
+    if (qatomic_read(&replay_io.error)) {
+        replay_write_error();
+    }
+}
+
+/*
+ * Replaying: make chunks[tail] one with unread data.  Returns false
+ * at the end of the log.
+ */
+static bool replay_io_next_chunk(void)
+{
+    qemu_mutex_lock(&replay_io.lock);
+    if (replay_io.have_chunk) {
+        ReplayIOChunk *chunk = &replay_io.chunks[replay_io.tail];
+
+        replay_io.unread_offset = chunk->offset + chunk->len;
+        replay_io.tail = (replay_io.tail + 1) % REPLAY_IO_CHUNKS;
+        replay_io.count--;
+        replay_io.have_chunk = false;
+        qemu_cond_broadcast(&replay_io.cond);
+    }
+    while (!replay_io.count && !replay_io.eof) {
+        qemu_cond_wait(&replay_io.cond, &replay_io.lock);
+    }
+    replay_io.have_chunk = replay_io.count;
+    qemu_mutex_unlock(&replay_io.lock);
+
+    replay_io.pos = 0;
+    return replay_io.have_chunk;
+}
+
+void replay_io_start(void)
+{
+    int i;
+
+    qemu_mutex_init(&replay_io.lock);
+    qemu_cond_init(&replay_io.cond);
+    for (i = 0; i < REPLAY_IO_CHUNKS; i++) {
+        replay_io.chunks[i].data = g_malloc(REPLAY_IO_CHUNK_SIZE);
+    }
+    replay_io_start_thread();
+}
+
+void replay_io_stop(void)
+{
+    int i;
+
+    if (!replay_io.running) {
+        return;
+    }
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        replay_io_flush();
+    }
+    replay_io_stop_thread();
+    for (i = 0; i < REPLAY_IO_CHUNKS; i++) {
+        g_free(replay_io.chunks[i].data);
+        replay_io.chunks[i].data = NULL;
+    }
+    qemu_cond_destroy(&replay_io.cond);
+    qemu_mutex_destroy(&replay_io.lock);
+}
+
+uint64_t replay_io_tell(void)
+{
+    if (replay_mode == REPLAY_MODE_PLAY && !replay_io.have_chunk) {
+        return replay_io.unread_offset;
+    }
+    return replay_io.chunks[replay_io.tail].offset + replay_io.pos;
+}
+
+void replay_io_seek(uint64_t offset)
+{
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        /* The thread is idle until the next chunk is submitted */
+        replay_io_flush();
+        fseek(replay_file, offset, SEEK_SET);
+        replay_io.chunks[replay_io.tail].offset = offset;
+    } else {
+        replay_io_stop_thread();
+        fseek(replay_file, offset, SEEK_SET);
+        replay_io_start_thread();
+    }
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        if (putc(byte, replay_file) == EOF) {
-            replay_write_error();
+        replay_io.chunks[replay_io.tail].data[replay_io.pos++] = byte;
+        if (replay_io.pos == REPLAY_IO_CHUNK_SIZE) {
+            replay_io_submit();
         }
     }
 }
@@ -82,9 +344,40 @@ void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        if (fwrite(buf, 1, size, replay_file) != size) {
-            replay_write_error();
+        while (size) {
+            size_t len = MIN(size, REPLAY_IO_CHUNK_SIZE - replay_io.pos);
+
+            memcpy(replay_io.chunks[replay_io.tail].data + replay_io.pos,
+                   buf, len);
+            replay_io.pos += len;
+            buf += len;
+            size -= len;
+            if (replay_io.pos == REPLAY_IO_CHUNK_SIZE) {
+                replay_io_submit();
+            }
+        }
+    }
+}
+
+/* Copy @size bytes of the log to @buf */
+static void replay_get_bytes(uint8_t *buf, size_t size)
+{
+    while (size) {
+        ReplayIOChunk *chunk = &replay_io.chunks[replay_io.tail];
+        size_t len;
+
+        if (!replay_io.have_chunk || replay_io.pos == chunk->len) {
+            if (!replay_io_next_chunk()) {
+                replay_io.read_past_eof = true;
+                replay_read_error();
+            }
+            continue;
         }
+        len = MIN(size, chunk->len - replay_io.pos);
+        memcpy(buf, chunk->data + replay_io.pos, len);
+        replay_io.pos += len;
+        buf += len;
+        size -= len;
     }
 }
 
@@ -92,11 +385,13 @@ uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        int r = getc(replay_file);
-        if (r == EOF) {
-            replay_read_error();
+        ReplayIOChunk *chunk = &replay_io.chunks[replay_io.tail];
+
+        if (replay_io.have_chunk && replay_io.pos < chunk->len) {
+            byte = chunk->data[replay_io.pos++];
+        } else {
+            replay_get_bytes(&byte, 1);
         }
-        byte = r;
     }
     return byte;
 }
@@ -138,9 +433,7 @@ void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
-            replay_read_error();
-        }
+        replay_get_bytes(buf, *size);
     }
 }
 
@@ -149,20 +442,19 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
-            replay_read_error();
-        }
+        replay_get_bytes(*buf, *size);
     }
 }
 
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        if (replay_io.read_past_eof) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        } else if (replay_mode == REPLAY_MODE_PLAY &&
+                   qatomic_read(&replay_io.error)) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
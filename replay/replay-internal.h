@@ -99,6 +99,16 @@ extern uint64_t replay_break_icount;
 /* Timer for the replay breakpoint callback */
 extern QEMUTimer *replay_break_timer;
 
+/*! Starts the thread that writes or reads ahead the log, at the current
+    position of replay_file. */
+void replay_io_start(void);
+/*! Writes the pending events and stops the thread. */
+void replay_io_stop(void);
+/*! Returns the offset in the log of the next event. */
+uint64_t replay_io_tell(void);
+/*! Moves to @offset in the log. */
+void replay_io_seek(uint64_t offset);
+
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
 void replay_put_word(uint16_t word);
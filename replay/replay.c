@@ -277,14 +277,18 @@ static void replay_enable(const char *fname, int mode)
     /* skip file header for RECORD and check it for PLAY */
     if (replay_mode == REPLAY_MODE_RECORD) {
         fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_io_start();
     } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
+        unsigned int version;
+
+        replay_io_start();
+        version = replay_get_dword();
         if (version != REPLAY_VERSION) {
             fprintf(stderr, "Replay: invalid input log file version\n");
             exit(1);
         }
         /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_io_seek(HEADER_SIZE);
         replay_fetch_data_kind();
     }
 
@@ -372,10 +376,11 @@ void replay_finish(void)
             replay_put_event(EVENT_END);
 
             /* write header */
-            fseek(replay_file, 0, SEEK_SET);
+            replay_io_seek(0);
             replay_put_dword(REPLAY_VERSION);
         }
 
+        replay_io_stop();
         fclose(replay_file);
         replay_file = NULL;
     }
@@ -34,6 +34,7 @@
 #include "sysemu/hw_accel.h"
 #include "exec/exec-all.h"
 #include "qemu/thread.h"
+#include "qemu/timer.h"
 #include "qemu/plugin.h"
 #include "sysemu/cpus.h"
 #include "qemu/guest-random.h"
@@ -382,9 +383,47 @@ void qemu_init_cpu_loop(void)
     qemu_thread_get_self(&io_thread);
 }
 
+/*
+ * How long the BQL is held between qemu_mutex_lock_iothread() and
+ * qemu_mutex_unlock_iothread(), not counting condition variable waits.
+ * Only the holder updates the counters.
+ */
+static struct {
+    uint64_t acquisitions;
+    uint64_t hold_ns;
+    uint64_t max_hold_ns;
+} bql_stats;
+static __thread int64_t bql_acquired_ns;
+
+static void bql_hold_start(void)
+{
+    bql_acquired_ns = get_clock();
+}
+
+static void bql_hold_end(void)
+{
+    uint64_t ns = get_clock() - bql_acquired_ns;
+
+    bql_stats.acquisitions++;
+    bql_stats.hold_ns += ns;
+    bql_stats.max_hold_ns = MAX(bql_stats.max_hold_ns, ns);
+}
+
+void qemu_mutex_iothread_get_stats(uint64_t *acquisitions, uint64_t *hold_ns,
+                                   uint64_t *max_hold_ns)
+{
+    g_assert(qemu_mutex_iothread_locked());
+    *acquisitions = bql_stats.acquisitions;
+    *hold_ns = bql_stats.hold_ns;
+    *max_hold_ns = bql_stats.max_hold_ns;
+}
+
 void run_on_cpu(CPUState *cpu, run_on_cpu_func func, run_on_cpu_data data)
 {
+    /* @func runs in the vCPU thread, which counts its own hold time */
+    bql_hold_end();
     do_run_on_cpu(cpu, func, data, &qemu_global_mutex);
+    bql_hold_start();
 }
 
 static void qemu_cpu_stop(CPUState *cpu, bool exit)
@@ -416,7 +455,7 @@ void qemu_wait_io_event(CPUState *cpu)
             slept = true;
             qemu_plugin_vcpu_idle_cb(cpu);
         }
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(cpu->halt_cond);
     }
     if (slept) {
         qemu_plugin_vcpu_resume_cb(cpu);
@@ -492,23 +531,29 @@ void qemu_mutex_lock_iothread_impl(const char *file, int line)
     g_assert(!qemu_mutex_iothread_locked());
     bql_lock(&qemu_global_mutex, file, line);
     iothread_locked = true;
+    bql_hold_start();
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
     g_assert(qemu_mutex_iothread_locked());
+    bql_hold_end();
     iothread_locked = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
 void qemu_cond_wait_iothread(QemuCond *cond)
 {
+    bql_hold_end();
     qemu_cond_wait(cond, &qemu_global_mutex);
+    bql_hold_start();
 }
 
 void qemu_cond_timedwait_iothread(QemuCond *cond, int ms)
 {
+    bql_hold_end();
     qemu_cond_timedwait(cond, &qemu_global_mutex, ms);
+    bql_hold_start();
 }
 
 /* signal CPU creation */
@@ -559,7 +604,7 @@ static void __pause_all_vcpus(bool disable_clock)
     replay_mutex_unlock();
 
     while (!all_vcpus_paused()) {
-        qemu_cond_wait(&qemu_pause_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_pause_cond);
         CPU_FOREACH(cpu) {
             qemu_cpu_kick(cpu);
         }
@@ -638,7 +683,7 @@ void qemu_init_vcpu(CPUState *cpu)
     cpus_accel->create_vcpu_thread(cpu);
 
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
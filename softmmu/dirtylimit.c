@@ -0,0 +1,469 @@
+/*
+ * Dirty page rate limit implementation code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qmp/qdict.h"
+#include "sysemu/dirtyrate.h"
+#include "sysemu/dirtylimit.h"
+#include "monitor/hmp.h"
+#include "monitor/monitor.h"
+#include "exec/memory.h"
+#include "exec/target_page.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
+#include "sysemu/kvm.h"
+#include "trace.h"
+
+/*
+ * Dirty page rates are measured over this period, and the throttle of
+ * the limited vCPUs is adjusted after each measure.
+ */
+#define DIRTYLIMIT_CALC_TIME_MS         1000
+
+/*
+ * Plus or minus this dirty page rate (MB/s) from the quota, the vCPU
+ * is considered limited and its throttle is not adjusted any more.
+ */
+#define DIRTYLIMIT_TOLERANCE_RANGE      25
+
+/*
+ * Further than this percentage from the quota, the throttle is adjusted
+ * in proportion to the distance, otherwise by small steps.
+ */
+#define DIRTYLIMIT_LINEAR_ADJUSTMENT_PCT    50
+
+/*
+ * Max percentage of the time a vCPU can spend sleeping in the throttle.
+ */
+#define DIRTYLIMIT_THROTTLE_PCT_MAX 99
+
+typedef struct VcpuDirtyLimitState {
+    int cpu_index;
+    bool enabled;
+    /* dirty page rate limit in MB/s */
+    uint64_t quota;
+    /* last dirty page rate measured, in MB/s */
+    uint64_t current;
+} VcpuDirtyLimitState;
+
+typedef struct DirtyLimitState {
+    /* protects the fields below */
+    QemuMutex lock;
+    VcpuDirtyLimitState *states;
+    /* max number of vCPUs of the machine */
+    int max_cpus;
+    /* number of vCPUs whose dirty page rate is limited */
+    int limited_nvcpu;
+    /* thread that measures the dirty page rates and adjusts the throttle */
+    QemuThread thread;
+    bool running;
+} DirtyLimitState;
+
+static DirtyLimitState *dirtylimit_state;
+
+static void dirtylimit_state_initialize(void)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    int max_cpus = ms->smp.max_cpus;
+    int i;
+
+    if (dirtylimit_state) {
+        return;
+    }
+
+    dirtylimit_state = g_new0(DirtyLimitState, 1);
+    qemu_mutex_init(&dirtylimit_state->lock);
+    dirtylimit_state->states = g_new0(VcpuDirtyLimitState, max_cpus);
+    for (i = 0; i < max_cpus; i++) {
+        dirtylimit_state->states[i].cpu_index = i;
+    }
+    dirtylimit_state->max_cpus = max_cpus;
+    trace_dirtylimit_state_initialize(max_cpus);
+}
+
+bool dirtylimit_in_service(void)
+{
+    return dirtylimit_state && qatomic_read(&dirtylimit_state->limited_nvcpu);
+}
+
+bool dirtylimit_vcpu_index_valid(int cpu_index)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+
+    return !(cpu_index < 0 || cpu_index >= ms->smp.max_cpus ||
+             !qemu_get_cpu(cpu_index));
+}
+
+/*
+ * Time it takes to fill a dirty ring at @dirtyrate MB/s, in microseconds.
+ */
+static int64_t dirtylimit_dirty_ring_full_time(uint64_t dirtyrate)
+{
+    uint64_t ring_bytes = (uint64_t)kvm_dirty_ring_size() *
+                          qemu_target_page_size();
+
+    return ring_bytes * 1000000 / (MAX(dirtyrate, 1) << 20);
+}
+
+static bool dirtylimit_done(uint64_t quota, uint64_t current)
+{
+    uint64_t min = MIN(quota, current);
+    uint64_t max = MAX(quota, current);
+
+    return (max - min) <= DIRTYLIMIT_TOLERANCE_RANGE;
+}
+
+static bool dirtylimit_need_linear_adjustment(uint64_t quota,
+                                              uint64_t current)
+{
+    uint64_t min = MIN(quota, current);
+    uint64_t max = MAX(quota, current);
+
+    return ((max - min) * 100 / max) > DIRTYLIMIT_LINEAR_ADJUSTMENT_PCT;
+}
+
+/*
+ * Adjust the time @cpu sleeps on a full dirty ring, so as to bring its
+ * dirty page rate from @current to @quota.  Sleeping for a fraction
+ * pct of the time, the vCPU dirties a full ring in
+ * ring_full_time / (1 - pct).
+ */
+static void dirtylimit_set_throttle(CPUState *cpu, uint64_t quota,
+                                    uint64_t current)
+{
+    int64_t throttle_us = qatomic_read(&cpu->throttle_us_per_full);
+    int64_t ring_full_time_us;
+    uint64_t sleep_pct;
+    int64_t step;
+
+    if (current == 0) {
+        qatomic_set(&cpu->throttle_us_per_full, 0);
+        return;
+    }
+
+    ring_full_time_us = dirtylimit_dirty_ring_full_time(current);
+
+    if (dirtylimit_need_linear_adjustment(quota, current)) {
+        sleep_pct = (MAX(quota, current) - MIN(quota, current)) * 100 /
+                    MAX(quota, current);
+        step = ring_full_time_us * sleep_pct / (100 - sleep_pct);
+    } else {
+        sleep_pct = 0;
+        step = ring_full_time_us / 10;
+    }
+
+    if (quota < current) {
+        throttle_us += step;
+    } else {
+        throttle_us -= step;
+    }
+
+    throttle_us = MIN(throttle_us,
+                      ring_full_time_us * DIRTYLIMIT_THROTTLE_PCT_MAX);
+    throttle_us = MAX(throttle_us, 0);
+    qatomic_set(&cpu->throttle_us_per_full, throttle_us);
+
+    trace_dirtylimit_set_throttle(cpu->cpu_index, sleep_pct, throttle_us);
+}
+
+static void dirtylimit_adjust_throttle(VcpuStat *stat)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&dirtylimit_state->lock);
+    WITH_RCU_READ_LOCK_GUARD() {
+        for (i = 0; i < stat->nvcpu; i++) {
+            int cpu_index = stat->rates[i].id;
+            VcpuDirtyLimitState *state;
+            CPUState *cpu = qemu_get_cpu(cpu_index);
+
+            if (cpu_index >= dirtylimit_state->max_cpus || !cpu) {
+                continue;
+            }
+            state = &dirtylimit_state->states[cpu_index];
+            state->current = stat->rates[i].dirty_rate;
+            if (!state->enabled ||
+                dirtylimit_done(state->quota, state->current)) {
+                continue;
+            }
+            dirtylimit_set_throttle(cpu, state->quota, state->current);
+        }
+    }
+}
+
+static void *dirtylimit_thread(void *opaque)
+{
+    VcpuStat stat;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIMIT);
+    qemu_mutex_unlock_iothread();
+
+    while (qatomic_read(&dirtylimit_state->running)) {
+        vcpu_calculate_dirtyrate(DIRTYLIMIT_CALC_TIME_MS, &stat,
+                                 GLOBAL_DIRTY_LIMIT, false);
+        dirtylimit_adjust_throttle(&stat);
+        g_free(stat.rates);
+    }
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_LIMIT);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called with dirtylimit_state->lock held */
+static void dirtylimit_start(void)
+{
+    if (dirtylimit_state->running) {
+        return;
+    }
+    dirtylimit_state->running = true;
+    qemu_thread_create(&dirtylimit_state->thread, "dirtylimit",
+                       dirtylimit_thread, NULL, QEMU_THREAD_JOINABLE);
+}
+
+/* Called with dirtylimit_state->lock held */
+static void dirtylimit_stop(void)
+{
+    bool iothread_locked = qemu_mutex_iothread_locked();
+    CPUState *cpu;
+
+    if (!dirtylimit_state->running) {
+        return;
+    }
+    qatomic_set(&dirtylimit_state->running, false);
+
+    /* the thread needs both locks to finish its last measure */
+    qemu_mutex_unlock(&dirtylimit_state->lock);
+    if (iothread_locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    qemu_thread_join(&dirtylimit_state->thread);
+    if (iothread_locked) {
+        qemu_mutex_lock_iothread();
+    }
+    qemu_mutex_lock(&dirtylimit_state->lock);
+
+    CPU_FOREACH(cpu) {
+        qatomic_set(&cpu->throttle_us_per_full, 0);
+    }
+}
+
+/* Called with dirtylimit_state->lock held */
+static void dirtylimit_set_vcpu_locked(int cpu_index, uint64_t quota,
+                                       bool enable)
+{
+    VcpuDirtyLimitState *state = &dirtylimit_state->states[cpu_index];
+    CPUState *cpu = qemu_get_cpu(cpu_index);
+
+    trace_dirtylimit_set_vcpu(cpu_index, enable ? quota : 0);
+
+    if (enable) {
+        if (!state->enabled) {
+            qatomic_inc(&dirtylimit_state->limited_nvcpu);
+        }
+        state->quota = quota;
+        state->enabled = true;
+    } else {
+        if (state->enabled) {
+            qatomic_dec(&dirtylimit_state->limited_nvcpu);
+        }
+        state->quota = 0;
+        state->enabled = false;
+        if (cpu) {
+            qatomic_set(&cpu->throttle_us_per_full, 0);
+        }
+    }
+}
+
+void dirtylimit_set_vcpu(int cpu_index, uint64_t quota, bool enable)
+{
+    dirtylimit_state_initialize();
+
+    QEMU_LOCK_GUARD(&dirtylimit_state->lock);
+    dirtylimit_set_vcpu_locked(cpu_index, quota, enable);
+    if (dirtylimit_state->limited_nvcpu) {
+        dirtylimit_start();
+    } else {
+        dirtylimit_stop();
+    }
+}
+
+void dirtylimit_set_all(uint64_t quota, bool enable)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    int i;
+
+    dirtylimit_state_initialize();
+
+    QEMU_LOCK_GUARD(&dirtylimit_state->lock);
+    for (i = 0; i < ms->smp.max_cpus; i++) {
+        if (dirtylimit_vcpu_index_valid(i)) {
+            dirtylimit_set_vcpu_locked(i, quota, enable);
+        }
+    }
+    if (dirtylimit_state->limited_nvcpu) {
+        dirtylimit_start();
+    } else {
+        dirtylimit_stop();
+    }
+}
+
+void dirtylimit_vcpu_execute(CPUState *cpu)
+{
+    int64_t sleep_us = qatomic_read(&cpu->throttle_us_per_full);
+
+    if (sleep_us) {
+        trace_dirtylimit_vcpu_execute(cpu->cpu_index, sleep_us);
+        g_usleep(sleep_us);
+    }
+}
+
+static bool dirtylimit_check(Error **errp)
+{
+    if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "dirty page limit requires KVM with the accelerator "
+                   "property 'dirty-ring-size' set");
+        return false;
+    }
+    return true;
+}
+
+void qmp_set_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                              uint64_t dirty_rate, Error **errp)
+{
+    if (!dirtylimit_check(errp)) {
+        return;
+    }
+
+    if (has_cpu_index && !dirtylimit_vcpu_index_valid(cpu_index)) {
+        error_setg(errp, "incorrect cpu index specified");
+        return;
+    }
+
+    if (!dirty_rate) {
+        qmp_cancel_vcpu_dirty_limit(has_cpu_index, cpu_index, errp);
+        return;
+    }
+
+    if (has_cpu_index) {
+        dirtylimit_set_vcpu(cpu_index, dirty_rate, true);
+    } else {
+        dirtylimit_set_all(dirty_rate, true);
+    }
+}
+
+void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                                 Error **errp)
+{
+    if (!dirtylimit_check(errp)) {
+        return;
+    }
+
+    if (has_cpu_index && !dirtylimit_vcpu_index_valid(cpu_index)) {
+        error_setg(errp, "incorrect cpu index specified");
+        return;
+    }
+
+    if (!dirtylimit_in_service()) {
+        return;
+    }
+
+    if (has_cpu_index) {
+        dirtylimit_set_vcpu(cpu_index, 0, false);
+    } else {
+        dirtylimit_set_all(0, false);
+    }
+}
+
+DirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    DirtyLimitInfoList *head = NULL, **tail = &head;
+    int i;
+
+    if (!dirtylimit_in_service()) {
+        return NULL;
+    }
+
+    QEMU_LOCK_GUARD(&dirtylimit_state->lock);
+    for (i = 0; i < dirtylimit_state->max_cpus; i++) {
+        VcpuDirtyLimitState *state = &dirtylimit_state->states[i];
+        DirtyLimitInfo *info;
+
+        if (!state->enabled) {
+            continue;
+        }
+        info = g_new0(DirtyLimitInfo, 1);
+        info->cpu_index = state->cpu_index;
+        info->limit_rate = state->quota;
+        info->current_rate = state->current;
+        QAPI_LIST_APPEND(tail, info);
+    }
+
+    return head;
+}
+
+void hmp_info_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    DirtyLimitInfoList *info, *limits;
+    Error *err = NULL;
+
+    if (!dirtylimit_check(&err)) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    limits = qmp_query_vcpu_dirty_limit(NULL);
+    if (!limits) {
+        monitor_printf(mon, "Dirty page limit not enabled!\n");
+        return;
+    }
+
+    for (info = limits; info; info = info->next) {
+        monitor_printf(mon, "vcpu[%"PRIi64"], limit rate %"PRIu64 " (MB/s),"
+                       " current rate %"PRIu64 " (MB/s)\n",
+                       info->value->cpu_index,
+                       info->value->limit_rate,
+                       info->value->current_rate);
+    }
+
+    qapi_free_DirtyLimitInfoList(limits);
+}
+
+void hmp_set_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    int64_t dirty_rate = qdict_get_int(qdict, "dirty_rate");
+    int64_t cpu_index = qdict_get_try_int(qdict, "cpu_index", -1);
+    Error *err = NULL;
+
+    if (dirty_rate < 0) {
+        monitor_printf(mon, "Incorrect dirty rate specified!\n");
+        return;
+    }
+
+    qmp_set_vcpu_dirty_limit(cpu_index != -1, cpu_index, dirty_rate, &err);
+    hmp_handle_error(mon, err);
+}
+
+void hmp_cancel_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    int64_t cpu_index = qdict_get_try_int(qdict, "cpu_index", -1);
+    Error *err = NULL;
+
+    qmp_cancel_vcpu_dirty_limit(cpu_index != -1, cpu_index, &err);
+    hmp_handle_error(mon, err);
+}
@@ -84,6 +84,12 @@
  */
 RAMList ram_list = { .blocks = QLIST_HEAD_INITIALIZER(ram_list.blocks) };
 
+/*
+ * Pages reported dirty by the accelerator's dirty log while the dirty
+ * rate is being measured with GLOBAL_DIRTY_DIRTY_RATE.
+ */
+uint64_t total_dirty_pages;
+
 static MemoryRegion *system_memory;
 static MemoryRegion *system_io;
 
@@ -126,6 +132,8 @@ typedef struct PhysPageMap {
 
 struct AddressSpaceDispatch {
     MemoryRegionSection *mru_section;
+    /* Tags the entries of the vCPU dispatch caches, never 0 */
+    uint64_t generation;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -329,6 +337,50 @@ static MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr addr)
     }
 }
 
+/*
+ * Look up the page of @addr in the dispatch cache of the current vCPU
+ * before walking the map.  The map has page granularity, so the section
+ * found for a page covers it all.
+ *
+ * Called from RCU critical section
+ */
+static MemoryRegionSection *dispatch_cache_find(AddressSpaceDispatch *d,
+                                                hwaddr addr)
+{
+    CPUState *cpu = current_cpu;
+    hwaddr page = addr >> TARGET_PAGE_BITS;
+    CPUDispatchCacheEntry *set, entry;
+    int i;
+
+    if (!cpu) {
+        return phys_page_find(d, addr);
+    }
+
+    set = cpu->dispatch_cache[(page ^ d->generation) %
+                              CPU_DISPATCH_CACHE_SETS];
+    for (i = 0; i < CPU_DISPATCH_CACHE_WAYS; i++) {
+        if (set[i].generation == d->generation && set[i].page == page) {
+            cpu->dispatch_cache_hits++;
+            entry = set[i];
+            break;
+        }
+    }
+    if (i == CPU_DISPATCH_CACHE_WAYS) {
+        cpu->dispatch_cache_misses++;
+        entry = (CPUDispatchCacheEntry) {
+            .generation = d->generation,
+            .page = page,
+            .section = phys_page_find(d, addr),
+        };
+        i--;
+    }
+
+    /* Keep the ways in LRU order, evicting the last one */
+    memmove(&set[1], &set[0], i * sizeof(*set));
+    set[0] = entry;
+    return entry.section;
+}
+
 /* Called from RCU critical section */
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
@@ -339,7 +391,7 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
 
     if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
         !section_covers_addr(section, addr)) {
-        section = phys_page_find(d, addr);
+        section = dispatch_cache_find(d, addr);
         qatomic_set(&d->mru_section, section);
     }
     if (resolve_subpage && section->mr->subpage) {
@@ -960,6 +1012,91 @@ void cpu_check_watchpoint(CPUState *cpu, vaddr addr, vaddr len,
 
 #endif /* CONFIG_TCG */
 
+struct RAMBlockIndex {
+    struct rcu_head rcu;
+    /* The blocks that have a name, by name */
+    GHashTable *by_name;
+    /* All the blocks, sorted by offset */
+    unsigned int nr_blocks;
+    RAMBlock *by_offset[];
+};
+
+static int ram_block_cmp_offset(const void *a, const void *b)
+{
+    const RAMBlock *block_a = *(RAMBlock * const *)a;
+    const RAMBlock *block_b = *(RAMBlock * const *)b;
+
+    return block_a->offset < block_b->offset ? -1 :
+           block_a->offset > block_b->offset;
+}
+
+static void ram_block_index_free(RAMBlockIndex *index)
+{
+    g_hash_table_destroy(index->by_name);
+    g_free(index);
+}
+
+/* Called with the ramlist lock held */
+static void ram_block_index_update(void)
+{
+    RAMBlockIndex *old = ram_list.index;
+    RAMBlockIndex *index;
+    RAMBlock *block;
+    unsigned int n = 0;
+
+    RAMBLOCK_FOREACH(block) {
+        n++;
+    }
+
+    index = g_malloc(sizeof(*index) + n * sizeof(index->by_offset[0]));
+    index->by_name = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    index->nr_blocks = n;
+    n = 0;
+    RAMBLOCK_FOREACH(block) {
+        index->by_offset[n++] = block;
+        if (block->idstr[0]) {
+            g_hash_table_insert(index->by_name, g_strdup(block->idstr), block);
+        }
+    }
+    qsort(index->by_offset, n, sizeof(index->by_offset[0]),
+          ram_block_cmp_offset);
+
+    qatomic_rcu_set(&ram_list.index, index);
+    if (old) {
+        call_rcu(old, ram_block_index_free, rcu);
+    }
+}
+
+/* Called from RCU critical section */
+static RAMBlock *ram_block_index_lookup_offset(ram_addr_t addr)
+{
+    RAMBlockIndex *index = qatomic_rcu_read(&ram_list.index);
+    unsigned int lo = 0, hi;
+    RAMBlock *block;
+
+    if (!index) {
+        return NULL;
+    }
+
+    /* Find the last block that starts at or before @addr */
+    hi = index->nr_blocks;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (index->by_offset[mid]->offset <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!lo) {
+        return NULL;
+    }
+    block = index->by_offset[lo - 1];
+    return addr - block->offset < block->max_length ? block : NULL;
+}
+
 /* Called from RCU critical section */
 static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
 {
@@ -969,10 +1106,9 @@ static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
     if (block && addr - block->offset < block->max_length) {
         return block;
     }
-    RAMBLOCK_FOREACH(block) {
-        if (addr - block->offset < block->max_length) {
-            goto found;
-        }
+    block = ram_block_index_lookup_offset(addr);
+    if (block) {
+        goto found;
     }
 
     fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
@@ -1600,6 +1736,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     block->fd = fd;
+    block->fd_offset = offset;
     return area;
 }
 #endif
@@ -1751,8 +1888,6 @@ void qemu_ram_unset_migratable(RAMBlock *rb)
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
 {
-    RAMBlock *block;
-
     assert(new_block);
     assert(!new_block->idstr[0]);
 
@@ -1765,15 +1900,14 @@ void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
     }
     pstrcat(new_block->idstr, sizeof(new_block->idstr), name);
 
-    RCU_READ_LOCK_GUARD();
-    RAMBLOCK_FOREACH(block) {
-        if (block != new_block &&
-            !strcmp(block->idstr, new_block->idstr)) {
-            fprintf(stderr, "RAMBlock \"%s\" already registered, abort!\n",
-                    new_block->idstr);
-            abort();
-        }
+    qemu_mutex_lock_ramlist();
+    if (g_hash_table_contains(ram_list.index->by_name, new_block->idstr)) {
+        fprintf(stderr, "RAMBlock \"%s\" already registered, abort!\n",
+                new_block->idstr);
+        abort();
     }
+    ram_block_index_update();
+    qemu_mutex_unlock_ramlist();
 }
 
 /* Called with iothread lock held.  */
@@ -1784,7 +1918,10 @@ void qemu_ram_unset_idstr(RAMBlock *block)
      * does not work anyway.
      */
     if (block) {
+        qemu_mutex_lock_ramlist();
         memset(block->idstr, 0, sizeof(block->idstr));
+        ram_block_index_update();
+        qemu_mutex_unlock_ramlist();
     }
 }
 
@@ -2015,6 +2152,7 @@ static void ram_block_add(RAMBlock *new_block, Error **errp)
         QLIST_INSERT_HEAD_RCU(&ram_list.blocks, new_block, next);
     }
     ram_list.mru_block = NULL;
+    ram_block_index_update();
 
     /* Write list before version */
     smp_wmb();
@@ -2224,6 +2362,7 @@ void qemu_ram_free(RAMBlock *block)
     qemu_mutex_lock_ramlist();
     QLIST_REMOVE_RCU(block, next);
     ram_list.mru_block = NULL;
+    ram_block_index_update();
     /* Write list before version */
     smp_wmb();
     ram_list.version++;
@@ -2272,6 +2411,55 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+int qemu_ram_adopt_fd(RAMBlock *rb, int fd, off_t offset, Error **errp)
+{
+    struct stat st;
+    void *area;
+    int flags = MAP_SHARED | MAP_FIXED;
+
+    if (rb->fd < 0 || !(rb->flags & RAM_SHARED) ||
+        (rb->flags & RAM_PREALLOC) || xen_enabled()) {
+        error_setg(errp, "RAM block %s is not backed by a shared file",
+                   rb->idstr);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Can't stat the memory of %s",
+                         rb->idstr);
+        return -1;
+    }
+    if (qemu_fd_getpagesize(fd) != rb->page_size ||
+        st.st_size < offset + rb->max_length) {
+        error_setg(errp, "The memory passed for %s doesn't match its size "
+                   "or page size", rb->idstr);
+        return -1;
+    }
+
+    /* Nothing else maps the block yet: the guest hasn't started */
+    flags |= rb->flags & RAM_NORESERVE ? MAP_NORESERVE : 0;
+    area = mmap(rb->host, rb->max_length, PROT_READ | PROT_WRITE, flags,
+                fd, offset);
+    if (area != rb->host) {
+        /* MAP_FIXED failing leaves the range unmapped */
+        error_report("Could not map the memory passed for %s: %s",
+                     rb->idstr, strerror(errno));
+        exit(1);
+    }
+    memory_try_enable_merging(rb->host, rb->max_length);
+    qemu_ram_setup_dump(rb->host, rb->max_length);
+
+    close(rb->fd);
+    rb->fd = fd;
+    rb->fd_offset = offset;
+    return 0;
+}
+#else
+int qemu_ram_adopt_fd(RAMBlock *rb, int fd, off_t offset, Error **errp)
+{
+    error_setg(errp, "Passing RAM is not supported on this host");
+    return -1;
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -2417,15 +2605,9 @@ found:
  */
 RAMBlock *qemu_ram_block_by_name(const char *name)
 {
-    RAMBlock *block;
-
-    RAMBLOCK_FOREACH(block) {
-        if (!strcmp(name, block->idstr)) {
-            return block;
-        }
-    }
+    RAMBlockIndex *index = qatomic_rcu_read(&ram_list.index);
 
-    return NULL;
+    return index ? g_hash_table_lookup(index->by_name, name) : NULL;
 }
 
 /* Some of the softmmu routines need to translate from a host pointer
@@ -2581,9 +2763,13 @@ static void io_mem_init(void)
 
 AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv)
 {
+    /* FlatViews are only generated under the BQL */
+    static uint64_t dispatch_generation;
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
+    d->generation = ++dispatch_generation;
+
     n = dummy_section(&d->map, fv, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
 
@@ -2744,7 +2930,7 @@ static bool prepare_mmio_access(MemoryRegion *mr)
 {
     bool release_lock = false;
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         release_lock = true;
     }
@@ -3002,53 +3188,55 @@ void cpu_flush_icache_range(hwaddr start, hwaddr len)
                                      NULL, len, FLUSH_CACHE);
 }
 
+#define BOUNCE_BUFFER_MAGIC 0xb4017ceb4ffe12edULL
+
+/*
+ * A bounce buffer is allocated by address_space_map() for memory that is
+ * not directly accessible.  Several may be in use at once, as long as
+ * their total size stays below the limit of the AddressSpace.
+ */
 typedef struct {
+    uint64_t magic;
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
-    hwaddr len;
-    bool in_use;
+    size_t len;
+    uint8_t buffer[];
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
-typedef struct MapClient {
-    QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
-
-static void cpu_unregister_map_client_do(MapClient *client)
+static void
+address_space_unregister_map_client_do(AddressSpaceMapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!qatomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    /*
+     * Write map_client_list before reading bounce_buffer_size, because
+     * address_space_unmap() does it the other way around.
+     */
+    smp_mb();
+    if (qatomic_read(&as->bounce_buffer_size) < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -3064,28 +3252,27 @@ void cpu_exec_init_all(void)
     finalize_target_page_bits();
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->map_client_list_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
-static void cpu_notify_map_clients(void)
+static void address_space_notify_map_clients(AddressSpace *as)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 static bool flatview_access_valid(FlatView *fv, hwaddr addr, hwaddr len,
@@ -3154,8 +3341,8 @@ flatview_extend_translation(FlatView *fv, hwaddr addr,
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -3179,25 +3366,42 @@ void *address_space_map(AddressSpace *as,
     mr = flatview_translate(fv, addr, &xlat, &l, is_write, attrs);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (qatomic_xchg(&bounce.in_use, true)) {
+        size_t used = qatomic_read(&as->bounce_buffer_size);
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations: take what is left below the limit */
+        for (;;) {
+            size_t left = used < as->max_bounce_buffer_size ?
+                          as->max_bounce_buffer_size - used : 0;
+            hwaddr alloc = MIN(left, l);
+            size_t actual = qatomic_cmpxchg(&as->bounce_buffer_size, used,
+                                            used + alloc);
+            if (actual == used) {
+                l = alloc;
+                break;
+            }
+            used = actual;
+        }
+
+        if (l == 0) {
             *plen = 0;
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
 
+        bounce = g_malloc0(l + sizeof(BounceBuffer));
+        bounce->magic = BOUNCE_BUFFER_MAGIC;
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
+        bounce->addr = addr;
+        bounce->len = l;
+
         if (!is_write) {
             flatview_read(fv, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                          bounce->buffer, l);
         }
 
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
 
@@ -3217,12 +3421,12 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          bool is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
-        MemoryRegion *mr;
-        ram_addr_t addr1;
+    MemoryRegion *mr;
+    ram_addr_t addr1;
+    BounceBuffer *bounce;
 
-        mr = memory_region_from_host(buffer, &addr1);
-        assert(mr != NULL);
+    mr = memory_region_from_host(buffer, &addr1);
+    if (mr != NULL) {
         if (is_write) {
             invalidate_and_set_dirty(mr, addr1, access_len);
         }
@@ -3232,15 +3436,22 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         memory_region_unref(mr);
         return;
     }
+
+    bounce = container_of(buffer, BounceBuffer, buffer);
+    assert(bounce->magic == BOUNCE_BUFFER_MAGIC);
+
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    qatomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+
+    qatomic_sub(&as->bounce_buffer_size, bounce->len);
+    bounce->magic = ~BOUNCE_BUFFER_MAGIC;
+    memory_region_unref(bounce->mr);
+    g_free(bounce);
+    /* Write bounce_buffer_size before reading map_client_list. */
+    smp_mb();
+    address_space_notify_map_clients(as);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -3628,9 +3839,18 @@ static void mtree_print_phys_entries(int start, int end, int skip, int ptr)
 
 void mtree_print_dispatch(AddressSpaceDispatch *d, MemoryRegion *root)
 {
+    uint64_t hits = 0, misses = 0;
+    CPUState *cpu;
     int i;
 
+    CPU_FOREACH(cpu) {
+        hits += cpu->dispatch_cache_hits;
+        misses += cpu->dispatch_cache_misses;
+    }
+
     qemu_printf("  Dispatch\n");
+    qemu_printf("    vCPU lookup cache (all address spaces): %" PRIu64
+                " hits, %" PRIu64 " misses\n", hits, misses);
     qemu_printf("    Physical sections\n");
 
     for (i = 0; i < d->map.sections_nb; ++i) {
@@ -1112,9 +1112,9 @@ static inline bool nonempty_str(const char *str)
 
 static int parse_fw_cfg(void *opaque, QemuOpts *opts, Error **errp)
 {
-    gchar *buf;
     size_t size;
     const char *name, *file, *str, *gen_id;
+    bool ok = true;
     FWCfgState *fw_cfg = (FWCfgState *) opaque;
 
     if (fw_cfg == NULL) {
@@ -1148,27 +1148,23 @@ static int parse_fw_cfg(void *opaque, QemuOpts *opts, Error **errp)
         warn_report("externally provided fw_cfg item names "
                     "should be prefixed with \"opt/\"");
     }
-    if (nonempty_str(str)) {
-        size = strlen(str); /* NUL terminator NOT included in fw_cfg blob */
-        buf = g_memdup(str, size);
-    } else if (nonempty_str(gen_id)) {
+    if (nonempty_str(gen_id)) {
         if (!fw_cfg_add_from_generator(fw_cfg, name, gen_id, errp)) {
             return -1;
         }
         return 0;
-    } else {
-        GError *err = NULL;
-        if (!g_file_get_contents(file, &buf, &size, &err)) {
-            error_setg(errp, "can't load %s: %s", file, err->message);
-            g_error_free(err);
-            return -1;
-        }
     }
     /* For legacy, keep user files in a specific global order. */
     fw_cfg_set_order_override(fw_cfg, FW_CFG_ORDER_OVERRIDE_USER);
-    fw_cfg_add_file(fw_cfg, name, buf, size);
+    if (nonempty_str(str)) {
+        size = strlen(str); /* NUL terminator NOT included in fw_cfg blob */
+        fw_cfg_add_file(fw_cfg, name, g_memdup(str, size), size);
+    } else {
+        /* The file is mapped, so that large ones cost nothing until read */
+        ok = fw_cfg_add_file_from_host(fw_cfg, name, file, errp);
+    }
     fw_cfg_reset_order_override(fw_cfg);
-    return 0;
+    return ok ? 0 : -1;
 }
 
 static int device_help_func(void *opaque, QemuOpts *opts, Error **errp)
@@ -1963,6 +1959,15 @@ static void qemu_create_late_backends(void)
     /* now chardevs have been created we may have semihosting to connect */
     qemu_semihosting_connect_chardevs();
     qemu_semihosting_console_init();
+
+    /*
+     * The memory backends preallocate in the background, wait for all
+     * of them at once.
+     */
+    if (!os_mem_prealloc_finish(&error_fatal)) {
+        exit(1);
+    }
+    phase_advance(PHASE_LATE_BACKENDS_CREATED);
 }
 
 static bool have_custom_ram_size(void)
@@ -140,6 +140,7 @@ vu_request_to_string(unsigned int req)
         REQ(VHOST_USER_GET_MAX_MEM_SLOTS),
         REQ(VHOST_USER_ADD_MEM_REG),
         REQ(VHOST_USER_REM_MEM_REG),
+        REQ(VHOST_USER_SET_LOG_RING),
         REQ(VHOST_USER_MAX),
     };
 #undef REQ
@@ -444,11 +445,45 @@ vu_log_kick(VuDev *dev)
     }
 }
 
+static bool
+vu_log_ring_push(VuLogRing *ring, uint64_t page)
+{
+    uint64_t head, old;
+
+    do {
+        head = qatomic_read__nocheck(&ring->head);
+        if (head - qatomic_read__nocheck(&ring->tail) >= ring->size) {
+            return false;
+        }
+        old = qatomic_cmpxchg__nocheck(&ring->head, head, head + 1);
+    } while (old != head);
+
+    qatomic_set__nocheck(&ring->entries[head & (ring->size - 1)],
+                         page * VHOST_LOG_PAGE | VU_LOG_RING_VALID);
+    return true;
+}
+
 static void
-vu_log_page(uint8_t *log_table, uint64_t page)
+vu_log_page(VuDev *dev, uint64_t page)
 {
+    uint8_t bit = 1 << (page % 8);
+
     DPRINT("Logged dirty guest page: %"PRId64"\n", page);
-    qatomic_or(&log_table[page / 8], 1 << (page % 8));
+    if (!dev->log_ring) {
+        qatomic_or(&dev->log_table[page / 8], bit);
+        return;
+    }
+
+    /*
+     * The bit stays set until the master reaps the page, so it is only
+     * pushed once.  If the ring is full, the bit alone is enough.
+     */
+    if (qatomic_fetch_or(&dev->log_table[page / 8], bit) & bit) {
+        return;
+    }
+    if (!vu_log_ring_push(dev->log_ring, page)) {
+        qatomic_or(&dev->log_ring->flags, VU_LOG_RING_F_OVERFLOW);
+    }
 }
 
 static void
@@ -465,7 +500,7 @@ vu_log_write(VuDev *dev, uint64_t address, uint64_t length)
 
     page = address / VHOST_LOG_PAGE;
     while (page * VHOST_LOG_PAGE < address + length) {
-        vu_log_page(dev->log_table, page);
+        vu_log_page(dev, page);
         page += 1;
     }
 
@@ -568,6 +603,13 @@ vu_set_owner_exec(VuDev *dev, VhostUserMsg *vmsg)
 static void
 vu_close_log(VuDev *dev)
 {
+    if (dev->log_ring) {
+        if (munmap(dev->log_ring, dev->log_ring_size) != 0) {
+            perror("close log ring munmap() error");
+        }
+
+        dev->log_ring = NULL;
+    }
     if (dev->log_table) {
         if (munmap(dev->log_table, dev->log_size) != 0) {
             perror("close log munmap() error");
@@ -1027,6 +1069,44 @@ vu_set_log_base_exec(VuDev *dev, VhostUserMsg *vmsg)
     return true;
 }
 
+static bool
+vu_set_log_ring_exec(VuDev *dev, VhostUserMsg *vmsg)
+{
+    uint64_t mmap_size = vmsg->payload.log.mmap_size;
+    VuLogRing *ring;
+
+    if (vmsg->fd_num != 1 ||
+        vmsg->size != sizeof(vmsg->payload.log)) {
+        vu_panic(dev, "Invalid log_ring message");
+        return false;
+    }
+
+    ring = mmap(0, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                vmsg->fds[0], vmsg->payload.log.mmap_offset);
+    close(vmsg->fds[0]);
+    if (ring == MAP_FAILED) {
+        perror("log ring mmap error");
+        vmsg_set_reply_u64(vmsg, 1);
+        return true;
+    }
+    if (mmap_size < sizeof(*ring) ||
+        !ring->size || (ring->size & (ring->size - 1)) ||
+        (mmap_size - sizeof(*ring)) / sizeof(ring->entries[0]) < ring->size) {
+        munmap(ring, mmap_size);
+        vu_panic(dev, "Invalid log ring");
+        return false;
+    }
+    DPRINT("Log ring size: %"PRIu32"\n", ring->size);
+
+    if (dev->log_ring) {
+        munmap(dev->log_ring, dev->log_ring_size);
+    }
+    dev->log_ring = ring;
+    dev->log_ring_size = mmap_size;
+
+    return false;
+}
+
 static bool
 vu_set_log_fd_exec(VuDev *dev, VhostUserMsg *vmsg)
 {
@@ -1413,7 +1493,8 @@ vu_get_protocol_features_exec(VuDev *dev, VhostUserMsg *vmsg)
                         1ULL << VHOST_USER_PROTOCOL_F_HOST_NOTIFIER |
                         1ULL << VHOST_USER_PROTOCOL_F_SLAVE_SEND_FD |
                         1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK |
-                        1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS;
+                        1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS |
+                        1ULL << VHOST_USER_PROTOCOL_F_LOG_RING;
 
     if (have_userfault()) {
         features |= 1ULL << VHOST_USER_PROTOCOL_F_PAGEFAULT;
@@ -1846,6 +1927,8 @@ vu_process_message(VuDev *dev, VhostUserMsg *vmsg)
         return vu_set_log_base_exec(dev, vmsg);
     case VHOST_USER_SET_LOG_FD:
         return vu_set_log_fd_exec(dev, vmsg);
+    case VHOST_USER_SET_LOG_RING:
+        return vu_set_log_ring_exec(dev, vmsg);
     case VHOST_USER_SET_VRING_NUM:
         return vu_set_vring_num_exec(dev, vmsg);
     case VHOST_USER_SET_VRING_ADDR:
@@ -64,6 +64,7 @@ enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD = 12,
     VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS = 14,
     VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS = 15,
+    VHOST_USER_PROTOCOL_F_LOG_RING = 17,
 
     VHOST_USER_PROTOCOL_F_MAX
 };
@@ -109,6 +110,7 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_MAX_MEM_SLOTS = 36,
     VHOST_USER_ADD_MEM_REG = 37,
     VHOST_USER_REM_MEM_REG = 38,
+    VHOST_USER_SET_LOG_RING = 41,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -369,6 +371,19 @@ typedef void (*vu_set_watch_cb) (VuDev *dev, int fd, int condition,
                                  vu_watch_cb cb, void *data);
 typedef void (*vu_remove_watch_cb) (VuDev *dev, int fd);
 
+/* Ring of dirty pages, see VHOST_USER_SET_LOG_RING */
+typedef struct VuLogRing {
+    uint64_t head;
+    uint64_t tail;
+    uint32_t size;
+    uint32_t flags;
+    uint64_t padding[5];
+    uint64_t entries[];
+} VuLogRing;
+
+#define VU_LOG_RING_F_OVERFLOW  (1 << 0)
+#define VU_LOG_RING_VALID       1ULL
+
 typedef struct VuDevInflightInfo {
     int fd;
     void *addr;
@@ -387,6 +402,8 @@ struct VuDev {
     int slave_fd;
     uint64_t log_size;
     uint8_t *log_table;
+    uint64_t log_ring_size;
+    VuLogRing *log_ring;
     uint64_t features;
     uint64_t protocol_features;
     bool broken;
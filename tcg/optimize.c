@@ -600,6 +600,24 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+/*
+ * The only predecessor of the code after a conditional branch is the
+ * code before it, so what we know about the temps still holds there,
+ * and the optimization goes on through the extended basic block.  Only
+ * labels and unconditional branches end it.  The exception is normal
+ * temps, which are dead at the end of each basic block.
+ */
+static void finish_cond_branch(TCGContext *s, TCGTempSet *temps_used)
+{
+    int i;
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (s->temps[i].kind == TEMP_NORMAL && test_bit(i, temps_used->l)) {
+            reset_ts(&s->temps[i]);
+        }
+    }
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
@@ -1400,7 +1418,7 @@ void tcg_optimize(TCGContext *s)
                 /* Simplify LT/GE comparisons vs zero to a single compare
                    vs the high word of the input.  */
             do_brcond_high:
-                memset(&temps_used, 0, sizeof(temps_used));
+                finish_cond_branch(s, &temps_used);
                 op->opc = INDEX_op_brcond_i32;
                 op->args[0] = op->args[1];
                 op->args[1] = op->args[3];
@@ -1426,7 +1444,7 @@ void tcg_optimize(TCGContext *s)
                     goto do_default;
                 }
             do_brcond_low:
-                memset(&temps_used, 0, sizeof(temps_used));
+                finish_cond_branch(s, &temps_used);
                 op->opc = INDEX_op_brcond_i32;
                 op->args[1] = op->args[2];
                 op->args[2] = op->args[4];
@@ -1542,10 +1560,13 @@ void tcg_optimize(TCGContext *s)
         do_default:
             /* Default case: we know nothing about operation (or were unable
                to compute the operation result) so no propagation is done.
-               We trash everything if the operation is the end of a basic
-               block, otherwise we only trash the output args.  "mask" is
-               the non-zero bits mask for the first output arg.  */
-            if (def->flags & TCG_OPF_BB_END) {
+               We trash everything if the operation is the end of an
+               extended basic block, otherwise we only trash the output
+               args.  "mask" is the non-zero bits mask for the first
+               output arg.  */
+            if (def->flags & TCG_OPF_COND_BRANCH) {
+                finish_cond_branch(s, &temps_used);
+            } else if (def->flags & TCG_OPF_BB_END) {
                 memset(&temps_used, 0, sizeof(temps_used));
             } else {
         do_reset_output:
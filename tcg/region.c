@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "qemu/units.h"
 #include "qapi/error.h"
+#include "qemu/rcu.h"
 #include "exec/exec-all.h"
 #include "tcg/tcg.h"
 #include "tcg-internal.h"
@@ -277,6 +278,7 @@ size_t tcg_nb_tbs(void)
     return nb_tbs;
 }
 
+#ifdef CONFIG_TSAN
 static gboolean tcg_region_tree_traverse(gpointer k, gpointer v, gpointer data)
 {
     TranslationBlock *tb = v;
@@ -284,21 +286,53 @@ static gboolean tcg_region_tree_traverse(gpointer k, gpointer v, gpointer data)
     tb_destroy(tb);
     return FALSE;
 }
+#endif
+
+/* The trees of a flushed code buffer, waiting to be freed */
+struct tcg_region_trees_old {
+    struct rcu_head rcu;
+    size_t n;
+    GTree *trees[];
+};
+
+static void tcg_region_trees_free(struct tcg_region_trees_old *old)
+{
+    size_t i;
+
+    for (i = 0; i < old->n; i++) {
+        g_tree_destroy(old->trees[i]);
+    }
+    g_free(old);
+}
 
 static void tcg_region_tree_reset_all(void)
 {
+    struct tcg_region_trees_old *old;
     size_t i;
 
+    old = g_malloc(sizeof(*old) + region.n * sizeof(old->trees[0]));
+    old->n = region.n;
+
     tcg_region_tree_lock_all();
     for (i = 0; i < region.n; i++) {
         struct tcg_region_tree *rt = region_trees + i * tree_size;
 
+#ifdef CONFIG_TSAN
+        /* tb_destroy() only tells TSan that the jmp_lock is gone */
         g_tree_foreach(rt->tree, tcg_region_tree_traverse, NULL);
-        /* Increment the refcount first so that destroy acts as a reset */
-        g_tree_ref(rt->tree);
-        g_tree_destroy(rt->tree);
+#endif
+        old->trees[i] = rt->tree;
+        rt->tree = g_tree_new(tb_tc_cmp);
     }
     tcg_region_tree_unlock_all();
+
+    /*
+     * Freeing one node per TB takes most of the time of a flush, and all
+     * vCPUs wait for it.  Nobody looks into the old trees anymore, and
+     * their keys are never dereferenced again, so leave them to the RCU
+     * thread.
+     */
+    call_rcu(old, tcg_region_trees_free, rcu);
 }
 
 static void tcg_region_bounds(size_t curr_region, void **pstart, void **pend)
@@ -0,0 +1,67 @@
+/*
+ * buffer_is_zero() speed benchmark
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/cutils.h"
+
+#define ZERO_PAGE_SIZE 4096
+
+/*
+ * Offset of the only non-zero byte in the page, or -1 for a zero page.
+ * Migration checks every page it sends: a zero page is read whole, and
+ * a page with data is usually told apart in its first bytes.
+ */
+static const int nonzero_at[] = { -1, ZERO_PAGE_SIZE - 1, 2048, 256, 8, 0 };
+
+/*
+ * Switching implementation only goes one way, so run every case for
+ * an implementation before moving to the next one.
+ */
+static void test_speed(void)
+{
+    uint8_t *page = qemu_memalign(ZERO_PAGE_SIZE, ZERO_PAGE_SIZE);
+    const size_t total = 4 * GiB;
+    int accel = 0;
+    size_t remain;
+    bool zero = false;
+    int i;
+
+    /* accel 0 is the fastest one the host has, the last one is generic */
+    do {
+        for (i = 0; i < ARRAY_SIZE(nonzero_at); i++) {
+            memset(page, 0, ZERO_PAGE_SIZE);
+            if (nonzero_at[i] >= 0) {
+                page[nonzero_at[i]] = 1;
+            }
+
+            g_test_timer_start();
+            for (remain = total; remain; remain -= ZERO_PAGE_SIZE) {
+                zero = buffer_is_zero(page, ZERO_PAGE_SIZE);
+            }
+            g_test_timer_elapsed();
+            g_assert(zero == (nonzero_at[i] < 0));
+
+            g_test_message("buffer_is_zero: accel %d non-zero byte at %d "
+                           "%.2f MB/sec", accel, nonzero_at[i],
+                           total / MiB / g_test_timer_last());
+        }
+        accel++;
+    } while (test_buffer_is_zero_next_accel());
+
+    qemu_vfree(page);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/buffer-is-zero/benchmark", test_speed);
+
+    return g_test_run();
+}
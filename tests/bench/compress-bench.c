@@ -0,0 +1,120 @@
+/*
+ * Migration page compression speed benchmark
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "../migration/ram-compress.h"
+
+#define COMPRESS_PAGE_SIZE 4096
+/* Default of the compress-level parameter */
+#define COMPRESS_LEVEL 1
+
+typedef struct CompressOpts {
+    CompressMethod method;
+    const char *name;
+    /* bits of entropy of each byte of the pages */
+    int entropy;
+} CompressOpts;
+
+static const char *method_names[] = {
+    [COMPRESS_METHOD_ZLIB] = "zlib",
+#ifdef CONFIG_ZSTD
+    [COMPRESS_METHOD_ZSTD] = "zstd",
+#endif
+#ifdef CONFIG_LZ4
+    [COMPRESS_METHOD_LZ4] = "lz4",
+#endif
+};
+
+static const int entropies[] = { 0, 1, 2, 4, 6, 8 };
+
+static void fill_page(int entropy, uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < COMPRESS_PAGE_SIZE; i++) {
+        page[i] = entropy ? g_test_rand_int_range(0, 1 << entropy) : 0;
+    }
+}
+
+static void test_compress_speed(const void *opaque)
+{
+    const CompressOpts *o = opaque;
+    const RAMCompressMethods *ops = ram_compress_get_ops(o->method);
+    size_t bound = ops->bound(COMPRESS_PAGE_SIZE);
+    uint8_t *page = g_malloc(COMPRESS_PAGE_SIZE);
+    uint8_t *out = g_malloc(COMPRESS_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(bound);
+    const size_t total = 1 * GiB;
+    void *cstate, *dstate;
+    double compress_time;
+    size_t remain;
+    int clen = 0;
+
+    g_assert(ops->compress_setup(&cstate, COMPRESS_LEVEL, &error_abort) == 0);
+    g_assert(ops->decompress_setup(&dstate, &error_abort) == 0);
+    fill_page(o->entropy, page);
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= COMPRESS_PAGE_SIZE) {
+        clen = ops->compress(cstate, compressed, bound, page,
+                             COMPRESS_PAGE_SIZE);
+    }
+    compress_time = g_test_timer_elapsed();
+    g_assert(clen > 0);
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= COMPRESS_PAGE_SIZE) {
+        g_assert(ops->decompress(dstate, out, COMPRESS_PAGE_SIZE, compressed,
+                                 clen) == COMPRESS_PAGE_SIZE);
+    }
+    g_test_timer_elapsed();
+    g_assert(memcmp(page, out, COMPRESS_PAGE_SIZE) == 0);
+
+    g_test_message("%s: entropy %d bits/byte compressed to %d bytes, "
+                   "compress %.2f MB/sec decompress %.2f MB/sec",
+                   o->name, o->entropy, clen, total / MiB / compress_time,
+                   total / MiB / g_test_timer_last());
+
+    ops->compress_cleanup(cstate);
+    ops->decompress_cleanup(dstate);
+    g_free(page);
+    g_free(out);
+    g_free(compressed);
+}
+
+int main(int argc, char **argv)
+{
+    CompressOpts *opts;
+    char name[64];
+    int i, j;
+
+    g_test_init(&argc, &argv, NULL);
+    module_call_init(MODULE_INIT_MIGRATION);
+
+    for (i = 0; i < ARRAY_SIZE(method_names); i++) {
+        if (!method_names[i]) {
+            continue;
+        }
+        for (j = 0; j < ARRAY_SIZE(entropies); j++) {
+            opts = g_new0(CompressOpts, 1);
+            opts->method = i;
+            opts->name = method_names[i];
+            opts->entropy = entropies[j];
+            snprintf(name, sizeof(name),
+                     "/compress/benchmark/%s/entropy-%d",
+                     opts->name, opts->entropy);
+            g_test_add_data_func_full(name, opts, test_compress_speed,
+                                      g_free);
+        }
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,147 @@
+/*
+ * Migration dirty bitmap speed benchmark
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/bitmap.h"
+#include "qemu/bitops.h"
+#include "qemu/atomic.h"
+
+/* 16 GiB of guest RAM in 4 KiB pages */
+#define DIRTY_PAGES (4 * MiB)
+
+typedef struct DirtyOpts {
+    /* one in @sparse runs of pages is dirty */
+    int sparse;
+    /* number of dirty pages in a row */
+    int run_len;
+} DirtyOpts;
+
+static const DirtyOpts opts[] = {
+    { .sparse = 100000, .run_len = 1 },
+    { .sparse = 1000, .run_len = 1 },
+    { .sparse = 100, .run_len = 1 },
+    { .sparse = 10, .run_len = 1 },
+    { .sparse = 100, .run_len = 64 },
+    { .sparse = 10, .run_len = 64 },
+    { .sparse = 1, .run_len = 1 },
+};
+
+static unsigned long fill_bitmap(const DirtyOpts *o, unsigned long *bmap)
+{
+    unsigned long i, dirty = 0;
+
+    bitmap_zero(bmap, DIRTY_PAGES);
+    for (i = 0; i < DIRTY_PAGES; i += o->run_len) {
+        if (g_test_rand_int_range(0, o->sparse) == 0) {
+            bitmap_set(bmap, i, o->run_len);
+            dirty += o->run_len;
+        }
+    }
+    return dirty;
+}
+
+/*
+ * How fast migration_bitmap_find_dirty() goes through the migration
+ * bitmap of a RAMBlock, that has no summary.
+ */
+static void test_find_dirty_speed(const void *opaque)
+{
+    const DirtyOpts *o = opaque;
+    unsigned long *bmap = bitmap_new(DIRTY_PAGES);
+    unsigned long dirty = fill_bitmap(o, bmap);
+    unsigned long page, found = 0;
+    int iters = 0;
+
+    g_test_timer_start();
+    do {
+        page = find_next_bit(bmap, DIRTY_PAGES, 0);
+        while (page < DIRTY_PAGES) {
+            found++;
+            page = find_next_bit(bmap, DIRTY_PAGES, page + 1);
+        }
+        iters++;
+    } while (g_test_timer_elapsed() < 1.0);
+    g_assert_cmpint(found, ==, dirty * iters);
+
+    g_test_message("find dirty: 1 in %d runs of %d pages dirty, "
+                   "%.2f GB of RAM/sec", o->sparse, o->run_len,
+                   (double)iters * DIRTY_PAGES * 4 * KiB / GiB /
+                   g_test_timer_last());
+
+    g_free(bmap);
+}
+
+/*
+ * How fast the fast path of cpu_physical_memory_sync_dirty_bitmap()
+ * moves the dirty log into the migration bitmap: each word of the log
+ * is taken atomically and the pages that are newly dirty are counted.
+ */
+static void test_sync_speed(const void *opaque)
+{
+    const DirtyOpts *o = opaque;
+    unsigned long *log = bitmap_new(DIRTY_PAGES);
+    unsigned long *bmap = bitmap_new(DIRTY_PAGES);
+    unsigned long *src = bitmap_new(DIRTY_PAGES);
+    unsigned long words = BITS_TO_LONGS(DIRTY_PAGES);
+    unsigned long dirty = fill_bitmap(o, src);
+    uint64_t num_dirty;
+    double elapsed = 0;
+    int iters = 0;
+    unsigned long k;
+
+    do {
+        bitmap_copy(log, src, DIRTY_PAGES);
+        bitmap_zero(bmap, DIRTY_PAGES);
+        num_dirty = 0;
+
+        g_test_timer_start();
+        for (k = 0; k < words; k++) {
+            if (log[k]) {
+                unsigned long bits = qatomic_xchg(&log[k], 0);
+                unsigned long new_dirty = ~bmap[k];
+
+                bmap[k] |= bits;
+                new_dirty &= bits;
+                num_dirty += ctpopl(new_dirty);
+            }
+        }
+        elapsed += g_test_timer_elapsed();
+        g_assert_cmpint(num_dirty, ==, dirty);
+        iters++;
+    } while (elapsed < 1.0);
+
+    g_test_message("sync: 1 in %d runs of %d pages dirty, "
+                   "%.2f GB of RAM/sec", o->sparse, o->run_len,
+                   (double)iters * DIRTY_PAGES * 4 * KiB / GiB / elapsed);
+
+    g_free(log);
+    g_free(bmap);
+    g_free(src);
+}
+
+int main(int argc, char **argv)
+{
+    char name[64];
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(opts); i++) {
+        snprintf(name, sizeof(name),
+                 "/dirty-bitmap/benchmark/find/sparse-%d/run-%d",
+                 opts[i].sparse, opts[i].run_len);
+        g_test_add_data_func(name, &opts[i], test_find_dirty_speed);
+        snprintf(name, sizeof(name),
+                 "/dirty-bitmap/benchmark/sync/sparse-%d/run-%d",
+                 opts[i].sparse, opts[i].run_len);
+        g_test_add_data_func(name, &opts[i], test_sync_speed);
+    }
+
+    return g_test_run();
+}
@@ -90,6 +90,7 @@ static const char commands_string[] =
     " -u = update rate (0.0 to 100.0), 50/50 split of insertions/removals\n"
     "\n"
     " -R = enable auto-resize\n"
+    " -I = interleave the buckets across NUMA nodes\n"
     " -S = resize rate (0.0 to 100.0)\n"
     " -D = delay (in us) between potential resizes\n"
     " -N = number of resize threads";
@@ -275,6 +276,8 @@ static void pr_params(void)
     printf(" initial size hint: %zu\n", qht_n_elems);
     printf(" auto-resize:       %s\n",
            qht_mode & QHT_MODE_AUTO_RESIZE ? "on" : "off");
+    printf(" NUMA interleave:   %s\n",
+           qht_mode & QHT_MODE_NUMA_INTERLEAVE ? "on" : "off");
     if (resize_rate) {
         printf(" resize_rate:       %f%%\n", resize_rate * 100.0);
         printf(" resize range:      %zu-%zu\n", resize_min, resize_max);
@@ -444,7 +447,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:pr:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:Ik:K:l:hn:N:o:pr:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -465,6 +468,9 @@ static void parse_args(int argc, char *argv[])
         case 'h':
             usage_complete(argc, argv);
             exit(0);
+        case 'I':
+            qht_mode |= QHT_MODE_NUMA_INTERLEAVE;
+            break;
         case 'k':
             init_size = atol(optarg);
             break;
@@ -0,0 +1,133 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define XBZRLE_PAGE_SIZE 4096
+
+typedef struct XBZRLEOpts {
+    /* number of bytes changed in each page */
+    int changed;
+    /* length of the runs of changed bytes */
+    int run_len;
+} XBZRLEOpts;
+
+static const XBZRLEOpts opts[] = {
+    { .changed = 8, .run_len = 1 },
+    { .changed = 64, .run_len = 8 },
+    { .changed = 256, .run_len = 64 },
+    { .changed = 1024, .run_len = 16 },
+    { .changed = 1024, .run_len = 256 },
+};
+
+static void fill_pages(const XBZRLEOpts *o, uint8_t *old, uint8_t *new)
+{
+    int i, j;
+
+    for (i = 0; i < XBZRLE_PAGE_SIZE; i++) {
+        old[i] = new[i] = g_test_rand_int();
+    }
+    for (i = 0; i < o->changed; i += o->run_len) {
+        int start = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+
+        for (j = start; j < start + o->run_len && j < XBZRLE_PAGE_SIZE; j++) {
+            new[j] = ~old[j];
+        }
+    }
+}
+
+/*
+ * Switching implementation only goes one way, so run every case for
+ * an implementation before moving to the next one.
+ */
+static void test_encode_speed(void)
+{
+    uint8_t *old = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    const size_t total = 2 * GiB;
+    int accel = 0;
+    size_t remain;
+    int i;
+
+    /* accel 0 is the fastest one the host has, the last one is generic */
+    do {
+        for (i = 0; i < ARRAY_SIZE(opts); i++) {
+            int rc = 0;
+
+            fill_pages(&opts[i], old, new);
+            g_test_timer_start();
+            for (remain = total; remain; remain -= XBZRLE_PAGE_SIZE) {
+                rc = xbzrle_encode_buffer(old, new, XBZRLE_PAGE_SIZE,
+                                          compressed, XBZRLE_PAGE_SIZE);
+            }
+            g_test_timer_elapsed();
+
+            g_test_message("xbzrle encode: accel %d changed %d run %d "
+                           "encoded %d bytes %.2f MB/sec",
+                           accel, opts[i].changed, opts[i].run_len, rc,
+                           total / MiB / g_test_timer_last());
+        }
+        accel++;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+static void test_decode_speed(const void *opaque)
+{
+    const XBZRLEOpts *o = opaque;
+    uint8_t *old = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    const size_t total = 2 * GiB;
+    size_t remain;
+    int dlen;
+
+    fill_pages(o, old, new);
+    dlen = xbzrle_encode_buffer(old, new, XBZRLE_PAGE_SIZE, compressed,
+                                XBZRLE_PAGE_SIZE);
+    g_assert(dlen > 0);
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= XBZRLE_PAGE_SIZE) {
+        g_assert(xbzrle_decode_buffer(compressed, dlen, old,
+                                      XBZRLE_PAGE_SIZE) > 0);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("xbzrle decode: changed %d run %d encoded %d bytes "
+                   "%.2f MB/sec", o->changed, o->run_len, dlen,
+                   total / MiB / g_test_timer_last());
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+int main(int argc, char **argv)
+{
+    char name[64];
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/xbzrle/benchmark/encode", test_encode_speed);
+    for (i = 0; i < ARRAY_SIZE(opts); i++) {
+        snprintf(name, sizeof(name),
+                 "/xbzrle/benchmark/decode/changed-%d/run-%d",
+                 opts[i].changed, opts[i].run_len);
+        g_test_add_data_func(name, &opts[i], test_decode_speed);
+    }
+
+    return g_test_run();
+}
@@ -136,3 +136,92 @@ def __init__(self, name, scenarios):
                  multifd=True, multifd_channels=64),
     ]),
 ]
+
+
+# Scenarios run by guestperf-bench.py.  The guest dirties memory at a
+# fixed rate, so that results from different QEMU builds on the same
+# host can be compared
+BENCHMARKS = [
+    # Looking at how the time to converge grows with the
+    # rate at which the guest dirties memory
+    Comparison("dirty-rate", scenarios = [
+        Scenario("dirty-rate-100mbs",
+                 bandwidth=1250, dirty_rate=100),
+        Scenario("dirty-rate-500mbs",
+                 bandwidth=1250, dirty_rate=500),
+        Scenario("dirty-rate-1000mbs",
+                 bandwidth=1250, dirty_rate=1000),
+    ]),
+
+
+    # Looking at how multifd scales with the number of channels
+    Comparison("multifd-channels", scenarios = [
+        Scenario("multifd-channels-1",
+                 dirty_rate=500, multifd=True, multifd_channels=1),
+        Scenario("multifd-channels-2",
+                 dirty_rate=500, multifd=True, multifd_channels=2),
+        Scenario("multifd-channels-4",
+                 dirty_rate=500, multifd=True, multifd_channels=4),
+        Scenario("multifd-channels-8",
+                 dirty_rate=500, multifd=True, multifd_channels=8),
+    ]),
+
+
+    # Looking at the cost of each multifd compression method
+    Comparison("multifd-compression", scenarios = [
+        Scenario("multifd-compression-none",
+                 bandwidth=1250, dirty_rate=500, multifd=True,
+                 multifd_channels=4, multifd_compression="none"),
+        Scenario("multifd-compression-zlib",
+                 bandwidth=1250, dirty_rate=500, multifd=True,
+                 multifd_channels=4, multifd_compression="zlib"),
+        Scenario("multifd-compression-zstd",
+                 bandwidth=1250, dirty_rate=500, multifd=True,
+                 multifd_channels=4, multifd_compression="zstd"),
+    ]),
+
+
+    # Looking at the cost of each method of the compress capability
+    Comparison("compress-method", scenarios = [
+        Scenario("compress-method-zlib",
+                 bandwidth=1250, dirty_rate=100, compression_mt=True,
+                 compression_mt_threads=4, compression_method="zlib"),
+        Scenario("compress-method-zstd",
+                 bandwidth=1250, dirty_rate=100, compression_mt=True,
+                 compression_mt_threads=4, compression_method="zstd"),
+        Scenario("compress-method-lz4",
+                 bandwidth=1250, dirty_rate=100, compression_mt=True,
+                 compression_mt_threads=4, compression_method="lz4"),
+    ]),
+
+
+    # Looking at post-copy when the guest faults on most of its
+    # pages: switching over right away, with a guest that keeps
+    # dirtying memory
+    Comparison("post-copy-faults", scenarios = [
+        Scenario("post-copy-faults-1gbs",
+                 post_copy=True, post_copy_iters=0,
+                 bandwidth=125, dirty_rate=1000),
+        Scenario("post-copy-faults-10gbs",
+                 post_copy=True, post_copy_iters=0,
+                 bandwidth=1250, dirty_rate=1000),
+    ]),
+
+
+    # Looking at the effect of the xbzrle cache size
+    # on a guest that keeps dirtying the same pages
+    Comparison("xbzrle-cache", scenarios = [
+        Scenario("xbzrle-cache-5",
+                 dirty_rate=500, compression_xbzrle=True,
+                 compression_xbzrle_cache=5),
+        Scenario("xbzrle-cache-10",
+                 dirty_rate=500, compression_xbzrle=True,
+                 compression_xbzrle_cache=10),
+        Scenario("xbzrle-cache-20",
+                 dirty_rate=500, compression_xbzrle=True,
+                 compression_xbzrle_cache=20),
+        Scenario("xbzrle-cache-50",
+                 dirty_rate=500, compression_xbzrle=True,
+                 compression_xbzrle_cache=50),
+    ]),
+]
@@ -95,7 +95,8 @@ def _migrate_progress(self, vm):
                 info["ram"].get("normal-bytes", 0),
                 info["ram"].get("dirty-pages-rate", 0),
                 info["ram"].get("mbps", 0),
-                info["ram"].get("dirty-sync-count", 0)
+                info["ram"].get("dirty-sync-count", 0),
+                info["ram"].get("postcopy-requests", 0)
             ),
             time.time(),
             info.get("total-time", 0),
@@ -162,14 +163,16 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                                      "state": True }
                                ])
             resp = src.command("migrate-set-parameters",
-                               compress_threads=scenario._compression_mt_threads)
+                               compress_threads=scenario._compression_mt_threads,
+                               compress_method=scenario._compression_method)
             resp = dst.command("migrate-set-capabilities",
                                capabilities = [
                                    { "capability": "compress",
                                      "state": True }
                                ])
             resp = dst.command("migrate-set-parameters",
-                               decompress_threads=scenario._compression_mt_threads)
+                               decompress_threads=scenario._compression_mt_threads,
+                               compress_method=scenario._compression_method)
 
         if scenario._compression_xbzrle:
             resp = src.command("migrate-set-capabilities",
@@ -195,14 +198,16 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                                      "state": True }
                                ])
             resp = src.command("migrate-set-parameters",
-                               multifd_channels=scenario._multifd_channels)
+                               multifd_channels=scenario._multifd_channels,
+                               multifd_compression=scenario._multifd_compression)
             resp = dst.command("migrate-set-capabilities",
                                capabilities = [
                                    { "capability": "multifd",
                                      "state": True }
                                ])
             resp = dst.command("migrate-set-parameters",
-                               multifd_channels=scenario._multifd_channels)
+                               multifd_channels=scenario._multifd_channels,
+                               multifd_compression=scenario._multifd_compression)
 
         resp = src.command("migrate", uri=connect_uri)
 
@@ -282,7 +287,7 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                 resp = src.command("stop")
                 paused = True
 
-    def _get_common_args(self, hardware, tunnelled=False):
+    def _get_common_args(self, hardware, scenario, tunnelled=False):
         args = [
             "noapic",
             "edd=off",
@@ -298,6 +303,8 @@ def _get_common_args(self, hardware, tunnelled=False):
             args.append("quiet")
 
         args.append("ramsize=%s" % hardware._mem)
+        if scenario._dirty_rate:
+            args.append("dirtyrate=%s" % scenario._dirty_rate)
 
         cmdline = " ".join(args)
         if tunnelled:
@@ -328,14 +335,14 @@ def _get_common_args(self, hardware, tunnelled=False):
 
         return argv
 
-    def _get_src_args(self, hardware):
-        return self._get_common_args(hardware)
+    def _get_src_args(self, hardware, scenario):
+        return self._get_common_args(hardware, scenario)
 
-    def _get_dst_args(self, hardware, uri):
+    def _get_dst_args(self, hardware, scenario, uri):
         tunnelled = False
         if self._dst_host != "localhost":
             tunnelled = True
-        argv = self._get_common_args(hardware, tunnelled)
+        argv = self._get_common_args(hardware, scenario, tunnelled)
         return argv + ["-incoming", uri]
 
     @staticmethod
@@ -404,13 +411,13 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
         srcmonaddr = "/var/tmp/qemu-src-%d-monitor.sock" % os.getpid()
 
         src = QEMUMachine(self._binary,
-                          args=self._get_src_args(hardware),
+                          args=self._get_src_args(hardware, scenario),
                           wrapper=self._get_src_wrapper(hardware),
                           name="qemu-src-%d" % os.getpid(),
                           monitor_address=srcmonaddr)
 
         dst = QEMUMachine(self._binary,
-                          args=self._get_dst_args(hardware, uri),
+                          args=self._get_dst_args(hardware, scenario, uri),
                           wrapper=self._get_dst_wrapper(hardware),
                           name="qemu-dst-%d" % os.getpid(),
                           monitor_address=dstmonaddr)
@@ -30,7 +30,8 @@ def __init__(self,
                  normal_bytes,
                  dirty_rate_pps,
                  transfer_rate_mbs,
-                 iterations):
+                 iterations,
+                 postcopy_requests=0):
         self._transferred_bytes = transferred_bytes
         self._remaining_bytes = remaining_bytes
         self._total_bytes = total_bytes
@@ -41,6 +42,7 @@ def __init__(self,
         self._dirty_rate_pps = dirty_rate_pps
         self._transfer_rate_mbs = transfer_rate_mbs
         self._iterations = iterations
+        self._postcopy_requests = postcopy_requests
 
     def serialize(self):
         return {
@@ -54,6 +56,7 @@ def serialize(self):
             "dirty_rate_pps": self._dirty_rate_pps,
             "transfer_rate_mbs": self._transfer_rate_mbs,
             "iterations": self._iterations,
+            "postcopy_requests": self._postcopy_requests,
         }
 
     @classmethod
@@ -68,7 +71,8 @@ def deserialize(cls, data):
             data["normal_bytes"],
             data["dirty_rate_pps"],
             data["transfer_rate_mbs"],
-            data["iterations"])
+            data["iterations"],
+            data.get("postcopy_requests", 0))
 
 
 class Progress(object):
@@ -85,6 +85,35 @@ def deserialize(cls, data):
             data["transport"],
             data["sleep"])
 
+    def summary(self):
+        """The figures to compare runs of a scenario by"""
+        first = self._progress_history[0]
+        last = self._progress_history[-1]
+        start = first._now - first._duration / 1000.0
+        transferred = last._ram._transferred_bytes
+        gib = transferred / (1024.0 * 1024 * 1024)
+
+        # QEMU CPU time while the migration ran, in milliseconds
+        cpu = [record._value for record in self._qemu_timings._records
+               if start <= record._timestamp <= last._now]
+        cpu_ms = cpu[-1] - cpu[0] if len(cpu) > 1 else 0
+
+        throughput = 0
+        if last._duration:
+            throughput = (transferred / (1024.0 * 1024) /
+                          (last._duration / 1000.0))
+
+        return {
+            "status": last._status,
+            "total_time_ms": last._duration,
+            "downtime_ms": last._downtime,
+            "transferred_bytes": transferred,
+            "throughput_mibs": throughput,
+            "iterations": last._ram._iterations,
+            "postcopy_requests": last._ram._postcopy_requests,
+            "cpu_ms_per_gib": cpu_ms / gib if gib else 0,
+        }
+
     def to_json(self):
         return json.dumps(self.serialize(), indent=4)
 
@@ -30,7 +30,10 @@ def __init__(self, name,
                  auto_converge=False, auto_converge_step=10,
                  compression_mt=False, compression_mt_threads=1,
                  compression_xbzrle=False, compression_xbzrle_cache=10,
-                 multifd=False, multifd_channels=2):
+                 multifd=False, multifd_channels=2,
+                 dirty_rate=0,
+                 compression_method="zlib",
+                 multifd_compression="none"):
 
         self._name = name
 
@@ -59,6 +62,12 @@ def __init__(self, name,
 
         self._multifd = multifd
         self._multifd_channels = multifd_channels
+        self._multifd_compression = multifd_compression
+
+        self._compression_method = compression_method
+
+        # Guest workload
+        self._dirty_rate = dirty_rate # MiB per second, 0 for unlimited
 
     def serialize(self):
         return {
@@ -79,6 +88,9 @@ def serialize(self):
             "compression_xbzrle_cache": self._compression_xbzrle_cache,
             "multifd": self._multifd,
             "multifd_channels": self._multifd_channels,
+            "multifd_compression": self._multifd_compression,
+            "compression_method": self._compression_method,
+            "dirty_rate": self._dirty_rate,
         }
 
     @classmethod
@@ -100,4 +112,7 @@ def deserialize(cls, data):
             data["compression_xbzrle"],
             data["compression_xbzrle_cache"],
             data["multifd"],
-            data["multifd_channels"])
+            data["multifd_channels"],
+            data.get("dirty_rate", 0),
+            data.get("compression_method", "zlib"),
+            data.get("multifd_compression", "none"))
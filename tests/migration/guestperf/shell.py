@@ -20,16 +20,18 @@
 
 import argparse
 import fnmatch
+import json
 import os
 import os.path
 import platform
+import statistics
 import sys
 import logging
 
 from guestperf.hardware import Hardware
 from guestperf.engine import Engine
 from guestperf.scenario import Scenario
-from guestperf.comparison import COMPARISONS
+from guestperf.comparison import COMPARISONS, BENCHMARKS
 from guestperf.plot import Plot
 from guestperf.report import Report
 
@@ -126,6 +128,13 @@ def __init__(self):
                             action="store_true")
         parser.add_argument("--multifd-channels", dest="multifd_channels",
                             default=2, type=int)
+        parser.add_argument("--multifd-compression",
+                            dest="multifd_compression", default="none")
+        parser.add_argument("--compression-method",
+                            dest="compression_method", default="zlib")
+
+        parser.add_argument("--dirty-rate", dest="dirty_rate", default=0,
+                            type=int)
 
     def get_scenario(self, args):
         return Scenario(name="perfreport",
@@ -150,7 +159,12 @@ def get_scenario(self, args):
                         compression_xbzrle_cache=args.compression_xbzrle_cache,
 
                         multifd=args.multifd,
-                        multifd_channels=args.multifd_channels)
+                        multifd_channels=args.multifd_channels,
+                        multifd_compression=args.multifd_compression,
+
+                        compression_method=args.compression_method,
+
+                        dirty_rate=args.dirty_rate)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -224,6 +238,82 @@ def run(self, argv):
                 raise
 
 
+class BenchShell(BaseShell):
+
+    def __init__(self):
+        super(BenchShell, self).__init__()
+
+        parser = self._parser
+
+        parser.add_argument("--filter", dest="filter", default="*")
+        parser.add_argument("--repeat", dest="repeat", default=3, type=int)
+        parser.add_argument("--output", dest="output", default=None)
+
+    @staticmethod
+    def _median(runs):
+        runs = [run for run in runs if run["status"] == "completed"]
+        if len(runs) == 0:
+            return None
+        return {key: statistics.median([run[key] for run in runs])
+                for key in runs[0] if key != "status"}
+
+    def run(self, argv):
+        args = self._parser.parse_args(argv)
+        logging.basicConfig(level=(logging.DEBUG if args.debug else
+                                   logging.INFO if args.verbose else
+                                   logging.WARN))
+
+        # Exit as a skipped test where the benchmarks can't run
+        for path in ("/dev/kvm", args.binary, args.kernel, args.initrd):
+            if not os.path.exists(path):
+                print("Skipping benchmarks: %s not found" % path,
+                      file=sys.stderr)
+                return 77
+
+        engine = self.get_engine(args)
+        hardware = self.get_hardware(args)
+
+        results = {}
+        failed = False
+        for comparison in BENCHMARKS:
+            for scenario in comparison._scenarios:
+                name = os.path.join(comparison._name, scenario._name)
+                if not fnmatch.fnmatch(name, args.filter):
+                    continue
+
+                runs = []
+                for i in range(args.repeat):
+                    if args.verbose:
+                        print("Running %s (%d/%d)" % (name, i + 1, args.repeat))
+                    try:
+                        runs.append(engine.run(hardware, scenario).summary())
+                    except Exception as e:
+                        print("Error: %s: %s" % (name, str(e)),
+                              file=sys.stderr)
+                        runs.append({"status": "error", "error": str(e)})
+                    if runs[-1]["status"] != "completed":
+                        failed = True
+
+                results[name] = {
+                    "scenario": scenario.serialize(),
+                    "runs": runs,
+                    "median": self._median(runs),
+                }
+
+        output = json.dumps({
+            "binary": args.binary,
+            "hardware": hardware.serialize(),
+            "results": results,
+        }, indent=4)
+        if args.output is None:
+            print(output)
+        else:
+            with open(args.output, "w") as fh:
+                print(output, file=fh)
+
+        return 1 if failed else 0
+
+
 class PlotShell(object):
 
     def __init__(self):
@@ -156,6 +156,12 @@ static unsigned long long now(void)
     return (tv.tv_sec * 1000ull) + (tv.tv_usec / 1000ull);
 }
 
+/*
+ * Limit on the MiB per second each thread dirties, 0 for as fast as it
+ * can: the dirty rate is then fixed and the same from run to run.
+ */
+static unsigned long long dirtyrateMB;
+
 static void stressone(unsigned long long ramsizeMB)
 {
     size_t pagesPerMB = 1024 * 1024 / RAM_PAGE_SIZE;
@@ -166,6 +172,7 @@ static void stressone(unsigned long long ramsizeMB)
     char *dataptr;
     size_t nMB = 0;
     unsigned long long before, after;
+    unsigned long long start, dirtiedMB = 0;
 
     /* We don't care about initial state, but we do want
      * to fault it all into RAM, otherwise the first iter
@@ -179,6 +186,7 @@ static void stressone(unsigned long long ramsizeMB)
     }
 
     before = now();
+    start = before;
 
     while (1) {
 
@@ -193,6 +201,16 @@ static void stressone(unsigned long long ramsizeMB)
                 }
             }
 
+            if (dirtyrateMB) {
+                unsigned long long due = start +
+                    ++dirtiedMB * 1000 / dirtyrateMB;
+
+                after = now();
+                if (due > after) {
+                    g_usleep((due - after) * 1000);
+                }
+            }
+
             if (nMB == 1024) {
                 after = now();
                 fprintf(stderr, "%s (%05d): INFO: %06llums copied 1 GB in %05llums\n",
@@ -218,6 +236,7 @@ static void stress(unsigned long long ramsizeGB, int ncpus)
 {
     size_t i;
     unsigned long long ramsizeMB = ramsizeGB * 1024 / ncpus;
+    dirtyrateMB /= ncpus;
     ncpus--;
 
     for (i = 0; i < ncpus; i++) {
@@ -266,11 +285,12 @@ int main(int argc, char **argv)
     char *end;
     int ch;
     int opt_ind = 0;
-    const char *sopt = "hr:c:";
+    const char *sopt = "hr:c:d:";
     struct option lopt[] = {
         { "help", no_argument, NULL, 'h' },
         { "ramsize", required_argument, NULL, 'r' },
         { "cpus", required_argument, NULL, 'c' },
+        { "dirty-rate", required_argument, NULL, 'd' },
         { NULL, 0, NULL, 0 }
     };
     int ret;
@@ -300,9 +320,20 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'd':
+            errno = 0;
+            dirtyrateMB = strtoll(optarg, &end, 10);
+            if (errno != 0 || *end) {
+                fprintf(stderr, "%s (%05d): ERROR: Cannot parse dirty rate %s\n",
+                        argv0, gettid(), optarg);
+                exit_failure();
+            }
+            break;
+
         case '?':
         case 'h':
-            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]\n", argv0);
+            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]"
+                    "[--dirty-rate MB/s]\n", argv0);
             exit_failure();
         }
     }
@@ -314,6 +345,10 @@ int main(int argc, char **argv)
         ret = get_command_arg_ull("ramsize", &ramsizeGB);
         if (ret < 0)
             exit_failure();
+
+        ret = get_command_arg_ull("dirtyrate", &dirtyrateMB);
+        if (ret < 0)
+            exit_failure();
     }
 
     if (ncpus == 0)
@@ -321,6 +356,10 @@ int main(int argc, char **argv)
 
     fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs\n",
             argv0, gettid(), ramsizeGB, ncpus);
+    if (dirtyrateMB) {
+        fprintf(stdout, "%s (%05d): INFO: dirtying %llu MiB/s\n",
+                argv0, gettid(), dirtyrateMB);
+    }
 
     stress(ramsizeGB, ncpus);
 
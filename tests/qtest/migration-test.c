@@ -15,6 +15,7 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -207,6 +208,7 @@ static void read_blocktime(QTestState *who)
 
     rsp_return = migrate_query(who);
     g_assert(qdict_haskey(rsp_return, "postcopy-blocktime"));
+    g_assert(qdict_haskey(rsp_return, "postcopy-fault-latency"));
     qobject_unref(rsp_return);
 }
 
@@ -473,6 +475,8 @@ typedef struct {
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
     bool use_dirty_ring;
+    /* Send the pages that postcopy asks for through their own channel */
+    bool postcopy_preempt;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -653,6 +657,8 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
 
     cleanup("bootsect");
     cleanup("migsocket");
+    cleanup("migfile");
+    cleanup("dedupstore");
     cleanup("src_serial");
     cleanup("dest_serial");
 }
@@ -662,6 +668,7 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -672,6 +679,11 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -718,13 +730,129 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
-static void test_postcopy_recovery(void)
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    /* Send the pages that follow each requested page with it */
+    migrate_set_parameter_int(from, "postcopy-prefetch-window", 16);
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_discard_bitmap(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    g_free(args->opts_source);
+    g_free(args->opts_target);
+    args->opts_source =
+        g_strdup("-global migration.x-postcopy-discard-bitmap=on");
+    args->opts_target =
+        g_strdup("-global migration.x-postcopy-discard-bitmap=on");
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_place_batch(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    /* Place up to 64 contiguous pages at once on the destination */
+    migrate_set_parameter_int(to, "postcopy-place-batch", 64);
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+/*
+ * The guest dirties its RAM faster than max-bandwidth lets it through,
+ * so postcopy-auto switches to postcopy after two bitmap syncs.
+ */
+static void test_postcopy_auto(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    g_free(args->opts_source);
+    args->opts_source = g_strdup("-global migration.x-postcopy-auto=on");
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    /* Leave room for the round trip on the return path */
+    migrate_set_parameter_int(from, "downtime-limit", 100);
+    migrate_set_parameter_int(from, "postcopy-auto-iterations", 2);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_rate_limit(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp_return;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    /* Precopy runs at 30 MB/s, let it through 64 KiB at a time */
+    migrate_set_parameter_int(from, "max-bandwidth-burst", 65536);
+    wait_for_migration_pass(from);
+
+    rsp_return = migrate_query(from);
+    g_assert(qdict_haskey(rsp_return, "rate-limit"));
+    g_assert_cmpint(qdict_get_int(qdict_get_qdict(rsp_return, "rate-limit"),
+                                  "waits"), >, 0);
+    qobject_unref(rsp_return);
+
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_recovery_common(bool compress_bitmap)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
     g_autofree char *uri = NULL;
 
     args->hide_stderr = true;
+    if (compress_bitmap) {
+        /* Both sides have to agree on it before postcopy is paused */
+        g_free(args->opts_source);
+        g_free(args->opts_target);
+        args->opts_source =
+            g_strdup("-global migration.x-postcopy-compress-bitmap=on");
+        args->opts_target =
+            g_strdup("-global migration.x-postcopy-compress-bitmap=on");
+    }
 
     if (migrate_postcopy_prepare(&from, &to, args)) {
         return;
@@ -780,6 +908,16 @@ static void test_postcopy_recovery(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_recovery(void)
+{
+    test_postcopy_recovery_common(false);
+}
+
+static void test_postcopy_recovery_compress_bitmap(void)
+{
+    test_postcopy_recovery_common(true);
+}
+
 static void test_baddest(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -795,11 +933,13 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
-static void test_precopy_unix_common(bool dirty_ring)
+static void test_precopy_unix_common(bool dirty_ring, int dirty_sync_threads,
+                                     bool predictive, bool clear_ahead)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
+    QDict *rsp_return, *timings;
 
     args->use_dirty_ring = dirty_ring;
 
@@ -815,6 +955,9 @@ static void test_precopy_unix_common(bool dirty_ring)
     migrate_set_parameter_int(from, "downtime-limit", 1);
     /* 1GB/s */
     migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "dirty-sync-threads", dirty_sync_threads);
+    migrate_set_capability(from, "predictive-switchover", predictive);
+    migrate_set_capability(from, "clear-dirty-log-ahead", clear_ahead);
 
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
@@ -822,6 +965,9 @@ static void test_precopy_unix_common(bool dirty_ring)
     migrate_qmp(from, uri, "{}");
 
     wait_for_migration_pass(from);
+    g_assert_cmpint(read_ram_property_int(from, "dirty-sync-time"), >, 0);
+    g_assert_cmpint(read_migrate_property_int(from, "predicted-downtime"),
+                    >, 0);
 
     migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
 
@@ -834,19 +980,164 @@ static void test_precopy_unix_common(bool dirty_ring)
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
 
+    rsp_return = migrate_query(from);
+    timings = qdict_get_qdict(rsp_return, "timings");
+    g_assert_cmpint(qdict_get_int(timings, "bitmap-sync"), >, 0);
+    g_assert_cmpint(qdict_get_int(timings, "flush"), >, 0);
+    g_assert(qdict_haskey(timings, "device-state"));
+    qobject_unref(rsp_return);
+
+    rsp_return = migrate_query(to);
+    timings = qdict_get_qdict(rsp_return, "timings");
+    g_assert_cmpint(qdict_get_int(timings, "load"), >, 0);
+    qobject_unref(rsp_return);
+
     test_migrate_end(from, to, true);
 }
 
 static void test_precopy_unix(void)
 {
     /* Using default dirty logging */
-    test_precopy_unix_common(false);
+    test_precopy_unix_common(false, 1, false, false);
+}
+
+static void test_precopy_unix_dirty_sync_threads(void)
+{
+    /* Merge the dirty bitmaps with helper threads */
+    test_precopy_unix_common(false, 4, false, false);
+}
+
+static void test_precopy_unix_predictive(void)
+{
+    /* Switch over when the downtime model says so */
+    test_precopy_unix_common(false, 1, true, false);
+}
+
+static void test_precopy_unix_clear_ahead(void)
+{
+    /* Clear the dirty log on a helper thread */
+    test_precopy_unix_common(false, 1, false, true);
 }
 
 static void test_precopy_unix_dirty_ring(void)
 {
     /* Using dirty ring tracking */
-    test_precopy_unix_common(true);
+    test_precopy_unix_common(true, 1, false, false);
+}
+
+static void test_precopy_unix_prepopulate(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    /* The destination starts populating as soon as it listens */
+    g_free(args->opts_target);
+    args->opts_target = g_strdup("-global migration.prepopulate-threads=4");
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_precopy_unix_page_dedup(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    g_autofree char *store = g_strdup_printf("%s/dedupstore", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_capability(from, "page-dedup", true);
+    migrate_set_capability(to, "page-dedup", true);
+    migrate_set_parameter_str(to, "page-dedup-store", store);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+    g_assert_cmpint(read_ram_property_int(from, "dedup-pages"), >, 0);
+    g_assert_cmpint(read_ram_property_int(from, "dedup-misses"), <=,
+                    read_ram_property_int(from, "dedup-pages"));
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_precopy_unix_release_ram(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_capability(from, "release-ram-precopy", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    /* The pages freed on the source must have made it to the destination */
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* The source frees the rest of its RAM as it quits */
+    test_migrate_end(from, to, true);
 }
 
 #if 0
@@ -886,15 +1177,308 @@ static void test_ignore_shared(void)
 }
 #endif
 
-static void test_xbzrle(const char *uri)
+static void test_ram_handover(void)
 {
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
 
-    if (test_migrate_start(&from, &to, uri, args)) {
+    args->use_shmem = true;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "ram-handover", true);
+    migrate_set_capability(to, "ram-handover", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* The shared RAM went over as a file descriptor */
+    g_assert_cmpint(read_ram_property_int(from, "transferred"), <, 1024 * 1024);
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_xbzrle(const char *uri, int load_threads)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+
+    migrate_set_capability(from, "xbzrle", true);
+    migrate_set_capability(to, "xbzrle", true);
+    migrate_set_parameter_int(to, "load-threads", load_threads);
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+    /* Make sure we have 2 passes, so the xbzrle cache gets a workout */
+    wait_for_migration_pass(from);
+
+    /* 1000ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 1000);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_xbzrle_unix(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+
+    test_xbzrle(uri, 0);
+}
+
+static void test_xbzrle_unix_load_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+
+    /* Write the pages on the destination with a pool of threads */
+    test_xbzrle(uri, 4);
+}
+
+static void test_compress(const char *method)
+{
+    MigrateStart *args = migrate_start_new();
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter_int(from, "compress-threads", 4);
+    migrate_set_parameter_int(to, "decompress-threads", 4);
+    migrate_set_parameter_str(from, "compress-method", method);
+    migrate_set_parameter_str(to, "compress-method", method);
+
+    migrate_set_capability(from, "compress", true);
+    migrate_set_capability(to, "compress", true);
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* The second pass is the first one with compressed pages */
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_compress_zlib(void)
+{
+    test_compress("zlib");
+}
+
+#ifdef CONFIG_ZSTD
+static void test_compress_zstd(void)
+{
+    test_compress("zstd");
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static void test_compress_lz4(void)
+{
+    test_compress("lz4");
+}
+#endif
+
+/*
+ * Save the guest to a file with fixed-ram, and only then start the
+ * migration from that file on the destination, with @dest_cap if not
+ * NULL.
+ */
+static void test_fixed_ram(bool multifd, const char *dest_cap)
+{
+    MigrateStart *args = migrate_start_new();
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_capability(from, "fixed-ram", true);
+    migrate_set_capability(to, "fixed-ram", true);
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
+    if (dest_cap) {
+        migrate_set_capability(to, dest_cap, true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+}
+
+static void test_fixed_ram_file(void)
+{
+    test_fixed_ram(false, NULL);
+}
+
+static void test_fixed_ram_file_multifd(void)
+{
+    /* The pages are written and read by 4 threads */
+    test_fixed_ram(true, NULL);
+}
+
+static void test_fixed_ram_file_mmap(void)
+{
+    /* The guest runs from pages that are mapped from the file */
+    test_fixed_ram(false, "fixed-ram-mmap");
+}
+
+static void test_fixed_ram_file_postcopy(void)
+{
+    /* The guest runs before its RAM is read from the file */
+    test_fixed_ram(false, "fixed-ram-postcopy");
+}
+
+#ifdef CONFIG_ZSTD
+/*
+ * Save the guest to a file compressed with zstd.  The destination
+ * finds out on its own that it has to decompress it.
+ */
+static void test_stream_compress_file(void)
+{
+    MigrateStart *args = migrate_start_new();
+    g_autofree char *path = g_strdup_printf("%s/migfile", tmpfs);
+    g_autofree char *uri = g_strdup_printf("file:%s", path);
+    g_autofree char *data = NULL;
+    gsize len;
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "compress-level", 1);
+    migrate_set_parameter_int(from, "compress-threads", 2);
+    migrate_set_capability(from, "stream-compress", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    /* The file starts with the magic number of a zstd frame */
+    g_assert(g_file_get_contents(path, &data, &len, NULL));
+    g_assert_cmpint(len, >, 4);
+    g_assert(!memcmp(data, "\x28\xb5\x2f\xfd", 4));
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+}
+#endif
+
+static void test_precopy_tcp_common(int stream_buffer_size,
+                                    int stream_iov_max, bool fair)
+{
+    MigrateStart *args = migrate_start_new();
+    g_autofree char *uri = NULL;
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "tcp:127.0.0.1:0", args)) {
         return;
     }
 
+    migrate_set_parameter_int(from, "stream-buffer-size", stream_buffer_size);
+    migrate_set_parameter_int(to, "stream-buffer-size", stream_buffer_size);
+    migrate_set_parameter_int(from, "stream-iov-max", stream_iov_max);
+    migrate_set_parameter_int(to, "stream-iov-max", stream_iov_max);
+    migrate_set_capability(from, "fair-iteration", fair);
+
     /*
      * We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -905,21 +1489,16 @@ static void test_xbzrle(const char *uri)
     /* 1GB/s */
     migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
 
-    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
-
-    migrate_set_capability(from, "xbzrle", true);
-    migrate_set_capability(to, "xbzrle", true);
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
 
+    uri = migrate_get_socket_address(to, "socket-address");
+
     migrate_qmp(from, uri, "{}");
 
-    wait_for_migration_pass(from);
-    /* Make sure we have 2 passes, so the xbzrle cache gets a workout */
     wait_for_migration_pass(from);
 
-    /* 1000ms should converge */
-    migrate_set_parameter_int(from, "downtime-limit", 1000);
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
 
     if (!got_stop) {
         qtest_qmp_eventwait(from, "STOP");
@@ -932,40 +1511,41 @@ static void test_xbzrle(const char *uri)
     test_migrate_end(from, to, true);
 }
 
-static void test_xbzrle_unix(void)
+static void test_precopy_tcp(void)
 {
-    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    test_precopy_tcp_common(32768, 64, false);
+}
 
-    test_xbzrle(uri);
+static void test_precopy_tcp_stream_buffer(void)
+{
+    /* Write up to 4 MiB or 1024 buffers at once */
+    test_precopy_tcp_common(4 * 1024 * 1024, 1024, false);
 }
 
-static void test_precopy_tcp(void)
+static void test_precopy_unix_cold_first(void)
 {
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     MigrateStart *args = migrate_start_new();
-    g_autofree char *uri = NULL;
     QTestState *from, *to;
 
-    if (test_migrate_start(&from, &to, "tcp:127.0.0.1:0", args)) {
+    if (test_migrate_start(&from, &to, uri, args)) {
         return;
     }
 
     /*
-     * We want to pick a speed slow enough that the test completes
-     * quickly, but that it doesn't complete precopy even on a slow
-     * machine, so also set the downtime.
+     * The test guest keeps writing the same pages: hold them back
+     * until the migration converges, which it must still do.
      */
-    /* 1 ms should make it not converge*/
+    migrate_set_capability(from, "ram-cold-first", true);
     migrate_set_parameter_int(from, "downtime-limit", 1);
-    /* 1GB/s */
     migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
 
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
 
-    uri = migrate_get_socket_address(to, "socket-address");
-
     migrate_qmp(from, uri, "{}");
 
+    wait_for_migration_pass(from);
     wait_for_migration_pass(from);
 
     migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
@@ -981,6 +1561,12 @@ static void test_precopy_tcp(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_precopy_tcp_fair_iteration(void)
+{
+    /* Hand out the bandwidth of each iteration by pending size */
+    test_precopy_tcp_common(32768, 64, true);
+}
+
 static void test_migrate_fd_proto(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1224,10 +1810,132 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+/*
+ * The guest keeps writing to its first 100 MiB: after a few passes all
+ * of its buckets of 1 MiB must have been dirty.
+ */
+static void test_migrate_dirty_heatmap(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *heatmap, *block;
+    QListEntry *entry;
+    QList *buckets;
+    int dirty = 0;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "dirty-heatmap-granularity", 1048576);
+
+    wait_for_serial("src_serial");
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+
+    heatmap = wait_command(from, "{ 'execute': 'query-dirty-heatmap' }");
+    g_assert_cmpint(qdict_get_int(heatmap, "granularity"), ==, 1048576);
+    g_assert_cmpint(qdict_get_int(heatmap, "syncs"), >=, 1);
+    block = qobject_to(QDict, qlist_peek(qdict_get_qlist(heatmap, "blocks")));
+    g_assert(block);
+    buckets = qdict_get_qlist(block, "buckets");
+    QLIST_FOREACH_ENTRY(buckets, entry) {
+        QDict *bucket = qobject_to(QDict, qlist_entry_obj(entry));
+
+        dirty += qdict_get_int(bucket, "dirty-syncs") > 0;
+    }
+    g_assert_cmpint(dirty, >=, 100);
+    qobject_unref(heatmap);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+    test_migrate_end(from, to, true);
+}
+
+/* Returns the number of vCPUs whose dirty page rate is limited */
+static int query_vcpu_dirty_limit(QTestState *who)
+{
+    QDict *rsp;
+    QList *limits;
+    int count;
+
+    rsp = qtest_qmp(who, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    g_assert(rsp);
+    g_assert(qdict_haskey(rsp, "return"));
+    limits = qdict_get_qlist(rsp, "return");
+    count = qlist_size(limits);
+    qobject_unref(rsp);
+
+    return count;
+}
+
+static void test_migrate_dirty_limit(void)
 {
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
+
+    args->use_dirty_ring = true;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "dirty-limit", true);
+    migrate_set_parameter_int(from, "vcpu-dirty-limit", 50);
+
+    /*
+     * Set the initial parameters so that the migration could not converge
+     * without throttling.
+     */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000); /* ~100Mb/s */
+
+    /* To check the limit is still there after precopy */
+    migrate_set_capability(from, "pause-before-switchover", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Wait for the vCPU to be limited */
+    while (query_vcpu_dirty_limit(from) == 0) {
+        usleep(1000);
+        g_assert_false(got_stop);
+    }
+
+    /* Now, when we tested that throttling works, let it converge */
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    wait_for_migration_status(from, "pre-switchover", NULL);
+    g_assert_cmpint(query_vcpu_dirty_limit(from), ==, 1);
+
+    migrate_continue(from, "pre-switchover");
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_multifd_tcp_common(MigrateStart *args, const char *method,
+                                    const char *capability)
+{
+    QTestState *from, *to;
     QDict *rsp;
     g_autofree char *uri = NULL;
 
@@ -1254,6 +1962,11 @@ static void test_multifd_tcp(const char *method)
     migrate_set_capability(from, "multifd", true);
     migrate_set_capability(to, "multifd", true);
 
+    if (capability) {
+        migrate_set_capability(from, capability, true);
+        migrate_set_capability(to, capability, true);
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1280,20 +1993,217 @@ static void test_multifd_tcp(const char *method)
     test_migrate_end(from, to, true);
 }
 
+static void test_multifd_tcp(const char *method, const char *capability)
+{
+    test_multifd_tcp_common(migrate_start_new(), method, capability);
+}
+
 static void test_multifd_tcp_none(void)
 {
-    test_multifd_tcp("none");
+    test_multifd_tcp("none", NULL);
+}
+
+/* The channels are synced at the end of each section, as before 6.1 */
+static void test_multifd_tcp_flush_after_each_section(void)
+{
+    MigrateStart *args = migrate_start_new();
+    const char *opts = "-global migration.multifd-flush-after-each-section=on";
+
+    g_free(args->opts_source);
+    g_free(args->opts_target);
+    args->opts_source = g_strdup(opts);
+    args->opts_target = g_strdup(opts);
+    test_multifd_tcp_common(args, "none", NULL);
+}
+
+/*
+ * With multifd-backpressure, the destination reports the load of its
+ * channels on the return path, and the source shows it.
+ */
+static void test_multifd_tcp_backpressure(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp, *load;
+    g_autofree char *uri = NULL;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+    migrate_set_capability(from, "return-path", true);
+    migrate_set_capability(to, "return-path", true);
+    migrate_set_capability(from, "multifd-backpressure", true);
+    migrate_set_capability(to, "multifd-backpressure", true);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_pass(from);
+
+    /* The destination reports every 100 ms while the pages come in */
+    while (true) {
+        rsp = migrate_query(from);
+        if (qdict_haskey(rsp, "destination-load")) {
+            break;
+        }
+        qobject_unref(rsp);
+        g_usleep(10 * 1000);
+    }
+    load = qdict_get_qdict(rsp, "destination-load");
+    g_assert(qdict_haskey(load, "backpressure"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(load, "channels")), ==, 4);
+    qobject_unref(rsp);
+
+    rsp = migrate_query(to);
+    load = qobject_to(QDict, qlist_peek(qdict_get_qlist(
+                                        rsp, "multifd-recv-channels")));
+    g_assert(qdict_haskey(load, "queued"));
+    g_assert(qdict_haskey(load, "busy"));
+    qobject_unref(rsp);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+    test_migrate_end(from, to, true);
+}
+
+/*
+ * Spread the channels over two entries of multifd-addresses, unequally,
+ * with a source address: they are the same port here, but it is the
+ * same code as for two links.
+ */
+static void test_multifd_tcp_addresses(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    g_autofree char *uri = NULL;
+    const char *port;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+    port = strrchr(uri, ':') + 1;
+    rsp = wait_command(from, "{ 'execute': 'migrate-set-parameters',"
+                       "  'arguments': { 'multifd-addresses': ["
+                       "    { 'addr': { 'type': 'inet', 'host': '127.0.0.1',"
+                       "                'port': %s },"
+                       "      'source': '127.0.0.1' },"
+                       "    { 'addr': { 'type': 'inet', 'host': '127.0.0.1',"
+                       "                'port': %s },"
+                       "      'weight': 3 } ] } }", port, port);
+    qobject_unref(rsp);
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+    test_migrate_end(from, to, true);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp("none", "multifd-zero-page");
+}
+
+static void test_multifd_tcp_adaptive_packet_size(void)
+{
+    test_multifd_tcp("none", "multifd-adaptive-packet-size");
+}
+
+static void test_multifd_tcp_autotune(void)
+{
+    test_multifd_tcp("none", "multifd-autotune");
+}
+
+static void test_multifd_tcp_numa_affinity(void)
+{
+    test_multifd_tcp("none", "multifd-numa-affinity");
+}
+
+static void test_multifd_tcp_crc32c(void)
+{
+    test_multifd_tcp("none", "multifd-crc32c");
+}
+
+static void test_multifd_tcp_zlib_crc32c(void)
+{
+    test_multifd_tcp("zlib", "multifd-crc32c");
+}
+
+static void test_multifd_tcp_huge_page_granularity(void)
+{
+    test_multifd_tcp("none", "ram-huge-page-granularity");
 }
 
 static void test_multifd_tcp_zlib(void)
 {
-    test_multifd_tcp("zlib");
+    test_multifd_tcp("zlib", NULL);
+}
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    test_multifd_tcp("xbzrle", NULL);
+}
+
+static void test_multifd_tcp_xbzrle_zero_page(void)
+{
+    test_multifd_tcp("xbzrle", "multifd-zero-page");
 }
 
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
-    test_multifd_tcp("zstd");
+    test_multifd_tcp("zstd", NULL);
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    test_multifd_tcp("lz4", NULL);
 }
 #endif
 
@@ -1464,12 +2374,61 @@ int main(int argc, char **argv)
     module_call_init(MODULE_INIT_QOM);
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/prefetch", test_postcopy_prefetch);
+    qtest_add_func("/migration/postcopy/discard-bitmap",
+                   test_postcopy_discard_bitmap);
+    qtest_add_func("/migration/postcopy/place-batch",
+                   test_postcopy_place_batch);
+    qtest_add_func("/migration/postcopy/rate-limit", test_postcopy_rate_limit);
+    qtest_add_func("/migration/postcopy/auto", test_postcopy_auto);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/recovery/compress-bitmap",
+                   test_postcopy_recovery_compress_bitmap);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
+    qtest_add_func("/migration/precopy/unix/dirty-sync-threads",
+                   test_precopy_unix_dirty_sync_threads);
+    qtest_add_func("/migration/precopy/unix/predictive-switchover",
+                   test_precopy_unix_predictive);
+    qtest_add_func("/migration/precopy/unix/clear-dirty-log-ahead",
+                   test_precopy_unix_clear_ahead);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/precopy/tcp/stream-buffer",
+                   test_precopy_tcp_stream_buffer);
+    qtest_add_func("/migration/precopy/unix/prepopulate",
+                   test_precopy_unix_prepopulate);
+    qtest_add_func("/migration/precopy/unix/page-dedup",
+                   test_precopy_unix_page_dedup);
+    qtest_add_func("/migration/precopy/unix/release-ram",
+                   test_precopy_unix_release_ram);
+    qtest_add_func("/migration/precopy/unix/cold-first",
+                   test_precopy_unix_cold_first);
+    qtest_add_func("/migration/precopy/tcp/fair-iteration",
+                   test_precopy_tcp_fair_iteration);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
+    qtest_add_func("/migration/ram-handover", test_ram_handover);
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/xbzrle/unix/load-threads",
+                   test_xbzrle_unix_load_threads);
+    qtest_add_func("/migration/compress/unix/zlib", test_compress_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/compress/unix/zstd", test_compress_zstd);
+#endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/compress/unix/lz4", test_compress_lz4);
+#endif
+    qtest_add_func("/migration/fixed-ram/file", test_fixed_ram_file);
+    qtest_add_func("/migration/fixed-ram/file/multifd",
+                   test_fixed_ram_file_multifd);
+    qtest_add_func("/migration/fixed-ram/file/mmap",
+                   test_fixed_ram_file_mmap);
+    qtest_add_func("/migration/fixed-ram/file/postcopy",
+                   test_fixed_ram_file_postcopy);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/stream-compress/file",
+                   test_stream_compress_file);
+#endif
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
@@ -1479,16 +2438,44 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/dirty_heatmap", test_migrate_dirty_heatmap);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/flush-after-each-section",
+                   test_multifd_tcp_flush_after_each_section);
+    qtest_add_func("/migration/multifd/tcp/addresses",
+                   test_multifd_tcp_addresses);
+    qtest_add_func("/migration/multifd/tcp/backpressure",
+                   test_multifd_tcp_backpressure);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
+    qtest_add_func("/migration/multifd/tcp/adaptive-packet-size",
+                   test_multifd_tcp_adaptive_packet_size);
+    qtest_add_func("/migration/multifd/tcp/autotune",
+                   test_multifd_tcp_autotune);
+    qtest_add_func("/migration/multifd/tcp/numa-affinity",
+                   test_multifd_tcp_numa_affinity);
+    qtest_add_func("/migration/multifd/tcp/huge-page-granularity",
+                   test_multifd_tcp_huge_page_granularity);
+    qtest_add_func("/migration/multifd/tcp/crc32c", test_multifd_tcp_crc32c);
+    qtest_add_func("/migration/multifd/tcp/zlib/crc32c",
+                   test_multifd_tcp_zlib_crc32c);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+    qtest_add_func("/migration/multifd/tcp/xbzrle", test_multifd_tcp_xbzrle);
+    qtest_add_func("/migration/multifd/tcp/xbzrle/zero-page",
+                   test_multifd_tcp_xbzrle_zero_page);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/lz4", test_multifd_tcp_lz4);
+#endif
 
     if (kvm_dirty_ring_supported()) {
         qtest_add_func("/migration/dirty_ring",
                        test_precopy_unix_dirty_ring);
+        qtest_add_func("/migration/dirty_limit",
+                       test_migrate_dirty_limit);
     }
 
     ret = g_test_run();
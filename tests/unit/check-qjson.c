@@ -1151,6 +1151,41 @@ static void large_dict(void)
     g_string_free(gstr, true);
 }
 
+static void stream_append(void *opaque, const char *buf, size_t len)
+{
+    GString *gstr = opaque;
+
+    g_assert_cmpuint(strlen(buf), ==, len);
+    g_string_append_len(gstr, buf, len);
+}
+
+static void stream_dict(void)
+{
+    static const size_t chunk_sizes[] = { 1, 7, 64, 64 * 1024 };
+    GString *gstr = g_string_new("");
+    GString *json, *streamed;
+    QObject *obj;
+    int i, pretty;
+
+    gen_test_json(gstr, 10, 100);
+    obj = qobject_from_json(gstr->str, &error_abort);
+
+    for (pretty = 0; pretty < 2; pretty++) {
+        json = qobject_to_json_pretty(obj, pretty);
+        for (i = 0; i < ARRAY_SIZE(chunk_sizes); i++) {
+            streamed = g_string_new("");
+            qobject_to_json_stream(obj, pretty, chunk_sizes[i],
+                                   stream_append, streamed);
+            g_assert_cmpstr(streamed->str, ==, json->str);
+            g_string_free(streamed, true);
+        }
+        g_string_free(json, true);
+    }
+
+    qobject_unref(obj);
+    g_string_free(gstr, true);
+}
+
 static void simple_list(void)
 {
     int i;
@@ -1492,6 +1527,7 @@ int main(int argc, char **argv)
 
     g_test_add_func("/dicts/simple_dict", simple_dict);
     g_test_add_func("/dicts/large_dict", large_dict);
+    g_test_add_func("/dicts/stream", stream_dict);
     g_test_add_func("/lists/simple_list", simple_list);
 
     g_test_add_func("/mixed/simple_whitespace", simple_whitespace);
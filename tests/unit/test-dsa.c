@@ -0,0 +1,92 @@
+/*
+ * Batches of the DSA offload
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Without a device, this tests the CPU fallback.  Set QEMU_TEST_DSA_WQ
+ * to a shared work queue, like /dev/dsa/wq0.0, to test the device.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/dsa.h"
+#include "qapi/error.h"
+
+#define TEST_PAGE_SIZE 4096
+/* More than a batch descriptor, with one left over */
+#define TEST_PAGES 65
+
+static void test_dsa_init(void)
+{
+    const char *wq = getenv("QEMU_TEST_DSA_WQ");
+    strList path = { .value = (char *)wq };
+
+    if (wq) {
+        qemu_dsa_init(&path, &error_abort);
+        g_assert(qemu_dsa_is_running());
+    }
+}
+
+static void fill_pages(uint8_t *buf, struct iovec *iov)
+{
+    int i;
+
+    memset(buf, 0, TEST_PAGES * TEST_PAGE_SIZE);
+    for (i = 0; i < TEST_PAGES; i++) {
+        iov[i].iov_base = buf + i * TEST_PAGE_SIZE;
+        iov[i].iov_len = TEST_PAGE_SIZE;
+        /* Every third page is not zero, at a different place each time */
+        if (i % 3 == 0) {
+            buf[i * TEST_PAGE_SIZE + (i * 61) % TEST_PAGE_SIZE] = i + 1;
+        }
+    }
+}
+
+static void test_buffer_is_zero_batch(void)
+{
+    g_autofree uint8_t *buf = g_malloc(TEST_PAGES * TEST_PAGE_SIZE);
+    struct iovec iov[TEST_PAGES];
+    QemuDsaBatchTask *task = qemu_dsa_batch_task_new();
+    size_t count;
+    bool *zero;
+    int i;
+
+    test_dsa_init();
+    fill_pages(buf, iov);
+    for (count = 1; count <= TEST_PAGES; count += 16) {
+        zero = qemu_dsa_buffer_is_zero_batch(task, iov, count);
+        for (i = 0; i < count; i++) {
+            g_assert_cmpint(zero[i], ==, i % 3 != 0);
+        }
+    }
+    qemu_dsa_batch_task_free(task);
+    qemu_dsa_cleanup();
+}
+
+static void test_fill_zero_batch(void)
+{
+    g_autofree uint8_t *buf = g_malloc(TEST_PAGES * TEST_PAGE_SIZE);
+    struct iovec iov[TEST_PAGES];
+    QemuDsaBatchTask *task = qemu_dsa_batch_task_new();
+
+    test_dsa_init();
+    fill_pages(buf, iov);
+    /* Page 63 is not zero and is left out */
+    qemu_dsa_fill_zero_batch(task, iov, 63);
+    g_assert(buffer_is_zero(buf, 63 * TEST_PAGE_SIZE));
+    g_assert(!buffer_is_zero(iov[63].iov_base, TEST_PAGE_SIZE));
+    qemu_dsa_batch_task_free(task);
+    qemu_dsa_cleanup();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/dsa/buffer-is-zero-batch", test_buffer_is_zero_batch);
+    g_test_add_func("/dsa/fill-zero-batch", test_fill_zero_batch);
+
+    return g_test_run();
+}
@@ -398,6 +398,39 @@ static void test_hbitmap_reset_all(TestHBitmapData *data,
     hbitmap_test_reset_all(data);
 }
 
+static void test_hbitmap_meta(TestHBitmapData *data,
+                              const void *unused)
+{
+    HBitmap *meta;
+
+    hbitmap_test_init(data, L3 * 2, 1);
+    hbitmap_test_set(data, 0, L2);
+    meta = hbitmap_create_meta(data->hb, L1);
+    g_assert_cmpint(hbitmap_count(meta), ==, 0);
+
+    /* Setting bits that are already set does not change anything */
+    hbitmap_set(data->hb, 0, L1);
+    g_assert_cmpint(hbitmap_count(meta), ==, 0);
+
+    hbitmap_test_reset(data, L1 * 2 + 6, 2);
+    g_assert(hbitmap_get(meta, L1 * 2));
+    g_assert(hbitmap_get(meta, L1 * 3 - 1));
+    g_assert_cmpint(hbitmap_count(meta), ==, L1 * 2);
+
+    hbitmap_test_set(data, L3 - 1, 2);
+    g_assert_cmpint(hbitmap_count(meta), ==, L1 * 6);
+
+    /* Merging marks the chunks where the other bitmap has bits */
+    hbitmap_reset_all(meta);
+    hbitmap_merge(meta, data->hb, meta);
+    g_assert_cmpint(hbitmap_count(meta), ==, L2 + L1 * 4);
+
+    hbitmap_test_truncate_impl(data, L3);
+    g_assert_cmpint(hbitmap_count(meta), ==, L2 + L1 * 2);
+
+    hbitmap_free_meta(data->hb);
+}
+
 static void test_hbitmap_granularity(TestHBitmapData *data,
                                      const void *unused)
 {
@@ -962,6 +995,54 @@ static void test_hbitmap_next_dirty_area_check(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check_limited(data, offset, count, INT64_MAX);
 }
 
+static void test_hbitmap_next_dirty_areas(TestHBitmapData *data,
+                                          const void *unused)
+{
+    int64_t starts[3], counts[3];
+    int64_t offset, count;
+    int i, n;
+
+    hbitmap_test_init(data, L3, 0);
+    g_assert_cmpint(hbitmap_next_dirty_areas(data->hb, 0, INT64_MAX, INT64_MAX,
+                                             3, starts, counts), ==, 0);
+
+    hbitmap_set(data->hb, 5, 1);
+    hbitmap_set(data->hb, L1 + 3, L1);
+    hbitmap_set(data->hb, L2, L2 * 2);
+    hbitmap_set(data->hb, L3 - 1, 1);
+
+    /* Long runs of set words, with a zero in the middle of one */
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2, INT64_MAX), ==, L2 * 3);
+    hbitmap_reset(data->hb, L2 + L1 * 13 + 7, 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2, INT64_MAX), ==,
+                    L2 + L1 * 13 + 7);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + L1 * 13 + 8, INT64_MAX),
+                    ==, L2 * 3);
+
+    n = hbitmap_next_dirty_areas(data->hb, 0, INT64_MAX, L2, 3, starts, counts);
+    g_assert_cmpint(n, ==, 3);
+
+    /* The same as calling hbitmap_next_dirty_area() repeatedly */
+    offset = 0;
+    for (i = 0; i < n; i++) {
+        g_assert(hbitmap_next_dirty_area(data->hb, offset, INT64_MAX, L2,
+                                         &offset, &count));
+        g_assert_cmpint(starts[i], ==, offset);
+        g_assert_cmpint(counts[i], ==, count);
+        offset += count;
+    }
+    g_assert_cmpint(starts[2], ==, L2);
+    g_assert_cmpint(counts[2], ==, L1 * 13 + 7);
+
+    n = hbitmap_next_dirty_areas(data->hb, L2 * 2, L3, INT64_MAX, 3,
+                                 starts, counts);
+    g_assert_cmpint(n, ==, 2);
+    g_assert_cmpint(starts[0], ==, L2 * 2);
+    g_assert_cmpint(counts[0], ==, L2);
+    g_assert_cmpint(starts[1], ==, L3 - 1);
+    g_assert_cmpint(counts[1], ==, 1);
+}
+
 static void test_hbitmap_next_dirty_area_do(TestHBitmapData *data,
                                             int granularity)
 {
@@ -1062,6 +1143,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/meta", test_hbitmap_meta);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
@@ -1112,6 +1194,8 @@ int main(int argc, char **argv)
                      test_hbitmap_next_dirty_area_4);
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
+    hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_areas",
+                     test_hbitmap_next_dirty_areas);
 
     g_test_run();
 
@@ -0,0 +1,118 @@
+/*
+ * Page cache unit tests.
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "../migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+/* 2 sets of 8 ways */
+#define CACHE_PAGES 16
+#define CACHE_WAYS 8
+#define CACHE_SETS (CACHE_PAGES / CACHE_WAYS)
+
+/* address of the @n-th page that goes to the first set */
+static uint64_t set0_addr(int n)
+{
+    return (uint64_t)n * CACHE_SETS * PAGE_SIZE;
+}
+
+static void test_init(void)
+{
+    Error *err = NULL;
+
+    g_assert_null(cache_init(PAGE_SIZE - 1, PAGE_SIZE, false, -1, &err));
+    error_free_or_abort(&err);
+    g_assert_null(cache_init(3 * PAGE_SIZE, PAGE_SIZE, false, -1, &err));
+    error_free_or_abort(&err);
+
+    /* a cache smaller than a set is a single set */
+    cache_fini(cache_init(PAGE_SIZE, PAGE_SIZE, false, -1, &error_abort));
+}
+
+static void test_insert(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE, false,
+                                  -1, &error_abort);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    /* pages of the same set don't evict each other */
+    for (i = 0; i < CACHE_WAYS; i++) {
+        memset(page, i, PAGE_SIZE);
+        g_assert_cmpint(cache_insert(cache, set0_addr(i), page, 1), ==, 0);
+    }
+    for (i = 0; i < CACHE_WAYS; i++) {
+        memset(page, i, PAGE_SIZE);
+        g_assert_true(cache_is_cached(cache, set0_addr(i), 1));
+        g_assert_cmpmem(get_cached_data(cache, set0_addr(i)), PAGE_SIZE,
+                        page, PAGE_SIZE);
+    }
+
+    /* the set is full of fresh pages */
+    g_assert_cmpint(cache_insert(cache, set0_addr(CACHE_WAYS), page, 1),
+                    ==, -1);
+    g_assert_false(cache_is_cached(cache, set0_addr(CACHE_WAYS), 1));
+    g_assert_null(get_cached_data(cache, set0_addr(CACHE_WAYS)));
+
+    /* the other set is still empty */
+    g_assert_cmpint(cache_insert(cache, PAGE_SIZE, page, 1), ==, 0);
+
+    /* updating a cached page doesn't need a free way */
+    memset(page, 0xff, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, set0_addr(0), page, 1), ==, 0);
+    g_assert_cmpmem(get_cached_data(cache, set0_addr(0)), PAGE_SIZE,
+                    page, PAGE_SIZE);
+
+    cache_fini(cache);
+}
+
+static void test_replace(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE, false,
+                                  -1, &error_abort);
+    uint8_t page[PAGE_SIZE] = { 0 };
+    int i;
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        g_assert_cmpint(cache_insert(cache, set0_addr(i), page, 1), ==, 0);
+    }
+    /* the odd pages stay hot */
+    for (i = 1; i < CACHE_WAYS; i += 2) {
+        g_assert_true(cache_is_cached(cache, set0_addr(i), 5));
+    }
+
+    /* the cold pages are replaced first, and in turn */
+    for (i = 0; i < CACHE_WAYS / 2; i++) {
+        g_assert_cmpint(cache_insert(cache, set0_addr(CACHE_WAYS + i), page,
+                                     5), ==, 0);
+        g_assert_false(cache_is_cached(cache, set0_addr(2 * i), 5));
+    }
+    for (i = 1; i < CACHE_WAYS; i += 2) {
+        g_assert_true(cache_is_cached(cache, set0_addr(i), 5));
+    }
+
+    /* now every page of the set is fresh */
+    g_assert_cmpint(cache_insert(cache, set0_addr(2 * CACHE_WAYS), page, 5),
+                    ==, -1);
+    /* until they get old enough */
+    g_assert_cmpint(cache_insert(cache, set0_addr(2 * CACHE_WAYS), page, 7),
+                    ==, 0);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/init", test_init);
+    g_test_add_func("/page_cache/insert", test_insert);
+    g_test_add_func("/page_cache/replace", test_replace);
+
+    return g_test_run();
+}
@@ -671,6 +671,28 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_account_ahead(void)
+{
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 100;
+
+    throttle_init(&ts);
+    throttle_timers_init(tt, ctx, QEMU_CLOCK_VIRTUAL,
+                         read_timer_cb, write_timer_cb, &ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* The bucket holds avg / 10 operations, and one more fits while full */
+    g_assert(throttle_account_ahead(&ts, false, 512, 4) == 4);
+    g_assert(throttle_account_ahead(&ts, true, 512, 100) == 7);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 11));
+
+    /* Now every operation has to wait */
+    g_assert(throttle_account_ahead(&ts, false, 512, 100) == 0);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 11));
+
+    throttle_timers_destroy(tt);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -764,6 +786,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/account_ahead",      test_account_ahead);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
@@ -334,6 +334,85 @@ static void test_simple_array(void)
                          sizeof(wire_simple_arr)));
 }
 
+/*
+ * u32_1, u32_2 and u32_arr are saved and loaded as one run, and so are
+ * u16_arr and u16_1; u8_1 sits between them.
+ */
+typedef struct TestSimpleRuns {
+    uint32_t u32_1;
+    uint32_t u32_2;
+    uint32_t u32_arr[2];
+    uint8_t  u8_1;
+    uint16_t u16_arr[2];
+    uint16_t u16_1;
+    uint64_t u64_1;
+} TestSimpleRuns;
+
+TestSimpleRuns obj_simple_runs = {
+    .u32_1 = 0x01020304,
+    .u32_2 = 0x05060708,
+    .u32_arr = { 0x090a0b0c, 0x0d0e0f10 },
+    .u8_1 = 0x11,
+    .u16_arr = { 0x1213, 0x1415 },
+    .u16_1 = 0x1617,
+    .u64_1 = 0x18191a1b1c1d1e1fULL,
+};
+
+static const VMStateDescription vmstate_simple_runs = {
+    .name = "simple/runs",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(u32_1, TestSimpleRuns),
+        VMSTATE_UINT32(u32_2, TestSimpleRuns),
+        VMSTATE_UINT32_ARRAY(u32_arr, TestSimpleRuns, 2),
+        VMSTATE_UINT8(u8_1, TestSimpleRuns),
+        VMSTATE_UINT16_ARRAY(u16_arr, TestSimpleRuns, 2),
+        VMSTATE_UINT16(u16_1, TestSimpleRuns),
+        VMSTATE_UINT64(u64_1, TestSimpleRuns),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+uint8_t wire_simple_runs[] = {
+    /* u32_1 */   0x01, 0x02, 0x03, 0x04,
+    /* u32_2 */   0x05, 0x06, 0x07, 0x08,
+    /* u32_arr */ 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+    /* u8_1 */    0x11,
+    /* u16_arr */ 0x12, 0x13, 0x14, 0x15,
+    /* u16_1 */   0x16, 0x17,
+    /* u64_1 */   0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_simple_runs_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestSimpleRuns));
+}
+
+static void test_simple_runs(void)
+{
+    TestSimpleRuns obj, obj_clone;
+
+    memset(&obj, 0, sizeof(obj));
+    save_vmstate(&vmstate_simple_runs, &obj_simple_runs);
+
+    compare_vmstate(wire_simple_runs, sizeof(wire_simple_runs));
+
+    SUCCESS(load_vmstate(&vmstate_simple_runs, &obj, &obj_clone,
+                         obj_simple_runs_copy, 1, wire_simple_runs,
+                         sizeof(wire_simple_runs)));
+    g_assert_cmpint(obj.u32_1, ==, obj_simple_runs.u32_1);
+    g_assert_cmpint(obj.u32_2, ==, obj_simple_runs.u32_2);
+    g_assert_cmpint(obj.u32_arr[0], ==, obj_simple_runs.u32_arr[0]);
+    g_assert_cmpint(obj.u32_arr[1], ==, obj_simple_runs.u32_arr[1]);
+    g_assert_cmpint(obj.u8_1, ==, obj_simple_runs.u8_1);
+    g_assert_cmpint(obj.u16_arr[0], ==, obj_simple_runs.u16_arr[0]);
+    g_assert_cmpint(obj.u16_arr[1], ==, obj_simple_runs.u16_arr[1]);
+    g_assert_cmpint(obj.u16_1, ==, obj_simple_runs.u16_1);
+    g_assert_cmpint(obj.u64_1, ==, obj_simple_runs.u64_1);
+}
+
 typedef struct TestStruct {
     uint32_t a, b, c, e;
     uint64_t d, f;
@@ -1497,6 +1576,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
     g_test_add_func("/vmstate/simple/array", test_simple_array);
+    g_test_add_func("/vmstate/simple/runs", test_simple_runs);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
@@ -174,6 +174,71 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_ITERATIONS 1000
+
+static void encode_decode_accel(GRand *rand, int *expected, bool first)
+{
+    uint8_t *old = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    int i, j;
+
+    for (i = 0; i < ACCEL_ITERATIONS; i++) {
+        int changes = g_rand_int_range(rand, 0, 200);
+        int dlen = g_rand_int_range(rand, 0, XBZRLE_PAGE_SIZE + 1);
+        int rc;
+
+        for (j = 0; j < XBZRLE_PAGE_SIZE; j++) {
+            old[j] = new[j] = g_rand_int(rand);
+        }
+        for (j = 0; j < changes; j++) {
+            int start = g_rand_int_range(rand, 0, XBZRLE_PAGE_SIZE);
+            int len = g_rand_int_range(rand, 1, 70);
+
+            for (; len && start < XBZRLE_PAGE_SIZE; len--, start++) {
+                new[start] ^= g_rand_int_range(rand, 1, 256);
+            }
+        }
+
+        rc = xbzrle_encode_buffer(old, new, XBZRLE_PAGE_SIZE, compressed,
+                                  dlen);
+        if (first) {
+            expected[i] = rc;
+        }
+        g_assert_cmpint(rc, ==, expected[i]);
+        if (rc > 0) {
+            g_assert_cmpint(xbzrle_decode_buffer(compressed, rc, old,
+                                                 XBZRLE_PAGE_SIZE),
+                            ==, XBZRLE_PAGE_SIZE);
+        }
+        if (rc >= 0) {
+            g_assert(memcmp(old, new, XBZRLE_PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+static void test_encode_decode_accel(void)
+{
+    int *expected = g_new(int, ACCEL_ITERATIONS);
+    uint32_t seed = g_test_rand_int();
+    bool first = true;
+
+    /* every implementation must produce the same stream */
+    do {
+        GRand *rand = g_rand_new_with_seed(seed);
+
+        encode_decode_accel(rand, expected, first);
+        g_rand_free(rand);
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(expected);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +251,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
@@ -44,19 +44,43 @@ static GCond trace_empty_cond;
 static bool trace_available;
 static bool trace_writeout_enabled;
 
+/*
+ * Each thread has its own ring buffer, so that threads that trace at the
+ * same time do not fight over a cache line or over buffer space.  The
+ * writeout thread merges the records of all buffers by timestamp.
+ *
+ * Buffers are never freed.  When a thread exits, its buffer is drained and
+ * then adopted by the next thread that starts tracing.
+ */
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+typedef struct TraceBuffer {
+    uint8_t buf[TRACE_BUF_LEN];
+    volatile gint idx;          /* reserved by the owner thread */
+    volatile gint writeout_idx; /* consumed by the writeout thread */
+    volatile gint orphan;       /* the owner thread exited */
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+static TraceBuffer *trace_buffers;
+static __thread TraceBuffer *trace_thread_buf;
 static volatile gint dropped_events;
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
 
+static void trace_thread_exit(gpointer opaque)
+{
+    TraceBuffer *tb = opaque;
+
+    g_atomic_int_set(&tb->orphan, 1);
+}
+
+static GPrivate trace_thread_key = G_PRIVATE_INIT(trace_thread_exit);
+
 #define TRACE_RECORD_TYPE_MAPPING 0
 #define TRACE_RECORD_TYPE_EVENT   1
 
@@ -76,53 +100,112 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceBuffer *tb, unsigned int idx,
+                             void *dataptr, size_t size);
+static unsigned int write_to_buffer(TraceBuffer *tb, unsigned int idx,
+                                    void *dataptr, size_t size);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void clear_buffer_range(TraceBuffer *tb, unsigned int idx, size_t len)
 {
     uint32_t num = 0;
     while (num < len) {
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = 0;
+        tb->buf[idx++] = 0;
         num++;
     }
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Get the buffer of the current thread, allocating it on first use
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * Returns NULL if no memory is available.
+ */
+static TraceBuffer *get_thread_buffer(void)
+{
+    TraceBuffer *tb = trace_thread_buf;
+
+    if (likely(tb)) {
+        return tb;
+    }
+
+    /* Adopt the drained buffer of a thread that exited */
+    for (tb = g_atomic_pointer_get(&trace_buffers); tb; tb = tb->next) {
+        if (g_atomic_int_get(&tb->orphan) &&
+            g_atomic_int_get(&tb->idx) == g_atomic_int_get(&tb->writeout_idx) &&
+            g_atomic_int_compare_and_exchange(&tb->orphan, 1, 0)) {
+            break;
+        }
+    }
+
+    if (!tb) {
+        /* don't use g_malloc, can deadlock when traced */
+        tb = calloc(1, sizeof(*tb));
+        if (!tb) {
+            return NULL;
+        }
+        do {
+            tb->next = g_atomic_pointer_get(&trace_buffers);
+        } while (!g_atomic_pointer_compare_and_exchange(&trace_buffers,
+                                                        tb->next, tb));
+    }
+
+    trace_thread_buf = tb;
+    g_private_set(&trace_thread_key, tb);
+    return tb;
+}
+
+/**
+ * Read the header of the next trace record of a buffer
+ *
+ * @tb          Trace buffer
+ * @record      Trace record header to fill
  *
- * Returns false if the record is not valid.
+ * Returns false if there is no valid record.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static bool peek_trace_record(TraceBuffer *tb, TraceRecord *record)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
+    unsigned int idx = g_atomic_int_get(&tb->writeout_idx) % TRACE_BUF_LEN;
+
     /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    read_from_buffer(tb, idx, record, sizeof(record->event));
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
+    if (!(record->event & TRACE_RECORD_VALID)) {
         return false;
     }
 
     smp_rmb(); /* read memory barrier before accessing record */
     /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
+    read_from_buffer(tb, idx, record, sizeof(TraceRecord));
+    return true;
+}
+
+/**
+ * Read the next trace record of a buffer, which must be valid, and
+ * release its space
+ *
+ * @tb          Trace buffer
+ * @length      Record length, from peek_trace_record()
+ * @recordptr   Trace record to fill
+ */
+static void get_trace_record(TraceBuffer *tb, uint32_t length,
+                             TraceRecord **recordptr)
+{
+    unsigned int writeout_idx = g_atomic_int_get(&tb->writeout_idx);
+    unsigned int idx = writeout_idx % TRACE_BUF_LEN;
+
+    *recordptr = malloc(length); /* don't use g_malloc, can deadlock when traced */
     /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
+    read_from_buffer(tb, idx, *recordptr, length);
     smp_rmb(); /* memory barrier before clearing valid flag */
     (*recordptr)->event &= ~TRACE_RECORD_VALID;
     /* clear the trace buffer range for consumed record otherwise any byte
      * with its MSB set may be considered as a valid event id when the writer
      * thread crosses this range of buffer again.
      */
-    clear_buffer_range(idx, record.length);
-    return true;
+    clear_buffer_range(tb, idx, length);
+    g_atomic_int_set(&tb->writeout_idx, writeout_idx + length);
 }
 
 /**
@@ -161,7 +244,6 @@ static gpointer writeout_thread(gpointer opaque)
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
     int dropped_count;
     size_t unused __attribute__ ((unused));
     uint64_t type = TRACE_RECORD_TYPE_EVENT;
@@ -183,12 +265,29 @@ static gpointer writeout_thread(gpointer opaque)
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
+        /* Write out the oldest record of all buffers, until none is left */
+        for (;;) {
+            TraceBuffer *tb, *oldest = NULL;
+            TraceRecord record;
+            uint64_t oldest_ns = UINT64_MAX;
+            uint32_t oldest_length = 0;
+
+            for (tb = g_atomic_pointer_get(&trace_buffers); tb; tb = tb->next) {
+                if (peek_trace_record(tb, &record) &&
+                    (!oldest || record.timestamp_ns < oldest_ns)) {
+                    oldest = tb;
+                    oldest_ns = record.timestamp_ns;
+                    oldest_length = record.length;
+                }
+            }
+            if (!oldest) {
+                break;
+            }
+
+            get_trace_record(oldest, oldest_length, &recordptr);
             unused = fwrite(&type, sizeof(type), 1, trace_fp);
             unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
             free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
         }
 
         fflush(trace_fp);
@@ -198,50 +297,65 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, &val,
+                                   sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, &slen,
+                                   sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, (void*)s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
 {
+    TraceBuffer *tb = get_thread_buffer();
     unsigned int idx, rec_off, old_idx, new_idx;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
     uint64_t event_u64 = event;
     uint64_t timestamp_ns = get_clock();
 
+    if (!tb) {
+        g_atomic_int_inc(&dropped_events);
+        return -ENOSPC;
+    }
+
+    /*
+     * Only the owner thread reserves space, but a signal handler may
+     * trace in the middle of another record.
+     */
     do {
-        old_idx = g_atomic_int_get(&trace_idx);
+        old_idx = g_atomic_int_get(&tb->idx);
         smp_rmb();
         new_idx = old_idx + rec_len;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+        if (new_idx - (unsigned int)g_atomic_int_get(&tb->writeout_idx)
+            > TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
             g_atomic_int_inc(&dropped_events);
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
+    } while (!g_atomic_int_compare_and_exchange(&tb->idx, old_idx, new_idx));
 
     idx = old_idx % TRACE_BUF_LEN;
 
     rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    rec_off = write_to_buffer(tb, rec_off, &event_u64, sizeof(event_u64));
+    rec_off = write_to_buffer(tb, rec_off, &timestamp_ns, sizeof(timestamp_ns));
+    rec_off = write_to_buffer(tb, rec_off, &rec_len, sizeof(rec_len));
+    rec_off = write_to_buffer(tb, rec_off, &trace_pid, sizeof(trace_pid));
 
+    rec->tbuf = tb;
     rec->tbuf_idx = idx;
     rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+static void read_from_buffer(TraceBuffer *tb, unsigned int idx,
+                             void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -249,11 +363,12 @@ static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        data_ptr[x++] = trace_buf[idx++];
+        data_ptr[x++] = tb->buf[idx++];
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(TraceBuffer *tb, unsigned int idx,
+                                    void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -261,20 +376,22 @@ static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = data_ptr[x++];
+        tb->buf[idx++] = data_ptr[x++];
     }
     return idx; /* most callers wants to know where to write next */
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
+    TraceBuffer *tb = rec->tbuf;
     TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    read_from_buffer(tb, rec->tbuf_idx, &record, sizeof(TraceRecord));
     smp_wmb(); /* write barrier before marking as valid */
     record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    write_to_buffer(tb, rec->tbuf_idx, &record, sizeof(TraceRecord));
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
+    if ((unsigned int)g_atomic_int_get(&tb->idx) -
+        (unsigned int)g_atomic_int_get(&tb->writeout_idx)
         > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
@@ -3073,6 +3073,55 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Copy @len bytes from @src to @dst if they differ, return true if they
+ * did.  The bytes before the first difference are equal already, so only
+ * the rest is copied.
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static bool vnc_copy_if_changed(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        const __m128i *d = (const __m128i *)(dst + i);
+        const __m128i *s = (const __m128i *)(src + i);
+        __m128i eq;
+
+        eq = _mm_and_si128(
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128(d), _mm_loadu_si128(s)),
+                _mm_cmpeq_epi8(_mm_loadu_si128(d + 1),
+                               _mm_loadu_si128(s + 1))),
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128(d + 2),
+                               _mm_loadu_si128(s + 2)),
+                _mm_cmpeq_epi8(_mm_loadu_si128(d + 3),
+                               _mm_loadu_si128(s + 3))));
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            memcpy(dst + i, src + i, len - i);
+            return true;
+        }
+    }
+    if (memcmp(dst + i, src + i, len - i) == 0) {
+        return false;
+    }
+    memcpy(dst + i, src + i, len - i);
+    return true;
+}
+#else
+static bool vnc_copy_if_changed(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    if (memcmp(dst, src, len) == 0) {
+        return false;
+    }
+    memcpy(dst, src, len);
+    return true;
+}
+#endif
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -3080,7 +3129,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     int height = MIN(pixman_image_get_height(vd->guest.fb),
                      pixman_image_get_height(vd->server));
     int cmp_bytes, server_stride, line_bytes, guest_ll, guest_stride, y = 0;
-    uint8_t *guest_row0 = NULL, *server_row0;
+    uint8_t *guest_row0 = NULL, *guest_row, *server_row0;
     VncState *vs;
     int has_dirty = 0;
     pixman_image_t *tmpbuf = NULL;
@@ -3116,7 +3165,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
-        int x;
+        int x, x0, x_end = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
@@ -3128,30 +3177,37 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         y = offset / VNC_DIRTY_BPL(&vd->guest);
         x = offset % VNC_DIRTY_BPL(&vd->guest);
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        if (x >= x_end) {
+            y++;
+            continue;
+        }
 
+        x0 = 0;
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
-            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
-            guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
+            /* Only convert the line from the first dirty chunk on */
+            x0 = x;
+            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb,
+                                     width - x0 * VNC_DIRTY_PIXELS_PER_BIT,
+                                     x0 * VNC_DIRTY_PIXELS_PER_BIT, y);
+            guest_row = (uint8_t *)pixman_image_get_data(tmpbuf);
         } else {
-            guest_ptr = guest_row0 + y * guest_stride;
+            guest_row = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
+        /* Visit the dirty chunks of the line only */
+        for (; x < x_end; x = find_next_bit(vd->guest.dirty[y], x_end, x + 1)) {
             int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
+
+            clear_bit(x, vd->guest.dirty[y]);
+            server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+            guest_ptr = guest_row + (x - x0) * cmp_bytes;
             if ((x + 1) * cmp_bytes > line_bytes) {
                 _cmp_bytes = line_bytes - x * cmp_bytes;
             }
             assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (!vnc_copy_if_changed(server_ptr, guest_ptr, _cmp_bytes)) {
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
             if (!vd->non_adaptive) {
                 vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
                                  y, &tv);
@@ -250,6 +250,8 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    /* a worker thread is encoding the job */
+    bool running;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -134,6 +134,7 @@ void aio_set_fd_handler(AioContext *ctx,
             new_node->pfd.fd = fd;
         } else {
             new_node->pfd = node->pfd;
+            new_node->poll_ns = node->poll_ns;
         }
         g_source_add_poll(&ctx->source, &new_node->pfd);
 
@@ -388,6 +389,7 @@ void aio_dispatch(AioContext *ctx)
 
 static bool run_poll_handlers_once(AioContext *ctx,
                                    int64_t now,
+                                   int64_t elapsed_time,
                                    int64_t *timeout)
 {
     bool progress = false;
@@ -395,6 +397,10 @@ static bool run_poll_handlers_once(AioContext *ctx,
     AioHandler *tmp;
 
     QLIST_FOREACH_SAFE(node, &ctx->poll_aio_handlers, node_poll, tmp) {
+        /* Past its polling time, the handler is left to fd monitoring */
+        if (elapsed_time > node->poll_ns) {
+            continue;
+        }
         if (aio_node_check(ctx, node->is_external) &&
             node->io_poll(node->opaque)) {
             node->poll_idle_timeout = now + POLL_IDLE_INTERVAL_NS;
@@ -489,8 +495,10 @@ static bool run_poll_handlers(AioContext *ctx, int64_t max_ns, int64_t *timeout)
     RCU_READ_LOCK_GUARD();
 
     start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    elapsed_time = 0;
     do {
-        progress = run_poll_handlers_once(ctx, start_time, timeout);
+        progress = run_poll_handlers_once(ctx, start_time, elapsed_time,
+                                          timeout);
         elapsed_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
         max_ns = qemu_soonest_timeout(*timeout, max_ns);
         assert(!(max_ns && progress));
@@ -534,8 +542,10 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
         poll_set_started(ctx, true);
 
         if (run_poll_handlers(ctx, max_ns, timeout)) {
+            stat64_add(&ctx->poll_hits, 1);
             return true;
         }
+        stat64_add(&ctx->poll_misses, 1);
     }
 
     if (poll_set_started(ctx, false)) {
@@ -546,6 +556,80 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
     return false;
 }
 
+/* We'd have to poll for too long, poll less */
+static void shrink_polling_time(AioContext *ctx, AioHandler *node)
+{
+    int64_t old = node->poll_ns;
+
+    if (ctx->poll_shrink) {
+        node->poll_ns /= ctx->poll_shrink;
+    } else {
+        node->poll_ns = 0;
+    }
+
+    trace_poll_shrink(ctx, node, old, node->poll_ns);
+}
+
+/* There is room to grow, poll longer */
+static void grow_polling_time(AioContext *ctx, AioHandler *node)
+{
+    int64_t old = node->poll_ns;
+    int64_t grow = ctx->poll_grow;
+
+    if (grow == 0) {
+        grow = 2;
+    }
+
+    if (node->poll_ns) {
+        node->poll_ns *= grow;
+    } else {
+        node->poll_ns = 4000; /* start polling at 4 microseconds */
+    }
+
+    if (node->poll_ns > ctx->poll_max_ns) {
+        node->poll_ns = ctx->poll_max_ns;
+    }
+
+    trace_poll_grow(ctx, node, old, node->poll_ns);
+}
+
+/*
+ * Each handler has its own polling time.  It grows when the handler gets
+ * an event soon after polling stopped.  When nothing happened for more than
+ * poll_max_ns, all the polling times shrink.  So the handlers that don't
+ * fire while they are polled stop being polled, and the AioContext only
+ * polls as long as its busiest handler needs.
+ */
+static void adjust_polling_time(AioContext *ctx, AioHandlerList *ready_list,
+                                int64_t block_ns)
+{
+    AioHandler *node;
+    int64_t poll_ns = 0;
+
+    if (block_ns > ctx->poll_max_ns) {
+        QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+            if (node->poll_ns) {
+                shrink_polling_time(ctx, node);
+            }
+        }
+    } else {
+        QLIST_FOREACH(node, ready_list, node_ready) {
+            /* Below its own polling time is the sweet spot */
+            if (QLIST_IS_INSERTED(node, node_poll) &&
+                block_ns > node->poll_ns && node->poll_ns < ctx->poll_max_ns) {
+                grow_polling_time(ctx, node);
+            }
+        }
+    }
+
+    QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+        /* poll_max_ns may have been lowered since it grew */
+        node->poll_ns = MIN(node->poll_ns, ctx->poll_max_ns);
+        poll_ns = MAX(poll_ns, node->poll_ns);
+    }
+    ctx->poll_ns = poll_ns;
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
@@ -619,41 +703,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     if (ctx->poll_max_ns) {
         int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
 
-        if (block_ns <= ctx->poll_ns) {
-            /* This is the sweet spot, no adjustment needed */
-        } else if (block_ns > ctx->poll_max_ns) {
-            /* We'd have to poll for too long, poll less */
-            int64_t old = ctx->poll_ns;
-
-            if (ctx->poll_shrink) {
-                ctx->poll_ns /= ctx->poll_shrink;
-            } else {
-                ctx->poll_ns = 0;
-            }
-
-            trace_poll_shrink(ctx, old, ctx->poll_ns);
-        } else if (ctx->poll_ns < ctx->poll_max_ns &&
-                   block_ns < ctx->poll_max_ns) {
-            /* There is room to grow, poll longer */
-            int64_t old = ctx->poll_ns;
-            int64_t grow = ctx->poll_grow;
-
-            if (grow == 0) {
-                grow = 2;
-            }
-
-            if (ctx->poll_ns) {
-                ctx->poll_ns *= grow;
-            } else {
-                ctx->poll_ns = 4000; /* start polling at 4 microseconds */
-            }
-
-            if (ctx->poll_ns > ctx->poll_max_ns) {
-                ctx->poll_ns = ctx->poll_max_ns;
-            }
-
-            trace_poll_grow(ctx, old, ctx->poll_ns);
-        }
+        adjust_polling_time(ctx, &ready_list, block_ns);
     }
 
     progress |= aio_bh_poll(ctx);
@@ -661,6 +711,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     if (ret > 0) {
         progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
     }
+    progress |= fdmon_io_uring_dispatch(ctx);
 
     aio_free_deleted_handlers(ctx);
 
@@ -418,7 +418,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx->io_uring_sqpoll, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -434,6 +434,22 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
 }
 #endif
 
+void aio_context_set_io_uring_sqpoll(AioContext *ctx, bool sqpoll,
+                                     Error **errp)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring && sqpoll != ctx->io_uring_sqpoll) {
+        error_setg(errp, "io_uring is already in use by this AioContext");
+        return;
+    }
+    ctx->io_uring_sqpoll = sqpoll;
+#else
+    if (sqpoll) {
+        error_setg(errp, "io_uring is not supported by this build of QEMU");
+    }
+#endif
+}
+
 void aio_notify(AioContext *ctx)
 {
     /*
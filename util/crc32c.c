@@ -105,11 +105,102 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_update_table(uint32_t crc, const uint8_t *data,
+                                    unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+/*
+ * The CRC32 instructions of SSE 4.2 and ARMv8 compute the same reflected
+ * CRC as the table, eight bytes at a time.
+ */
+#ifdef CONFIG_CRC32C_SSE42
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#include <nmmintrin.h>
+
+static uint32_t crc32c_update_sse42(uint32_t crc, const uint8_t *data,
+                                    unsigned int length)
+{
+    uint64_t crc64 = crc;
+
+    while (length && ((uintptr_t)data & 7)) {
+        crc64 = _mm_crc32_u8(crc64, *data++);
+        length--;
+    }
+    while (length >= 8) {
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)data);
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc64 = _mm_crc32_u8(crc64, *data++);
+    }
+    return crc64;
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_CRC32C_SSE42 */
+
+#ifdef CONFIG_CRC32C_ARMV8
+#include <arm_acle.h>
+
+static uint32_t __attribute__((target("+crc")))
+crc32c_update_armv8(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    while (length && ((uintptr_t)data & 7)) {
+        crc = __crc32cb(crc, *data++);
+        length--;
+    }
+    while (length >= 8) {
+        crc = __crc32cd(crc, *(const uint64_t *)data);
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#endif /* CONFIG_CRC32C_ARMV8 */
+
+static uint32_t (*crc32c_update)(uint32_t, const uint8_t *, unsigned int) =
+    crc32c_update_table;
+
+#if defined(CONFIG_CRC32C_SSE42)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) crc32c_init_accel(void)
+{
+    int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (c & bit_SSE4_2) {
+            crc32c_update = crc32c_update_sse42;
+        }
+    }
+}
+#elif defined(CONFIG_CRC32C_ARMV8)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+static void __attribute__((constructor)) crc32c_init_accel(void)
+{
+    if (qemu_getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_update = crc32c_update_armv8;
+    }
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_update(crc, data, length) ^ 0xffffffff;
 }
 
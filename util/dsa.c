@@ -0,0 +1,330 @@
+/*
+ * Offload of memory operations to Intel DSA
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/dsa.h"
+#include "qapi/error.h"
+
+#ifdef CONFIG_DSA_OPT
+#include <linux/idxd.h>
+#endif
+
+struct QemuDsaBatchTask {
+    /* number of buffers that the arrays have room for */
+    size_t size;
+    bool *results;
+#ifdef CONFIG_DSA_OPT
+    /* one descriptor and completion record per buffer */
+    struct dsa_hw_desc *descs;
+    struct dsa_completion_record *comps;
+    /* one batch descriptor per DSA_BATCH_MAX buffers */
+    struct dsa_hw_desc *batch_descs;
+    struct dsa_completion_record *batch_comps;
+#endif
+};
+
+#ifdef CONFIG_DSA_OPT
+#include "qemu/cpuid.h"
+
+#pragma GCC push_options
+#pragma GCC target("enqcmd")
+#include <immintrin.h>
+
+#define DSA_WQ_PORTAL_SIZE 4096
+#define DSA_MAX_DEVICES 16
+/* Buffers per batch descriptor, all the devices support that many */
+#define DSA_BATCH_MAX 32
+/* ENQCMD fails while the shared work queue is full */
+#define DSA_SUBMIT_RETRIES 1000
+
+static struct {
+    int fd[DSA_MAX_DEVICES];
+    void *portal[DSA_MAX_DEVICES];
+    int nr_devices;
+    /* device that gets the next batch */
+    unsigned int next;
+} dsa;
+
+static bool dsa_submit(struct dsa_hw_desc *desc)
+{
+    void *portal = dsa.portal[qatomic_fetch_inc(&dsa.next) % dsa.nr_devices];
+    int i;
+
+    /* The device reads the descriptors that the batch points to */
+    _mm_sfence();
+    for (i = 0; i < DSA_SUBMIT_RETRIES; i++) {
+        if (!_enqcmd(portal, desc)) {
+            return true;
+        }
+        _mm_pause();
+    }
+    return false;
+}
+
+static void dsa_wait(struct dsa_completion_record *comp)
+{
+    while (!comp->status) {
+        _mm_pause();
+    }
+}
+
+static void dsa_desc_init(struct dsa_hw_desc *desc,
+                          struct dsa_completion_record *comp, int opcode)
+{
+    memset(desc, 0, sizeof(*desc));
+    memset(comp, 0, sizeof(*comp));
+    desc->opcode = opcode;
+    desc->flags = IDXD_OP_FLAG_RCR | IDXD_OP_FLAG_CRAV;
+    desc->completion_addr = (uintptr_t)comp;
+}
+
+static bool dsa_done(struct dsa_completion_record *comp)
+{
+    return (comp->status & DSA_COMP_STATUS_MASK) == DSA_COMP_SUCCESS;
+}
+
+/*
+ * Submit the @count descriptors of @task, in batches of DSA_BATCH_MAX,
+ * and wait for them.  The ones that could not be submitted are left
+ * with a clear completion record.
+ */
+static void dsa_run(QemuDsaBatchTask *task, size_t count)
+{
+    size_t submitted, i;
+
+    for (submitted = 0; submitted < count; submitted += DSA_BATCH_MAX) {
+        size_t n = MIN(count - submitted, DSA_BATCH_MAX);
+        struct dsa_hw_desc *desc = &task->descs[submitted];
+
+        /* A batch has at least two descriptors */
+        if (n > 1) {
+            desc = &task->batch_descs[submitted / DSA_BATCH_MAX];
+            dsa_desc_init(desc, &task->batch_comps[submitted / DSA_BATCH_MAX],
+                          DSA_OPCODE_BATCH);
+            desc->desc_list_addr = (uintptr_t)&task->descs[submitted];
+            desc->desc_count = n;
+        }
+        if (!dsa_submit(desc)) {
+            break;
+        }
+    }
+
+    for (i = 0; i < submitted; i += DSA_BATCH_MAX) {
+        if (MIN(count - i, DSA_BATCH_MAX) > 1) {
+            dsa_wait(&task->batch_comps[i / DSA_BATCH_MAX]);
+        } else {
+            dsa_wait(&task->comps[i]);
+        }
+    }
+}
+
+static void dsa_task_alloc_descs(QemuDsaBatchTask *task, size_t count)
+{
+    size_t batches = DIV_ROUND_UP(count, DSA_BATCH_MAX);
+
+    qemu_vfree(task->descs);
+    qemu_vfree(task->comps);
+    qemu_vfree(task->batch_descs);
+    qemu_vfree(task->batch_comps);
+    /* Descriptor lists and completion records must be aligned */
+    task->descs = qemu_memalign(64, count * sizeof(*task->descs));
+    task->comps = qemu_memalign(64, count * sizeof(*task->comps));
+    task->batch_descs = qemu_memalign(64, batches * sizeof(*task->descs));
+    task->batch_comps = qemu_memalign(64, batches * sizeof(*task->comps));
+}
+
+int qemu_dsa_init(const strList *paths, Error **errp)
+{
+    unsigned int a, b, c, d;
+
+    qemu_dsa_cleanup();
+    if (!paths) {
+        return 0;
+    }
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        c = 0;
+    } else {
+        __cpuid_count(7, 0, a, b, c, d);
+    }
+    if (!(c & bit_ENQCMD)) {
+        error_setg(errp, "DSA offload needs a CPU with ENQCMD");
+        return -1;
+    }
+
+    for (; paths; paths = paths->next) {
+        int fd;
+        void *portal;
+
+        if (dsa.nr_devices == DSA_MAX_DEVICES) {
+            error_setg(errp, "DSA offload supports at most %d work queues",
+                       DSA_MAX_DEVICES);
+            goto fail;
+        }
+        fd = qemu_open(paths->value, O_RDWR, errp);
+        if (fd < 0) {
+            goto fail;
+        }
+        portal = mmap(NULL, DSA_WQ_PORTAL_SIZE, PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, 0);
+        if (portal == MAP_FAILED) {
+            error_setg_errno(errp, errno, "Can't map DSA work queue %s",
+                             paths->value);
+            close(fd);
+            goto fail;
+        }
+        dsa.fd[dsa.nr_devices] = fd;
+        dsa.portal[dsa.nr_devices] = portal;
+        dsa.nr_devices++;
+    }
+    return 0;
+
+fail:
+    qemu_dsa_cleanup();
+    return -1;
+}
+
+void qemu_dsa_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < dsa.nr_devices; i++) {
+        munmap(dsa.portal[i], DSA_WQ_PORTAL_SIZE);
+        close(dsa.fd[i]);
+    }
+    dsa.nr_devices = 0;
+}
+
+bool qemu_dsa_is_running(void)
+{
+    return dsa.nr_devices;
+}
+
+#pragma GCC pop_options
+#else
+static void dsa_task_alloc_descs(QemuDsaBatchTask *task, size_t count)
+{
+}
+
+int qemu_dsa_init(const strList *paths, Error **errp)
+{
+    if (paths) {
+        error_setg(errp, "DSA offload is not supported by this build of "
+                   "QEMU");
+        return -1;
+    }
+    return 0;
+}
+
+void qemu_dsa_cleanup(void)
+{
+}
+
+bool qemu_dsa_is_running(void)
+{
+    return false;
+}
+#endif /* CONFIG_DSA_OPT */
+
+QemuDsaBatchTask *qemu_dsa_batch_task_new(void)
+{
+    return g_new0(QemuDsaBatchTask, 1);
+}
+
+void qemu_dsa_batch_task_free(QemuDsaBatchTask *task)
+{
+    if (!task) {
+        return;
+    }
+#ifdef CONFIG_DSA_OPT
+    qemu_vfree(task->descs);
+    qemu_vfree(task->comps);
+    qemu_vfree(task->batch_descs);
+    qemu_vfree(task->batch_comps);
+#endif
+    g_free(task->results);
+    g_free(task);
+}
+
+static void batch_task_reserve(QemuDsaBatchTask *task, size_t count)
+{
+    if (count > task->size) {
+        dsa_task_alloc_descs(task, count);
+        g_free(task->results);
+        task->results = g_new(bool, count);
+        task->size = count;
+    }
+}
+
+bool *qemu_dsa_buffer_is_zero_batch(QemuDsaBatchTask *task,
+                                    const struct iovec *iov, size_t count)
+{
+    size_t i;
+
+    batch_task_reserve(task, count);
+#ifdef CONFIG_DSA_OPT
+    if (qemu_dsa_is_running()) {
+        for (i = 0; i < count; i++) {
+            struct dsa_hw_desc *desc = &task->descs[i];
+
+            dsa_desc_init(desc, &task->comps[i], DSA_OPCODE_COMPVAL);
+            desc->src_addr = (uintptr_t)iov[i].iov_base;
+            desc->xfer_size = iov[i].iov_len;
+            desc->comp_pattern = 0;
+        }
+        dsa_run(task, count);
+        for (i = 0; i < count; i++) {
+            if (dsa_done(&task->comps[i])) {
+                /* The result is 0 when the buffer matches the pattern */
+                task->results[i] = !task->comps[i].result;
+            } else {
+                task->results[i] = buffer_is_zero(iov[i].iov_base,
+                                                  iov[i].iov_len);
+            }
+        }
+        return task->results;
+    }
+#endif
+    for (i = 0; i < count; i++) {
+        task->results[i] = buffer_is_zero(iov[i].iov_base, iov[i].iov_len);
+    }
+    return task->results;
+}
+
+void qemu_dsa_fill_zero_batch(QemuDsaBatchTask *task,
+                              const struct iovec *iov, size_t count)
+{
+    size_t i;
+
+    batch_task_reserve(task, count);
+#ifdef CONFIG_DSA_OPT
+    if (qemu_dsa_is_running()) {
+        for (i = 0; i < count; i++) {
+            struct dsa_hw_desc *desc = &task->descs[i];
+
+            dsa_desc_init(desc, &task->comps[i], DSA_OPCODE_MEMFILL);
+            desc->pattern = 0;
+            desc->dst_addr = (uintptr_t)iov[i].iov_base;
+            desc->xfer_size = iov[i].iov_len;
+        }
+        dsa_run(task, count);
+        for (i = 0; i < count; i++) {
+            if (!dsa_done(&task->comps[i])) {
+                memset(iov[i].iov_base, 0, iov[i].iov_len);
+            }
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < count; i++) {
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+    }
+}
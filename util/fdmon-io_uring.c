@@ -19,9 +19,10 @@
  * 4. Nanosecond timeouts are supported so it requires fewer syscalls than
  *    epoll(7).
  *
- * This code only monitors file descriptors and does not do asynchronous disk
- * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * Other requests can be submitted to the same io_uring with aio_add_sqe(), so
+ * that for example the disk I/O of an IOThread completes in the system call
+ * that waits for file descriptor events.  Their user_data is tagged with
+ * FDMON_IO_URING_CQE_HANDLER to tell them from the AioHandlers.
  *
  * File descriptor monitoring is implemented using the following operations:
  *
@@ -38,14 +39,22 @@
  * the "cq ring".  Ring entries are called "sqe" and "cqe", respectively.
  *
  * The code is structured so that sq/cq rings are only modified within
- * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
- * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
- * and/or IORING_OP_POLL_REMOVE sqes for them.
+ * fdmon_io_uring_wait() and aio_add_sqe(), both of which run in the thread of
+ * the AioContext.  Changes to AioHandlers, which can come from other threads,
+ * are made by enqueuing them on ctx->submit_list so that
+ * fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD and/or
+ * IORING_OP_POLL_REMOVE sqes for them.
+ *
+ * While external clients are disabled this falls back to fdmon-poll, except
+ * when requests of aio_add_sqe() are in flight: only the io_uring sees them
+ * complete.  The external AioHandlers are then not re-armed until external
+ * clients are enabled again.
  */
 
 #include "qemu/osdep.h"
 #include <poll.h>
 #include "qemu/rcu_queue.h"
+#include "qemu/main-loop.h"
 #include "aio-posix.h"
 
 enum {
@@ -55,6 +64,9 @@ enum {
     FDMON_IO_URING_PENDING  = (1 << 0),
     FDMON_IO_URING_ADD      = (1 << 1),
     FDMON_IO_URING_REMOVE   = (1 << 2),
+
+    /* Tag of the user_data of aio_add_sqe() requests */
+    FDMON_IO_URING_CQE_HANDLER = 1,
 };
 
 static inline int poll_events_from_pfd(int pfd_events)
@@ -205,6 +217,13 @@ static void fill_sq_ring(AioContext *ctx)
     QSLIST_MOVE_ATOMIC(&submit_list, &ctx->submit_list);
 
     while ((node = dequeue(&submit_list, &flags))) {
+        /* Keep disabled external handlers for later */
+        if (flags == FDMON_IO_URING_ADD &&
+            !aio_node_check(ctx, node->is_external)) {
+            enqueue(&ctx->submit_list, node, FDMON_IO_URING_ADD);
+            continue;
+        }
+
         /* Order matters, just in case both flags were set */
         if (flags & FDMON_IO_URING_ADD) {
             add_poll_add_sqe(ctx, node);
@@ -228,6 +247,16 @@ static bool process_cqe(AioContext *ctx,
         return false;
     }
 
+    if ((uintptr_t)node & FDMON_IO_URING_CQE_HANDLER) {
+        CqeHandler *cqe_handler = (void *)((uintptr_t)node &
+                                           ~FDMON_IO_URING_CQE_HANDLER);
+
+        cqe_handler->cqe = *cqe;
+        QSIMPLEQ_INSERT_TAIL(&ctx->cqe_handler_ready_list, cqe_handler, next);
+        ctx->fdmon_io_uring_in_flight--;
+        return true;
+    }
+
     /*
      * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
      * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
@@ -239,6 +268,12 @@ static bool process_cqe(AioContext *ctx,
         return false;
     }
 
+    /* Re-armed by fill_sq_ring() once external clients are enabled */
+    if (!aio_node_check(ctx, node->is_external)) {
+        enqueue(&ctx->submit_list, node, FDMON_IO_URING_ADD);
+        return false;
+    }
+
     aio_add_ready_handler(ready_list, node, pfd_events_from_poll(cqe->res));
 
     /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
@@ -272,8 +307,12 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
     int ret;
 
-    /* Fall back while external clients are disabled */
-    if (qatomic_read(&ctx->external_disable_cnt)) {
+    /*
+     * Fall back while external clients are disabled, unless only io_uring
+     * can see requests of aio_add_sqe() complete
+     */
+    if (qatomic_read(&ctx->external_disable_cnt) &&
+        !ctx->fdmon_io_uring_in_flight) {
         return fdmon_poll_ops.wait(ctx, ready_list, timeout);
     }
 
@@ -315,6 +354,41 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
     return qatomic_read(&ctx->external_disable_cnt);
 }
 
+bool aio_can_add_sqe(AioContext *ctx)
+{
+    /*
+     * The main loop AioContext is also "home" for the vCPU threads that
+     * hold the BQL, and they must not touch the sq ring.
+     */
+    return ctx->fdmon_ops == &fdmon_io_uring_ops &&
+           ctx != qemu_get_aio_context() &&
+           in_aio_context_home_thread(ctx);
+}
+
+void aio_add_sqe(AioContext *ctx, const struct io_uring_sqe *sqe,
+                 CqeHandler *cqe_handler)
+{
+    struct io_uring_sqe *new_sqe = get_sqe(ctx);
+
+    *new_sqe = *sqe;
+    io_uring_sqe_set_data(new_sqe, (void *)((uintptr_t)cqe_handler |
+                                            FDMON_IO_URING_CQE_HANDLER));
+    ctx->fdmon_io_uring_in_flight++;
+}
+
+bool fdmon_io_uring_dispatch(AioContext *ctx)
+{
+    CqeHandler *cqe_handler;
+    bool progress = false;
+
+    while ((cqe_handler = QSIMPLEQ_FIRST(&ctx->cqe_handler_ready_list))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->cqe_handler_ready_list, next);
+        cqe_handler->cb(cqe_handler);
+        progress = true;
+    }
+    return progress;
+}
+
 static const FDMonOps fdmon_io_uring_ops = {
     .update = fdmon_io_uring_update,
     .wait = fdmon_io_uring_wait,
@@ -331,6 +405,8 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     }
 
     QSLIST_INIT(&ctx->submit_list);
+    QSIMPLEQ_INIT(&ctx->cqe_handler_ready_list);
+    ctx->fdmon_io_uring_in_flight = 0;
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
@@ -340,6 +416,27 @@ void fdmon_io_uring_destroy(AioContext *ctx)
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
         AioHandler *node;
 
+        /*
+         * Stop taking requests and wait for the ones in flight, dropping the
+         * file descriptor events.  fdmon-poll will see the ones that are
+         * still pending.
+         */
+        ctx->fdmon_ops = &fdmon_poll_ops;
+        while (ctx->fdmon_io_uring_in_flight ||
+               !QSIMPLEQ_EMPTY(&ctx->cqe_handler_ready_list)) {
+            AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
+            AioHandler *ready, *tmp;
+
+            if (ctx->fdmon_io_uring_in_flight) {
+                io_uring_submit_and_wait(&ctx->fdmon_io_uring, 1);
+                process_cq_ring(ctx, &ready_list);
+                QLIST_FOREACH_SAFE(ready, &ready_list, node_ready, tmp) {
+                    QLIST_REMOVE(ready, node_ready);
+                }
+            }
+            fdmon_io_uring_dispatch(ctx);
+        }
+
         io_uring_queue_exit(&ctx->fdmon_io_uring);
 
         /* Move handlers due to be removed onto the deleted list */
@@ -355,7 +452,5 @@ void fdmon_io_uring_destroy(AioContext *ctx)
 
             QSLIST_REMOVE_HEAD_RCU(&ctx->submit_list, node_submitted);
         }
-
-        ctx->fdmon_ops = &fdmon_poll_ops;
     }
 }
@@ -217,6 +217,29 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
     return MAX(start, first_dirty_off);
 }
 
+/*
+ * Return the index of the first word in @words[@pos..@sz) that is not all
+ * ones, or @sz.  Dirty bitmaps of big disks have long runs of set bits;
+ * checking them a cache line at a time with a single branch lets the
+ * compiler use vector instructions.
+ */
+static size_t hb_skip_ones(const unsigned long *words, size_t pos, size_t sz)
+{
+    while (pos + 8 <= sz) {
+        const unsigned long *p = &words[pos];
+
+        if ((p[0] & p[1] & p[2] & p[3] & p[4] & p[5] & p[6] & p[7]) !=
+            (unsigned long)-1) {
+            break;
+        }
+        pos += 8;
+    }
+    while (pos < sz && words[pos] == (unsigned long)-1) {
+        pos++;
+    }
+    return pos;
+}
+
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
@@ -245,9 +268,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        pos = hb_skip_ones(last_lev, pos + 1, sz);
 
         if (pos >= sz) {
             return -1;
@@ -301,6 +322,25 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, int64_t start, int64_t end,
     return true;
 }
 
+int hbitmap_next_dirty_areas(const HBitmap *hb, int64_t start, int64_t end,
+                             int64_t max_dirty_count, int max_areas,
+                             int64_t *dirty_starts, int64_t *dirty_counts)
+{
+    int n = 0;
+
+    assert(max_areas >= 0);
+
+    end = MIN(end, hb->orig_size);
+    while (n < max_areas &&
+           hbitmap_next_dirty_area(hb, start, end, max_dirty_count,
+                                   &dirty_starts[n], &dirty_counts[n])) {
+        start = dirty_starts[n] + dirty_counts[n];
+        n++;
+    }
+
+    return n;
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -836,10 +876,26 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
     }
     if (hb->meta) {
-        hbitmap_truncate(hb->meta, hb->size << hb->granularity);
+        hbitmap_truncate(hb->meta, hb->orig_size);
     }
 }
 
+HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_size)
+{
+    assert(!(chunk_size & (chunk_size - 1)));
+    assert(!hb->meta);
+    hb->meta = hbitmap_alloc(hb->orig_size,
+                             hb->granularity + ctz32(chunk_size));
+    return hb->meta;
+}
+
+void hbitmap_free_meta(HBitmap *hb)
+{
+    assert(hb->meta);
+    hbitmap_free(hb->meta);
+    hb->meta = NULL;
+}
+
 bool hbitmap_can_merge(const HBitmap *a, const HBitmap *b)
 {
     return (a->orig_size == b->orig_size);
@@ -852,16 +908,20 @@ bool hbitmap_can_merge(const HBitmap *a, const HBitmap *b)
  */
 static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 {
-    int64_t offset;
-    int64_t count;
+    int64_t offset = 0;
+    int64_t starts[64], counts[64];
+    int i, n;
 
-    for (offset = 0;
-         hbitmap_next_dirty_area(src, offset, src->orig_size, INT64_MAX,
-                                 &offset, &count);
-         offset += count)
-    {
-        hbitmap_set(dst, offset, count);
-    }
+    do {
+        n = hbitmap_next_dirty_areas(src, offset, src->orig_size, INT64_MAX,
+                                     ARRAY_SIZE(starts), starts, counts);
+        for (i = 0; i < n; i++) {
+            hbitmap_set(dst, starts[i], counts[i]);
+        }
+        if (n) {
+            offset = starts[n - 1] + counts[n - 1];
+        }
+    } while (n == ARRAY_SIZE(starts));
 }
 
 /**
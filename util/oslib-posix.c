@@ -37,6 +37,7 @@
 #include "qapi/error.h"
 #include "qemu/sockets.h"
 #include "qemu/thread.h"
+#include "qemu/queue.h"
 #include <libgen.h>
 #include "qemu/cutils.h"
 #include "qemu/compiler.h"
@@ -73,22 +74,37 @@
 
 #define MAX_MEM_PREALLOC_THREAD_COUNT 16
 
+struct MemsetThread;
+
+typedef struct MemsetContext {
+    bool all_threads_created;
+    bool any_thread_failed;
+    struct MemsetThread *threads;
+    int num_threads;
+    char *area;
+    size_t size;
+    int64_t start_us;
+    QLIST_ENTRY(MemsetContext) next;
+} MemsetContext;
+
 struct MemsetThread {
     char *addr;
     size_t numpages;
     size_t hpagesize;
     QemuThread pgthread;
     sigjmp_buf env;
+    MemsetContext *context;
 };
 typedef struct MemsetThread MemsetThread;
 
-static MemsetThread *memset_thread;
-static int memset_num_threads;
-static bool memset_thread_failed;
+/* The threads of this context touch the pages, and may get a SIGBUS */
+static MemsetContext *sigbus_memset_context;
+/* Preallocations running in the background, see os_mem_prealloc_finish() */
+static QLIST_HEAD(, MemsetContext) memset_contexts =
+    QLIST_HEAD_INITIALIZER(memset_contexts);
 
 static QemuMutex page_mutex;
 static QemuCond page_cond;
-static bool threads_created_flag;
 
 int qemu_get_thread_id(void)
 {
@@ -439,30 +455,38 @@ const char *qemu_get_exec_dir(void)
 static void sigbus_handler(int signal)
 {
     int i;
-    if (memset_thread) {
-        for (i = 0; i < memset_num_threads; i++) {
-            if (qemu_thread_is_self(&memset_thread[i].pgthread)) {
-                siglongjmp(memset_thread[i].env, 1);
+
+    if (sigbus_memset_context) {
+        for (i = 0; i < sigbus_memset_context->num_threads; i++) {
+            MemsetThread *thread = &sigbus_memset_context->threads[i];
+
+            if (qemu_thread_is_self(&thread->pgthread)) {
+                siglongjmp(thread->env, 1);
             }
         }
     }
 }
 
-static void *do_touch_pages(void *arg)
+static void wait_all_threads_created(MemsetContext *context)
 {
-    MemsetThread *memset_args = (MemsetThread *)arg;
-    sigset_t set, oldset;
-
     /*
-     * On Linux, the page faults from the loop below can cause mmap_sem
+     * On Linux, the page faults from the threads can cause mmap_sem
      * contention with allocation of the thread stacks.  Do not start
      * clearing until all threads have been created.
      */
     qemu_mutex_lock(&page_mutex);
-    while(!threads_created_flag){
+    while (!context->all_threads_created) {
         qemu_cond_wait(&page_cond, &page_mutex);
     }
     qemu_mutex_unlock(&page_mutex);
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *memset_args = (MemsetThread *)arg;
+    sigset_t set, oldset;
+
+    wait_all_threads_created(memset_args->context);
 
     /* unblock SIGBUS */
     sigemptyset(&set);
@@ -470,7 +494,7 @@ static void *do_touch_pages(void *arg)
     pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
 
     if (sigsetjmp(memset_args->env, 1)) {
-        memset_thread_failed = true;
+        memset_args->context->any_thread_failed = true;
     } else {
         char *addr = memset_args->addr;
         size_t numpages = memset_args->numpages;
@@ -497,7 +521,25 @@ static void *do_touch_pages(void *arg)
     return NULL;
 }
 
-static inline int get_memset_num_threads(int smp_cpus)
+static void *do_madv_populate_write_pages(void *arg)
+{
+    MemsetThread *memset_args = (MemsetThread *)arg;
+    size_t size = memset_args->numpages * memset_args->hpagesize;
+
+    wait_all_threads_created(memset_args->context);
+
+    /*
+     * The kernel allocates the pages without writing to them, and
+     * reports the failures instead of sending SIGBUS.
+     */
+    if (size && qemu_madvise(memset_args->addr, size,
+                             QEMU_MADV_POPULATE_WRITE)) {
+        memset_args->context->any_thread_failed = true;
+    }
+    return NULL;
+}
+
+static inline int get_memset_num_threads(size_t numpages, int smp_cpus)
 {
     long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
     int ret = 1;
@@ -505,15 +547,44 @@ static inline int get_memset_num_threads(int smp_cpus)
     if (host_procs > 0) {
         ret = MIN(MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT), smp_cpus);
     }
+    /* Especially with gigantic pages, don't create more threads than pages */
+    ret = MIN(ret, numpages);
+    /* Ensure at least one thread */
+    ret = MAX(ret, 1);
     /* In case sysconf() fails, we fall back to single threaded */
     return ret;
 }
 
-static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                            int smp_cpus)
+static bool wait_mem_prealloc_context(MemsetContext *context)
+{
+    bool failed;
+    int i;
+
+    for (i = 0; i < context->num_threads; i++) {
+        qemu_thread_join(&context->threads[i].pgthread);
+    }
+    failed = context->any_thread_failed;
+    trace_os_mem_prealloc_done(context->area, context->size, failed,
+        (g_get_monotonic_time() - context->start_us) / 1000);
+
+    if (sigbus_memset_context == context) {
+        sigbus_memset_context = NULL;
+    }
+    g_free(context->threads);
+    g_free(context);
+    return failed;
+}
+
+static MemsetContext *touch_all_pages(char *area, size_t hpagesize,
+                                      size_t numpages, int smp_cpus,
+                                      unsigned long *host_cpus,
+                                      unsigned long nbits,
+                                      bool use_madv_populate_write)
 {
     static gsize initialized = 0;
+    MemsetContext *context = g_new0(MemsetContext, 1);
     size_t numpages_per_thread, leftover;
+    void *(*touch_fn)(void *);
     char *addr = area;
     int i = 0;
 
@@ -523,69 +594,132 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
         g_once_init_leave(&initialized, 1);
     }
 
-    memset_thread_failed = false;
-    threads_created_flag = false;
-    memset_num_threads = get_memset_num_threads(smp_cpus);
-    memset_thread = g_new0(MemsetThread, memset_num_threads);
-    numpages_per_thread = numpages / memset_num_threads;
-    leftover = numpages % memset_num_threads;
-    for (i = 0; i < memset_num_threads; i++) {
-        memset_thread[i].addr = addr;
-        memset_thread[i].numpages = numpages_per_thread + (i < leftover);
-        memset_thread[i].hpagesize = hpagesize;
-        qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
-                           do_touch_pages, &memset_thread[i],
-                           QEMU_THREAD_JOINABLE);
-        addr += memset_thread[i].numpages * hpagesize;
+    if (use_madv_populate_write) {
+        touch_fn = do_madv_populate_write_pages;
+    } else {
+        touch_fn = do_touch_pages;
+        sigbus_memset_context = context;
+    }
+
+    context->area = area;
+    context->size = numpages * hpagesize;
+    context->start_us = g_get_monotonic_time();
+    context->num_threads = get_memset_num_threads(numpages, smp_cpus);
+    context->threads = g_new0(MemsetThread, context->num_threads);
+    numpages_per_thread = numpages / context->num_threads;
+    leftover = numpages % context->num_threads;
+    for (i = 0; i < context->num_threads; i++) {
+        MemsetThread *thread = &context->threads[i];
+
+        thread->addr = addr;
+        thread->numpages = numpages_per_thread + (i < leftover);
+        thread->hpagesize = hpagesize;
+        thread->context = context;
+        qemu_thread_create(&thread->pgthread, "touch_pages",
+                           touch_fn, thread, QEMU_THREAD_JOINABLE);
+        /*
+         * The kernel clears the pages from the CPU that faults them in,
+         * keep it close to the memory.
+         */
+        if (host_cpus) {
+            qemu_thread_set_affinity(&thread->pgthread, host_cpus, nbits);
+        }
+        addr += thread->numpages * hpagesize;
     }
+    trace_os_mem_prealloc(area, context->size, context->num_threads,
+                          use_madv_populate_write);
 
     qemu_mutex_lock(&page_mutex);
-    threads_created_flag = true;
+    context->all_threads_created = true;
     qemu_cond_broadcast(&page_cond);
     qemu_mutex_unlock(&page_mutex);
 
-    for (i = 0; i < memset_num_threads; i++) {
-        qemu_thread_join(&memset_thread[i].pgthread);
-    }
-    g_free(memset_thread);
-    memset_thread = NULL;
+    return context;
+}
 
-    return memset_thread_failed;
+static bool madv_populate_write_possible(char *area, size_t pagesize)
+{
+    return !qemu_madvise(area, pagesize, QEMU_MADV_POPULATE_WRITE) ||
+           errno != EINVAL;
 }
 
 void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
-                     Error **errp)
+                     unsigned long *host_cpus, unsigned long nbits,
+                     bool async, Error **errp)
 {
     int ret;
     struct sigaction act, oldact;
     size_t hpagesize = qemu_fd_getpagesize(fd);
     size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    bool use_madv_populate_write;
+    MemsetContext *context;
 
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = &sigbus_handler;
-    act.sa_flags = 0;
+    /*
+     * Sense on every invocation, as MADV_POPULATE_WRITE cannot be used for
+     * some special mappings, such as mapping /dev/mem.
+     */
+    use_madv_populate_write = madv_populate_write_possible(area, hpagesize);
 
-    ret = sigaction(SIGBUS, &act, &oldact);
-    if (ret) {
-        error_setg_errno(errp, errno,
-            "os_mem_prealloc: failed to install signal handler");
+    /*
+     * Only MADV_POPULATE_WRITE can run in the background: the SIGBUS
+     * handler is for the whole process, and is restored before we return.
+     */
+    if (async && use_madv_populate_write) {
+        context = touch_all_pages(area, hpagesize, numpages, smp_cpus,
+                                  host_cpus, nbits, true);
+        QLIST_INSERT_HEAD(&memset_contexts, context, next);
         return;
     }
 
+    if (!use_madv_populate_write) {
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = &sigbus_handler;
+        act.sa_flags = 0;
+
+        ret = sigaction(SIGBUS, &act, &oldact);
+        if (ret) {
+            error_setg_errno(errp, errno,
+                "os_mem_prealloc: failed to install signal handler");
+            return;
+        }
+    }
+
     /* touch pages simultaneously */
-    if (touch_all_pages(area, hpagesize, numpages, smp_cpus)) {
+    context = touch_all_pages(area, hpagesize, numpages, smp_cpus,
+                              host_cpus, nbits, use_madv_populate_write);
+    if (wait_mem_prealloc_context(context)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM");
     }
 
-    ret = sigaction(SIGBUS, &oldact, NULL);
-    if (ret) {
-        /* Terminate QEMU since it can't recover from error */
-        perror("os_mem_prealloc: failed to reinstall signal handler");
-        exit(1);
+    if (!use_madv_populate_write) {
+        ret = sigaction(SIGBUS, &oldact, NULL);
+        if (ret) {
+            /* Terminate QEMU since it can't recover from error */
+            perror("os_mem_prealloc: failed to reinstall signal handler");
+            exit(1);
+        }
     }
 }
 
+bool os_mem_prealloc_finish(Error **errp)
+{
+    MemsetContext *context, *next_context;
+    bool failed = false;
+
+    QLIST_FOREACH_SAFE(context, &memset_contexts, next, next_context) {
+        QLIST_REMOVE(context, next);
+        failed |= wait_mem_prealloc_context(context);
+    }
+
+    if (failed) {
+        error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
+            "pages available to allocate guest RAM");
+        return false;
+    }
+    return true;
+}
+
 char *qemu_get_pid_name(pid_t pid)
 {
     char *name = NULL;
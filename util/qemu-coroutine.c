@@ -21,11 +21,15 @@
 #include "block/aio.h"
 
 enum {
-    POOL_BATCH_SIZE = 64,
+    POOL_DEFAULT_SIZE = 64,
 };
 
-/** Free list to speed up creation */
+/*
+ * Free list to speed up creation.  Devices with many requests in flight
+ * make the pool bigger with qemu_coroutine_inc_pool_size().
+ */
 static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
+static unsigned int pool_batch_size = POOL_DEFAULT_SIZE;
 static unsigned int release_pool_size;
 static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(pool);
 static __thread unsigned int alloc_pool_size;
@@ -42,6 +46,17 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
     }
 }
 
+/* The stats go to the AioContext of the thread, if it has one */
+static void coroutine_pool_account(bool hit)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    if (ctx) {
+        stat64_add(hit ? &ctx->coroutine_pool_hits :
+                   &ctx->coroutine_pool_misses, 1);
+    }
+}
+
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 {
     Coroutine *co = NULL;
@@ -49,7 +64,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
     if (CONFIG_COROUTINE_POOL) {
         co = QSLIST_FIRST(&alloc_pool);
         if (!co) {
-            if (release_pool_size > POOL_BATCH_SIZE) {
+            if (release_pool_size > qatomic_read(&pool_batch_size)) {
                 /* Slow path; a good place to register the destructor, too.  */
                 if (!coroutine_pool_cleanup_notifier.notify) {
                     coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
@@ -71,6 +86,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         }
     }
 
+    coroutine_pool_account(co != NULL);
     if (!co) {
         co = qemu_coroutine_new();
     }
@@ -86,16 +102,23 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        if (release_pool_size < POOL_BATCH_SIZE * 2) {
-            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
-            qatomic_inc(&release_pool_size);
-            return;
-        }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
+        unsigned int batch_size = qatomic_read(&pool_batch_size);
+
+        /*
+         * Keep the coroutine in this thread first: its stack was most
+         * likely touched here, so its pages are on the NUMA node of this
+         * thread, and the next coroutine of the thread reuses them.
+         */
+        if (alloc_pool_size < batch_size) {
             QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
             alloc_pool_size++;
             return;
         }
+        if (release_pool_size < batch_size * 2) {
+            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
+            qatomic_inc(&release_pool_size);
+            return;
+        }
     }
 
     qemu_coroutine_delete(co);
@@ -202,3 +225,13 @@ AioContext *coroutine_fn qemu_coroutine_get_aio_context(Coroutine *co)
 {
     return co->ctx;
 }
+
+void qemu_coroutine_inc_pool_size(unsigned int additional_pool_size)
+{
+    qatomic_add(&pool_batch_size, additional_pool_size);
+}
+
+void qemu_coroutine_dec_pool_size(unsigned int removing_pool_size)
+{
+    qatomic_sub(&pool_batch_size, removing_pool_size);
+}
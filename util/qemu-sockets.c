@@ -359,8 +359,36 @@ listen_ok:
     ((rc) == -EINPROGRESS)
 #endif
 
+static int inet_bind_source(int sock, int family, const char *source,
+                            Error **errp)
+{
+    struct addrinfo ai, *res;
+    int rc;
+
+    memset(&ai, 0, sizeof(ai));
+    ai.ai_flags = AI_PASSIVE;
+    ai.ai_family = family;
+    ai.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo(source, NULL, &ai, &res);
+    if (rc != 0) {
+        error_setg(errp, "address resolution failed for %s: %s",
+                   source, gai_strerror(rc));
+        return -1;
+    }
+
+    rc = bind(sock, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc < 0) {
+        error_setg_errno(errp, errno, "Failed to bind socket to '%s'", source);
+        return -1;
+    }
+    return 0;
+}
+
 static int inet_connect_addr(const InetSocketAddress *saddr,
-                             struct addrinfo *addr, Error **errp)
+                             struct addrinfo *addr, const char *source,
+                             Error **errp)
 {
     int sock, rc;
 
@@ -372,6 +400,11 @@ static int inet_connect_addr(const InetSocketAddress *saddr,
     }
     socket_set_fast_reuse(sock);
 
+    if (source && inet_bind_source(sock, addr->ai_family, source, errp) < 0) {
+        closesocket(sock);
+        return -1;
+    }
+
     /* connect to peer */
     do {
         rc = 0;
@@ -447,7 +480,8 @@ static struct addrinfo *inet_parse_connect_saddr(InetSocketAddress *saddr,
  *
  * Returns: -1 on error, file descriptor on success.
  */
-int inet_connect_saddr(InetSocketAddress *saddr, Error **errp)
+static int inet_connect_saddr_from(InetSocketAddress *saddr,
+                                   const char *source, Error **errp)
 {
     Error *local_err = NULL;
     struct addrinfo *res, *e;
@@ -468,7 +502,7 @@ int inet_connect_saddr(InetSocketAddress *saddr, Error **errp)
         }
 #endif
 
-        sock = inet_connect_addr(saddr, e, &local_err);
+        sock = inet_connect_addr(saddr, e, source, &local_err);
         if (sock >= 0) {
             break;
         }
@@ -496,6 +530,11 @@ int inet_connect_saddr(InetSocketAddress *saddr, Error **errp)
     return sock;
 }
 
+int inet_connect_saddr(InetSocketAddress *saddr, Error **errp)
+{
+    return inet_connect_saddr_from(saddr, NULL, errp);
+}
+
 static int inet_dgram_saddr(InetSocketAddress *sraddr,
                             InetSocketAddress *sladdr,
                             Error **errp)
@@ -1210,6 +1249,19 @@ int socket_connect(SocketAddress *addr, Error **errp)
     return fd;
 }
 
+int socket_connect_from(SocketAddress *addr, const char *source,
+                        Error **errp)
+{
+    if (!source) {
+        return socket_connect(addr, errp);
+    }
+    if (addr->type != SOCKET_ADDRESS_TYPE_INET) {
+        error_setg(errp, "Only inet sockets can be bound to '%s'", source);
+        return -1;
+    }
+    return inet_connect_saddr_from(&addr->u.inet, source, errp);
+}
+
 int socket_listen(SocketAddress *addr, int num, Error **errp)
 {
     int fd;
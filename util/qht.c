@@ -22,8 +22,9 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold. Resizing is done concurrently with readers and
+ *   writers; a write only waits for the bucket it touches to be moved.
+ * - Optionally, large bucket arrays are interleaved across NUMA nodes.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -43,14 +44,18 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Auto-resizing is done online, one head bucket at a time. The new map is
+ * linked from old->next, and each head bucket of the old map is copied to it
+ * with its lock held, after which it is marked as moved in old->moved. Writers
+ * that lock a bucket that has not been moved yet move it first, and a few
+ * more buckets after every write; whoever moves the last one sets ht->map to
+ * the new map, and the old map is freed once no RCU readers can see it
+ * anymore. Explicit resizes and resets instead take all bucket spinlocks and
+ * copy all entries at once, then mark all buckets as moved.
  *
- * Writers check for concurrent resizes by comparing ht->map before and after
- * acquiring their bucket lock. If they don't match, a resize has occurred
- * while the bucket spinlock was being acquired.
+ * Writers and readers of a moved bucket follow old->next to the map that now
+ * holds its entries. This only depends on the bucket, so writers never wait
+ * for a resize of the whole map to finish.
  *
  * Related Work:
  * - Idea of cacheline-sized buckets with full hashes taken from:
@@ -68,8 +73,14 @@
 #include "qemu/osdep.h"
 #include "qemu/qht.h"
 #include "qemu/atomic.h"
+#include "qemu/bitops.h"
 #include "qemu/rcu.h"
 
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
 //#define QHT_DEBUG
 
 /*
@@ -138,7 +149,8 @@ static inline void qht_unlock(struct qht *ht)
  * qatomic_read's are of course not necessary when the bucket lock is held.
  *
  * If both ht->lock and b->lock are grabbed, ht->lock should always
- * be grabbed first.
+ * be grabbed first. If the locks of a bucket and of a bucket of the next
+ * map are both grabbed, the former should be grabbed first.
  */
 struct qht_bucket {
     QemuSpin lock;
@@ -159,6 +171,11 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @next: map that the head buckets are being moved to, or NULL. It is set
+ *        once, after @moved is allocated.
+ * @moved: bitmap of the head buckets that were moved to @next.
+ * @n_moved: number of bits set in @moved.
+ * @resize_pos: next head bucket to be moved by qht_map_move_some().
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -168,14 +185,28 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    struct qht_map *next;
+    unsigned long *moved;
+    size_t n_moved;
+    size_t resize_pos;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
+/* number of head buckets that each write moves during an online resize */
+#define QHT_RESIZE_STEP 8
+
+/* interleave bucket arrays of at least this size across NUMA nodes */
+#define QHT_NUMA_MIN_SIZE (2 * 1024 * 1024)
+
 static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
                                 bool reset);
 static void qht_grow_maybe(struct qht *ht);
+static void qht_map_move_bucket__locked(struct qht *ht, struct qht_map *map,
+                                        size_t idx);
+static void qht_map_move_some(struct qht *ht, struct qht_map *map, size_t n);
+static void qht_finish_resize(struct qht *ht);
 
 #ifdef QHT_DEBUG
 
@@ -235,10 +266,39 @@ static inline void qht_head_init(struct qht_bucket *b)
     seqlock_init(&b->sequence);
 }
 
+static inline size_t qht_map_bucket_idx(const struct qht_map *map,
+                                        uint32_t hash)
+{
+    return hash & (map->n_buckets - 1);
+}
+
 static inline
 struct qht_bucket *qht_map_to_bucket(const struct qht_map *map, uint32_t hash)
 {
-    return &map->buckets[hash & (map->n_buckets - 1)];
+    return &map->buckets[qht_map_bucket_idx(map, hash)];
+}
+
+/*
+ * Whether the entries of head bucket @idx are now in map->next.
+ * Once true, it stays true.
+ */
+static inline bool qht_map_bucket_moved(const struct qht_map *map, size_t idx)
+{
+    if (likely(!qatomic_rcu_read(&map->next))) {
+        return false;
+    }
+    /* pairs with qatomic_or() in qht_map_move_bucket__locked() */
+    return qatomic_load_acquire(&map->moved[BIT_WORD(idx)]) & BIT_MASK(idx);
+}
+
+/* Get the map that holds the entries for @hash, starting from @map. */
+static inline const struct qht_map *
+qht_map_follow(const struct qht_map *map, uint32_t hash)
+{
+    while (unlikely(qht_map_bucket_moved(map, qht_map_bucket_idx(map, hash)))) {
+        map = qatomic_rcu_read(&map->next);
+    }
+    return map;
 }
 
 /* acquire all bucket locks from a map */
@@ -265,51 +325,11 @@ static void qht_map_unlock_buckets(struct qht_map *map)
 }
 
 /*
- * Call with at least a bucket lock held.
- * @map should be the value read before acquiring the lock (or locks).
- */
-static inline bool qht_map_is_stale__locked(const struct qht *ht,
-                                            const struct qht_map *map)
-{
-    return map != ht->map;
-}
-
-/*
- * Grab all bucket locks, and set @pmap after making sure the map isn't stale.
- *
- * Pairs with qht_map_unlock_buckets(), hence the pass-by-reference.
- *
- * Note: callers cannot have ht->lock held.
- */
-static inline
-void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
-{
-    struct qht_map *map;
-
-    map = qatomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return;
-    }
-    qht_map_unlock_buckets(map);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qht_lock(ht);
-    map = ht->map;
-    qht_map_lock_buckets(map);
-    qht_unlock(ht);
-    *pmap = map;
-    return;
-}
-
-/*
- * Get a head bucket and lock it, making sure its parent map is not stale.
+ * Get a head bucket and lock it, making sure that it has not been moved to
+ * another map. If an online resize is in progress, move the bucket first.
  * @pmap is filled with a pointer to the bucket's parent map.
  *
  * Unlock with qemu_spin_unlock(&b->lock).
- *
- * Note: callers cannot have ht->lock held.
  */
 static inline
 struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
@@ -317,25 +337,24 @@ struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
 {
     struct qht_bucket *b;
     struct qht_map *map;
+    size_t idx;
 
     map = qatomic_rcu_read(&ht->map);
-    b = qht_map_to_bucket(map, hash);
+    for (;;) {
+        idx = qht_map_bucket_idx(map, hash);
+        b = &map->buckets[idx];
 
-    qemu_spin_lock(&b->lock);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return b;
+        qemu_spin_lock(&b->lock);
+        if (likely(!qatomic_rcu_read(&map->next))) {
+            *pmap = map;
+            return b;
+        }
+        if (!qht_map_bucket_moved(map, idx)) {
+            qht_map_move_bucket__locked(ht, map, idx);
+        }
+        qemu_spin_unlock(&b->lock);
+        map = qatomic_rcu_read(&map->next);
     }
-    qemu_spin_unlock(&b->lock);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qht_lock(ht);
-    map = ht->map;
-    b = qht_map_to_bucket(map, hash);
-    qemu_spin_lock(&b->lock);
-    qht_unlock(ht);
-    *pmap = map;
-    return b;
 }
 
 static inline bool qht_map_needs_resize(const struct qht_map *map)
@@ -366,15 +385,32 @@ static void qht_map_destroy(struct qht_map *map)
         qht_chain_destroy(&map->buckets[i]);
     }
     qemu_vfree(map->buckets);
+    g_free(map->moved);
     g_free(map);
 }
 
-static struct qht_map *qht_map_create(size_t n_buckets)
+/*
+ * Spread the pages of a large bucket array across the NUMA nodes, so that
+ * the threads that look it up from every node share the memory bandwidth.
+ * This is only a hint, the array is usable even if it fails.
+ */
+static void qht_buckets_interleave(void *buckets, size_t size)
+{
+#if defined(CONFIG_LINUX) && defined(__NR_mbind)
+    unsigned long nodemask = ~0UL;
+
+    syscall(__NR_mbind, buckets, size, MPOL_INTERLEAVE, &nodemask,
+            sizeof(nodemask) * BITS_PER_BYTE, 0);
+#endif
+}
+
+static struct qht_map *qht_map_create(size_t n_buckets, unsigned int mode)
 {
     struct qht_map *map;
+    size_t size = sizeof(*map->buckets) * n_buckets;
     size_t i;
 
-    map = g_malloc(sizeof(*map));
+    map = g_malloc0(sizeof(*map));
     map->n_buckets = n_buckets;
 
     map->n_added_buckets = 0;
@@ -386,8 +422,14 @@ static struct qht_map *qht_map_create(size_t n_buckets)
         map->n_added_buckets_threshold = 1;
     }
 
-    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
-                                 sizeof(*map->buckets) * n_buckets);
+    if ((mode & QHT_MODE_NUMA_INTERLEAVE) && size >= QHT_NUMA_MIN_SIZE) {
+        /* the policy applies to whole pages, that must not be shared */
+        size = ROUND_UP(size, qemu_real_host_page_size);
+        map->buckets = qemu_memalign(qemu_real_host_page_size, size);
+        qht_buckets_interleave(map->buckets, size);
+    } else {
+        map->buckets = qemu_memalign(QHT_BUCKET_ALIGN, size);
+    }
     for (i = 0; i < n_buckets; i++) {
         qht_head_init(&map->buckets[i]);
     }
@@ -404,13 +446,16 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
     ht->cmp = cmp;
     ht->mode = mode;
     qemu_mutex_init(&ht->lock);
-    map = qht_map_create(n_buckets);
+    map = qht_map_create(n_buckets, mode);
     qatomic_rcu_set(&ht->map, map);
 }
 
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    qht_lock(ht);
+    qht_finish_resize(ht);
+    qht_unlock(ht);
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -446,13 +491,35 @@ static void qht_map_reset__all_locked(struct qht_map *map)
     qht_map_debug__all_locked(map);
 }
 
+/*
+ * Move the remaining head buckets of an online resize, if one is in
+ * progress, and wait for ht->map to be updated. Call with ht->lock held,
+ * so that no other resize can start.
+ */
+static void qht_finish_resize(struct qht *ht)
+{
+    struct qht_map *map;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        while ((map = qatomic_rcu_read(&ht->map))->next) {
+            qht_map_move_some(ht, map, map->n_buckets);
+            /* other threads might still be moving the ones they took */
+            cpu_relax();
+        }
+    }
+}
+
 void qht_reset(struct qht *ht)
 {
     struct qht_map *map;
 
-    qht_map_lock_buckets__no_stale(ht, &map);
+    qht_lock(ht);
+    qht_finish_resize(ht);
+    map = ht->map;
+    qht_map_lock_buckets(map);
     qht_map_reset__all_locked(map);
     qht_map_unlock_buckets(map);
+    qht_unlock(ht);
 }
 
 static inline void qht_do_resize(struct qht *ht, struct qht_map *new)
@@ -474,9 +541,10 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qht_lock(ht);
+    qht_finish_resize(ht);
     map = ht->map;
     if (n_buckets != map->n_buckets) {
-        new = qht_map_create(n_buckets);
+        new = qht_map_create(n_buckets, ht->mode);
     }
     qht_do_resize_and_reset(ht, new);
     qht_unlock(ht);
@@ -512,13 +580,17 @@ void *qht_do_lookup(const struct qht_bucket *head, qht_lookup_func_t func,
 }
 
 static __attribute__((noinline))
-void *qht_lookup__slowpath(const struct qht_bucket *b, qht_lookup_func_t func,
+void *qht_lookup__slowpath(const struct qht_map *map, qht_lookup_func_t func,
                            const void *userp, uint32_t hash)
 {
+    const struct qht_bucket *b;
     unsigned int version;
     void *ret;
 
     do {
+        /* the write we raced with might have moved the bucket */
+        map = qht_map_follow(map, hash);
+        b = qht_map_to_bucket(map, hash);
         version = seqlock_read_begin(&b->sequence);
         ret = qht_do_lookup(b, func, userp, hash);
     } while (seqlock_read_retry(&b->sequence, version));
@@ -533,7 +605,7 @@ void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
     unsigned int version;
     void *ret;
 
-    map = qatomic_rcu_read(&ht->map);
+    map = qht_map_follow(qatomic_rcu_read(&ht->map), hash);
     b = qht_map_to_bucket(map, hash);
 
     version = seqlock_read_begin(&b->sequence);
@@ -545,7 +617,7 @@ void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
      * Removing the do/while from the fastpath gives a 4% perf. increase when
      * running a 100%-lookup microbenchmark.
      */
-    return qht_lookup__slowpath(b, func, userp, hash);
+    return qht_lookup__slowpath(map, func, userp, hash);
 }
 
 void *qht_lookup(const struct qht *ht, const void *userp, uint32_t hash)
@@ -603,6 +675,83 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
     return NULL;
 }
 
+/*
+ * Call with head bucket @idx of @map locked, during an online resize.
+ * The entries stay in the bucket for the readers that are still
+ * looking at it, but it is never written to again.
+ */
+static void qht_map_move_bucket__locked(struct qht *ht, struct qht_map *map,
+                                        size_t idx)
+{
+    struct qht_bucket *head = &map->buckets[idx];
+    struct qht_map *new = map->next;
+    struct qht_bucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            struct qht_bucket *to;
+
+            if (b->pointers[i] == NULL) {
+                goto done;
+            }
+            to = qht_map_to_bucket(new, b->hashes[i]);
+            qemu_spin_lock(&to->lock);
+            qht_insert__locked(ht, new, to, b->pointers[i], b->hashes[i],
+                               NULL);
+            qemu_spin_unlock(&to->lock);
+        }
+        b = b->next;
+    } while (b);
+
+ done:
+    /* make readers that are in the middle of a lookup look again */
+    seqlock_write_begin(&head->sequence);
+    qatomic_or(&map->moved[BIT_WORD(idx)], BIT_MASK(idx));
+    seqlock_write_end(&head->sequence);
+
+    if (qatomic_fetch_inc(&map->n_moved) == map->n_buckets - 1) {
+        /* all entries are in the new map now */
+        qatomic_rcu_set(&ht->map, new);
+        call_rcu(map, qht_map_destroy, rcu);
+    }
+}
+
+/* take up to @n head buckets of @map that nobody moved yet, and move them */
+static void qht_map_move_some(struct qht *ht, struct qht_map *map, size_t n)
+{
+    size_t idx;
+
+    if (qatomic_read(&map->resize_pos) >= map->n_buckets) {
+        return;
+    }
+    idx = qatomic_fetch_add(&map->resize_pos, n);
+    n = MIN(n, map->n_buckets - MIN(idx, map->n_buckets));
+
+    /* moving the last bucket frees @map after a grace period */
+    WITH_RCU_READ_LOCK_GUARD() {
+        for (; n; n--, idx++) {
+            struct qht_bucket *b = &map->buckets[idx];
+
+            qemu_spin_lock(&b->lock);
+            if (!qht_map_bucket_moved(map, idx)) {
+                qht_map_move_bucket__locked(ht, map, idx);
+            }
+            qemu_spin_unlock(&b->lock);
+        }
+    }
+}
+
+/* move a few buckets, if an online resize has to be completed */
+static inline void qht_resize_help(struct qht *ht)
+{
+    struct qht_map *map = qatomic_rcu_read(&ht->map);
+
+    if (unlikely(qatomic_rcu_read(&map->next))) {
+        qht_map_move_some(ht, map, QHT_RESIZE_STEP);
+    }
+}
+
 static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
 {
     struct qht_map *map;
@@ -615,11 +764,19 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
         return;
     }
     map = ht->map;
-    /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
-        struct qht_map *new = qht_map_create(map->n_buckets * 2);
-
-        qht_do_resize(ht, new);
+    /*
+     * another thread might have just performed the resize we were after,
+     * or started one that the writers are still completing
+     */
+    if (!qatomic_read(&map->next) && qht_map_needs_resize(map)) {
+        struct qht_map *new = qht_map_create(map->n_buckets * 2, ht->mode);
+
+        /*
+         * Start an online resize: from now on, writers move the buckets
+         * that they touch, plus a few more, to @new.
+         */
+        map->moved = bitmap_new(map->n_buckets);
+        qatomic_rcu_set(&map->next, new);
     }
     qht_unlock(ht);
 }
@@ -642,6 +799,7 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash, void **existing)
     if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
         qht_grow_maybe(ht);
     }
+    qht_resize_help(ht);
     if (likely(prev == NULL)) {
         return true;
     }
@@ -749,6 +907,7 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
     ret = qht_remove__locked(b, p, hash);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
+    qht_resize_help(ht);
     return ret;
 }
 
@@ -804,10 +963,13 @@ do_qht_iter(struct qht *ht, const struct qht_iter *iter, void *userp)
 {
     struct qht_map *map;
 
-    map = qatomic_rcu_read(&ht->map);
+    qht_lock(ht);
+    qht_finish_resize(ht);
+    map = ht->map;
     qht_map_lock_buckets(map);
     qht_map_iter__all_locked(map, iter, userp);
     qht_map_unlock_buckets(map);
+    qht_unlock(ht);
 }
 
 void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
@@ -848,7 +1010,7 @@ static void qht_map_copy(void *p, uint32_t hash, void *userp)
 
 /*
  * Atomically perform a resize and/or reset.
- * Call with ht->lock held.
+ * Call with ht->lock held and no online resize in progress.
  */
 static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
 {
@@ -877,6 +1039,12 @@ static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
     qht_map_iter__all_locked(old, &iter, &data);
     qht_map_debug__all_locked(new);
 
+    /* writers waiting for the old bucket locks go to the new map */
+    old->moved = bitmap_new(old->n_buckets);
+    bitmap_fill(old->moved, old->n_buckets);
+    old->n_moved = old->n_buckets;
+    old->resize_pos = old->n_buckets;
+    qatomic_rcu_set(&old->next, new);
     qatomic_rcu_set(&ht->map, new);
     qht_map_unlock_buckets(old);
     call_rcu(old, qht_map_destroy, rcu);
@@ -888,10 +1056,11 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     size_t ret = false;
 
     qht_lock(ht);
+    qht_finish_resize(ht);
     if (n_buckets != ht->map->n_buckets) {
         struct qht_map *new;
 
-        new = qht_map_create(n_buckets);
+        new = qht_map_create(n_buckets, ht->mode);
         qht_do_resize(ht, new);
         ret = true;
     }
@@ -49,6 +49,16 @@ QemuEvent rcu_gp_event;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/*
+ * Number of grace periods that synchronize_rcu() started and completed.
+ * Written under rcu_sync_lock.
+ */
+static unsigned long rcu_sync_started;
+static unsigned long rcu_sync_done;
+
+/* Set by drain_call_rcu() to run the callbacks without delay.  */
+static int rcu_call_expedited;
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -142,8 +152,22 @@ static void wait_for_readers(void)
 
 void synchronize_rcu(void)
 {
+    unsigned long snap;
+
+    /* Order our updates before seeing which grace periods started.  */
+    snap = qatomic_mb_read(&rcu_sync_started);
+
     QEMU_LOCK_GUARD(&rcu_sync_lock);
 
+    /* Callers that come in while a grace period is running share the
+     * next one: if one completed while we waited for the lock, it started
+     * after our updates and we are done.
+     */
+    if (rcu_sync_done != snap) {
+        return;
+    }
+    qatomic_set(&rcu_sync_started, rcu_sync_started + 1);
+
     /* Write RCU-protected pointers before reading p_rcu_reader->ctr.
      * Pairs with smp_mb_placeholder() in rcu_read_lock().
      */
@@ -170,6 +194,7 @@ void synchronize_rcu(void)
 
         wait_for_readers();
     }
+    rcu_sync_done = rcu_sync_started;
 }
 
 
@@ -242,11 +267,13 @@ static void *call_rcu_thread(void *opaque)
         int tries = 0;
         int n = qatomic_read(&rcu_call_count);
 
-        /* Heuristically wait for a decent number of callbacks to pile up.
+        /* Heuristically wait for a decent number of callbacks to pile up,
+         * unless somebody is waiting for them in drain_call_rcu().
          * Fetch rcu_call_count now, we only must process elements that were
          * added before synchronize_rcu() starts.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
+        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5 &&
+                          !qatomic_read(&rcu_call_expedited))) {
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
@@ -339,8 +366,10 @@ void drain_call_rcu(void)
      * assumed.
      */
 
+    qatomic_inc(&rcu_call_expedited);
     call_rcu1(&rcu_drain.rcu, drain_rcu_callback);
     qemu_event_wait(&rcu_drain.drain_complete_event);
+    qatomic_dec(&rcu_call_expedited);
 
     if (locked) {
         qemu_mutex_lock_iothread();
@@ -14,6 +14,20 @@
 #include <linux/membarrier.h>
 #include <sys/syscall.h>
 
+/*
+ * Older headers lack these, and they are enum values rather than macros.
+ * They are available since Linux 4.14.
+ */
+#define QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED           (1 << 3)
+#define QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED  (1 << 4)
+
+/*
+ * MEMBARRIER_CMD_SHARED waits for a scheduler grace period in the kernel,
+ * which takes milliseconds.  The expedited command instead sends an IPI to
+ * the CPUs that run one of our threads, and returns in microseconds.
+ */
+static bool membarrier_expedited;
+
 static int
 membarrier(int cmd, int flags)
 {
@@ -26,6 +40,11 @@ void smp_mb_global(void)
 #if defined CONFIG_WIN32
     FlushProcessWriteBuffers();
 #elif defined CONFIG_LINUX
+    /* A forked child is not registered, fall back to the slow command.  */
+    if (membarrier_expedited &&
+        membarrier(QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0) {
+        return;
+    }
     membarrier(MEMBARRIER_CMD_SHARED, 0);
 #else
 #error --enable-membarrier is not supported on this operating system.
@@ -46,5 +65,9 @@ void smp_mb_global_init(void)
         error_report("Please upgrade your system to a newer version of Linux");
         exit(1);
     }
+    if ((ret & QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        membarrier(QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        membarrier_expedited = true;
+    }
 #endif
 }
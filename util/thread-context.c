@@ -0,0 +1,295 @@
+/*
+ * Placement of QEMU's own threads on host CPUs
+ *
+ * Copyright (c) 2021 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread-context.h"
+#include "qapi/error.h"
+#include "qapi/qapi-builtin-visit.h"
+#include "qapi/qapi-visit-qom.h"
+#include "qapi/visitor.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/module.h"
+#include "qom/object_interfaces.h"
+
+#ifdef CONFIG_NUMA
+#include <numa.h>
+#endif
+
+OBJECT_DECLARE_SIMPLE_TYPE(ThreadContext, THREAD_CONTEXT)
+
+struct ThreadContext {
+    Object parent;
+
+    uint16List *cpu_affinity;
+    uint16List *node_affinity;
+    ThreadGroupList *threads;
+    bool complete;
+    bool warned;
+
+    /* Set once complete */
+    unsigned long *host_cpus;
+    unsigned long nbits;
+};
+
+/* Protects thread_contexts and the warned flags */
+static QemuMutex thread_context_lock;
+/* The context that places each group of threads, if any */
+static ThreadContext *thread_contexts[THREAD_GROUP__MAX];
+
+static unsigned long *thread_context_node_cpus(uint16List *nodes,
+                                               unsigned long *nbits,
+                                               Error **errp)
+{
+#ifdef CONFIG_NUMA
+    unsigned long *host_cpus;
+    struct bitmask *node_cpus;
+    long cpu;
+
+    if (numa_available() < 0) {
+        error_setg(errp, "NUMA is not available on this host");
+        return NULL;
+    }
+
+    *nbits = numa_num_possible_cpus();
+    host_cpus = bitmap_new(*nbits);
+    node_cpus = numa_allocate_cpumask();
+    for (; nodes; nodes = nodes->next) {
+        if (nodes->value > numa_max_node() ||
+            numa_node_to_cpus(nodes->value, node_cpus)) {
+            error_setg(errp, "Host NUMA node %" PRIu16 " does not exist",
+                       nodes->value);
+            numa_free_cpumask(node_cpus);
+            g_free(host_cpus);
+            return NULL;
+        }
+        for (cpu = 0; cpu < *nbits; cpu++) {
+            if (numa_bitmask_isbitset(node_cpus, cpu)) {
+                set_bit(cpu, host_cpus);
+            }
+        }
+    }
+    numa_free_cpumask(node_cpus);
+
+    if (bitmap_empty(host_cpus, *nbits)) {
+        error_setg(errp, "The host NUMA nodes have no CPUs");
+        g_free(host_cpus);
+        return NULL;
+    }
+    return host_cpus;
+#else
+    error_setg(errp, "NUMA node affinity is not supported by this build "
+               "of QEMU");
+    return NULL;
+#endif
+}
+
+static unsigned long *thread_context_host_cpus(ThreadContext *tc,
+                                               unsigned long *nbits,
+                                               Error **errp)
+{
+    unsigned long *host_cpus;
+    uint16List *l;
+
+    if (!tc->cpu_affinity == !tc->node_affinity) {
+        error_setg(errp, "Exactly one of 'cpu-affinity' and 'node-affinity' "
+                   "must be set");
+        return NULL;
+    }
+    if (tc->node_affinity) {
+        return thread_context_node_cpus(tc->node_affinity, nbits, errp);
+    }
+
+    *nbits = 0;
+    for (l = tc->cpu_affinity; l; l = l->next) {
+        *nbits = MAX(*nbits, l->value + 1);
+    }
+    host_cpus = bitmap_new(*nbits);
+    for (l = tc->cpu_affinity; l; l = l->next) {
+        set_bit(l->value, host_cpus);
+    }
+    return host_cpus;
+}
+
+static void thread_context_complete(UserCreatable *uc, Error **errp)
+{
+    ThreadContext *tc = THREAD_CONTEXT(uc);
+    ThreadGroupList *l;
+
+    if (!tc->threads) {
+        error_setg(errp, "Property 'threads' must be set");
+        return;
+    }
+    tc->host_cpus = thread_context_host_cpus(tc, &tc->nbits, errp);
+    if (!tc->host_cpus) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&thread_context_lock);
+    for (l = tc->threads; l; l = l->next) {
+        ThreadContext *other = thread_contexts[l->value];
+
+        if (other && other != tc) {
+            error_setg(errp, "The %s threads are already placed by "
+                       "thread-context '%s'", ThreadGroup_str(l->value),
+                       object_get_canonical_path_component(OBJECT(other)));
+            return;
+        }
+    }
+    for (l = tc->threads; l; l = l->next) {
+        thread_contexts[l->value] = tc;
+    }
+    tc->complete = true;
+}
+
+static void thread_context_get_affinity(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    uint16List **list = (void *)obj + (ptrdiff_t)opaque;
+
+    visit_type_uint16List(v, name, list, errp);
+}
+
+static void thread_context_set_affinity(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    ThreadContext *tc = THREAD_CONTEXT(obj);
+    uint16List **list = (void *)obj + (ptrdiff_t)opaque;
+    uint16List *value;
+
+    if (tc->complete) {
+        error_setg(errp, "Property '%s' can't be changed once the "
+                   "thread-context is created", name);
+        return;
+    }
+    if (!visit_type_uint16List(v, name, &value, errp)) {
+        return;
+    }
+    qapi_free_uint16List(*list);
+    *list = value;
+}
+
+static void thread_context_get_threads(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    ThreadContext *tc = THREAD_CONTEXT(obj);
+
+    visit_type_ThreadGroupList(v, name, &tc->threads, errp);
+}
+
+static void thread_context_set_threads(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    ThreadContext *tc = THREAD_CONTEXT(obj);
+    ThreadGroupList *value;
+
+    if (tc->complete) {
+        error_setg(errp, "Property '%s' can't be changed once the "
+                   "thread-context is created", name);
+        return;
+    }
+    if (!visit_type_ThreadGroupList(v, name, &value, errp)) {
+        return;
+    }
+    qapi_free_ThreadGroupList(tc->threads);
+    tc->threads = value;
+}
+
+static void thread_context_instance_finalize(Object *obj)
+{
+    ThreadContext *tc = THREAD_CONTEXT(obj);
+    int i;
+
+    WITH_QEMU_LOCK_GUARD(&thread_context_lock) {
+        for (i = 0; i < THREAD_GROUP__MAX; i++) {
+            if (thread_contexts[i] == tc) {
+                thread_contexts[i] = NULL;
+            }
+        }
+    }
+    g_free(tc->host_cpus);
+    qapi_free_uint16List(tc->cpu_affinity);
+    qapi_free_uint16List(tc->node_affinity);
+    qapi_free_ThreadGroupList(tc->threads);
+}
+
+static void thread_context_class_init(ObjectClass *klass, void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+
+    ucc->complete = thread_context_complete;
+
+    object_class_property_add(klass, "cpu-affinity", "uint16List",
+                              thread_context_get_affinity,
+                              thread_context_set_affinity, NULL,
+                              (void *)offsetof(ThreadContext, cpu_affinity));
+    object_class_property_add(klass, "node-affinity", "uint16List",
+                              thread_context_get_affinity,
+                              thread_context_set_affinity, NULL,
+                              (void *)offsetof(ThreadContext, node_affinity));
+    object_class_property_add(klass, "threads", "ThreadGroupList",
+                              thread_context_get_threads,
+                              thread_context_set_threads, NULL, NULL);
+}
+
+static const TypeInfo thread_context_info = {
+    .name = TYPE_THREAD_CONTEXT,
+    .parent = TYPE_OBJECT,
+    .class_init = thread_context_class_init,
+    .instance_size = sizeof(ThreadContext),
+    .instance_finalize = thread_context_instance_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    }
+};
+
+static void thread_context_register_types(void)
+{
+    qemu_mutex_init(&thread_context_lock);
+    type_register_static(&thread_context_info);
+}
+
+type_init(thread_context_register_types)
+
+void thread_context_create_thread(ThreadGroup group, QemuThread *thread,
+                                  const char *name,
+                                  void *(*start_routine)(void *),
+                                  void *arg)
+{
+    ThreadContext *tc;
+    int ret;
+
+    /* Joinable, so that @thread stays valid even if it is done already */
+    qemu_thread_create(thread, name, start_routine, arg,
+                       QEMU_THREAD_JOINABLE);
+
+    /*
+     * Holding the lock keeps the context alive, a thread-context can be
+     * deleted while a migration thread creates the multifd threads.
+     */
+    QEMU_LOCK_GUARD(&thread_context_lock);
+    tc = thread_contexts[group];
+    if (!tc) {
+        return;
+    }
+    ret = qemu_thread_set_affinity(thread, tc->host_cpus, tc->nbits);
+    if (ret < 0) {
+        warn_report_once_cond(&tc->warned,
+                              "Can't place thread '%s' on the host CPUs of "
+                              "thread-context '%s': %s", name,
+                              object_get_canonical_path_component(OBJECT(tc)),
+                              strerror(-ret));
+    }
+}
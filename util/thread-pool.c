@@ -23,8 +23,18 @@
 #include "qemu/main-loop.h"
 
 static void do_spawn_thread(ThreadPool *pool);
+static void spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolQueue ThreadPoolQueue;
+
+/*
+ * Requests are spread over this many queues, each with its own lock, so
+ * that submitting a request and picking it up do not serialize on one
+ * lock.  Each worker has a home queue and steals from the others when
+ * it is empty.
+ */
+#define THREAD_POOL_QUEUES 16
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -35,23 +45,32 @@ enum ThreadState {
 struct ThreadPoolElement {
     BlockAIOCB common;
     ThreadPool *pool;
+    ThreadPoolQueue *queue;
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by queue->lock.
+     * After that, only the worker thread can write to it.  ret and state
+     * are written before the element is put on the completed list.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by queue->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Lock-free list of the elements that the BH has to complete.  */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+struct ThreadPoolQueue {
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
@@ -60,25 +79,75 @@ struct ThreadPool {
     QemuSemaphore sem;
     int max_threads;
     QEMUBH *new_thread_bh;
+    ThreadPoolQueue queues[THREAD_POOL_QUEUES];
+
+    /* Requests that are in a queue, updated atomically.  */
+    int nr_queued;
+
+    /* Elements that finished or were cancelled, pushed atomically.  */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) completing;
+    int next_queue;
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    /* The following variables are protected by lock.  cur_threads and
+     * idle_threads are also read atomically when submitting.
+     */
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
+    int next_home;
     bool stopping;
 };
 
+/*
+ * Pick up a request, from the home queue if possible.  The caller got
+ * a token from the semaphore, so one is queued somewhere even if
+ * another worker takes it first from under our nose.
+ */
+static ThreadPoolElement *thread_pool_dequeue(ThreadPool *pool, int home)
+{
+    ThreadPoolElement *req;
+    int i = home;
+
+    for (;;) {
+        ThreadPoolQueue *q = &pool->queues[i];
+
+        if (qatomic_read(&QTAILQ_FIRST(&q->request_list))) {
+            qemu_mutex_lock(&q->lock);
+            req = QTAILQ_FIRST(&q->request_list);
+            if (req) {
+                QTAILQ_REMOVE(&q->request_list, req, reqs);
+                req->state = THREAD_ACTIVE;
+                qatomic_dec(&pool->nr_queued);
+                qemu_mutex_unlock(&q->lock);
+                return req;
+            }
+            qemu_mutex_unlock(&q->lock);
+        }
+        i = (i + 1) % THREAD_POOL_QUEUES;
+    }
+}
+
+static void thread_pool_complete_elem(ThreadPool *pool,
+                                      ThreadPoolElement *elem)
+{
+    /* The cmpxchg orders ret and state before the BH sees elem.  */
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->done_list, elem, done);
+    qemu_bh_schedule(pool->completion_bh);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    int home;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
+    home = pool->next_home++ % THREAD_POOL_QUEUES;
     do_spawn_thread(pool);
 
     while (!pool->stopping) {
@@ -86,34 +155,40 @@ static void *worker_thread(void *opaque)
         int ret;
 
         do {
-            pool->idle_threads++;
+            qatomic_set(&pool->idle_threads, pool->idle_threads + 1);
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+            qatomic_set(&pool->idle_threads, pool->idle_threads - 1);
+            /* Pairs with qatomic_inc() in thread_pool_submit_aio().  */
+            smp_mb();
+        } while (ret == -1 && qatomic_read(&pool->nr_queued) > 0);
         if (ret == -1 || pool->stopping) {
             break;
         }
-
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
         qemu_mutex_unlock(&pool->lock);
 
+        req = thread_pool_dequeue(pool, home);
         ret = req->func(req->arg);
 
         req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
         req->state = THREAD_DONE;
+        thread_pool_complete_elem(pool, req);
 
         qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
     }
 
-    pool->cur_threads--;
+    qatomic_set(&pool->cur_threads, pool->cur_threads - 1);
+
+    /*
+     * The submitter does not take the lock when it sees no room for a
+     * new thread.  If it queued a request while we were leaving, make
+     * sure that somebody picks it up.
+     */
+    smp_mb();
+    if (!pool->stopping && qatomic_read(&pool->nr_queued) > 0) {
+        spawn_thread(pool);
+    }
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
     return NULL;
@@ -145,7 +220,7 @@ static void spawn_thread_bh_fn(void *opaque)
 
 static void spawn_thread(ThreadPool *pool)
 {
-    pool->cur_threads++;
+    qatomic_set(&pool->cur_threads, pool->cur_threads + 1);
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
@@ -162,23 +237,30 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
     aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    for (;;) {
+        /*
+         * Take all the finished elements at once, instead of scanning
+         * every pending one.  The batch lives in the pool, not on the
+         * stack, so that a nested invocation from a callback that calls
+         * aio_poll() carries on with it.
+         */
+        if (QSLIST_EMPTY(&pool->completing)) {
+            if (QSLIST_EMPTY(&pool->done_list)) {
+                break;
+            }
+            QSLIST_MOVE_ATOMIC(&pool->completing, &pool->done_list);
         }
+        elem = QSLIST_FIRST(&pool->completing);
+        QSLIST_REMOVE_HEAD(&pool->completing, done);
 
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
 
         if (elem->common.cb) {
-            /* Read state before ret.  */
-            smp_rmb();
-
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
              */
@@ -189,16 +271,12 @@ restart:
             aio_context_acquire(pool->ctx);
 
             /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
+             * else having scheduled it meanwhile because we look at the
+             * lists again anyway.
              */
             qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
@@ -207,10 +285,11 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolQueue *q = elem->queue;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    QEMU_LOCK_GUARD(&pool->lock);
+    QEMU_LOCK_GUARD(&q->lock);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
@@ -218,11 +297,12 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          * the lock taken and ensure that elem will remain THREAD_QUEUED.
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+        QTAILQ_REMOVE(&q->request_list, elem, reqs);
+        qatomic_dec(&pool->nr_queued);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_complete_elem(pool, elem);
     }
 
 }
@@ -245,6 +325,8 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolQueue *q;
+    int nr_queues;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
@@ -256,12 +338,33 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    /* Only use the home queues of the threads that exist.  */
+    nr_queues = MIN(MAX(qatomic_read(&pool->cur_threads), 1),
+                    THREAD_POOL_QUEUES);
+    q = &pool->queues[pool->next_queue % nr_queues];
+    pool->next_queue = (pool->next_queue + 1) % THREAD_POOL_QUEUES;
+    req->queue = q;
+
+    /*
+     * Count the request before looking at the threads, and pair with
+     * the barriers in worker_thread(): either an idle thread that is
+     * timing out sees the request, or we see that it is gone.  The
+     * pool lock is only needed when a thread must be started.
+     */
+    qatomic_inc(&pool->nr_queued);
+    if (qatomic_read(&pool->idle_threads) == 0 &&
+        qatomic_read(&pool->cur_threads) < pool->max_threads) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->idle_threads == 0 &&
+            pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
+
+    qemu_mutex_lock(&q->lock);
+    QTAILQ_INSERT_TAIL(&q->request_list, req, reqs);
+    qemu_mutex_unlock(&q->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
 }
@@ -296,6 +399,8 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -310,7 +415,12 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QSLIST_INIT(&pool->done_list);
+    QSLIST_INIT(&pool->completing);
+    for (i = 0; i < THREAD_POOL_QUEUES; i++) {
+        qemu_mutex_init(&pool->queues[i].lock);
+        QTAILQ_INIT(&pool->queues[i].request_list);
+    }
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -322,6 +432,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -332,7 +444,7 @@ void thread_pool_free(ThreadPool *pool)
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
+    qatomic_set(&pool->cur_threads, pool->cur_threads - pool->new_threads);
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
@@ -345,6 +457,9 @@ void thread_pool_free(ThreadPool *pool)
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
+    for (i = 0; i < THREAD_POOL_QUEUES; i++) {
+        qemu_mutex_destroy(&pool->queues[i].lock);
+    }
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
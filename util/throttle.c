@@ -484,6 +484,30 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+/* do the accounting for up to @max more operations of the same type and
+ * size in advance, as long as none of them would have to wait.  Call it
+ * right after throttle_schedule_timer() returned false.
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the size of each operation
+ * @max:      the maximum number of operations to account
+ * @ret:      the number of operations that were accounted
+ */
+unsigned throttle_account_ahead(ThrottleState *ts, bool is_write,
+                                uint64_t size, unsigned max)
+{
+    unsigned n;
+
+    for (n = 0; n < max; n++) {
+        if (throttle_compute_wait_for(ts, is_write)) {
+            break;
+        }
+        throttle_account(ts, is_write, size);
+    }
+
+    return n;
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from